@@ -2,6 +2,7 @@
 
 @class PhotoGallery;
 @class PhotoGalleryViewController;
+@class PhotoGalleryCoordinator;
 
 @interface AppDelegate : NSObject
 {
@@ -11,6 +12,7 @@
     NSString *                      _galleryURLString;
     PhotoGallery *                  _photoGallery;
     PhotoGalleryViewController *    _photoGalleryViewController;
+    PhotoGalleryCoordinator *       _kioskCoordinator;
 }
 
 @property (nonatomic, retain) IBOutlet UIWindow *               window;
@@ -1,9 +1,14 @@
 #import "AppDelegate.h"
 #import "PhotoGallery.h"
 #import "PhotoGalleryViewController.h"
+#import "PhotoGalleryCoordinator.h"
 #import "SetupViewController.h"
 #import "NetworkManager.h"
+#import "QFaultSimulator.h"
+#import "PhotoMetadataBenchmarkOperation.h"
+#import "GalleryParseBenchmarkOperation.h"
 #import "Logging.h"
+#import "QTrace.h"
 
 
 @interface AppDelegate () <SetupViewControllerDelegate>
@@ -11,8 +16,10 @@
 @property (nonatomic, copy,   readwrite) NSString *                     galleryURLString;
 @property (nonatomic, retain, readwrite) PhotoGallery *                 photoGallery;
 @property (nonatomic, retain, readwrite) PhotoGalleryViewController *   photoGalleryViewController;
+@property (nonatomic, retain, readwrite) PhotoGalleryCoordinator *      kioskCoordinator;
 // forward declarations
 - (void)presentSetupViewControllerAnimated:(BOOL)animated;
+- (NSArray *)galleryURLStringsToOpen;
 @end
 
 
@@ -82,10 +89,78 @@
 @synthesize galleryURLString           = _galleryURLString;
 @synthesize photoGallery               = _photoGallery;    //代表一组照片的 photogallery 对象.
 @synthesize photoGalleryViewController = _photoGalleryViewController;
+@synthesize kioskCoordinator           = _kioskCoordinator;   //在后台同步的其他 gallery
 
 #define GALLERY_URL_STRING_KEY @"galleryURLString"
 #define APPLICATON_CLEAR_SETUP @"applicationClearSetup"
+#define KIOSK_GALLERY_URL_STRINGS_KEY @"kioskGalleryURLStrings"
+#define KIOSK_GALLERY_SYNC_INTERVAL_KEY @"kioskGallerySyncInterval"
 
+// The gallery on screen gets this much more of the network and the CPU than each of the 
+// kiosk galleries syncing in the background.
+
+static const double kForegroundGalleryWeight = 2.0;
+
+// Kiosk galleries sync this often, unless the kioskGallerySyncInterval user default says otherwise.
+
+static const NSTimeInterval kKioskGallerySyncInterval = 15.0 * 60.0;
+
+
+#if ! defined(NDEBUG)
+
+// Returns the URL string of copy galleryIndex of the gallery for the galleryBenchmarkCount 
+// option.  A different query string gives each copy its own gallery cache.
+
+static NSString * BenchmarkGalleryURLString(NSString * galleryURLString, NSUInteger galleryIndex)
+{
+    NSString *  separator;
+    
+    separator = ([galleryURLString rangeOfString:@"?"].location == NSNotFound) ? @"?" : @"&";
+    return [NSString stringWithFormat:@"%@%@kiosk=%zu", galleryURLString, separator, (size_t) galleryIndex];
+}
+
+#endif
+
+// Returns the URL strings of the galleries that -applicationDidFinishLaunching: is going 
+// to open, as configured in the user defaults: the gallery on screen and either the kiosk 
+// galleries or, in the debug build, the galleryBenchmarkCount copies of the gallery.
+- (NSArray *)galleryURLStringsToOpen
+{
+    NSUserDefaults *    userDefaults;
+    NSMutableArray *    result;
+    NSString *          galleryURLString;
+    NSUInteger          benchmarkCount;
+    
+    userDefaults = [NSUserDefaults standardUserDefaults];
+    result = [NSMutableArray array];
+    assert(result != nil);
+    
+    galleryURLString = [userDefaults stringForKey:GALLERY_URL_STRING_KEY];
+    if ( (galleryURLString != nil) && ([NSURL URLWithString:galleryURLString] == nil) ) {
+        galleryURLString = nil;
+    }
+    if (galleryURLString != nil) {
+        [result addObject:galleryURLString];
+    }
+    
+    benchmarkCount = 0;
+    #if ! defined(NDEBUG)
+        if (galleryURLString != nil) {
+            benchmarkCount = (NSUInteger) [userDefaults integerForKey:@"galleryBenchmarkCount"];
+        }
+        for (NSUInteger galleryIndex = 0; galleryIndex < benchmarkCount; galleryIndex++) {
+            [result addObject:BenchmarkGalleryURLString(galleryURLString, galleryIndex)];
+        }
+    #endif
+    if (benchmarkCount == 0) {
+        for (NSString * kioskGalleryURLString in [userDefaults arrayForKey:KIOSK_GALLERY_URL_STRINGS_KEY]) {
+            if ( [kioskGalleryURLString isKindOfClass:[NSString class]] && ([NSURL URLWithString:kioskGalleryURLString] != nil) ) {
+                [result addObject:kioskGalleryURLString];
+            }
+        }
+    }
+    return result;
+}
 
 #pragma mark - UIApplicationDelegate
 
@@ -97,10 +172,15 @@
     
     [[QLog log] logWithFormat:@"application start"];
     
-    // Tell the PhotoGallery class about application startup, which gives it the 
-    // opportunity to do some on-disk garbage collection.
-    [PhotoGallery applicationStartup];
-
+    // In the debug build, if the "traceRecording" user default is set, record a timeline 
+    // of our operations, which gets written to the Caches directory when we go into the 
+    // background.
+    #if ! defined(NDEBUG)
+        if ( [[NSUserDefaults standardUserDefaults] boolForKey:@"traceRecording"] ) {
+            [[QTrace trace] start];
+        }
+    #endif
+    
     // Add an observer to the network manager's networkInUse property so that we can  
     // update the application's networkActivityIndicatorVisible property(控制这状态来的网络加载指示器的显示与否).
     // This has the side effect of starting up the NetworkManager singleton.
@@ -116,6 +196,11 @@
         [SetupViewController resetChoices];
     }
 
+    // Tell the PhotoGallery class about application startup, which gives it the 
+    // opportunity to do some on-disk garbage collection.  It mustn't delete the caches 
+    // of the galleries we're about to open.
+    [PhotoGallery applicationStartupKeepingGalleryURLStrings:[self galleryURLStringsToOpen]];
+
     // Get the current gallery URL and, if it's not nil, create a gallery object for it.
     // 从首选项里获取当前 gallery 的 url.
     self.galleryURLString = [userDefaults stringForKey:GALLERY_URL_STRING_KEY];
@@ -129,10 +214,112 @@
         // self.photoGallery 代表了从网络获取galleryURLString所指的 xml 后,分析数据得到的一组照片信息.
         self.photoGallery = [[[PhotoGallery alloc] initWithGalleryURLString:self.galleryURLString] autorelease];
         assert(self.photoGallery != nil);
+        self.photoGallery.syncWeight = kForegroundGalleryWeight;
         
         [self.photoGallery start];
     }
     
+    // If the "kioskGalleryURLStrings" user default is set (you can set it with a launch 
+    // argument), keep those galleries up to date in the background too.  In the debug build, 
+    // the "galleryBenchmarkCount" user default instead runs that many copies of the current 
+    // gallery side by side, each with its own gallery cache, and logs how they get on.
+    // 在后台同时同步多个 gallery.
+    
+    NSArray *   kioskGalleryURLStrings;
+    NSUInteger  benchmarkCount;
+    
+    kioskGalleryURLStrings = [userDefaults arrayForKey:KIOSK_GALLERY_URL_STRINGS_KEY];
+    benchmarkCount = 0;
+    #if ! defined(NDEBUG)
+        if (self.galleryURLString != nil) {
+            benchmarkCount = (NSUInteger) [userDefaults integerForKey:@"galleryBenchmarkCount"];
+        }
+    #endif
+    if ( ([kioskGalleryURLStrings count] != 0) || (benchmarkCount != 0) ) {
+        NSTimeInterval  syncInterval;
+        
+        self.kioskCoordinator = [[[PhotoGalleryCoordinator alloc] init] autorelease];
+        assert(self.kioskCoordinator != nil);
+        
+        syncInterval = [userDefaults doubleForKey:KIOSK_GALLERY_SYNC_INTERVAL_KEY];
+        self.kioskCoordinator.syncInterval = (syncInterval > 0.0) ? syncInterval : kKioskGallerySyncInterval;
+        
+        if (benchmarkCount == 0) {
+            for (NSString * kioskGalleryURLString in kioskGalleryURLStrings) {
+                if ( [kioskGalleryURLString isKindOfClass:[NSString class]] && ([NSURL URLWithString:kioskGalleryURLString] != nil) ) {
+                    (void) [self.kioskCoordinator addGalleryWithURLString:kioskGalleryURLString weight:1.0];
+                }
+            }
+            [self.kioskCoordinator start];
+        }
+        #if ! defined(NDEBUG)
+            else {
+                NSUInteger  galleryIndex;
+                
+                // A different query string gives each copy its own gallery cache, but 
+                // the photo paths are relative, so they all share the same thumbnails.
+                
+                for (galleryIndex = 0; galleryIndex < benchmarkCount; galleryIndex++) {
+                    (void) [self.kioskCoordinator addGalleryWithURLString:BenchmarkGalleryURLString(self.galleryURLString, galleryIndex) weight:1.0];
+                }
+                [self.kioskCoordinator startBenchmark];
+            }
+        #endif
+    }
+    
+    #if ! defined(NDEBUG)
+        // If the "faultSimulatorLoadTest" user default is set, hammer the gallery URL with 
+        // retrying operations and log how they fare.  The operation count and duration come 
+        // from the loadTestOperationCount and loadTestDuration keys of faultSimulatorConfig.
+        
+        if ( [userDefaults boolForKey:@"faultSimulatorLoadTest"] && (self.galleryURLString != nil) ) {
+            NSDictionary *  config;
+            NSUInteger      operationCount;
+            NSTimeInterval  duration;
+            
+            config = [userDefaults dictionaryForKey:@"faultSimulatorConfig"];
+            operationCount = [[config objectForKey:@"loadTestOperationCount"] unsignedIntegerValue];
+            if (operationCount == 0) {
+                operationCount = 10000;
+            }
+            duration = [[config objectForKey:@"loadTestDuration"] doubleValue];
+            if (duration <= 0.0) {
+                duration = 300.0;
+            }
+            [[QFaultSimulator sharedSimulator] startLoadTestWithURL:[NSURL URLWithString:self.galleryURLString] operationCount:operationCount duration:duration];
+        }
+        
+        // If the "galleryMetadataBenchmarkRows" user default is set, compare Core Data with 
+        // the columnar metadata store for that many photos.  The operation logs the results.
+        
+        if ( [userDefaults integerForKey:@"galleryMetadataBenchmarkRows"] > 0 ) {
+            PhotoMetadataBenchmarkOperation *   op;
+            
+            op = [[[PhotoMetadataBenchmarkOperation alloc] initWithRowCount:(NSUInteger) [userDefaults integerForKey:@"galleryMetadataBenchmarkRows"] 
+                                                              directoryPath:[NSTemporaryDirectory() stringByAppendingPathComponent:@"MetadataBenchmark"]] autorelease];
+            assert(op != nil);
+            [[NetworkManager sharedManager] addCPUOperation:op finishedTarget:self action:@selector(metadataBenchmarkDone:)];
+        }
+        
+        // If the "galleryParseBenchmarkPhotos" user default is set, time the serial and 
+        // chunked parses of a synthetic index of that many photos, up to a concurrency of 
+        // "galleryParseBenchmarkConcurrency" (default 4).  The operation logs the results.
+        
+        if ( [userDefaults integerForKey:@"galleryParseBenchmarkPhotos"] > 0 ) {
+            GalleryParseBenchmarkOperation *    op;
+            NSInteger                           maximumConcurrency;
+            
+            maximumConcurrency = [userDefaults integerForKey:@"galleryParseBenchmarkConcurrency"];
+            if (maximumConcurrency < 2) {
+                maximumConcurrency = 4;
+            }
+            op = [[[GalleryParseBenchmarkOperation alloc] initWithPhotoCount:(NSUInteger) [userDefaults integerForKey:@"galleryParseBenchmarkPhotos"] 
+                                                           maximumConcurrency:(NSUInteger) maximumConcurrency] autorelease];
+            assert(op != nil);
+            [[NetworkManager sharedManager] addCPUOperation:op finishedTarget:self action:@selector(parseBenchmarkDone:)];
+        }
+    #endif
+    
     // Set up the main view to display the gallery (if any).  We add our Setup button to the 
     // view controller's navigation items, which seems like a bit of a layer break but it 
     // makes some sort of sense because we want the actions directed to us.
@@ -169,7 +356,22 @@
     if (self.photoGallery != nil) {
         [self.photoGallery save];
     }
+    [self.kioskCoordinator save];
     [[NSUserDefaults standardUserDefaults] synchronize];
+    if (QTraceIsRecording()) {
+        (void) [[QTrace trace] stop];
+    }
+}
+
+- (void)applicationWillEnterForeground:(UIApplication *)application
+    // In the debug build, start a new trace for the new stint in the foreground.
+{
+    #pragma unused(application)
+    #if ! defined(NDEBUG)
+        if ( [[NSUserDefaults standardUserDefaults] boolForKey:@"traceRecording"] ) {
+            [[QTrace trace] start];
+        }
+    #endif
 }
 
 - (void)applicationWillTerminate:(UIApplication *)application
@@ -181,12 +383,42 @@
     if (self.photoGallery != nil) {
         [self.photoGallery stop];
     }
+    [self.kioskCoordinator stop];
     [[NSUserDefaults standardUserDefaults] synchronize];
+    if (QTraceIsRecording()) {
+        (void) [[QTrace trace] stop];
+    }
 }
 
 
 #pragma mark - Custom methods
 
+#if ! defined(NDEBUG)
+
+- (void)metadataBenchmarkDone:(PhotoMetadataBenchmarkOperation *)op
+    // Called when the metadata benchmark is done.  The operation has already logged 
+    // the results, so there's nothing more to do than note any error.
+{
+    assert([NSThread isMainThread]);
+    assert([op isKindOfClass:[PhotoMetadataBenchmarkOperation class]]);
+    if (op.error != nil) {
+        [[QLog log] logWithFormat:@"metadata benchmark failed %@", op.error];
+    }
+}
+
+- (void)parseBenchmarkDone:(GalleryParseBenchmarkOperation *)op
+    // Called when the parse benchmark is done.  The operation has already logged 
+    // the results, so there's nothing more to do than note any failure.
+{
+    assert([NSThread isMainThread]);
+    assert([op isKindOfClass:[GalleryParseBenchmarkOperation class]]);
+    if (op.error != nil) {
+        [[QLog log] logWithFormat:@"parse benchmark failed %@", op.error];
+    }
+}
+
+#endif
+
 - (IBAction)setupAction:(id)sender
     // Called when the user taps the Setup button.  It just calls through 
     // to -presentSetupViewControllerAnimated:.
@@ -237,6 +469,7 @@
         // Create a new gallery for the specified URL.
         self.photoGallery = [[[PhotoGallery alloc] initWithGalleryURLString:self.galleryURLString] autorelease];
         assert(self.photoGallery != nil);
+        self.photoGallery.syncWeight = kForegroundGalleryWeight;
         
         [self.photoGallery start];
         
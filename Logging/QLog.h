@@ -1,10 +1,11 @@
 #import <Foundation/Foundation.h>
 
+@class QLogWriter;
+
 @interface QLog : NSObject
 {
     BOOL                _enabled;                                               // main thread write, any thread read
-    int                 _logFile;                                               // main thread write, any thread read
-    off_t               _logFileLength;                                         // main thread only, only valid if _logFile != -1
+    QLogWriter *        _writer;                                                // main thread write, any thread read, protected by @synchronize (self)
     BOOL                _loggingToStdErr;                                       // main thread write, any thread read
     NSUInteger          _optionsMask;                                           // main thread write, any thread read
     BOOL                _showViewer;                                            // main thread only
@@ -16,8 +17,9 @@
     // Returns the singleton logging object.
     
 - (void)flush;                                                                  // main thread only
-    // Flushes any pending log entries to the logEntries array and also, if 
-    // appropriate, to the log file or stderr.
+    // Flushes any pending log entries to the logEntries array.  Entries go to 
+    // stderr as they're logged, and to the log file via a background writer 
+    // thread, so neither waits for this.
     
 - (void)clear;                                                                  // main thread only
     // Empties the logEntries array and, if appropriate, the log file.  Not 
@@ -38,6 +40,7 @@
 // qlogLoggingToFile    loggingToFile
 // qlogLoggingToStdErr  loggingToStdErr
 // qlogOption0..31      optionsMask
+// qlogFileSyncPolicy   -- see QLogWriterSyncPolicy
 
 // Log entry generation
 
@@ -63,11 +66,18 @@
 
 // In file log entries
 
+// The log file is really a set of size capped segments in Caches/QLog, written by 
+// a QLogWriter.  Old segments are deleted as new ones are started, so the file 
+// log only holds the most recent entries.
+
 - (NSInputStream *)streamForLogValidToLength:(off_t *)lengthPtr;                // main thread only
     // Returns an un-opened stream.  If lengthPtr is not NULL then, on return 
     // *lengthPtr contains the number of bytes in that stream that are 
     // guaranteed to be valid.
     //
+    // If we're logging to a file, the stream reads the segments directly, after 
+    // waiting for the writer to catch up with everything logged so far.
+    //
     // This can only be called on the main thread but the resulting stream 
     // can be passed to any thread for processing.
     
@@ -1,8 +1,7 @@
 #import "QLog.h"
+#import "QLogWriter.h"
 
 #include <stdarg.h>
-#include <fcntl.h>
-#include <sys/stat.h>
 #include <unistd.h>
 #include <xlocale.h>
 #include <time.h>
@@ -19,12 +18,25 @@
     #define QLOG_ADD_SEQUENCE_NUMBERS 0
 #endif
 
+// The file log is kept to kLogSegmentCount segments of kLogSegmentSize bytes; see QLogWriter.
+
+#if TARGET_OS_EMBEDDED || TARGET_IPHONE_SIMULATOR
+    static const off_t      kLogSegmentSize  = 256 * 1024;
+#else
+    static const off_t      kLogSegmentSize  = 1024 * 1024;
+#endif
+static const NSUInteger     kLogSegmentCount = 4;
+
+// The in-memory log holds this many entries.
+
+static const NSUInteger     kLogEntriesInMemory = 100;
+
 #pragma mark - private properties
 @interface QLog ()
 
 // private properties
 
-@property (copy, readonly) NSString * pathToLogFile;
+@property (copy, readonly) NSString * pathToLogDirectory;
 
 // forward declarations
 
@@ -64,8 +76,6 @@
         assert(self->_pendingEntries != nil);
         
         self->_enabled = NO;
-        self->_logFile = -1;
-        self->_logFileLength = -1;
 
         [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(preferencesChanged:) name:NSUserDefaultsDidChangeNotification object:nil];
         [self setupFromPreferences];
@@ -81,18 +91,18 @@
     [super dealloc];
 }
 
-- (NSString *)pathToLogFile
-    // Returns the path to the log file.  Because iOS doesn't support a Logs directory, 
-    // we put the log file into the Caches directory.  That's a reasonable place for it. 
-    // We don't want the OS deleting it willynilly (like it might for the temporary directory), 
-    // but neither do we want it being backed up.
+- (NSString *)pathToLogDirectory
+    // Returns the path to the directory holding the log file segments.  Because iOS doesn't 
+    // support a Logs directory, we put the log into the Caches directory.  That's a reasonable 
+    // place for it.  We don't want the OS deleting it willynilly (like it might for the temporary 
+    // directory), but neither do we want it being backed up.
 {
-    NSString *  logDirPath;
+    NSString *  cachesDirPath;
     
-    logDirPath = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) objectAtIndex:0];
-    assert(logDirPath != nil);
+    cachesDirPath = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) objectAtIndex:0];
+    assert(cachesDirPath != nil);
     
-    return [logDirPath stringByAppendingPathComponent:@"QLog.log"];
+    return [cachesDirPath stringByAppendingPathComponent:@"QLog"];
 }
 
 - (void)setupFromPreferences
@@ -101,8 +111,6 @@
     NSUserDefaults *    userDefaults;
     BOOL                shouldBeEnabled;
     BOOL                shouldLogToFile;
-    int                 junk;
-    struct stat         sb;
     NSUInteger          newOptionsMask;
 
     // This is always called either on the main thread or before initialisation is 
@@ -126,50 +134,39 @@
     if ( ! self->_enabled ) {
         shouldLogToFile = NO;
     }
-    if ( shouldLogToFile != (self->_logFile != -1) ) {
-        off_t       newLength;
+    if ( shouldLogToFile != (self->_writer != nil) ) {
+        QLogWriter *    writer;
 
         // shouldLogToFile is different from the current logging to file setup, 
         // so we have to change things.
 
         [self willChangeValueForKey:@"loggingToFile"];
-        newLength = self->_logFileLength;
         if (shouldLogToFile) {
         
-            // We should be logging to a file but are not.  Open the log file and 
-            // get its length from newLength.  Note that the only other code that looks 
-            // at _logFile is also running on the main thread, so we don't have to worry 
-            // about synchronisation here.
+            // We should be logging to a file but are not.  Start a writer, which picks 
+            // up any segments left over from last time.  Earlier versions logged to a 
+            // single, unbounded QLog.log file; if that's still around, get rid of it.
         
-            assert(self->_logFile == -1);
-            self->_logFile = open([self.pathToLogFile fileSystemRepresentation], O_RDWR | O_CREAT | O_APPEND, DEFFILEMODE);
-            assert(self->_logFile != -1);
+            (void) [[NSFileManager defaultManager] removeItemAtPath:[[self.pathToLogDirectory stringByDeletingLastPathComponent] stringByAppendingPathComponent:@"QLog.log"] error:NULL];
+
+            writer = [[QLogWriter alloc] initWithDirectoryPath:self.pathToLogDirectory segmentSize:kLogSegmentSize segmentCount:kLogSegmentCount];
+            assert(writer != nil);
             
-            if (self->_logFile != -1) {
-                junk = fstat(self->_logFile, &sb);
-                assert(junk == 0);
-                
-                newLength = sb.st_size;
-                assert(newLength >= 0);
+            @synchronized (self) {
+                self->_writer = writer;
             }
         } else {
         
-            // We are logging to a file and shouldn't be.  Close down the log file.
-            
-            assert(self->_logFile != -1);
-            junk = close(self->_logFile);
-            assert(junk == -1);
-            self->_logFile = -1;
+            // We are logging to a file and shouldn't be.  Detach the writer, so that no 
+            // one else can append to it, and then stop it, which writes out anything 
+            // it still has pending.
             
-            newLength = -1;
-        }
-        
-        // Update the newLength property.
-        
-        if (newLength != self->_logFileLength) {
-            [self willChangeValueForKey:@"logFileLength"];
-            self->_logFileLength = newLength;
-            [self didChangeValueForKey:@"logFileLength"];
+            @synchronized (self) {
+                writer = self->_writer;
+                self->_writer = nil;
+            }
+            [writer stop];
+            [writer release];
         }
         
         // Finally, trigger KVO observers.
@@ -177,6 +174,10 @@
         [self didChangeValueForKey:@"loggingToFile"];
     }
     
+    if (self->_writer != nil) {
+        self->_writer.syncPolicy = (QLogWriterSyncPolicy) [userDefaults integerForKey:@"qlogFileSyncPolicy"];
+    }
+    
     // loggingToStdErr property
     
     shouldBeEnabled = [userDefaults boolForKey:@"qlogLoggingToStdErr"];
@@ -226,9 +227,9 @@
     // See comment in header.
     //
     // Note that this is for public consumption only.  Internally we just look at 
-    // _logFile.
+    // _writer.
 {
-    return (self->_logFile != -1);
+    return (self->_writer != nil);
 }
 
 @synthesize loggingToStdErr = _loggingToStdErr;
@@ -280,9 +281,11 @@
         assert(newEntry != nil);
         
         // Add the log entry to the list of new entries and, if this is the first 
-        // element in the list, tell the main thread about it.
+        // element in the list, tell the main thread about it.  Also pass it to the 
+        // writer (if any), which writes it to the log file on its own thread.
         
         @synchronized (self) {
+            [self->_writer appendEntry:newEntry];
             [self->_pendingEntries addObject:newEntry];
             if ([self->_pendingEntries count] == 1) {
                 [self performSelectorOnMainThread:@selector(flush) withObject:nil waitUntilDone:NO];
@@ -359,8 +362,6 @@
 {
     NSArray *       entriesToAdd;
     NSIndexSet *    indexSet;
-    int             junk;
-    struct stat     sb;
     
     assert([NSThread isMainThread]);
     
@@ -371,6 +372,14 @@
         [self->_pendingEntries removeAllObjects];
     }
 
+    // If there's been a burst of logging, only the last kLogEntriesInMemory entries 
+    // would survive the pruning below, so don't bother adding (and telling our KVO 
+    // observers about) the rest.  They've already gone to the log file, if any.
+    
+    if ([entriesToAdd count] > kLogEntriesInMemory) {
+        entriesToAdd = [entriesToAdd subarrayWithRange:NSMakeRange([entriesToAdd count] - kLogEntriesInMemory, kLogEntriesInMemory)];
+    }
+
     // We might have no pending log entries (because of someone calling us directly, 
     // rather than the logging code calling us via -performSelectorOnMainThread:xxx), 
     // so we only do the rest of this code if we actually got some log entries.
@@ -387,76 +396,16 @@
         [self  didChange:NSKeyValueChangeInsertion valuesAtIndexes:indexSet forKey:@"logEntries"];
 
         // If we've hit the limit of the in-memory log, prune it now.  We do this after adding 
-        // the new entries so that if there are more than 100 new entries we still clip correctly.
+        // the new entries so that if there are lots of new entries we still clip correctly.
         
-        if ([self->_logEntries count] > 100) {
-            indexSet = [NSIndexSet indexSetWithIndexesInRange:NSMakeRange(0, [self->_logEntries count] - 100)];
+        if ([self->_logEntries count] > kLogEntriesInMemory) {
+            indexSet = [NSIndexSet indexSetWithIndexesInRange:NSMakeRange(0, [self->_logEntries count] - kLogEntriesInMemory)];
             assert(indexSet != nil);
 
             [self willChange:NSKeyValueChangeRemoval valuesAtIndexes:indexSet forKey:@"logEntries"];
             [self->_logEntries removeObjectsAtIndexes:indexSet];
             [self  didChange:NSKeyValueChangeRemoval valuesAtIndexes:indexSet forKey:@"logEntries"];
         }
-        
-        // If we're logging to a file, add the entries to the on-disk log.
-        
-        if (self->_logFile != -1) {
-            int                 err;
-            NSData *            dataToWrite;
-            NSUInteger          bytesToWrite;
-            NSUInteger          bytesWrittenSoFar;
-            const char *        buf;
-            
-            err = 0;
-            
-            // Flatten the array of strings into a single blob of UTF-8 data.
-            
-            dataToWrite = [self dataForLogEntries:entriesToAdd];
-            assert(dataToWrite != nil);
-        
-            // Write that data to the file.
-            
-            bytesToWrite = [dataToWrite length];
-            bytesWrittenSoFar = 0;
-            buf = [dataToWrite bytes];
-            do {
-                ssize_t     bytesWritten;
-                
-                if (bytesWrittenSoFar == bytesToWrite) {
-                    break;
-                }
-                bytesWritten = write(self->_logFile, &buf[bytesWrittenSoFar], bytesToWrite - bytesWrittenSoFar);
-                if (bytesWritten > 0) {
-                    bytesWrittenSoFar += bytesWritten;
-                } else {
-                    assert(bytesWritten != 0);
-                    err = errno;
-                    
-                    if (err == EINTR) {
-                        err = 0;
-                    } else {
-                        break;
-                    }
-                }
-            } while (YES);
-            
-            // I have no idea what to do with an error at this point.  Right now, I'm just 
-            // going to ignore it in production code.
-            
-            assert(err == 0);
-
-            // Once we've written out the entire buffer, update the log file length.  
-            // We do this at the end to ensure that the client sees only complete 
-            // log records.  Also, we get the length from the file rather than keeping 
-            // track of it ourself so that things can't possibly get too far out of 
-            // sync.
-            
-            junk = fstat(self->_logFile, &sb);
-            assert(junk == 0);
-            
-            self->_logFileLength = sb.st_size;
-            assert(self->_logFileLength >= 0);
-        }
     }
 }
 
@@ -465,16 +414,10 @@
 {
     assert([NSThread isMainThread]);
     
-    // First truncate the log file (if any).
+    // First empty the log file (if any).  This waits for the writer to delete 
+    // the segments.
     
-    if (self->_logFile != -1) {
-        int     junk;
-        
-        junk = ftruncate(self->_logFile, 0);
-        assert(junk == 0);
-        
-        self->_logFileLength = 0;
-    }
+    [self->_writer clear];
     
     // Next nix any in-memory log entries.
     
@@ -494,7 +437,6 @@
     // See comment in header.
 {
     NSInputStream * result;
-    NSString *      path;
 
     // It's important that this be called on the main thread so that it's coordinated 
     // with the the preferences re-read code that might be closing or opening the log 
@@ -502,12 +444,11 @@
     
     assert([NSThread isMainThread]);
 
-    // Flush the log to ensure that any in-memory entries are pushed to disk before 
-    // we get the log file length.
+    // Flush the log to ensure that the in-memory entries are up to date.
 
     [self flush];
 
-    if (self->_logFile == -1) {
+    if (self->_writer == nil) {
         NSData *    logData;
         
         // There is no log file.  Just return a memory-based stream containing our 
@@ -523,19 +464,10 @@
             }
         }
     } else {
-        // There is a log file, so return a file stream for that.
+        // There is a log file, so return a stream of its segments.  The writer 
+        // handles waiting for any entries it hasn't written yet.
 
-        path = self.pathToLogFile;
-        assert(path != nil);
-        
-        result = [NSInputStream inputStreamWithFileAtPath:path];
-        
-        if (result != nil) {
-            if (lengthPtr != NULL) {
-                assert(self->_logFileLength >= 0);
-                *lengthPtr = self->_logFileLength;
-            }
-        }
+        result = [self->_writer streamForLogValidToLength:lengthPtr];
     }
     
     return result;
@@ -0,0 +1,66 @@
+#import <Foundation/Foundation.h>
+
+// QLogWriter is the part of QLog that writes log entries to disk.  It runs its own
+// thread, so whoever logs an entry just adds it to a list and carries on; the writer
+// thread takes everything that's accumulated in one go, flattens it to UTF-8 and writes
+// it with a single write call.
+//
+// The log is kept as a set of segment files (QLog-<n>.log, n increasing) in one directory.
+// Once the current segment reaches segmentSize the writer starts a new one, and once there
+// are more than segmentCount it deletes the oldest, so the log never takes up more than
+// about segmentSize * segmentCount bytes.
+//
+// 日志写到独立的线程, 分段文件循环使用, 总大小有上限.
+
+enum QLogWriterSyncPolicy {
+    kQLogWriterSyncNever      = 0,      // leave it to the kernel
+    kQLogWriterSyncOnRotate   = 1,      // fsync each segment when it's finished
+    kQLogWriterSyncEachWrite  = 2       // fsync after every write
+};
+typedef enum QLogWriterSyncPolicy QLogWriterSyncPolicy;
+
+@interface QLogWriter : NSObject
+{
+    NSString *              _directoryPath;
+    off_t                   _segmentSize;
+    NSUInteger              _segmentCount;
+    QLogWriterSyncPolicy    _syncPolicy;
+    NSCondition *           _condition;
+    NSMutableArray *        _pendingEntries;        // protected by _condition
+    uint64_t                _appendedCount;         // protected by _condition
+    uint64_t                _writtenCount;          // protected by _condition, entries up to here are on disk (or were cleared)
+    BOOL                    _clearRequested;        // protected by _condition
+    BOOL                    _stopRequested;         // protected by _condition
+    BOOL                    _stopped;               // protected by _condition
+    NSMutableArray *        _segmentNumbers;        // of NSNumber, oldest first, protected by _condition
+    off_t                   _currentSegmentLength;  // protected by _condition
+    int                     _currentSegmentFile;    // writer thread only
+    NSMutableData *         _buffer;                // writer thread only
+}
+
+- (id)initWithDirectoryPath:(NSString *)directoryPath segmentSize:(off_t)segmentSize segmentCount:(NSUInteger)segmentCount;
+    // Creates the directory if necessary, picks up any segments that are already there,
+    // and starts the writer thread.
+
+@property (copy,   readonly ) NSString *            directoryPath;
+@property (assign, readonly ) off_t                 segmentSize;
+@property (assign, readonly ) NSUInteger            segmentCount;
+@property (assign, readwrite) QLogWriterSyncPolicy  syncPolicy;         // any thread, default is kQLogWriterSyncNever
+
+- (void)appendEntry:(NSString *)entry;                                          // any thread
+    // Queues entry to be written, followed by a LF.
+
+- (void)clear;                                                                  // any thread
+    // Discards any queued entries and deletes every segment.  Returns once that's done.
+
+- (void)stop;                                                                   // any thread
+    // Writes any queued entries, closes the current segment and stops the writer thread.
+    // You can't append entries after this.
+
+- (NSInputStream *)streamForLogValidToLength:(off_t *)lengthPtr;                // any thread
+    // Waits for any queued entries to be written and then returns an un-opened stream
+    // that reads the segments, oldest first.  The segment files are opened before this
+    // returns, so the stream is unaffected if the writer rotates them away while it's
+    // being read.  See -[QLog streamForLogValidToLength:].
+
+@end
@@ -0,0 +1,588 @@
+#import "QLogWriter.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Note that nothing in this file can log via QLog; QLog calls us while holding its lock,
+// and the entry would just come straight back to us anyway.
+
+#pragma mark - Segment stream
+
+// QLogSegmentStream reads a list of already open files, each up to a fixed length, one
+// after the other.  It's only meant to be read synchronously (QLogViewer opens it, reads
+// it to the end and closes it), so it doesn't support run loop scheduling or delegate
+// events.
+
+@interface QLogSegmentStream : NSInputStream
+{
+    NSArray *       _files;             // of NSNumber file descriptor, owned by us
+    NSArray *       _lengths;           // of NSNumber off_t
+    NSUInteger      _fileIndex;
+    off_t           _fileOffset;
+    NSStreamStatus  _status;
+    id              _delegate;
+}
+
+- (id)initWithFiles:(NSArray *)files lengths:(NSArray *)lengths;
+
+@end
+
+@implementation QLogSegmentStream
+
+- (id)initWithFiles:(NSArray *)files lengths:(NSArray *)lengths
+{
+    assert(files != nil);
+    assert(lengths != nil);
+    assert([files count] == [lengths count]);
+    self = [super init];
+    if (self != nil) {
+        self->_files   = [files copy];
+        self->_lengths = [lengths copy];
+        self->_status  = NSStreamStatusNotOpen;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    for (NSNumber * file in self->_files) {
+        int     junk;
+
+        junk = close([file intValue]);
+        assert(junk == 0);
+    }
+    [self->_files release];
+    [self->_lengths release];
+    [super dealloc];
+}
+
+- (void)open
+{
+    assert(self->_status == NSStreamStatusNotOpen);
+    self->_status = NSStreamStatusOpen;
+}
+
+- (void)close
+{
+    self->_status = NSStreamStatusClosed;
+}
+
+- (NSInteger)read:(uint8_t *)buffer maxLength:(NSUInteger)len
+{
+    NSInteger   result;
+
+    assert(buffer != NULL);
+    assert(self->_status == NSStreamStatusOpen || self->_status == NSStreamStatusAtEnd);
+
+    result = 0;
+    while ( (result == 0) && (self->_fileIndex < [self->_files count]) ) {
+        off_t       fileRemaining;
+        size_t      bytesToRead;
+        ssize_t     bytesRead;
+
+        fileRemaining = [[self->_lengths objectAtIndex:self->_fileIndex] longLongValue] - self->_fileOffset;
+        if (fileRemaining <= 0) {
+            self->_fileIndex += 1;
+            self->_fileOffset = 0;
+        } else {
+            bytesToRead = len;
+            if ((off_t) bytesToRead > fileRemaining) {
+                bytesToRead = (size_t) fileRemaining;
+            }
+            bytesRead = pread([[self->_files objectAtIndex:self->_fileIndex] intValue], buffer, bytesToRead, self->_fileOffset);
+            if (bytesRead > 0) {
+                self->_fileOffset += bytesRead;
+                result = bytesRead;
+            } else if ( (bytesRead < 0) && (errno == EINTR) ) {
+                // try again
+            } else {
+                // The segment got shorter than it was when we were created, which
+                // shouldn't happen.  Treat it as an error.
+                self->_status = NSStreamStatusError;
+                result = -1;
+            }
+        }
+    }
+    if ( (result == 0) && (self->_status == NSStreamStatusOpen) ) {
+        self->_status = NSStreamStatusAtEnd;
+    }
+    return result;
+}
+
+- (BOOL)getBuffer:(uint8_t **)buffer length:(NSUInteger *)len
+{
+    #pragma unused(buffer)
+    #pragma unused(len)
+    return NO;
+}
+
+- (BOOL)hasBytesAvailable
+{
+    return (self->_status == NSStreamStatusOpen);
+}
+
+- (NSStreamStatus)streamStatus
+{
+    return self->_status;
+}
+
+- (NSError *)streamError
+{
+    return nil;
+}
+
+- (id)delegate
+{
+    return self->_delegate;
+}
+
+- (void)setDelegate:(id)delegate
+{
+    self->_delegate = delegate;
+}
+
+- (id)propertyForKey:(NSString *)key
+{
+    #pragma unused(key)
+    return nil;
+}
+
+- (BOOL)setProperty:(id)property forKey:(NSString *)key
+{
+    #pragma unused(property)
+    #pragma unused(key)
+    return NO;
+}
+
+- (void)scheduleInRunLoop:(NSRunLoop *)aRunLoop forMode:(NSString *)mode
+{
+    #pragma unused(aRunLoop)
+    #pragma unused(mode)
+    assert(NO);
+}
+
+- (void)removeFromRunLoop:(NSRunLoop *)aRunLoop forMode:(NSString *)mode
+{
+    #pragma unused(aRunLoop)
+    #pragma unused(mode)
+}
+
+@end
+
+#pragma mark - Writer
+
+@interface QLogWriter ()
+
+// forward declarations
+
+- (NSString *)pathForSegmentNumber:(NSNumber *)segmentNumber;
+- (void)openSegmentNumber:(NSNumber *)segmentNumber;
+- (void)writerThreadMain;
+
+@end
+
+@implementation QLogWriter
+
+- (id)initWithDirectoryPath:(NSString *)directoryPath segmentSize:(off_t)segmentSize segmentCount:(NSUInteger)segmentCount
+{
+    assert(directoryPath != nil);
+    assert(segmentSize > 0);
+    assert(segmentCount > 0);
+    self = [super init];
+    if (self != nil) {
+        BOOL        success;
+        NSArray *   fileNames;
+
+        self->_directoryPath = [directoryPath copy];
+        assert(self->_directoryPath != nil);
+        self->_segmentSize  = segmentSize;
+        self->_segmentCount = segmentCount;
+        self->_syncPolicy   = kQLogWriterSyncNever;
+        self->_currentSegmentFile = -1;
+
+        self->_condition = [[NSCondition alloc] init];
+        assert(self->_condition != nil);
+        self->_pendingEntries = [[NSMutableArray alloc] init];
+        assert(self->_pendingEntries != nil);
+        self->_buffer = [[NSMutableData alloc] initWithCapacity:32768];
+        assert(self->_buffer != nil);
+
+        // Find any existing segments.  We continue appending to the newest.
+
+        success = [[NSFileManager defaultManager] createDirectoryAtPath:self->_directoryPath withIntermediateDirectories:YES attributes:nil error:NULL];
+        assert(success);
+
+        self->_segmentNumbers = [[NSMutableArray alloc] init];
+        assert(self->_segmentNumbers != nil);
+
+        fileNames = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:self->_directoryPath error:NULL];
+        for (NSString * fileName in fileNames) {
+            if ( [fileName hasPrefix:@"QLog-"] && [[fileName pathExtension] isEqual:@"log"] ) {
+                NSNumber *  segmentNumber;
+
+                segmentNumber = [NSNumber numberWithLongLong:[[[fileName stringByDeletingPathExtension] substringFromIndex:5] longLongValue]];
+                if ( [[[self pathForSegmentNumber:segmentNumber] lastPathComponent] isEqual:fileName] ) {
+                    [self->_segmentNumbers addObject:segmentNumber];
+                }
+            }
+        }
+        [self->_segmentNumbers sortUsingSelector:@selector(compare:)];
+
+        if ([self->_segmentNumbers count] == 0) {
+            [self->_segmentNumbers addObject:[NSNumber numberWithLongLong:0]];
+        }
+        [self openSegmentNumber:[self->_segmentNumbers lastObject]];
+
+        [NSThread detachNewThreadSelector:@selector(writerThreadMain) toTarget:self withObject:nil];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    // The writer thread retains us until it exits, so by the time we get here -stop
+    // has been called and the current segment is closed.
+    assert(self->_stopped);
+    assert(self->_currentSegmentFile == -1);
+    [self->_directoryPath release];
+    [self->_condition release];
+    [self->_pendingEntries release];
+    [self->_segmentNumbers release];
+    [self->_buffer release];
+    [super dealloc];
+}
+
+@synthesize directoryPath = _directoryPath;
+@synthesize segmentSize   = _segmentSize;
+@synthesize segmentCount  = _segmentCount;
+@synthesize syncPolicy    = _syncPolicy;
+
+- (NSString *)pathForSegmentNumber:(NSNumber *)segmentNumber
+{
+    assert(segmentNumber != nil);
+    return [self->_directoryPath stringByAppendingPathComponent:[NSString stringWithFormat:@"QLog-%lld.log", [segmentNumber longLongValue]]];
+}
+
+- (void)openSegmentNumber:(NSNumber *)segmentNumber
+    // Opens the specified segment for appending and makes it the current segment.
+    // Must be called with _condition locked (or before the writer thread starts).
+{
+    int         junk;
+    struct stat sb;
+
+    assert(self->_currentSegmentFile == -1);
+    self->_currentSegmentFile = open([[self pathForSegmentNumber:segmentNumber] fileSystemRepresentation], O_WRONLY | O_CREAT | O_APPEND, DEFFILEMODE);
+    assert(self->_currentSegmentFile != -1);
+
+    self->_currentSegmentLength = 0;
+    if (self->_currentSegmentFile != -1) {
+        junk = fstat(self->_currentSegmentFile, &sb);
+        assert(junk == 0);
+        if (junk == 0) {
+            self->_currentSegmentLength = sb.st_size;
+        }
+    }
+}
+
+- (void)closeSegment
+    // Closes the current segment, syncing it first if the policy says so.  Must be
+    // called with _condition locked.
+{
+    int     junk;
+
+    if (self->_currentSegmentFile != -1) {
+        if (self.syncPolicy != kQLogWriterSyncNever) {
+            (void) fsync(self->_currentSegmentFile);
+        }
+        junk = close(self->_currentSegmentFile);
+        assert(junk == 0);
+        self->_currentSegmentFile = -1;
+    }
+}
+
+#pragma mark * Writer thread
+
+- (void)rotate
+    // Called on the writer thread to close the current segment, start a new one and,
+    // if there are too many segments, delete the oldest.
+{
+    NSNumber *  segmentNumber;
+
+    [self->_condition lock];
+    [self closeSegment];
+
+    segmentNumber = [NSNumber numberWithLongLong:[[self->_segmentNumbers lastObject] longLongValue] + 1];
+    [self->_segmentNumbers addObject:segmentNumber];
+    [self openSegmentNumber:segmentNumber];
+
+    while ([self->_segmentNumbers count] > self->_segmentCount) {
+        (void) unlink([[self pathForSegmentNumber:[self->_segmentNumbers objectAtIndex:0]] fileSystemRepresentation]);
+        [self->_segmentNumbers removeObjectAtIndex:0];
+    }
+    [self->_condition unlock];
+}
+
+- (void)removeAllSegments
+    // Called on the writer thread to delete every segment and start again with an
+    // empty one.
+{
+    [self->_condition lock];
+    [self closeSegment];
+    for (NSNumber * segmentNumber in self->_segmentNumbers) {
+        (void) unlink([[self pathForSegmentNumber:segmentNumber] fileSystemRepresentation]);
+    }
+    [self->_segmentNumbers removeAllObjects];
+    [self->_segmentNumbers addObject:[NSNumber numberWithLongLong:0]];
+    [self openSegmentNumber:[self->_segmentNumbers lastObject]];
+    [self->_condition unlock];
+}
+
+- (void)writeBuffer
+    // Called on the writer thread to write the contents of _buffer to the current segment
+    // and then empty it.
+{
+    int             err;
+    NSUInteger      bytesToWrite;
+    NSUInteger      bytesWrittenSoFar;
+    const char *    buf;
+
+    err = 0;
+    bytesToWrite = [self->_buffer length];
+    bytesWrittenSoFar = 0;
+    buf = [self->_buffer bytes];
+    while ( (bytesWrittenSoFar != bytesToWrite) && (self->_currentSegmentFile != -1) ) {
+        ssize_t     bytesWritten;
+
+        bytesWritten = write(self->_currentSegmentFile, &buf[bytesWrittenSoFar], bytesToWrite - bytesWrittenSoFar);
+        if (bytesWritten > 0) {
+            bytesWrittenSoFar += bytesWritten;
+        } else {
+            assert(bytesWritten != 0);
+            err = errno;
+            if (err == EINTR) {
+                err = 0;
+            } else {
+                break;
+            }
+        }
+    }
+
+    // As in the days when QLog wrote the file itself, there's not much we can do
+    // with an error here, so we ignore it in production code.
+
+    assert(err == 0);
+
+    // Only update the segment length once the write is done, so that
+    // -streamForLogValidToLength: never hands out a partial entry.
+
+    if (bytesWrittenSoFar != 0) {
+        [self->_condition lock];
+        self->_currentSegmentLength += bytesWrittenSoFar;
+        [self->_condition unlock];
+    }
+    [self->_buffer setLength:0];
+}
+
+- (void)writeEntries:(NSArray *)entries
+    // Called on the writer thread to write a batch of entries.  The batch is flattened
+    // into _buffer and written in one go, except where it crosses into a new segment;
+    // an entry is never split between segments.
+{
+    assert(entries != nil);
+
+    for (NSString * entry in entries) {
+        const char *    entryUTF8;
+        size_t          entryLength;
+        off_t           lengthSoFar;
+
+        assert([entry isKindOfClass:[NSString class]]);
+        entryUTF8 = [entry UTF8String];
+        assert(entryUTF8 != NULL);
+        entryLength = strlen(entryUTF8);
+
+        // _currentSegmentLength is only changed by this thread, so we can read it
+        // without the lock.
+
+        lengthSoFar = self->_currentSegmentLength + (off_t) [self->_buffer length];
+        if ( (lengthSoFar != 0) && (lengthSoFar + (off_t) entryLength + 1 > self->_segmentSize) ) {
+            [self writeBuffer];
+            [self rotate];
+        }
+
+        [self->_buffer appendBytes:entryUTF8 length:entryLength];
+        [self->_buffer appendBytes:"\n" length:1];
+    }
+    [self writeBuffer];
+
+    if ( (self.syncPolicy == kQLogWriterSyncEachWrite) && (self->_currentSegmentFile != -1) ) {
+        (void) fsync(self->_currentSegmentFile);
+    }
+}
+
+- (void)writerThreadMain
+    // The writer thread's entry point.  It sleeps until there's something to do, takes
+    // every pending entry, writes them, and goes back to sleep.
+{
+    BOOL    done;
+
+    [[NSThread currentThread] setName:@"QLogWriter"];
+
+    done = NO;
+    do {
+        NSAutoreleasePool * pool;
+        NSArray *           entries;
+        uint64_t            batchEnd;
+        BOOL                clear;
+
+        pool = [[NSAutoreleasePool alloc] init];
+        assert(pool != nil);
+
+        [self->_condition lock];
+        while ( ([self->_pendingEntries count] == 0) && ! self->_clearRequested && ! self->_stopRequested ) {
+            [self->_condition wait];
+        }
+        entries = [[self->_pendingEntries copy] autorelease];
+        [self->_pendingEntries removeAllObjects];
+        batchEnd = self->_appendedCount;
+        clear = self->_clearRequested;
+        done  = self->_stopRequested;
+        [self->_condition unlock];
+
+        // -clear discards the entries that were pending when it was called, so anything
+        // we picked up here was logged after the clear and goes into the new segment.
+
+        if (clear) {
+            [self removeAllSegments];
+        }
+        if ([entries count] != 0) {
+            [self writeEntries:entries];
+        }
+
+        [self->_condition lock];
+        if (done) {
+            [self closeSegment];
+            self->_stopped = YES;
+        }
+        if (clear) {
+            self->_clearRequested = NO;
+        }
+        self->_writtenCount = batchEnd;
+        [self->_condition broadcast];
+        [self->_condition unlock];
+
+        [pool drain];
+    } while ( ! done );
+}
+
+#pragma mark * Public API
+
+- (void)appendEntry:(NSString *)entry
+    // See comment in header.
+{
+    assert(entry != nil);
+
+    [self->_condition lock];
+    assert( ! self->_stopRequested );
+    [self->_pendingEntries addObject:entry];
+
+    self->_appendedCount += 1;
+
+    // Only wake the writer for the first entry; if there's already something pending
+    // it's either awake or about to be, and it'll pick this entry up in the same batch.
+    // We broadcast because the writer might not be the only thread waiting on the
+    // condition.
+
+    if ([self->_pendingEntries count] == 1) {
+        [self->_condition broadcast];
+    }
+    [self->_condition unlock];
+}
+
+- (void)clear
+    // See comment in header.
+{
+    [self->_condition lock];
+    assert( ! self->_stopRequested );
+    [self->_pendingEntries removeAllObjects];
+    self->_clearRequested = YES;
+    [self->_condition broadcast];
+    while (self->_clearRequested) {
+        [self->_condition wait];
+    }
+    [self->_condition unlock];
+}
+
+- (void)stop
+    // See comment in header.
+{
+    [self->_condition lock];
+    self->_stopRequested = YES;
+    [self->_condition broadcast];
+    while ( ! self->_stopped ) {
+        [self->_condition wait];
+    }
+    [self->_condition unlock];
+}
+
+- (NSInputStream *)streamForLogValidToLength:(off_t *)lengthPtr
+    // See comment in header.
+{
+    NSInputStream *     result;
+    NSMutableArray *    files;
+    NSMutableArray *    lengths;
+    off_t               totalLength;
+    uint64_t            targetCount;
+
+    files   = [NSMutableArray array];
+    assert(files != nil);
+    lengths = [NSMutableArray array];
+    assert(lengths != nil);
+    totalLength = 0;
+
+    [self->_condition lock];
+
+    // Wait for the writer to write everything that was logged before we were called.
+    // We don't wait for the writer to go idle, because with other threads still logging
+    // that might never happen.
+
+    targetCount = self->_appendedCount;
+    while ( (self->_writtenCount < targetCount) && ! self->_stopped ) {
+        [self->_condition wait];
+    }
+
+    // Open each segment while we hold the lock, so that the writer can't delete any of
+    // them out from under us.  Earlier segments are finished, so we can take their
+    // length from the file system; the current one is only valid up to the last
+    // complete write.
+
+    for (NSNumber * segmentNumber in self->_segmentNumbers) {
+        int         file;
+        off_t       length;
+        struct stat sb;
+
+        file = open([[self pathForSegmentNumber:segmentNumber] fileSystemRepresentation], O_RDONLY);
+        if (file != -1) {
+            if ([segmentNumber isEqual:[self->_segmentNumbers lastObject]]) {
+                length = self->_currentSegmentLength;
+            } else if (fstat(file, &sb) == 0) {
+                length = sb.st_size;
+            } else {
+                length = 0;
+            }
+            [files   addObject:[NSNumber numberWithInt:file]];
+            [lengths addObject:[NSNumber numberWithLongLong:length]];
+            totalLength += length;
+        }
+    }
+
+    [self->_condition unlock];
+
+    result = [[[QLogSegmentStream alloc] initWithFiles:files lengths:lengths] autorelease];
+    if ( (result != nil) && (lengthPtr != NULL) ) {
+        *lengthPtr = totalLength;
+    }
+    return result;
+}
+
+@end
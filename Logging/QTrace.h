@@ -0,0 +1,81 @@
+#import <Foundation/Foundation.h>
+
+#include <stdint.h>
+
+// QTrace records a timeline of what the app's operations were doing, and when, and on
+// which thread, and writes it out as a trace event JSON file that you can load into a
+// standard trace viewer (chrome://tracing or ui.perfetto.dev).
+//
+// o Every QRunLoopOperation is an async span, from the moment it starts on its run loop
+//   thread to the moment it finishes.
+//
+// o Synchronous work, such as the -main of an NSOperation or a long main thread method,
+//   is a complete span on the thread that did it; see QTraceNow and
+//   -recordSpanNamed:object:startTime:.
+//
+// o NetworkManager records which operation caused each operation to be queued, and the
+//   trace links the two with a flow arrow (RetryingHTTPOperation to its QHTTPOperation,
+//   the thumbnail get to its resize, the gallery get to its parse, and so on).
+//
+// 记录各个 operation 在哪个线程上, 什么时候运行, 输出为 trace event JSON 格式, 可以用 chrome://tracing 查看.
+//
+// Recording is off by default.  When it's off, each hook costs one test of a global,
+// which is why callers test QTraceIsRecording() before calling in:
+//
+//     if (QTraceIsRecording()) {
+//         [[QTrace trace] operationDidBegin:self];
+//     }
+
+extern volatile BOOL gQTraceRecording;          // don't touch, use QTraceIsRecording()
+
+static inline BOOL QTraceIsRecording(void)
+{
+    return gQTraceRecording;
+}
+
+// Returns the current time in trace units (microseconds), for -recordSpanNamed:object:startTime:.
+extern uint64_t QTraceNow(void);
+
+@interface QTrace : NSObject
+{
+    uint64_t                _startTime;
+    NSMutableData *         _events;            // of QTraceEvent, protected by @synchronized (self)
+    NSUInteger              _droppedEventCount;
+    uint64_t                _nextID;
+    CFMutableDictionaryRef  _objectToIDMap;     // object -> NSNumber span ID, objects not retained
+    CFMutableDictionaryRef  _deferredFlowMap;   // object -> NSMutableArray of span IDs to link to when it ends
+    NSMutableSet *          _pendingFlowIDs;    // span IDs with a flow that has started but not yet finished
+    NSMutableDictionary *   _threadNames;       // NSNumber thread ID -> NSString
+}
+
++ (QTrace *)trace;                                                              // any thread
+    // Returns the singleton trace object.
+
+- (void)start;                                                                  // main thread only
+    // Throws away anything recorded so far and starts recording.
+
+- (NSString *)stop;                                                             // main thread only
+    // Stops recording and writes what was recorded to a new file in the Caches directory,
+    // returning its path (or nil if there was nothing to write, or the write failed).
+
+// Recording.  These are all any thread, and do nothing if the trace isn't recording.
+
+- (void)operation:(NSOperation *)operation wasQueuedByParent:(id)parent;
+    // Records a flow from parent (which may be nil) to operation.  If operation depends on
+    // parent, the flow starts when parent ends, otherwise it starts now.
+
+- (void)operationDidBegin:(NSOperation *)operation;
+- (void)operationDidEnd:(NSOperation *)operation;
+    // Record the start and end of an async span for operation.
+
+- (void)recordSpanNamed:(const char *)name object:(id)object startTime:(uint64_t)startTime;
+    // Records a complete span on the current thread from startTime to now.  name must
+    // be a string constant (or otherwise live forever).  If object is an operation that
+    // was queued with -operation:wasQueuedByParent:, the span finishes its flow.
+
+@property (assign, readwrite) id currentOperation;
+    // The operation on whose behalf the current thread is running code.  NetworkManager sets
+    // this while it runs an operation's completion action, so that anything the action
+    // queues is linked back to the operation.  Not retained.
+
+@end
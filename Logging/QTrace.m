@@ -0,0 +1,401 @@
+#import "QTrace.h"
+#import "QLog.h"
+
+#include <mach/mach_time.h>
+#include <objc/runtime.h>
+#include <pthread.h>
+#include <stdio.h>
+
+// Each event takes a fixed size record, and the trace stops recording new events once
+// it has this many, so that leaving it running can't eat all our memory.
+
+#if TARGET_OS_EMBEDDED || TARGET_IPHONE_SIMULATOR
+    static const NSUInteger kMaximumEventCount = 100000;
+#else
+    static const NSUInteger kMaximumEventCount = 400000;
+#endif
+
+// Phases, as defined by the trace event format.
+
+enum {
+    kQTracePhaseComplete   = 'X',
+    kQTracePhaseAsyncBegin = 'b',
+    kQTracePhaseAsyncEnd   = 'e',
+    kQTracePhaseFlowStart  = 's',
+    kQTracePhaseFlowFinish = 'f'
+};
+
+typedef struct {
+    const char *    name;
+    const char *    category;
+    uint64_t        ts;
+    uint64_t        dur;
+    uint64_t        tid;
+    uint64_t        id;
+    char            phase;
+} QTraceEvent;
+
+volatile BOOL gQTraceRecording;
+
+extern uint64_t QTraceNow(void)
+{
+    static mach_timebase_info_data_t    sTimebase;
+
+    if (sTimebase.denom == 0) {
+        (void) mach_timebase_info(&sTimebase);
+    }
+    return mach_absolute_time() * sTimebase.numer / sTimebase.denom / 1000;
+}
+
+@interface QTrace ()
+
+// forward declarations
+
+- (void)appendEventWithPhase:(char)phase name:(const char *)name category:(const char *)category ts:(uint64_t)ts dur:(uint64_t)dur id:(uint64_t)spanID;
+
+@end
+
+@implementation QTrace
+
++ (QTrace *)trace
+    // See comment in header.
+{
+    static QTrace * sTrace;
+
+    // See the comment in +[QLog log].
+    if (sTrace == nil) {
+        @synchronized ([QTrace class]) {
+            if (sTrace == nil) {
+                sTrace = [[QTrace alloc] init];
+                assert(sTrace != nil);
+            }
+        }
+    }
+    return sTrace;
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self != nil) {
+        self->_objectToIDMap = CFDictionaryCreateMutable(NULL, 0, NULL, &kCFTypeDictionaryValueCallBacks);
+        assert(self->_objectToIDMap != NULL);
+        self->_deferredFlowMap = CFDictionaryCreateMutable(NULL, 0, NULL, &kCFTypeDictionaryValueCallBacks);
+        assert(self->_deferredFlowMap != NULL);
+        self->_pendingFlowIDs = [[NSMutableSet alloc] init];
+        assert(self->_pendingFlowIDs != nil);
+        self->_threadNames = [[NSMutableDictionary alloc] init];
+        assert(self->_threadNames != nil);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    // This object lives for the entire life of the application.  Getting it to support being deallocated
+    // would be quite tricky.
+    assert(NO);
+    [super dealloc];
+}
+
+#pragma mark - Starting and stopping
+
+- (void)start
+    // See comment in header.
+{
+    assert([NSThread isMainThread]);
+    @synchronized (self) {
+        [self->_events release];
+        self->_events = [[NSMutableData alloc] initWithCapacity:1024 * sizeof(QTraceEvent)];
+        assert(self->_events != nil);
+        self->_droppedEventCount = 0;
+        CFDictionaryRemoveAllValues(self->_objectToIDMap);
+        CFDictionaryRemoveAllValues(self->_deferredFlowMap);
+        [self->_pendingFlowIDs removeAllObjects];
+        [self->_threadNames removeAllObjects];
+        self->_startTime = QTraceNow();
+        gQTraceRecording = YES;
+    }
+    [[QLog log] logWithFormat:@"trace start"];
+}
+
+// Writes s to file as a JSON string, quotes included.
+static void WriteJSONString(FILE * file, NSString * s)
+{
+    s = [s stringByReplacingOccurrencesOfString:@"\\" withString:@"\\\\"];
+    s = [s stringByReplacingOccurrencesOfString:@"\"" withString:@"\\\""];
+    fprintf(file, "\"%s\"", [s UTF8String]);
+}
+
+- (NSString *)stop
+    // See comment in header.
+{
+    NSData *            events;
+    NSDictionary *      threadNames;
+    NSUInteger          droppedEventCount;
+    NSString *          path;
+    FILE *              file;
+    const QTraceEvent * event;
+    NSUInteger          eventIndex;
+    NSUInteger          eventCount;
+    BOOL                success;
+
+    assert([NSThread isMainThread]);
+
+    @synchronized (self) {
+        gQTraceRecording = NO;
+        events = [self->_events autorelease];
+        self->_events = nil;
+        threadNames = [[self->_threadNames copy] autorelease];
+        droppedEventCount = self->_droppedEventCount;
+        CFDictionaryRemoveAllValues(self->_objectToIDMap);
+        CFDictionaryRemoveAllValues(self->_deferredFlowMap);
+        [self->_pendingFlowIDs removeAllObjects];
+    }
+
+    path = nil;
+    eventCount = [events length] / sizeof(QTraceEvent);
+    if (eventCount != 0) {
+        path = [[NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) objectAtIndex:0] stringByAppendingPathComponent:
+            [NSString stringWithFormat:@"Trace-%.0f.json", [NSDate timeIntervalSinceReferenceDate]]
+        ];
+        assert(path != nil);
+
+        file = fopen([path fileSystemRepresentation], "w");
+        success = (file != NULL);
+        if (success) {
+            fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+            fprintf(file, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":1,\"args\":{\"name\":");
+            WriteJSONString(file, [[NSProcessInfo processInfo] processName]);
+            fprintf(file, "}}");
+            for (NSNumber * threadID in threadNames) {
+                fprintf(file, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%llu,\"args\":{\"name\":", [threadID unsignedLongLongValue]);
+                WriteJSONString(file, [threadNames objectForKey:threadID]);
+                fprintf(file, "}}");
+            }
+            event = (const QTraceEvent *) [events bytes];
+            for (eventIndex = 0; eventIndex < eventCount; eventIndex++, event++) {
+                fprintf(file, ",\n{\"ph\":\"%c\",\"name\":\"%s\",\"cat\":\"%s\",\"pid\":1,\"tid\":%llu,\"ts\":%llu", event->phase, event->name, event->category, event->tid, event->ts);
+                switch (event->phase) {
+                    case kQTracePhaseComplete: {
+                        fprintf(file, ",\"dur\":%llu", event->dur);
+                    } break;
+                    case kQTracePhaseFlowFinish: {
+                        fprintf(file, ",\"id\":\"0x%llx\",\"bp\":\"e\"", event->id);
+                    } break;
+                    default: {
+                        fprintf(file, ",\"id\":\"0x%llx\"", event->id);
+                    } break;
+                }
+                fprintf(file, "}");
+            }
+            fprintf(file, "\n]}\n");
+            success = (fclose(file) == 0);
+        }
+        if ( ! success ) {
+            (void) [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+            path = nil;
+        }
+    }
+    [[QLog log] logWithFormat:@"trace stop, %zu events (%zu dropped) written to %@", (size_t) eventCount, (size_t) droppedEventCount, [path lastPathComponent]];
+    return path;
+}
+
+#pragma mark - Recording
+
+// The rest of these must be called with the lock held.
+
+- (void)appendEventWithPhase:(char)phase name:(const char *)name category:(const char *)category ts:(uint64_t)ts dur:(uint64_t)dur id:(uint64_t)spanID
+{
+    QTraceEvent     event;
+    NSNumber *      threadID;
+
+    if (self->_events == nil) {
+        // We stopped recording after the caller checked.
+    } else if ([self->_events length] / sizeof(QTraceEvent) >= kMaximumEventCount) {
+        self->_droppedEventCount += 1;
+    } else {
+        event.name     = name;
+        event.category = category;
+        event.ts       = (ts > self->_startTime) ? ts - self->_startTime : 0;
+        event.dur      = dur;
+        event.tid      = pthread_mach_thread_np(pthread_self());
+        event.id       = spanID;
+        event.phase    = phase;
+        [self->_events appendBytes:&event length:sizeof(event)];
+
+        // Remember the thread's name the first time we see it, because it may be gone by
+        // the time we write the trace.
+
+        threadID = [NSNumber numberWithUnsignedLongLong:event.tid];
+        if ([self->_threadNames objectForKey:threadID] == nil) {
+            NSString *  threadName;
+
+            if ([NSThread isMainThread]) {
+                threadName = @"main";
+            } else {
+                threadName = [[NSThread currentThread] name];
+                if ([threadName length] == 0) {
+                    threadName = [NSString stringWithFormat:@"thread %llu", event.tid];
+                }
+            }
+            [self->_threadNames setObject:threadName forKey:threadID];
+        }
+    }
+}
+
+- (uint64_t)spanIDForObject:(id)object
+{
+    NSNumber *  result;
+
+    assert(object != nil);
+    result = (NSNumber *) CFDictionaryGetValue(self->_objectToIDMap, object);
+    if (result == nil) {
+        self->_nextID += 1;
+        result = [NSNumber numberWithUnsignedLongLong:self->_nextID];
+        CFDictionarySetValue(self->_objectToIDMap, object, result);
+    }
+    return [result unsignedLongLongValue];
+}
+
+// Starts a flow to the span with the specified ID from the current thread.  The flow
+// has to start inside a slice, so we give it one of its own.
+- (void)startFlowToSpanID:(uint64_t)spanID name:(const char *)name ts:(uint64_t)ts
+{
+    [self appendEventWithPhase:kQTracePhaseComplete   name:name category:"queue" ts:ts dur:0 id:0];
+    [self appendEventWithPhase:kQTracePhaseFlowStart  name:"queue" category:"flow" ts:ts dur:0 id:spanID];
+    [self->_pendingFlowIDs addObject:[NSNumber numberWithUnsignedLongLong:spanID]];
+}
+
+- (void)finishFlowToSpanID:(uint64_t)spanID ts:(uint64_t)ts
+{
+    NSNumber *  flowID;
+
+    flowID = [NSNumber numberWithUnsignedLongLong:spanID];
+    if ([self->_pendingFlowIDs containsObject:flowID]) {
+        [self appendEventWithPhase:kQTracePhaseFlowFinish name:"queue" category:"flow" ts:ts dur:0 id:spanID];
+        [self->_pendingFlowIDs removeObject:flowID];
+    }
+}
+
+// Called when object's span ends.  Starts the flows to the operations that were waiting
+// for it, and forgets about it, so that its ID won't be given to a new object at the
+// same address.
+- (void)objectDidEnd:(id)object ts:(uint64_t)ts
+{
+    NSArray *   deferredFlows;
+
+    deferredFlows = (NSArray *) CFDictionaryGetValue(self->_deferredFlowMap, object);
+    for (NSArray * deferredFlow in deferredFlows) {
+        [self startFlowToSpanID:[[deferredFlow objectAtIndex:0] unsignedLongLongValue] name:[[deferredFlow objectAtIndex:1] pointerValue] ts:ts];
+    }
+    CFDictionaryRemoveValue(self->_deferredFlowMap, object);
+    CFDictionaryRemoveValue(self->_objectToIDMap, object);
+}
+
+// The rest of these are any thread, and take the lock.
+
+- (void)operation:(NSOperation *)operation wasQueuedByParent:(id)parent
+    // See comment in header.
+{
+    uint64_t                spanID;
+    const char *            name;
+    NSMutableArray *        deferredFlows;
+
+    assert(operation != nil);
+    if (parent != nil) {
+        name = class_getName([operation class]);
+        @synchronized (self) {
+            spanID = [self spanIDForObject:operation];
+            if ( [parent isKindOfClass:[NSOperation class]] && [[operation dependencies] containsObject:parent] && ! [parent isFinished] ) {
+                deferredFlows = (NSMutableArray *) CFDictionaryGetValue(self->_deferredFlowMap, parent);
+                if (deferredFlows == nil) {
+                    deferredFlows = [NSMutableArray array];
+                    assert(deferredFlows != nil);
+                    CFDictionarySetValue(self->_deferredFlowMap, parent, deferredFlows);
+                }
+                [deferredFlows addObject:[NSArray arrayWithObjects:[NSNumber numberWithUnsignedLongLong:spanID], [NSValue valueWithPointer:name], nil]];
+            } else {
+                [self startFlowToSpanID:spanID name:name ts:QTraceNow()];
+            }
+        }
+    }
+}
+
+- (void)operationDidBegin:(NSOperation *)operation
+    // See comment in header.
+{
+    uint64_t        ts;
+    uint64_t        spanID;
+    const char *    name;
+
+    assert(operation != nil);
+    ts = QTraceNow();
+    name = class_getName([operation class]);
+    @synchronized (self) {
+        spanID = [self spanIDForObject:operation];
+        [self appendEventWithPhase:kQTracePhaseAsyncBegin name:name category:"operation" ts:ts dur:0 id:spanID];
+
+        // A flow can't finish on an async span, so give it a slice on this thread.
+
+        if ([self->_pendingFlowIDs containsObject:[NSNumber numberWithUnsignedLongLong:spanID]]) {
+            [self appendEventWithPhase:kQTracePhaseComplete name:name category:"start" ts:ts dur:0 id:0];
+            [self finishFlowToSpanID:spanID ts:ts];
+        }
+    }
+}
+
+- (void)operationDidEnd:(NSOperation *)operation
+    // See comment in header.
+{
+    uint64_t    ts;
+    NSNumber *  spanID;
+
+    assert(operation != nil);
+    ts = QTraceNow();
+    @synchronized (self) {
+        // If we started recording part way through the operation, we have no begin
+        // to match.
+        spanID = (NSNumber *) CFDictionaryGetValue(self->_objectToIDMap, operation);
+        if (spanID != nil) {
+            [self appendEventWithPhase:kQTracePhaseAsyncEnd name:class_getName([operation class]) category:"operation" ts:ts dur:0 id:[spanID unsignedLongLongValue]];
+            [self objectDidEnd:operation ts:ts];
+        }
+    }
+}
+
+- (void)recordSpanNamed:(const char *)name object:(id)object startTime:(uint64_t)startTime
+    // See comment in header.
+{
+    uint64_t    ts;
+    NSNumber *  spanID;
+
+    assert(name != NULL);
+    ts = QTraceNow();
+    @synchronized (self) {
+        [self appendEventWithPhase:kQTracePhaseComplete name:name category:"span" ts:startTime dur:ts - startTime id:0];
+        if (object != nil) {
+            spanID = (NSNumber *) CFDictionaryGetValue(self->_objectToIDMap, object);
+            if (spanID != nil) {
+                [self finishFlowToSpanID:[spanID unsignedLongLongValue] ts:startTime];
+                [self objectDidEnd:object ts:ts];
+            }
+        }
+    }
+}
+
+- (id)currentOperation
+{
+    return [[[[NSThread currentThread] threadDictionary] objectForKey:@"QTraceCurrentOperation"] nonretainedObjectValue];
+}
+
+- (void)setCurrentOperation:(id)newValue
+{
+    if (newValue == nil) {
+        [[[NSThread currentThread] threadDictionary] removeObjectForKey:@"QTraceCurrentOperation"];
+    } else {
+        [[[NSThread currentThread] threadDictionary] setObject:[NSValue valueWithNonretainedObject:newValue] forKey:@"QTraceCurrentOperation"];
+    }
+}
+
+@end
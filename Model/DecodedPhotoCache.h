@@ -0,0 +1,46 @@
+#import <UIKit/UIKit.h>
+
+// DecodedPhotoCache holds the display-ready photo images that PhotoDecodeOperation 
+// produces, so that flipping back to a photo you've just looked at shows it straight 
+// away, without decoding it again.  Photo only decodes photos that someone is looking at, 
+// so everything in here has been on screen.  It's keyed by the absolute path of the photo file, which changes whenever the 
+// photo does, so a stale image is never returned.
+//
+// Decoded photos are big (a 1024 x 768 photo is 3 MB), so the cache only holds a handful. 
+// It's bounded by size, discarding the least recently used photos first, and it's emptied 
+// when the memory budget asks for caches to be evicted.
+//
+// 最近显示过的大图解码后的 bitmap 缓存, 以图片文件的路径为 key.
+//
+// The cache is only accessed on the main thread.
+
+@interface DecodedPhotoCache : NSObject
+{
+    NSUInteger              _byteLimit;
+    NSMutableDictionary *   _imagesByPath;
+    NSMutableArray *        _paths;                 // least recently used first
+    NSUInteger              _byteCount;
+    NSUInteger              _hitCount;
+    NSUInteger              _missCount;
+}
+
++ (DecodedPhotoCache *)sharedCache;
+
+@property (nonatomic, assign, readwrite) NSUInteger     byteLimit;      // default is 12 MB, 8 MB on embedded
+
+// Returns the decoded image for the photo file at path, or nil if it's not in the cache.
+// This counts as a hit or a miss.
+- (UIImage *)imageForPhotoPath:(NSString *)path;
+
+// Adds the decoded image for the photo file at path, replacing any that's already there.
+- (void)setImage:(UIImage *)image forPhotoPath:(NSString *)path;
+
+// Forgets the image for the photo file at path, for example because the file is being deleted.
+- (void)removeImageForPhotoPath:(NSString *)path;
+
+- (void)removeAllImages;
+
+@property (nonatomic, assign, readonly ) NSUInteger     hitCount;
+@property (nonatomic, assign, readonly ) NSUInteger     missCount;
+
+@end
@@ -0,0 +1,177 @@
+#import "DecodedPhotoCache.h"
+#import "MemoryBudget.h"
+#import "Logging.h"
+
+// Returns the number of bytes of pixels behind the image.
+static NSUInteger BytesForImage(UIImage * image)
+{
+    CGImageRef  cgImage;
+    
+    cgImage = image.CGImage;
+    if (cgImage == NULL) {
+        return 0;
+    }
+    return CGImageGetBytesPerRow(cgImage) * CGImageGetHeight(cgImage);
+}
+
+@interface DecodedPhotoCache ()
+
+// forward declarations
+- (void)trimToByteLimit;
+- (void)evictCaches:(NSNotification *)note;
+
+@end
+
+@implementation DecodedPhotoCache
+
++ (DecodedPhotoCache *)sharedCache
+{
+    static DecodedPhotoCache * sDecodedPhotoCache;
+
+    assert([NSThread isMainThread]);
+    if (sDecodedPhotoCache == nil) {
+        sDecodedPhotoCache = [[DecodedPhotoCache alloc] init];
+        assert(sDecodedPhotoCache != nil);
+    }
+    return sDecodedPhotoCache;
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self != nil) {
+        #if TARGET_OS_EMBEDDED
+            self->_byteLimit = 8 * 1024 * 1024;
+        #else
+            self->_byteLimit = 12 * 1024 * 1024;
+        #endif
+        self->_imagesByPath = [[NSMutableDictionary alloc] init];
+        assert(self->_imagesByPath != nil);
+        self->_paths = [[NSMutableArray alloc] init];
+        assert(self->_paths != nil);
+        
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(evictCaches:) name:kMemoryBudgetEvictCachesNotification object:nil];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    // This object lives for the entire life of the application.  Getting it to support being 
+    // deallocated would be quite tricky, so we don't even try.
+    assert(NO);
+    [super dealloc];
+}
+
+@synthesize byteLimit = _byteLimit;
+@synthesize hitCount  = _hitCount;
+@synthesize missCount = _missCount;
+
+- (void)setByteLimit:(NSUInteger)newValue
+{
+    assert([NSThread isMainThread]);
+    self->_byteLimit = newValue;
+    [self trimToByteLimit];
+}
+
+// Removes the entry for path, which must be in the cache, keeping the byte count 
+// and the memory budget up to date.
+- (void)removePath:(NSString *)path
+{
+    NSUInteger  length;
+    
+    [[path retain] autorelease];            // it might be the array's copy
+    length = BytesForImage([self->_imagesByPath objectForKey:path]);
+    [self->_imagesByPath removeObjectForKey:path];
+    [self->_paths removeObject:path];
+    assert(self->_byteCount >= length);
+    self->_byteCount -= length;
+    [[MemoryBudget sharedBudget] adjustBytes:- (long long) length forSubsystem:kMemoryBudgetSubsystemDecodedPhotos];
+}
+
+// Discards least recently used photos until we're within the byte limit.
+- (void)trimToByteLimit
+{
+    while ( (self->_byteCount > self->_byteLimit) && ([self->_paths count] != 0) ) {
+        [self removePath:[self->_paths objectAtIndex:0]];
+    }
+}
+
+- (UIImage *)imageForPhotoPath:(NSString *)path
+{
+    UIImage *   result;
+    
+    assert([NSThread isMainThread]);
+    assert(path != nil);
+    
+    result = [self->_imagesByPath objectForKey:path];
+    if (result != nil) {
+        self->_hitCount += 1;
+        
+        // Move it to the most recently used end.
+        
+        [[path retain] autorelease];
+        [self->_paths removeObject:path];
+        [self->_paths addObject:path];
+    } else {
+        self->_missCount += 1;
+    }
+    return result;
+}
+
+- (void)setImage:(UIImage *)image forPhotoPath:(NSString *)path
+{
+    NSUInteger  length;
+    
+    assert([NSThread isMainThread]);
+    assert(image != nil);
+    assert(path != nil);
+    
+    if ([self->_imagesByPath objectForKey:path] != nil) {
+        [self removePath:path];
+    }
+    
+    // A photo that's bigger than the whole cache is just not worth keeping.
+    
+    length = BytesForImage(image);
+    if (length <= self->_byteLimit) {
+        [self->_imagesByPath setObject:image forKey:path];
+        [self->_paths addObject:path];
+        self->_byteCount += length;
+        [[MemoryBudget sharedBudget] adjustBytes:(long long) length forSubsystem:kMemoryBudgetSubsystemDecodedPhotos];
+        [self trimToByteLimit];
+    }
+}
+
+- (void)removeImageForPhotoPath:(NSString *)path
+{
+    assert([NSThread isMainThread]);
+    assert(path != nil);
+    
+    if ([self->_imagesByPath objectForKey:path] != nil) {
+        [self removePath:path];
+    }
+}
+
+- (void)removeAllImages
+{
+    assert([NSThread isMainThread]);
+    
+    [[MemoryBudget sharedBudget] adjustBytes:- (long long) self->_byteCount forSubsystem:kMemoryBudgetSubsystemDecodedPhotos];
+    [self->_imagesByPath removeAllObjects];
+    [self->_paths removeAllObjects];
+    self->_byteCount = 0;
+}
+
+// Called on the main thread when the memory budget wants caches evicted.  Everything in 
+// the cache can be decoded again, so we throw the lot away.
+- (void)evictCaches:(NSNotification *)note
+{
+    #pragma unused(note)
+    assert([NSThread isMainThread]);
+    
+    [[QLog log] logWithFormat:@"%s evicted %zu photos, %zu bytes", __PRETTY_FUNCTION__, (size_t) [self->_paths count], (size_t) self->_byteCount];
+    [self removeAllImages];
+}
+
+@end
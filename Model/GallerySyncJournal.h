@@ -0,0 +1,61 @@
+#import <Foundation/Foundation.h>
+
+// GallerySyncJournal keeps a gallery cache's delta sync state in a property list next to
+// its database.  It holds two things:
+//
+// o changeToken -- The server's change token for the version of the gallery that the
+//   saved database reflects.  PhotoGallery sends this back to the server to ask for a
+//   delta rather than the full index.
+//
+// o the pending sync -- A sync that's been committed to the managed object context but
+//   not yet saved.  PhotoGallery records this (-beginSyncWithChangeToken:...) before it
+//   commits a sync, and promotes it (-commitPendingSync) once the context has been saved.
+//   For a delta, the journal holds the delta's records as well as its token, so that if
+//   the app dies before the save, the next launch can apply them again and carry on from
+//   there.  Applying a delta is idempotent (records add, update or remove photos by ID),
+//   so it doesn't matter whether the save happened before the crash.  A full sync only
+//   records its token; if it's lost, the journal keeps the old token, which is still
+//   right for the database as saved.
+//
+// Every change is written to disk (atomically) before the method returns.
+//
+// 增量同步的日志: 记录数据库对应的 change token, 以及已提交但还没保存的增量, 崩溃后可以重新应用.
+//
+// The journal is only accessed on the main thread.
+
+@interface GallerySyncJournal : NSObject
+{
+    NSString *              _path;
+    NSString *              _changeToken;
+    NSDictionary *          _pendingSync;
+}
+
+// Reads the journal at path, if there is one.
+- (id)initWithPath:(NSString *)path;
+
+@property (nonatomic, copy,   readonly ) NSString *     path;
+@property (nonatomic, copy,   readonly ) NSString *     changeToken;
+
+@property (nonatomic, assign, readonly ) BOOL           hasPendingSync;
+@property (nonatomic, copy,   readonly ) NSString *     pendingChangeToken;         // nil if the server didn't give one
+@property (nonatomic, copy,   readonly ) NSString *     pendingDeltaFrom;           // nil for a full sync
+@property (nonatomic, copy,   readonly ) NSArray *      pendingResults;             // of GalleryParserOperation results, delta only
+@property (nonatomic, copy,   readonly ) NSArray *      pendingRemovedPhotoIDs;     // of NSString, delta only
+
+// Records a sync that's about to be committed.  deltaFrom is nil for a full sync, in
+// which case results and removedPhotoIDs are ignored.  Returns NO if the journal couldn't
+// be written, in which case a delta shouldn't be applied.
+- (BOOL)beginSyncWithChangeToken:(NSString *)changeToken deltaFrom:(NSString *)deltaFrom results:(NSArray *)results removedPhotoIDs:(NSArray *)removedPhotoIDs;
+
+// The database has been saved, so the pending sync's token becomes changeToken.  Does
+// nothing if there's no pending sync.
+- (void)commitPendingSync;
+
+// Throws away the pending sync, leaving changeToken as it was.
+- (void)discardPendingSync;
+
+// Forgets changeToken (and any pending sync), for example because the server no longer
+// recognises it.  The next sync is a full sync.
+- (void)forgetChangeToken;
+
+@end
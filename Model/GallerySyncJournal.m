@@ -0,0 +1,178 @@
+#import "GallerySyncJournal.h"
+#import "Logging.h"
+
+// keys in the journal property list
+
+static NSString * kJournalKeyChangeToken            = @"changeToken";
+static NSString * kJournalKeyPendingSync            = @"pendingSync";
+
+// keys in the pending sync dictionary
+
+static NSString * kPendingSyncKeyChangeToken        = @"changeToken";
+static NSString * kPendingSyncKeyDeltaFrom          = @"deltaFrom";
+static NSString * kPendingSyncKeyResults            = @"results";
+static NSString * kPendingSyncKeyRemovedPhotoIDs    = @"removedPhotoIDs";
+
+@interface GallerySyncJournal ()
+
+// read/write variants of public properties
+
+@property (nonatomic, copy,   readwrite) NSString *     changeToken;
+
+// private properties
+
+@property (nonatomic, copy,   readwrite) NSDictionary * pendingSync;
+
+// forward declarations
+
+- (BOOL)write;
+
+@end
+
+@implementation GallerySyncJournal
+
+- (id)initWithPath:(NSString *)path
+{
+    NSDictionary *  journal;
+    NSString *      changeToken;
+    NSDictionary *  pendingSync;
+
+    assert(path != nil);
+    self = [super init];
+    if (self != nil) {
+        self->_path = [path copy];
+
+        // A journal that isn't what we expect is treated as no journal at all, which
+        // just means the next sync is a full one.
+
+        journal = [NSDictionary dictionaryWithContentsOfFile:path];
+        if ( [journal isKindOfClass:[NSDictionary class]] ) {
+            changeToken = [journal objectForKey:kJournalKeyChangeToken];
+            if ( [changeToken isKindOfClass:[NSString class]] ) {
+                self->_changeToken = [changeToken copy];
+            }
+            pendingSync = [journal objectForKey:kJournalKeyPendingSync];
+            if ( [pendingSync isKindOfClass:[NSDictionary class]] ) {
+                self->_pendingSync = [pendingSync copy];
+            }
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self->_path release];
+    [self->_changeToken release];
+    [self->_pendingSync release];
+    [super dealloc];
+}
+
+@synthesize path        = _path;
+@synthesize changeToken = _changeToken;
+@synthesize pendingSync = _pendingSync;
+
+- (BOOL)hasPendingSync
+{
+    return (self.pendingSync != nil);
+}
+
+- (NSString *)pendingChangeToken
+{
+    return [self.pendingSync objectForKey:kPendingSyncKeyChangeToken];
+}
+
+- (NSString *)pendingDeltaFrom
+{
+    return [self.pendingSync objectForKey:kPendingSyncKeyDeltaFrom];
+}
+
+- (NSArray *)pendingResults
+{
+    return [self.pendingSync objectForKey:kPendingSyncKeyResults];
+}
+
+- (NSArray *)pendingRemovedPhotoIDs
+{
+    return [self.pendingSync objectForKey:kPendingSyncKeyRemovedPhotoIDs];
+}
+
+- (BOOL)write
+    // Writes the journal to disk, or deletes it if there's nothing in it.
+{
+    BOOL                    success;
+    NSMutableDictionary *   journal;
+
+    assert([NSThread isMainThread]);
+
+    journal = [NSMutableDictionary dictionary];
+    assert(journal != nil);
+    if (self.changeToken != nil) {
+        [journal setObject:self.changeToken forKey:kJournalKeyChangeToken];
+    }
+    if (self.pendingSync != nil) {
+        [journal setObject:self.pendingSync forKey:kJournalKeyPendingSync];
+    }
+
+    if ([journal count] == 0) {
+        (void) [[NSFileManager defaultManager] removeItemAtPath:self.path error:NULL];
+        success = YES;
+    } else {
+        success = [journal writeToFile:self.path atomically:YES];
+    }
+    if ( ! success ) {
+        [[QLog log] logWithFormat:@"%s sync journal write failed '%@'", __PRETTY_FUNCTION__, [self.path lastPathComponent]];
+    }
+    return success;
+}
+
+- (BOOL)beginSyncWithChangeToken:(NSString *)changeToken deltaFrom:(NSString *)deltaFrom results:(NSArray *)results removedPhotoIDs:(NSArray *)removedPhotoIDs
+{
+    NSMutableDictionary *   pendingSync;
+
+    assert([NSThread isMainThread]);
+
+    pendingSync = [NSMutableDictionary dictionary];
+    assert(pendingSync != nil);
+    if (changeToken != nil) {
+        [pendingSync setObject:changeToken forKey:kPendingSyncKeyChangeToken];
+    }
+    if (deltaFrom != nil) {
+        assert(results != nil);
+        assert(removedPhotoIDs != nil);
+        [pendingSync setObject:deltaFrom       forKey:kPendingSyncKeyDeltaFrom];
+        [pendingSync setObject:results         forKey:kPendingSyncKeyResults];
+        [pendingSync setObject:removedPhotoIDs forKey:kPendingSyncKeyRemovedPhotoIDs];
+    }
+    self.pendingSync = pendingSync;
+    return [self write];
+}
+
+- (void)commitPendingSync
+{
+    assert([NSThread isMainThread]);
+    if (self.pendingSync != nil) {
+        self.changeToken = self.pendingChangeToken;
+        self.pendingSync = nil;
+        (void) [self write];
+    }
+}
+
+- (void)discardPendingSync
+{
+    assert([NSThread isMainThread]);
+    if (self.pendingSync != nil) {
+        self.pendingSync = nil;
+        (void) [self write];
+    }
+}
+
+- (void)forgetChangeToken
+{
+    assert([NSThread isMainThread]);
+    self.changeToken = nil;
+    self.pendingSync = nil;
+    (void) [self write];
+}
+
+@end
@@ -1,27 +1,55 @@
 #import <Foundation/Foundation.h>
 #import <CoreGraphics/CoreGraphics.h>
 
+@class RetryingHTTPOperation;
+
 @interface MakeThumbnailOperation : NSOperation
 {
-    NSData *        _imageData;
-    NSString *      _MIMEType;
-    CGFloat         _thumbnailSize;
-    CGImageRef      _thumbnail;
+    NSData *                    _imageData;
+    NSString *                  _MIMEType;
+    RetryingHTTPOperation *     _imageDataOperation;
+    CGFloat                     _thumbnailSize;
+    BOOL                        _encodesThumbnail;
+    BOOL                        _usesResampler;
+    CGImageRef                  _thumbnail;
+    NSData *                    _thumbnailPNGData;
+    NSError *                   _error;
+    BOOL                        _madeThumbnail;
+    BOOL                        _benchmarks;
+    NSTimeInterval              _kernelTime;
+    NSTimeInterval              _coreGraphicsTime;
+    double                      _peakSignalToNoiseRatio;
 }
 
 // Configures the operation to create a thumbnail based on the specified data,
 // which must be of type "image/jpeg" or "image/png".
 - (id)initWithImageData:(NSData *)imageData MIMEType:(NSString *)MIMEType;
 
+// Configures the operation to create a thumbnail based on the response of the 
+// specified HTTP operation, which it takes on as a dependency.  This lets you queue 
+// the fetch and the resize together, so that the resize starts as soon as the fetch 
+// finishes, without a trip through the main thread in between.  If the fetch fails 
+// or is cancelled, the resize fails with the same error.
+- (id)initWithImageDataOperation:(RetryingHTTPOperation *)imageDataOperation;
 
 // properties specified at init time
 
+@property (retain, readonly ) RetryingHTTPOperation *   imageDataOperation;
+
+// properties specified at init time, or taken from imageDataOperation once it's finished
+
 @property (copy,   readonly ) NSData *      imageData;
 @property (copy,   readonly ) NSString *    MIMEType;
 
 // properties that can be changed before starting the operation
 
 @property (assign, readwrite) CGFloat       thumbnailSize;      // defaults to 32.0f
+@property (assign, readwrite) BOOL          encodesThumbnail;   // defaults to NO; if YES, also fills in thumbnailPNGData
+@property (assign, readwrite) BOOL          usesResampler;      // defaults to NO; see below
+
+// If usesResampler is set, an operation that isn't in a batch makes its thumbnail with 
+// a ThumbnailResampler of its own rather than with Core Graphics.  That's for operations 
+// that can't be batched because their image data is still to arrive.
 
 // properties that are valid after the operation is finished
 
@@ -31,4 +59,67 @@
 
 @property (assign, readonly ) CGImageRef    thumbnail;
 
+// The PNG representation of thumbnail, if encodesThumbnail is set.  This is nil if 
+// ImageIO isn't available, in which case the client has to encode it on the main thread 
+// using UIImagePNGRepresentation.
+
+@property (copy,   readonly ) NSData *      thumbnailPNGData;
+
+// The error from imageDataOperation, if any.
+
+@property (copy,   readonly ) NSError *     error;
+
+@end
+
+// MakeThumbnailBatchOperation makes the thumbnails for a group of MakeThumbnailOperations 
+// in one go, sharing a ThumbnailResampler (and hence its scratch buffers) between them. 
+// Each MakeThumbnailOperation still runs, and still completes to its client in the usual 
+// way, but it depends on the batch, and when it finds the batch has already made its 
+// thumbnail its -main has nothing left to do.  A thumbnail the batch can't make with the 
+// resampler (for example, from an image smaller than the thumbnail) falls back to 
+// Core Graphics, as does any MakeThumbnailOperation that isn't in a batch (unless it 
+// sets usesResampler).
+//
+// You must add the MakeThumbnailOperations to the batch before queueing either them or 
+// the batch.  Only add operations whose image data is already in hand, that is, those 
+// with no imageDataOperation, or whose imageDataOperation has finished.  The batch 
+// doesn't wait for downloads; if it did, every thumbnail in it would wait for the 
+// slowest one, retries and all.
+//
+// 批量生成缩略图, 共享缩小算法的缓冲区.
+
+@interface MakeThumbnailBatchOperation : NSOperation
+{
+    NSMutableArray *            _thumbnailOperations;
+    BOOL                        _benchmarks;
+    NSUInteger                  _thumbnailCount;
+    NSTimeInterval              _elapsedTime;
+    NSUInteger                  _benchmarkCount;
+    NSTimeInterval              _kernelTime;
+    NSTimeInterval              _coreGraphicsTime;
+    double                      _peakSignalToNoiseRatio;
+}
+
+- (void)addThumbnailOperation:(MakeThumbnailOperation *)operation;
+
+@property (copy,   readonly ) NSArray *         thumbnailOperations;
+
+// properties that can be changed before starting the operation
+
+// If benchmarks is set, each thumbnail is made both with the resampler and with Core 
+// Graphics, and the batch records how long each took and how close the results are.  
+// The resampler's thumbnail is the one that's used.
+
+@property (assign, readwrite) BOOL              benchmarks;
+
+// properties that are valid after the operation is finished
+
+@property (assign, readonly ) NSUInteger        thumbnailCount;             // thumbnails made
+@property (assign, readonly ) NSTimeInterval    elapsedTime;                // for the whole batch
+
+@property (assign, readonly ) NSUInteger        benchmarkCount;             // thumbnails made both ways
+@property (assign, readonly ) NSTimeInterval    kernelTime;                 // total, for those thumbnails
+@property (assign, readonly ) NSTimeInterval    coreGraphicsTime;           // ditto
+@property (assign, readonly ) double            peakSignalToNoiseRatio;     // mean, in dB, of the colour channels
+
 @end
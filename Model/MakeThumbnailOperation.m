@@ -1,17 +1,47 @@
 #import "MakeThumbnailOperation.h"
+#import "RetryingHTTPOperation.h"
+#import "MemoryBudget.h"
+#import "QTrace.h"
+#import "ThumbnailResampler.h"
+#import <ImageIO/ImageIO.h>
 
 /*
     o 本类继承自 NSOperation,  通过重写 main 方法 来定义自己的 NSOperation.
         这种方法非常简单，开发者不需要管理一些状态属性(例如isExecuting 和 isFinished )，当 main 方法返回的时候，这个NSOperation就结束了
  */
 
+@interface MakeThumbnailOperation ()
+
+// private properties, for MakeThumbnailBatchOperation
+
+@property (assign, readonly ) BOOL              madeThumbnail;
+@property (assign, readwrite) BOOL              benchmarks;
+@property (assign, readonly ) NSTimeInterval    kernelTime;
+@property (assign, readonly ) NSTimeInterval    coreGraphicsTime;
+@property (assign, readonly ) double            peakSignalToNoiseRatio;
+
+// forward declarations
+
+- (void)makeThumbnailWithResampler:(ThumbnailResampler *)resampler;
+
+@end
 
 @implementation MakeThumbnailOperation
 
 @synthesize imageData     = _imageData;
 @synthesize MIMEType      = _MIMEType;
+@synthesize imageDataOperation = _imageDataOperation;
 @synthesize thumbnailSize = _thumbnailSize;
+@synthesize encodesThumbnail = _encodesThumbnail;
+@synthesize usesResampler = _usesResampler;
 @synthesize thumbnail     = _thumbnail;
+@synthesize thumbnailPNGData = _thumbnailPNGData;
+@synthesize error         = _error;
+@synthesize madeThumbnail = _madeThumbnail;
+@synthesize benchmarks    = _benchmarks;
+@synthesize kernelTime    = _kernelTime;
+@synthesize coreGraphicsTime = _coreGraphicsTime;
+@synthesize peakSignalToNoiseRatio = _peakSignalToNoiseRatio;
 
 /*!
  *  初始化一个 resize operation
@@ -35,11 +65,29 @@
     return self;
 }
 
+- (id)initWithImageDataOperation:(RetryingHTTPOperation *)imageDataOperation
+{
+    assert(imageDataOperation != nil);
+    
+    self = [super init];
+    if (self != nil) {
+        self->_imageDataOperation = [imageDataOperation retain];
+        self->_thumbnailSize = 32.0f;
+        
+        // 依赖于 HTTP operation, 它完成以后本 operation 才会开始.
+        [self addDependency:imageDataOperation];
+    }
+    return self;
+}
+
 - (void)dealloc
 {
     CGImageRelease(self->_thumbnail);
     [self->_MIMEType release];
     [self->_imageData release];
+    [self->_imageDataOperation release];
+    [self->_thumbnailPNGData release];
+    [self->_error release];
     [super dealloc];
 }
 
@@ -47,9 +95,189 @@
 // 本方法,在本 operation 的实例添加的一个 queue 后调用执行
 - (void)main
 {
-    // Latch thumbnailSize for performance, and also to prevent it changing out from underneath us.
+    uint64_t                traceStartTime;
+    ThumbnailResampler *    resampler;
+
+    // If we're part of a batch, the batch has probably made our thumbnail already.
+    
+    if ( ! self.madeThumbnail ) {
+        traceStartTime = QTraceIsRecording() ? QTraceNow() : 0;
+        resampler = nil;
+        if (self.usesResampler) {
+            resampler = [[[ThumbnailResampler alloc] initWithThumbnailSize:(size_t) self.thumbnailSize] autorelease];
+        }
+        [self makeThumbnailWithResampler:resampler];
+        if ( (traceStartTime != 0) && QTraceIsRecording() ) {
+            [[QTrace trace] recordSpanNamed:"MakeThumbnailOperation" object:self startTime:traceStartTime];
+        }
+    }
+}
+
+static double PeakSignalToNoiseRatio(CGImageRef image1, CGImageRef image2)
+    // Returns the PSNR, in dB, of the colour channels of two 32-bit BGRA images of 
+    // the same size, capped at 99 dB (identical images have an infinite PSNR).
+{
+    double      result;
+    CFDataRef   data1;
+    CFDataRef   data2;
+    size_t      width;
+    size_t      height;
+    size_t      x;
+    size_t      y;
+    size_t      c;
+    double      squaredError;
+    double      diff;
+    const uint8_t * row1;
+    const uint8_t * row2;
+
+    assert(CGImageGetWidth(image1)  == CGImageGetWidth(image2) );
+    assert(CGImageGetHeight(image1) == CGImageGetHeight(image2));
+    assert(CGImageGetBitsPerPixel(image1) == 32);
+    assert(CGImageGetBitsPerPixel(image2) == 32);
+
+    result = 0.0;
+    width  = CGImageGetWidth(image1);
+    height = CGImageGetHeight(image1);
+
+    data1 = CGDataProviderCopyData(CGImageGetDataProvider(image1));
+    data2 = CGDataProviderCopyData(CGImageGetDataProvider(image2));
+    if ( (data1 != NULL) && (data2 != NULL) ) {
+        squaredError = 0.0;
+        for (y = 0; y < height; y++) {
+            row1 = CFDataGetBytePtr(data1) + (y * CGImageGetBytesPerRow(image1));
+            row2 = CFDataGetBytePtr(data2) + (y * CGImageGetBytesPerRow(image2));
+            for (x = 0; x < width; x++) {
+                // Bytes 0..2 are B, G and R; byte 3 is alpha, which is always opaque.
+                for (c = 0; c < 3; c++) {
+                    diff = (double) row1[x * 4 + c] - (double) row2[x * 4 + c];
+                    squaredError += diff * diff;
+                }
+            }
+        }
+        if (squaredError == 0.0) {
+            result = 99.0;
+        } else {
+            result = MIN(99.0, 10.0 * log10( (255.0 * 255.0) / (squaredError / (double) (width * height * 3)) ));
+        }
+    }
+    if (data1 != NULL) {
+        CFRelease(data1);
+    }
+    if (data2 != NULL) {
+        CFRelease(data2);
+    }
+    return result;
+}
+
+- (CGImageRef)createThumbnailWithCoreGraphicsFromImage:(CGImageRef)sourceImage
+    // Makes the thumbnail the original way, by having Core Graphics draw sourceImage 
+    // scaled into a thumbnailSize bitmap context.
+{
+    CGImageRef          result;
     CGFloat             thumbnailSize;
+
+    assert(sourceImage != NULL);
+
+    result = NULL;
     thumbnailSize = self.thumbnailSize;
+    
+    // Drawing the source image decodes all of it, which for a full size photo is by far 
+    // the biggest allocation we make, so we count it against the memory budget until 
+    // we're done with the image.
+    
+    long long           decodeBytes;
+    decodeBytes = (long long) CGImageGetWidth(sourceImage) * (long long) CGImageGetHeight(sourceImage) * 4;
+    [[MemoryBudget sharedBudget] adjustBytes:decodeBytes forSubsystem:kMemoryBudgetSubsystemThumbnailDecodes];
+    
+    // Render it to a bitmap context and then create an image from that context.
+    
+    static const CGFloat kWhite[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+    CGColorRef      white;
+    CGContextRef    context;
+    CGColorSpaceRef space;
+
+    space = CGColorSpaceCreateDeviceRGB();
+    assert(space != NULL);
+
+    white = CGColorCreate(space, kWhite);
+    assert(white != NULL);
+
+    // Create the context that's thumbnailSize x thumbnailSize.
+    context = CGBitmapContextCreate(NULL, thumbnailSize, thumbnailSize, 8, 0, space, kCGBitmapByteOrder32Little | kCGImageAlphaPremultipliedFirst);
+    if (context != NULL) {
+        CGRect  r;
+        
+        // Make sure anything we don't cover comes out white.  While the next 
+        // steps ensures that we cover the entire image, there's a possibility 
+        // that we're dealing with a transparent PNG.
+        
+        CGContextSetFillColorWithColor(context, white);
+        CGContextFillRect(context, CGRectMake(0.0f, 0.0f, thumbnailSize, thumbnailSize));
+
+        // Calculate the drawing rectangle so that the image fills the entire 
+        // thumbnail.  That is, for a tall image, we scale it so that the 
+        // width matches thumbnailSize and the it's centred vertically.  
+        // Similarly for a wide image.
+
+        r = CGRectZero;
+        r.size.width  = CGImageGetWidth(sourceImage);
+        r.size.height = CGImageGetHeight(sourceImage);
+        if (r.size.height > r.size.width) {
+            // tall image
+            r.size.height = (r.size.height / r.size.width) * thumbnailSize;
+            r.size.width  = thumbnailSize;
+            r.origin.y = - ((r.size.height - thumbnailSize) / 2);
+        } else {
+            // wide image
+            r.size.width  = (r.size.width / r.size.height) * thumbnailSize;
+            r.size.height = thumbnailSize;
+            r.origin.x = - ((r.size.width - thumbnailSize) / 2);
+        }
+        
+        // Draw the source image and get then create the thumbnail from the 
+        // context. 
+        
+        CGContextDrawImage(context, r, sourceImage);
+        
+        result = CGBitmapContextCreateImage(context);
+        assert(result != NULL);
+    }
+    
+    CGContextRelease(context);
+    CGColorSpaceRelease(space);
+    CGColorRelease(white);
+
+    [[MemoryBudget sharedBudget] adjustBytes:-decodeBytes forSubsystem:kMemoryBudgetSubsystemThumbnailDecodes];
+    
+    return result;
+}
+
+// Does the work for -main, or for MakeThumbnailBatchOperation, in which case resampler 
+// is the batch's resampler.
+- (void)makeThumbnailWithResampler:(ThumbnailResampler *)resampler
+{
+    assert( ! self.madeThumbnail );
+    self->_madeThumbnail = YES;
+    
+    // If we're chained to a fetch, pick up its results now that it's finished.  Cancellation 
+    // doesn't propagate through dependencies, so we have to check for that ourselves.
+    
+    if (self.imageDataOperation != nil) {
+        assert([self.imageDataOperation isFinished]);
+        if ( [self isCancelled] || [self.imageDataOperation isCancelled] ) {
+            self->_error = [[NSError alloc] initWithDomain:NSCocoaErrorDomain code:NSUserCancelledError userInfo:nil];
+        } else if (self.imageDataOperation.error != nil) {
+            self->_error = [self.imageDataOperation.error copy];
+        } else if ( (self.imageDataOperation.responseContent == nil) || (self.imageDataOperation.responseMIMEType == nil) ) {
+            self->_error = [[NSError alloc] initWithDomain:NSCocoaErrorDomain code:NSFileReadCorruptFileError userInfo:nil];
+        } else {
+            self->_imageData = [self.imageDataOperation.responseContent copy];
+            self->_MIMEType  = [self.imageDataOperation.responseMIMEType copy];
+        }
+        if (self->_error != nil) {
+            return;
+        }
+    }
 
     assert(self.imageData != nil);
     assert(self.MIMEType != nil);
@@ -68,68 +296,202 @@
         sourceImage = NULL;
     }
     
-    // Render it to a bitmap context and then create an image from that context.
+    // Make the thumbnail.  With a resampler, and if benchmarks is set, make it both ways 
+    // and keep the resampler's.  Each timing includes decoding the source.  The kernel 
+    // runs first, so if Core Graphics keeps anything from decoding the source the first 
+    // time, it's the Core Graphics timing that benefits.
     
     if (sourceImage != NULL) {
-        static const CGFloat kWhite[4] = {0.0f, 0.0f, 0.0f, 1.0f};
-        CGColorRef      white;
-        CGContextRef    context;
-        CGColorSpaceRef space;
-
-        space = CGColorSpaceCreateDeviceRGB();
-        assert(space != NULL);
-
-        white = CGColorCreate(space, kWhite);
-        assert(white != NULL);
-
-        // Create the context that's thumbnailSize x thumbnailSize.
-        context = CGBitmapContextCreate(NULL, thumbnailSize, thumbnailSize, 8, 0, space, kCGBitmapByteOrder32Little | kCGImageAlphaPremultipliedFirst);
-        if (context != NULL) {
-            CGRect  r;
+        if (resampler == nil) {
+            self->_thumbnail = [self createThumbnailWithCoreGraphicsFromImage:sourceImage];
+        } else if ( ! self.benchmarks ) {
+            self->_thumbnail = [resampler createThumbnailFromImage:sourceImage];
+            if (self->_thumbnail == NULL) {
+                self->_thumbnail = [self createThumbnailWithCoreGraphicsFromImage:sourceImage];
+            }
+        } else {
+            CFAbsoluteTime  startTime;
+            CGImageRef      coreGraphicsThumbnail;
             
-            // Make sure anything we don't cover comes out white.  While the next 
-            // steps ensures that we cover the entire image, there's a possibility 
-            // that we're dealing with a transparent PNG.
+            startTime = CFAbsoluteTimeGetCurrent();
+            self->_thumbnail = [resampler createThumbnailFromImage:sourceImage];
+            self->_kernelTime = CFAbsoluteTimeGetCurrent() - startTime;
+
+            startTime = CFAbsoluteTimeGetCurrent();
+            coreGraphicsThumbnail = [self createThumbnailWithCoreGraphicsFromImage:sourceImage];
+            self->_coreGraphicsTime = CFAbsoluteTimeGetCurrent() - startTime;
             
-            CGContextSetFillColorWithColor(context, white);
-            CGContextFillRect(context, CGRectMake(0.0f, 0.0f, thumbnailSize, thumbnailSize));
-
-            // Calculate the drawing rectangle so that the image fills the entire 
-            // thumbnail.  That is, for a tall image, we scale it so that the 
-            // width matches thumbnailSize and the it's centred vertically.  
-            // Similarly for a wide image.
-
-            r = CGRectZero;
-            r.size.width  = CGImageGetWidth(sourceImage);
-            r.size.height = CGImageGetWidth(sourceImage);
-            if (r.size.height > r.size.width) {
-                // tall image
-                r.size.height = (r.size.height / r.size.width) * thumbnailSize;
-                r.size.width  = thumbnailSize;
-                r.origin.y = - ((r.size.height - thumbnailSize) / 2);
+            if ( (self->_thumbnail != NULL) && (coreGraphicsThumbnail != NULL) ) {
+                self->_peakSignalToNoiseRatio = PeakSignalToNoiseRatio(self->_thumbnail, coreGraphicsThumbnail);
+                CGImageRelease(coreGraphicsThumbnail);
             } else {
-                // wide image
-                r.size.width  = (r.size.width / r.size.height) * thumbnailSize;
-                r.size.height = thumbnailSize;
-                r.origin.x = - ((r.size.width - thumbnailSize) / 2);
+                // The resampler couldn't do it, so this one isn't a benchmark.
+                self->_kernelTime       = 0.0;
+                self->_coreGraphicsTime = 0.0;
+                if (self->_thumbnail == NULL) {
+                    self->_thumbnail = coreGraphicsThumbnail;
+                } else {
+                    CGImageRelease(coreGraphicsThumbnail);
+                }
             }
-            
-            // Draw the source image and get then create the thumbnail from the 
-            // context. 
-            
-            CGContextDrawImage(context, r, sourceImage);
-            
-            self->_thumbnail = CGBitmapContextCreateImage(context);
-            assert(self->_thumbnail != NULL);
         }
-        
-        CGContextRelease(context);
-        CGColorSpaceRelease(space);
-        CGColorRelease(white);
     }
 
     CGImageRelease(sourceImage);
     CGDataProviderRelease(provider);
+    
+    // Encode the thumbnail here, rather than leaving it to the main thread.  ImageIO is 
+    // weak linked; without it, the client falls back to UIImagePNGRepresentation.
+    
+    if ( self.encodesThumbnail && (self->_thumbnail != NULL) && (&CGImageDestinationCreateWithData != NULL) ) {
+        NSMutableData *         data;
+        CGImageDestinationRef   destination;
+        
+        data = [NSMutableData data];
+        assert(data != nil);
+        
+        destination = CGImageDestinationCreateWithData( (CFMutableDataRef) data, CFSTR("public.png"), 1, NULL);
+        if (destination != NULL) {
+            CGImageDestinationAddImage(destination, self->_thumbnail, NULL);
+            if ( CGImageDestinationFinalize(destination) ) {
+                self->_thumbnailPNGData = [data copy];
+            }
+            CFRelease(destination);
+        }
+    }
+}
+
+@end
+
+@interface MakeThumbnailBatchOperation ()
+
+// read/write versions of public properties
+
+@property (assign, readwrite) NSUInteger        thumbnailCount;
+@property (assign, readwrite) NSTimeInterval    elapsedTime;
+@property (assign, readwrite) NSUInteger        benchmarkCount;
+@property (assign, readwrite) NSTimeInterval    kernelTime;
+@property (assign, readwrite) NSTimeInterval    coreGraphicsTime;
+@property (assign, readwrite) double            peakSignalToNoiseRatio;
+
+@end
+
+@implementation MakeThumbnailBatchOperation
+
+@synthesize benchmarks       = _benchmarks;
+@synthesize thumbnailCount   = _thumbnailCount;
+@synthesize elapsedTime      = _elapsedTime;
+@synthesize benchmarkCount   = _benchmarkCount;
+@synthesize kernelTime       = _kernelTime;
+@synthesize coreGraphicsTime = _coreGraphicsTime;
+@synthesize peakSignalToNoiseRatio = _peakSignalToNoiseRatio;
+
+- (id)init
+{
+    self = [super init];
+    if (self != nil) {
+        self->_thumbnailOperations = [[NSMutableArray alloc] init];
+        assert(self->_thumbnailOperations != nil);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self->_thumbnailOperations release];
+    [super dealloc];
+}
+
+- (NSArray *)thumbnailOperations
+{
+    NSArray *   result;
+    
+    @synchronized (self) {
+        result = [[self->_thumbnailOperations copy] autorelease];
+    }
+    return result;
+}
+
+- (void)addThumbnailOperation:(MakeThumbnailOperation *)operation
+{
+    assert(operation != nil);
+    assert( ! [self isExecuting] && ! [self isFinished] );
+    
+    // The image data must already be in hand; see the comment in the header.  Each 
+    // thumbnail operation can't finish until the batch has made its thumbnail.
+    
+    assert( (operation.imageDataOperation == nil) || [operation.imageDataOperation isFinished] );
+    [operation addDependency:self];
+    @synchronized (self) {
+        [self->_thumbnailOperations addObject:operation];
+    }
+}
+
+- (void)main
+{
+    uint64_t                traceStartTime;
+    CFAbsoluteTime          startTime;
+    ThumbnailResampler *    resampler;
+    NSUInteger              thumbnailCount;
+    NSUInteger              benchmarkCount;
+    NSTimeInterval          kernelTime;
+    NSTimeInterval          coreGraphicsTime;
+    double                  totalPSNR;
+    
+    traceStartTime = QTraceIsRecording() ? QTraceNow() : 0;
+    startTime = CFAbsoluteTimeGetCurrent();
+    
+    resampler = nil;
+    thumbnailCount   = 0;
+    benchmarkCount   = 0;
+    kernelTime       = 0.0;
+    coreGraphicsTime = 0.0;
+    totalPSNR        = 0.0;
+    for (MakeThumbnailOperation * operation in self.thumbnailOperations) {
+        ThumbnailResampler *    resamplerForOperation;
+        
+        // A cancelled operation will never run its -main, so there's no point making 
+        // its thumbnail.
+        
+        if ( [self isCancelled] || [operation isCancelled] ) {
+            continue;
+        }
+        
+        // All the thumbnails in a batch are typically the same size, but if one 
+        // isn't, it goes the Core Graphics route rather than upsetting the resampler.
+        
+        if (resampler == nil) {
+            resampler = [[[ThumbnailResampler alloc] initWithThumbnailSize:(size_t) operation.thumbnailSize] autorelease];
+        }
+        if ( (resampler != nil) && (resampler.thumbnailSize == (size_t) operation.thumbnailSize) ) {
+            resamplerForOperation = resampler;
+        } else {
+            resamplerForOperation = nil;
+        }
+        
+        operation.benchmarks = self.benchmarks;
+        [operation makeThumbnailWithResampler:resamplerForOperation];
+        if (operation.thumbnail != NULL) {
+            thumbnailCount += 1;
+        }
+        if (operation.kernelTime > 0.0) {
+            benchmarkCount   += 1;
+            kernelTime       += operation.kernelTime;
+            coreGraphicsTime += operation.coreGraphicsTime;
+            totalPSNR        += operation.peakSignalToNoiseRatio;
+        }
+    }
+    
+    self.thumbnailCount   = thumbnailCount;
+    self.elapsedTime      = CFAbsoluteTimeGetCurrent() - startTime;
+    self.benchmarkCount   = benchmarkCount;
+    self.kernelTime       = kernelTime;
+    self.coreGraphicsTime = coreGraphicsTime;
+    self.peakSignalToNoiseRatio = (benchmarkCount == 0) ? 0.0 : (totalPSNR / (double) benchmarkCount);
+    
+    if ( (traceStartTime != 0) && QTraceIsRecording() ) {
+        [[QTrace trace] recordSpanNamed:"MakeThumbnailBatchOperation" object:self startTime:traceStartTime];
+    }
 }
 
 @end
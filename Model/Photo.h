@@ -1,5 +1,6 @@
 #import <CoreData/CoreData.h>
 #import <UIKit/UIKit.h>
+#import <ImageIO/ImageIO.h>
 
 // When trying to figure out Core Data issues, it's useful to know what photo ID a 
 // particular Photo object corresponds to, even if Core Data has forgetten that 
@@ -14,8 +15,12 @@
 extern const CGFloat kThumbnailSize;
 
 @class Thumbnail;
+@class QRunLoopOperation;
 @class RetryingHTTPOperation;
 @class MakeThumbnailOperation;
+@class ProgressiveImageOperation;
+@class PhotoTileOperation;
+@class PhotoDecodeOperation;
 
 @interface Photo : NSManagedObject  
 {
@@ -26,11 +31,27 @@ extern const CGFloat kThumbnailSize;
     
     UIImage *                   _thumbnailImage;
     BOOL                        _thumbnailImageIsPlaceholder;
+    BOOL                        _thumbnailImageEvicted;
+    long long                   _thumbnailImageBytes;   // bytes of _thumbnailImage reported to MemoryBudget
     RetryingHTTPOperation *     _thumbnailGetOperation;
     MakeThumbnailOperation *    _thumbnailResizeOperation;
-    RetryingHTTPOperation *     _photoGetOperation;
+    BOOL                        _thumbnailGetIsBatched; // waiting for a PhotoGalleryContext thumbnail batch
+    NSTimeInterval              _thumbnailMainThreadTime;
+    QRunLoopOperation *         _photoGetOperation;     // RetryingHTTPOperation or SegmentedHTTPOperation
     NSString *                  _photoGetFilePath;
     NSUInteger                  _photoNeededAssertions; //一个标识数,表示此 Photo 对象的大图是否是在展示中
+    BOOL                        _photoGetIsPrefetch;
+    NSDictionary *              _photoGetVariant;
+    BOOL                        _photoGetIsUpgrade;
+    NSDate *                    _photoGetStartDate;
+    NSString *                  _photoGetStoreBlobName;
+    UIImage *                   _partialPhotoImage;
+    long long                   _partialPhotoImageBytes;
+    CGImageSourceRef            _partialPhotoSource;
+    NSTimer *                   _partialPhotoTimer;
+    ProgressiveImageOperation * _partialPhotoOperation;
+    PhotoTileOperation *        _photoTileOperation;
+    PhotoDecodeOperation *      _photoDecodeOperation;
     NSError *                   _photoGetError;
 }
 
@@ -81,11 +102,47 @@ extern const CGFloat kThumbnailSize;
 // observable, returns a placeholder if the thumbnail isn't available yet.
 @property (nonatomic, retain, readonly ) UIImage *      thumbnailImage;
 
+// Drops the decoded thumbnail image, if it can be recreated from the database, to free 
+// up memory.  The next access to thumbnailImage decodes it again.  This doesn't change 
+// the value of thumbnailImage (just how we get it), so there's no KVO notification. 
+// Returns the number of bytes freed.  See MemoryBudget.
+- (long long)evictThumbnailImage;
+
+// Called by PhotoGalleryContext when a batched thumbnail get (see 
+// -[PhotoGalleryContext addPhotoToThumbnailGetBatch:]) delivers this photo's thumbnail data, 
+// or finishes without it, in which case the photo gets its thumbnail on its own.
+- (void)thumbnailGetBatchDidReceiveData:(NSData *)data MIMEType:(NSString *)MIMEType;
+- (void)thumbnailGetBatchDidFail;
+
 
 // observable, returns nil if the photo isn't available yet
 // 被 PhotoDetailViewController 类所监控,用于判断是否显示大图,或者 loading 信息
+//
+// While the photo is being downloaded for someone who has asserted that they need it, this 
+// returns a partially decoded, reduced resolution version of the photo that's updated every 
+// so often as more data arrives.  The partial image has the same size (in points) as the 
+// full image will have, so it can be replaced without disturbing the layout.
+//
+// Once the photo is downloaded and someone has asserted that they need it, the Photo 
+// object decodes it on the CPU queue (see PhotoDecodeOperation) into DecodedPhotoCache.  A 
+// prefetched photo isn't decoded until then, so that prefetching doesn't push the photos 
+// the user has just looked at out of the cache.  While 
+// that's in progress, photoDecoding is YES and this returns the partial image, if there is 
+// one, or nil; when it's done, this returns the decoded image (with a KVO notification), 
+// which displays without any decode work on the main thread.
 @property (nonatomic, retain, readonly ) UIImage *      photoImage;
 
+// observable, YES while the downloaded photo is being decoded for photoImage
+@property (nonatomic, assign, readonly ) BOOL           photoDecoding;
+
+
+// observable, absolute path of the directory containing the photo's tile pyramid (see 
+// PhotoTileOperation), or nil if there isn't one.  While someone has asserted that they 
+// need the photo, and the downloaded photo is large, the Photo object builds the tile 
+// pyramid in the background.  Clients that can display tiles should prefer them to 
+// photoImage, because then they don't need to decode the whole photo.
+@property (nonatomic, copy,   readonly ) NSString *     photoTilesPath;
+
 
 // The Photo object does not download the full photo (that is, photoImage) unless someone wants to 
 // display it.  Clients should register and unregister their interest in the full photo using these 
@@ -94,6 +151,32 @@ extern const CGFloat kThumbnailSize;
 - (void)assertPhotoNeeded;
 - (void)deassertPhotoNeeded;
 
+// Clients that expect to display the photo soon (see PhotoPrefetcher) can ask for it to be 
+// downloaded at low priority using -prefetchPhoto.  If someone subsequently asserts that 
+// they need the photo, the in-flight download is promoted to the normal high priority. 
+// -cancelPhotoPrefetch cancels the download if it was started by -prefetchPhoto and no 
+// one has asserted that they need the photo since; it returns the number of bytes that 
+// had been downloaded so far (and are now thrown away).
+
+- (void)prefetchPhoto;
+- (unsigned long long)cancelPhotoPrefetch;
+
+// The gallery XML can offer a photo in a number of variants (see kGalleryParserResultVariants). 
+// When it downloads the photo, the Photo object chooses the smallest variant that fills the 
+// screen, stepping down to a smaller variant if the estimated throughput to the server (see 
+// NetworkManager) means that the download would take too long.  With no estimate yet, it 
+// goes no higher than the middle variant, so that the first photos from a server aren't 
+// its originals.  If the user then zooms in, the client can call -upgradePhoto to download 
+// the next larger variant; when that completes, localPhotoPath changes (and with it 
+// photoImage and photoTilesPath) as it does for an update. 
+// -upgradePhoto does nothing if there's no larger variant, or if a get is already in progress.
+
+- (void)upgradePhoto;
+
+// The size of the downloaded photo file, or 0 if the photo hasn't been downloaded.
+
+@property (nonatomic, assign, readonly ) unsigned long long photoFileSize;
+
 // Status properties for the photo download operation.  Note that photoGetError is only really 
 // interesting if photoImage is nil (indicating that the photo hasn't been downloaded), 
 // photoGetting is NO (indicating that the photo is not in the process of being downloaded), 
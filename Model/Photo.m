@@ -3,9 +3,19 @@
 #import "Thumbnail.h"
 #import "PhotoGalleryContext.h"
 #import "MakeThumbnailOperation.h"
+#import "ProgressiveImageOperation.h"
+#import "PhotoTileOperation.h"
+#import "PhotoDecodeOperation.h"
 #import "NetworkManager.h"
+#import "GalleryParserOperation.h"
 #import "RetryingHTTPOperation.h"
+#import "SegmentedHTTPOperation.h"
 #import "QHTTPOperation.h"
+#import "QHTTPResponseCache.h"
+#import "PhotoStore.h"
+#import "MemoryBudget.h"
+#import "ThumbnailCache.h"
+#import "DecodedPhotoCache.h"
 #import "Logging.h"
 
 // After downloading a thumbnail this code automatically reduces the image to a square 
@@ -22,6 +32,54 @@
 
 const CGFloat kThumbnailSize = 60.0f;
 
+// While a photo that someone needs is downloading, we decode what's arrived so far at 
+// most this often, and at no more than this size.  The interval is a trade-off between 
+// how quickly the photo fills in and how much CPU we burn re-decoding it.
+
+static const NSTimeInterval kPartialPhotoUpdateInterval = 0.3;
+static const CGFloat        kPartialPhotoMaximumSize    = 1024.0f;
+
+// Photos that are bigger than this in either dimension get cut into tiles (see 
+// PhotoTileOperation) when someone needs them.  Smaller photos are cheap enough to 
+// decode in one go.
+
+static const CGFloat        kPhotoTileMinimumSize       = 1024.0f;
+
+// Downloaded photos are decoded for display at no more than this size.  Anything bigger 
+// gets tiles, which take over once they're built.
+
+static const CGFloat        kPhotoDecodeMaximumSize     = 1024.0f;
+
+// When choosing a photo variant, we step down to a smaller variant if, at the estimated 
+// throughput to the server, the one that fills the screen would take longer than this 
+// to download.
+
+static const NSTimeInterval kPhotoVariantDownloadBudget = 4.0;
+
+// The number of bytes that variant selection has saved in this session, relative to always 
+// downloading the "image" variant.  Upgrades count against this.  Main thread only.
+
+static long long            sPhotoVariantSavedBytes;
+
+// The total time the main thread has spent on getting thumbnails, and the number of thumbnails 
+// that it was spent on, so that we can log the average.  Main thread only.
+
+static NSTimeInterval       sThumbnailMainThreadTime;
+static NSUInteger           sThumbnailCount;
+
+// Returns the number of bytes of decoded pixels behind the image, for the memory budget.
+
+static long long BytesForImage(UIImage * image)
+{
+    CGImageRef  cgImage;
+    
+    cgImage = image.CGImage;
+    if (cgImage == NULL) {
+        return 0;
+    }
+    return (long long) CGImageGetBytesPerRow(cgImage) * (long long) CGImageGetHeight(cgImage);
+}
+
 @interface Photo ()
 
 // read/write versions of public properties
@@ -44,17 +102,41 @@ const CGFloat kThumbnailSize = 60.0f;
 @property (nonatomic, retain, readonly ) PhotoGalleryContext *      photoGalleryContext;
 @property (nonatomic, retain, readwrite) RetryingHTTPOperation *    thumbnailGetOperation;
 @property (nonatomic, retain, readwrite) MakeThumbnailOperation *   thumbnailResizeOperation;
-@property (nonatomic, retain, readwrite) RetryingHTTPOperation *    photoGetOperation;
+@property (nonatomic, retain, readwrite) QRunLoopOperation *        photoGetOperation;
 @property (nonatomic, copy,   readwrite) NSString *                 photoGetFilePath;
+@property (nonatomic, copy,   readwrite) NSDictionary *             photoGetVariant;
 @property (nonatomic, assign, readwrite) BOOL                       thumbnailImageIsPlaceholder;
+@property (nonatomic, copy,   readwrite) NSDate *                   photoGetStartDate;
+@property (nonatomic, copy,   readwrite) NSString *                 photoGetStoreBlobName;
+@property (nonatomic, retain, readwrite) NSTimer *                  partialPhotoTimer;
+@property (nonatomic, retain, readwrite) ProgressiveImageOperation * partialPhotoOperation;
+@property (nonatomic, retain, readwrite) PhotoTileOperation *       photoTileOperation;
+@property (nonatomic, retain, readwrite) PhotoDecodeOperation *     photoDecodeOperation;
 
 
 // forward declarations
+- (void)startThumbnailGetAllowingBatch:(BOOL)allowBatch;
+- (void)startThumbnailResizeWithData:(NSData *)data MIMEType:(NSString *)MIMEType encodesThumbnail:(BOOL)encodesThumbnail;
 - (void)updateThumbnail;
 - (void)updatePhoto;
-
+- (void)startPhotoGetWithPriority:(NSOperationQueuePriority)priority;
+- (void)startPhotoGetForVariant:(NSDictionary *)variant priority:(NSOperationQueuePriority)priority;
+- (void)startPartialPhoto;
+- (void)stopPartialPhotoClearingImage:(BOOL)clearImage;
+- (void)setPartialPhotoImageBytes:(long long)newValue;
+- (void)startPhotoTiles;
+- (void)stopPhotoTiles;
+- (void)startPhotoDecode;
+- (void)stopPhotoDecode;
+- (void)removePhotoTilesForLocalPhotoPath:(NSString *)localPhotoPath;
+- (NSString *)pathForLocalPhotoPath:(NSString *)localPhotoPath;
+- (BOOL)removeLocalPhotoPath:(NSString *)localPhotoPath;
+
+- (void)setThumbnailImageBytes:(long long)newValue;
 - (void)thumbnailCommitImage:(UIImage *)image isPlaceholder:(BOOL)isPlaceholder;
+- (void)thumbnailCommitImage:(UIImage *)image imageData:(NSData *)imageData isPlaceholder:(BOOL)isPlaceholder;
 - (void)thumbnailCommitImageData:(UIImage *)image;
+- (void)thumbnailCommitPNGData:(NSData *)imageData;
 
 @end
 
@@ -83,7 +165,14 @@ const CGFloat kThumbnailSize = 60.0f;
 @synthesize thumbnailImageIsPlaceholder = _thumbnailImageIsPlaceholder;  //一个开关标识,代表现在展示 thumbnail 的图片是不是 placeholder
 @synthesize photoGetOperation           = _photoGetOperation;
 @synthesize photoGetFilePath            = _photoGetFilePath; // 代表下载的大图,暂时存储在临时目录下的路径.
+@synthesize photoGetVariant             = _photoGetVariant;  // 正在下载的大图的 variant, nil 表示使用 remotePhotoPath
 @synthesize photoGetError               = _photoGetError;
+@synthesize photoGetStartDate           = _photoGetStartDate;     // 开始下载大图的时间, 用于计算 time-to-first-pixels
+@synthesize photoGetStoreBlobName       = _photoGetStoreBlobName; // 条件请求所对应的 PhotoStore 里已有的图片, 收到 304 就直接用它
+@synthesize partialPhotoTimer           = _partialPhotoTimer;     // 下载大图过程中, 定时解码已下载部分的 timer
+@synthesize partialPhotoOperation       = _partialPhotoOperation; // 正在解码已下载部分的 operation
+@synthesize photoTileOperation          = _photoTileOperation;    // 正在把大图切成 tiles 的 operation
+@synthesize photoDecodeOperation        = _photoDecodeOperation;  // 正在把已下载的大图解码成可直接显示的 bitmap 的 operation
 
 // 此方法在 PhotoGallery.m 中的 commitParserResults 方法中被调用.
 // 由新下载的 xml 文件中得到的 photo 信息,构建一个 photo 对象,并把它存入到 core data 中.
@@ -114,6 +203,7 @@ const CGFloat kThumbnailSize = 60.0f;
         result.date                = [[[properties objectForKey:@"date"] copy] autorelease];
         result.remotePhotoPath     = [[[properties objectForKey:@"remotePhotoPath"] copy] autorelease];
         result.remoteThumbnailPath = [[[properties objectForKey:@"remoteThumbnailPath"] copy] autorelease];
+        [result.photoGalleryContext setPhotoVariants:[properties objectForKey:@"variants"] forPhotoID:result.photoID];
     }
     return result;
 }
@@ -139,11 +229,22 @@ const CGFloat kThumbnailSize = 60.0f;
 #endif
  
     [self->_thumbnailImage release];
+    [self setThumbnailImageBytes:0];
     assert(self->_thumbnailGetOperation == nil);            // As far as I can tell there are only two ways for these objects to get deallocated, 
     assert(self->_thumbnailResizeOperation == nil);         // namely, the object being deleted and the entire managed object context going away 
     assert(self->_photoGetOperation == nil);                // (which turns the object into a fault).  In both cases -stop runs, which shuts down 
     assert(self->_photoGetFilePath == nil);                 // this stuff.  But the asserts are here, just to be sure.
+    assert(self->_partialPhotoTimer == nil);
+    assert(self->_partialPhotoOperation == nil);
+    assert(self->_partialPhotoSource == NULL);
+    assert(self->_photoTileOperation == nil);
+    assert(self->_photoDecodeOperation == nil);
     [self->_photoGetError release];
+    [self->_photoGetVariant release];
+    [self->_photoGetStartDate release];
+    [self->_photoGetStoreBlobName release];
+    [self->_partialPhotoImage release];
+    [self setPartialPhotoImageBytes:0];
     [super dealloc];
 }
 
@@ -160,6 +261,7 @@ const CGFloat kThumbnailSize = 60.0f;
     if ( ! [self.displayName isEqual:[properties objectForKey:@"displayName"]] ) {
         self.displayName = [[[properties objectForKey:@"displayName"] copy] autorelease];
     }
+    [self.photoGalleryContext setPhotoVariants:[properties objectForKey:@"variants"] forPhotoID:self.photoID];
     
     BOOL    thumbnailNeedsUpdate;
     BOOL    photoNeedsUpdate;
@@ -219,14 +321,38 @@ const CGFloat kThumbnailSize = 60.0f;
     // If we're currently fetching the photo, cancel that.
 
     if (self.photoGetOperation != nil) {
+        // We're typically called as the object is being deleted or turned into a fault, 
+        // so we drop the partial image without a KVO notification.
+        [self stopPartialPhotoClearingImage:NO];
+        [self->_partialPhotoImage release];
+        self->_partialPhotoImage = nil;
+        [self setPartialPhotoImageBytes:0];
         [[NetworkManager sharedManager] cancelOperation:self.photoGetOperation];
         self.photoGetOperation = nil;
+        self->_photoGetIsPrefetch = NO;
+        self.photoGetVariant = nil;
+        self->_photoGetIsUpgrade = NO;
+        self.photoGetStoreBlobName = nil;
         if (self.photoGetFilePath != nil) {
             (void) [[NSFileManager defaultManager] removeItemAtPath:self.photoGetFilePath error:NULL];
             self.photoGetFilePath = nil;
         }
         [[QLog log] logWithFormat:@"photo %@ photo get stopped", self.photoID];
     }
+    
+    // If we're currently cutting the photo into tiles, cancel that.
+    
+    if (self.photoTileOperation != nil) {
+        [self stopPhotoTiles];
+        [[QLog log] logWithFormat:@"photo %@ photo tiles stopped", self.photoID];
+    }
+    
+    // Likewise if we're decoding it.
+    
+    if (self.photoDecodeOperation != nil) {
+        [self stopPhotoDecode];
+        [[QLog log] logWithFormat:@"photo %@ photo decode stopped", self.photoID];
+    }
 }
 
 - (void)prepareForDeletion
@@ -246,9 +372,7 @@ const CGFloat kThumbnailSize = 60.0f;
     // Delete the photo file if it exists on disk.
     
     if (self.localPhotoPath != nil) {
-        success = [[NSFileManager defaultManager]
-                   removeItemAtPath:[self.photoGalleryContext.photosDirectoryPath stringByAppendingPathComponent:self.localPhotoPath]
-                   error:NULL];
+        success = [self removeLocalPhotoPath:self.localPhotoPath];
         
         assert(success);
     }
@@ -279,29 +403,103 @@ const CGFloat kThumbnailSize = 60.0f;
 // Starts the HTTP operation to GET the photo's thumbnail.
 - (void)startThumbnailGet
 {
+    [self startThumbnailGetAllowingBatch:YES];
+}
+
+// If allowBatch is YES, and the gallery supports it, the thumbnail is fetched along with 
+// others in a batch (see -[PhotoGalleryContext addPhotoToThumbnailGetBatch:]).  Otherwise, 
+// or if the batch doesn't deliver (see -thumbnailGetBatchDidFail), we get it on our own.
+// 如果 gallery 支持, 和其他 thumbnail 一起批量获取.
+- (void)startThumbnailGetAllowingBatch:(BOOL)allowBatch
+{
+    NSData *    cachedData;
+    BOOL        unfused;
+
     assert(self.remoteThumbnailPath != nil);
     assert(self.thumbnailGetOperation == nil);
     assert(self.thumbnailResizeOperation == nil);
+    assert( ! self->_thumbnailGetIsBatched );
    
     NSURLRequest * request = [self.photoGalleryContext requestToGetGalleryRelativeString:self.remoteThumbnailPath];
+    
+    // If another gallery has already fetched and resized this thumbnail, use its result. 
+    // 如果其他 gallery 已经获取过这个 thumbnail, 直接从共享的缓存里取.
+    cachedData = nil;
+    if (request != nil) {
+        cachedData = [[ThumbnailCache sharedCache] thumbnailDataForURL:[request URL]];
+    }
+    
     if (request == nil) {    
         [[QLog log] logWithFormat:@"%s photo %@ thumbnail get bad path '%@'",__PRETTY_FUNCTION__, self.photoID, self.remoteThumbnailPath];
         [self thumbnailCommitImage:nil isPlaceholder:YES];  //构造 NSURLRequest 对象失败,设置Placeholder图像.
+    } else if (cachedData != nil) {
+        [[QLog log] logWithFormat:@"%s photo %@ thumbnail cache hit '%@'",__PRETTY_FUNCTION__, self.photoID, self.remoteThumbnailPath];
+        [self thumbnailCommitImage:[UIImage imageWithData:cachedData] imageData:cachedData isPlaceholder:NO];
+    } else if ( allowBatch && [self.photoGalleryContext addPhotoToThumbnailGetBatch:self] ) {
+        [[QLog log] logWithFormat:@"%s photo %@ thumbnail batch get start '%@'",__PRETTY_FUNCTION__, self.photoID, self.remoteThumbnailPath];
+        self->_thumbnailGetIsBatched = YES;
+        [self.photoGalleryContext noteThumbnailGetStarted];
     } else {
         self.thumbnailGetOperation = [[[RetryingHTTPOperation alloc] initWithRequest:request] autorelease];
         assert(self.thumbnailGetOperation != nil);
         
         [self.thumbnailGetOperation setQueuePriority:NSOperationQueuePriorityLow];
         self.thumbnailGetOperation.acceptableContentTypes = [NSSet setWithObjects:@"image/jpeg", @"image/png", nil];
+        self.thumbnailGetOperation.responseCache = [QHTTPResponseCache sharedCache];
 
         [[QLog log] logWithFormat:@"%s photo %@ thumbnail get start '%@'",__PRETTY_FUNCTION__, self.photoID, self.remoteThumbnailPath];
         
+        // A get that's standing in for a failed batch carries on the batch's burst (see 
+        // -thumbnailGetBatchDidFail).
+        
+        if (allowBatch) {
+            [self.photoGalleryContext noteThumbnailGetStarted];
+        }
+        [self.photoGalleryContext noteThumbnailRequestStarted];
+        
         
         //对thumbnailGetOperation 的 hasHadRetryableFailure 属性添加一个监控.在第一次获取失败后,启用一个新的placehoder图片(Placeholder-Deferred.png),说明在重新获取图片.
         [self.thumbnailGetOperation addObserver:self forKeyPath:@"hasHadRetryableFailure" options:0 context:&self->_thumbnailImage];
         
-        //添加到 Runloop,并当完成 opertaion 后调用回调函数
-        [[NetworkManager sharedManager] addNetworkManagementOperation:self.thumbnailGetOperation finishedTarget:self action:@selector(thumbnailGetDone:)];
+        // Normally we queue the get and the resize together, with the resize depending on 
+        // the get, so the whole chain (fetch, resize, PNG encode) runs off the main thread, 
+        // and the main thread only sees the result in -thumbnailResizeDone:.  The debug-only 
+        // thumbnailUnfused preference reverts to queueing the resize from -thumbnailGetDone:, 
+        // for comparison.
+        // 默认把 get 和 resize 一起加入队列, resize 依赖于 get, 中间不用回到 main thread.
+        
+        unfused = NO;
+        #if ! defined(NDEBUG)
+            unfused = [[NSUserDefaults standardUserDefaults] boolForKey:@"thumbnailUnfused"];
+        #endif
+        if (unfused) {
+            //添加到 Runloop,并当完成 opertaion 后调用回调函数
+            [[NetworkManager sharedManager] addNetworkManagementOperation:self.thumbnailGetOperation finishedTarget:self action:@selector(thumbnailGetDone:) group:self.photoGalleryContext.operationGroup];
+        } else {
+            self.thumbnailResizeOperation = [[[MakeThumbnailOperation alloc] initWithImageDataOperation:self.thumbnailGetOperation] autorelease];
+            assert(self.thumbnailResizeOperation != nil);
+
+            self.thumbnailResizeOperation.thumbnailSize    = kThumbnailSize;
+            self.thumbnailResizeOperation.encodesThumbnail = YES;
+            if ( [self.thumbnailResizeOperation respondsToSelector:@selector(setThreadPriority:)] ) {
+                [self.thumbnailResizeOperation setThreadPriority:0.2];
+            }
+            [self.thumbnailResizeOperation setQueuePriority:NSOperationQueuePriorityLow];
+            
+            // This resize can't go in a batch, because a batch would hold it (and the rest 
+            // of the batch) until the get finishes, so it uses a resampler of its own.  The 
+            // debug-only thumbnailUnbatched preference makes it use Core Graphics, for 
+            // comparison.
+            
+            self.thumbnailResizeOperation.usesResampler = YES;
+            #if ! defined(NDEBUG)
+                self.thumbnailResizeOperation.usesResampler = ! [[NSUserDefaults standardUserDefaults] boolForKey:@"thumbnailUnbatched"];
+            #endif
+
+            // The get has no completion of its own; the resize picks up its result.
+            [[NetworkManager sharedManager] addNetworkManagementOperation:self.thumbnailGetOperation finishedTarget:nil action:NULL group:self.photoGalleryContext.operationGroup];
+            [[NetworkManager sharedManager] addCPUOperation:self.thumbnailResizeOperation finishedTarget:self action:@selector(thumbnailResizeDone:) group:self.photoGalleryContext.operationGroup];
+        }
     }
 }
 
@@ -312,6 +510,11 @@ const CGFloat kThumbnailSize = 60.0f;
     BOOL    didSomething;
     
     didSomething = NO;
+    if (self->_thumbnailGetIsBatched) {
+        [self.photoGalleryContext removePhotoFromThumbnailGetBatch:self];
+        self->_thumbnailGetIsBatched = NO;
+        didSomething = YES;
+    }
     if (self.thumbnailGetOperation != nil) { //网络获取 thumbnail 操作可以被取消
         
         //在 startThumbnailGet 中添加了对 RetryingHTTPOperation 类的此属性监控,用于展示一个新的 thumbnail placeholder deferred 图片,提示用户,图片获取在重新尝试中.
@@ -326,6 +529,9 @@ const CGFloat kThumbnailSize = 60.0f;
         self.thumbnailResizeOperation = nil;
         didSomething = YES;
     }
+    if (didSomething) {
+        [self.photoGalleryContext noteThumbnailGetStopped];
+    }
     return didSomething;
 }
 
@@ -362,6 +568,8 @@ const CGFloat kThumbnailSize = 60.0f;
 // If all is well, we start a resize operation to reduce it the appropriate size.
 - (void)thumbnailGetDone:(RetryingHTTPOperation *)operation
 {
+    NSDate *    startDate;
+
     assert([NSThread isMainThread]);
     assert([operation isKindOfClass:[RetryingHTTPOperation class]]);
     assert(operation == self.thumbnailGetOperation);
@@ -369,7 +577,10 @@ const CGFloat kThumbnailSize = 60.0f;
 
     assert(self.thumbnailResizeOperation == nil);  //此时应该还没有设置 resize operation
 
+    startDate = [NSDate date];
+    
     [[QLog log] logWithFormat:@"%s photo %@ thumbnail get done. %@",__PRETTY_FUNCTION__, self.photoID , operation.request.URL];
+    [self.photoGalleryContext noteResponseBytesFromCache:operation.responseBytesFromCache fromNetwork:operation.responseBytesFromNetwork];
     
     if (operation.error != nil) {
         [[QLog log] logWithFormat:@"photo %@ thumbnail get error %@", self.photoID, operation.error];
@@ -383,25 +594,88 @@ const CGFloat kThumbnailSize = 60.0f;
         // Got the data successfully.  Let's start the resize operation.
         // 开始 resize 操作
         
-        self.thumbnailResizeOperation = [[[MakeThumbnailOperation alloc] initWithImageData:operation.responseContent MIMEType:operation.responseMIMEType] autorelease];
-        assert(self.thumbnailResizeOperation != nil);
+        [self startThumbnailResizeWithData:operation.responseContent MIMEType:operation.responseMIMEType encodesThumbnail:NO];
+    }
+    
+    self->_thumbnailMainThreadTime += -[startDate timeIntervalSinceNow];
+}
 
-        self.thumbnailResizeOperation.thumbnailSize = kThumbnailSize; // MakeThumbnailOperation 类的thumbnailSize 默认为32.0f
-        
-        // We want thumbnails resizes to soak up(吸收) unused CPU time, but the main thread should
-        // always run if it can.  The operation priority is a relative value (courtesy of(由...提供) the
-        // underlying Mach THREAD_PRECEDENCE_POLICY), that is, it sets the priority relative 
-        // to other threads in the same process.  A value of 0.5 is the default, so we set a 
-        // value significantly lower than that.
-        
-        if ( [self.thumbnailResizeOperation respondsToSelector:@selector(setThreadPriority:)] ) {
-            [self.thumbnailResizeOperation setThreadPriority:0.2];
-        }
-        [self.thumbnailResizeOperation setQueuePriority:NSOperationQueuePriorityLow];
-        
-        
-        // 向 main thread 上添加任务
-        [[NetworkManager sharedManager] addCPUOperation:self.thumbnailResizeOperation finishedTarget:self action:@selector(thumbnailResizeDone:)];
+// Starts the operation to resize the thumbnail data that we've got, either from our own 
+// get or from a batch.  A batched thumbnail is encoded off the main thread like a fused 
+// one; the unfused path leaves the encoding to -thumbnailCommitImage:imageData:isPlaceholder:, 
+// as it always did, because it only exists for comparison.
+- (void)startThumbnailResizeWithData:(NSData *)data MIMEType:(NSString *)MIMEType encodesThumbnail:(BOOL)encodesThumbnail
+{
+    BOOL    unbatched;
+    
+    assert(data != nil);
+    assert(self.thumbnailResizeOperation == nil);
+    
+    self.thumbnailResizeOperation = [[[MakeThumbnailOperation alloc] initWithImageData:data MIMEType:MIMEType] autorelease];
+    assert(self.thumbnailResizeOperation != nil);
+
+    self.thumbnailResizeOperation.thumbnailSize = kThumbnailSize; // MakeThumbnailOperation 类的thumbnailSize 默认为32.0f
+    self.thumbnailResizeOperation.encodesThumbnail = encodesThumbnail;
+    
+    // We want thumbnails resizes to soak up(吸收) unused CPU time, but the main thread should
+    // always run if it can.  The operation priority is a relative value (courtesy of(由...提供) the
+    // underlying Mach THREAD_PRECEDENCE_POLICY), that is, it sets the priority relative 
+    // to other threads in the same process.  A value of 0.5 is the default, so we set a 
+    // value significantly lower than that.
+    
+    if ( [self.thumbnailResizeOperation respondsToSelector:@selector(setThreadPriority:)] ) {
+        [self.thumbnailResizeOperation setThreadPriority:0.2];
+    }
+    [self.thumbnailResizeOperation setQueuePriority:NSOperationQueuePriorityLow];
+    
+    // The debug-only thumbnailUnbatched preference leaves the resize to Core Graphics, for 
+    // comparison.
+    
+    unbatched = NO;
+    #if ! defined(NDEBUG)
+        unbatched = [[NSUserDefaults standardUserDefaults] boolForKey:@"thumbnailUnbatched"];
+    #endif
+    if ( ! unbatched ) {
+        [self.photoGalleryContext addThumbnailOperationToBatch:self.thumbnailResizeOperation];
+    }
+    
+    // 向 main thread 上添加任务
+    [[NetworkManager sharedManager] addCPUOperation:self.thumbnailResizeOperation finishedTarget:self action:@selector(thumbnailResizeDone:) group:self.photoGalleryContext.operationGroup];
+}
+
+// See comment in header.
+- (void)thumbnailGetBatchDidReceiveData:(NSData *)data MIMEType:(NSString *)MIMEType
+{
+    NSDate *    startDate;
+
+    assert([NSThread isMainThread]);
+    assert(data != nil);
+    assert(self->_thumbnailGetIsBatched);
+
+    startDate = [NSDate date];
+
+    [[QLog log] logWithFormat:@"%s photo %@ thumbnail batch part %zu bytes", __PRETTY_FUNCTION__, self.photoID, (size_t) [data length]];
+    self->_thumbnailGetIsBatched = NO;
+    [self startThumbnailResizeWithData:data MIMEType:MIMEType encodesThumbnail:YES];
+
+    self->_thumbnailMainThreadTime += -[startDate timeIntervalSinceNow];
+}
+
+// See comment in header.
+- (void)thumbnailGetBatchDidFail
+{
+    assert([NSThread isMainThread]);
+    assert(self->_thumbnailGetIsBatched);
+
+    [[QLog log] logWithFormat:@"%s photo %@ thumbnail batch missed, getting it on its own", __PRETTY_FUNCTION__, self.photoID];
+    self->_thumbnailGetIsBatched = NO;
+    [self startThumbnailGetAllowingBatch:NO];
+    
+    // If that didn't go to the network after all (because another gallery filled the 
+    // shared cache in the meantime), this get is over.
+    
+    if (self.thumbnailGetOperation == nil) {
+        [self.photoGalleryContext noteThumbnailGetStopped];
     }
 }
 
@@ -409,15 +683,24 @@ const CGFloat kThumbnailSize = 60.0f;
 // If all is well, we commit the thumbnail to our database.
 - (void)thumbnailResizeDone:(MakeThumbnailOperation *)operation
 {
+    NSDate *    startDate;
+    NSURL *     thumbnailURL;
+
     assert([NSThread isMainThread]);
     assert([operation isKindOfClass:[MakeThumbnailOperation class]]);
     assert(operation == self.thumbnailResizeOperation);
     assert([self.thumbnailResizeOperation isFinished]);
 
+    startDate = [NSDate date];
+
     [[QLog log] logWithFormat:@"%s photo %@ thumbnail resize done. %@", __PRETTY_FUNCTION__, self.photoID, self.thumbnailGetOperation.request.URL];
  
     UIImage *   image;
-    if (operation.thumbnail == NULL) {
+    if (operation.error != nil) {
+        // Only happens in the fused case, where the get failed before we got to resize.
+        [[QLog log] logWithFormat:@"photo %@ thumbnail get error %@", self.photoID, operation.error];
+        image = nil;
+    } else if (operation.thumbnail == NULL) {
         [[QLog log] logWithFormat:@"photo %@ thumbnail resize failed", self.photoID];
         image = nil;
     } else { //  resize operation 顺利完成
@@ -426,8 +709,34 @@ const CGFloat kThumbnailSize = 60.0f;
         assert(image != nil);
     }
     
-    [self thumbnailCommitImage:image isPlaceholder:NO];
+    // Share the result with any other gallery that shows the same thumbnail.  If the 
+    // thumbnail came from a batch, there's no get operation to tell us its URL.
+    if ( (image != nil) && (operation.thumbnailPNGData != nil) ) {
+        thumbnailURL = self.thumbnailGetOperation.request.URL;
+        if (thumbnailURL == nil) {
+            thumbnailURL = [[self.photoGalleryContext requestToGetGalleryRelativeString:self.remoteThumbnailPath] URL];
+        }
+        if (thumbnailURL != nil) {
+            [[ThumbnailCache sharedCache] setThumbnailData:operation.thumbnailPNGData forURL:thumbnailURL];
+        }
+    }
+    
+    [self thumbnailCommitImage:image imageData:operation.thumbnailPNGData isPlaceholder:NO];
     [self stopThumbnail]; //清理工作
+    
+    // Log how much main thread time this thumbnail cost, in both -thumbnailGetDone: (if 
+    // we're not fused) and here.
+    
+    self->_thumbnailMainThreadTime += -[startDate timeIntervalSinceNow];
+    sThumbnailMainThreadTime += self->_thumbnailMainThreadTime;
+    sThumbnailCount += 1;
+    [[QLog log] logOption:kLogOptionNetworkDetails withFormat:@"photo %@ thumbnail main thread time %.2f ms, average %.2f ms over %zu", 
+        self.photoID, 
+        self->_thumbnailMainThreadTime * 1000.0, 
+        (sThumbnailMainThreadTime / sThumbnailCount) * 1000.0, 
+        (size_t) sThumbnailCount
+    ];
+    self->_thumbnailMainThreadTime = 0.0;
 }
 
 // Commits the thumbnail image to the object itself and to the Core Data database.
@@ -436,6 +745,13 @@ const CGFloat kThumbnailSize = 60.0f;
 // 如果 placeholder 为 NO 的话, 会把 Image 存入到 CoreData.
 // 无论如何,本方法会更改 thumbnailImage 属性的值,导致监控本属性的 PhotoCell 类得到通知,更新 UI 上的照片.
 - (void)thumbnailCommitImage:(UIImage *)image isPlaceholder:(BOOL)isPlaceholder
+{
+    [self thumbnailCommitImage:image imageData:nil isPlaceholder:isPlaceholder];
+}
+
+// imageData, if not nil, is the PNG representation of image, which saves us having to 
+// encode it on the main thread.
+- (void)thumbnailCommitImage:(UIImage *)image imageData:(NSData *)imageData isPlaceholder:(BOOL)isPlaceholder
 {
     // If we were given no image, that's a shortcut for the bad image placeholder.  In 
     // that case we ignore the incoming value of placeholder and force it to YES.
@@ -454,6 +770,7 @@ const CGFloat kThumbnailSize = 60.0f;
     
     if ( ! isPlaceholder ) {
         [[QLog log] logWithFormat:@"%s photo %@ thumbnail commit to UI.%@",__PRETTY_FUNCTION__, self.photoID, self.thumbnailGetOperation.request.URL];
+        [self.photoGalleryContext noteThumbnailArrived];
     }
     
     // If we got a non-placeholder image, commit its PNG representation into our thumbnail database.
@@ -466,7 +783,17 @@ const CGFloat kThumbnailSize = 60.0f;
     
     //将不是 placeholder 的数据存入 Core Data
     if ( ! isPlaceholder ) {
-        if ( [[[NSRunLoop currentRunLoop] currentMode] isEqual:NSDefaultRunLoopMode] ) {
+        if (imageData != nil) {
+            if ( [[[NSRunLoop currentRunLoop] currentMode] isEqual:NSDefaultRunLoopMode] ) {
+                [self thumbnailCommitPNGData:imageData];
+            } else {
+                [self performSelector:@selector(thumbnailCommitPNGData:)
+                           withObject:imageData
+                           afterDelay:0.0
+                              inModes:[NSArray arrayWithObject:NSDefaultRunLoopMode]
+                 ];
+            }
+        } else if ( [[[NSRunLoop currentRunLoop] currentMode] isEqual:NSDefaultRunLoopMode] ) {
             [self thumbnailCommitImageData:image];
         } else {
             [self performSelector:@selector(thumbnailCommitImageData:)
@@ -481,6 +808,8 @@ const CGFloat kThumbnailSize = 60.0f;
     [self willChangeValueForKey:@"thumbnailImage"];
     [self->_thumbnailImage release];
     self->_thumbnailImage = [image retain];
+    self->_thumbnailImageEvicted = NO;
+    [self setThumbnailImageBytes:isPlaceholder ? 0 : BytesForImage(image)];
     [self  didChangeValueForKey:@"thumbnailImage"];
     
 }
@@ -491,6 +820,20 @@ const CGFloat kThumbnailSize = 60.0f;
 // 更新 thumbnail ,请调用 updateThumbnail 方法.
 - (void)thumbnailCommitImageData:(UIImage *)image
 {
+    // If we were running on iOS 4 or later we could get the PNG representation using
+    // ImageIO, but I want to maintain iOS 3 compatibility for the moment and on that
+    // system we have to use UIImagePNGRepresentation.  On systems that have ImageIO, 
+    // MakeThumbnailOperation does the encoding for us, and we go straight to 
+    // -thumbnailCommitPNGData:.
+    [self thumbnailCommitPNGData:UIImagePNGRepresentation(image)];
+}
+
+// Commits the PNG representation of the thumbnail to the Core Data database.
+// As with -thumbnailCommitImageData:, this only stores the data if thumbnail.imageData is nil.
+- (void)thumbnailCommitPNGData:(NSData *)imageData
+{
+    assert(imageData != nil);
+    
     [[QLog log] logWithFormat:@"%s photo %@ thumbnail commit image to CoreData. %@",__PRETTY_FUNCTION__, self.photoID ,self.thumbnailGetOperation.request.URL];
     
     // If we have no thumbnail object, create it.
@@ -503,11 +846,7 @@ const CGFloat kThumbnailSize = 60.0f;
     // Stash the data in the thumbnail object's imageData property.
     // 只有在 thumbnail.imageData为空时,才存入数据.
     if (self.thumbnail.imageData == nil) {
-        
-        // If we were running on iOS 4 or later we could get the PNG representation using
-        // ImageIO, but I want to maintain iOS 3 compatibility for the moment and on that
-        // system we have to use UIImagePNGRepresentation.
-        self.thumbnail.imageData = UIImagePNGRepresentation(image);
+        self.thumbnail.imageData = imageData;
         assert(self.thumbnail.imageData != nil);
     }
 }
@@ -526,12 +865,14 @@ const CGFloat kThumbnailSize = 60.0f;
             self.thumbnailImageIsPlaceholder = NO;
             self->_thumbnailImage = [[UIImage alloc] initWithData:self.thumbnail.imageData];
             assert(self->_thumbnailImage != nil);
+            self->_thumbnailImageEvicted = NO;
+            [self setThumbnailImageBytes:BytesForImage(self->_thumbnailImage)];
             
         } else { //刚刚初始化的对象,还没有从网络下载数据
             
             assert(self.thumbnailGetOperation    == nil);   // These should be nil because the only code paths that start 
             assert(self.thumbnailResizeOperation == nil);   // a get also ensure there's a thumbnail in place (either a 
-                                                            // placeholder or the old thumbnail).
+            assert( ! self->_thumbnailGetIsBatched );       // placeholder or the old thumbnail).
         
             // Otherwise, return the placeholder and kick off a get (unless we're already getting).
             self.thumbnailImageIsPlaceholder = YES;//暂时返回一个 PlaceHolder
@@ -549,12 +890,35 @@ const CGFloat kThumbnailSize = 60.0f;
 // 更新 thumbnail 的值为从网络下载的 xml 中的数据.
 - (void)updateThumbnail
 {
+    NSURLRequest *  request;
+
     [[QLog log] logWithFormat:@"%s photo %@ update thumbnail. %@",__PRETTY_FUNCTION__, self.photoID,self.thumbnailGetOperation.request.URL];
+    
+    // The thumbnail may have changed without its URL changing, so make sure the shared 
+    // cache doesn't hand us back the old one.
+    
+    request = [self.photoGalleryContext requestToGetGalleryRelativeString:self.remoteThumbnailPath];
+    if (request != nil) {
+        [[ThumbnailCache sharedCache] removeThumbnailDataForURL:[request URL]];
+    }
 
     // We only do an update if we've previously handed out(分发,公布) a thumbnail image.
     // If not, the thumbnail will be fetched normally when the client first requests an image.
     
-    if (self->_thumbnailImage != nil) {
+    if (self->_thumbnailImageEvicted) {
+    
+        // We handed out a thumbnail but have since evicted it (see -evictThumbnailImage). 
+        // There's nothing on hand to keep showing while a get runs, so just nix the stale 
+        // data; the next access to thumbnailImage will return a placeholder and kick off 
+        // the get.
+        
+        assert(self->_thumbnailImage == nil);
+        if (self.thumbnail != nil) {
+            self.thumbnail.imageData = nil;
+        }
+        self->_thumbnailImageEvicted = NO;
+    
+    } else if (self->_thumbnailImage != nil) {
     
         // If we're already getting a thumbnail, stop that get (it may be getting from the old path).
         (void) [self stopThumbnail];
@@ -574,6 +938,38 @@ const CGFloat kThumbnailSize = 60.0f;
 }
 
 
+// Records the size of the decoded thumbnail image with the memory budget.  Placeholders 
+// come from +[UIImage imageNamed:], which shares them, so they count as zero.
+- (void)setThumbnailImageBytes:(long long)newValue
+{
+    [[MemoryBudget sharedBudget] adjustBytes:newValue - self->_thumbnailImageBytes forSubsystem:kMemoryBudgetSubsystemThumbnailImages];
+    self->_thumbnailImageBytes = newValue;
+}
+
+// See comment in header.
+- (long long)evictThumbnailImage
+{
+    long long   result;
+    
+    assert([NSThread isMainThread]);
+    
+    // We can only evict a real thumbnail that we can decode again from the database, and 
+    // not while a get or resize is in flight, because their completion expects to replace 
+    // the existing image.
+    
+    result = 0;
+    if ( (self->_thumbnailImage != nil) && ! self.thumbnailImageIsPlaceholder 
+      && (self.thumbnail != nil) && (self.thumbnail.imageData != nil) 
+      && (self.thumbnailGetOperation == nil) && (self.thumbnailResizeOperation == nil) && ! self->_thumbnailGetIsBatched ) {
+        result = self->_thumbnailImageBytes;
+        [self->_thumbnailImage release];
+        self->_thumbnailImage = nil;
+        self->_thumbnailImageEvicted = YES;
+        [self setThumbnailImageBytes:0];
+    }
+    return result;
+}
+
 #pragma mark - Photos
 
 // PhotoDetailViewController 的 viewWillAppear 中调用
@@ -583,15 +979,273 @@ const CGFloat kThumbnailSize = 60.0f;
     self->_photoNeededAssertions += 1;
     if ( (self.localPhotoPath == nil) && ! self.photoGetting ) { //如果还没有下载的话
         [self startPhotoGet];
+    } else if (self->_photoGetIsPrefetch) {
+    
+        // The photo is being prefetched; now that someone actually needs it, promote 
+        // the get to the priority it would have had if we'd started it here.
+        
+        [[QLog log] logWithFormat:@"%s photo %@ photo prefetch promoted",__PRETTY_FUNCTION__, self.photoID];
+        self->_photoGetIsPrefetch = NO;
+        [self.photoGetOperation setQueuePriority:NSOperationQueuePriorityHigh];
+        [self startPartialPhoto];
+    }
+    
+    // If the photo is already on disk, make sure it's decoded and has tiles.
+    
+    if (self.localPhotoPath != nil) {
+        [self startPhotoDecode];
+        [self startPhotoTiles];
+    }
+}
+
+// 预先下载大图,在 PhotoPrefetcher 中被调用
+- (void)prefetchPhoto
+{
+    if ( (self.localPhotoPath == nil) && ! self.photoGetting ) {
+        [self startPhotoGetWithPriority:NSOperationQueuePriorityVeryLow];
+        self->_photoGetIsPrefetch = self.photoGetting;
     }
 }
 
+- (unsigned long long)cancelPhotoPrefetch
+{
+    unsigned long long  result;
+    NSDictionary *      attributes;
+    
+    result = 0;
+    if ( self->_photoGetIsPrefetch && (self->_photoNeededAssertions == 0) ) {
+        assert(self.photoGetOperation != nil);
+        assert(self.photoGetFilePath != nil);
+        
+        attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:self.photoGetFilePath error:NULL];
+        if (attributes != nil) {
+            result = [attributes fileSize];
+        }
+        [[QLog log] logWithFormat:@"%s photo %@ photo prefetch cancelled, %llu bytes discarded",__PRETTY_FUNCTION__, self.photoID, result];
+        
+        [[NetworkManager sharedManager] cancelOperation:self.photoGetOperation];
+        self.photoGetOperation = nil;
+        self->_photoGetIsPrefetch = NO;
+        self.photoGetVariant = nil;
+        self->_photoGetIsUpgrade = NO;
+        (void) [[NSFileManager defaultManager] removeItemAtPath:self.photoGetFilePath error:NULL];
+        self.photoGetFilePath = nil;
+    }
+    return result;
+}
+
+- (unsigned long long)photoFileSize
+{
+    unsigned long long  result;
+    NSDictionary *      attributes;
+    
+    result = 0;
+    if (self.localPhotoPath != nil) {
+        attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:[self pathForLocalPhotoPath:self.localPhotoPath] error:NULL];
+        if (attributes != nil) {
+            result = [attributes fileSize];
+        }
+    }
+    return result;
+}
+
 // Starts the HTTP operation to GET the photo itself.
 // 开始下载大图,在 assertPhotoNeeded 中被调用
 // 当前是在 main thread 上运行那个
 - (void)startPhotoGet
 {
-    NSURLRequest *      request;
+    [self startPhotoGetWithPriority:NSOperationQueuePriorityHigh];
+}
+
+// Returns the pixel area of a variant, or 0 if the XML didn't specify its dimensions.
+static double PixelAreaOfVariant(NSDictionary * variant)
+{
+    return [[variant objectForKey:kGalleryParserVariantWidth] doubleValue] * [[variant objectForKey:kGalleryParserVariantHeight] doubleValue];
+}
+
+static NSInteger CompareVariantsByPixelArea(id left, id right, void * context)
+{
+    double  leftArea;
+    double  rightArea;
+    #pragma unused(context)
+    
+    leftArea  = PixelAreaOfVariant(left);
+    rightArea = PixelAreaOfVariant(right);
+    if (leftArea < rightArea) {
+        return NSOrderedAscending;
+    } else if (leftArea > rightArea) {
+        return NSOrderedDescending;
+    }
+    return NSOrderedSame;
+}
+
+// Returns the variants of this photo that we might download instead of the photo at 
+// remotePhotoPath, smallest first.  We only consider variants whose dimensions we know, 
+// and we never consider the thumbnail, because the user is already looking at that.
+- (NSArray *)photoVariantCandidates
+{
+    NSMutableArray *    result;
+    
+    result = [NSMutableArray array];
+    assert(result != nil);
+    
+    for (NSDictionary * variant in [self.photoGalleryContext photoVariantsForPhotoID:self.photoID]) {
+        if ( (PixelAreaOfVariant(variant) > 0.0) && ! [[variant objectForKey:kGalleryParserVariantKind] isEqual:@"thumbnail"] ) {
+            [result addObject:variant];
+        }
+    }
+    [result sortUsingFunction:CompareVariantsByPixelArea context:NULL];
+    return result;
+}
+
+// Returns the variant at remotePhotoPath, that is, the one we'd have downloaded before we 
+// knew about variants, or nil if we don't know about it.
+- (NSDictionary *)defaultPhotoVariant
+{
+    for (NSDictionary * variant in [self.photoGalleryContext photoVariantsForPhotoID:self.photoID]) {
+        if ( [[variant objectForKey:kGalleryParserVariantPath] isEqual:self.remotePhotoPath] ) {
+            return variant;
+        }
+    }
+    return nil;
+}
+
+// Returns the size of the screen in pixels, which is the size we want the photo to fill.
++ (CGSize)photoTargetPixelSize
+{
+    CGSize      result;
+    UIScreen *  screen;
+    
+    screen = [UIScreen mainScreen];
+    result = screen.bounds.size;
+    if ( [screen respondsToSelector:@selector(scale)] ) {
+        result.width  *= screen.scale;
+        result.height *= screen.scale;
+    }
+    return result;
+}
+
+// Chooses the variant to download.  This is the smallest variant that fills the screen 
+// (in at least one dimension, because the scroll view fits the photo to the screen), 
+// stepping down to smaller variants while that would take longer than our budget at 
+// the estimated throughput to the server.  Until we have an estimate (that is, for the 
+// first photos from a server) we don't go above the middle candidate, so that a link 
+// we know nothing about isn't asked for the original; -upgradePhoto can always get a 
+// bigger one later.  Returns nil if we don't know about any variants, in which case 
+// the caller should use remotePhotoPath.
+- (NSDictionary *)chooseVariant
+{
+    NSDictionary *  result;
+    NSArray *       candidates;
+    NSUInteger      index;
+    CGSize          targetSize;
+    double          throughput;
+    double          size;
+    
+    result = nil;
+    candidates = [self photoVariantCandidates];
+    if ([candidates count] != 0) {
+        targetSize = [[self class] photoTargetPixelSize];
+        
+        for (index = 0; index < [candidates count] - 1; index++) {
+            NSDictionary *  variant;
+            
+            variant = [candidates objectAtIndex:index];
+            if ( ([[variant objectForKey:kGalleryParserVariantWidth] doubleValue] >= targetSize.width) || ([[variant objectForKey:kGalleryParserVariantHeight] doubleValue] >= targetSize.height) ) {
+                break;
+            }
+        }
+        
+        // If we have a throughput estimate, step down until the download fits in our budget.
+        
+        throughput = [[NetworkManager sharedManager] estimatedThroughputForHost:[[[self.photoGalleryContext requestToGetGalleryRelativeString:nil] URL] host]];
+        if (throughput > 0.0) {
+            while (index > 0) {
+                size = [[[candidates objectAtIndex:index] objectForKey:kGalleryParserVariantSize] doubleValue];
+                if ( size / throughput <= kPhotoVariantDownloadBudget ) {
+                    break;
+                }
+                index -= 1;
+            }
+        } else {
+            index = MIN(index, ([candidates count] - 1) / 2);
+        }
+        
+        result = [candidates objectAtIndex:index];
+    }
+    return result;
+}
+
+// Returns the pixel size of the downloaded photo, or CGSizeZero if it's not available. 
+// This only reads the image header, so it's cheap enough to do on the main thread.
+- (CGSize)localPhotoPixelSize
+{
+    CGSize              result;
+    CGImageSourceRef    source;
+    CFDictionaryRef     properties;
+    NSNumber *          width;
+    NSNumber *          height;
+    
+    // ImageIO is weak linked; if it's not available we just don't know.
+    
+    result = CGSizeZero;
+    if ( (self.localPhotoPath != nil) && (&CGImageSourceCreateWithURL != NULL) ) {
+        source = CGImageSourceCreateWithURL( (CFURLRef) [NSURL fileURLWithPath:[self pathForLocalPhotoPath:self.localPhotoPath]], NULL);
+        if (source != NULL) {
+            properties = CGImageSourceCopyPropertiesAtIndex(source, 0, NULL);
+            if (properties != NULL) {
+                width  = (NSNumber *) CFDictionaryGetValue(properties, kCGImagePropertyPixelWidth);
+                height = (NSNumber *) CFDictionaryGetValue(properties, kCGImagePropertyPixelHeight);
+                if ( (width != nil) && (height != nil) ) {
+                    result = CGSizeMake([width floatValue], [height floatValue]);
+                }
+                CFRelease(properties);
+            }
+            CFRelease(source);
+        }
+    }
+    return result;
+}
+
+- (void)upgradePhoto
+{
+    CGSize          currentSize;
+    NSDictionary *  upgrade;
+    
+    if ( (self.localPhotoPath != nil) && ! self.photoGetting ) {
+        currentSize = [self localPhotoPixelSize];
+        if (currentSize.width > 0.0f) {
+        
+            // Find the smallest variant that's bigger than what we have.
+            
+            upgrade = nil;
+            for (NSDictionary * variant in [self photoVariantCandidates]) {
+                if ( PixelAreaOfVariant(variant) > (double) currentSize.width * (double) currentSize.height ) {
+                    upgrade = variant;
+                    break;
+                }
+            }
+            if (upgrade != nil) {
+                [[QLog log] logWithFormat:@"%s photo %@ photo upgrade from %.0f x %.0f to '%@'", __PRETTY_FUNCTION__, self.photoID, currentSize.width, currentSize.height, [upgrade objectForKey:kGalleryParserVariantPath]];
+                [self startPhotoGetForVariant:upgrade priority:NSOperationQueuePriorityHigh];
+                self->_photoGetIsUpgrade = self.photoGetting;
+            }
+        }
+    }
+}
+
+- (void)startPhotoGetWithPriority:(NSOperationQueuePriority)priority
+{
+    [self startPhotoGetForVariant:[self chooseVariant] priority:priority];
+}
+
+- (void)startPhotoGetForVariant:(NSDictionary *)variant priority:(NSOperationQueuePriority)priority
+{
+    NSMutableURLRequest *   request;
+    NSString *              remotePath;
+    NSDictionary *          conditionalHeaders;
+    NSString *              storeBlobName;
+    BOOL                    useSegmented;
 
     assert(self.remotePhotoPath != nil);
     // assert(self.localPhotoPath  == nil);     -- May be non-nil when we're updating the photo.
@@ -602,11 +1256,16 @@ const CGFloat kThumbnailSize = 60.0f;
     
     self.photoGetError = nil;
     
-    //示例: self.remotePhotoPath = @"images/IMG_0125.JPG"
-    request = [self.photoGalleryContext requestToGetGalleryRelativeString:self.remotePhotoPath];
+    remotePath = [variant objectForKey:kGalleryParserVariantPath];
+    if (remotePath == nil) {
+        remotePath = self.remotePhotoPath;
+    }
+    
+    //示例: remotePath = @"images/IMG_0125.JPG"
+    request = [self.photoGalleryContext requestToGetGalleryRelativeString:remotePath];
     //示例:  request = { URL: http://Leo-MacBook-Pro.local:8888/TestGallery/images/IMG_0125.JPG }
     if (request == nil) {
-        [[QLog log] logWithFormat:@"%s photo %@ photo get bad path '%@'",__PRETTY_FUNCTION__, self.photoID, self.remotePhotoPath];
+        [[QLog log] logWithFormat:@"%s photo %@ photo get bad path '%@'",__PRETTY_FUNCTION__, self.photoID, remotePath];
         self.photoGetError = [NSError errorWithDomain:kQHTTPOperationErrorDomain code:400 userInfo:nil];
     } else {
 
@@ -617,32 +1276,107 @@ const CGFloat kThumbnailSize = 60.0f;
         //example :  self.photoGetFilePath = /private/var/mobile/Applications/8181B390-29AC-4311-B18B-E0992F70D8DC/tmp/PhotoTemp-418620304.233712971
         assert(self.photoGetFilePath != nil);
         
-        // Create, configure, and start the download operation.
-        self.photoGetOperation = [[[RetryingHTTPOperation alloc] initWithRequest:request] autorelease];
-        assert(self.photoGetOperation != nil);
+        // If the photo store already holds what we downloaded from this URL last time (perhaps 
+        // for another gallery), and it's the size the gallery says it should be, ask the server 
+        // to only send the photo if it's changed.  A 304 lets us skip the download entirely.
+        storeBlobName = nil;
+        conditionalHeaders = [[PhotoStore sharedStore] conditionalHeadersForURL:[request URL] 
+                                                                   expectedSize:[[variant objectForKey:kGalleryParserVariantSize] longLongValue] 
+                                                                       blobName:&storeBlobName];
+        if (conditionalHeaders != nil) {
+            for (NSString * headerField in conditionalHeaders) {
+                [request setValue:[conditionalHeaders objectForKey:headerField] forHTTPHeaderField:headerField];
+            }
+        }
+        self.photoGetStoreBlobName = storeBlobName;
         
-        [self.photoGetOperation setQueuePriority:NSOperationQueuePriorityHigh];
-        self.photoGetOperation.responseFilePath = self.photoGetFilePath; //设置 下载内容到文件 的路径, 在 RetryingHTTPOperation 的 startRequest 方法里会检测这个值.
-        self.photoGetOperation.acceptableContentTypes = [NSSet setWithObjects:@"image/jpeg", @"image/png", nil];
+        // Create, configure, and start the download operation.  The debug-only photoSegmentedGet 
+        // preference fetches large photos over several connections at once (see 
+        // SegmentedHTTPOperation), which helps on high latency links.  That rules out showing 
+        // the photo as it arrives, because it doesn't arrive in order.
+        
+        useSegmented = NO;
+        #if ! defined(NDEBUG)
+            useSegmented = [[NSUserDefaults standardUserDefaults] boolForKey:@"photoSegmentedGet"];
+        #endif
+        if (useSegmented) {
+            SegmentedHTTPOperation *    op;
+            
+            op = [[[SegmentedHTTPOperation alloc] initWithRequest:request] autorelease];
+            assert(op != nil);
+            op.responseFilePath       = self.photoGetFilePath;
+            op.computesResponseDigest = YES;
+            op.acceptableContentTypes = [NSSet setWithObjects:@"image/jpeg", @"image/png", nil];
+            op.expectedLength         = [[variant objectForKey:kGalleryParserVariantSize] longLongValue];
+            self.photoGetOperation = op;
+        } else {
+            RetryingHTTPOperation *     op;
+            
+            op = [[[RetryingHTTPOperation alloc] initWithRequest:request] autorelease];
+            assert(op != nil);
+            op.responseFilePath       = self.photoGetFilePath;  //设置 下载内容到文件 的路径, 在 RetryingHTTPOperation 的 startRequest 方法里会检测这个值.
+            op.computesResponseDigest = YES;                    //用内容的 SHA-1 在 PhotoStore 里找到相同的图片
+            op.acceptableContentTypes = [NSSet setWithObjects:@"image/jpeg", @"image/png", nil];
+            self.photoGetOperation = op;
+        }
+        
+        [self.photoGetOperation setQueuePriority:priority];
 
-        [[QLog log] logWithFormat:@"%s photo %@ photo get start '%@'",__PRETTY_FUNCTION__, self.photoID, self.remotePhotoPath];
+        [[QLog log] logWithFormat:@"%s photo %@ photo get start '%@'",__PRETTY_FUNCTION__, self.photoID, remotePath];
         
         // 添加到网络管理队列, 在其他队列里运行 get 操作
-        [[NetworkManager sharedManager] addNetworkManagementOperation:self.photoGetOperation finishedTarget:self action:@selector(photoGetDone:)];
+        [[NetworkManager sharedManager] addNetworkManagementOperation:self.photoGetOperation finishedTarget:self action:@selector(photoGetDone:) group:self.photoGalleryContext.operationGroup];
+        
+        self.photoGetStartDate = [NSDate date];
+        self.photoGetVariant   = variant;
+        self->_photoGetIsUpgrade = NO;
+        
+        // If someone is waiting to see this photo, show them what we can as it arrives.  If 
+        // we already have a photo (this is an update or an upgrade) they're looking at that.
+        if ( (self->_photoNeededAssertions != 0) && (self.localPhotoPath == nil) ) {
+            [self startPartialPhoto];
+        }
     }
 }
 
 // Called when the HTTP operation to GET the photo completes.
 // If all is well, we commit the photo to the database.
-- (void)photoGetDone:(RetryingHTTPOperation *)operation
+- (void)photoGetDone:(QRunLoopOperation *)operation
 {
+    // RetryingHTTPOperation and SegmentedHTTPOperation present their results the same 
+    // way, so we talk to whichever one it is via id.
+    id          getOperation;
+    
     assert([NSThread isMainThread]);
-    assert([operation isKindOfClass:[RetryingHTTPOperation class]]);
+    assert([operation isKindOfClass:[RetryingHTTPOperation class]] || [operation isKindOfClass:[SegmentedHTTPOperation class]]);
     assert(operation == self.photoGetOperation);
+    getOperation = operation;
 
     [[QLog log] logWithFormat:@"%s photo %@ photo get done '%@'",__PRETTY_FUNCTION__, self.photoID,self.remotePhotoPath];
     
-    if (operation.error != nil) {
+    // Shut down the partial decode.  If the get worked, we keep showing the partial image 
+    // until the real one has been decoded (see -photoDecodeDone:), so the user never sees 
+    // a gap; otherwise we get rid of it below.
+    [self stopPartialPhotoClearingImage:NO];
+    
+    NSString *  fileName;
+    NSError *   error;
+    BOOL        success;
+    
+    fileName = nil;
+    error    = nil;
+    success  = NO;
+    if ( (operation.error != nil) && (self.photoGetStoreBlobName != nil) && [[operation.error domain] isEqual:kQHTTPOperationErrorDomain] && ([operation.error code] == 304) 
+      && [[NSFileManager defaultManager] fileExistsAtPath:[[PhotoStore sharedStore] pathForBlobName:self.photoGetStoreBlobName]] ) {
+        
+        // The server says the photo hasn't changed since we downloaded it into the photo store, 
+        // so we just take a reference to the copy we already have.  The check for the file 
+        // catches the case where the last reference to it went away while we were asking.
+        fileName = self.photoGetStoreBlobName;
+        [[PhotoStore sharedStore] retainBlobName:fileName owner:[self.photoGalleryContext.galleryCachePath lastPathComponent]];
+        [[PhotoStore sharedStore] noteSkippedDownloadOfBlobName:fileName];
+        success = YES;
+    } else if (operation.error != nil) {
         [[QLog log] logWithFormat:@"photo %@ photo get error %@", self.photoID, operation.error];
         self.photoGetError = operation.error;
     } else {
@@ -654,7 +1388,7 @@ const CGFloat kThumbnailSize = 60.0f;
         // Just to keep things sane, we set the file name extension based on the MIME type.
         NSString *  type;
         NSString *  extension;
-        type = operation.responseMIMEType;
+        type = [getOperation responseMIMEType];
         assert(type != nil);
         if ([type isEqual:@"image/png"]) {
             extension = @"png";
@@ -663,61 +1397,121 @@ const CGFloat kThumbnailSize = 60.0f;
             extension = @"jpg";
         }
         
-        // Move the file to the gallery's photo directory, and if that's successful, set localPhotoPath 
-        // to point to it.  We automatically rename the file to avoid conflicts.  Conflicts do happen 
-        // in day-to-day operations (specifically, in the case where we update a photo while actually 
-        // displaying that photo).
-        
-        // 这里在移动下载下来的缓存文件到存放图片的目录时,如果这个图片正在使用的话(比如正在查看),可能会有冲突,导致移动不成功.
-        // 所以这里设置了一个循环,去检查有没有移动成功,如果没有移动成功就尝试下一次,直到移动成功.或者如果连续100次移动不成功,就放弃了.
-        NSString *  fileName;
-        NSError *   error;
-        BOOL        success;
-        NSUInteger  fileCounter = 0;
-        do {
-            fileName = [NSString stringWithFormat:@"Photo-%@-%zu.%@", self.photoID, (size_t) fileCounter, extension];
-            assert(fileName != nil);
+        if ([getOperation responseDigest] != nil) {
             
-            success = [[NSFileManager defaultManager] moveItemAtPath:self.photoGetFilePath
-                                                              toPath:[self.photoGalleryContext.photosDirectoryPath stringByAppendingPathComponent:fileName]
-                                                               error:&error];
-            if ( success ) {
+            // Move the file into the photo store, which names it by its contents.  If the store 
+            // already has this photo, it just takes another reference to it.  Either way, 
+            // remember the server's validators so that next time we can ask whether it's changed.
+            fileName = [[PhotoStore sharedStore] addFileAtPath:self.photoGetFilePath 
+                                                        digest:[getOperation responseDigest] 
+                                                     extension:extension 
+                                                         owner:[self.photoGalleryContext.galleryCachePath lastPathComponent] 
+                                                         error:&error];
+            success = (fileName != nil);
+            if (success) {
                 self.photoGetFilePath = nil;
-                break;
-            }
-            fileCounter += 1;
-            if (fileCounter > 100) {
-                break;
+                [[PhotoStore sharedStore] noteBlobName:fileName forURL:[[getOperation request] URL] responseHeaders:[getOperation responseHeaders]];
             }
-        } while (YES);
-
-        // On success, update localPhotoPath to point to the newly downloaded photo 
-        // and then delete the previous photo (if any).
+        } else {
         
-        if (success) {
-            NSString *  oldLocalPhotoPath;
-            
-            oldLocalPhotoPath = [[self.localPhotoPath copy] autorelease];
+            // Move the file to the gallery's photo directory, and if that's successful, set localPhotoPath 
+            // to point to it.  We automatically rename the file to avoid conflicts.  Conflicts do happen 
+            // in day-to-day operations (specifically, in the case where we update a photo while actually 
+            // displaying that photo).
             
-            [[QLog log] logWithFormat:@"%s big photo %@ photo get commit '%@'",__PRETTY_FUNCTION__, self.photoID, fileName];
-            self.localPhotoPath = fileName;
-            assert(self.photoGetError == nil);
-            
-            if (oldLocalPhotoPath != nil) { //说明原来就有这个图片,被新图片替换了
-                [[QLog log] logWithFormat:@"%s big photo %@ photo cleanup '%@'",__PRETTY_FUNCTION__, self.photoID, oldLocalPhotoPath];
-                (void) [[NSFileManager defaultManager]
-                        removeItemAtPath:[self.photoGalleryContext.photosDirectoryPath stringByAppendingPathComponent:oldLocalPhotoPath]
-                        error:NULL];
-            }
-        } else {
+            // 这里在移动下载下来的缓存文件到存放图片的目录时,如果这个图片正在使用的话(比如正在查看),可能会有冲突,导致移动不成功.
+            // 所以这里设置了一个循环,去检查有没有移动成功,如果没有移动成功就尝试下一次,直到移动成功.或者如果连续100次移动不成功,就放弃了.
+            NSUInteger  fileCounter = 0;
+            do {
+                fileName = [NSString stringWithFormat:@"Photo-%@-%zu.%@", self.photoID, (size_t) fileCounter, extension];
+                assert(fileName != nil);
+                
+                success = [[NSFileManager defaultManager] moveItemAtPath:self.photoGetFilePath
+                                                                  toPath:[self.photoGalleryContext.photosDirectoryPath stringByAppendingPathComponent:fileName]
+                                                                   error:&error];
+                if ( success ) {
+                    self.photoGetFilePath = nil;
+                    break;
+                }
+                fileCounter += 1;
+                if (fileCounter > 100) {
+                    break;
+                }
+            } while (YES);
+        }
+        
+        if ( ! success ) {
             assert(error != nil);
             [[QLog log] logWithFormat:@"%s photo %@ photo get commit failed %@",__PRETTY_FUNCTION__, self.photoID, error];
             self.photoGetError = error;
         }
     }
+
+    // On success, update localPhotoPath to point to the newly downloaded photo 
+    // and then delete the previous photo (if any).
+    
+    if (success) {
+        NSString *  oldLocalPhotoPath;
+        
+        oldLocalPhotoPath = [[self.localPhotoPath copy] autorelease];
+        
+        // Any tiles we're building, or decode we're doing, are for the old photo.
+        [self stopPhotoTiles];
+        [self stopPhotoDecode];
+        
+        [[QLog log] logWithFormat:@"%s big photo %@ photo get commit '%@', full image after %.3f s",__PRETTY_FUNCTION__, self.photoID, fileName, -[self.photoGetStartDate timeIntervalSinceNow]];
+        self.localPhotoPath = fileName;
+        assert(self.photoGetError == nil);
+        
+        // Account for the bytes that variant selection saved (or, for an upgrade, cost).
+        
+        if (self.photoGetVariant != nil) {
+            long long   variantSize;
+            long long   defaultSize;
+            
+            variantSize = [[self.photoGetVariant objectForKey:kGalleryParserVariantSize] longLongValue];
+            defaultSize = [[[self defaultPhotoVariant] objectForKey:kGalleryParserVariantSize] longLongValue];
+            if (self->_photoGetIsUpgrade) {
+                sPhotoVariantSavedBytes -= variantSize;
+            } else if ( (variantSize != 0) && (defaultSize != 0) ) {
+                sPhotoVariantSavedBytes += defaultSize - variantSize;
+            }
+            [[QLog log] logWithFormat:@"%s photo %@ photo variant '%@' %@ x %@, %lld bytes saved this session", __PRETTY_FUNCTION__, 
+                self.photoID, 
+                [self.photoGetVariant objectForKey:kGalleryParserVariantKind], 
+                [self.photoGetVariant objectForKey:kGalleryParserVariantWidth], 
+                [self.photoGetVariant objectForKey:kGalleryParserVariantHeight], 
+                sPhotoVariantSavedBytes
+            ];
+        }
+        
+        if (oldLocalPhotoPath != nil) { //说明原来就有这个图片,被新图片替换了
+            [[QLog log] logWithFormat:@"%s big photo %@ photo cleanup '%@'",__PRETTY_FUNCTION__, self.photoID, oldLocalPhotoPath];
+            (void) [self removeLocalPhotoPath:oldLocalPhotoPath];
+        }
+        
+        // If someone is looking at the photo, decode it and cut it into tiles.  We don't 
+        // decode a prefetched photo until someone asks for it (see -assertPhotoNeeded); 
+        // a decoded photo is up to 4 MB, and decoding prefetches ahead of time would push 
+        // the photos the user has just looked at out of DecodedPhotoCache.
+        if (self->_photoNeededAssertions != 0) {
+            [self startPhotoDecode];
+            [self startPhotoTiles];
+        }
+    }
+    
+    // If we're not decoding the photo (the get failed, or we decided not to bother), 
+    // there's nothing to replace the partial image, so get rid of it now.
+    if (self.photoDecodeOperation == nil) {
+        [self stopPartialPhotoClearingImage:YES];
+    }
     
     // Clean up.    
     self.photoGetOperation = nil;
+    self.photoGetVariant = nil;
+    self.photoGetStoreBlobName = nil;
+    self->_photoGetIsPrefetch = NO;
+    self->_photoGetIsUpgrade = NO;
     if (self.photoGetFilePath != nil) { //新下载的大图片还在临时目录下
         (void) [[NSFileManager defaultManager] removeItemAtPath:self.photoGetFilePath error:NULL];
         self.photoGetFilePath = nil;
@@ -727,7 +1521,7 @@ const CGFloat kThumbnailSize = 60.0f;
 //Foundation 框架提供的表示属性依赖的机制
 + (NSSet *)keyPathsForValuesAffectingPhotoImage
 {
-    return [NSSet setWithObject:@"localPhotoPath"];
+    return [NSSet setWithObjects:@"localPhotoPath", @"photoDecodeOperation", nil];
 }
 // 大图数据
 - (UIImage *)photoImage
@@ -739,16 +1533,44 @@ const CGFloat kThumbnailSize = 60.0f;
     // (by putting it into an image view, say).
     
     if (self.localPhotoPath == nil) {   //大图还没有被下载下来
-        result = nil;
+        result = self->_partialPhotoImage;
     } else {
-        result = [UIImage imageWithContentsOfFile:[self.photoGalleryContext.photosDirectoryPath stringByAppendingPathComponent:self.localPhotoPath]];
+        result = [[DecodedPhotoCache sharedCache] imageForPhotoPath:[self pathForLocalPhotoPath:self.localPhotoPath]];
         if (result == nil) {
-            [[QLog log] logWithFormat:@"photo %@ photo data bad", self.photoID];
+            if (self.photoDecodeOperation != nil) {
+            
+                // The decoded image isn't ready yet.  Don't hand out an image that would 
+                // be decoded on the main thread when it's drawn; the decode will trigger 
+                // a KVO notification when it's done.
+                
+                result = self->_partialPhotoImage;
+            } else {
+            
+                // We're not decoding it (no one has asserted that they need it, or ImageIO 
+                // isn't available, or the photoLazyDecode preference is set), so fall back to 
+                // a UIImage that decodes the file when it's first drawn.
+                
+                result = [UIImage imageWithContentsOfFile:[self pathForLocalPhotoPath:self.localPhotoPath]];
+                if (result == nil) {
+                    [[QLog log] logWithFormat:@"photo %@ photo data bad", self.photoID];
+                }
+            }
         }
     }
     return result;
 }
 
+//Foundation 框架提供的表示属性依赖的机制
++ (NSSet *)keyPathsForValuesAffectingPhotoDecoding
+{
+    return [NSSet setWithObject:@"photoDecodeOperation"];
+}
+
+- (BOOL)photoDecoding
+{
+    return (self.photoDecodeOperation != nil);
+}
+
 //Foundation 框架提供的表示属性依赖的机制
 + (NSSet *)keyPathsForValuesAffectingPhotoGetting
 {
@@ -766,6 +1588,350 @@ const CGFloat kThumbnailSize = 60.0f;
 {
     assert(self->_photoNeededAssertions != 0);
     self->_photoNeededAssertions -= 1;
+    
+    // If no one is looking any more, there's no point decoding the partial photo.  The 
+    // get itself carries on.
+    if (self->_photoNeededAssertions == 0) {
+        [self stopPartialPhotoClearingImage:YES];
+    }
+}
+
+#pragma mark - Partial photos
+
+// Starts decoding the photo as it downloads.  We do this on a timer, rather than each time 
+// data arrives, so that the decode cost is bounded no matter how fast the data arrives.
+- (void)startPartialPhoto
+{
+    assert(self.photoGetOperation != nil);
+    assert(self.photoGetFilePath != nil);
+
+    // CGImageSourceCreateIncremental is weak linked; if it's not available we just 
+    // show nothing until the download is complete, as before.  Likewise for a segmented 
+    // get, where the file is full size from the start and fills in out of order.
+    
+    if ( (self.partialPhotoTimer == nil) && (&CGImageSourceCreateIncremental != NULL) && ! [self.photoGetOperation isKindOfClass:[SegmentedHTTPOperation class]] ) {
+        assert(self->_partialPhotoSource == NULL);
+        self->_partialPhotoSource = CGImageSourceCreateIncremental(NULL);
+        assert(self->_partialPhotoSource != NULL);
+
+        self.partialPhotoTimer = [NSTimer scheduledTimerWithTimeInterval:kPartialPhotoUpdateInterval 
+                                                                  target:self 
+                                                                selector:@selector(partialPhotoTimerDidFire:) 
+                                                                userInfo:nil 
+                                                                 repeats:YES];
+        assert(self.partialPhotoTimer != nil);
+    }
+}
+
+// Records the size of the partial image with the memory budget.
+- (void)setPartialPhotoImageBytes:(long long)newValue
+{
+    [[MemoryBudget sharedBudget] adjustBytes:newValue - self->_partialPhotoImageBytes forSubsystem:kMemoryBudgetSubsystemPhotoImages];
+    self->_partialPhotoImageBytes = newValue;
+}
+
+// Stops decoding the photo as it downloads.  If clearImage is set, this also gets rid 
+// of the partial image (with a KVO notification for photoImage).
+- (void)stopPartialPhotoClearingImage:(BOOL)clearImage
+{
+    if (self.partialPhotoTimer != nil) {
+        [self.partialPhotoTimer invalidate];
+        self.partialPhotoTimer = nil;
+    }
+    if (self.partialPhotoOperation != nil) {
+        [[NetworkManager sharedManager] cancelOperation:self.partialPhotoOperation];
+        self.partialPhotoOperation = nil;
+    }
+    if (self->_partialPhotoSource != NULL) {
+        CFRelease(self->_partialPhotoSource);
+        self->_partialPhotoSource = NULL;
+    }
+    if ( clearImage && (self->_partialPhotoImage != nil) ) {
+        [self willChangeValueForKey:@"photoImage"];
+        [self->_partialPhotoImage release];
+        self->_partialPhotoImage = nil;
+        [self setPartialPhotoImageBytes:0];
+        [self  didChangeValueForKey:@"photoImage"];
+    }
+}
+
+// Called periodically while the photo downloads.  If we're not already decoding, start 
+// a decode of whatever has arrived so far.
+- (void)partialPhotoTimerDidFire:(NSTimer *)timer
+{
+    assert(timer == self.partialPhotoTimer);
+    #pragma unused(timer)
+    assert(self->_partialPhotoSource != NULL);
+    
+    if ( (self.partialPhotoOperation == nil) && (self.photoGetFilePath != nil) ) {
+        self.partialPhotoOperation = [[[ProgressiveImageOperation alloc] initWithImageSource:self->_partialPhotoSource filePath:self.photoGetFilePath] autorelease];
+        assert(self.partialPhotoOperation != nil);
+        
+        self.partialPhotoOperation.maximumSize = kPartialPhotoMaximumSize;
+        
+        [self.partialPhotoOperation setQueuePriority:NSOperationQueuePriorityHigh];
+        
+        [[NetworkManager sharedManager] addCPUOperation:self.partialPhotoOperation finishedTarget:self action:@selector(partialPhotoDone:) group:self.photoGalleryContext.operationGroup];
+    }
+}
+
+// Called when a partial decode completes.  If it produced anything, publish it.
+- (void)partialPhotoDone:(ProgressiveImageOperation *)operation
+{
+    UIImage *   image;
+    CGFloat     scale;
+
+    assert([NSThread isMainThread]);
+    assert([operation isKindOfClass:[ProgressiveImageOperation class]]);
+    assert(operation == self.partialPhotoOperation);
+
+    if ( (operation.image != NULL) && (self.localPhotoPath == nil) ) {
+    
+        // Give the partial image a scale such that its size in points is the pixel size of 
+        // the full image.  That way the image scroll view lays it out exactly as it will 
+        // lay out the final image.
+        
+        scale = (CGFloat) CGImageGetWidth(operation.image) / operation.fullSize.width;
+        image = [UIImage imageWithCGImage:operation.image scale:scale orientation:UIImageOrientationUp];
+        assert(image != nil);
+        
+        if (self->_partialPhotoImage == nil) {
+            [[QLog log] logWithFormat:@"%s photo %@ photo first pixels after %.3f s, %zu bytes", __PRETTY_FUNCTION__, self.photoID, -[self.photoGetStartDate timeIntervalSinceNow], (size_t) operation.bytesDecoded];
+        }
+        
+        [self willChangeValueForKey:@"photoImage"];
+        [self->_partialPhotoImage release];
+        self->_partialPhotoImage = [image retain];
+        [self setPartialPhotoImageBytes:BytesForImage(image)];
+        [self  didChangeValueForKey:@"photoImage"];
+    }
+    
+    self.partialPhotoOperation = nil;
+}
+
+#pragma mark - Photo decode
+
+// Starts decoding the downloaded photo for photoImage, unless it's already decoded or 
+// being decoded.  This is only called when someone is waiting to see the photo, so the 
+// decode runs at high priority.
+- (void)startPhotoDecode
+{
+    NSString *  photoPath;
+    BOOL        lazyDecode;
+    
+    assert(self.localPhotoPath != nil);
+    assert(self->_photoNeededAssertions != 0);
+    
+    photoPath = [self pathForLocalPhotoPath:self.localPhotoPath];
+    
+    // The debug-only photoLazyDecode preference reverts to letting UIKit decode the photo 
+    // on the main thread when it's first drawn, which is useful when measuring the 
+    // difference.  ImageIO is weak linked; without it we do the same.
+    
+    lazyDecode = NO;
+    #if ! defined(NDEBUG)
+        lazyDecode = [[NSUserDefaults standardUserDefaults] boolForKey:@"photoLazyDecode"];
+    #endif
+    if ( (self.photoDecodeOperation == nil) 
+      && (&CGImageSourceCreateWithURL != NULL) 
+      && ! lazyDecode
+      && ([[DecodedPhotoCache sharedCache] imageForPhotoPath:photoPath] == nil) ) {
+        self.photoDecodeOperation = [[[PhotoDecodeOperation alloc] initWithPhotoPath:photoPath] autorelease];
+        assert(self.photoDecodeOperation != nil);
+        
+        self.photoDecodeOperation.maximumSize = kPhotoDecodeMaximumSize;
+        
+        [self.photoDecodeOperation setQueuePriority:NSOperationQueuePriorityHigh];
+        
+        [[NetworkManager sharedManager] addCPUOperation:self.photoDecodeOperation finishedTarget:self action:@selector(photoDecodeDone:) group:self.photoGalleryContext.operationGroup];
+    }
+}
+
+- (void)stopPhotoDecode
+{
+    if (self.photoDecodeOperation != nil) {
+        [[NetworkManager sharedManager] cancelOperation:self.photoDecodeOperation];
+        self.photoDecodeOperation = nil;
+    }
+}
+
+// Called when the decode completes.  Puts the result into the cache and then, by clearing 
+// photoDecodeOperation, tells photoImage observers that the decoded image is available.
+- (void)photoDecodeDone:(PhotoDecodeOperation *)operation
+{
+    UIImage *   image;
+    CGFloat     scale;
+    
+    assert([NSThread isMainThread]);
+    assert([operation isKindOfClass:[PhotoDecodeOperation class]]);
+    assert(operation == self.photoDecodeOperation);
+    
+    if (operation.image == NULL) {
+        [[QLog log] logWithFormat:@"photo %@ photo decode failed", self.photoID];
+    } else {
+    
+        // As with the partial image, give the decoded image a scale such that its size in 
+        // points is the pixel size of the full photo, so it lays out the same way whether 
+        // or not it was reduced.
+        
+        scale = (CGFloat) CGImageGetWidth(operation.image) / operation.fullSize.width;
+        image = [UIImage imageWithCGImage:operation.image scale:scale orientation:UIImageOrientationUp];
+        assert(image != nil);
+        
+        [[DecodedPhotoCache sharedCache] setImage:image forPhotoPath:operation.photoPath];
+        
+        [[QLog log] logWithFormat:@"%s photo %@ photo decoded %zu x %zu", __PRETTY_FUNCTION__, self.photoID, CGImageGetWidth(operation.image), CGImageGetHeight(operation.image)];
+    }
+    
+    // The partial image has done its job.  We drop it silently, because the change of 
+    // photoDecodeOperation below covers photoImage.
+    
+    if (self->_partialPhotoImage != nil) {
+        [self->_partialPhotoImage release];
+        self->_partialPhotoImage = nil;
+        [self setPartialPhotoImageBytes:0];
+    }
+    
+    self.photoDecodeOperation = nil;
+}
+
+#pragma mark - Photo tiles
+
+// Returns the path of the tile directory for the photo at localPhotoPath.  There's one 
+// tile directory per photo file, so tiles for an old photo never get confused with tiles 
+// for a new one.
+- (NSString *)photoTilesPathForLocalPhotoPath:(NSString *)localPhotoPath
+{
+    assert(localPhotoPath != nil);
+    return [self.photoGalleryContext.tilesDirectoryPath stringByAppendingPathComponent:[localPhotoPath stringByDeletingPathExtension]];
+}
+
+//Foundation 框架提供的表示属性依赖的机制
++ (NSSet *)keyPathsForValuesAffectingPhotoTilesPath
+{
+    return [NSSet setWithObject:@"localPhotoPath"];
+}
+
+- (NSString *)photoTilesPath
+{
+    NSString *  result;
+    NSString *  path;
+    
+    // PhotoTileOperation only moves the tile directory into place once it's complete, so 
+    // if the info file is there we're good to go.
+    
+    result = nil;
+    if (self.localPhotoPath != nil) {
+        path = [self photoTilesPathForLocalPhotoPath:self.localPhotoPath];
+        if ( [[NSFileManager defaultManager] fileExistsAtPath:[path stringByAppendingPathComponent:kPhotoTileInfoFileName]] ) {
+            result = path;
+        }
+    }
+    return result;
+}
+
+// Returns YES if the downloaded photo is big enough to be worth cutting into tiles.
+- (BOOL)photoNeedsTiles
+{
+    CGSize  size;
+    
+    assert(self.localPhotoPath != nil);
+    
+    // ImageIO is weak linked; without it we can't build tiles, and we just display the 
+    // photo as a whole, as before.
+    
+    size = CGSizeZero;
+    if (&CGImageDestinationCreateWithURL != NULL) {
+        size = [self localPhotoPixelSize];
+    }
+    return (size.width > kPhotoTileMinimumSize) || (size.height > kPhotoTileMinimumSize);
+}
+
+// Starts cutting the downloaded photo into tiles, unless that's already done, already 
+// in progress, or not worth doing.
+- (void)startPhotoTiles
+{
+    assert(self.localPhotoPath != nil);
+    
+    if ( (self.photoTileOperation == nil) && (self.photoTilesPath == nil) && [self photoNeedsTiles] ) {
+        self.photoTileOperation = [[[PhotoTileOperation alloc] initWithPhotoPath:[self pathForLocalPhotoPath:self.localPhotoPath] 
+                                                               tileDirectoryPath:[self photoTilesPathForLocalPhotoPath:self.localPhotoPath]] autorelease];
+        assert(self.photoTileOperation != nil);
+        
+        // The user can see the whole photo in the meantime, so this can run behind the 
+        // partial photo decodes, but ahead of thumbnail resizes.
+        
+        [self.photoTileOperation setQueuePriority:NSOperationQueuePriorityNormal];
+
+        [[QLog log] logWithFormat:@"%s photo %@ photo tiles start", __PRETTY_FUNCTION__, self.photoID];
+        
+        [[NetworkManager sharedManager] addCPUOperation:self.photoTileOperation finishedTarget:self action:@selector(photoTilesDone:) group:self.photoGalleryContext.operationGroup];
+    }
+}
+
+- (void)stopPhotoTiles
+{
+    if (self.photoTileOperation != nil) {
+        [[NetworkManager sharedManager] cancelOperation:self.photoTileOperation];
+        self.photoTileOperation = nil;
+    }
+}
+
+// Called when the tile operation completes.  If it worked, photoTilesPath has gone from 
+// nil to the tile directory, so tell any observers.
+- (void)photoTilesDone:(PhotoTileOperation *)operation
+{
+    assert([NSThread isMainThread]);
+    assert([operation isKindOfClass:[PhotoTileOperation class]]);
+    assert(operation == self.photoTileOperation);
+    
+    if (operation.error != nil) {
+        [[QLog log] logWithFormat:@"photo %@ photo tiles error %@", self.photoID, operation.error];
+    } else {
+        [[QLog log] logWithFormat:@"%s photo %@ photo tiles done '%@'", __PRETTY_FUNCTION__, self.photoID, operation.tileDirectoryPath];
+        [self willChangeValueForKey:@"photoTilesPath"];
+        [self  didChangeValueForKey:@"photoTilesPath"];
+    }
+    self.photoTileOperation = nil;
+}
+
+- (void)removePhotoTilesForLocalPhotoPath:(NSString *)localPhotoPath
+{
+    (void) [[NSFileManager defaultManager] removeItemAtPath:[self photoTilesPathForLocalPhotoPath:localPhotoPath] error:NULL];
+}
+
+// Returns the absolute path of the photo file for localPhotoPath.  New photos live in the 
+// shared PhotoStore; photos downloaded before it existed are still in the gallery's Photos 
+// directory.
+- (NSString *)pathForLocalPhotoPath:(NSString *)localPhotoPath
+{
+    assert(localPhotoPath != nil);
+    if ([PhotoStore isBlobName:localPhotoPath]) {
+        return [[PhotoStore sharedStore] pathForBlobName:localPhotoPath];
+    }
+    return [self.photoGalleryContext.photosDirectoryPath stringByAppendingPathComponent:localPhotoPath];
+}
+
+// Gets rid of our photo file for localPhotoPath, and its tiles.  For a photo in the store 
+// that just drops our reference; the tiles stay if another photo in this gallery still 
+// refers to the same blob, because they're shared too.
+- (BOOL)removeLocalPhotoPath:(NSString *)localPhotoPath
+{
+    BOOL    success;
+    
+    assert(localPhotoPath != nil);
+    if ([PhotoStore isBlobName:localPhotoPath]) {
+        success = YES;
+        if ( ! [[PhotoStore sharedStore] releaseBlobName:localPhotoPath owner:[self.photoGalleryContext.galleryCachePath lastPathComponent]] ) {
+            [[DecodedPhotoCache sharedCache] removeImageForPhotoPath:[self pathForLocalPhotoPath:localPhotoPath]];
+            [self removePhotoTilesForLocalPhotoPath:localPhotoPath];
+        }
+    } else {
+        [[DecodedPhotoCache sharedCache] removeImageForPhotoPath:[self pathForLocalPhotoPath:localPhotoPath]];
+        success = [[NSFileManager defaultManager] removeItemAtPath:[self pathForLocalPhotoPath:localPhotoPath] error:NULL];
+        [self removePhotoTilesForLocalPhotoPath:localPhotoPath];
+    }
+    return success;
 }
 
 // Updates the photo is response to a change in the photo's XML entity.
@@ -782,8 +1948,9 @@ const CGFloat kThumbnailSize = 60.0f;
         // No one is actively looking at the photo.  If we have the photo downloaded, just forget about it.    
         if (self.localPhotoPath != nil) {
             [[QLog log] logWithFormat:@"photo %@ photo delete old photo '%@'", self.photoID, self.localPhotoPath];
-            [[NSFileManager defaultManager] removeItemAtPath:[self.photoGalleryContext.photosDirectoryPath stringByAppendingPathComponent:self.localPhotoPath]
-                                                       error:NULL];
+            [self stopPhotoTiles];
+            [self stopPhotoDecode];
+            (void) [self removeLocalPhotoPath:self.localPhotoPath];
             self.localPhotoPath = nil;
         }
         
@@ -791,8 +1958,13 @@ const CGFloat kThumbnailSize = 60.0f;
 
         // If we're already getting the photo, stop that get (it may be getting from the old path).
         if (self.photoGetOperation != nil) {
+            [self stopPartialPhotoClearingImage:YES];
             [[NetworkManager sharedManager] cancelOperation:self.photoGetOperation];
             self.photoGetOperation = nil;
+            self->_photoGetIsPrefetch = NO;
+            self.photoGetVariant = nil;
+            self->_photoGetIsUpgrade = NO;
+            self.photoGetStoreBlobName = nil;
         }
         
         // Someone is actively looking at the photo.  We start a new download, which 
@@ -0,0 +1,36 @@
+#import <Foundation/Foundation.h>
+#import <CoreGraphics/CoreGraphics.h>
+
+// PhotoDecodeOperation decodes a downloaded photo into a bitmap that's ready to display, 
+// that is, one that's already in the pixel format the display uses, so that drawing it 
+// on the main thread is just a copy.  Without this the decode happens on the main thread 
+// the first time the photo is drawn, which stalls the UI as the photo appears.
+//
+// Photos bigger than maximumSize in either dimension are decoded at a reduced size that 
+// fits, which for JPEG is much cheaper than decoding at full size and scaling down.
+
+@interface PhotoDecodeOperation : NSOperation
+{
+    NSString *      _photoPath;
+    CGFloat         _maximumSize;
+    CGSize          _fullSize;
+    CGImageRef      _image;
+}
+
+// Configures the operation to decode the photo at photoPath (which must be JPEG or PNG).
+- (id)initWithPhotoPath:(NSString *)photoPath;
+
+// properties specified at init time
+
+@property (copy,   readonly ) NSString *    photoPath;
+
+// properties that can be changed before starting the operation
+
+@property (assign, readwrite) CGFloat       maximumSize;        // defaults to 1024.0f
+
+// properties that are valid after the operation is finished
+
+@property (assign, readonly ) CGSize        fullSize;           // size of the photo, in pixels, or CGSizeZero
+@property (assign, readonly ) CGImageRef    image;              // NULL if the photo couldn't be decoded
+
+@end
@@ -0,0 +1,121 @@
+#import "PhotoDecodeOperation.h"
+#import <ImageIO/ImageIO.h>
+
+/*
+    o 本类继承自 NSOperation,  通过重写 main 方法 来定义自己的 NSOperation.
+        在后台线程把已下载的大图解码成可以直接显示的 bitmap, 避免在主线程第一次绘制时解码.
+ */
+
+@implementation PhotoDecodeOperation
+
+@synthesize photoPath   = _photoPath;
+@synthesize maximumSize = _maximumSize;
+@synthesize fullSize    = _fullSize;
+@synthesize image       = _image;
+
+- (id)initWithPhotoPath:(NSString *)photoPath
+{
+    assert(photoPath != nil);
+
+    self = [super init];
+    if (self != nil) {
+        self->_photoPath   = [photoPath copy];
+        self->_maximumSize = 1024.0f;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    CGImageRelease(self->_image);
+    [self->_photoPath release];
+    [super dealloc];
+}
+
+#pragma mark - 入列后开始执行的函数
+- (void)main
+{
+    // Latch maximumSize for performance, and also to prevent it changing out from underneath us.
+    CGFloat             maximumSize;
+    maximumSize = self.maximumSize;
+
+    CGImageSourceRef    source;
+    CFDictionaryRef     properties;
+    CGImageRef          sourceImage;
+    NSDictionary *      options;
+
+    sourceImage = NULL;
+
+    // Don't let the image source cache its own decode; we're about to make our own copy 
+    // in the right format.
+    
+    options = [NSDictionary dictionaryWithObject:[NSNumber numberWithBool:NO] forKey:(id) kCGImageSourceShouldCache];
+    assert(options != nil);
+    
+    source = CGImageSourceCreateWithURL( (CFURLRef) [NSURL fileURLWithPath:self.photoPath], (CFDictionaryRef) options);
+    if (source != NULL) {
+        properties = CGImageSourceCopyPropertiesAtIndex(source, 0, NULL);
+        if (properties != NULL) {
+            NSNumber *  width;
+            NSNumber *  height;
+
+            width  = (NSNumber *) CFDictionaryGetValue(properties, kCGImagePropertyPixelWidth);
+            height = (NSNumber *) CFDictionaryGetValue(properties, kCGImagePropertyPixelHeight);
+            if ( (width != nil) && (height != nil) ) {
+                self->_fullSize = CGSizeMake([width floatValue], [height floatValue]);
+            }
+            CFRelease(properties);
+        }
+        
+        if ( (self->_fullSize.width >= 1.0f) && (self->_fullSize.height >= 1.0f) ) {
+            if ( (self->_fullSize.width > maximumSize) || (self->_fullSize.height > maximumSize) ) {
+            
+                // Let the decoder produce the reduced size image directly.
+                
+                options = [NSDictionary dictionaryWithObjectsAndKeys:
+                    (id) kCFBooleanTrue,                        (id) kCGImageSourceCreateThumbnailFromImageAlways,
+                    [NSNumber numberWithFloat:maximumSize],     (id) kCGImageSourceThumbnailMaxPixelSize,
+                    nil
+                ];
+                assert(options != nil);
+                
+                sourceImage = CGImageSourceCreateThumbnailAtIndex(source, 0, (CFDictionaryRef) options);
+            } else {
+                sourceImage = CGImageSourceCreateImageAtIndex(source, 0, NULL);
+            }
+        }
+        CFRelease(source);
+    }
+    
+    // Render the image into a bitmap context in the display's native format (32-bit 
+    // little endian, premultiplied alpha first) and create an image from that.  This forces the decode 
+    // to happen here, and means that Core Animation can use the pixels as is.
+
+    if ( (sourceImage != NULL) && ! [self isCancelled] ) {
+        CGColorSpaceRef space;
+        CGContextRef    context;
+        size_t          width;
+        size_t          height;
+
+        width  = CGImageGetWidth(sourceImage);
+        height = CGImageGetHeight(sourceImage);
+
+        space = CGColorSpaceCreateDeviceRGB();
+        assert(space != NULL);
+
+        context = CGBitmapContextCreate(NULL, width, height, 8, 0, space, kCGBitmapByteOrder32Little | kCGImageAlphaPremultipliedFirst);
+        if (context != NULL) {
+            CGContextDrawImage(context, CGRectMake(0.0f, 0.0f, width, height), sourceImage);
+
+            self->_image = CGBitmapContextCreateImage(context);
+            assert(self->_image != NULL);
+        }
+
+        CGContextRelease(context);
+        CGColorSpaceRelease(space);
+    }
+
+    CGImageRelease(sourceImage);
+}
+
+@end
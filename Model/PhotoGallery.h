@@ -34,6 +34,11 @@ typedef NS_ENUM(NSUInteger, PhotoGallerySyncState){
 @class PhotoGalleryContext;
 @class RetryingHTTPOperation;
 @class GalleryParserOperation;
+@class GallerySyncJournal;
+@class PhotoMetadataStore;
+@class PhotoMetadataRebuildOperation;
+@class PhotoMetadataRow;
+@class Photo;
 
 @interface PhotoGallery : NSObject {
     NSString *                      _galleryURLString;
@@ -49,14 +54,27 @@ typedef NS_ENUM(NSUInteger, PhotoGallerySyncState){
     PhotoGallerySyncState           _syncState;    // 保存上面定义的 enum PhotoGallerySyncState 的值
     RetryingHTTPOperation *         _getOperation;
     GalleryParserOperation *        _parserOperation;
+    NSDate *                        _syncStartDate;
+    NSTimeInterval                  _lastSyncDuration;
+    NSTimeInterval                  _syncInterval;
+    NSTimeInterval                  _syncPhase;
+    double                          _syncWeight;
+    NSTimer *                       _syncTimer;
+    GallerySyncJournal *            _syncJournal;
+    NSString *                      _getDeltaFrom;
+    PhotoMetadataStore *            _metadataStore;
+    PhotoMetadataRebuildOperation * _metadataStoreRebuildOperation;
+    BOOL                            _metadataStoreRebuildStale;
 }
 
 #pragma mark - Start up and shut down
 
 // Called by the application delegate at startup time.  This takes care of
 // various bits of bookkeeping, including resetting the cache of photos
-// if that debugging option has been set.
-+ (void)applicationStartup;
+// if that debugging option has been set.  galleryURLStrings lists the galleries 
+// the app is about to open (the one on screen plus any kiosk galleries); their 
+// caches are never deleted to make room, however many there are.
++ (void)applicationStartupKeepingGalleryURLStrings:(NSArray *)galleryURLStrings;
 
 
 - (id)initWithGalleryURLString:(NSString *)galleryURLString;
@@ -87,6 +105,27 @@ typedef NS_ENUM(NSUInteger, PhotoGallerySyncState){
 // Returns the entity description for the "Photo" entity in our database.
 @property (nonatomic, retain, readonly ) NSEntityDescription *      photoEntity;
 
+// The name to use for the fetched results controller's persistent cache.  This is unique to 
+// the gallery cache, so it survives relaunches, and PhotoGallery deletes it along with the 
+// gallery cache.
+@property (nonatomic, copy,   readonly ) NSString *                 fetchedResultsCacheName;
+
+// If the debug-only galleryColumnarMetadata preference is set, the gallery also keeps 
+// its photos' metadata in a PhotoMetadataStore (a memory-mapped, columnar file that's 
+// already sorted by date), and PhotoGalleryViewController uses that rather than a fetched 
+// results controller, which is much cheaper for very big galleries.  Sync updates the 
+// store in place.  Otherwise metadataStore is nil.
+//
+// If the store has to be refilled from the database (it's new, or the app died while it 
+// was dirty), that happens on the CPU queue, and metadataStore stays nil, so the list 
+// uses Core Data, until it's done.  This is observable, so the list can switch over.
+@property (nonatomic, retain, readonly ) PhotoMetadataStore *       metadataStore;
+
+// Returns the Photo for a row of metadataStore, by way of its object ID, so only the photos 
+// that are actually on screen get fetched.  Returns nil if the photo is no longer in the 
+// database.
+- (Photo *)photoForMetadataRow:(PhotoMetadataRow *)row;
+
 
 #pragma mark * Syncing
 
@@ -107,4 +146,31 @@ typedef NS_ENUM(NSUInteger, PhotoGallerySyncState){
 - (void)stopSync;
     // Force a sync to stop right now.  Does nothing if a no sync is in progress.
 
+@property (nonatomic, assign, readonly ) NSTimeInterval             lastSyncDuration;           // how long the last successful sync took, from the get to the commit
+
+// Delta sync.  If the gallery's index carries a change token (see GalleryParserOperation.h), 
+// the next sync sends it back as the "since" query parameter, and the server can reply with 
+// just the photos that were added, changed or removed since then.  A delta goes through 
+// the same commit path as a full index, but only touches the photos it names.  If the 
+// server rejects the token (with 410 Gone), the gallery forgets it and does a full sync 
+// there and then.  Each delta is recorded in a GallerySyncJournal before it's committed, 
+// so that if the app dies before the database is saved, -start applies it again.  The 
+// debug-only galleryNoDeltaSync preference forces full syncs, for comparison.
+
+// Several galleries can be open at once (see PhotoGalleryCoordinator).  These properties 
+// control how this one shares the network and the CPU with the others.  Set them before 
+// calling -start.
+//
+// o syncInterval -- If not zero, the gallery syncs again every syncInterval seconds, 
+//   starting syncPhase seconds after the first interval.  Galleries with the same interval 
+//   use different phases so that their syncs don't all land at once.
+//
+// o syncWeight -- The gallery's share of the network transfer and CPU queues, relative to 
+//   the other galleries; see -[NetworkOperationGroup weight].  Default is 1.0.  Unlike the 
+//   others, you can change this at any time.
+
+@property (nonatomic, assign, readwrite) NSTimeInterval             syncInterval;               // default is 0, meaning no periodic sync
+@property (nonatomic, assign, readwrite) NSTimeInterval             syncPhase;                  // default is 0
+@property (nonatomic, assign, readwrite) double                     syncWeight;
+
 @end
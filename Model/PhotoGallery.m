@@ -1,11 +1,19 @@
 #import "PhotoGallery.h"
 #import "Photo.h"
 #import "PhotoGalleryContext.h"
+#import "PhotoStore.h"
+#import "MemoryBudget.h"
 #import "NetworkManager.h"
 #import "RecursiveDeleteOperation.h"
 #import "RetryingHTTPOperation.h"
+#import "QHTTPOperation.h"
+#import "QHTTPResponseCache.h"
 #import "GalleryParserOperation.h"
+#import "GallerySyncJournal.h"
+#import "PhotoMetadataStore.h"
+#import "PhotoMetadataRebuildOperation.h"
 #import "Logging.h"
+#import "QTrace.h"
 
 @interface PhotoGallery ()
 
@@ -25,10 +33,19 @@
 @property (nonatomic, retain, readwrite) GalleryParserOperation *   parserOperation;
 @property (nonatomic, copy,   readwrite) NSDate *                   lastSyncDate;
 @property (nonatomic, copy,   readwrite) NSError *                  lastSyncError;
+@property (nonatomic, retain, readwrite) NSTimer *                  syncTimer;
+@property (nonatomic, retain, readwrite) GallerySyncJournal *       syncJournal;
+@property (nonatomic, copy,   readwrite) NSString *                 getDeltaFrom;
+@property (nonatomic, retain, readwrite) PhotoMetadataStore *       metadataStore;
+
+// private properties
+@property (nonatomic, retain, readwrite) PhotoMetadataRebuildOperation * metadataStoreRebuildOperation;
 
 // forward declarations
+- (void)startPrewarm;
 - (void)startParserOperationWithData:(NSData *)data;
-- (void)commitParserResults:(NSArray *)latestResults;
+- (void)commitParserResults:(NSArray *)latestResults removedPhotoIDs:(NSArray *)removedPhotoIDs;
+- (void)startMetadataStoreRebuildWithStore:(PhotoMetadataStore *)store;
 
 @end
 
@@ -59,6 +76,10 @@ static NSString * kGalleryExtension    = @"gallery";
 //
 // o kPhotosDirectoryName is the name of the directory containing the actual photo files.
 //   Note that this is shared with PhotoGalleryContext, which is why it's not "static".
+//
+// o kTilesDirectoryName is the name of the directory containing the tile pyramids for 
+//   large photos (see PhotoTileOperation).  It's created on demand.  Again, this is 
+//   shared with PhotoGalleryContext.
 
 static NSString * kInfoFileName        = @"GalleryInfo.plist";
 static NSString * kDatabaseFileName    = @"Gallery.db";
@@ -70,13 +91,59 @@ static NSString * kDatabaseFileName    = @"Gallery.db";
 // [External Linkage] refers to things that exist beyond a particular translation unit. In other words, accessable through the whole program.
 // So both are mutually exclusive (互相排斥的).
        NSString * kPhotosDirectoryName = @"Photos";
+       NSString * kTilesDirectoryName  = @"Tiles";
 
 static NSString * galleryClearCacheKey = @"galleryClearCache";
+
+// At startup we delete the least recently used gallery caches to keep this many.  The 
+// caches of the galleries we're about to open count towards this but are always kept.
+
+static const NSUInteger kGalleryCacheLimit = 3;
+
+// Gallery caches that we're finished with are renamed into the trash directory, which 
+// lives alongside them in the caches directory.  Renaming is quick, however big the cache, 
+// and once a cache is in the trash nothing will look at it again.  The actual deletion 
+// happens in the background (see +reapTrashedPaths:), spread across kReapConcurrency 
+// threads and limited to kReapDeletesPerSecond files per second so that it doesn't get 
+// in the way of photo reads.  Anything left in the trash when the app quits gets reaped 
+// at the next launch.  In the debug build you can override the rate limit with the 
+// galleryReapRate user default.
+
+static NSString * kTrashDirectoryName       = @"GalleryTrash";
+static const NSUInteger kReapConcurrency    = 2;
+static const double kReapDeletesPerSecond   = 500.0;
+#if ! defined(NDEBUG)
+static NSString * galleryReapRateKey = @"galleryReapRate";
+#endif
+
+// The fetched results controller cache (see -fetchedResultsCacheName) lives outside of the 
+// gallery cache, in a location private to Core Data, so we name it after the gallery cache 
+// directory.
+static NSString * kFetchedResultsCacheNameTemplate = @"Photos-%@";
 // The gallery info file (kInfoFileName) contains a dictionary with just one property 
 // currently defined, kInfoFileName, which is the URL string of the gallery's XML data.
 
 static NSString * kGalleryInfoKeyGalleryURLString = @"gallerURLString";
 
+// Gallery XML larger than this is parsed in parallel, one chunk per core.  In the debug 
+// build you can force a specific chunk count (including 1, that is, a serial parse) 
+// using the galleryParseConcurrency user default, which makes it easy to see how the 
+// parse scales; GalleryParserOperation logs the parse time.
+
+static const NSUInteger kParallelParseThreshold = 256 * 1024;
+#if ! defined(NDEBUG)
+static NSString * galleryParseConcurrencyKey = @"galleryParseConcurrency";
+#endif
+
+// The sync journal (see GallerySyncJournal) lives in the gallery cache, next to the database.
+
+static NSString * kSyncJournalFileName = @"SyncJournal.plist";
+
+// The metadata store (see PhotoMetadataStore), if the galleryColumnarMetadata preference 
+// is set, also lives in the gallery cache.
+
+static NSString * kMetadataStoreFileName        = @"PhotoMetadata.store";
+
 @synthesize saveTimer = _saveTimer;
 @synthesize galleryURLString = _galleryURLString;
 @synthesize sequenceNumber   = _sequenceNumber;  //一个从0开始的数字标识符,表示这是第几个 gallery 请求.用户有可能会更改 galleryURL,此值会伴随增加.
@@ -87,10 +154,19 @@ static NSString * kGalleryInfoKeyGalleryURLString = @"gallerURLString";
 @synthesize galleryContext = _galleryContext;
 @synthesize photoEntity = _photoEntity;
 @synthesize lastSyncError = _lastSyncError;
+@synthesize lastSyncDuration = _lastSyncDuration;
+@synthesize syncInterval  = _syncInterval;
+@synthesize syncPhase     = _syncPhase;
+@synthesize syncWeight    = _syncWeight;
+@synthesize syncTimer     = _syncTimer;
+@synthesize syncJournal   = _syncJournal;
+@synthesize getDeltaFrom  = _getDeltaFrom;
+@synthesize metadataStore = _metadataStore;
+@synthesize metadataStoreRebuildOperation = _metadataStoreRebuildOperation;
 
 #pragma mark - Class Methods
 // Returns the path to the caches directory.
-// This is a class method because it's used by [self applicationStartup]
+// This is a class method because it's used by [self applicationStartupKeepingGalleryURLStrings:]
 // 查找本程序的 Caches 目录的绝对路径
 + (NSString *)cachesDirectoryPath
 {
@@ -112,10 +188,112 @@ static NSString * kGalleryInfoKeyGalleryURLString = @"gallerURLString";
     (void) [[NSFileManager defaultManager] removeItemAtPath:[galleryCachePath stringByAppendingPathComponent:kInfoFileName] error:NULL];
 }
 
+// Returns the path to the trash directory, creating it if necessary, or nil if that fails.
++ (NSString *)trashDirectoryPath
+{
+    NSString *  result;
+    BOOL        isDir;
+
+    result = [[self cachesDirectoryPath] stringByAppendingPathComponent:kTrashDirectoryName];
+    if ( ! ([[NSFileManager defaultManager] fileExistsAtPath:result isDirectory:&isDir] && isDir) ) {
+        if ( ! [[NSFileManager defaultManager] createDirectoryAtPath:result withIntermediateDirectories:NO attributes:nil error:NULL] ) {
+            result = nil;
+        }
+    }
+    return result;
+}
+
+// Moves the gallery cache into the trash, returning its new path.  This is a single 
+// rename, so it takes the same time however many photos are in the cache.  If the rename 
+// fails we fall back to abandoning the cache in place, which means the next launch will 
+// try again, and return nil.  Either way, the cache's fetched results controller cache 
+// and its references to shared photos are gone by the time we return.
+// 把 gallery cache 目录改名移到 trash 目录里, 不管里面有多少文件, 这都只是一次 rename 操作.
++ (NSString *)trashGalleryCacheAtPath:(NSString *)galleryCachePath
+{
+    NSString *      result;
+    NSString *      trashDirectoryPath;
+    CFAbsoluteTime  startTime;
+    
+    assert([NSThread isMainThread]);            // for PhotoStore
+    assert(galleryCachePath != nil);
+    
+    startTime = CFAbsoluteTimeGetCurrent();
+
+    // The fetched results controller caches for these galleries aren't in the gallery 
+    // cache directories, so we have to delete them separately.  Likewise their photos, 
+    // which live in the shared photo store; dropping the galleries' references deletes 
+    // any photos that no other gallery is using.
+    [NSFetchedResultsController deleteCacheWithName:[NSString stringWithFormat:kFetchedResultsCacheNameTemplate, [galleryCachePath lastPathComponent]]];
+    [[PhotoStore sharedStore] releaseAllBlobsForOwner:[galleryCachePath lastPathComponent]];
+    
+    // The gallery cache names are unique (they include a timestamp), so there's no need 
+    // to worry about clashing with something that's already in the trash.
+    result = nil;
+    trashDirectoryPath = [self trashDirectoryPath];
+    if (trashDirectoryPath != nil) {
+        result = [trashDirectoryPath stringByAppendingPathComponent:[galleryCachePath lastPathComponent]];
+        if ( ! [[NSFileManager defaultManager] moveItemAtPath:galleryCachePath toPath:result error:NULL] ) {
+            result = nil;
+        }
+    }
+    if (result == nil) {
+        [[QLog log] logWithFormat:@"gallery trash '%@' failed", [galleryCachePath lastPathComponent]];
+        [self abandonGalleryCacheAtPath:galleryCachePath];
+    } else {
+        [[QLog log] logWithFormat:@"gallery trash '%@' in %.3f ms", [galleryCachePath lastPathComponent], (CFAbsoluteTimeGetCurrent() - startTime) * 1000.0];
+    }
+    return result;
+}
+
+// Starts a low priority operation to delete the specified paths, which must be in the trash. 
+// We don't monitor this operation for successful completion.  It just does its stuff and 
+// then goes away.  If the app quits before the operation is done, it just gets killed. 
+// That's OK; whatever's left in the trash gets reaped when the app is next launched.
+// 在低优先级线程上删除 trash 目录里的东西.  没删完也没关系, 下次启动时会继续.
++ (void)reapTrashedPaths:(NSArray *)paths
+{
+    static NSOperationQueue *   sGalleryDeleteQueue;
+    RecursiveDeleteOperation *  op;
+    double                      deletesPerSecond;
+    
+    assert([NSThread isMainThread]);
+    assert(paths != nil);
+    
+    if ( [paths count] != 0 ) {
+        // We run one reap at a time, so that a reap started at runtime doesn't compete 
+        // with the one started at launch.  Each reap is parallel internally.
+        if (sGalleryDeleteQueue == nil) {
+            sGalleryDeleteQueue = [[NSOperationQueue alloc] init];
+            assert(sGalleryDeleteQueue != nil);
+            
+            [sGalleryDeleteQueue setMaxConcurrentOperationCount:1];
+        }
+        
+        deletesPerSecond = kReapDeletesPerSecond;
+        #if ! defined(NDEBUG)
+            if ( [[NSUserDefaults standardUserDefaults] objectForKey:galleryReapRateKey] != nil ) {
+                deletesPerSecond = [[NSUserDefaults standardUserDefaults] doubleForKey:galleryReapRateKey];
+            }
+        #endif
+        
+        //递归删除掉 NSArry 里的目录路径
+        op = [[[RecursiveDeleteOperation alloc] initWithPaths:paths] autorelease];
+        assert(op != nil);
+        
+        op.concurrency = kReapConcurrency;
+        op.maximumDeletesPerSecond = deletesPerSecond;
+        if ( [op respondsToSelector:@selector(setThreadPriority:)] ) {
+            [op setThreadPriority:0.1]; // 我们把优先级设置的很低,以免抢占过多的资源
+        }
+        [sGalleryDeleteQueue addOperation:op];
+    }
+}
+
 /*!
  *  在一个独立的低优先级线程里, 清理掉那些无用的或者过期的缓存目录(即,带.gallery后缀的文件名)
  */
-+ (void)applicationStartup
++ (void)applicationStartupKeepingGalleryURLStrings:(NSArray *)galleryURLStrings
 /*
 App 的 Library目录结构,每个 App 的 Library 都是独立的
  .Library
@@ -213,8 +391,9 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
     assert(potentialGalleryCacheNames != nil);
     
 
-    NSMutableArray* liveGalleryCachePathsAndDates = [NSMutableArray array];
+    NSMutableArray* liveGalleryCachePathsAndDates = [NSMutableArray array];    // not counting the ones in use
     assert(liveGalleryCachePathsAndDates != nil);
+    NSUInteger      inUseGalleryCacheCount = 0;
     
     for (NSString * galleryCacheName in potentialGalleryCacheNames) {
         //那些带 .gallery 后缀的文件就是缓存目录
@@ -232,7 +411,6 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
             //是否删除所有的缓存
             if (clearAllCaches) {
                 [[QLog log] logWithFormat:@"gallery clear '%@'", galleryCacheName];
-                (void)[fileManager removeItemAtPath:galleryInfoFilePath error:NULL];
                 [deletableGalleryCachePaths addObject:galleryCachePath];
             } else if ( ! [fileManager fileExistsAtPath:galleryInfoFilePath]) { // 缓存目录不存在 GalleryInfo.plist 文件,则为无用缓存.
                 [[QLog log] logWithFormat:@"gallery delete abandoned '%@'", galleryCacheName];
@@ -252,19 +430,29 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
                     [[QLog log] logWithFormat:@"gallery delete invalid '%@'", galleryCacheName];
                     [deletableGalleryCachePaths addObject:galleryCachePath];
                 } else {
+                    NSString *  galleryInfoURLString;
+                    
                     assert([modDate isKindOfClass:[NSDate class]]);
-                    [liveGalleryCachePathsAndDates addObject:[NSDictionary dictionaryWithObjectsAndKeys:
-                        galleryCachePath,   @"path", 
-                        modDate,            @"modDate", 
-                        nil
-                    ]];
+                    galleryInfoURLString = [[NSDictionary dictionaryWithContentsOfFile:galleryInfoFilePath] objectForKey:kGalleryInfoKeyGalleryURLString];
+                    if ( (galleryInfoURLString != nil) && [galleryURLStrings containsObject:galleryInfoURLString] ) {
+                        // One of the galleries we're about to open; leave it be.
+                        inUseGalleryCacheCount += 1;
+                    } else {
+                        [liveGalleryCachePathsAndDates addObject:[NSDictionary dictionaryWithObjectsAndKeys:
+                            galleryCachePath,   @"path", 
+                            modDate,            @"modDate", 
+                            nil
+                        ]];
+                    }
                 }
             }
         }
     }
     
     // See if we've exceeded our gallery cache limit, in which case we keep abandoning the oldest 
-    // gallery cache until we're under that limit.
+    // gallery cache until we're under that limit.  The caches of galleries that are in use 
+    // count towards the limit but are never abandoned, so with enough kiosk galleries the 
+    // limit is all theirs.
 
     // 目前我们还没有执行我们的 gallery cache 限制, 对缓存目录排序后, 删除那些多余的,最老的缓存.
     [liveGalleryCachePathsAndDates sortUsingDescriptors:[
@@ -273,50 +461,40 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
                                                             ] autorelease]
                                                          ]];
     
-    while ( [liveGalleryCachePathsAndDates count] > 3 ) {
+    while ( ([liveGalleryCachePathsAndDates count] != 0) && (([liveGalleryCachePathsAndDates count] + inUseGalleryCacheCount) > kGalleryCacheLimit) ) {
         NSString * path = [[liveGalleryCachePathsAndDates objectAtIndex:0] objectForKey:@"path"];
         assert([path isKindOfClass:[NSString class]]);
 
         [[QLog log] logWithFormat:@"gallery abandon and delete '%@'", [path lastPathComponent]];
 
-        // 删除 Caches/****.gallery/的GalleryInfo.plist 文件,这样 cache 目录就不会被使用了
-        [self abandonGalleryCacheAtPath:path];
         [deletableGalleryCachePaths addObject:path];
         
         [liveGalleryCachePathsAndDates removeObjectAtIndex:0];
     }
     
-    // Start an operation to delete the targeted gallery caches.  This happens on a 
-    // thread so that it doesn't prevent the app starting up.  The app will 
-    // ignore these gallery caches anyway, because we removed their gallery info files. 
-    // Also, we don't monitor this operation for successful completion.  It 
-    // just does its stuff and then goes away.  That means that we effectively 
-    // leak the operation queue.  Not a big deal.  It also means that, if the 
-    // app quits before the operation is done, it just gets killed.  That's 
-    // OK too; the delete will pick up where it left off when the app is next 
-    // relaunched.
-    
-    // 开启一个 operation 去删除那些无用的 gallery caches.
-    // 这个operation 在一个独立的线程上执行,这样它就无法拖延程序的启动了.
-    // 程序将要忽略掉那些我们记录下来的要删除的缓存目录,因为我们已经把目录里的 galleryInfo.plist文件了.
-    // 并且,我们不监控这个操作是否顺利完成,它完成后会自动退出的. 就是说我们漏掉这个操作队列的其他处理.
-    // 这并没有什么大不了的. 这意味着,如果 app 在删除操作没有完成以前就退出的话,这个操作就被杀死了.
-    // 这也没有关系. 这个删除操作会在下次程序启动的时候再此运行的.
-
-    if ( [deletableGalleryCachePaths count] != 0 ) {
-        static NSOperationQueue *   sGalleryDeleteQueue;
-        
-        sGalleryDeleteQueue = [[NSOperationQueue alloc] init];
-        assert(sGalleryDeleteQueue != nil);
-        
-        //递归删除掉 NSArry 里的目录路径
-        RecursiveDeleteOperation * op = [[[RecursiveDeleteOperation alloc] initWithPaths:deletableGalleryCachePaths] autorelease];
-        assert(op != nil);
+    // Move the targeted gallery caches into the trash.  Each move is a single rename, so 
+    // this doesn't hold up startup however big the caches are, and once a cache is in the 
+    // trash the app never looks at it again.
+    // 把要删除的 gallery caches 移到 trash 目录里, 每个都只是一次 rename, 不会拖延程序的启动.
+    
+    for (NSString * path in deletableGalleryCachePaths) {
+        (void) [self trashGalleryCacheAtPath:path];
+    }
+    
+    // Then start reaping everything in the trash.  That includes anything that the last 
+    // run of the app didn't get around to deleting, which is how an interrupted reap 
+    // resumes.
+    // 然后在后台删除 trash 目录里的所有东西, 包括上次没有删完的.
+    
+    NSString * trashDirectoryPath = [self trashDirectoryPath];
+    if (trashDirectoryPath != nil) {
+        NSMutableArray * trashedPaths = [NSMutableArray array];
+        assert(trashedPaths != nil);
         
-        if ( [op respondsToSelector:@selector(setThreadPriority:)] ) {
-            [op setThreadPriority:0.1]; // 我们把优先级设置的很低,以免抢占过多的资源
+        for (NSString * trashedName in [fileManager contentsOfDirectoryAtPath:trashDirectoryPath error:NULL]) {
+            [trashedPaths addObject:[trashDirectoryPath stringByAppendingPathComponent:trashedName]];
         }
-        [sGalleryDeleteQueue addOperation:op];
+        [self reapTrashedPaths:trashedPaths];
     }
 }
 
@@ -333,12 +511,16 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
         static NSUInteger sNextGallerySequenceNumber;  // 默认为0
         
         self->_galleryURLString = [galleryURLString copy];
+        self->_syncWeight = 1.0;
         self->_sequenceNumber = sNextGallerySequenceNumber;
         sNextGallerySequenceNumber += 1;
         
         //添加一个监控,等到程序变为 active 后,调用 didBecomeActive: 方法
         [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(didBecomeActive:) name:UIApplicationDidBecomeActiveNotification object:nil];
         
+        // When memory gets tight, drop the decoded thumbnails that we can recreate from the database.
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(evictCaches:) name:kMemoryBudgetEvictCachesNotification object:nil];
+        
         [[QLog log] logWithFormat:@"%s gallery %zu is %@",__PRETTY_FUNCTION__, (size_t) self->_sequenceNumber, galleryURLString];
     }
     return self;
@@ -347,6 +529,7 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
 - (void)dealloc
 {
     [[NSNotificationCenter defaultCenter] removeObserver:self name:UIApplicationDidBecomeActiveNotification object:nil];
+    [[NSNotificationCenter defaultCenter] removeObserver:self name:kMemoryBudgetEvictCachesNotification object:nil];
 
     [self->_galleryURLString release];
 
@@ -355,8 +538,14 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
     assert(self->_galleryContext == nil);
     assert(self->_photoEntity == nil);
     assert(self->_saveTimer == nil);
+    assert(self->_syncTimer == nil);
+    assert(self->_syncJournal == nil);
+    assert(self->_metadataStore == nil);
+    assert(self->_metadataStoreRebuildOperation == nil);
 
     [self->_lastSyncDate release];
+    [self->_getDeltaFrom release];
+    [self->_syncStartDate release];
     [self->_lastSyncError release];
     [self->_standardDateFormatter release];
 
@@ -384,6 +573,34 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
     }
 }
 
+// Called on the main thread when the memory budget wants caches evicted.  We only look 
+// at the photos that are already in memory; faulting in the rest would be self defeating.
+- (void)evictCaches:(NSNotification *)note
+{
+    #pragma unused(note)
+    NSUInteger  photoCount;
+    long long   bytesFreed;
+    
+    assert([NSThread isMainThread]);
+    
+    if (self.galleryContext != nil) {
+        photoCount = 0;
+        bytesFreed = 0;
+        for (NSManagedObject * object in [self.galleryContext registeredObjects]) {
+            if ( [object isKindOfClass:[Photo class]] && ! [object isFault] ) {
+                long long   bytes;
+                
+                bytes = [(Photo *) object evictThumbnailImage];
+                if (bytes != 0) {
+                    photoCount += 1;
+                    bytesFreed += bytes;
+                }
+            }
+        }
+        [[QLog log] logWithFormat:@"%s gallery %zu evicted %zu thumbnails, %lld bytes", __PRETTY_FUNCTION__, (size_t) self.sequenceNumber, (size_t) photoCount, bytesFreed];
+    }
+}
+
 #pragma mark - Core Data wrangling
 //Foundation 框架提供的表示属性依赖的机制
 + (NSSet *)keyPathsForValuesAffectingManagedObjectContext
@@ -513,16 +730,22 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
     return result;
 }
 
-// Abandons the specified gallery cache directory.  We do this simply by removing the gallery info file.
-// The directory will be deleted when the application is next launched.
-// 调用本类的同名"类方法", 删除 Caches/****.gallery/的GalleryInfo.plist 文件, 这样下次 cache 目录就不会被使用了
+// Abandons the specified gallery cache directory.  We do this by moving it into the trash, and 
+// then starting a reap to delete it.  If the move fails, the cache is abandoned in place (by 
+// removing the gallery info file) and will be deleted when the application is next launched.
+// 把 cache 目录移到 trash 里, 然后在后台删除.  如果移动失败, 就删除 GalleryInfo.plist 文件, 下次启动时再删除.
 - (void)abandonGalleryCacheAtPath:(NSString *)galleryCachePath
 {
+    NSString *  trashedPath;
+    
     assert(galleryCachePath != nil);
 
     [[QLog log] logWithFormat:@"gallery %zu abandon '%@'", (size_t) self.sequenceNumber, [galleryCachePath lastPathComponent]];
     
-    [[self class] abandonGalleryCacheAtPath:galleryCachePath];
+    trashedPath = [[self class] trashGalleryCacheAtPath:galleryCachePath];
+    if (trashedPath != nil) {
+        [[self class] reapTrashedPaths:[NSArray arrayWithObject:trashedPath]];
+    }
 }
 
 
@@ -536,6 +759,11 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
     return self.galleryContext.galleryCachePath;
 }
 
+- (NSString *)fetchedResultsCacheName
+{
+    return [NSString stringWithFormat:kFetchedResultsCacheNameTemplate, [self.galleryCachePath lastPathComponent]];
+}
+
 
 #pragma mark - init galleryContext
 // Attempt to start up the gallery cache for our gallery URL string, either by finding an existing
@@ -638,6 +866,11 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
         // until everything as fully up and running.  That no longer happens, but I've kept the
         // configure-before-set code because it seems like the right thing to do.
         self.galleryContext = context;
+        
+        self.syncJournal = [[[GallerySyncJournal alloc] initWithPath:[galleryCachePath stringByAppendingPathComponent:kSyncJournalFileName]] autorelease];
+        assert(self.syncJournal != nil);
+        
+        [self setupMetadataStore];
 
         // Subscribe to the context changed notification so that we can auto-save.
         [[NSNotificationCenter defaultCenter] addObserver:self
@@ -666,6 +899,191 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
 }
 
 
+#pragma mark * Metadata store
+
+// Opens the metadata store, if the debug-only galleryColumnarMetadata preference is set. 
+// If it's new or wasn't cleanly saved, we refill it from the database on the CPU queue, 
+// and only publish it as metadataStore once that's done.  If the preference isn't set 
+// (or this is a release build), we delete any store left over from when it was, because 
+// it's no longer being kept up to date.
+- (void)setupMetadataStore
+{
+    NSString *              storePath;
+    PhotoMetadataStore *    store;
+    BOOL                    useStore;
+    
+    assert(self.galleryContext != nil);
+    assert(self.metadataStore == nil);
+    assert(self.metadataStoreRebuildOperation == nil);
+    
+    storePath = [self.galleryCachePath stringByAppendingPathComponent:kMetadataStoreFileName];
+    assert(storePath != nil);
+    
+    useStore = NO;
+    #if ! defined(NDEBUG)
+        useStore = [[NSUserDefaults standardUserDefaults] boolForKey:@"galleryColumnarMetadata"];
+    #endif
+    if ( ! useStore ) {
+        (void) [[NSFileManager defaultManager] removeItemAtPath:storePath error:NULL];
+    } else {
+        store = [[[PhotoMetadataStore alloc] initWithPath:storePath] autorelease];
+        assert(store != nil);
+        
+        // If the store won't open, we just carry on with Core Data alone.
+        
+        if ( [store open:NULL] ) {
+            if (store.needsRebuild) {
+                [self startMetadataStoreRebuildWithStore:store];
+            } else {
+                self.metadataStore = store;
+            }
+        }
+    }
+}
+
+// Copies a photo's metadata into the store.  The caller must have called -beginUpdates.
+- (void)setMetadataForPhoto:(Photo *)photo
+{
+    [self.metadataStore setPhotoID:photo.photoID 
+                              name:photo.displayName 
+                              date:photo.date 
+                         photoPath:photo.remotePhotoPath 
+                     thumbnailPath:photo.remoteThumbnailPath 
+                         objectURI:[[photo objectID] URIRepresentation]
+    ];
+}
+
+// Starts refilling store from the database, on the CPU queue.  The store belongs to the 
+// operation until -metadataStoreRebuildDone: is called.
+- (void)startMetadataStoreRebuildWithStore:(PhotoMetadataStore *)store
+{
+    assert(store != nil);
+    assert(self.metadataStoreRebuildOperation == nil);
+    
+    self->_metadataStoreRebuildStale = NO;
+    self.metadataStoreRebuildOperation = [[[PhotoMetadataRebuildOperation alloc] initWithStore:store persistentStoreCoordinator:[self.galleryContext persistentStoreCoordinator]] autorelease];
+    assert(self.metadataStoreRebuildOperation != nil);
+    
+    [[NetworkManager sharedManager] addCPUOperation:self.metadataStoreRebuildOperation finishedTarget:self action:@selector(metadataStoreRebuildDone:) group:self.galleryContext.operationGroup];
+}
+
+// Called when the rebuild is done.  If a sync was committed while it ran, the rebuild may 
+// have missed it, so we save and go round again; otherwise we publish the store, which 
+// tells the gallery list (via KVO) that it can switch over from Core Data.
+- (void)metadataStoreRebuildDone:(PhotoMetadataRebuildOperation *)operation
+{
+    assert([NSThread isMainThread]);
+    assert([operation isKindOfClass:[PhotoMetadataRebuildOperation class]]);
+    assert(operation == self.metadataStoreRebuildOperation);
+    assert(self.metadataStore == nil);
+    
+    [[operation retain] autorelease];
+    self.metadataStoreRebuildOperation = nil;
+    
+    [[QLog log] logWithFormat:@"%s gallery %zu metadata store rebuilt, %zu photos in %.3f s%@", __PRETTY_FUNCTION__, 
+        (size_t) self.sequenceNumber, 
+        (size_t) operation.photoCount, 
+        operation.elapsedTime, 
+        operation.succeeded ? (self->_metadataStoreRebuildStale ? @", stale" : @"") : @", failed"
+    ];
+    
+    if ( ! operation.succeeded ) {
+    
+        // Carry on with Core Data alone.  The store is still dirty, so we'll try again 
+        // next time the gallery is opened.
+        
+        [operation.store close];
+    } else if (self->_metadataStoreRebuildStale) {
+    
+        // The rebuild only sees what's been saved, so save the sync before going again.
+        
+        [self save];
+        [self startMetadataStoreRebuildWithStore:operation.store];
+    } else {
+        self.metadataStore = operation.store;
+    }
+}
+
+// Applies a sync's changes to the metadata store, in place.
+- (void)updateMetadataStoreWithPhotos:(NSArray *)photos removedPhotos:(NSSet *)removedPhotos
+{
+    NSMutableArray *    newPhotos;
+    NSError *           error;
+    
+    assert(self.metadataStore != nil);
+    
+    // New photos only have temporary object IDs, which mean nothing once the context 
+    // has gone, so get them their permanent IDs now rather than at save time.
+    
+    newPhotos = [NSMutableArray array];
+    assert(newPhotos != nil);
+    for (Photo * photo in photos) {
+        if ( [[photo objectID] isTemporaryID] ) {
+            [newPhotos addObject:photo];
+        }
+    }
+    if ( ([newPhotos count] != 0) && ! [self.galleryContext obtainPermanentIDsForObjects:newPhotos error:&error] ) {
+        [[QLog log] logWithFormat:@"%s gallery %zu permanent IDs error %@", __PRETTY_FUNCTION__, (size_t) self.sequenceNumber, error];
+    }
+    
+    [self.metadataStore beginUpdates];
+    for (Photo * photo in photos) {
+        [self setMetadataForPhoto:photo];
+    }
+    for (Photo * photo in removedPhotos) {
+        [self.metadataStore removePhotoID:photo.photoID];
+    }
+    [self.metadataStore endUpdates];
+}
+
+- (Photo *)photoForMetadataRow:(PhotoMetadataRow *)row
+{
+    Photo *                 result;
+    NSURL *                 objectURI;
+    NSManagedObjectID *     objectID;
+    
+    assert(row != nil);
+    assert(self.galleryContext != nil);
+    
+    result = nil;
+    objectURI = row.objectURI;
+    if (objectURI != nil) {
+        objectID = [[self.galleryContext persistentStoreCoordinator] managedObjectIDForURIRepresentation:objectURI];
+        if (objectID != nil) {
+            result = (Photo *) [self.galleryContext existingObjectWithID:objectID error:NULL];
+        }
+    }
+    if ( (result != nil) && ( ! [result isKindOfClass:[Photo class]] || [result isDeleted] ) ) {
+        result = nil;
+    }
+    return result;
+}
+
+// If the app died with a sync committed to the context but not saved, finish it off.  A 
+// delta can be applied again from the journal, as long as it applies to the version that 
+// the database was saved at.  A full sync can't (the journal doesn't keep the index), 
+// but that's fine: the journal's change token still matches the saved database, so the 
+// next sync picks up where it left off.
+// 崩溃恢复: 重新应用日志里已提交但还没保存的增量.
+- (void)recoverSyncJournal
+{
+    GallerySyncJournal *    journal;
+    
+    journal = self.syncJournal;
+    assert(journal != nil);
+    
+    if (journal.hasPendingSync) {
+        if ( (journal.pendingDeltaFrom != nil) && [journal.pendingDeltaFrom isEqual:journal.changeToken] ) {
+            [[QLog log] logWithFormat:@"%s gallery %zu sync journal reapply delta %@ -> %@ (%zu changed, %zu removed)", __PRETTY_FUNCTION__, (size_t) self.sequenceNumber, journal.pendingDeltaFrom, journal.pendingChangeToken, (size_t) [journal.pendingResults count], (size_t) [journal.pendingRemovedPhotoIDs count]];
+            [self commitParserResults:journal.pendingResults removedPhotoIDs:journal.pendingRemovedPhotoIDs];
+            [self save];
+        } else {
+            [[QLog log] logWithFormat:@"%s gallery %zu sync journal discard pending sync", __PRETTY_FUNCTION__, (size_t) self.sequenceNumber];
+            [journal discardPendingSync];
+        }
+    }
+}
+
 - (void)start
 {
     BOOL   success;
@@ -679,7 +1097,28 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
     
     // If all went well, start the syncing processing.  If not, the application is dead and we crash.
     if (success) {
+        self.galleryContext.operationGroup.weight = self.syncWeight;
+        
+        [self recoverSyncJournal];
+        
         [self startSync];//开启网络同步
+        
+        // Schedule the periodic syncs, if any.  The first one comes syncPhase seconds after 
+        // the first interval; after that they come every interval.
+        // 定时同步, 不同的 gallery 错开时间.
+        
+        assert(self.syncTimer == nil);
+        if (self.syncInterval > 0.0) {
+            self.syncTimer = [[[NSTimer alloc] initWithFireDate:[NSDate dateWithTimeIntervalSinceNow:self.syncInterval + self.syncPhase] 
+                                                       interval:self.syncInterval 
+                                                         target:self 
+                                                       selector:@selector(syncTimerDidFire:) 
+                                                       userInfo:nil 
+                                                        repeats:YES
+                             ] autorelease];
+            assert(self.syncTimer != nil);
+            [[NSRunLoop currentRunLoop] addTimer:self.syncTimer forMode:NSDefaultRunLoopMode];
+        }
     } else {
         abort();
     }
@@ -692,7 +1131,9 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
 - (void)save
 {
     NSError *       error;
+    uint64_t        traceStartTime;
     error = nil;
+    traceStartTime = QTraceIsRecording() ? QTraceNow() : 0;
     
     // Disable the auto-save timer.
     [self.saveTimer invalidate];
@@ -705,12 +1146,25 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
             error = nil;
         }
     }
+    // Once the database reflects the pending sync, if any, its change token is the one to 
+    // send next time.
+    if ( (error == nil) && (self.syncJournal != nil) ) {
+        [self.syncJournal commitPendingSync];
+    }
+    // Likewise the metadata store, which was updated in place by the sync, now matches 
+    // the database.
+    if (error == nil) {
+        [self.metadataStore markClean];
+    }
     // Log the results.
     if (error == nil) {
         [[QLog log] logWithFormat:@"%s gallery %zu saved", __PRETTY_FUNCTION__ ,(size_t) self.sequenceNumber];
     } else {
         [[QLog log] logWithFormat:@"%s gallery %zu save error %@",__PRETTY_FUNCTION__, (size_t) self.sequenceNumber, error];
     }
+    if ( (traceStartTime != 0) && QTraceIsRecording() ) {
+        [[QTrace trace] recordSpanNamed:"-[PhotoGallery save]" object:nil startTime:traceStartTime];
+    }
 }
 
 #pragma mark - managed object context notification arrived
@@ -739,6 +1193,19 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
  */
 - (void)stop
 {
+    // Cancel every operation that we, or our photos, have in flight, in one go.  The 
+    // individual -cancelOperation: calls made by -stopSync and -[Photo stop] then have 
+    // nothing left to do.
+    // 一次性取消本 gallery 的所有 operation.
+    
+    if (self.galleryContext != nil) {
+        [[NetworkManager sharedManager] cancelOperationGroup:self.galleryContext.operationGroup];
+    }
+    
+    // The timer retains us, so this also breaks that retain cycle.
+    [self.syncTimer invalidate];
+    self.syncTimer = nil;
+    
     [self stopSync];
     
     // Shut down the managed object context.
@@ -750,8 +1217,14 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
         [[NSNotificationCenter defaultCenter] removeObserver:self name:NSManagedObjectContextObjectsDidChangeNotification object:self.galleryContext];
         
         [self save];
+        [self.galleryContext logResponseBytes];
         
         self.photoEntity = nil;
+        self.syncJournal = nil;
+        [[NetworkManager sharedManager] cancelOperation:self.metadataStoreRebuildOperation];
+        self.metadataStoreRebuildOperation = nil;
+        [self.metadataStore close];
+        self.metadataStore = nil;
         self.galleryContext = nil;
     }
     [[QLog log] logWithFormat:@"%s gallery %zu stopped",__PRETTY_FUNCTION__, (size_t) self.sequenceNumber];
@@ -933,6 +1406,38 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
    
     assert(request != nil);
     
+    // If we have a change token, ask for just the changes since then.
+    // 有 change token 的话, 只请求增量.
+    
+    BOOL    allowDelta;
+    allowDelta = YES;
+    #if ! defined(NDEBUG)
+        allowDelta = ! [[NSUserDefaults standardUserDefaults] boolForKey:@"galleryNoDeltaSync"];
+    #endif
+    
+    self.getDeltaFrom = nil;
+    if ( (self.syncJournal.changeToken != nil) && allowDelta ) {
+        NSString *  escapedToken;
+        NSString *  urlString;
+        
+        escapedToken = [(NSString *) CFURLCreateStringByAddingPercentEscapes(
+            NULL, 
+            (CFStringRef) self.syncJournal.changeToken, 
+            NULL, 
+            CFSTR(":/?#[]@!$&'()*+,;="), 
+            kCFStringEncodingUTF8
+        ) autorelease];
+        assert(escapedToken != nil);
+        
+        urlString = [[request URL] absoluteString];
+        urlString = [urlString stringByAppendingFormat:@"%@since=%@", ([[request URL] query] == nil) ? @"?" : @"&", escapedToken];
+        [request setURL:[NSURL URLWithString:urlString]];
+        assert([request URL] != nil);
+        
+        self.getDeltaFrom = self.syncJournal.changeToken;
+        [[QLog log] logOption:kLogOptionSyncDetails withFormat:@"%s gallery %zu sync get delta since %@", __PRETTY_FUNCTION__, (size_t) self.sequenceNumber, self.getDeltaFrom];
+    }
+    
     assert(self.getOperation == nil);
      // 创建 operation
     self.getOperation = [[[RetryingHTTPOperation alloc] initWithRequest:request] autorelease];
@@ -940,13 +1445,69 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
     
     [self.getOperation setQueuePriority:NSOperationQueuePriorityNormal];
     self.getOperation.acceptableContentTypes = [NSSet setWithObjects:@"application/xml", @"text/xml", nil];
+    self.getOperation.responseCache = [QHTTPResponseCache sharedCache];
     
      // 添加 operation 到 OperationQueue
      // 目前都在 main thread 上面执行, 直到下面, self.getOperation 被添加到 NetworkManger 的网络管理队列(queueForNetworkManagement)后,
      // self.getOperation 立即在那个队列里执行.
-    [[NetworkManager sharedManager] addNetworkManagementOperation:self.getOperation finishedTarget:self action:@selector(getOperationDone:)];
+    [[NetworkManager sharedManager] addNetworkManagementOperation:self.getOperation finishedTarget:self action:@selector(getOperationDone:) group:self.galleryContext.operationGroup];
      // 等到下载资源操作完成以后(也可能超时不成功),在主线程上调用本类的getOperationDone: 方法.
     self.syncState = kPhotoGallerySyncStateGetting;
+    
+    [self startPrewarm];
+}
+
+// The number of photos whose thumbnail hosts we look at when pre-warming, and the number 
+// of idle connections we open to each host.  Galleries rarely spread their thumbnails 
+// over more than one or two hosts, so a small sample finds them all.
+
+static const NSUInteger kPrewarmPhotoSampleCount = 8;
+static const NSUInteger kPrewarmConnectionCount  = 2;
+
+// While the gallery XML downloads and parses, get name resolution and connection setup 
+// out of the way for the hosts that the thumbnails will come from, so that the burst of 
+// thumbnail gets that follows the sync starts on warm connections.  We don't know the 
+// hosts of a new gallery's thumbnails until it's parsed, so we go by the gallery's own 
+// host plus the thumbnails of the photos we already have.  The debug-only 
+// galleryNoPrewarm preference turns this off, for comparison (see 
+// -[PhotoGalleryContext noteSyncStartedWithPrewarm:]).
+// 在下载和分析 XML 的同时, 预先解析 thumbnail 所在主机的域名并建立几个空闲的 keep-alive 连接.
+- (void)startPrewarm
+{
+    NSMutableArray *    urls;
+    NSFetchRequest *    fetchRequest;
+    NSArray *           photos;
+    BOOL                prewarm;
+    
+    assert([NSThread isMainThread]);
+    assert(self.galleryContext != nil);
+    
+    prewarm = YES;
+    #if ! defined(NDEBUG)
+        prewarm = ! [[NSUserDefaults standardUserDefaults] boolForKey:@"galleryNoPrewarm"];
+    #endif
+    [self.galleryContext noteSyncStartedWithPrewarm:prewarm];
+    
+    if (prewarm) {
+        urls = [NSMutableArray arrayWithObject:[[self.galleryContext requestToGetGalleryRelativeString:nil] URL]];
+        assert(urls != nil);
+        
+        fetchRequest = [self photosFetchRequest];
+        assert(fetchRequest != nil);
+        [fetchRequest setFetchLimit:kPrewarmPhotoSampleCount];
+        
+        photos = [self.galleryContext executeFetchRequest:fetchRequest error:NULL];
+        for (Photo * photo in photos) {
+            NSURLRequest *  request;
+            
+            request = [self.galleryContext requestToGetGalleryRelativeString:photo.remoteThumbnailPath];
+            if (request != nil) {
+                [urls addObject:[request URL]];
+            }
+        }
+        
+        [[NetworkManager sharedManager] prewarmConnectionsForURLs:urls connectionCount:kPrewarmConnectionCount group:self.galleryContext.operationGroup];
+    }
 }
 
 /*!
@@ -967,9 +1528,21 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
     assert(self.syncState == kPhotoGallerySyncStateGetting);
     
     [[QLog log] logOption:kLogOptionSyncDetails withFormat:@"%s gallery %zu sync listing done",__PRETTY_FUNCTION__, (size_t) self.sequenceNumber];
+    [self.galleryContext noteResponseBytesFromCache:operation.responseBytesFromCache fromNetwork:operation.responseBytesFromNetwork];
     
     error = operation.error;
-    if (error != nil) { //请求有错误,没有成功.
+    if ( (error != nil) && (self.getDeltaFrom != nil) && [[error domain] isEqual:kQHTTPOperationErrorDomain] && ([error code] == 410) ) {
+        // The server no longer recognises our change token.  Forget it and start again 
+        // with a full sync.  We have to clear getOperation first because -startGetOperation 
+        // asserts that it's nil.
+        // 服务器不认识这个 change token 了, 改为全量同步.
+        [[QLog log] logWithFormat:@"%s gallery %zu sync change token %@ gone, falling back to a full sync", __PRETTY_FUNCTION__, (size_t) self.sequenceNumber, self.getDeltaFrom];
+        [self.syncJournal forgetChangeToken];
+        self.syncState = kPhotoGallerySyncStateStopped;
+        self.getOperation = nil;
+        [self startGetOperation];
+        return;
+    } else if (error != nil) { //请求有错误,没有成功.
         self.lastSyncError = error;
         self.syncState = kPhotoGallerySyncStateStopped;
     } else {
@@ -1001,8 +1574,22 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
 
     [self.parserOperation setQueuePriority:NSOperationQueuePriorityNormal];
     
+    if ([data length] >= kParallelParseThreshold) {
+        self.parserOperation.parseConcurrency = [[NSProcessInfo processInfo] activeProcessorCount];
+    }
+    #if ! defined(NDEBUG)
+    {
+        NSInteger   parseConcurrency;
+        
+        parseConcurrency = [[NSUserDefaults standardUserDefaults] integerForKey:galleryParseConcurrencyKey];
+        if (parseConcurrency > 0) {
+            self.parserOperation.parseConcurrency = (NSUInteger) parseConcurrency;
+        }
+    }
+    #endif
+    
     //入列,开始执行 main 方法, 添加到 NetworkManger 的CPU队列(queueForCPU)上执行,也就是在main thread 上面执行,指定回调函数parserOperationDone:
-    [[NetworkManager sharedManager] addCPUOperation:self.parserOperation finishedTarget:self action:@selector(parserOperationDone:)];
+    [[NetworkManager sharedManager] addCPUOperation:self.parserOperation finishedTarget:self action:@selector(parserOperationDone:) group:self.galleryContext.operationGroup];
 
     self.syncState = kPhotoGallerySyncStateParsing; // 改变动作状态为 Parsing
 }
@@ -1021,16 +1608,61 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
 
     [[QLog log] logOption:kLogOptionSyncDetails withFormat:@"%s gallery %zu sync parse done",__PRETTY_FUNCTION__, (size_t) self.sequenceNumber];
     
+    // If the previous sync hasn't been saved yet, save it now, so that the journal only 
+    // ever has one sync pending.
+    
+    if ( (operation.error == nil) && self.syncJournal.hasPendingSync ) {
+        [self save];
+    }
+    
     if (operation.error != nil) { // 分析 xml 有错误
         self.lastSyncError = operation.error;
         self.syncState = kPhotoGallerySyncStateStopped;
+    } else if ( (operation.deltaFrom != nil) && ! [operation.deltaFrom isEqual:self.syncJournal.changeToken] && (self.getDeltaFrom == nil) ) {
+        // We asked for the full index and got a delta that doesn't apply to what we have.  
+        // That's either our fallback full sync (below) getting a delta again, or a server 
+        // that never sends anything else; either way, asking again won't help.
+        // 请求全量却收到了增量, 同步失败, 不再重试.
+        [[QLog log] logWithFormat:@"%s gallery %zu sync delta from %@ in response to a full get", __PRETTY_FUNCTION__, (size_t) self.sequenceNumber, operation.deltaFrom];
+        self.lastSyncError = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadCorruptFileError userInfo:nil];
+        self.syncState = kPhotoGallerySyncStateStopped;
+    } else if ( (operation.deltaFrom != nil) && ! [operation.deltaFrom isEqual:self.syncJournal.changeToken] ) {
+        // The delta doesn't apply to what we have (the database has moved on since we 
+        // asked), so we can't use it.  Forget our token and do a full sync.  That get 
+        // goes out without a token, so this happens at most once per sync.
+        // 增量和本地的版本对不上, 改为全量同步.
+        [[QLog log] logWithFormat:@"%s gallery %zu sync delta from %@ doesn't match %@, falling back to a full sync", __PRETTY_FUNCTION__, (size_t) self.sequenceNumber, operation.deltaFrom, self.syncJournal.changeToken];
+        [self.syncJournal forgetChangeToken];
+        self.syncState = kPhotoGallerySyncStateStopped;
+        self.parserOperation = nil;
+        [self startGetOperation];
+        return;
+    } else if ( ! [self.syncJournal beginSyncWithChangeToken:operation.changeToken deltaFrom:operation.deltaFrom results:operation.results removedPhotoIDs:operation.removedPhotoIDs] && (operation.deltaFrom != nil) ) {
+        // A delta that isn't in the journal can't be recovered if we die before the 
+        // save, so don't apply it.  Forgetting the token means the next sync is a full one.
+        [self.syncJournal forgetChangeToken];
+        self.lastSyncError = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteUnknownError userInfo:nil];
+        self.syncState = kPhotoGallerySyncStateStopped;
     } else {
-        [self commitParserResults:operation.results];
+        // Pick up the thumbnail batch endpoint (if any) before committing, so that the 
+        // thumbnail updates that the commit kicks off can use it.
+        self.galleryContext.thumbnailBatchPath = operation.thumbnailBatchPath;
+        
+        if (operation.deltaFrom != nil) {
+            [self commitParserResults:operation.results removedPhotoIDs:operation.removedPhotoIDs];
+        } else {
+            [self commitParserResults:operation.results removedPhotoIDs:nil];
+        }
         
         assert(self.lastSyncError == nil);
         self.lastSyncDate = [NSDate date];  //保存一个时间戳
+        self->_lastSyncDuration = [self.lastSyncDate timeIntervalSinceDate:self->_syncStartDate];
         self.syncState = kPhotoGallerySyncStateStopped;
-        [[QLog log] logWithFormat:@"%s gallery %zu sync success",__PRETTY_FUNCTION__, (size_t) self.sequenceNumber];
+        if (operation.deltaFrom != nil) {
+            [[QLog log] logWithFormat:@"%s gallery %zu sync success in %.3f s (delta %@ -> %@, %zu changed, %zu removed)",__PRETTY_FUNCTION__, (size_t) self.sequenceNumber, self.lastSyncDuration, operation.deltaFrom, operation.changeToken, (size_t) [operation.results count], (size_t) [operation.removedPhotoIDs count]];
+        } else {
+            [[QLog log] logWithFormat:@"%s gallery %zu sync success in %.3f s (full, %zu photos)",__PRETTY_FUNCTION__, (size_t) self.sequenceNumber, self.lastSyncDuration, (size_t) [operation.results count]];
+        }
     }
 
     self.parserOperation = nil;
@@ -1106,20 +1738,41 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
  
    Commits the results of parsing our the gallery's XML to the Core Data database.
  
+   If removedPhotoIDs is nil, parserResults is the full index, and any photo that's not 
+   in it is deleted.  Otherwise parserResults is a delta: only the photos it names, and 
+   those in removedPhotoIDs, are fetched, and only the latter are deleted.
+   removedPhotoIDs 不为 nil 时是增量同步, 只处理增量里提到的 photo.
+ 
  *  @param parserResults
+ *  @param removedPhotoIDs
  */
-- (void)commitParserResults:(NSArray *)parserResults
+- (void)commitParserResults:(NSArray *)parserResults removedPhotoIDs:(NSArray *)removedPhotoIDs
 {
     NSError *           error;
     NSDate *            syncDate;
+    uint64_t            traceStartTime;
+
+    traceStartTime = QTraceIsRecording() ? QTraceNow() : 0;
 
     syncDate = [NSDate date]; //当前的时间戳
     assert(syncDate != nil);
 
     // Start by getting all of the photos that we currently have in the database.
     // 我们当前 在数据库里 已经有的所有 photos
+    // For a delta, only the photos that the delta mentions.
     NSArray *           knownPhotos;    // of Photo
-    knownPhotos = [self.galleryContext executeFetchRequest:[self photosFetchRequest] error:&error];
+    NSFetchRequest *    fetchRequest;
+    fetchRequest = [self photosFetchRequest];
+    assert(fetchRequest != nil);
+    if (removedPhotoIDs != nil) {
+        NSMutableArray *    deltaIDs;
+        
+        deltaIDs = [NSMutableArray arrayWithArray:removedPhotoIDs];
+        assert(deltaIDs != nil);
+        [deltaIDs addObjectsFromArray:[parserResults valueForKey:kGalleryParserResultPhotoID]];
+        [fetchRequest setPredicate:[NSPredicate predicateWithFormat:@"photoID IN %@", deltaIDs]];
+    }
+    knownPhotos = [self.galleryContext executeFetchRequest:fetchRequest error:&error];
     assert(knownPhotos != nil);
     
     if (knownPhotos != nil) { // 有错误返回 nil,没有错误没有匹配,返回空 array
@@ -1134,9 +1787,13 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
         // As we refresh each existing photo, we remove it from this set.
         // Any photos left over are no longer present in the XML, and we remove them.
         // 任何存在与Core Data 中,但是不再存在于 XML 中的,删除他们.
+        // For a delta, photosToRemove starts out as just the photos that the delta removes.
         NSMutableSet *  photosToRemove;
         photosToRemove = [NSMutableSet setWithArray:knownPhotos]; // 默认是初始化所有的在 Core Data 中的 Photo 对象,都标记为删除,除非新获取的 xml 中包含此 photoID
         assert(photosToRemove != nil);
+        if (removedPhotoIDs != nil) {
+            [photosToRemove filterUsingPredicate:[NSPredicate predicateWithFormat:@"photoID IN %@", removedPhotoIDs]];
+        }
         
         // Create photoIDToKnownPhotos, which is a map from photoID to photo.
         // We use this to quickly determine if a photo with a specific photoID currently exists.
@@ -1161,6 +1818,10 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
         NSMutableSet *  parserIDs = [NSMutableSet set];
         assert(parserIDs != nil);
         
+        // The photos that we refreshed or created, for the metadata store.
+        NSMutableArray *    syncedPhotos = [NSMutableArray array];
+        assert(syncedPhotos != nil);
+        
         // Iterate through the incoming XML results, processing each one in turn.
         // 轮询处理我们从网络下载的 photo 元素组成的数组 parserResults  (其中每个 photo 元素是由其属性,以及其包含的image子标签属性,组成的dictionary数据结构)
         for (NSDictionary * parserResult in parserResults) {
@@ -1184,6 +1845,7 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
                     [parserResult objectForKey:kGalleryParserResultDate],           @"date", 
                     [parserResult objectForKey:kGalleryParserResultPhotoPath],      @"remotePhotoPath", 
                     [parserResult objectForKey:kGalleryParserResultThumbnailPath],  @"remoteThumbnailPath", 
+                    [parserResult objectForKey:kGalleryParserResultVariants],       @"variants", 
                     nil
                 ];
                 assert(properties != nil);
@@ -1217,8 +1879,15 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
                     
                     [photoIDToKnownPhotos setObject:knownPhoto forKey:knownPhoto.photoID];
                 }
+                [syncedPhotos addObject:knownPhoto];
             }
         }
+        
+        if (self.metadataStore != nil) {
+            [self updateMetadataStoreWithPhotos:syncedPhotos removedPhotos:photosToRemove];
+        } else if (self.metadataStoreRebuildOperation != nil) {
+            self->_metadataStoreRebuildStale = YES;
+        }
 
         // Remove any photos that are no longer present in the XML.
         // 删除所有存在与 Core Data 中,但是已经不存在于新获取的 XML 中的 Photo 对象
@@ -1231,6 +1900,10 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
     #if ! defined(NDEBUG)
         [self checkDatabase];
     #endif
+
+    if ( (traceStartTime != 0) && QTraceIsRecording() ) {
+        [[QTrace trace] recordSpanNamed:"-[PhotoGallery commitParserResults:removedPhotoIDs:]" object:nil startTime:traceStartTime];
+    }
 }
 
 
@@ -1244,12 +1917,31 @@ App 的 Library目录结构,每个 App 的 Library 都是独立的
             assert(self.getOperation == nil);
             
             self.lastSyncError = nil;
+            [self->_syncStartDate release];
+            self->_syncStartDate = [[NSDate alloc] init];
             // Starts the HTTP operation to GET the photo gallery's XML.
             [self startGetOperation];
         }
     }
 }
 
+- (void)syncTimerDidFire:(NSTimer *)timer
+{
+    #pragma unused(timer)
+    assert(timer == self.syncTimer);
+    [[QLog log] logOption:kLogOptionSyncDetails withFormat:@"%s gallery %zu periodic sync",__PRETTY_FUNCTION__, (size_t) self.sequenceNumber];
+    [self startSync];
+}
+
+- (void)setSyncWeight:(double)newValue
+{
+    assert(newValue > 0.0);
+    self->_syncWeight = newValue;
+    if (self.galleryContext != nil) {
+        self.galleryContext.operationGroup.weight = newValue;
+    }
+}
+
 // Force a sync to stop right now.  Does nothing if a no sync is in progress.
 - (void)stopSync
 {
@@ -1,5 +1,10 @@
 #import <CoreData/CoreData.h>
 
+@class NetworkOperationGroup;
+@class MakeThumbnailOperation;
+@class MakeThumbnailBatchOperation;
+@class Photo;
+
 // There's a one-to-one relationship between PhotoGallery and PhotoGalleryContext objects. 
 // The reason why certain bits of state are stored here, rather than in PhotoGallery, is 
 // so that managed objects, specifically the Photo objects, can get access to this state 
@@ -10,8 +15,25 @@
 
 @interface PhotoGalleryContext : NSManagedObjectContext
 {
-    NSString *      _galleryURLString;
-    NSString *      _galleryCachePath;
+    NSString *              _galleryURLString;
+    NSString *              _galleryCachePath;
+    NSMutableDictionary *   _photoVariants;
+    NetworkOperationGroup * _operationGroup;
+    BOOL                    _measuringFirstThumbnail;
+    BOOL                    _syncPrewarmed;
+    NSDate *                _firstThumbnailStartDate;
+    long long               _syncBytesFromCache;
+    long long               _syncBytesFromNetwork;
+    MakeThumbnailBatchOperation *   _thumbnailBatch;
+    NSString *              _thumbnailBatchPath;
+    NSMutableDictionary *   _thumbnailGetPhotos;
+    NSMutableArray *        _thumbnailGetPendingIDs;
+    NSMutableArray *        _thumbnailGetOperations;
+    NSMutableArray *        _thumbnailGetOperationPhotoIDs;
+    NSUInteger              _thumbnailBurstOutstanding;
+    NSUInteger              _thumbnailBurstThumbnails;
+    NSUInteger              _thumbnailBurstRequests;
+    CFAbsoluteTime          _thumbnailBurstStartTime;
 }
 
 - (id)initWithGalleryURLString:(NSString *)galleryURLString galleryCachePath:(NSString *)galleryCachePath;
@@ -22,6 +44,12 @@
 // 路径示例: "/var/mobile/Applications/8181B390-29AC-4311-B18B-E0992F70D8DC/Library/Caches/Gallery418482044.875488997.gallery/Photos/"
 
 @property (nonatomic, copy,   readonly ) NSString *     photosDirectoryPath;    // path to Photos directory within galleryCachePath
+@property (nonatomic, copy,   readonly ) NSString *     tilesDirectoryPath;     // path to Tiles directory within galleryCachePath, which may not exist yet
+
+// All of the operations started on behalf of this gallery (by PhotoGallery and by the Photo 
+// objects) are added to this group, so that PhotoGallery can cancel them all in one go when 
+// the gallery is stopped.
+@property (nonatomic, retain, readonly ) NetworkOperationGroup *  operationGroup;
 
 
 // Returns a mutable request that's configured to do an HTTP GET operation for a resources with the given path relative to the galleryURLString.
@@ -33,4 +61,74 @@
 // 如果 path 不是 nil ,也不是一个有效的 URL path, 返回 fail
 - (NSMutableURLRequest *)requestToGetGalleryRelativeString:(NSString *)path;
 
+// The variants of each photo (see kGalleryParserResultVariants), as recorded by the most recent 
+// sync.  These aren't stored in the database, so -photoVariantsForPhotoID: returns nil until the 
+// first sync after the gallery is opened; Photo falls back to its remotePhotoPath in that case.
+// These can only be called on the main thread.
+- (NSArray *)photoVariantsForPhotoID:(NSString *)photoID;
+- (void)setPhotoVariants:(NSArray *)variants forPhotoID:(NSString *)photoID;
+
+// First thumbnail latency.  PhotoGallery calls -noteSyncStartedWithPrewarm: when it starts a 
+// sync, and Photo calls -noteThumbnailGetStarted and -noteThumbnailArrived as thumbnails are 
+// fetched from the network.  The context logs the time from the first get after the sync 
+// starts to the first thumbnail arriving, along with whether the sync pre-warmed its 
+// connections, so that the two cases can be compared.
+// These can only be called on the main thread.
+- (void)noteSyncStartedWithPrewarm:(BOOL)prewarmed;
+- (void)noteThumbnailGetStarted;
+- (void)noteThumbnailArrived;
+
+// Response bytes.  The gallery XML get and the thumbnail gets go through the shared 
+// QHTTPResponseCache, and report how many bytes they got from it and from the network 
+// via -noteResponseBytesFromCache:fromNetwork:.  The totals cover everything from one 
+// sync starting to the next, which includes the thumbnails that the sync brings in, 
+// and are logged when the next sync starts (or by -logResponseBytes).
+// These can only be called on the main thread.
+- (void)noteResponseBytesFromCache:(long long)bytesFromCache fromNetwork:(long long)bytesFromNetwork;
+- (void)logResponseBytes;
+
+// Thumbnail batching.  Photo passes each thumbnail resize operation whose image data 
+// is already in hand to -addThumbnailOperationToBatch: before queueing it.  The context gathers the resize 
+// operations started in one pass of the run loop (up to a limit) into a 
+// MakeThumbnailBatchOperation, which it queues at the end of that pass, or as soon as 
+// the batch is full.  The batch makes all the thumbnails with one set of scratch buffers; 
+// see MakeThumbnailOperation.h.
+// This can only be called on the main thread.
+- (void)addThumbnailOperationToBatch:(MakeThumbnailOperation *)operation;
+
+// Batched thumbnail gets.  If the gallery advertises a thumbnail batch endpoint (see 
+// -[GalleryParserOperation thumbnailBatchPath]), PhotoGallery sets thumbnailBatchPath after 
+// each sync, and Photo offers each thumbnail get to -addPhotoToThumbnailGetBatch: before 
+// falling back to a get of its own.  As with the resize batches above, the context gathers 
+// the photos offered in one pass of the run loop (up to a limit) and fetches all of their 
+// thumbnails with one request, whose multipart/mixed response is parsed as it arrives (see 
+// MultipartHTTPOperation).  Each part, identified by its Content-ID header, goes straight 
+// to its photo, which starts the resize.  Once the request is done, any photo that didn't 
+// get a part (because the request failed, or the server left it out) is told to get its 
+// thumbnail on its own.
+//
+// The batch path isn't stored in the database, so thumbnails are fetched one at a time 
+// until the first sync after the gallery is opened, and the debug-only thumbnailNoBatchGet 
+// preference turns batching off, for comparison.
+//
+// -addPhotoToThumbnailGetBatch: returns NO if the gallery doesn't support batches, in which 
+// case the photo should do its own get.  Photo calls -removePhotoFromThumbnailGetBatch: if 
+// it stops its thumbnail get before the batch delivers; any part that arrives for it 
+// afterwards is ignored.  The context doesn't retain the photos.
+// These can only be called on the main thread.
+@property (nonatomic, copy,   readwrite) NSString *     thumbnailBatchPath;     // nil if the gallery doesn't support batches
+- (BOOL)addPhotoToThumbnailGetBatch:(Photo *)photo;
+- (void)removePhotoFromThumbnailGetBatch:(Photo *)photo;
+
+// Thumbnail bursts.  To compare the batched and unbatched cases, the context logs each 
+// burst of thumbnail gets (typically, a screenful), from the first get starting with none 
+// outstanding to the last one finishing, along with the number of thumbnails and the 
+// number of HTTP requests it took.  Photo calls -noteThumbnailGetStarted (above) and 
+// -noteThumbnailGetStopped as each thumbnail get starts and finishes, and 
+// -noteThumbnailRequestStarted for each request it makes; the context counts its own 
+// batch requests.
+// These can only be called on the main thread.
+- (void)noteThumbnailGetStopped;
+- (void)noteThumbnailRequestStarted;
+
 @end
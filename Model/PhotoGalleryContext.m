@@ -1,5 +1,24 @@
 #import "PhotoGalleryContext.h"
 #import "NetworkManager.h"
+#import "MakeThumbnailOperation.h"
+#import "MultipartHTTPOperation.h"
+#import "Photo.h"
+#import "Logging.h"
+
+enum {
+    kThumbnailBatchMaximumCount     = 8,
+    kThumbnailGetBatchMaximumCount  = 16        // a bit more than a screenful
+};
+
+@interface PhotoGalleryContext ()
+
+// forward declarations
+
+- (void)queueThumbnailBatch;
+- (void)sendThumbnailGetBatch;
+- (BOOL)batchesThumbnailGets;
+
+@end
 
 @implementation PhotoGalleryContext
 
@@ -12,6 +31,22 @@
     if (self != nil) {
         self->_galleryURLString = [galleryURLString copy];
         self->_galleryCachePath = [galleryCachePath copy];
+        self->_photoVariants    = [[NSMutableDictionary alloc] init];
+        assert(self->_photoVariants != nil);
+        self->_operationGroup   = [[NetworkOperationGroup alloc] initWithName:[galleryCachePath lastPathComponent]];
+        assert(self->_operationGroup != nil);
+        
+        // The photos remove themselves when they stop their thumbnail get, so the 
+        // dictionary doesn't retain them.
+        
+        self->_thumbnailGetPhotos = (NSMutableDictionary *) CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+        assert(self->_thumbnailGetPhotos != nil);
+        self->_thumbnailGetPendingIDs = [[NSMutableArray alloc] init];
+        assert(self->_thumbnailGetPendingIDs != nil);
+        self->_thumbnailGetOperations = [[NSMutableArray alloc] init];
+        assert(self->_thumbnailGetOperations != nil);
+        self->_thumbnailGetOperationPhotoIDs = [[NSMutableArray alloc] init];
+        assert(self->_thumbnailGetOperationPhotoIDs != nil);
     }
     return self;
 }
@@ -20,11 +55,36 @@
 {
     [self->_galleryCachePath release];
     [self->_galleryURLString release];
+    [self->_photoVariants release];
+    [self->_operationGroup release];
+    [self->_firstThumbnailStartDate release];
+    assert(self->_thumbnailBatch == nil);       // the delayed perform retains us until it's queued
+    [self->_thumbnailBatch release];
+    [self->_thumbnailBatchPath release];
+    
+    // Any batched gets have been cancelled along with the operation group, but their 
+    // part notifications may still be on the way.  Also, the photos call 
+    // -removePhotoFromThumbnailGetBatch: as super turns them into faults, so make 
+    // sure that finds nothing.
+    
+    for (MultipartHTTPOperation * op in self->_thumbnailGetOperations) {
+        op.partTarget = nil;
+    }
+    [self->_thumbnailGetOperations release];
+    self->_thumbnailGetOperations = nil;
+    [self->_thumbnailGetOperationPhotoIDs release];
+    self->_thumbnailGetOperationPhotoIDs = nil;
+    [self->_thumbnailGetPendingIDs release];
+    self->_thumbnailGetPendingIDs = nil;
+    [self->_thumbnailGetPhotos release];
+    self->_thumbnailGetPhotos = nil;
     [super dealloc];
 }
 
 @synthesize galleryURLString = _galleryURLString;
 @synthesize galleryCachePath = _galleryCachePath;
+@synthesize operationGroup   = _operationGroup;
+@synthesize thumbnailBatchPath = _thumbnailBatchPath;
 
 - (NSString *)photosDirectoryPath
 {
@@ -41,6 +101,13 @@
     
 }
 
+- (NSString *)tilesDirectoryPath
+{
+    // See the comment in -photosDirectoryPath.
+    extern NSString * kTilesDirectoryName;
+    return [self.galleryCachePath stringByAppendingPathComponent:kTilesDirectoryName];
+}
+
 
 // 把 path 路径和 galleryURLString 相关, 然后返回一个配置好了的HTTP GET的 NSMutableURLRequest 对象
 // 如果参数 path 为 nil, 返回一个只有 galleryURLString 请求
@@ -81,4 +148,356 @@
     return result;
 }
 
+- (NSArray *)photoVariantsForPhotoID:(NSString *)photoID
+{
+    assert([NSThread isMainThread]);
+    assert(photoID != nil);
+    return [self->_photoVariants objectForKey:photoID];
+}
+
+- (void)setPhotoVariants:(NSArray *)variants forPhotoID:(NSString *)photoID
+{
+    assert([NSThread isMainThread]);
+    assert(photoID != nil);
+    if (variants == nil) {
+        [self->_photoVariants removeObjectForKey:photoID];
+    } else {
+        [self->_photoVariants setObject:[[variants copy] autorelease] forKey:photoID];
+    }
+}
+
+- (void)noteSyncStartedWithPrewarm:(BOOL)prewarmed
+{
+    assert([NSThread isMainThread]);
+    [self logResponseBytes];
+    self->_measuringFirstThumbnail = YES;
+    self->_syncPrewarmed = prewarmed;
+    [self->_firstThumbnailStartDate release];
+    self->_firstThumbnailStartDate = nil;
+}
+
+- (void)noteThumbnailGetStarted
+{
+    assert([NSThread isMainThread]);
+    if (self->_measuringFirstThumbnail && (self->_firstThumbnailStartDate == nil) ) {
+        self->_firstThumbnailStartDate = [[NSDate alloc] init];
+    }
+    if (self->_thumbnailBurstOutstanding == 0) {
+        self->_thumbnailBurstStartTime  = CFAbsoluteTimeGetCurrent();
+        self->_thumbnailBurstThumbnails = 0;
+        self->_thumbnailBurstRequests   = 0;
+    }
+    self->_thumbnailBurstOutstanding += 1;
+    self->_thumbnailBurstThumbnails  += 1;
+}
+
+- (void)noteThumbnailGetStopped
+{
+    assert([NSThread isMainThread]);
+    assert(self->_thumbnailBurstOutstanding != 0);
+    if (self->_thumbnailBurstOutstanding != 0) {
+        self->_thumbnailBurstOutstanding -= 1;
+        if (self->_thumbnailBurstOutstanding == 0) {
+            [[QLog log] logWithFormat:@"%s gallery %@ thumbnail burst %zu thumbnails in %.3f s, %zu requests (%.2f per thumbnail, batching %s)", 
+                __PRETTY_FUNCTION__, 
+                [self.galleryCachePath lastPathComponent], 
+                (size_t) self->_thumbnailBurstThumbnails, 
+                CFAbsoluteTimeGetCurrent() - self->_thumbnailBurstStartTime, 
+                (size_t) self->_thumbnailBurstRequests, 
+                (double) self->_thumbnailBurstRequests / (double) self->_thumbnailBurstThumbnails, 
+                [self batchesThumbnailGets] ? "on" : "off"
+            ];
+        }
+    }
+}
+
+- (void)noteThumbnailRequestStarted
+{
+    assert([NSThread isMainThread]);
+    self->_thumbnailBurstRequests += 1;
+}
+
+- (void)noteThumbnailArrived
+{
+    assert([NSThread isMainThread]);
+    if (self->_measuringFirstThumbnail && (self->_firstThumbnailStartDate != nil) ) {
+        [[QLog log] logWithFormat:@"%s gallery %@ first thumbnail latency %.3f s (pre-warm %s)", __PRETTY_FUNCTION__, [self.galleryCachePath lastPathComponent], -[self->_firstThumbnailStartDate timeIntervalSinceNow], self->_syncPrewarmed ? "on" : "off"];
+        self->_measuringFirstThumbnail = NO;
+        [self->_firstThumbnailStartDate release];
+        self->_firstThumbnailStartDate = nil;
+    }
+}
+
+- (void)noteResponseBytesFromCache:(long long)bytesFromCache fromNetwork:(long long)bytesFromNetwork
+{
+    assert([NSThread isMainThread]);
+    self->_syncBytesFromCache   += bytesFromCache;
+    self->_syncBytesFromNetwork += bytesFromNetwork;
+}
+
+- (void)logResponseBytes
+{
+    long long   total;
+
+    assert([NSThread isMainThread]);
+    total = self->_syncBytesFromCache + self->_syncBytesFromNetwork;
+    if (total != 0) {
+        [[QLog log] logWithFormat:@"%s gallery %@ sync response bytes %lld from cache, %lld from network (%.0f%% cached)", __PRETTY_FUNCTION__, [self.galleryCachePath lastPathComponent], self->_syncBytesFromCache, self->_syncBytesFromNetwork, 100.0 * (double) self->_syncBytesFromCache / (double) total];
+    }
+    self->_syncBytesFromCache   = 0;
+    self->_syncBytesFromNetwork = 0;
+}
+
+- (void)addThumbnailOperationToBatch:(MakeThumbnailOperation *)operation
+{
+    assert([NSThread isMainThread]);
+    assert(operation != nil);
+    
+    if (self->_thumbnailBatch == nil) {
+        self->_thumbnailBatch = [[MakeThumbnailBatchOperation alloc] init];
+        assert(self->_thumbnailBatch != nil);
+        #if ! defined(NDEBUG)
+            self->_thumbnailBatch.benchmarks = [[NSUserDefaults standardUserDefaults] boolForKey:@"thumbnailBenchmark"];
+        #endif
+        [self performSelector:@selector(queueThumbnailBatch) withObject:nil afterDelay:0.0];
+    }
+    [self->_thumbnailBatch addThumbnailOperation:operation];
+    if ([self->_thumbnailBatch.thumbnailOperations count] >= kThumbnailBatchMaximumCount) {
+        [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(queueThumbnailBatch) object:nil];
+        [self queueThumbnailBatch];
+    }
+}
+
+- (void)queueThumbnailBatch
+    // Queues the batch that's being gathered.  The batch runs at the same priority as 
+    // the resize operations it's standing in for.
+{
+    MakeThumbnailBatchOperation *   batch;
+    
+    assert([NSThread isMainThread]);
+    batch = self->_thumbnailBatch;
+    self->_thumbnailBatch = nil;
+    if (batch != nil) {
+        if ( [batch respondsToSelector:@selector(setThreadPriority:)] ) {
+            [batch setThreadPriority:0.2];
+        }
+        [batch setQueuePriority:NSOperationQueuePriorityLow];
+        [[NetworkManager sharedManager] addCPUOperation:batch finishedTarget:self action:@selector(thumbnailBatchDone:) group:self.operationGroup];
+        [batch release];
+    }
+}
+
+// Returns YES if thumbnails should be fetched in batches, that is, if the gallery 
+// supports it and, in the debug build, the thumbnailNoBatchGet preference isn't set.
+- (BOOL)batchesThumbnailGets
+{
+    BOOL    result;
+    
+    result = (self.thumbnailBatchPath != nil);
+    #if ! defined(NDEBUG)
+        if ( [[NSUserDefaults standardUserDefaults] boolForKey:@"thumbnailNoBatchGet"] ) {
+            result = NO;
+        }
+    #endif
+    return result;
+}
+
+- (BOOL)addPhotoToThumbnailGetBatch:(Photo *)photo
+{
+    assert([NSThread isMainThread]);
+    assert(photo != nil);
+    assert(photo.photoID != nil);
+    
+    if ( ! [self batchesThumbnailGets] ) {
+        return NO;
+    }
+    
+    // Photo IDs are unique within a gallery, so this shouldn't happen, but if it does 
+    // we'd have no way to tell which photo a part was for.
+    
+    if ([self->_thumbnailGetPhotos objectForKey:photo.photoID] != nil) {
+        return NO;
+    }
+    
+    if ([self->_thumbnailGetPendingIDs count] == 0) {
+        [self performSelector:@selector(sendThumbnailGetBatch) withObject:nil afterDelay:0.0];
+    }
+    [self->_thumbnailGetPhotos setObject:photo forKey:photo.photoID];
+    [self->_thumbnailGetPendingIDs addObject:photo.photoID];
+    if ([self->_thumbnailGetPendingIDs count] >= kThumbnailGetBatchMaximumCount) {
+        [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(sendThumbnailGetBatch) object:nil];
+        [self sendThumbnailGetBatch];
+    }
+    return YES;
+}
+
+- (void)removePhotoFromThumbnailGetBatch:(Photo *)photo
+{
+    assert([NSThread isMainThread]);
+    assert(photo != nil);
+    
+    if ( (photo.photoID != nil) && ([self->_thumbnailGetPhotos objectForKey:photo.photoID] == photo) ) {
+        [self->_thumbnailGetPendingIDs removeObject:photo.photoID];
+        [self->_thumbnailGetPhotos removeObjectForKey:photo.photoID];
+    }
+}
+
+- (void)sendThumbnailGetBatch
+    // Sends one request for the thumbnails of the photos gathered so far.
+{
+    NSArray *               photoIDs;
+    NSMutableArray *        escapedIDs;
+    NSMutableURLRequest *   request;
+    
+    assert([NSThread isMainThread]);
+    
+    photoIDs = [[self->_thumbnailGetPendingIDs copy] autorelease];
+    [self->_thumbnailGetPendingIDs removeAllObjects];
+    if ([photoIDs count] == 0) {
+        return;
+    }
+    
+    escapedIDs = [NSMutableArray arrayWithCapacity:[photoIDs count]];
+    assert(escapedIDs != nil);
+    for (NSString * photoID in photoIDs) {
+        [escapedIDs addObject:[(NSString *) CFURLCreateStringByAddingPercentEscapes(
+            NULL, 
+            (CFStringRef) photoID, 
+            NULL, 
+            CFSTR(":/?#[]@!$&'()*+,;="), 
+            kCFStringEncodingUTF8
+        ) autorelease]];
+    }
+    request = [self requestToGetGalleryRelativeString:[NSString stringWithFormat:@"%@%@ids=%@", 
+        self.thumbnailBatchPath, 
+        ([self.thumbnailBatchPath rangeOfString:@"?"].location == NSNotFound) ? @"?" : @"&", 
+        [escapedIDs componentsJoinedByString:@","]
+    ]];
+    
+    if (request == nil) {
+        [[QLog log] logWithFormat:@"%s gallery %@ thumbnail batch bad path '%@'", __PRETTY_FUNCTION__, [self.galleryCachePath lastPathComponent], self.thumbnailBatchPath];
+        for (NSString * photoID in photoIDs) {
+            Photo *     photo;
+            
+            photo = [self->_thumbnailGetPhotos objectForKey:photoID];
+            [self->_thumbnailGetPhotos removeObjectForKey:photoID];
+            [photo thumbnailGetBatchDidFail];
+        }
+    } else {
+        MultipartHTTPOperation *    op;
+        
+        op = [[[MultipartHTTPOperation alloc] initWithRequest:request] autorelease];
+        assert(op != nil);
+        
+        op.acceptableContentTypes = [NSSet setWithObject:@"multipart/mixed"];
+        op.partTarget = self;
+        op.partAction = @selector(thumbnailGetBatchPartsAvailable:);
+        [op setQueuePriority:NSOperationQueuePriorityLow];
+        
+        [self->_thumbnailGetOperations addObject:op];
+        [self->_thumbnailGetOperationPhotoIDs addObject:photoIDs];
+        
+        [[QLog log] logWithFormat:@"%s gallery %@ thumbnail batch get start, %zu photos", __PRETTY_FUNCTION__, [self.galleryCachePath lastPathComponent], (size_t) [photoIDs count]];
+        [self noteThumbnailRequestStarted];
+        [[NetworkManager sharedManager] addNetworkTransferOperation:op finishedTarget:self action:@selector(thumbnailGetBatchDone:) group:self.operationGroup];
+    }
+}
+
+- (void)deliverThumbnailGetBatchParts:(NSArray *)parts
+    // Hands each part to its photo.  A part for a photo we're not waiting on (because 
+    // it's stopped its get, or the server sent something we didn't ask for) is dropped, 
+    // as is a part that isn't a usable image; in the latter case the photo will fall 
+    // back to its own get when the batch is done.
+{
+    assert([NSThread isMainThread]);
+    assert(parts != nil);
+    
+    for (NSDictionary * part in parts) {
+        NSDictionary *  headers;
+        NSData *        body;
+        NSString *      photoID;
+        NSString *      MIMEType;
+        Photo *         photo;
+        
+        headers  = [part objectForKey:kMultipartHTTPOperationPartHeaders];
+        body     = [part objectForKey:kMultipartHTTPOperationPartBody];
+        photoID  = [[headers objectForKey:@"content-id"] stringByTrimmingCharactersInSet:[NSCharacterSet characterSetWithCharactersInString:@"<> "]];
+        MIMEType = [[[[headers objectForKey:@"content-type"] componentsSeparatedByString:@";"] objectAtIndex:0] lowercaseString];
+        
+        photo = nil;
+        if (photoID != nil) {
+            photo = [self->_thumbnailGetPhotos objectForKey:photoID];
+        }
+        if ( (photo != nil) && ([body length] != 0) && ([MIMEType isEqual:@"image/jpeg"] || [MIMEType isEqual:@"image/png"]) ) {
+            [self->_thumbnailGetPhotos removeObjectForKey:photoID];
+            [photo thumbnailGetBatchDidReceiveData:body MIMEType:MIMEType];
+        }
+    }
+}
+
+- (void)thumbnailGetBatchPartsAvailable:(MultipartHTTPOperation *)op
+{
+    assert([NSThread isMainThread]);
+    assert([op isKindOfClass:[MultipartHTTPOperation class]]);
+    
+    [self deliverThumbnailGetBatchParts:[op takeParts]];
+}
+
+- (void)thumbnailGetBatchDone:(MultipartHTTPOperation *)op
+{
+    NSUInteger  opIndex;
+    NSArray *   photoIDs;
+    NSUInteger  missingCount;
+    
+    assert([NSThread isMainThread]);
+    assert([op isKindOfClass:[MultipartHTTPOperation class]]);
+    
+    opIndex = [self->_thumbnailGetOperations indexOfObjectIdenticalTo:op];
+    assert(opIndex != NSNotFound);
+    photoIDs = [[[self->_thumbnailGetOperationPhotoIDs objectAtIndex:opIndex] retain] autorelease];
+    op.partTarget = nil;
+    [[op retain] autorelease];
+    [self->_thumbnailGetOperations removeObjectAtIndex:opIndex];
+    [self->_thumbnailGetOperationPhotoIDs removeObjectAtIndex:opIndex];
+    
+    [self noteResponseBytesFromCache:op.responseBytesFromCache fromNetwork:op.responseBytesFromNetwork];
+    
+    // Pick up any parts that arrived after the last notification, then send any photo 
+    // that's still waiting off to get its thumbnail on its own.
+    
+    [self deliverThumbnailGetBatchParts:[op takeParts]];
+    
+    missingCount = 0;
+    for (NSString * photoID in photoIDs) {
+        Photo *     photo;
+        
+        photo = [self->_thumbnailGetPhotos objectForKey:photoID];
+        if (photo != nil) {
+            [self->_thumbnailGetPhotos removeObjectForKey:photoID];
+            [photo thumbnailGetBatchDidFail];
+            missingCount += 1;
+        }
+    }
+    
+    if (op.error != nil) {
+        [[QLog log] logWithFormat:@"%s gallery %@ thumbnail batch get error %@, %zu parts, %zu of %zu photos falling back", __PRETTY_FUNCTION__, [self.galleryCachePath lastPathComponent], op.error, (size_t) op.partCount, (size_t) missingCount, (size_t) [photoIDs count]];
+    } else {
+        [[QLog log] logWithFormat:@"%s gallery %@ thumbnail batch get done, %zu parts, %zu of %zu photos falling back", __PRETTY_FUNCTION__, [self.galleryCachePath lastPathComponent], (size_t) op.partCount, (size_t) missingCount, (size_t) [photoIDs count]];
+    }
+}
+
+- (void)thumbnailBatchDone:(MakeThumbnailBatchOperation *)batch
+{
+    assert([NSThread isMainThread]);
+    assert([batch isKindOfClass:[MakeThumbnailBatchOperation class]]);
+    
+    if ( ! [batch isCancelled] && (batch.thumbnailCount != 0) ) {
+        if (batch.benchmarkCount == 0) {
+            [[QLog log] logWithFormat:@"%s gallery %@ thumbnail batch %zu of %zu in %.1f ms (%.0f thumbnails/s)", __PRETTY_FUNCTION__, [self.galleryCachePath lastPathComponent], (size_t) batch.thumbnailCount, (size_t) [batch.thumbnailOperations count], batch.elapsedTime * 1000.0, (double) batch.thumbnailCount / batch.elapsedTime];
+        } else {
+            [[QLog log] logWithFormat:@"%s gallery %@ thumbnail batch benchmark %zu thumbnails, resampler %.0f thumbnails/s, Core Graphics %.0f thumbnails/s, PSNR %.1f dB", __PRETTY_FUNCTION__, [self.galleryCachePath lastPathComponent], (size_t) batch.benchmarkCount, (double) batch.benchmarkCount / batch.kernelTime, (double) batch.benchmarkCount / batch.coreGraphicsTime, batch.peakSignalToNoiseRatio];
+        }
+    }
+}
+
 @end
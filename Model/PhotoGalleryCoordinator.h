@@ -0,0 +1,57 @@
+#import <Foundation/Foundation.h>
+
+@class PhotoGallery;
+
+// PhotoGalleryCoordinator runs a set of galleries side by side, for example a kiosk that 
+// keeps several feeds up to date in the background while the user looks at another one. 
+// The galleries already share the network, the CPU and memory through the process-wide 
+// NetworkManager queues and MemoryBudget, and their thumbnails through ThumbnailCache; 
+// the coordinator adds the policy on top:
+//
+// o Each gallery's operation group gets the weight it was added with, so that, when they're 
+//   all busy, each gets that share of the network transfer and CPU queues.
+//
+// o If syncInterval is set, the galleries sync periodically, with their phases spread evenly 
+//   across the interval, so that their syncs don't all land at once.
+//
+// 同时运行多个 gallery, 按权重共享网络和 CPU, 并且错开它们的定时同步.
+//
+// The coordinator is only accessed on the main thread.
+
+@interface PhotoGalleryCoordinator : NSObject
+{
+    NSMutableArray *        _galleries;
+    NSTimeInterval          _syncInterval;
+    BOOL                    _started;
+    
+    NSDate *                _benchmarkStartDate;
+    NSMutableSet *          _benchmarkPendingGalleries;     // galleries we're observing
+}
+
+@property (nonatomic, copy,   readonly ) NSArray *          galleries;
+@property (nonatomic, assign, readwrite) NSTimeInterval     syncInterval;   // default is 0, meaning no periodic syncs; set before -start
+
+// Creates a gallery for the URL, with the specified share of the queues (see 
+// -[PhotoGallery syncWeight]), and adds it to the coordinator.  If the coordinator has 
+// already started, the gallery starts too, but only galleries added before -start get 
+// staggered phases.
+- (PhotoGallery *)addGalleryWithURLString:(NSString *)galleryURLString weight:(double)weight;
+
+// Starts all of the galleries.
+- (void)start;
+
+// Like the PhotoGallery methods of the same name.
+- (void)save;
+- (void)stop;
+
+#if ! defined(NDEBUG)
+
+// Starts the galleries (which must not have been started) and logs how long each takes 
+// to sync.  After each sync the benchmark asks for the gallery's first thumbnails, as if 
+// they were on screen, and once every gallery has synced it logs the shared thumbnail 
+// cache's hit rate.
+- (void)startBenchmark;
+
+#endif
+
+@end
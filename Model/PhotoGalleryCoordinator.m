@@ -0,0 +1,195 @@
+#import "PhotoGalleryCoordinator.h"
+#import "PhotoGallery.h"
+#import "Photo.h"
+#import "ThumbnailCache.h"
+#import "Logging.h"
+
+@implementation PhotoGalleryCoordinator
+
+@synthesize syncInterval = _syncInterval;
+
+- (id)init
+{
+    self = [super init];
+    if (self != nil) {
+        self->_galleries = [[NSMutableArray alloc] init];
+        assert(self->_galleries != nil);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    // We should have been stopped before being released, which means we're no longer 
+    // observing the galleries.
+    assert([self->_benchmarkPendingGalleries count] == 0);
+    [self->_galleries release];
+    [self->_benchmarkPendingGalleries release];
+    [self->_benchmarkStartDate release];
+    [super dealloc];
+}
+
+- (NSArray *)galleries
+{
+    return [[self->_galleries copy] autorelease];
+}
+
+- (PhotoGallery *)addGalleryWithURLString:(NSString *)galleryURLString weight:(double)weight
+{
+    PhotoGallery *  gallery;
+    
+    assert([NSThread isMainThread]);
+    assert(galleryURLString != nil);
+    assert(weight > 0.0);
+    
+    gallery = [[[PhotoGallery alloc] initWithGalleryURLString:galleryURLString] autorelease];
+    assert(gallery != nil);
+    
+    gallery.syncWeight   = weight;
+    gallery.syncInterval = self.syncInterval;
+    [self->_galleries addObject:gallery];
+    
+    if (self->_started) {
+        [gallery start];
+    }
+    return gallery;
+}
+
+- (void)start
+{
+    NSUInteger  galleryCount;
+    NSUInteger  galleryIndex;
+    
+    assert([NSThread isMainThread]);
+    assert( ! self->_started );
+    
+    // Spread the phases evenly across the interval, so that, with N galleries, there's a 
+    // sync every interval/N seconds rather than N syncs every interval seconds.
+    
+    galleryCount = [self->_galleries count];
+    for (galleryIndex = 0; galleryIndex < galleryCount; galleryIndex++) {
+        PhotoGallery *  gallery;
+        
+        gallery = [self->_galleries objectAtIndex:galleryIndex];
+        gallery.syncPhase = self.syncInterval * galleryIndex / galleryCount;
+        [gallery start];
+    }
+    self->_started = YES;
+    
+    [[QLog log] logWithFormat:@"%s started %zu galleries, sync interval %.0f s", __PRETTY_FUNCTION__, (size_t) galleryCount, self.syncInterval];
+}
+
+- (void)save
+{
+    assert([NSThread isMainThread]);
+    for (PhotoGallery * gallery in self->_galleries) {
+        [gallery save];
+    }
+}
+
+- (void)stop
+{
+    assert([NSThread isMainThread]);
+    
+    #if ! defined(NDEBUG)
+        for (PhotoGallery * gallery in self->_benchmarkPendingGalleries) {
+            [gallery removeObserver:self forKeyPath:@"syncing"];
+        }
+        [self->_benchmarkPendingGalleries removeAllObjects];
+    #endif
+    for (PhotoGallery * gallery in self->_galleries) {
+        [gallery stop];
+    }
+    self->_started = NO;
+}
+
+#pragma mark - Benchmark
+
+#if ! defined(NDEBUG)
+
+// The number of thumbnails the benchmark asks each gallery for, which is about a screenful.
+
+static const NSUInteger kBenchmarkThumbnailCount = 12;
+
+- (void)startBenchmark
+{
+    assert([NSThread isMainThread]);
+    assert( ! self->_started );
+    assert([self->_benchmarkPendingGalleries count] == 0);
+    
+    [self->_benchmarkStartDate release];
+    self->_benchmarkStartDate = [[NSDate alloc] init];
+    if (self->_benchmarkPendingGalleries == nil) {
+        self->_benchmarkPendingGalleries = [[NSMutableSet alloc] init];
+        assert(self->_benchmarkPendingGalleries != nil);
+    }
+    [self->_benchmarkPendingGalleries addObjectsFromArray:self->_galleries];
+    for (PhotoGallery * gallery in self->_galleries) {
+        [gallery addObserver:self forKeyPath:@"syncing" options:0 context:&self->_benchmarkPendingGalleries];
+    }
+    
+    [self start];
+}
+
+// Asks for the first few thumbnails of the gallery, just as PhotoGalleryViewController 
+// would if the gallery were on screen.
+- (void)touchThumbnailsOfGallery:(PhotoGallery *)gallery
+{
+    NSFetchRequest *    request;
+    NSArray *           photos;
+    
+    request = [[[NSFetchRequest alloc] init] autorelease];
+    assert(request != nil);
+    [request setEntity:gallery.photoEntity];
+    [request setSortDescriptors:[NSArray arrayWithObject:[[[NSSortDescriptor alloc] initWithKey:@"date" ascending:YES] autorelease]]];
+    [request setFetchLimit:kBenchmarkThumbnailCount];
+    
+    photos = [gallery.managedObjectContext executeFetchRequest:request error:NULL];
+    for (Photo * photo in photos) {
+        (void) photo.thumbnailImage;
+    }
+}
+
+- (void)observeValueForKeyPath:(NSString *)keyPath ofObject:(id)object change:(NSDictionary *)change context:(void *)context
+{
+    if (context == &self->_benchmarkPendingGalleries) {
+        PhotoGallery *  gallery;
+        
+        assert([keyPath isEqual:@"syncing"]);
+        assert([NSThread isMainThread]);
+        gallery = (PhotoGallery *) object;
+        assert([self->_benchmarkPendingGalleries containsObject:gallery]);
+        
+        if ( ! gallery.isSyncing ) {
+            [gallery removeObserver:self forKeyPath:@"syncing"];
+            
+            [[QLog log] logWithFormat:@"%s gallery %@ synced in %.3f s, error %@", __PRETTY_FUNCTION__, gallery.galleryURLString, gallery.lastSyncDuration, gallery.lastSyncError];
+            if (gallery.lastSyncError == nil) {
+                [self touchThumbnailsOfGallery:gallery];
+            }
+            
+            [self->_benchmarkPendingGalleries removeObject:gallery];
+            if ([self->_benchmarkPendingGalleries count] == 0) {
+                ThumbnailCache *    cache;
+                
+                // The thumbnails for the last gallery are still in flight, so they don't 
+                // show up in these numbers.
+                
+                cache = [ThumbnailCache sharedCache];
+                [[QLog log] logWithFormat:@"%s %zu galleries synced in %.3f s; thumbnail cache %zu hits, %zu misses", 
+                    __PRETTY_FUNCTION__, 
+                    (size_t) [self->_galleries count], 
+                    -[self->_benchmarkStartDate timeIntervalSinceNow], 
+                    (size_t) cache.hitCount, 
+                    (size_t) cache.missCount
+                ];
+            }
+        }
+    } else if (NO) {   // Disabled because the super class does nothing useful with it.
+        [super observeValueForKeyPath:keyPath ofObject:object change:change context:context];
+    }
+}
+
+#endif
+
+@end
@@ -0,0 +1,64 @@
+#import <Foundation/Foundation.h>
+
+// PhotoMetadataBenchmarkOperation compares the two ways that PhotoGalleryViewController can
+// get at a gallery's photos: a date-sorted Core Data fetch of the Photo entity, as done by
+// its fetched results controller, and a PhotoMetadataStore.  It builds a scratch Core Data
+// database and a scratch store, each holding the same rowCount synthetic photos, and then
+// measures, for each:
+//
+// o open time -- from nothing to being able to show the first row, that is, adding the
+//   persistent store and executing the sorted fetch, versus opening the store
+//
+// o memory -- the growth in the process's resident size over the open, plus, for the store,
+//   the resident pages of its mapping
+//
+// o scroll cost -- the average time to read the name and date of a screenful of rows, at
+//   kScreenCount random positions, which is what -tableView:cellForRowAtIndexPath: does
+//
+// and logs the results.  The scratch directory is deleted afterwards.  AppDelegate runs this
+// in the debug build if the galleryMetadataBenchmarkRows user default is set (for example,
+// "-galleryMetadataBenchmarkRows 1000000" as a launch argument).
+//
+// Core Data 与列式元数据存储的对比测试: 打开时间, 内存, 滚动开销.
+
+@interface PhotoMetadataBenchmarkOperation : NSOperation
+{
+    NSUInteger          _rowCount;
+    NSString *          _directoryPath;
+    NSError *           _error;
+    NSTimeInterval      _coreDataBuildTime;
+    NSTimeInterval      _coreDataOpenTime;
+    unsigned long long  _coreDataOpenBytes;
+    NSTimeInterval      _coreDataScreenTime;
+    NSTimeInterval      _storeBuildTime;
+    NSTimeInterval      _storeOpenTime;
+    unsigned long long  _storeOpenBytes;
+    unsigned long long  _storeResidentBytes;
+    unsigned long long  _storeFileSize;
+    NSTimeInterval      _storeScreenTime;
+}
+
+// Configures the operation to benchmark rowCount photos, in a scratch directory at the
+// specified path, which the operation creates and then deletes.
+- (id)initWithRowCount:(NSUInteger)rowCount directoryPath:(NSString *)directoryPath;
+
+// properties specified at init time
+@property (assign, readonly ) NSUInteger            rowCount;
+@property (copy,   readonly ) NSString *            directoryPath;
+
+// properties that are valid after the operation is finished
+@property (copy,   readonly ) NSError *             error;
+
+@property (assign, readonly ) NSTimeInterval        coreDataBuildTime;
+@property (assign, readonly ) NSTimeInterval        coreDataOpenTime;
+@property (assign, readonly ) unsigned long long    coreDataOpenBytes;      // growth in resident size
+@property (assign, readonly ) NSTimeInterval        coreDataScreenTime;     // per screenful
+
+@property (assign, readonly ) NSTimeInterval        storeBuildTime;
+@property (assign, readonly ) NSTimeInterval        storeOpenTime;
+@property (assign, readonly ) unsigned long long    storeOpenBytes;         // growth in resident size
+@property (assign, readonly ) unsigned long long    storeResidentBytes;     // of the mapping, after scrolling
+@property (assign, readonly ) unsigned long long    storeFileSize;
+@property (assign, readonly ) NSTimeInterval        storeScreenTime;        // per screenful
+
+@end
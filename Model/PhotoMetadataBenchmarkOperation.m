@@ -0,0 +1,415 @@
+#import "PhotoMetadataBenchmarkOperation.h"
+#import "PhotoMetadataStore.h"
+#import "Logging.h"
+
+#import <CoreData/CoreData.h>
+
+#include <mach/mach.h>
+
+// The benchmark reads kScreenCount screenfuls of kScreenRowCount rows, which is about what
+// fits on the screen, at positions chosen by the same generator as the photos.  We insert
+// the photos into Core Data, and into the store, in batches of kBuildBatchSize, so that we
+// don't end up with all of them in memory at once.
+
+static const NSUInteger kScreenCount        = 100;
+static const NSUInteger kScreenRowCount     = 12;
+static const NSUInteger kBuildBatchSize     = 10000;
+static const uint64_t   kSeed               = 0x9e3779b97f4a7c15ULL;
+
+static NSString * kCoreDataFileName         = @"Benchmark.db";
+static NSString * kStoreFileName            = @"Benchmark.store";
+
+static uint64_t NextRandom(uint64_t * statePtr)
+    // xorshift64*
+{
+    uint64_t    x;
+
+    x = *statePtr;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *statePtr = x;
+    return x * 2685821657736338717ULL;
+}
+
+// Makes up the properties of the photo at the specified index.  Successive calls with the
+// same state produce the same photos, in the same, unsorted, date order.
+static void SyntheticPhoto(uint64_t * statePtr, NSUInteger index, NSString ** photoIDPtr, NSString ** namePtr, NSDate ** datePtr, NSString ** photoPathPtr, NSString ** thumbnailPathPtr)
+{
+    unsigned int    imageNumber;
+
+    *photoIDPtr       = [NSString stringWithFormat:@"%llu", (unsigned long long) NextRandom(statePtr)];
+    *namePtr          = [NSString stringWithFormat:@"Photo %zu", (size_t) index];
+    *datePtr          = [NSDate dateWithTimeIntervalSinceReferenceDate:300000000.0 + (double) (NextRandom(statePtr) % (365 * 24 * 60 * 60))];
+    imageNumber       = (unsigned int) (NextRandom(statePtr) % 10000);
+    *photoPathPtr     = [NSString stringWithFormat:@"images/IMG_%04u.jpg", imageNumber];
+    *thumbnailPathPtr = [NSString stringWithFormat:@"thumbnails/IMG_%04u.jpg", imageNumber];
+}
+
+static unsigned long long ResidentBytes(void)
+{
+    struct mach_task_basic_info info;
+    mach_msg_type_number_t      count;
+
+    count = MACH_TASK_BASIC_INFO_COUNT;
+    if ( task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t) &info, &count) != KERN_SUCCESS ) {
+        return 0;
+    }
+    return info.resident_size;
+}
+
+static unsigned long long Growth(unsigned long long before, unsigned long long after)
+{
+    return (after > before) ? (after - before) : 0;
+}
+
+@interface PhotoMetadataBenchmarkOperation ()
+
+// read/write versions of public properties
+@property (copy,   readwrite) NSError *     error;
+
+@end
+
+@implementation PhotoMetadataBenchmarkOperation
+
+- (id)initWithRowCount:(NSUInteger)rowCount directoryPath:(NSString *)directoryPath
+    // See comment in header.
+{
+    assert(rowCount >= kScreenRowCount);
+    assert(directoryPath != nil);
+    self = [super init];
+    if (self != nil) {
+        self->_rowCount = rowCount;
+        self->_directoryPath = [directoryPath copy];
+        assert(self->_directoryPath != nil);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self->_directoryPath release];
+    [self->_error release];
+    [super dealloc];
+}
+
+@synthesize rowCount           = _rowCount;
+@synthesize directoryPath      = _directoryPath;
+@synthesize error              = _error;
+@synthesize coreDataBuildTime  = _coreDataBuildTime;
+@synthesize coreDataOpenTime   = _coreDataOpenTime;
+@synthesize coreDataOpenBytes  = _coreDataOpenBytes;
+@synthesize coreDataScreenTime = _coreDataScreenTime;
+@synthesize storeBuildTime     = _storeBuildTime;
+@synthesize storeOpenTime      = _storeOpenTime;
+@synthesize storeOpenBytes     = _storeOpenBytes;
+@synthesize storeResidentBytes = _storeResidentBytes;
+@synthesize storeFileSize      = _storeFileSize;
+@synthesize storeScreenTime    = _storeScreenTime;
+
+// Returns the app's model, tweaked so that its entities are plain managed objects, so that
+// none of Photo's machinery (thumbnails, downloads and so on) gets involved.
+- (NSManagedObjectModel *)model
+{
+    NSString *              modelPath;
+    NSManagedObjectModel *  result;
+
+    modelPath = [[NSBundle mainBundle] pathForResource:@"Photos" ofType:@"mom"];
+    assert(modelPath != nil);
+
+    result = [[[NSManagedObjectModel alloc] initWithContentsOfURL:[NSURL fileURLWithPath:modelPath]] autorelease];
+    assert(result != nil);
+    for (NSEntityDescription * entity in [result entities]) {
+        [entity setManagedObjectClassName:NSStringFromClass([NSManagedObject class])];
+    }
+    return result;
+}
+
+- (NSManagedObjectContext *)contextForModel:(NSManagedObjectModel *)model error:(NSError **)errorPtr
+{
+    NSPersistentStoreCoordinator *  psc;
+    NSManagedObjectContext *        result;
+
+    result = nil;
+    psc = [[[NSPersistentStoreCoordinator alloc] initWithManagedObjectModel:model] autorelease];
+    assert(psc != nil);
+    if ( [psc addPersistentStoreWithType:NSSQLiteStoreType configuration:nil URL:[NSURL fileURLWithPath:[self.directoryPath stringByAppendingPathComponent:kCoreDataFileName]] options:nil error:errorPtr] != nil ) {
+        result = [[[NSManagedObjectContext alloc] init] autorelease];
+        assert(result != nil);
+        [result setPersistentStoreCoordinator:psc];
+        [result setUndoManager:nil];
+    }
+    return result;
+}
+
+- (BOOL)buildCoreDataWithModel:(NSManagedObjectModel *)model error:(NSError **)errorPtr
+{
+    BOOL                        success;
+    NSError *                   error;
+    NSManagedObjectContext *    context;
+    uint64_t                    state;
+    NSUInteger                  batchStart;
+    NSUInteger                  index;
+
+    error = nil;
+    context = [self contextForModel:model error:&error];
+    success = (context != nil);
+
+    state = kSeed;
+    for (batchStart = 0; success && (batchStart < self.rowCount); batchStart += kBuildBatchSize) {
+        NSAutoreleasePool *     pool;
+
+        pool = [[NSAutoreleasePool alloc] init];
+        assert(pool != nil);
+
+        for (index = batchStart; index < MIN(batchStart + kBuildBatchSize, self.rowCount); index++) {
+            NSString *          photoID;
+            NSString *          name;
+            NSDate *            date;
+            NSString *          photoPath;
+            NSString *          thumbnailPath;
+            NSManagedObject *   photo;
+
+            SyntheticPhoto(&state, index, &photoID, &name, &date, &photoPath, &thumbnailPath);
+            photo = [NSEntityDescription insertNewObjectForEntityForName:@"Photo" inManagedObjectContext:context];
+            assert(photo != nil);
+            [photo setValue:photoID       forKey:@"photoID"];
+            [photo setValue:name          forKey:@"displayName"];
+            [photo setValue:date          forKey:@"date"];
+            [photo setValue:photoPath     forKey:@"remotePhotoPath"];
+            [photo setValue:thumbnailPath forKey:@"remoteThumbnailPath"];
+        }
+        success = [context save:&error];
+        [context reset];
+
+        [error retain];
+        [pool drain];
+        [error autorelease];
+    }
+    if ( ! success && (errorPtr != NULL) ) {
+        *errorPtr = error;
+    }
+    return success;
+}
+
+- (BOOL)buildStore:(NSError **)errorPtr
+{
+    BOOL                    success;
+    PhotoMetadataStore *    store;
+    uint64_t                state;
+    NSUInteger              batchStart;
+    NSUInteger              index;
+
+    store = [[[PhotoMetadataStore alloc] initWithPath:[self.directoryPath stringByAppendingPathComponent:kStoreFileName]] autorelease];
+    assert(store != nil);
+
+    success = [store open:errorPtr];
+    if (success) {
+        [store beginUpdates];
+        [store removeAllRows];
+        state = kSeed;
+        for (batchStart = 0; batchStart < self.rowCount; batchStart += kBuildBatchSize) {
+            NSAutoreleasePool *     pool;
+
+            pool = [[NSAutoreleasePool alloc] init];
+            assert(pool != nil);
+
+            for (index = batchStart; index < MIN(batchStart + kBuildBatchSize, self.rowCount); index++) {
+                NSString *          photoID;
+                NSString *          name;
+                NSDate *            date;
+                NSString *          photoPath;
+                NSString *          thumbnailPath;
+
+                SyntheticPhoto(&state, index, &photoID, &name, &date, &photoPath, &thumbnailPath);
+                [store setPhotoID:photoID name:name date:date photoPath:photoPath thumbnailPath:thumbnailPath objectURI:nil];
+            }
+
+            [pool drain];
+        }
+        [store endUpdates];
+        [store markClean];
+        [store close];
+    }
+    return success;
+}
+
+// Reads kScreenCount screenfuls of rows, at the specified positions, through readRow,
+// and returns the average time per screenful.
+- (NSTimeInterval)scrollToPositions:(const NSUInteger *)positions readingRowsWith:(SEL)readRow from:(id)rows
+{
+    CFAbsoluteTime      startTime;
+    NSUInteger          screenIndex;
+    NSUInteger          rowIndex;
+
+    startTime = CFAbsoluteTimeGetCurrent();
+    for (screenIndex = 0; screenIndex < kScreenCount; screenIndex++) {
+        NSAutoreleasePool *     pool;
+
+        pool = [[NSAutoreleasePool alloc] init];
+        assert(pool != nil);
+        for (rowIndex = positions[screenIndex]; rowIndex < (positions[screenIndex] + kScreenRowCount); rowIndex++) {
+            [self performSelector:readRow withObject:rows withObject:[NSNumber numberWithUnsignedInteger:rowIndex]];
+        }
+        [pool drain];
+    }
+    return (CFAbsoluteTimeGetCurrent() - startTime) / kScreenCount;
+}
+
+// Reads a row the way PhotoCell does, from the sorted Core Data fetch results.
+- (void)readPhotos:(NSArray *)photos row:(NSNumber *)rowNumber
+{
+    NSManagedObject *   photo;
+
+    photo = [photos objectAtIndex:[rowNumber unsignedIntegerValue]];
+    (void) [photo valueForKey:@"displayName"];
+    (void) [photo valueForKey:@"date"];
+}
+
+// Reads a row the way PhotoCell does, from the metadata store.
+- (void)readStore:(PhotoMetadataStore *)store row:(NSNumber *)rowNumber
+{
+    PhotoMetadataRow *  row;
+
+    row = [store rowAtIndex:[rowNumber unsignedIntegerValue]];
+    (void) row.name;
+    (void) row.date;
+}
+
+- (void)main
+{
+    NSError *               error;
+    BOOL                    success;
+    NSManagedObjectModel *  model;
+    CFAbsoluteTime          startTime;
+    unsigned long long      residentBefore;
+    NSUInteger              positions[kScreenCount];
+    NSUInteger              screenIndex;
+    uint64_t                state;
+
+    error = nil;
+    (void) [[NSFileManager defaultManager] removeItemAtPath:self.directoryPath error:NULL];
+    success = [[NSFileManager defaultManager] createDirectoryAtPath:self.directoryPath withIntermediateDirectories:YES attributes:nil error:&error];
+
+    model = [self model];
+
+    // Build both.
+
+    if (success) {
+        startTime = CFAbsoluteTimeGetCurrent();
+        success = [self buildCoreDataWithModel:model error:&error];
+        self->_coreDataBuildTime = CFAbsoluteTimeGetCurrent() - startTime;
+    }
+    if (success && ! [self isCancelled]) {
+        startTime = CFAbsoluteTimeGetCurrent();
+        success = [self buildStore:&error];
+        self->_storeBuildTime = CFAbsoluteTimeGetCurrent() - startTime;
+    }
+
+    state = ~kSeed;
+    for (screenIndex = 0; screenIndex < kScreenCount; screenIndex++) {
+        positions[screenIndex] = (NSUInteger) (NextRandom(&state) % (self.rowCount - kScreenRowCount + 1));
+    }
+
+    // Core Data: the fetch that the fetched results controller does, which has to sort
+    // every row before it can return the first one.
+
+    if (success && ! [self isCancelled]) {
+        NSAutoreleasePool *         pool;
+        NSManagedObjectContext *    context;
+        NSFetchRequest *            fetchRequest;
+        NSArray *                   photos;
+
+        pool = [[NSAutoreleasePool alloc] init];
+        assert(pool != nil);
+
+        residentBefore = ResidentBytes();
+        startTime = CFAbsoluteTimeGetCurrent();
+
+        photos = nil;
+        context = [self contextForModel:model error:&error];
+        if (context != nil) {
+            fetchRequest = [[[NSFetchRequest alloc] init] autorelease];
+            assert(fetchRequest != nil);
+            [fetchRequest setEntity:[NSEntityDescription entityForName:@"Photo" inManagedObjectContext:context]];
+            [fetchRequest setFetchBatchSize:20];
+            [fetchRequest setSortDescriptors:[NSArray arrayWithObject:[[[NSSortDescriptor alloc] initWithKey:@"date" ascending:YES] autorelease]]];
+            photos = [context executeFetchRequest:fetchRequest error:&error];
+        }
+        success = (photos != nil) && ([photos count] == self.rowCount);
+        if (success) {
+            [self readPhotos:photos row:[NSNumber numberWithUnsignedInteger:0]];
+
+            self->_coreDataOpenTime  = CFAbsoluteTimeGetCurrent() - startTime;
+            self->_coreDataOpenBytes = Growth(residentBefore, ResidentBytes());
+
+            self->_coreDataScreenTime = [self scrollToPositions:positions readingRowsWith:@selector(readPhotos:row:) from:photos];
+        }
+
+        [error retain];
+        [pool drain];
+        [error autorelease];
+    }
+
+    // The store: just an open.
+
+    if (success && ! [self isCancelled]) {
+        NSAutoreleasePool *     pool;
+        PhotoMetadataStore *    store;
+
+        pool = [[NSAutoreleasePool alloc] init];
+        assert(pool != nil);
+
+        residentBefore = ResidentBytes();
+        startTime = CFAbsoluteTimeGetCurrent();
+
+        store = [[[PhotoMetadataStore alloc] initWithPath:[self.directoryPath stringByAppendingPathComponent:kStoreFileName]] autorelease];
+        assert(store != nil);
+        success = [store open:&error] && ! store.needsRebuild && (store.count == self.rowCount);
+        if (success) {
+            [self readStore:store row:[NSNumber numberWithUnsignedInteger:0]];
+
+            self->_storeOpenTime  = CFAbsoluteTimeGetCurrent() - startTime;
+            self->_storeOpenBytes = Growth(residentBefore, ResidentBytes());
+
+            self->_storeScreenTime = [self scrollToPositions:positions readingRowsWith:@selector(readStore:row:) from:store];
+            self->_storeResidentBytes = store.residentBytes;
+            self->_storeFileSize      = store.fileSize;
+        }
+        [store close];
+
+        [error retain];
+        [pool drain];
+        [error autorelease];
+    }
+
+    (void) [[NSFileManager defaultManager] removeItemAtPath:self.directoryPath error:NULL];
+
+    if (success && ! [self isCancelled]) {
+        [[QLog log] logWithFormat:@"%s %zu rows: Core Data built in %.1f s, opened in %.3f s (+%llu KB), %.3f ms per screen",
+            __PRETTY_FUNCTION__,
+            (size_t) self.rowCount,
+            self.coreDataBuildTime,
+            self.coreDataOpenTime,
+            self.coreDataOpenBytes / 1024,
+            self.coreDataScreenTime * 1000.0
+        ];
+        [[QLog log] logWithFormat:@"%s %zu rows: store built in %.1f s, opened in %.3f s (+%llu KB, %llu of %llu KB resident after scrolling), %.3f ms per screen",
+            __PRETTY_FUNCTION__,
+            (size_t) self.rowCount,
+            self.storeBuildTime,
+            self.storeOpenTime,
+            self.storeOpenBytes / 1024,
+            self.storeResidentBytes / 1024,
+            self.storeFileSize / 1024,
+            self.storeScreenTime * 1000.0
+        ];
+    } else if ( ! success ) {
+        if (error == nil) {
+            error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadCorruptFileError userInfo:nil];
+        }
+        self.error = error;
+    }
+}
+
+@end
@@ -0,0 +1,45 @@
+#import <Foundation/Foundation.h>
+
+@class PhotoMetadataStore;
+@class NSPersistentStoreCoordinator;
+
+// PhotoMetadataRebuildOperation refills a gallery's PhotoMetadataStore from its Core Data
+// database, so that opening a big gallery whose store is new, damaged or dirty doesn't
+// block the main thread for the seconds that a million rows take.  It reads the photos
+// through a managed object context of its own, on the gallery's persistent store
+// coordinator, so it sees the database as last saved.
+//
+// The operation owns the store while it runs; no one else may touch it until the
+// operation has finished.  PhotoGallery keeps its metadataStore property nil until then,
+// so the gallery list uses Core Data in the meantime.
+//
+// 在 CPU 队列上从数据库重建元数据存储, 不阻塞主线程.
+
+@interface PhotoMetadataRebuildOperation : NSOperation
+{
+    PhotoMetadataStore *            _store;
+    NSPersistentStoreCoordinator *  _persistentStoreCoordinator;
+    BOOL                            _succeeded;
+    NSUInteger                      _photoCount;
+    NSTimeInterval                  _elapsedTime;
+}
+
+// Configures the operation to refill store, which must be open, from the database
+// behind persistentStoreCoordinator.
+- (id)initWithStore:(PhotoMetadataStore *)store persistentStoreCoordinator:(NSPersistentStoreCoordinator *)persistentStoreCoordinator;
+
+// properties specified at init time
+
+@property (retain, readonly ) PhotoMetadataStore *              store;
+@property (retain, readonly ) NSPersistentStoreCoordinator *    persistentStoreCoordinator;
+
+// properties that are valid after the operation is finished
+
+// YES if the store now matches the database, in which case it's been marked clean.  If
+// the fetch failed, or the operation was cancelled, the store is left dirty, so that it's
+// rebuilt again next time it's opened.
+@property (assign, readonly ) BOOL                              succeeded;
+@property (assign, readonly ) NSUInteger                        photoCount;
+@property (assign, readonly ) NSTimeInterval                    elapsedTime;
+
+@end
@@ -0,0 +1,115 @@
+#import "PhotoMetadataRebuildOperation.h"
+#import "PhotoMetadataStore.h"
+#import "Photo.h"
+
+#import <CoreData/CoreData.h>
+
+/*
+    o 本类继承自 NSOperation,  通过重写 main 方法 来定义自己的 NSOperation.
+        在后台线程用自己的 NSManagedObjectContext 读取所有的 Photo, 重新填充元数据存储.
+ */
+
+// We fetch the photos kRebuildBatchSize at a time, and after each batch we drain the
+// autorelease pool, and turn the photos back into faults, so that a big gallery doesn't
+// end up in memory all at once.  That's also how often we check for cancellation.
+
+static const NSUInteger kRebuildBatchSize = 1000;
+
+@implementation PhotoMetadataRebuildOperation
+
+@synthesize store                      = _store;
+@synthesize persistentStoreCoordinator = _persistentStoreCoordinator;
+@synthesize succeeded                  = _succeeded;
+@synthesize photoCount                 = _photoCount;
+@synthesize elapsedTime                = _elapsedTime;
+
+- (id)initWithStore:(PhotoMetadataStore *)store persistentStoreCoordinator:(NSPersistentStoreCoordinator *)persistentStoreCoordinator
+{
+    assert(store != nil);
+    assert(store.isOpen);
+    assert(persistentStoreCoordinator != nil);
+
+    self = [super init];
+    if (self != nil) {
+        self->_store = [store retain];
+        self->_persistentStoreCoordinator = [persistentStoreCoordinator retain];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self->_store release];
+    [self->_persistentStoreCoordinator release];
+    [super dealloc];
+}
+
+#pragma mark - 入列后开始执行的函数
+- (void)main
+{
+    CFAbsoluteTime              startTime;
+    NSManagedObjectContext *    context;
+    NSFetchRequest *            fetchRequest;
+    NSArray *                   photos;
+    NSUInteger                  photoCount;
+    NSAutoreleasePool *         pool;
+    BOOL                        cancelled;
+
+    startTime = CFAbsoluteTimeGetCurrent();
+
+    // A managed object context can only be used by one thread, so we make our own, on
+    // the gallery's coordinator.  We never change anything, so it needs no undo manager.
+
+    context = [[[NSManagedObjectContext alloc] init] autorelease];
+    assert(context != nil);
+    [context setPersistentStoreCoordinator:self.persistentStoreCoordinator];
+    [context setUndoManager:nil];
+
+    fetchRequest = [[[NSFetchRequest alloc] init] autorelease];
+    assert(fetchRequest != nil);
+    [fetchRequest setEntity:[NSEntityDescription entityForName:@"Photo" inManagedObjectContext:context]];
+    [fetchRequest setFetchBatchSize:kRebuildBatchSize];
+
+    photos = [context executeFetchRequest:fetchRequest error:NULL];
+
+    [self.store beginUpdates];
+    [self.store removeAllRows];
+    photoCount = 0;
+    cancelled = NO;
+    pool = [[NSAutoreleasePool alloc] init];
+    assert(pool != nil);
+    for (Photo * photo in photos) {
+        [self.store setPhotoID:photo.photoID
+                          name:photo.displayName
+                          date:photo.date
+                     photoPath:photo.remotePhotoPath
+                 thumbnailPath:photo.remoteThumbnailPath
+                     objectURI:[[photo objectID] URIRepresentation]
+        ];
+        [context refreshObject:photo mergeChanges:NO];
+        photoCount += 1;
+        if ( (photoCount % kRebuildBatchSize) == 0 ) {
+            [pool drain];
+            pool = [[NSAutoreleasePool alloc] init];
+            assert(pool != nil);
+            if ([self isCancelled]) {
+                cancelled = YES;
+                break;
+            }
+        }
+    }
+    [pool drain];
+    [self.store endUpdates];
+
+    // If the fetch failed, or we gave up part way, leave the store dirty, so that it's
+    // rebuilt next time.
+
+    if ( (photos != nil) && ! cancelled ) {
+        [self.store markClean];
+        self->_succeeded = YES;
+    }
+    self->_photoCount  = photoCount;
+    self->_elapsedTime = CFAbsoluteTimeGetCurrent() - startTime;
+}
+
+@end
@@ -0,0 +1,144 @@
+#import <Foundation/Foundation.h>
+
+// PhotoMetadataStore keeps the metadata that the gallery list needs (photo ID, name, date,
+// photo and thumbnail paths, plus the Core Data object ID of the corresponding Photo) in a
+// single memory-mapped file, laid out by column rather than by row.  It's an optional
+// alternative to fetching Photo objects for very large galleries: opening the store is
+// just an mmap, the rows are kept in a date-sorted index so the list never has to sort,
+// and a row is only turned into Objective-C objects (PhotoMetadataRow) when someone
+// actually looks at it.
+//
+// The file looks like this:
+//
+// o a fixed size header (counts, capacities and a dirty flag)
+// o the date column, one double per row
+// o a flags byte per row
+// o for each string column, an (offset, length) pair per row, pointing into the heap
+// o the date index, one row number per live row, sorted by date
+// o a hash table from photo ID to row number, for updates
+// o the string heap, UTF-8, not nul terminated
+//
+// Updates are made in place, between -beginUpdates and -endUpdates.  Rows are never moved
+// during an update; a changed string is appended to the heap and a removed row is just
+// flagged, and -endUpdates merges the changed rows into the date index (rather than sorting
+// the whole thing).  When the file runs out of room it's copied into a bigger one, and when
+// enough of it is garbage, -endUpdates compacts it.
+//
+// The store is a cache of the Core Data database, not a replacement for it, so it doesn't
+// try to be crash proof on its own.  Instead, -beginUpdates sets the dirty flag on disk and
+// -markClean (called once the database has been saved) clears it.  If the store is opened
+// with the flag set, or the file is missing or damaged, needsRebuild is YES, and the owner
+// (PhotoGallery) refills it from the database.
+//
+// 列式存储, 内存映射的 photo 元数据: 按日期排好序的索引, 行对象按需创建, 同步时原地更新.
+//
+// The store isn't thread safe, but it isn't tied to a thread either; it can be used from
+// any one thread at a time.  PhotoGallery uses its store on the main thread, once 
+// PhotoMetadataRebuildOperation has finished refilling it (if need be) on the CPU queue, 
+// while PhotoMetadataBenchmarkOperation uses a scratch store on the CPU queue.
+
+extern NSString * kPhotoMetadataStoreDidChangeNotification;    // object is the store, posted by -endUpdates on the calling thread
+
+// The notification's userInfo says which rows moved, so that a table can update just those 
+// rows.  kPhotoMetadataStoreRemovedIndexesKey is an NSIndexSet of the positions, in the old 
+// date order, of the rows that were removed or whose date changed, and 
+// kPhotoMetadataStoreInsertedIndexesKey an NSIndexSet of the positions, in the new date 
+// order, of the rows that were added or whose date changed.  Every other row keeps its 
+// relative order, though its other columns may have changed.  If the update included 
+// -removeAllRows, or failed, there's no userInfo, and the reader should start afresh.
+
+extern NSString * kPhotoMetadataStoreRemovedIndexesKey;
+extern NSString * kPhotoMetadataStoreInsertedIndexesKey;
+
+@class PhotoMetadataRow;
+
+@interface PhotoMetadataStore : NSObject
+{
+    NSString *              _path;
+    int                     _fd;
+    void *                  _map;
+    size_t                  _mapSize;
+    double *                _dates;
+    uint8_t *               _rowFlags;
+    uint32_t *              _strings;
+    uint32_t *              _dateIndex;
+    uint32_t *              _hash;
+    char *                  _heap;
+    BOOL                    _needsRebuild;
+    BOOL                    _updating;
+    BOOL                    _failed;
+    BOOL                    _removedAllRows;
+    uint32_t *              _changedRows;
+    size_t                  _changedCount;
+    size_t                  _changedCapacity;
+}
+
+- (id)initWithPath:(NSString *)path;
+
+@property (nonatomic, copy,   readonly ) NSString *         path;
+
+// Opens the store, creating it if necessary.  Returns NO (and an NSPOSIXErrorDomain error)
+// if the file can't be created or mapped.
+- (BOOL)open:(NSError **)errorPtr;
+
+// Unmaps the file.  Any outstanding PhotoMetadataRow objects become invalid.
+- (void)close;
+
+@property (nonatomic, assign, readonly ) BOOL               isOpen;
+
+// YES if the store was empty, damaged or dirty when it was opened.  The owner should call
+// -removeAllRows and refill it.  Cleared by -markClean.
+@property (nonatomic, assign, readonly ) BOOL               needsRebuild;
+
+// the number of photos, that is, the number of rows in the date index
+@property (nonatomic, assign, readonly ) NSUInteger         count;
+
+// Returns a view of the row at the specified position in date order.  The view reads the
+// file each time you ask it for a property, and is only valid until the next -endUpdates,
+// which may renumber the rows (see kPhotoMetadataStoreDidChangeNotification).
+- (PhotoMetadataRow *)rowAtIndex:(NSUInteger)index;
+
+// updating
+
+- (void)beginUpdates;
+
+// Adds or updates the row for photoID.
+- (void)setPhotoID:(NSString *)photoID name:(NSString *)name date:(NSDate *)date photoPath:(NSString *)photoPath thumbnailPath:(NSString *)thumbnailPath objectURI:(NSURL *)objectURI;
+
+// Removes the row for photoID, if there is one.
+- (void)removePhotoID:(NSString *)photoID;
+
+// Empties the store, for a rebuild.
+- (void)removeAllRows;
+
+// Brings the date index up to date, compacts the file if it's worthwhile, and posts
+// kPhotoMetadataStoreDidChangeNotification.
+- (void)endUpdates;
+
+// The database that the store mirrors has been saved, so clear the dirty flag.
+- (void)markClean;
+
+// statistics, for the benchmark
+
+@property (nonatomic, assign, readonly ) unsigned long long fileSize;
+@property (nonatomic, assign, readonly ) unsigned long long residentBytes;      // of the mapping, according to mincore
+
+@end
+
+// A view of one row of a PhotoMetadataStore.  All of the properties are decoded from the
+// file on demand.
+
+@interface PhotoMetadataRow : NSObject
+{
+    PhotoMetadataStore *    _store;
+    uint32_t                _row;
+}
+
+@property (nonatomic, copy,   readonly ) NSString *         photoID;
+@property (nonatomic, copy,   readonly ) NSString *         name;
+@property (nonatomic, copy,   readonly ) NSDate *           date;
+@property (nonatomic, copy,   readonly ) NSString *         photoPath;
+@property (nonatomic, copy,   readonly ) NSString *         thumbnailPath;
+@property (nonatomic, copy,   readonly ) NSURL *            objectURI;          // of the Photo in the Core Data database
+
+@end
@@ -0,0 +1,1036 @@
+#import "PhotoMetadataStore.h"
+#import "Logging.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+NSString * kPhotoMetadataStoreDidChangeNotification = @"PhotoMetadataStoreDidChange";
+NSString * kPhotoMetadataStoreRemovedIndexesKey     = @"removedIndexes";
+NSString * kPhotoMetadataStoreInsertedIndexesKey    = @"insertedIndexes";
+
+// the string columns
+
+enum {
+    kColumnPhotoID = 0,
+    kColumnName,
+    kColumnPhotoPath,
+    kColumnThumbnailPath,
+    kColumnObjectURI,
+    kColumnCount
+};
+
+// per-row flags
+
+enum {
+    kRowFlagRemoved = 0x01,     // the photo was removed; the row stays (so it can be revived) until the next compaction
+    kRowFlagChanged = 0x02      // the row is in _changedRows, waiting for -endUpdates to put it in the right place in the date index
+};
+
+// header flags
+
+enum {
+    kStoreFlagDirty = 0x01      // set by -beginUpdates, cleared by -markClean
+};
+
+static const uint32_t kStoreMagic           = 0x31444d50;       // "PMD1"
+static const uint32_t kStoreVersion         = 1;
+static const uint32_t kNoRow                = UINT32_MAX;
+
+// The store starts small, and doubles the row or heap capacity as needed.  -endUpdates
+// compacts the file once a quarter of its rows have been removed, or half of its heap
+// is garbage, but not for small numbers, where it's not worth the copy.
+
+static const uint32_t kInitialRowCapacity   = 1024;
+static const uint64_t kInitialHeapCapacity  = 64 * 1024;
+static const uint32_t kCompactMinimumRows   = 1024;
+static const uint64_t kCompactMinimumBytes  = 256 * 1024;
+
+typedef struct {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    flags;
+    uint32_t    rowCount;           // rows in use, including removed ones
+    uint32_t    rowCapacity;
+    uint32_t    liveCount;          // rows in the date index
+    uint32_t    hashCapacity;       // power of two, at least twice rowCapacity
+    uint32_t    reserved;
+    uint64_t    heapUsed;
+    uint64_t    heapCapacity;
+    uint64_t    heapGarbage;        // bytes of heap no longer referenced by any row
+} StoreHeader;
+
+// The offsets of each section of the file, which follow from the capacities.
+
+typedef struct {
+    size_t      dates;
+    size_t      rowFlags;
+    size_t      strings;
+    size_t      dateIndex;
+    size_t      hash;
+    size_t      heap;
+    size_t      size;
+} StoreLayout;
+
+static size_t RoundUp(size_t value, size_t alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static StoreLayout StoreLayoutMake(uint32_t rowCapacity, uint32_t hashCapacity, uint64_t heapCapacity)
+{
+    StoreLayout     layout;
+    size_t          offset;
+
+    offset = RoundUp(sizeof(StoreHeader), 64);
+    layout.dates     = offset;
+    offset += (size_t) rowCapacity * sizeof(double);
+    layout.rowFlags  = offset;
+    offset = RoundUp(offset + rowCapacity, 8);
+    layout.strings   = offset;
+    offset += (size_t) kColumnCount * rowCapacity * 2 * sizeof(uint32_t);
+    layout.dateIndex = offset;
+    offset += (size_t) rowCapacity * sizeof(uint32_t);
+    layout.hash      = offset;
+    offset += (size_t) hashCapacity * sizeof(uint32_t);
+    layout.heap      = offset;
+    offset += (size_t) heapCapacity;
+    layout.size      = offset;
+    return layout;
+}
+
+static uint32_t HashCapacityForRowCapacity(uint32_t rowCapacity)
+{
+    uint32_t    result;
+
+    result = 1;
+    while (result < (rowCapacity * 2)) {
+        result *= 2;
+    }
+    return result;
+}
+
+static uint32_t HashBytes(const char * bytes, size_t length)
+    // FNV-1a
+{
+    uint32_t    result;
+    size_t      i;
+
+    result = 2166136261U;
+    for (i = 0; i < length; i++) {
+        result = (result ^ (uint8_t) bytes[i]) * 16777619U;
+    }
+    return result;
+}
+
+// An entry in the date index, as used by -mergeChangedRowsRemovedIndexes:insertedIndexes:.  
+// Rows with the same date are ordered by row number, so that the order is stable.
+
+typedef struct {
+    double      date;
+    uint32_t    row;
+} DateRow;
+
+static int CompareDateRows(const void * left, const void * right)
+{
+    const DateRow *     l;
+    const DateRow *     r;
+
+    l = (const DateRow *) left;
+    r = (const DateRow *) right;
+    if (l->date < r->date) {
+        return -1;
+    } else if (l->date > r->date) {
+        return 1;
+    } else if (l->row < r->row) {
+        return -1;
+    } else if (l->row > r->row) {
+        return 1;
+    }
+    return 0;
+}
+
+@interface PhotoMetadataRow ()
+
+- (id)initWithStore:(PhotoMetadataStore *)store row:(uint32_t)row;
+
+@end
+
+@interface PhotoMetadataStore ()
+
+// private properties
+
+@property (nonatomic, assign, readonly ) StoreHeader *      header;
+
+// forward declarations
+
+- (NSString *)stringForColumn:(NSUInteger)column row:(uint32_t)row;
+- (double)dateForRow:(uint32_t)row;
+
+@end
+
+@implementation PhotoMetadataStore
+
+- (id)initWithPath:(NSString *)path
+{
+    assert(path != nil);
+    self = [super init];
+    if (self != nil) {
+        self->_path = [path copy];
+        self->_fd = -1;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    if (self.isOpen) {
+        [self close];
+    }
+    [self->_path release];
+    [super dealloc];
+}
+
+@synthesize path         = _path;
+@synthesize needsRebuild = _needsRebuild;
+
+- (BOOL)isOpen
+{
+    return (self->_map != NULL);
+}
+
+- (StoreHeader *)header
+{
+    assert(self->_map != NULL);
+    return (StoreHeader *) self->_map;
+}
+
+- (unsigned long long)fileSize
+{
+    return self->_mapSize;
+}
+
+#pragma mark * Mapping
+
+// Points the column ivars into the mapping, based on the capacities in its header.
+- (void)setupPointers
+{
+    StoreHeader *   header;
+    StoreLayout     layout;
+    char *          base;
+
+    header = self.header;
+    layout = StoreLayoutMake(header->rowCapacity, header->hashCapacity, header->heapCapacity);
+    assert(layout.size == self->_mapSize);
+
+    base = (char *) self->_map;
+    self->_dates     = (double *)   (base + layout.dates);
+    self->_rowFlags  = (uint8_t *)  (base + layout.rowFlags);
+    self->_strings   = (uint32_t *) (base + layout.strings);
+    self->_dateIndex = (uint32_t *) (base + layout.dateIndex);
+    self->_hash      = (uint32_t *) (base + layout.hash);
+    self->_heap      = base + layout.heap;
+}
+
+- (int)mapFileOfSize:(size_t)size
+{
+    void *      map;
+
+    assert(self->_fd >= 0);
+    assert(self->_map == NULL);
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, self->_fd, 0);
+    if (map == MAP_FAILED) {
+        return errno;
+    }
+    self->_map = map;
+    self->_mapSize = size;
+    return 0;
+}
+
+- (void)unmap
+{
+    if (self->_map != NULL) {
+        (void) munmap(self->_map, self->_mapSize);
+        self->_map = NULL;
+        self->_mapSize = 0;
+        self->_dates     = NULL;
+        self->_rowFlags  = NULL;
+        self->_strings   = NULL;
+        self->_dateIndex = NULL;
+        self->_hash      = NULL;
+        self->_heap      = NULL;
+    }
+}
+
+// Returns YES if the mapped file looks like one of ours.
+- (BOOL)isValid
+{
+    const StoreHeader * header;
+
+    if (self->_mapSize < sizeof(StoreHeader)) {
+        return NO;
+    }
+    header = self.header;
+    if ( (header->magic != kStoreMagic) || (header->version != kStoreVersion) ) {
+        return NO;
+    }
+    if ( (header->rowCount > header->rowCapacity) || (header->liveCount > header->rowCount) ) {
+        return NO;
+    }
+    if ( (header->hashCapacity != HashCapacityForRowCapacity(header->rowCapacity)) ) {
+        return NO;
+    }
+    if ( (header->heapUsed > header->heapCapacity) || (header->heapCapacity > UINT32_MAX) || (header->heapGarbage > header->heapUsed) ) {
+        return NO;
+    }
+    return StoreLayoutMake(header->rowCapacity, header->hashCapacity, header->heapCapacity).size == self->_mapSize;
+}
+
+// Throws away whatever's in the file and replaces it with an empty store.
+- (int)initializeFile
+{
+    int             err;
+    StoreLayout     layout;
+    uint32_t        hashCapacity;
+    StoreHeader *   header;
+
+    assert(self->_fd >= 0);
+    assert(self->_map == NULL);
+
+    hashCapacity = HashCapacityForRowCapacity(kInitialRowCapacity);
+    layout = StoreLayoutMake(kInitialRowCapacity, hashCapacity, kInitialHeapCapacity);
+
+    err = 0;
+    if ( (ftruncate(self->_fd, 0) < 0) || (ftruncate(self->_fd, (off_t) layout.size) < 0) ) {
+        err = errno;
+    }
+    if (err == 0) {
+        err = [self mapFileOfSize:layout.size];
+    }
+    if (err == 0) {
+        header = self.header;
+        header->magic        = kStoreMagic;
+        header->version      = kStoreVersion;
+        header->flags        = kStoreFlagDirty;
+        header->rowCapacity  = kInitialRowCapacity;
+        header->hashCapacity = hashCapacity;
+        header->heapCapacity = kInitialHeapCapacity;
+        [self setupPointers];
+    }
+    return err;
+}
+
+- (BOOL)open:(NSError **)errorPtr
+{
+    int             err;
+    struct stat     sb;
+    BOOL            valid;
+    CFAbsoluteTime  startTime;
+
+    assert( ! self.isOpen );
+
+    startTime = CFAbsoluteTimeGetCurrent();
+
+    err = 0;
+    self->_fd = open([self.path fileSystemRepresentation], O_RDWR | O_CREAT, 0644);
+    if (self->_fd < 0) {
+        err = errno;
+    }
+    if ( (err == 0) && (fstat(self->_fd, &sb) < 0) ) {
+        err = errno;
+    }
+
+    // A file that we can't map, or that doesn't look right, is replaced with an empty
+    // store, which the owner then refills.
+
+    valid = NO;
+    if ( (err == 0) && (sb.st_size >= (off_t) sizeof(StoreHeader)) ) {
+        if ( [self mapFileOfSize:(size_t) sb.st_size] == 0 ) {
+            valid = [self isValid];
+            if ( ! valid ) {
+                [self unmap];
+            }
+        }
+    }
+    if (err == 0) {
+        if (valid) {
+            [self setupPointers];
+            self->_needsRebuild = (self.header->flags & kStoreFlagDirty) != 0;
+        } else {
+            err = [self initializeFile];
+            self->_needsRebuild = YES;
+        }
+    }
+
+    if (err == 0) {
+        [[QLog log] logWithFormat:@"%s metadata store '%@' opened in %.3f ms, %zu photos, %llu bytes%s",
+            __PRETTY_FUNCTION__,
+            [[self.path stringByDeletingLastPathComponent] lastPathComponent],
+            (CFAbsoluteTimeGetCurrent() - startTime) * 1000.0,
+            (size_t) self.count,
+            self.fileSize,
+            self.needsRebuild ? ", needs rebuild" : ""
+        ];
+    } else {
+        [self unmap];
+        if (self->_fd >= 0) {
+            (void) close(self->_fd);
+            self->_fd = -1;
+        }
+        [[QLog log] logWithFormat:@"%s metadata store open error %d", __PRETTY_FUNCTION__, err];
+        if (errorPtr != NULL) {
+            *errorPtr = [NSError errorWithDomain:NSPOSIXErrorDomain code:err userInfo:[NSDictionary dictionaryWithObject:self.path forKey:NSFilePathErrorKey]];
+        }
+    }
+    return (err == 0);
+}
+
+- (void)close
+{
+    assert( ! self->_updating );
+
+    [self unmap];
+    if (self->_fd >= 0) {
+        (void) close(self->_fd);
+        self->_fd = -1;
+    }
+    free(self->_changedRows);
+    self->_changedRows = NULL;
+    self->_changedCount = 0;
+    self->_changedCapacity = 0;
+}
+
+// Copies the store into a new file with the specified capacities, and then swaps the new
+// file for the old one.  If compact is NO, the rows keep their numbers, so this is safe
+// in the middle of an update.  If compact is YES, only the live rows are copied, in date
+// order, along with just the strings that they use; this renumbers the rows, so it can
+// only be done once the date index is up to date.
+- (int)rewriteWithRowCapacity:(uint32_t)rowCapacity heapCapacity:(uint64_t)heapCapacity compact:(BOOL)compact
+{
+    int             err;
+    NSString *      newPath;
+    int             newFD;
+    void *          newMap;
+    StoreLayout     layout;
+    StoreHeader *   oldHeader;
+    StoreHeader *   newHeader;
+    uint32_t        hashCapacity;
+    char *          base;
+    double *        newDates;
+    uint8_t *       newRowFlags;
+    uint32_t *      newStrings;
+    uint32_t *      newDateIndex;
+    uint32_t *      newHash;
+    char *          newHeap;
+    uint32_t        row;
+    NSUInteger      column;
+
+    oldHeader = self.header;
+    assert(rowCapacity >= (compact ? oldHeader->liveCount : oldHeader->rowCount));
+    assert( ! compact || (self->_changedCount == 0) );
+
+    hashCapacity = HashCapacityForRowCapacity(rowCapacity);
+    layout = StoreLayoutMake(rowCapacity, hashCapacity, heapCapacity);
+    newPath = [self.path stringByAppendingPathExtension:@"new"];
+    assert(newPath != nil);
+
+    err = 0;
+    newMap = MAP_FAILED;
+    newFD = open([newPath fileSystemRepresentation], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (newFD < 0) {
+        err = errno;
+    }
+    if ( (err == 0) && (ftruncate(newFD, (off_t) layout.size) < 0) ) {
+        err = errno;
+    }
+    if (err == 0) {
+        newMap = mmap(NULL, layout.size, PROT_READ | PROT_WRITE, MAP_SHARED, newFD, 0);
+        if (newMap == MAP_FAILED) {
+            err = errno;
+        }
+    }
+    if (err == 0) {
+        base = (char *) newMap;
+        newHeader    = (StoreHeader *) base;
+        newDates     = (double *)   (base + layout.dates);
+        newRowFlags  = (uint8_t *)  (base + layout.rowFlags);
+        newStrings   = (uint32_t *) (base + layout.strings);
+        newDateIndex = (uint32_t *) (base + layout.dateIndex);
+        newHash      = (uint32_t *) (base + layout.hash);
+        newHeap      = base + layout.heap;
+
+        *newHeader = *oldHeader;
+        newHeader->rowCapacity  = rowCapacity;
+        newHeader->hashCapacity = hashCapacity;
+        newHeader->heapCapacity = heapCapacity;
+
+        if ( ! compact ) {
+            memcpy(newDates,    self->_dates,    oldHeader->rowCount * sizeof(double));
+            memcpy(newRowFlags, self->_rowFlags, oldHeader->rowCount);
+            for (column = 0; column < kColumnCount; column++) {
+                memcpy(&newStrings[column * rowCapacity * 2], &self->_strings[column * oldHeader->rowCapacity * 2], oldHeader->rowCount * 2 * sizeof(uint32_t));
+            }
+            memcpy(newDateIndex, self->_dateIndex, oldHeader->liveCount * sizeof(uint32_t));
+            memcpy(newHeap, self->_heap, (size_t) oldHeader->heapUsed);
+        } else {
+            uint64_t    heapUsed;
+
+            heapUsed = 0;
+            for (row = 0; row < oldHeader->liveCount; row++) {
+                uint32_t    oldRow;
+
+                oldRow = self->_dateIndex[row];
+                newDates[row]     = self->_dates[oldRow];
+                newRowFlags[row]  = 0;
+                newDateIndex[row] = row;
+                for (column = 0; column < kColumnCount; column++) {
+                    const uint32_t *    oldString;
+                    uint32_t *          newString;
+
+                    oldString = &self->_strings[(column * oldHeader->rowCapacity + oldRow) * 2];
+                    newString = &newStrings[(column * rowCapacity + row) * 2];
+                    assert( (heapUsed + oldString[1]) <= heapCapacity );
+                    memcpy(newHeap + heapUsed, self->_heap + oldString[0], oldString[1]);
+                    newString[0] = (uint32_t) heapUsed;
+                    newString[1] = oldString[1];
+                    heapUsed += oldString[1];
+                }
+            }
+            newHeader->rowCount    = oldHeader->liveCount;
+            newHeader->heapUsed    = heapUsed;
+            newHeader->heapGarbage = 0;
+        }
+
+        // Rehash every row, removed ones included, so that they can still be revived.
+
+        for (row = 0; row < newHeader->rowCount; row++) {
+            const uint32_t *    photoID;
+            uint32_t            slot;
+
+            photoID = &newStrings[(kColumnPhotoID * rowCapacity + row) * 2];
+            slot = HashBytes(newHeap + photoID[0], photoID[1]) & (hashCapacity - 1);
+            while (newHash[slot] != 0) {
+                slot = (slot + 1) & (hashCapacity - 1);
+            }
+            newHash[slot] = row + 1;
+        }
+    }
+    if ( (err == 0) && (rename([newPath fileSystemRepresentation], [self.path fileSystemRepresentation]) < 0) ) {
+        err = errno;
+    }
+
+    if (err == 0) {
+        [self unmap];
+        (void) close(self->_fd);
+        self->_fd = newFD;
+        self->_map = newMap;
+        self->_mapSize = layout.size;
+        [self setupPointers];
+    } else {
+        if (newMap != MAP_FAILED) {
+            (void) munmap(newMap, layout.size);
+        }
+        if (newFD >= 0) {
+            (void) close(newFD);
+            (void) unlink([newPath fileSystemRepresentation]);
+        }
+    }
+    return err;
+}
+
+// Called when something goes wrong mid-update.  The store stops taking updates, and
+// because it stays dirty, it's rebuilt the next time it's opened.
+- (void)failWithError:(int)err
+{
+    [[QLog log] logWithFormat:@"%s metadata store error %d", __PRETTY_FUNCTION__, err];
+    self->_failed = YES;
+}
+
+#pragma mark * Rows
+
+- (NSUInteger)count
+{
+    return self.isOpen ? self.header->liveCount : 0;
+}
+
+- (PhotoMetadataRow *)rowAtIndex:(NSUInteger)index
+{
+    assert(index < self.count);
+    return [[[PhotoMetadataRow alloc] initWithStore:self row:self->_dateIndex[index]] autorelease];
+}
+
+- (NSString *)stringForColumn:(NSUInteger)column row:(uint32_t)row
+{
+    const uint32_t *    string;
+
+    assert(column < kColumnCount);
+    assert(row < self.header->rowCount);
+    string = &self->_strings[(column * self.header->rowCapacity + row) * 2];
+    return [[[NSString alloc] initWithBytes:self->_heap + string[0] length:string[1] encoding:NSUTF8StringEncoding] autorelease];
+}
+
+- (double)dateForRow:(uint32_t)row
+{
+    assert(row < self.header->rowCount);
+    return self->_dates[row];
+}
+
+// Returns the row for the specified photo ID, or kNoRow if there isn't one, in which
+// case *slotPtr is the empty hash slot where it would go.
+- (uint32_t)rowForPhotoIDBytes:(const char *)bytes length:(size_t)length slot:(uint32_t *)slotPtr
+{
+    StoreHeader *   header;
+    uint32_t        mask;
+    uint32_t        slot;
+    uint32_t        entry;
+
+    header = self.header;
+    mask = header->hashCapacity - 1;
+    slot = HashBytes(bytes, length) & mask;
+    while ( (entry = self->_hash[slot]) != 0 ) {
+        const uint32_t *    photoID;
+
+        photoID = &self->_strings[(kColumnPhotoID * header->rowCapacity + (entry - 1)) * 2];
+        if ( (photoID[1] == length) && (memcmp(self->_heap + photoID[0], bytes, length) == 0) ) {
+            return entry - 1;
+        }
+        slot = (slot + 1) & mask;
+    }
+    if (slotPtr != NULL) {
+        *slotPtr = slot;
+    }
+    return kNoRow;
+}
+
+// Makes sure there's room for the specified number of new rows and heap bytes, growing
+// the file if necessary.
+- (int)ensureRoomForRows:(uint32_t)rows heapBytes:(uint64_t)heapBytes
+{
+    StoreHeader *   header;
+    uint64_t        rowCapacity;
+    uint64_t        heapCapacity;
+
+    header = self.header;
+    rowCapacity  = header->rowCapacity;
+    heapCapacity = header->heapCapacity;
+    while ( (header->rowCount + rows) > rowCapacity ) {
+        rowCapacity *= 2;
+    }
+    while ( (header->heapUsed + heapBytes) > heapCapacity ) {
+        heapCapacity *= 2;
+    }
+    if ( (rowCapacity == header->rowCapacity) && (heapCapacity == header->heapCapacity) ) {
+        return 0;
+    }
+    if ( (rowCapacity > (UINT32_MAX / 4)) || (heapCapacity > UINT32_MAX) ) {
+        return EFBIG;
+    }
+    return [self rewriteWithRowCapacity:(uint32_t) rowCapacity heapCapacity:heapCapacity compact:NO];
+}
+
+// Sets one string of a row, appending it to the heap if it's different.  The caller must
+// have made room.
+- (void)setString:(const char *)bytes length:(size_t)length column:(NSUInteger)column row:(uint32_t)row
+{
+    StoreHeader *   header;
+    uint32_t *      string;
+
+    header = self.header;
+    string = &self->_strings[(column * header->rowCapacity + row) * 2];
+    if ( (string[1] != length) || (memcmp(self->_heap + string[0], bytes, length) != 0) ) {
+        assert( (header->heapUsed + length) <= header->heapCapacity );
+        memcpy(self->_heap + header->heapUsed, bytes, length);
+        header->heapGarbage += string[1];
+        string[0] = (uint32_t) header->heapUsed;
+        string[1] = (uint32_t) length;
+        header->heapUsed += length;
+    }
+}
+
+- (void)noteChangedRow:(uint32_t)row
+{
+    if ( (self->_rowFlags[row] & kRowFlagChanged) == 0 ) {
+        if (self->_changedCount == self->_changedCapacity) {
+            self->_changedCapacity = (self->_changedCapacity == 0) ? 1024 : (self->_changedCapacity * 2);
+            self->_changedRows = reallocf(self->_changedRows, self->_changedCapacity * sizeof(uint32_t));
+            assert(self->_changedRows != NULL);
+        }
+        self->_changedRows[self->_changedCount] = row;
+        self->_changedCount += 1;
+        self->_rowFlags[row] |= kRowFlagChanged;
+    }
+}
+
+#pragma mark * Updates
+
+- (void)beginUpdates
+{
+    StoreHeader *   header;
+
+    assert(self.isOpen);
+    assert( ! self->_updating );
+
+    self->_updating = YES;
+    header = self.header;
+    if ( ! self->_failed && ((header->flags & kStoreFlagDirty) == 0) ) {
+        header->flags |= kStoreFlagDirty;
+        (void) msync(self->_map, sizeof(StoreHeader), MS_SYNC);
+    }
+}
+
+- (void)setPhotoID:(NSString *)photoID name:(NSString *)name date:(NSDate *)date photoPath:(NSString *)photoPath thumbnailPath:(NSString *)thumbnailPath objectURI:(NSURL *)objectURI
+{
+    int             err;
+    const char *    strings[kColumnCount];
+    size_t          lengths[kColumnCount];
+    uint64_t        bytesNeeded;
+    NSUInteger      column;
+    uint32_t        row;
+    uint32_t        slot;
+    double          dateValue;
+    BOOL            changed;
+
+    assert(self->_updating);
+    assert(photoID != nil);
+    assert(date != nil);
+
+    if (self->_failed) {
+        return;
+    }
+
+    strings[kColumnPhotoID]       = [photoID UTF8String];
+    strings[kColumnName]          = (name          != nil) ? [name UTF8String]                    : "";
+    strings[kColumnPhotoPath]     = (photoPath     != nil) ? [photoPath UTF8String]               : "";
+    strings[kColumnThumbnailPath] = (thumbnailPath != nil) ? [thumbnailPath UTF8String]           : "";
+    strings[kColumnObjectURI]     = (objectURI     != nil) ? [[objectURI absoluteString] UTF8String] : "";
+    bytesNeeded = 0;
+    for (column = 0; column < kColumnCount; column++) {
+        assert(strings[column] != NULL);
+        lengths[column] = strlen(strings[column]);
+        bytesNeeded += lengths[column];
+    }
+    dateValue = [date timeIntervalSinceReferenceDate];
+
+    // Make room first, because growing the file changes all of our pointers (though
+    // not the row numbers).
+
+    row = [self rowForPhotoIDBytes:strings[kColumnPhotoID] length:lengths[kColumnPhotoID] slot:NULL];
+    err = [self ensureRoomForRows:(row == kNoRow) ? 1 : 0 heapBytes:bytesNeeded];
+    if (err != 0) {
+        [self failWithError:err];
+        return;
+    }
+
+    if (row == kNoRow) {
+        StoreHeader *   header;
+
+        header = self.header;
+        row = [self rowForPhotoIDBytes:strings[kColumnPhotoID] length:lengths[kColumnPhotoID] slot:&slot];
+        assert(row == kNoRow);
+        row = header->rowCount;
+        header->rowCount += 1;
+        self->_hash[slot] = row + 1;
+        self->_rowFlags[row] = 0;
+        for (column = 0; column < kColumnCount; column++) {
+            self->_strings[(column * header->rowCapacity + row) * 2]     = 0;
+            self->_strings[(column * header->rowCapacity + row) * 2 + 1] = 0;
+        }
+        changed = YES;
+    } else {
+        changed = ((self->_rowFlags[row] & kRowFlagRemoved) != 0) || (self->_dates[row] != dateValue);
+        self->_rowFlags[row] &= (uint8_t) ~kRowFlagRemoved;
+    }
+
+    self->_dates[row] = dateValue;
+    for (column = 0; column < kColumnCount; column++) {
+        [self setString:strings[column] length:lengths[column] column:column row:row];
+    }
+
+    // Only a change of date (or a new or revived row) moves the row in the date index.
+
+    if (changed) {
+        [self noteChangedRow:row];
+    }
+}
+
+- (void)removePhotoID:(NSString *)photoID
+{
+    const char *    bytes;
+    uint32_t        row;
+
+    assert(self->_updating);
+    assert(photoID != nil);
+
+    if (self->_failed) {
+        return;
+    }
+
+    bytes = [photoID UTF8String];
+    row = [self rowForPhotoIDBytes:bytes length:strlen(bytes) slot:NULL];
+    if ( (row != kNoRow) && ((self->_rowFlags[row] & kRowFlagRemoved) == 0) ) {
+        self->_rowFlags[row] |= kRowFlagRemoved;
+        [self noteChangedRow:row];
+    }
+}
+
+- (void)removeAllRows
+{
+    StoreHeader *   header;
+
+    assert(self->_updating);
+
+    header = self.header;
+    header->rowCount    = 0;
+    header->liveCount   = 0;
+    header->heapUsed    = 0;
+    header->heapGarbage = 0;
+    memset(self->_hash, 0, header->hashCapacity * sizeof(uint32_t));
+    self->_changedCount = 0;
+    self->_removedAllRows = YES;
+}
+
+// Brings the date index up to date.  Rather than sort every row, we sort just the rows
+// that changed, and merge them with the rest of the old index.  Along the way we note 
+// the old positions of the changed rows, and their new ones, in removedIndexes and 
+// insertedIndexes, if they're not nil.
+- (void)mergeChangedRowsRemovedIndexes:(NSMutableIndexSet *)removedIndexes insertedIndexes:(NSMutableIndexSet *)insertedIndexes
+{
+    StoreHeader *   header;
+    DateRow *       changed;
+    size_t          changedLive;
+    uint32_t *      newIndex;
+    size_t          changedIndex;
+    size_t          oldIndex;
+    size_t          newCount;
+    size_t          i;
+
+    header = self.header;
+
+    changed = malloc(self->_changedCount * sizeof(DateRow));
+    newIndex = malloc(header->rowCount * sizeof(uint32_t));
+    assert( (changed != NULL) && (newIndex != NULL) );
+
+    changedLive = 0;
+    for (i = 0; i < self->_changedCount; i++) {
+        uint32_t    row;
+
+        row = self->_changedRows[i];
+        if ( (self->_rowFlags[row] & kRowFlagRemoved) == 0 ) {
+            changed[changedLive].date = self->_dates[row];
+            changed[changedLive].row  = row;
+            changedLive += 1;
+        }
+    }
+    qsort(changed, changedLive, sizeof(DateRow), CompareDateRows);
+
+    changedIndex = 0;
+    newCount = 0;
+    for (oldIndex = 0; oldIndex < header->liveCount; oldIndex++) {
+        DateRow     old;
+
+        old.row = self->_dateIndex[oldIndex];
+        if ( (self->_rowFlags[old.row] & kRowFlagChanged) == 0 ) {
+            old.date = self->_dates[old.row];
+            while ( (changedIndex < changedLive) && (CompareDateRows(&changed[changedIndex], &old) < 0) ) {
+                [insertedIndexes addIndex:newCount];
+                newIndex[newCount++] = changed[changedIndex++].row;
+            }
+            newIndex[newCount++] = old.row;
+        } else {
+            [removedIndexes addIndex:oldIndex];
+        }
+    }
+    while (changedIndex < changedLive) {
+        [insertedIndexes addIndex:newCount];
+        newIndex[newCount++] = changed[changedIndex++].row;
+    }
+    assert(newCount <= header->rowCount);
+
+    memcpy(self->_dateIndex, newIndex, newCount * sizeof(uint32_t));
+    header->liveCount = (uint32_t) newCount;
+    for (i = 0; i < self->_changedCount; i++) {
+        self->_rowFlags[self->_changedRows[i]] &= (uint8_t) ~kRowFlagChanged;
+    }
+    self->_changedCount = 0;
+
+    free(newIndex);
+    free(changed);
+}
+
+// Compacts the file if enough of it is taken up by removed rows or unused strings.
+- (void)compactIfNeeded
+{
+    int             err;
+    StoreHeader *   header;
+    uint32_t        removedRows;
+    uint64_t        liveBytes;
+    uint32_t        rowCapacity;
+    uint64_t        heapCapacity;
+    uint32_t        i;
+    NSUInteger      column;
+
+    header = self.header;
+    removedRows = header->rowCount - header->liveCount;
+    if ( ! ( ((removedRows >= kCompactMinimumRows)          && (removedRows > (header->rowCount / 4)))
+          || ((header->heapGarbage >= kCompactMinimumBytes) && (header->heapGarbage > (header->heapUsed / 2))) ) ) {
+        return;
+    }
+
+    liveBytes = 0;
+    for (i = 0; i < header->liveCount; i++) {
+        for (column = 0; column < kColumnCount; column++) {
+            liveBytes += self->_strings[(column * header->rowCapacity + self->_dateIndex[i]) * 2 + 1];
+        }
+    }
+    rowCapacity = kInitialRowCapacity;
+    while ( rowCapacity < (header->liveCount + header->liveCount / 4) ) {
+        rowCapacity *= 2;
+    }
+    heapCapacity = kInitialHeapCapacity;
+    while ( heapCapacity < (liveBytes + liveBytes / 4) ) {
+        heapCapacity *= 2;
+    }
+
+    [[QLog log] logWithFormat:@"%s metadata store compact, %zu removed rows, %llu garbage bytes", __PRETTY_FUNCTION__, (size_t) removedRows, header->heapGarbage];
+    err = [self rewriteWithRowCapacity:rowCapacity heapCapacity:heapCapacity compact:YES];
+    if (err != 0) {
+        [self failWithError:err];
+    }
+}
+
+- (void)endUpdates
+{
+    NSMutableIndexSet * removedIndexes;
+    NSMutableIndexSet * insertedIndexes;
+    NSDictionary *      userInfo;
+
+    assert(self->_updating);
+
+    // After -removeAllRows every row is new, so there's no point tracking positions.
+
+    removedIndexes  = nil;
+    insertedIndexes = nil;
+    if ( ! self->_removedAllRows ) {
+        removedIndexes  = [NSMutableIndexSet indexSet];
+        insertedIndexes = [NSMutableIndexSet indexSet];
+        assert( (removedIndexes != nil) && (insertedIndexes != nil) );
+    }
+    if ( ! self->_failed ) {
+        if (self->_changedCount != 0) {
+            [self mergeChangedRowsRemovedIndexes:removedIndexes insertedIndexes:insertedIndexes];
+        }
+        [self compactIfNeeded];
+    }
+    userInfo = nil;
+    if ( ! self->_failed && ! self->_removedAllRows ) {
+        userInfo = [NSDictionary dictionaryWithObjectsAndKeys:
+            removedIndexes,  kPhotoMetadataStoreRemovedIndexesKey, 
+            insertedIndexes, kPhotoMetadataStoreInsertedIndexesKey, 
+            nil
+        ];
+    }
+    self->_removedAllRows = NO;
+    self->_updating = NO;
+
+    [[NSNotificationCenter defaultCenter] postNotificationName:kPhotoMetadataStoreDidChangeNotification object:self userInfo:userInfo];
+}
+
+- (void)markClean
+{
+    StoreHeader *   header;
+
+    assert( ! self->_updating );
+
+    if ( self.isOpen && ! self->_failed ) {
+        header = self.header;
+        if ( (header->flags & kStoreFlagDirty) != 0 ) {
+            (void) msync(self->_map, self->_mapSize, MS_SYNC);
+            header->flags &= ~kStoreFlagDirty;
+            (void) msync(self->_map, sizeof(StoreHeader), MS_SYNC);
+        }
+        self->_needsRebuild = NO;
+    }
+}
+
+- (unsigned long long)residentBytes
+{
+    unsigned long long  result;
+    size_t              pageSize;
+    size_t              pageCount;
+    char *              pages;
+    size_t              i;
+
+    result = 0;
+    if (self.isOpen) {
+        pageSize = (size_t) getpagesize();
+        pageCount = (self->_mapSize + pageSize - 1) / pageSize;
+        pages = malloc(pageCount);
+        if ( (pages != NULL) && (mincore(self->_map, self->_mapSize, pages) == 0) ) {
+            for (i = 0; i < pageCount; i++) {
+                if (pages[i] & 1) {
+                    result += pageSize;
+                }
+            }
+        }
+        free(pages);
+    }
+    return result;
+}
+
+@end
+
+@implementation PhotoMetadataRow
+
+- (id)initWithStore:(PhotoMetadataStore *)store row:(uint32_t)row
+{
+    assert(store != nil);
+    self = [super init];
+    if (self != nil) {
+        self->_store = [store retain];
+        self->_row = row;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self->_store release];
+    [super dealloc];
+}
+
+- (NSString *)photoID
+{
+    return [self->_store stringForColumn:kColumnPhotoID row:self->_row];
+}
+
+- (NSString *)name
+{
+    return [self->_store stringForColumn:kColumnName row:self->_row];
+}
+
+- (NSDate *)date
+{
+    return [NSDate dateWithTimeIntervalSinceReferenceDate:[self->_store dateForRow:self->_row]];
+}
+
+- (NSString *)photoPath
+{
+    return [self->_store stringForColumn:kColumnPhotoPath row:self->_row];
+}
+
+- (NSString *)thumbnailPath
+{
+    return [self->_store stringForColumn:kColumnThumbnailPath row:self->_row];
+}
+
+- (NSURL *)objectURI
+{
+    NSString *  uriString;
+
+    uriString = [self->_store stringForColumn:kColumnObjectURI row:self->_row];
+    return ([uriString length] == 0) ? nil : [NSURL URLWithString:uriString];
+}
+
+@end
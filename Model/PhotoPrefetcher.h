@@ -0,0 +1,56 @@
+#import <Foundation/Foundation.h>
+
+// PhotoPrefetcher downloads the full size photos next to the one being displayed, so that
+// when the user moves on to the next (or previous) photo in gallery order it's likely to
+// already be on disk.  The photo detail view controller tells it which photo has become
+// visible, along with the photos in gallery order, and it then calls -[Photo prefetchPhoto]
+// on the next neighbourCount photos in the direction of travel (and the one photo behind),
+// nearest first, until the estimated size of the prefetched-but-not-yet-viewed photos
+// reaches byteBudget.  If the user changes direction, any in-flight prefetches that have
+// fallen outside the new window are cancelled.  While memory is tight (see MemoryBudget),
+// it doesn't start any new prefetches.
+//
+// The prefetcher also keeps statistics (the hit rate, and the number of bytes that were
+// prefetched but never viewed), which it logs when it's stopped.
+//
+// This class must only be used on the main thread.
+
+@interface PhotoPrefetcher : NSObject
+{
+    NSUInteger              _neighbourCount;
+    unsigned long long      _byteBudget;
+    NSUInteger              _lastVisibleIndex;
+    NSInteger               _direction;
+    NSMutableSet *          _prefetchedPhotos;
+    NSUInteger              _viewCount;
+    NSUInteger              _prefetchCount;
+    NSUInteger              _hitCount;
+    NSUInteger              _partialHitCount;
+    unsigned long long      _wastedBytes;
+}
+
+// properties that can be changed at any time
+
+@property (nonatomic, assign, readwrite) NSUInteger             neighbourCount;     // default is 2
+@property (nonatomic, assign, readwrite) unsigned long long     byteBudget;         // default is 4 MB
+
+// Tells the prefetcher that the photo at the specified index has become visible; photos 
+// is the list of photos in gallery order.  We take an index, rather than a photo, because 
+// photos is typically the fetchedObjects of a batched fetch, and searching it for a photo 
+// would fault in every batch.
+
+- (void)photoAtIndex:(NSUInteger)index didBecomeVisibleInPhotos:(NSArray *)photos;
+
+// Cancels any in-flight prefetches, logs the statistics, and resets the prefetcher.
+
+- (void)stop;
+
+// statistics, reset by -stop
+
+@property (nonatomic, assign, readonly ) NSUInteger             viewCount;          // photos made visible
+@property (nonatomic, assign, readonly ) NSUInteger             prefetchCount;      // prefetches started
+@property (nonatomic, assign, readonly ) NSUInteger             hitCount;           // viewed photos that had been prefetched completely
+@property (nonatomic, assign, readonly ) NSUInteger             partialHitCount;    // viewed photos whose prefetch was still in flight
+@property (nonatomic, assign, readonly ) unsigned long long     wastedBytes;        // bytes of cancelled prefetches, thrown away unviewed
+
+@end
@@ -0,0 +1,227 @@
+#import "PhotoPrefetcher.h"
+#import "Photo.h"
+#import "MemoryBudget.h"
+#import "Logging.h"
+
+@interface PhotoPrefetcher ()
+
+// private properties
+@property (nonatomic, retain, readonly ) NSMutableSet *         prefetchedPhotos;
+
+@end
+
+@implementation PhotoPrefetcher
+
+// We always keep the photo just behind the user (in the direction of travel) in the
+// prefetch window, because the user is quite likely to flip back to it.
+
+static const NSUInteger         kPhotoPrefetcherBehindCount      = 1;
+
+// Until we've actually downloaded some photos, we assume that each photo is this big
+// for the purposes of the byte budget.
+
+static const unsigned long long kPhotoPrefetcherDefaultPhotoSize = 1024 * 1024;
+
+- (id)init
+{
+    self = [super init];
+    if (self != nil) {
+        self->_neighbourCount   = 2;
+        self->_byteBudget       = 4 * 1024 * 1024;
+        self->_lastVisibleIndex = NSNotFound;
+        self->_prefetchedPhotos = [[NSMutableSet alloc] init];
+        assert(self->_prefetchedPhotos != nil);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self stop];
+    [self->_prefetchedPhotos release];
+    [super dealloc];
+}
+
+@synthesize neighbourCount   = _neighbourCount;
+@synthesize byteBudget       = _byteBudget;
+@synthesize prefetchedPhotos = _prefetchedPhotos;   // photos we've prefetched that haven't been viewed yet
+
+@synthesize viewCount        = _viewCount;
+@synthesize prefetchCount    = _prefetchCount;
+@synthesize hitCount         = _hitCount;
+@synthesize partialHitCount  = _partialHitCount;
+@synthesize wastedBytes      = _wastedBytes;
+
+// A photo that has been deleted (typically by a sync) is of no further interest to us.
+- (BOOL)isPhotoUsable:(Photo *)photo
+{
+    return ! [photo isDeleted] && ([photo managedObjectContext] != nil);
+}
+
+// Returns our estimate of the number of bytes tied up in prefetched photos that haven't
+// been viewed yet.  For photos that are on disk we know the actual size; for photos that
+// are still in flight we use the average of the ones we know about.
+- (unsigned long long)estimatedPrefetchedBytes
+{
+    unsigned long long  knownBytes;
+    NSUInteger          knownCount;
+    NSUInteger          pendingCount;
+    unsigned long long  size;
+
+    knownBytes   = 0;
+    knownCount   = 0;
+    pendingCount = 0;
+    for (Photo * photo in self.prefetchedPhotos) {
+        if ( [self isPhotoUsable:photo] ) {
+            size = photo.photoFileSize;
+            if (size != 0) {
+                knownBytes += size;
+                knownCount += 1;
+            } else {
+                pendingCount += 1;
+            }
+        }
+    }
+    return knownBytes + pendingCount * ( (knownCount == 0) ? kPhotoPrefetcherDefaultPhotoSize : (knownBytes / knownCount) );
+}
+
+// Forgets about a prefetched photo that's no longer in the prefetch window.  If the
+// prefetch is still in flight we cancel it, which deletes what was downloaded so far, and 
+// that's wasted.  A prefetch that completed stays on disk, ready for when the user gets 
+// to the photo, so it isn't.
+- (void)dropPrefetchedPhoto:(Photo *)photo
+{
+    assert([self.prefetchedPhotos containsObject:photo]);
+
+    if ( [self isPhotoUsable:photo] && photo.photoGetting ) {
+        self->_wastedBytes += [photo cancelPhotoPrefetch];
+    }
+    [self.prefetchedPhotos removeObject:photo];
+}
+
+- (void)photoAtIndex:(NSUInteger)index didBecomeVisibleInPhotos:(NSArray *)photos
+{
+    Photo *             photo;
+    NSInteger           direction;
+    NSUInteger          aheadCount;
+    NSUInteger          behindCount;
+    NSMutableArray *    window;
+    NSUInteger          distance;
+
+    assert([NSThread isMainThread]);
+    assert(photos != nil);
+    assert(index < [photos count]);
+
+    photo = [photos objectAtIndex:index];
+    assert([photo isKindOfClass:[Photo class]]);
+
+    // Update the statistics.
+
+    self->_viewCount += 1;
+    if ( [self.prefetchedPhotos containsObject:photo] ) {
+        if (photo.localPhotoPath != nil) {
+            self->_hitCount += 1;
+        } else {
+            self->_partialHitCount += 1;
+        }
+        [self.prefetchedPhotos removeObject:photo];
+    }
+
+    // Work out which way the user is going.  Until we know, we prefetch equally in both
+    // directions.
+
+    direction = self->_direction;
+    if ( (self->_lastVisibleIndex != NSNotFound) && (index != self->_lastVisibleIndex) ) {
+        direction = (index > self->_lastVisibleIndex) ? 1 : -1;
+        if ( (self->_direction != 0) && (direction != self->_direction) ) {
+            [[QLog log] logWithFormat:@"%s photo %@ prefetch direction changed", __PRETTY_FUNCTION__, photo.photoID];
+        }
+    }
+    self->_direction        = direction;
+    self->_lastVisibleIndex = index;
+
+    aheadCount  = self.neighbourCount;
+    behindCount = (direction == 0) ? self.neighbourCount : MIN(kPhotoPrefetcherBehindCount, self.neighbourCount);
+
+    // Build the prefetch window, nearest first, favouring the direction of travel.
+
+    window = [NSMutableArray array];
+    assert(window != nil);
+
+    for (distance = 1; distance <= MAX(aheadCount, behindCount); distance++) {
+        NSInteger   aheadIndex;
+        NSInteger   behindIndex;
+
+        aheadIndex  = (NSInteger) index + ( (direction < 0) ? -(NSInteger) distance : (NSInteger) distance );
+        behindIndex = (NSInteger) index - ( (direction < 0) ? -(NSInteger) distance : (NSInteger) distance );
+        if ( (distance <= aheadCount) && (aheadIndex >= 0) && (aheadIndex < (NSInteger) [photos count]) ) {
+            [window addObject:[photos objectAtIndex:(NSUInteger) aheadIndex]];
+        }
+        if ( (distance <= behindCount) && (behindIndex >= 0) && (behindIndex < (NSInteger) [photos count]) ) {
+            [window addObject:[photos objectAtIndex:(NSUInteger) behindIndex]];
+        }
+    }
+
+    // Drop any prefetches that have fallen out of the window.  This is what cancels the
+    // in-flight prefetches when the user changes direction.
+
+    for (Photo * prefetchedPhoto in [[self.prefetchedPhotos copy] autorelease]) {
+        if ( ! [window containsObject:prefetchedPhoto] ) {
+            [self dropPrefetchedPhoto:prefetchedPhoto];
+        }
+    }
+
+    // Start prefetches for the photos in the window, nearest first, until we hit our budget.
+    // If memory is tight, we don't start any new prefetches; the ones already in flight 
+    // carry on, and the next visible photo will get another chance.
+
+    if ( [[MemoryBudget sharedBudget] isAtLeastStage:kMemoryBudgetStagePausePrefetch] ) {
+        [[QLog log] logWithFormat:@"%s photo %@ prefetch paused by memory budget", __PRETTY_FUNCTION__, photo.photoID];
+        window = nil;
+    }
+
+    for (Photo * neighbour in window) {
+        if ( [self estimatedPrefetchedBytes] >= self.byteBudget ) {
+            break;
+        }
+        if ( [self isPhotoUsable:neighbour] && (neighbour.localPhotoPath == nil) && ! neighbour.photoGetting ) {
+            [neighbour prefetchPhoto];
+            if (neighbour.photoGetting) {
+                [self.prefetchedPhotos addObject:neighbour];
+                self->_prefetchCount += 1;
+            }
+        }
+    }
+}
+
+- (void)stop
+{
+    NSUInteger  hits;
+
+    for (Photo * photo in [[self.prefetchedPhotos copy] autorelease]) {
+        [self dropPrefetchedPhoto:photo];
+    }
+    assert([self.prefetchedPhotos count] == 0);
+
+    if (self->_viewCount != 0) {
+        hits = self->_hitCount + self->_partialHitCount;
+        [[QLog log] logWithFormat:@"photo prefetch stats: %zu views, %zu prefetches, %zu hits (%zu partial), hit rate %.1f%%, %llu bytes wasted",
+            (size_t) self->_viewCount,
+            (size_t) self->_prefetchCount,
+            (size_t) hits,
+            (size_t) self->_partialHitCount,
+            100.0 * (double) hits / (double) self->_viewCount,
+            self->_wastedBytes
+        ];
+    }
+
+    self->_lastVisibleIndex = NSNotFound;
+    self->_direction        = 0;
+    self->_viewCount        = 0;
+    self->_prefetchCount    = 0;
+    self->_hitCount         = 0;
+    self->_partialHitCount  = 0;
+    self->_wastedBytes      = 0;
+}
+
+@end
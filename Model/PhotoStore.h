@@ -0,0 +1,73 @@
+#import <Foundation/Foundation.h>
+
+// PhotoStore is a content-addressed store for downloaded photos that's shared by all of
+// the gallery caches.  Each photo file (a "blob") is named by the SHA-1 of its contents,
+// so when two galleries (or two photos in the same gallery) point at the same image, we
+// only keep one copy on disk.
+//
+// Blobs are reference counted by owner, where the owner is the name of the gallery cache
+// directory that refers to the blob (via Photo's localPhotoPath).  Counting by owner means
+// that, when a gallery cache is thrown away wholesale (see +[PhotoGallery applicationStartupKeepingGalleryURLStrings:]),
+// we can drop all of its references in one go without opening its database.
+//
+// The store also remembers the validators (ETag and Last-Modified) that the server sent
+// with each photo, keyed by URL.  If we're asked to download a URL for which we already
+// hold a blob, we can make the request conditional, and a 304 response lets us reuse the
+// blob without transferring the photo again.
+//
+// 以内容的 SHA-1 为文件名的图片存储, 所有 gallery 的缓存共享.  相同的图片在磁盘上只保存一份.
+//
+// The store is only accessed on the main thread.
+
+@interface PhotoStore : NSObject
+{
+    NSString *              _storeDirectoryPath;
+    NSMutableDictionary *   _blobs;
+    NSMutableDictionary *   _validators;
+    BOOL                    _saveScheduled;
+    long long               _dedupedBytes;
+    NSUInteger              _dedupedCount;
+    long long               _skippedBytes;
+    NSUInteger              _skippedCount;
+}
+
++ (PhotoStore *)sharedStore;
+
+@property (nonatomic, copy,   readonly ) NSString *     storeDirectoryPath;
+
+// Returns the path of the blob with the specified name.
+- (NSString *)pathForBlobName:(NSString *)blobName;
+
+// Returns YES if blobName looks like a name that the store handed out, as opposed to
+// a legacy per-gallery photo file name.
++ (BOOL)isBlobName:(NSString *)blobName;
+
+// Moves the file at path into the store, as a blob whose contents have the specified
+// SHA-1 digest, and adds a reference to it on behalf of owner.  If the store already
+// has that blob, the file is deleted instead.  Returns the blob name, or nil (and an
+// error) if the file couldn't be moved into the store.
+- (NSString *)addFileAtPath:(NSString *)path digest:(NSString *)digest extension:(NSString *)extension owner:(NSString *)owner error:(NSError **)errorPtr;
+
+// Adds or removes a reference to the blob on behalf of owner.  Releasing the last reference
+// deletes the blob.  -releaseBlobName:owner: returns YES if the owner still holds other
+// references to the blob.
+- (void)retainBlobName:(NSString *)blobName owner:(NSString *)owner;
+- (BOOL)releaseBlobName:(NSString *)blobName owner:(NSString *)owner;
+
+// Drops every reference held by owner.  Used when a gallery cache is deleted.
+- (void)releaseAllBlobsForOwner:(NSString *)owner;
+
+// Records that the photo at url was downloaded into blobName, along with the validators
+// from the response headers, if any.
+- (void)noteBlobName:(NSString *)blobName forURL:(NSURL *)url responseHeaders:(NSDictionary *)headers;
+
+// If the store holds a blob for url, and the server gave us a validator for it, returns
+// the headers needed to make the request conditional and sets *blobNamePtr to the blob.
+// If expectedSize is not zero, the blob must also be that size.  Otherwise returns nil.
+- (NSDictionary *)conditionalHeadersForURL:(NSURL *)url expectedSize:(long long)expectedSize blobName:(NSString **)blobNamePtr;
+
+// Records that a download of blobName was skipped because the server said our copy was
+// still good.
+- (void)noteSkippedDownloadOfBlobName:(NSString *)blobName;
+
+@end
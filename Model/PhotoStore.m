@@ -0,0 +1,391 @@
+#import "PhotoStore.h"
+#import "Logging.h"
+
+#include <CommonCrypto/CommonDigest.h>
+
+// The store lives in its own directory in Caches, next to the gallery caches, and keeps
+// its index in a property list in that directory.
+
+static NSString * kPhotoStoreDirectoryName  = @"PhotoStore";
+static NSString * kPhotoStoreIndexFileName  = @"PhotoStore.plist";
+
+static NSString * kIndexKeyBlobs            = @"blobs";         // NSDictionary, blob name -> blob info
+static NSString * kIndexKeyValidators       = @"validators";    // NSDictionary, URL string -> validator info
+
+static NSString * kBlobKeySize              = @"size";          // NSNumber, file size in bytes
+static NSString * kBlobKeyRefs              = @"refs";          // NSDictionary, owner -> NSNumber reference count
+
+static NSString * kValidatorKeyBlob         = @"blob";          // NSString, blob name
+static NSString * kValidatorKeyETag         = @"ETag";          // NSString, optional
+static NSString * kValidatorKeyLastModified = @"Last-Modified"; // NSString, optional
+
+@interface PhotoStore ()
+
+// forward declarations
+
+- (void)scheduleSave;
+- (void)removeBlobName:(NSString *)blobName;
+
+@end
+
+// Header field names are case insensitive, and NSHTTPURLResponse doesn't promise 
+// any particular capitalisation (it tends to return "Etag"), so we search.
+static NSString * HeaderValue(NSDictionary * headers, NSString * name)
+{
+    for (NSString * key in headers) {
+        if ([key caseInsensitiveCompare:name] == NSOrderedSame) {
+            return [headers objectForKey:key];
+        }
+    }
+    return nil;
+}
+
+@implementation PhotoStore
+
++ (PhotoStore *)sharedStore
+{
+    static PhotoStore * sPhotoStore;
+
+    assert([NSThread isMainThread]);
+    if (sPhotoStore == nil) {
+        sPhotoStore = [[PhotoStore alloc] init];
+        assert(sPhotoStore != nil);
+    }
+    return sPhotoStore;
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self != nil) {
+        NSArray *       paths;
+        NSDictionary *  index;
+        BOOL            success;
+
+        paths = NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES);
+        assert( (paths != nil) && ([paths count] != 0) );
+        self->_storeDirectoryPath = [[[paths objectAtIndex:0] stringByAppendingPathComponent:kPhotoStoreDirectoryName] copy];
+        assert(self->_storeDirectoryPath != nil);
+
+        success = [[NSFileManager defaultManager] createDirectoryAtPath:self->_storeDirectoryPath withIntermediateDirectories:YES attributes:nil error:NULL];
+        assert(success);
+
+        self->_blobs      = [[NSMutableDictionary alloc] init];
+        assert(self->_blobs != nil);
+        self->_validators = [[NSMutableDictionary alloc] init];
+        assert(self->_validators != nil);
+
+        // Load the index, making the blob info dictionaries mutable as we go.
+
+        index = [NSDictionary dictionaryWithContentsOfFile:[self->_storeDirectoryPath stringByAppendingPathComponent:kPhotoStoreIndexFileName]];
+        if (index != nil) {
+            NSDictionary *  blobs;
+
+            blobs = [index objectForKey:kIndexKeyBlobs];
+            for (NSString * blobName in blobs) {
+                NSMutableDictionary *   blob;
+
+                blob = [[[blobs objectForKey:blobName] mutableCopy] autorelease];
+                [blob setObject:[[[blob objectForKey:kBlobKeyRefs] mutableCopy] autorelease] forKey:kBlobKeyRefs];
+                [self->_blobs setObject:blob forKey:blobName];
+            }
+            [self->_validators addEntriesFromDictionary:[index objectForKey:kIndexKeyValidators]];
+        }
+
+        // Reconcile the index with the directory.  Files that aren't in the index were
+        // added just before we were killed, before the index was saved, so no one can
+        // be referring to them.  Index entries without files are just forgotten.
+
+        for (NSString * fileName in [[NSFileManager defaultManager] contentsOfDirectoryAtPath:self->_storeDirectoryPath error:NULL]) {
+            if ( ! [fileName isEqual:kPhotoStoreIndexFileName] && ([self->_blobs objectForKey:fileName] == nil) ) {
+                [[QLog log] logWithFormat:@"%s remove orphan '%@'", __PRETTY_FUNCTION__, fileName];
+                (void) [[NSFileManager defaultManager] removeItemAtPath:[self->_storeDirectoryPath stringByAppendingPathComponent:fileName] error:NULL];
+            }
+        }
+        for (NSString * blobName in [self->_blobs allKeys]) {
+            if ( ! [[NSFileManager defaultManager] fileExistsAtPath:[self pathForBlobName:blobName]] ) {
+                [self->_blobs removeObjectForKey:blobName];
+            }
+        }
+
+        [[QLog log] logWithFormat:@"%s %zu blobs", __PRETTY_FUNCTION__, (size_t) [self->_blobs count]];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    // This object lives for the entire life of the application.  Getting it to support being
+    // deallocated would be quite tricky (particularly from a threading perspective), and so
+    // we don't even try.
+    assert(NO);
+    [super dealloc];
+}
+
+@synthesize storeDirectoryPath = _storeDirectoryPath;
+
++ (BOOL)isBlobName:(NSString *)blobName
+{
+    assert(blobName != nil);
+    return [[blobName stringByDeletingPathExtension] length] == (CC_SHA1_DIGEST_LENGTH * 2);
+}
+
+- (NSString *)pathForBlobName:(NSString *)blobName
+{
+    assert(blobName != nil);
+    return [self.storeDirectoryPath stringByAppendingPathComponent:blobName];
+}
+
+#pragma mark - Index
+
+- (void)save
+{
+    NSMutableDictionary *   validators;
+    NSDictionary *          index;
+    BOOL                    success;
+
+    assert([NSThread isMainThread]);
+    self->_saveScheduled = NO;
+
+    // Don't bother saving validators for blobs that have gone away.
+
+    validators = [NSMutableDictionary dictionary];
+    assert(validators != nil);
+    for (NSString * urlString in self->_validators) {
+        NSDictionary *  validator;
+
+        validator = [self->_validators objectForKey:urlString];
+        if ([self->_blobs objectForKey:[validator objectForKey:kValidatorKeyBlob]] != nil) {
+            [validators setObject:validator forKey:urlString];
+        }
+    }
+    [self->_validators setDictionary:validators];
+
+    index = [NSDictionary dictionaryWithObjectsAndKeys:
+        self->_blobs,       kIndexKeyBlobs,
+        self->_validators,  kIndexKeyValidators,
+        nil
+    ];
+    assert(index != nil);
+    success = [index writeToFile:[self.storeDirectoryPath stringByAppendingPathComponent:kPhotoStoreIndexFileName] atomically:YES];
+    if ( ! success ) {
+        [[QLog log] logWithFormat:@"%s save failed", __PRETTY_FUNCTION__];
+    }
+}
+
+// Saves the index at the end of this run loop cycle, so that a burst of changes
+// (for example, a gallery deleting all of its photos) only writes it once.
+- (void)scheduleSave
+{
+    if ( ! self->_saveScheduled ) {
+        self->_saveScheduled = YES;
+        [self performSelector:@selector(save) withObject:nil afterDelay:0.0];
+    }
+}
+
+#pragma mark - Blobs
+
+- (NSString *)addFileAtPath:(NSString *)path digest:(NSString *)digest extension:(NSString *)extension owner:(NSString *)owner error:(NSError **)errorPtr
+{
+    NSString *              result;
+    NSMutableDictionary *   blob;
+    NSError *               error;
+    BOOL                    success;
+
+    assert([NSThread isMainThread]);
+    assert(path != nil);
+    assert(digest != nil);
+    assert(extension != nil);
+    assert(owner != nil);
+
+    result = [digest stringByAppendingPathExtension:extension];
+    assert([[self class] isBlobName:result]);
+
+    error = nil;
+    blob = [self->_blobs objectForKey:result];
+    if (blob != nil) {
+
+        // We already have these bytes; throw away the new copy.
+
+        (void) [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+        self->_dedupedBytes += [[blob objectForKey:kBlobKeySize] longLongValue];
+        self->_dedupedCount += 1;
+        [[QLog log] logWithFormat:@"%s dedup '%@', %zu photos and %lld bytes saved this session", __PRETTY_FUNCTION__, result, (size_t) self->_dedupedCount, self->_dedupedBytes];
+    } else {
+        unsigned long long  size;
+
+        size = [[[NSFileManager defaultManager] attributesOfItemAtPath:path error:NULL] fileSize];
+        (void) [[NSFileManager defaultManager] removeItemAtPath:[self pathForBlobName:result] error:NULL];
+        success = [[NSFileManager defaultManager] moveItemAtPath:path toPath:[self pathForBlobName:result] error:&error];
+        if (success) {
+            blob = [NSMutableDictionary dictionaryWithObjectsAndKeys:
+                [NSNumber numberWithUnsignedLongLong:size],     kBlobKeySize,
+                [NSMutableDictionary dictionary],               kBlobKeyRefs,
+                nil
+            ];
+            assert(blob != nil);
+            [self->_blobs setObject:blob forKey:result];
+        } else {
+            assert(error != nil);
+            result = nil;
+        }
+    }
+
+    if (result != nil) {
+        [self retainBlobName:result owner:owner];
+    }
+    if ( (result == nil) && (errorPtr != NULL) ) {
+        *errorPtr = error;
+    }
+    return result;
+}
+
+- (void)retainBlobName:(NSString *)blobName owner:(NSString *)owner
+{
+    NSMutableDictionary *   refs;
+
+    assert([NSThread isMainThread]);
+    assert(blobName != nil);
+    assert(owner != nil);
+
+    refs = [[self->_blobs objectForKey:blobName] objectForKey:kBlobKeyRefs];
+    assert(refs != nil);
+    [refs setObject:[NSNumber numberWithUnsignedInteger:[[refs objectForKey:owner] unsignedIntegerValue] + 1] forKey:owner];
+    [self scheduleSave];
+}
+
+- (BOOL)releaseBlobName:(NSString *)blobName owner:(NSString *)owner
+{
+    BOOL                    result;
+    NSMutableDictionary *   refs;
+    NSUInteger              count;
+
+    assert([NSThread isMainThread]);
+    assert(blobName != nil);
+    assert(owner != nil);
+
+    result = NO;
+    refs = [[self->_blobs objectForKey:blobName] objectForKey:kBlobKeyRefs];
+    count = [[refs objectForKey:owner] unsignedIntegerValue];
+    if (count > 1) {
+        [refs setObject:[NSNumber numberWithUnsignedInteger:count - 1] forKey:owner];
+        result = YES;
+    } else {
+        [refs removeObjectForKey:owner];
+        if ( (refs != nil) && ([refs count] == 0) ) {
+            [self removeBlobName:blobName];
+        }
+    }
+    [self scheduleSave];
+    return result;
+}
+
+- (void)releaseAllBlobsForOwner:(NSString *)owner
+{
+    NSUInteger  removedCount;
+
+    assert([NSThread isMainThread]);
+    assert(owner != nil);
+
+    removedCount = 0;
+    for (NSString * blobName in [self->_blobs allKeys]) {
+        NSMutableDictionary *   refs;
+
+        refs = [[self->_blobs objectForKey:blobName] objectForKey:kBlobKeyRefs];
+        if ([refs objectForKey:owner] != nil) {
+            [refs removeObjectForKey:owner];
+            if ([refs count] == 0) {
+                [self removeBlobName:blobName];
+                removedCount += 1;
+            }
+        }
+    }
+    if (removedCount != 0) {
+        [[QLog log] logWithFormat:@"%s owner '%@' removed %zu blobs", __PRETTY_FUNCTION__, owner, (size_t) removedCount];
+    }
+    [self scheduleSave];
+}
+
+- (void)removeBlobName:(NSString *)blobName
+{
+    assert(blobName != nil);
+    (void) [[NSFileManager defaultManager] removeItemAtPath:[self pathForBlobName:blobName] error:NULL];
+    [self->_blobs removeObjectForKey:blobName];
+}
+
+#pragma mark - Validators
+
+- (void)noteBlobName:(NSString *)blobName forURL:(NSURL *)url responseHeaders:(NSDictionary *)headers
+{
+    NSMutableDictionary *   validator;
+    NSString *              value;
+
+    assert([NSThread isMainThread]);
+    assert(blobName != nil);
+    assert(url != nil);
+
+    validator = [NSMutableDictionary dictionaryWithObject:blobName forKey:kValidatorKeyBlob];
+    assert(validator != nil);
+    value = HeaderValue(headers, kValidatorKeyETag);
+    if (value != nil) {
+        [validator setObject:value forKey:kValidatorKeyETag];
+    }
+    value = HeaderValue(headers, kValidatorKeyLastModified);
+    if (value != nil) {
+        [validator setObject:value forKey:kValidatorKeyLastModified];
+    }
+
+    // A validator with neither header is still worth keeping: it doesn't let us make
+    // requests conditional, but it replaces any stale validator for this URL.
+
+    [self->_validators setObject:validator forKey:[url absoluteString]];
+    [self scheduleSave];
+}
+
+- (NSDictionary *)conditionalHeadersForURL:(NSURL *)url expectedSize:(long long)expectedSize blobName:(NSString **)blobNamePtr
+{
+    NSMutableDictionary *   result;
+    NSDictionary *          validator;
+    NSString *              blobName;
+    NSDictionary *          blob;
+    NSString *              value;
+
+    assert([NSThread isMainThread]);
+    assert(url != nil);
+    assert(blobNamePtr != NULL);
+
+    result = nil;
+    validator = [self->_validators objectForKey:[url absoluteString]];
+    blobName  = [validator objectForKey:kValidatorKeyBlob];
+    blob      = (blobName != nil) ? [self->_blobs objectForKey:blobName] : nil;
+    if ( (blob != nil) && ( (expectedSize == 0) || ([[blob objectForKey:kBlobKeySize] longLongValue] == expectedSize) ) ) {
+        result = [NSMutableDictionary dictionary];
+        assert(result != nil);
+        value = [validator objectForKey:kValidatorKeyETag];
+        if (value != nil) {
+            [result setObject:value forKey:@"If-None-Match"];
+        }
+        value = [validator objectForKey:kValidatorKeyLastModified];
+        if (value != nil) {
+            [result setObject:value forKey:@"If-Modified-Since"];
+        }
+        if ([result count] == 0) {
+            result = nil;
+        } else {
+            *blobNamePtr = blobName;
+        }
+    }
+    return result;
+}
+
+- (void)noteSkippedDownloadOfBlobName:(NSString *)blobName
+{
+    assert([NSThread isMainThread]);
+    assert(blobName != nil);
+
+    self->_skippedBytes += [[[self->_blobs objectForKey:blobName] objectForKey:kBlobKeySize] longLongValue];
+    self->_skippedCount += 1;
+    [[QLog log] logWithFormat:@"%s skipped '%@', %zu downloads and %lld bytes skipped this session", __PRETTY_FUNCTION__, blobName, (size_t) self->_skippedCount, self->_skippedBytes];
+}
+
+@end
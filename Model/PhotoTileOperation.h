@@ -0,0 +1,46 @@
+#import <Foundation/Foundation.h>
+#import <CoreGraphics/CoreGraphics.h>
+
+// PhotoTileOperation cuts a photo into a pyramid of kPhotoTileSize x kPhotoTileSize tiles,
+// which lets QImageScrollView decode and draw only the part of the photo that's visible,
+// at the resolution it's being displayed at.  Level 0 is the full resolution photo, level 1
+// is half that size, and so on, up to the first level at which the whole photo fits in a
+// single tile.
+//
+// The tile directory contains an info file (kPhotoTileInfoFileName) describing the pyramid,
+// and the tiles themselves, named as per +pathForTileAtLevel:column:row:inDirectory:.  The
+// operation builds the pyramid in a temporary directory and then renames it into place, so
+// if the info file is present the pyramid is complete.
+
+extern const size_t kPhotoTileSize;
+
+extern NSString * kPhotoTileInfoFileName;
+extern NSString * kPhotoTileInfoKeyWidth;           // NSNumber, pixel width of level 0
+extern NSString * kPhotoTileInfoKeyHeight;          // NSNumber, pixel height of level 0
+extern NSString * kPhotoTileInfoKeyTileSize;        // NSNumber, kPhotoTileSize
+extern NSString * kPhotoTileInfoKeyLevelCount;      // NSNumber
+
+@interface PhotoTileOperation : NSOperation
+{
+    NSString *      _photoPath;
+    NSString *      _tileDirectoryPath;
+    NSError *       _error;
+}
+
+// Configures the operation to build the tile pyramid for the photo at photoPath (which
+// must be JPEG or PNG) in tileDirectoryPath (which must not exist).
+- (id)initWithPhotoPath:(NSString *)photoPath tileDirectoryPath:(NSString *)tileDirectoryPath;
+
+// Returns the path of the specified tile within the tile directory.
++ (NSString *)pathForTileAtLevel:(NSUInteger)level column:(NSUInteger)column row:(NSUInteger)row inDirectory:(NSString *)tileDirectoryPath;
+
+// properties specified at init time
+
+@property (copy,   readonly ) NSString *    photoPath;
+@property (copy,   readonly ) NSString *    tileDirectoryPath;
+
+// properties that are valid after the operation is finished
+
+@property (copy,   readonly ) NSError *     error;
+
+@end
@@ -0,0 +1,228 @@
+#import "PhotoTileOperation.h"
+#import <ImageIO/ImageIO.h>
+
+const size_t kPhotoTileSize = 256;
+
+NSString * kPhotoTileInfoFileName       = @"Tiles.plist";
+NSString * kPhotoTileInfoKeyWidth       = @"width";
+NSString * kPhotoTileInfoKeyHeight      = @"height";
+NSString * kPhotoTileInfoKeyTileSize    = @"tileSize";
+NSString * kPhotoTileInfoKeyLevelCount  = @"levelCount";
+
+/*
+    o 本类继承自 NSOperation,  通过重写 main 方法 来定义自己的 NSOperation.
+        把一张大图切成 256x256 的小块(tile), 每一级(level)的尺寸是上一级的一半.
+ */
+
+@interface PhotoTileOperation ()
+
+// read/write variants of public properties
+
+@property (copy,   readwrite) NSError *     error;
+
+@end
+
+@implementation PhotoTileOperation
+
+@synthesize photoPath         = _photoPath;
+@synthesize tileDirectoryPath = _tileDirectoryPath;
+@synthesize error             = _error;
+
+- (id)initWithPhotoPath:(NSString *)photoPath tileDirectoryPath:(NSString *)tileDirectoryPath
+{
+    assert(photoPath != nil);
+    assert(tileDirectoryPath != nil);
+
+    self = [super init];
+    if (self != nil) {
+        self->_photoPath         = [photoPath copy];
+        self->_tileDirectoryPath = [tileDirectoryPath copy];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self->_photoPath release];
+    [self->_tileDirectoryPath release];
+    [self->_error release];
+    [super dealloc];
+}
+
++ (NSString *)pathForTileAtLevel:(NSUInteger)level column:(NSUInteger)column row:(NSUInteger)row inDirectory:(NSString *)tileDirectoryPath
+{
+    assert(tileDirectoryPath != nil);
+    return [tileDirectoryPath stringByAppendingPathComponent:[NSString stringWithFormat:@"%zu-%zu-%zu.jpg", (size_t) level, (size_t) column, (size_t) row]];
+}
+
+// Renders image into a new bitmap of the specified size and returns an image of that bitmap.
+// We use this both to force the decode of the full size photo (once, rather than once per
+// tile) and to scale each level down to create the next.
+static CGImageRef CreateRenderedImage(CGImageRef image, size_t width, size_t height)
+{
+    CGImageRef      result;
+    CGColorSpaceRef space;
+    CGContextRef    context;
+
+    result = NULL;
+
+    space = CGColorSpaceCreateDeviceRGB();
+    assert(space != NULL);
+
+    context = CGBitmapContextCreate(NULL, width, height, 8, 0, space, kCGBitmapByteOrder32Little | kCGImageAlphaNoneSkipFirst);
+    if (context != NULL) {
+        CGContextSetInterpolationQuality(context, kCGInterpolationHigh);
+        CGContextDrawImage(context, CGRectMake(0.0f, 0.0f, width, height), image);
+        result = CGBitmapContextCreateImage(context);
+    }
+
+    CGContextRelease(context);
+    CGColorSpaceRelease(space);
+
+    return result;
+}
+
+// Writes image to path as a JPEG.
+static BOOL WriteTile(CGImageRef image, NSString * path)
+{
+    BOOL                    success;
+    CGImageDestinationRef   destination;
+    NSDictionary *          properties;
+
+    success = NO;
+    destination = CGImageDestinationCreateWithURL( (CFURLRef) [NSURL fileURLWithPath:path], CFSTR("public.jpeg"), 1, NULL);
+    if (destination != NULL) {
+        properties = [NSDictionary dictionaryWithObject:[NSNumber numberWithFloat:0.8f] forKey:(id) kCGImageDestinationLossyCompressionQuality];
+        assert(properties != nil);
+
+        CGImageDestinationAddImage(destination, image, (CFDictionaryRef) properties);
+        success = CGImageDestinationFinalize(destination);
+        CFRelease(destination);
+    }
+    return success;
+}
+
+#pragma mark - 入列后开始执行的函数
+- (void)main
+{
+    BOOL                success;
+    NSFileManager *     fileManager;
+    NSString *          tempDirectoryPath;
+    CGImageSourceRef    source;
+    CGImageRef          photo;
+    CGImageRef          levelImage;
+    CGImageRef          nextLevelImage;
+    CGImageRef          tile;
+    size_t              fullWidth;
+    size_t              fullHeight;
+    size_t              levelWidth;
+    size_t              levelHeight;
+    NSUInteger          level;
+    NSUInteger          column;
+    NSUInteger          row;
+    NSDictionary *      info;
+
+    fileManager = [[[NSFileManager alloc] init] autorelease];   // -defaultManager is not thread safe
+    assert(fileManager != nil);
+
+    // Build the pyramid in a temporary directory next to the final one.
+
+    tempDirectoryPath = [self.tileDirectoryPath stringByAppendingPathExtension:@"tmp"];
+    assert(tempDirectoryPath != nil);
+
+    (void) [fileManager removeItemAtPath:tempDirectoryPath error:NULL];
+    success = [fileManager createDirectoryAtPath:tempDirectoryPath withIntermediateDirectories:YES attributes:nil error:NULL];
+
+    // Decode the photo.
+
+    photo      = NULL;
+    levelImage = NULL;
+    fullWidth  = 0;
+    fullHeight = 0;
+    if (success) {
+        source = CGImageSourceCreateWithURL( (CFURLRef) [NSURL fileURLWithPath:self.photoPath], NULL);
+        if (source != NULL) {
+            photo = CGImageSourceCreateImageAtIndex(source, 0, NULL);
+            CFRelease(source);
+        }
+        success = (photo != NULL);
+    }
+    if (success) {
+        fullWidth  = CGImageGetWidth(photo);
+        fullHeight = CGImageGetHeight(photo);
+        levelImage = CreateRenderedImage(photo, fullWidth, fullHeight);
+        success = (levelImage != NULL);
+    }
+
+    // Cut each level into tiles, then halve it to make the next level.  We stop after
+    // the first level that fits into a single tile.
+
+    level = 0;
+    while (success) {
+        levelWidth  = CGImageGetWidth(levelImage);
+        levelHeight = CGImageGetHeight(levelImage);
+
+        for (row = 0; success && (row * kPhotoTileSize < levelHeight); row++) {
+            for (column = 0; success && (column * kPhotoTileSize < levelWidth); column++) {
+                CGRect  tileRect;
+
+                if ( [self isCancelled] ) {
+                    success = NO;
+                    break;
+                }
+                tileRect = CGRectMake(column * kPhotoTileSize, row * kPhotoTileSize, kPhotoTileSize, kPhotoTileSize);
+                tileRect = CGRectIntersection(tileRect, CGRectMake(0.0f, 0.0f, levelWidth, levelHeight));
+
+                tile = CGImageCreateWithImageInRect(levelImage, tileRect);
+                success = (tile != NULL);
+                if (success) {
+                    success = WriteTile(tile, [[self class] pathForTileAtLevel:level column:column row:row inDirectory:tempDirectoryPath]);
+                    CGImageRelease(tile);
+                }
+            }
+        }
+        if ( ! success ) {
+            break;
+        }
+        level += 1;
+
+        if ( (levelWidth <= kPhotoTileSize) && (levelHeight <= kPhotoTileSize) ) {
+            break;
+        }
+        nextLevelImage = CreateRenderedImage(levelImage, (levelWidth + 1) / 2, (levelHeight + 1) / 2);
+        CGImageRelease(levelImage);
+        levelImage = nextLevelImage;
+        success = (levelImage != NULL);
+    }
+
+    // Write the info file and move the pyramid into place.
+
+    if (success) {
+        info = [NSDictionary dictionaryWithObjectsAndKeys:
+            [NSNumber numberWithUnsignedInteger:fullWidth],         kPhotoTileInfoKeyWidth,
+            [NSNumber numberWithUnsignedInteger:fullHeight],        kPhotoTileInfoKeyHeight,
+            [NSNumber numberWithUnsignedInteger:kPhotoTileSize],    kPhotoTileInfoKeyTileSize,
+            [NSNumber numberWithUnsignedInteger:level],             kPhotoTileInfoKeyLevelCount,
+            nil
+        ];
+        assert(info != nil);
+        success = [info writeToFile:[tempDirectoryPath stringByAppendingPathComponent:kPhotoTileInfoFileName] atomically:YES];
+    }
+    if (success) {
+        (void) [fileManager removeItemAtPath:self.tileDirectoryPath error:NULL];
+        success = [fileManager moveItemAtPath:tempDirectoryPath toPath:self.tileDirectoryPath error:NULL];
+    }
+    if ( ! success ) {
+        (void) [fileManager removeItemAtPath:tempDirectoryPath error:NULL];
+        if ( [self isCancelled] ) {
+            self.error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSUserCancelledError userInfo:nil];
+        } else {
+            self.error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteUnknownError userInfo:nil];
+        }
+    }
+
+    CGImageRelease(levelImage);
+    CGImageRelease(photo);
+}
+
+@end
@@ -0,0 +1,43 @@
+#import <Foundation/Foundation.h>
+#import <CoreGraphics/CoreGraphics.h>
+#import <ImageIO/ImageIO.h>
+
+// ProgressiveImageOperation decodes as much as possible of an image that's still being
+// downloaded to a file.  Each operation reads whatever is in the file right now, feeds
+// it to an incremental image source, and renders the rows (or progressive passes) that
+// are available into a bitmap that's no bigger than maximumSize in either dimension.
+//
+// The image source carries the decoder state from one operation to the next, so the
+// client creates it once (using CGImageSourceCreateIncremental) and passes it to each
+// operation in turn.  Image sources aren't thread safe, so the client must not run two
+// operations with the same source at the same time.
+
+@interface ProgressiveImageOperation : NSOperation
+{
+    CGImageSourceRef    _imageSource;
+    NSString *          _filePath;
+    CGFloat             _maximumSize;
+    NSUInteger          _bytesDecoded;
+    CGSize              _fullSize;
+    CGImageRef          _image;
+}
+
+// Configures the operation to decode the data in filePath using imageSource.
+- (id)initWithImageSource:(CGImageSourceRef)imageSource filePath:(NSString *)filePath;
+
+// properties specified at init time
+
+@property (assign, readonly ) CGImageSourceRef  imageSource;
+@property (copy,   readonly ) NSString *        filePath;
+
+// properties that can be changed before starting the operation
+
+@property (assign, readwrite) CGFloat           maximumSize;        // defaults to 1024.0f
+
+// properties that are valid after the operation is finished
+
+@property (assign, readonly ) NSUInteger        bytesDecoded;       // size of the file when we read it
+@property (assign, readonly ) CGSize            fullSize;           // size of the complete image, in pixels, or CGSizeZero
+@property (assign, readonly ) CGImageRef        image;              // NULL if nothing could be decoded yet
+
+@end
@@ -0,0 +1,158 @@
+#import "ProgressiveImageOperation.h"
+
+/*
+    o 本类继承自 NSOperation,  通过重写 main 方法 来定义自己的 NSOperation.
+        每次执行都读取正在下载中的文件,把已经到达的数据交给 incremental image source 解码.
+ */
+
+@implementation ProgressiveImageOperation
+
+@synthesize imageSource  = _imageSource;
+@synthesize filePath     = _filePath;
+@synthesize maximumSize  = _maximumSize;
+@synthesize bytesDecoded = _bytesDecoded;
+@synthesize fullSize     = _fullSize;
+@synthesize image        = _image;
+
+- (id)initWithImageSource:(CGImageSourceRef)imageSource filePath:(NSString *)filePath
+{
+    assert(imageSource != NULL);
+    assert(filePath != nil);
+
+    self = [super init];
+    if (self != nil) {
+        self->_imageSource = (CGImageSourceRef) CFRetain(imageSource);
+        self->_filePath    = [filePath copy];
+        self->_maximumSize = 1024.0f;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    CGImageRelease(self->_image);
+    CFRelease(self->_imageSource);
+    [self->_filePath release];
+    [super dealloc];
+}
+
+// Gets the full pixel size of the image from the image source's properties, which are
+// available as soon as the decoder has seen the image header.
+- (CGSize)fullSizeFromImageSource
+{
+    CGSize          result;
+    CFDictionaryRef properties;
+    NSNumber *      width;
+    NSNumber *      height;
+
+    result = CGSizeZero;
+    properties = CGImageSourceCopyPropertiesAtIndex(self.imageSource, 0, NULL);
+    if (properties != NULL) {
+        width  = (NSNumber *) CFDictionaryGetValue(properties, kCGImagePropertyPixelWidth);
+        height = (NSNumber *) CFDictionaryGetValue(properties, kCGImagePropertyPixelHeight);
+        if ( (width != nil) && (height != nil) ) {
+            result = CGSizeMake([width floatValue], [height floatValue]);
+        }
+        CFRelease(properties);
+    }
+    return result;
+}
+
+#pragma mark - 入列后开始执行的函数
+- (void)main
+{
+    // Latch maximumSize for performance, and also to prevent it changing out from underneath us.
+    CGFloat             maximumSize;
+    maximumSize = self.maximumSize;
+
+    NSData *            data;
+    CGImageStatus       status;
+    CGImageRef          partialImage;
+
+    // Read what's arrived so far.  The file is still being written on the networking
+    // thread, so we just take whatever length it has right now.
+
+    data = [NSData dataWithContentsOfFile:self.filePath options:NSDataReadingMappedIfSafe error:NULL];
+    if ( (data == nil) || ([data length] == 0) ) {
+        return;
+    }
+    self->_bytesDecoded = [data length];
+
+    CGImageSourceUpdateData(self.imageSource, (CFDataRef) data, false);
+    if (CGImageSourceGetCount(self.imageSource) == 0) {
+        return;
+    }
+    status = CGImageSourceGetStatusAtIndex(self.imageSource, 0);
+    if ( (status != kCGImageStatusIncomplete) && (status != kCGImageStatusComplete) ) {
+        return;
+    }
+    self->_fullSize = [self fullSizeFromImageSource];
+    if ( (self->_fullSize.width < 1.0f) || (self->_fullSize.height < 1.0f) ) {
+        return;
+    }
+
+    partialImage = CGImageSourceCreateImageAtIndex(self.imageSource, 0, NULL);
+
+    // Render what we have into a bitmap context and then create an image from that context.
+    // This forces the decode to happen here, rather than on the main thread when the image
+    // is first drawn.
+
+    if (partialImage != NULL) {
+        static const CGFloat kWhite[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+        CGColorRef      white;
+        CGContextRef    context;
+        CGColorSpaceRef space;
+        CGFloat         scale;
+        size_t          width;
+        size_t          height;
+
+        space = CGColorSpaceCreateDeviceRGB();
+        assert(space != NULL);
+
+        white = CGColorCreate(space, kWhite);
+        assert(white != NULL);
+
+        // Scale the full image so that it fits within maximumSize.
+
+        scale = 1.0f;
+        if (self->_fullSize.width > maximumSize) {
+            scale = maximumSize / self->_fullSize.width;
+        }
+        if ( (self->_fullSize.height * scale) > maximumSize ) {
+            scale = maximumSize / self->_fullSize.height;
+        }
+        width  = (size_t) (self->_fullSize.width  * scale);
+        height = (size_t) (self->_fullSize.height * scale);
+
+        context = CGBitmapContextCreate(NULL, width, height, 8, 0, space, kCGBitmapByteOrder32Little | kCGImageAlphaPremultipliedFirst);
+        if (context != NULL) {
+            CGRect  r;
+
+            // Anything that hasn't arrived yet comes out white.
+
+            CGContextSetFillColorWithColor(context, white);
+            CGContextFillRect(context, CGRectMake(0.0f, 0.0f, width, height));
+
+            // A partially decoded baseline image may have fewer rows than the full image;
+            // those rows belong at the top (remember that CG's origin is bottom left).
+
+            r = CGRectZero;
+            r.size.width  = CGImageGetWidth(partialImage)  * scale;
+            r.size.height = CGImageGetHeight(partialImage) * scale;
+            r.origin.y    = height - r.size.height;
+
+            CGContextDrawImage(context, r, partialImage);
+
+            self->_image = CGBitmapContextCreateImage(context);
+            assert(self->_image != NULL);
+        }
+
+        CGContextRelease(context);
+        CGColorSpaceRelease(space);
+        CGColorRelease(white);
+    }
+
+    CGImageRelease(partialImage);
+}
+
+@end
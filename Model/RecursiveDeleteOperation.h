@@ -1,10 +1,28 @@
 #import <Foundation/Foundation.h>
 
 // 递归删除操作, NSOperatino 的子类
+//
+// Each directory tree is walked in parallel: every directory is listed by its own
+// operation on a private queue, concurrency operations at a time, which deletes the
+// files it finds and queues a new operation for each subdirectory.  Once the walk is
+// done, the (now empty) directories are removed.  The deletes can also be rate limited,
+// so that tearing down a big cache doesn't starve everyone else of disk I/O.
+//
+// The operation is restartable: if the app is killed part way through, running a new
+// operation on the same paths picks up where the last one left off.
+//
+// 每个目录由一个单独的 operation 并行遍历, 并且可以限制每秒删除的文件数, 以免占用太多磁盘 I/O.
 @interface RecursiveDeleteOperation : NSOperation
 {
-    NSArray *   _paths;
-    NSError *   _error;
+    NSArray *                   _paths;
+    NSUInteger                  _concurrency;
+    double                      _maximumDeletesPerSecond;
+    NSError *                   _error;
+    NSUInteger                  _deletedCount;
+
+    RecursiveDeleteOperation *  _parent;            // for the operations that walk a directory, the operation that queued them; not retained
+    NSOperationQueue *          _walkQueue;
+    CFAbsoluteTime              _nextDeleteTime;
 }
 
 // 初始化方法, 通过一个数组初始化
@@ -14,7 +32,12 @@
 // properties specified at init time
 @property (copy,   readonly ) NSArray *     paths;
 
+// properties you can configure before queuing the operation
+@property (assign, readwrite) NSUInteger    concurrency;                // default is 2
+@property (assign, readwrite) double        maximumDeletesPerSecond;    // default is 0, meaning no limit
+
 // properties that are valid after the operation is finished
 @property (copy,   readonly ) NSError *     error;
+@property (assign, readonly ) NSUInteger    deletedCount;               // number of files deleted, not counting directories
 
 @end
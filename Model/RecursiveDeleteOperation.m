@@ -1,16 +1,25 @@
 #import "RecursiveDeleteOperation.h"
+#import "Logging.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
 
 @interface RecursiveDeleteOperation ()
 
 // read/write versions of public properties
 @property (copy,   readwrite) NSError *     error;
 
+// forward declarations
+- (void)walkDirectoryAtPath:(NSString *)path;
+
 @end
 
 
 @implementation RecursiveDeleteOperation
 
 @synthesize paths = _paths;
+@synthesize concurrency = _concurrency;
+@synthesize maximumDeletesPerSecond = _maximumDeletesPerSecond;
 @synthesize error = _error;
 
 - (id)initWithPaths:(NSArray *)paths
@@ -21,6 +30,19 @@
     if (self != nil) {
         self->_paths = [paths copy];
         assert(self->_paths != nil);
+        self->_concurrency = 2;
+    }
+    return self;
+}
+
+// Creates an operation that walks a single directory on behalf of parent.
+- (id)initWithDirectoryPath:(NSString *)path parent:(RecursiveDeleteOperation *)parent
+{
+    assert(path != nil);
+    assert(parent != nil);
+    self = [self initWithPaths:[NSArray arrayWithObject:path]];
+    if (self != nil) {
+        self->_parent = parent;
     }
     return self;
 }
@@ -29,29 +51,195 @@
 {
     [self->_paths release];
     [self->_error release];
+    [self->_walkQueue release];
     [super dealloc];
 }
 
+- (NSUInteger)deletedCount
+{
+    @synchronized (self) {
+        return self->_deletedCount;
+    }
+}
+
+#pragma mark - Called by the walk operations
+
+// Blocks until the rate limit allows another delete.  Any thread.
+- (void)waitForDeleteSlot
+{
+    CFAbsoluteTime  now;
+    CFAbsoluteTime  slot;
+
+    if (self->_maximumDeletesPerSecond > 0.0) {
+        @synchronized (self) {
+            now = CFAbsoluteTimeGetCurrent();
+            if (self->_nextDeleteTime < now) {
+                self->_nextDeleteTime = now;
+            }
+            slot = self->_nextDeleteTime;
+            self->_nextDeleteTime += 1.0 / self->_maximumDeletesPerSecond;
+        }
+        if (slot > now) {
+            [NSThread sleepForTimeInterval:slot - now];
+        }
+    }
+}
+
+- (void)noteDeletedFile
+{
+    @synchronized (self) {
+        self->_deletedCount += 1;
+    }
+}
+
+// Records the first error that any of the walk operations hits.
+- (void)noteErrorWithErrno:(int)err path:(NSString *)path
+{
+    @synchronized (self) {
+        if (self->_error == nil) {
+            self->_error = [[NSError alloc] initWithDomain:NSPOSIXErrorDomain code:err userInfo:[NSDictionary dictionaryWithObject:path forKey:NSFilePathErrorKey]];
+        }
+    }
+}
+
+// Queues an operation to walk the directory at path.  Any thread.
+- (void)walkDirectoryAtPath:(NSString *)path
+{
+    RecursiveDeleteOperation *  op;
+
+    assert(self->_walkQueue != nil);
+    op = [[[RecursiveDeleteOperation alloc] initWithDirectoryPath:path parent:self] autorelease];
+    assert(op != nil);
+    [op setThreadPriority:[self threadPriority]];
+    [self->_walkQueue addOperation:op];
+}
+
+#pragma mark - Walking a directory
+
+// Deletes the files in the directory at path, and hands each subdirectory back to the
+// parent to walk.  Directories themselves are left for the parent to remove once the
+// whole walk is done, which is why we don't need to wait for our subdirectories.
+- (void)walkDirectory
+{
+    NSFileManager *     fileManager;
+    NSString *          path;
+    NSString *          childPathString;
+    DIR *               dir;
+    struct dirent *     entry;
+    char                childPath[PATH_MAX];
+    BOOL                isDirectory;
+    struct stat         sb;
+    int                 err;
+
+    assert(self->_parent != nil);
+    path = [self.paths objectAtIndex:0];
+
+    fileManager = [[[NSFileManager alloc] init] autorelease];     // -defaultManager is not thread safe
+    assert(fileManager != nil);
+
+    dir = opendir([path fileSystemRepresentation]);
+    if (dir == NULL) {
+        if (errno == ENOTDIR) {
+            // One of the top-level paths is a file.
+            [self->_parent waitForDeleteSlot];
+            if (unlink([path fileSystemRepresentation]) == 0) {
+                [self->_parent noteDeletedFile];
+            } else if (errno != ENOENT) {
+                [self->_parent noteErrorWithErrno:errno path:path];
+            }
+        } else if (errno != ENOENT) {
+            [self->_parent noteErrorWithErrno:errno path:path];
+        }
+    } else {
+        while ( (entry = readdir(dir)) != NULL ) {
+            if ( [self->_parent isCancelled] ) {
+                break;
+            }
+            if ( (strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0) ) {
+                continue;
+            }
+            if ( snprintf(childPath, sizeof(childPath), "%s/%s", [path fileSystemRepresentation], entry->d_name) >= (int) sizeof(childPath) ) {
+                [self->_parent noteErrorWithErrno:ENAMETOOLONG path:path];
+                continue;
+            }
+
+            if (entry->d_type == DT_UNKNOWN) {
+                isDirectory = (lstat(childPath, &sb) == 0) && S_ISDIR(sb.st_mode);
+            } else {
+                isDirectory = (entry->d_type == DT_DIR);
+            }
+
+            // We only make an NSString when we need one; a directory can hold tens of 
+            // thousands of files, and we don't want all those strings in the autorelease pool.
+            
+            if (isDirectory) {
+                childPathString = [fileManager stringWithFileSystemRepresentation:childPath length:strlen(childPath)];
+                [self->_parent walkDirectoryAtPath:childPathString];
+            } else {
+                [self->_parent waitForDeleteSlot];
+                if (unlink(childPath) == 0) {
+                    [self->_parent noteDeletedFile];
+                } else if (errno != ENOENT) {
+                    err = errno;
+                    childPathString = [fileManager stringWithFileSystemRepresentation:childPath length:strlen(childPath)];
+                    [self->_parent noteErrorWithErrno:err path:childPathString];
+                }
+            }
+        }
+        (void) closedir(dir);
+    }
+}
+
 //因为是简单的添加到 NSOperationQueue 中的 operation ,这里只是简单的重写 main 函数就可以了.
 - (void)main
 {
-    BOOL                success;
     NSFileManager *     fileManager;
     NSError *           error;
-    
-    fileManager = [NSFileManager defaultManager];
-    assert(fileManager != nil);
-    
-    success = YES;  // necessary when self.paths is empty, which is a wacky corner case but I decided to allow it
-    for (NSString * path in self.paths) {
-        success = [fileManager removeItemAtPath:path error:&error];
-        if ( ! success ) {
-            break;
+    CFAbsoluteTime      startTime;
+    NSTimeInterval      elapsed;
+
+    if (self->_parent != nil) {
+        [self walkDirectory];
+    } else {
+        startTime = CFAbsoluteTimeGetCurrent();
+
+        // Walk the trees, deleting the files.  The walk operations queue more of their
+        // kind as they find subdirectories, but a directory's operation is still running
+        // when it queues its subdirectories, so the queue can't drain early.
+
+        assert(self.concurrency != 0);
+        self->_walkQueue = [[NSOperationQueue alloc] init];
+        assert(self->_walkQueue != nil);
+        [self->_walkQueue setMaxConcurrentOperationCount:self.concurrency];
+        for (NSString * path in self.paths) {
+            [self walkDirectoryAtPath:path];
         }
-    }
-    
-    if ( ! success ) {
-        self.error = error;
+        [self->_walkQueue waitUntilAllOperationsAreFinished];
+
+        // Now remove what's left, which should just be empty directories.  -defaultManager
+        // is not thread safe, so we use our own file manager.
+
+        if ( ! [self isCancelled] ) {
+            fileManager = [[[NSFileManager alloc] init] autorelease];
+            assert(fileManager != nil);
+            for (NSString * path in self.paths) {
+                if ( [fileManager fileExistsAtPath:path] && ! [fileManager removeItemAtPath:path error:&error] ) {
+                    if (self.error == nil) {
+                        self.error = error;
+                    }
+                }
+            }
+        }
+
+        elapsed = CFAbsoluteTimeGetCurrent() - startTime;
+        [[QLog log] logWithFormat:@"%s deleted %zu files from %zu paths in %.3f s (%.0f files/s), error %@",
+            __PRETTY_FUNCTION__,
+            (size_t) self.deletedCount,
+            (size_t) [self.paths count],
+            elapsed,
+            (elapsed > 0.0) ? self.deletedCount / elapsed : 0.0,
+            self.error
+        ];
     }
 }
 
@@ -0,0 +1,47 @@
+#import <Foundation/Foundation.h>
+
+// ThumbnailCache is an in-memory cache of encoded (PNG) thumbnails that's shared by all of 
+// the galleries that are open at once.  It's keyed by the thumbnail's absolute URL, so when 
+// several galleries point at the same server (a kiosk showing a handful of feeds from one 
+// site, say), each thumbnail is only fetched and resized once.  Photo checks the cache 
+// before it starts a thumbnail get, and adds to it when a resize completes.
+//
+// The cache holds encoded data rather than decoded images because the data is an order 
+// of magnitude smaller; decoding a thumbnail is cheap compared to fetching and resizing it.
+// It's bounded by size, discarding the least recently used thumbnails first, and it's 
+// emptied when the memory budget asks for caches to be evicted.
+//
+// 所有 gallery 共享的 thumbnail 内存缓存, 以 thumbnail 的 URL 为 key.
+//
+// The cache is only accessed on the main thread.
+
+@interface ThumbnailCache : NSObject
+{
+    NSUInteger              _byteLimit;
+    NSMutableDictionary *   _dataByURLString;
+    NSMutableArray *        _URLStrings;            // least recently used first
+    NSUInteger              _byteCount;
+    NSUInteger              _hitCount;
+    NSUInteger              _missCount;
+}
+
++ (ThumbnailCache *)sharedCache;
+
+@property (nonatomic, assign, readwrite) NSUInteger     byteLimit;      // default is 2 MB
+
+// Returns the PNG data for the thumbnail at url, or nil if it's not in the cache.
+// This counts as a hit or a miss.
+- (NSData *)thumbnailDataForURL:(NSURL *)url;
+
+// Adds the PNG data for the thumbnail at url, replacing any that's already there.
+- (void)setThumbnailData:(NSData *)data forURL:(NSURL *)url;
+
+// Forgets the thumbnail at url, for example because the gallery says it has changed.
+- (void)removeThumbnailDataForURL:(NSURL *)url;
+
+- (void)removeAllThumbnailData;
+
+@property (nonatomic, assign, readonly ) NSUInteger     hitCount;
+@property (nonatomic, assign, readonly ) NSUInteger     missCount;
+
+@end
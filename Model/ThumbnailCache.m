@@ -0,0 +1,167 @@
+#import "ThumbnailCache.h"
+#import "MemoryBudget.h"
+#import "Logging.h"
+
+@interface ThumbnailCache ()
+
+// forward declarations
+- (void)trimToByteLimit;
+- (void)evictCaches:(NSNotification *)note;
+
+@end
+
+@implementation ThumbnailCache
+
++ (ThumbnailCache *)sharedCache
+{
+    static ThumbnailCache * sThumbnailCache;
+
+    assert([NSThread isMainThread]);
+    if (sThumbnailCache == nil) {
+        sThumbnailCache = [[ThumbnailCache alloc] init];
+        assert(sThumbnailCache != nil);
+    }
+    return sThumbnailCache;
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self != nil) {
+        self->_byteLimit = 2 * 1024 * 1024;
+        self->_dataByURLString = [[NSMutableDictionary alloc] init];
+        assert(self->_dataByURLString != nil);
+        self->_URLStrings = [[NSMutableArray alloc] init];
+        assert(self->_URLStrings != nil);
+        
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(evictCaches:) name:kMemoryBudgetEvictCachesNotification object:nil];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    // This object lives for the entire life of the application.  Getting it to support being 
+    // deallocated would be quite tricky (particularly from a threading perspective), so we 
+    // don't even try.
+    assert(NO);
+    [super dealloc];
+}
+
+@synthesize byteLimit = _byteLimit;
+@synthesize hitCount  = _hitCount;
+@synthesize missCount = _missCount;
+
+- (void)setByteLimit:(NSUInteger)newValue
+{
+    assert([NSThread isMainThread]);
+    self->_byteLimit = newValue;
+    [self trimToByteLimit];
+}
+
+// Removes the entry for URLString, which must be in the cache, keeping the byte count 
+// and the memory budget up to date.
+- (void)removeURLString:(NSString *)URLString
+{
+    NSUInteger  length;
+    
+    [[URLString retain] autorelease];       // it might be the array's copy
+    length = [[self->_dataByURLString objectForKey:URLString] length];
+    [self->_dataByURLString removeObjectForKey:URLString];
+    [self->_URLStrings removeObject:URLString];
+    assert(self->_byteCount >= length);
+    self->_byteCount -= length;
+    [[MemoryBudget sharedBudget] adjustBytes:- (long long) length forSubsystem:kMemoryBudgetSubsystemThumbnailCache];
+}
+
+// Discards least recently used thumbnails until we're within the byte limit.
+- (void)trimToByteLimit
+{
+    while ( (self->_byteCount > self->_byteLimit) && ([self->_URLStrings count] != 0) ) {
+        [self removeURLString:[self->_URLStrings objectAtIndex:0]];
+    }
+}
+
+- (NSData *)thumbnailDataForURL:(NSURL *)url
+{
+    NSString *  URLString;
+    NSData *    result;
+    
+    assert([NSThread isMainThread]);
+    assert(url != nil);
+    
+    URLString = [url absoluteString];
+    result = [self->_dataByURLString objectForKey:URLString];
+    if (result != nil) {
+        self->_hitCount += 1;
+        
+        // Move it to the most recently used end.
+        
+        [[URLString retain] autorelease];
+        [self->_URLStrings removeObject:URLString];
+        [self->_URLStrings addObject:URLString];
+    } else {
+        self->_missCount += 1;
+    }
+    return result;
+}
+
+- (void)setThumbnailData:(NSData *)data forURL:(NSURL *)url
+{
+    NSString *  URLString;
+    
+    assert([NSThread isMainThread]);
+    assert(data != nil);
+    assert(url != nil);
+    
+    URLString = [url absoluteString];
+    if ([self->_dataByURLString objectForKey:URLString] != nil) {
+        [self removeURLString:URLString];
+    }
+    
+    // A thumbnail that's bigger than the whole cache is just not worth keeping.
+    
+    if ([data length] <= self->_byteLimit) {
+        [self->_dataByURLString setObject:data forKey:URLString];
+        [self->_URLStrings addObject:URLString];
+        self->_byteCount += [data length];
+        [[MemoryBudget sharedBudget] adjustBytes:(long long) [data length] forSubsystem:kMemoryBudgetSubsystemThumbnailCache];
+        [self trimToByteLimit];
+    }
+}
+
+- (void)removeThumbnailDataForURL:(NSURL *)url
+{
+    NSString *  URLString;
+    
+    assert([NSThread isMainThread]);
+    assert(url != nil);
+    
+    URLString = [url absoluteString];
+    if ([self->_dataByURLString objectForKey:URLString] != nil) {
+        [self removeURLString:URLString];
+    }
+}
+
+- (void)removeAllThumbnailData
+{
+    assert([NSThread isMainThread]);
+    
+    [[MemoryBudget sharedBudget] adjustBytes:- (long long) self->_byteCount forSubsystem:kMemoryBudgetSubsystemThumbnailCache];
+    [self->_dataByURLString removeAllObjects];
+    [self->_URLStrings removeAllObjects];
+    self->_byteCount = 0;
+}
+
+// Called on the main thread when the memory budget wants caches evicted.  Everything in 
+// the cache can be fetched again, so we throw the lot away.
+- (void)evictCaches:(NSNotification *)note
+{
+    #pragma unused(note)
+    assert([NSThread isMainThread]);
+    
+    [[QLog log] logWithFormat:@"%s evicted %zu thumbnails, %zu bytes", __PRETTY_FUNCTION__, (size_t) [self->_URLStrings count], (size_t) self->_byteCount];
+    [self removeAllThumbnailData];
+}
+
+@end
@@ -0,0 +1,46 @@
+#import <Foundation/Foundation.h>
+#import <CoreGraphics/CoreGraphics.h>
+
+// ThumbnailResampler makes square thumbnails by area averaging.  Each output pixel is the
+// average of the source pixels it covers (with fractional weights at the edges), which is
+// the right filter for large reductions like a photo to a thumbnail; it doesn't alias the
+// way point sampling does, and it doesn't blur the way a bilinear filter applied in one
+// step does.
+//
+// As with MakeThumbnailOperation, the thumbnail is the centred square of the source, scaled
+// to fill it.  The source is decoded (by Core Graphics) into a scratch bitmap, and then the
+// kernel reduces that straight into the 32-bit BGRA thumbnail.  The kernel works on whole
+// pixels (four channels at a time) using SSE2 or NEON where available, and plain C otherwise.
+//
+// The scratch bitmap, the kernel's row buffers and the output bitmap are kept from one
+// thumbnail to the next, which is why MakeThumbnailBatchOperation uses one resampler for
+// its whole batch.  The scratch bitmap is counted against the memory budget (as
+// kMemoryBudgetSubsystemThumbnailDecodes) for as long as the resampler holds it.
+//
+// 面积平均缩小算法, 重用缓冲区, 用 SSE2/NEON 每次处理一个像素的四个通道.
+//
+// A resampler can only be used by one thread at a time.
+
+@interface ThumbnailResampler : NSObject
+{
+    size_t              _thumbnailSize;
+    CGColorSpaceRef     _colorSpace;
+    void *              _sourceBuffer;
+    size_t              _sourceBufferSize;
+    void *              _spans;                 // thumbnailSize ThumbnailResamplerSpan
+    float *             _rowSums;               // thumbnailSize x 4 floats
+    float *             _rowAccumulators;       // thumbnailSize x 4 floats
+    uint8_t *           _outputBuffer;          // thumbnailSize x thumbnailSize x 4 bytes
+}
+
+- (id)initWithThumbnailSize:(size_t)thumbnailSize;
+
+@property (assign, readonly ) size_t    thumbnailSize;
+
+// Returns a thumbnailSize x thumbnailSize thumbnail of image, which the caller must release,
+// or NULL if that's not possible.  In particular, this returns NULL for an image whose
+// shorter side is less than thumbnailSize, because the kernel only reduces; the client
+// should fall back to Core Graphics in that case.
+- (CGImageRef)createThumbnailFromImage:(CGImageRef)image;
+
+@end
@@ -0,0 +1,492 @@
+#import "ThumbnailResampler.h"
+#import "MemoryBudget.h"
+
+#include <math.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    #include <arm_neon.h>
+#elif defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
+// How each thumbnail column (and, in the same way, each thumbnail row) maps to the source.
+// The source pixels [start, start + count) contribute to it, the first with weight
+// firstWeight, the last with weight lastWeight and the rest with weight 1.  If count is
+// 1, only firstWeight applies.
+
+struct ThumbnailResamplerSpan {
+    uint32_t    start;
+    uint32_t    count;
+    float       firstWeight;
+    float       lastWeight;
+};
+typedef struct ThumbnailResamplerSpan ThumbnailResamplerSpan;
+
+#pragma mark * Pixel vectors
+
+// A pixel vector holds the four channels of one BGRA pixel as floats.  The kernel is
+// written in terms of the functions below, which map to SSE2 or NEON intrinsics where
+// we have them.  Pixel pointers are always 4 byte aligned (the scratch bitmap rows are
+// a multiple of 4 bytes) and float pointers are always 16 byte aligned (they come from
+// malloc).
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+
+typedef float32x4_t PixelVector;
+
+static inline PixelVector PixelVectorZero(void)
+{
+    return vdupq_n_f32(0.0f);
+}
+
+static inline PixelVector PixelVectorLoadBytes(const uint8_t * pixel)
+{
+    uint8x8_t   bytes;
+
+    bytes = vreinterpret_u8_u32( vld1_dup_u32( (const uint32_t *) pixel ) );
+    return vcvtq_f32_u32( vmovl_u16( vget_low_u16( vmovl_u8(bytes) ) ) );
+}
+
+static inline void PixelVectorStoreBytes(uint8_t * pixel, PixelVector v)
+{
+    uint16x4_t  halves;
+    uint8x8_t   bytes;
+
+    // Values are in [0, 255], so the saturating narrows never kick in; they're only
+    // there to get the lanes into place.  Adding 0.5 before the (truncating)
+    // conversion rounds to nearest.
+
+    halves = vqmovn_u32( vcvtq_u32_f32( vaddq_f32(v, vdupq_n_f32(0.5f)) ) );
+    bytes  = vqmovn_u16( vcombine_u16(halves, halves) );
+    vst1_lane_u32( (uint32_t *) pixel, vreinterpret_u32_u8(bytes), 0);
+}
+
+static inline PixelVector PixelVectorLoad(const float * f)
+{
+    return vld1q_f32(f);
+}
+
+static inline void PixelVectorStore(float * f, PixelVector v)
+{
+    vst1q_f32(f, v);
+}
+
+static inline PixelVector PixelVectorAdd(PixelVector a, PixelVector b)
+{
+    return vaddq_f32(a, b);
+}
+
+static inline PixelVector PixelVectorAddScaled(PixelVector a, PixelVector b, float weight)
+    // returns a + b * weight
+{
+    return vmlaq_n_f32(a, b, weight);
+}
+
+static inline PixelVector PixelVectorScale(PixelVector a, float weight)
+{
+    return vmulq_n_f32(a, weight);
+}
+
+#elif defined(__SSE2__)
+
+typedef __m128 PixelVector;
+
+static inline PixelVector PixelVectorZero(void)
+{
+    return _mm_setzero_ps();
+}
+
+static inline PixelVector PixelVectorLoadBytes(const uint8_t * pixel)
+{
+    __m128i     zero;
+    __m128i     v;
+
+    zero = _mm_setzero_si128();
+    v = _mm_cvtsi32_si128( * (const int32_t *) pixel );
+    v = _mm_unpacklo_epi8(v, zero);
+    v = _mm_unpacklo_epi16(v, zero);
+    return _mm_cvtepi32_ps(v);
+}
+
+static inline void PixelVectorStoreBytes(uint8_t * pixel, PixelVector v)
+{
+    __m128i     i;
+
+    // _mm_cvtps_epi32 rounds to nearest (in the default rounding mode) and the packs
+    // saturate, so this is safe even if rounding error takes a value just past 255.
+
+    i = _mm_cvtps_epi32(v);
+    i = _mm_packs_epi32(i, i);
+    i = _mm_packus_epi16(i, i);
+    * (int32_t *) pixel = _mm_cvtsi128_si32(i);
+}
+
+static inline PixelVector PixelVectorLoad(const float * f)
+{
+    return _mm_load_ps(f);
+}
+
+static inline void PixelVectorStore(float * f, PixelVector v)
+{
+    _mm_store_ps(f, v);
+}
+
+static inline PixelVector PixelVectorAdd(PixelVector a, PixelVector b)
+{
+    return _mm_add_ps(a, b);
+}
+
+static inline PixelVector PixelVectorAddScaled(PixelVector a, PixelVector b, float weight)
+{
+    return _mm_add_ps(a, _mm_mul_ps(b, _mm_set1_ps(weight)));
+}
+
+static inline PixelVector PixelVectorScale(PixelVector a, float weight)
+{
+    return _mm_mul_ps(a, _mm_set1_ps(weight));
+}
+
+#else
+
+struct PixelVector {
+    float   c[4];
+};
+typedef struct PixelVector PixelVector;
+
+static inline PixelVector PixelVectorZero(void)
+{
+    PixelVector     result = { { 0.0f, 0.0f, 0.0f, 0.0f } };
+    return result;
+}
+
+static inline PixelVector PixelVectorLoadBytes(const uint8_t * pixel)
+{
+    PixelVector     result;
+    int             i;
+
+    for (i = 0; i < 4; i++) {
+        result.c[i] = pixel[i];
+    }
+    return result;
+}
+
+static inline void PixelVectorStoreBytes(uint8_t * pixel, PixelVector v)
+{
+    int             i;
+    float           f;
+
+    for (i = 0; i < 4; i++) {
+        f = v.c[i] + 0.5f;
+        pixel[i] = (f >= 255.0f) ? 255 : (uint8_t) f;
+    }
+}
+
+static inline PixelVector PixelVectorLoad(const float * f)
+{
+    PixelVector     result;
+
+    memcpy(result.c, f, sizeof(result.c));
+    return result;
+}
+
+static inline void PixelVectorStore(float * f, PixelVector v)
+{
+    memcpy(f, v.c, sizeof(v.c));
+}
+
+static inline PixelVector PixelVectorAdd(PixelVector a, PixelVector b)
+{
+    int             i;
+
+    for (i = 0; i < 4; i++) {
+        a.c[i] += b.c[i];
+    }
+    return a;
+}
+
+static inline PixelVector PixelVectorAddScaled(PixelVector a, PixelVector b, float weight)
+{
+    int             i;
+
+    for (i = 0; i < 4; i++) {
+        a.c[i] += b.c[i] * weight;
+    }
+    return a;
+}
+
+static inline PixelVector PixelVectorScale(PixelVector a, float weight)
+{
+    int             i;
+
+    for (i = 0; i < 4; i++) {
+        a.c[i] *= weight;
+    }
+    return a;
+}
+
+#endif
+
+#pragma mark * Kernel
+
+static void ComputeSpans(ThumbnailResamplerSpan * spans, size_t thumbnailSize, size_t sourceSize)
+    // Fills in spans (thumbnailSize of them) for reducing sourceSize pixels to thumbnailSize.
+{
+    double      scale;
+    size_t      i;
+    double      lo;
+    double      hi;
+    size_t      first;
+    size_t      last;
+
+    assert(sourceSize >= thumbnailSize);
+    scale = (double) sourceSize / (double) thumbnailSize;
+    for (i = 0; i < thumbnailSize; i++) {
+        lo = (double) i * scale;
+        hi = (i + 1 == thumbnailSize) ? (double) sourceSize : (double) (i + 1) * scale;
+        first = (size_t) floor(lo);
+        last  = (size_t) ceil(hi) - 1;
+        if (last >= sourceSize) {
+            last = sourceSize - 1;
+        }
+        if (last < first) {
+            last = first;
+        }
+        spans[i].start = (uint32_t) first;
+        spans[i].count = (uint32_t) (last - first + 1);
+        if (first == last) {
+            spans[i].firstWeight = (float) (hi - lo);
+            spans[i].lastWeight  = spans[i].firstWeight;
+        } else {
+            spans[i].firstWeight = (float) ((double) (first + 1) - lo);
+            spans[i].lastWeight  = (float) (hi - (double) last);
+        }
+    }
+}
+
+static void ReduceRow(float * rowSums, const uint8_t * row, const ThumbnailResamplerSpan * spans, size_t thumbnailSize)
+    // Reduces one source row horizontally, leaving the weighted sum for each thumbnail
+    // column in rowSums.
+{
+    size_t          i;
+    uint32_t        k;
+    const uint8_t * pixel;
+    PixelVector     sum;
+
+    for (i = 0; i < thumbnailSize; i++) {
+        pixel = row + (spans[i].start * 4);
+        sum = PixelVectorScale(PixelVectorLoadBytes(pixel), spans[i].firstWeight);
+        if (spans[i].count > 1) {
+            for (k = 1; k < spans[i].count - 1; k++) {
+                sum = PixelVectorAdd(sum, PixelVectorLoadBytes(pixel + (k * 4)));
+            }
+            sum = PixelVectorAddScaled(sum, PixelVectorLoadBytes(pixel + (k * 4)), spans[i].lastWeight);
+        }
+        PixelVectorStore(&rowSums[i * 4], sum);
+    }
+}
+
+static void AccumulateRow(float * rowAccumulators, const float * rowSums, float weight, size_t thumbnailSize)
+{
+    size_t          i;
+
+    for (i = 0; i < thumbnailSize; i++) {
+        PixelVectorStore(
+            &rowAccumulators[i * 4],
+            PixelVectorAddScaled(PixelVectorLoad(&rowAccumulators[i * 4]), PixelVectorLoad(&rowSums[i * 4]), weight)
+        );
+    }
+}
+
+static void EmitRow(uint8_t * outputRow, float * rowAccumulators, float normalise, size_t thumbnailSize)
+    // Writes the accumulated thumbnail row to outputRow and zeroes the accumulators
+    // for the next one.
+{
+    size_t          i;
+
+    for (i = 0; i < thumbnailSize; i++) {
+        PixelVectorStoreBytes(outputRow + (i * 4), PixelVectorScale(PixelVectorLoad(&rowAccumulators[i * 4]), normalise));
+        PixelVectorStore(&rowAccumulators[i * 4], PixelVectorZero());
+    }
+}
+
+#pragma mark * ThumbnailResampler
+
+@implementation ThumbnailResampler
+
+@synthesize thumbnailSize = _thumbnailSize;
+
+- (id)initWithThumbnailSize:(size_t)thumbnailSize
+{
+    assert(thumbnailSize != 0);
+    self = [super init];
+    if (self != nil) {
+        self->_thumbnailSize = thumbnailSize;
+
+        self->_colorSpace = CGColorSpaceCreateDeviceRGB();
+        assert(self->_colorSpace != NULL);
+
+        self->_spans           = malloc(thumbnailSize * sizeof(ThumbnailResamplerSpan));
+        self->_rowSums         = malloc(thumbnailSize * 4 * sizeof(float));
+        self->_rowAccumulators = calloc(thumbnailSize * 4, sizeof(float));
+        self->_outputBuffer    = malloc(thumbnailSize * thumbnailSize * 4);
+        if ( (self->_spans == NULL) || (self->_rowSums == NULL) || (self->_rowAccumulators == NULL) || (self->_outputBuffer == NULL) ) {
+            [self release];
+            self = nil;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    if (self->_sourceBuffer != NULL) {
+        free(self->_sourceBuffer);
+        [[MemoryBudget sharedBudget] adjustBytes:- (long long) self->_sourceBufferSize forSubsystem:kMemoryBudgetSubsystemThumbnailDecodes];
+    }
+    free(self->_spans);
+    free(self->_rowSums);
+    free(self->_rowAccumulators);
+    free(self->_outputBuffer);
+    CGColorSpaceRelease(self->_colorSpace);
+    [super dealloc];
+}
+
+- (BOOL)ensureSourceBufferSize:(size_t)size
+    // Grows the scratch bitmap to at least size bytes.  It never shrinks; a batch
+    // is a handful of photos from the same gallery, which are typically all the same size.
+{
+    void *      newBuffer;
+
+    if (size > self->_sourceBufferSize) {
+        newBuffer = malloc(size);
+        if (newBuffer == NULL) {
+            return NO;
+        }
+        if (self->_sourceBuffer != NULL) {
+            free(self->_sourceBuffer);
+        }
+        [[MemoryBudget sharedBudget] adjustBytes:(long long) size - (long long) self->_sourceBufferSize forSubsystem:kMemoryBudgetSubsystemThumbnailDecodes];
+        self->_sourceBuffer     = newBuffer;
+        self->_sourceBufferSize = size;
+    }
+    return YES;
+}
+
+- (BOOL)decodeImage:(CGImageRef)image side:(size_t)side
+    // Decodes the centred side x side square of image into the scratch bitmap.
+{
+    static const CGFloat kBlack[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+    CGContextRef    context;
+    CGColorRef      black;
+    CGRect          r;
+
+    if ( ! [self ensureSourceBufferSize:side * side * 4] ) {
+        return NO;
+    }
+
+    context = CGBitmapContextCreate(self->_sourceBuffer, side, side, 8, side * 4, self->_colorSpace, kCGBitmapByteOrder32Little | kCGImageAlphaPremultipliedFirst);
+    if (context == NULL) {
+        return NO;
+    }
+
+    // Cover any transparency in black, just like MakeThumbnailOperation.
+
+    black = CGColorCreate(self->_colorSpace, kBlack);
+    assert(black != NULL);
+    CGContextSetFillColorWithColor(context, black);
+    CGContextFillRect(context, CGRectMake(0.0f, 0.0f, side, side));
+    CGColorRelease(black);
+
+    // Draw the image at its natural size, offset by a whole number of pixels so that
+    // Core Graphics doesn't resample it; the context clips it to the centred square.
+
+    r = CGRectZero;
+    r.size.width  = CGImageGetWidth(image);
+    r.size.height = CGImageGetHeight(image);
+    r.origin.x = - (CGFloat) ((CGImageGetWidth(image)  - side) / 2);
+    r.origin.y = - (CGFloat) ((CGImageGetHeight(image) - side) / 2);
+    CGContextSetInterpolationQuality(context, kCGInterpolationNone);
+    CGContextDrawImage(context, r, image);
+
+    CGContextRelease(context);
+    return YES;
+}
+
+- (void)reduceSourceWithSide:(size_t)side
+    // Runs the kernel over the scratch bitmap, leaving the thumbnail in the output buffer.
+{
+    size_t                          thumbnailSize;
+    const ThumbnailResamplerSpan *  spans;
+    double                          scale;
+    float                           normalise;
+    size_t                          sourceRow;
+    size_t                          thumbnailRow;
+    double                          thumbnailRowEnd;
+    double                          sourceRowStart;
+    double                          overlap;
+
+    thumbnailSize = self->_thumbnailSize;
+    spans = (const ThumbnailResamplerSpan *) self->_spans;
+
+    // The same spans work for the rows as the columns because the source is square.
+    // Horizontally we use the spans directly; vertically we walk the source rows,
+    // reducing each one horizontally and adding it into the current thumbnail row
+    // weighted by how much of it falls in that row.  A source row that straddles two
+    // thumbnail rows is split between them.
+
+    ComputeSpans(self->_spans, thumbnailSize, side);
+    scale = (double) side / (double) thumbnailSize;
+    normalise = (float) (1.0 / (scale * scale));
+
+    thumbnailRow = 0;
+    thumbnailRowEnd = scale;
+    for (sourceRow = 0; sourceRow < side; sourceRow++) {
+        ReduceRow(self->_rowSums, ((const uint8_t *) self->_sourceBuffer) + (sourceRow * side * 4), spans, thumbnailSize);
+
+        sourceRowStart = (double) sourceRow;
+        while ( (thumbnailRow < thumbnailSize) && ((double) (sourceRow + 1) >= thumbnailRowEnd) ) {
+            // This source row finishes the current thumbnail row.
+
+            overlap = thumbnailRowEnd - sourceRowStart;
+            AccumulateRow(self->_rowAccumulators, self->_rowSums, (float) overlap, thumbnailSize);
+            EmitRow(self->_outputBuffer + (thumbnailRow * thumbnailSize * 4), self->_rowAccumulators, normalise, thumbnailSize);
+
+            sourceRowStart = thumbnailRowEnd;
+            thumbnailRow += 1;
+            thumbnailRowEnd = (thumbnailRow + 1 == thumbnailSize) ? (double) side : (double) (thumbnailRow + 1) * scale;
+        }
+        overlap = (double) (sourceRow + 1) - sourceRowStart;
+        if ( (thumbnailRow < thumbnailSize) && (overlap > 0.0) ) {
+            AccumulateRow(self->_rowAccumulators, self->_rowSums, (float) overlap, thumbnailSize);
+        }
+    }
+    assert(thumbnailRow == thumbnailSize);
+}
+
+- (CGImageRef)createThumbnailFromImage:(CGImageRef)image
+{
+    CGImageRef      result;
+    size_t          side;
+    CGContextRef    context;
+
+    assert(image != NULL);
+
+    result = NULL;
+
+    side = MIN(CGImageGetWidth(image), CGImageGetHeight(image));
+    if ( (side >= self->_thumbnailSize) && [self decodeImage:image side:side] ) {
+        [self reduceSourceWithSide:side];
+
+        // CGBitmapContextCreateImage copies the pixels (well, copy-on-write), so the
+        // output buffer is free for the next thumbnail.
+
+        context = CGBitmapContextCreate(self->_outputBuffer, self->_thumbnailSize, self->_thumbnailSize, 8, self->_thumbnailSize * 4, self->_colorSpace, kCGBitmapByteOrder32Little | kCGImageAlphaPremultipliedFirst);
+        if (context != NULL) {
+            result = CGBitmapContextCreateImage(context);
+            CGContextRelease(context);
+        }
+    }
+    return result;
+}
+
+@end
@@ -0,0 +1,46 @@
+#import <Foundation/Foundation.h>
+
+// GalleryParseBenchmarkOperation measures how GalleryParserOperation's chunked parse scales 
+// with parseConcurrency.  It builds a synthetic gallery document holding photoCount photos, 
+// parses it serially, and then with each parseConcurrency from 2 to maximumConcurrency, 
+// checking that every chunked parse produces exactly the serial results, and logs the 
+// times and speed ups.
+//
+// The document is laid out like a real index, but it's also salted with the markup that 
+// a careless split would trip over: comments and CDATA sections containing "<photo" and 
+// "</photo>", and attribute values containing ">".  A chunked parse that split inside any 
+// of those would lose or mangle photos, and show up as a mismatch.
+//
+// AppDelegate runs this in the debug build if the galleryParseBenchmarkPhotos user default 
+// is set (for example, "-galleryParseBenchmarkPhotos 500000" as a launch argument).  The 
+// galleryParseBenchmarkConcurrency user default overrides the maximum concurrency, which 
+// is otherwise 4.
+//
+// 分块并行解析的扩展性测试: 串行与 2..N 路并行解析的时间对比, 并检查结果一致.
+
+@interface GalleryParseBenchmarkOperation : NSOperation
+{
+    NSUInteger          _photoCount;
+    NSUInteger          _maximumConcurrency;
+    NSError *           _error;
+    NSUInteger          _documentLength;
+    NSTimeInterval      _buildTime;
+    NSArray *           _parseTimes;
+}
+
+// Configures the operation to parse a document of photoCount photos with each 
+// parseConcurrency from 1 to maximumConcurrency.
+- (id)initWithPhotoCount:(NSUInteger)photoCount maximumConcurrency:(NSUInteger)maximumConcurrency;
+
+// properties specified at init time
+@property (assign, readonly ) NSUInteger            photoCount;
+@property (assign, readonly ) NSUInteger            maximumConcurrency;
+
+// properties that are valid after the operation is finished
+@property (copy,   readonly ) NSError *             error;          // set if a parse failed, or a chunked parse didn't match the serial one
+
+@property (assign, readonly ) NSUInteger            documentLength; // bytes
+@property (assign, readonly ) NSTimeInterval        buildTime;
+@property (copy,   readonly ) NSArray *             parseTimes;     // of NSNumber (NSTimeInterval), index is parseConcurrency - 1
+
+@end
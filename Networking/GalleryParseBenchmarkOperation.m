@@ -0,0 +1,200 @@
+#import "GalleryParseBenchmarkOperation.h"
+#import "GalleryParserOperation.h"
+#import "Logging.h"
+
+// Every kTrapInterval'th photo is preceded by a comment, and has a comment element holding 
+// a CDATA section, each with photo tags in them, so that there are plenty of false matches 
+// for a naive split to find, whatever the concurrency.
+
+static const NSUInteger kTrapInterval       = 7;
+static const NSUInteger kImageCount         = 10000;
+
+// Appends a printf style string to data.
+static void AppendFormat(NSMutableData * data, const char * format, ...)
+{
+    char        buffer[1024];
+    va_list     args;
+    int         length;
+
+    va_start(args, format);
+    length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    assert( (length > 0) && ((size_t) length < sizeof(buffer)) );
+    [data appendBytes:buffer length:(NSUInteger) length];
+}
+
+@interface GalleryParseBenchmarkOperation ()
+
+// read/write versions of public properties
+@property (copy,   readwrite) NSError *     error;
+@property (copy,   readwrite) NSArray *     parseTimes;
+
+@end
+
+@implementation GalleryParseBenchmarkOperation
+
+- (id)initWithPhotoCount:(NSUInteger)photoCount maximumConcurrency:(NSUInteger)maximumConcurrency
+    // See comment in header.
+{
+    assert(photoCount != 0);
+    assert(maximumConcurrency >= 2);
+    self = [super init];
+    if (self != nil) {
+        self->_photoCount = photoCount;
+        self->_maximumConcurrency = maximumConcurrency;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self->_error release];
+    [self->_parseTimes release];
+    [super dealloc];
+}
+
+@synthesize photoCount         = _photoCount;
+@synthesize maximumConcurrency = _maximumConcurrency;
+@synthesize error              = _error;
+@synthesize documentLength     = _documentLength;
+@synthesize buildTime          = _buildTime;
+@synthesize parseTimes         = _parseTimes;
+
+// Returns the synthetic gallery document.
+- (NSData *)document
+{
+    NSMutableData *     result;
+    NSUInteger          index;
+    unsigned int        imageNumber;
+
+    // About 600 bytes per photo, which is what the real indexes average.
+
+    result = [NSMutableData dataWithCapacity:self.photoCount * 640 + 1024];
+    assert(result != nil);
+
+    AppendFormat(result, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    AppendFormat(result, "<!DOCTYPE album [ <!ENTITY trap \"&lt;photo id='0'&gt;\"> ]>\n");
+    AppendFormat(result, "<album QPhotoXMLVersion=\"1.0b4\" name=\"Parse Benchmark\" date=\"2010-08-16T13:12:36Z\" author=\"&lt;photo&gt; > everything\">\n");
+    AppendFormat(result, "  <albumComment><p>A synthetic gallery of %zu photos.</p></albumComment>\n", (size_t) self.photoCount);
+    for (index = 0; index < self.photoCount; index++) {
+        imageNumber = (unsigned int) (index % kImageCount);
+        if ( (index % kTrapInterval) == 0 ) {
+            AppendFormat(result, "  <!-- <photo name=\"commented out\" date=\"2010-08-16T13:12:36Z\" id=\"c%zu\"> </photo> -->\n", (size_t) index);
+        }
+        AppendFormat(result, "  <photo name=\"Photo %zu > %zu\" date=\"2010-08-16T%02u:%02u:%02uZ\" id=\"%zu\">\n",
+            (size_t) index,
+            (size_t) index / 2,
+            (unsigned int) (index / 3600) % 24,
+            (unsigned int) (index / 60) % 60,
+            (unsigned int) index % 60,
+            (size_t) index
+        );
+        if ( (index % kTrapInterval) == 0 ) {
+            AppendFormat(result, "    <comment><p><![CDATA[</photo><photo name=\"in CDATA\" date=\"2010-08-16T13:12:36Z\" id=\"d%zu\">]]></p></comment>\n", (size_t) index);
+        }
+        AppendFormat(result, "    <image kind=\"original\" srcURL=\"originals/IMG_%04u.JPG\" size=\"%u\" type=\"image\"></image>\n", imageNumber, 1000000 + imageNumber);
+        AppendFormat(result, "    <image kind=\"image\" srcURL=\"images/IMG_%04u.jpg\" size=\"%u\" type=\"image\" width=\"1024\" height=\"768\"></image>\n", imageNumber, 200000 + imageNumber);
+        AppendFormat(result, "    <image kind=\"thumbnail\" srcURL=\"thumbnails/IMG_%04u.jpg\" size=\"%u\" type=\"image\" width=\"300\" height=\"225\"></image>\n", imageNumber, 15000 + imageNumber);
+        AppendFormat(result, "  </photo>\n");
+    }
+    AppendFormat(result, "  <!-- </photo> -->\n");
+    AppendFormat(result, "</album>\n");
+    return result;
+}
+
+// Parses data with the specified concurrency, on this thread, and returns the operation, 
+// with the time taken in *parseTimePtr.
+- (GalleryParserOperation *)parseData:(NSData *)data concurrency:(NSUInteger)concurrency parseTime:(NSTimeInterval *)parseTimePtr
+{
+    GalleryParserOperation *    result;
+    CFAbsoluteTime              startTime;
+
+    result = [[[GalleryParserOperation alloc] initWithData:data] autorelease];
+    assert(result != nil);
+    result.parseConcurrency = concurrency;
+
+    startTime = CFAbsoluteTimeGetCurrent();
+    [result start];
+    *parseTimePtr = CFAbsoluteTimeGetCurrent() - startTime;
+
+    return result;
+}
+
+- (void)main
+{
+    NSError *                   error;
+    NSData *                    data;
+    CFAbsoluteTime              startTime;
+    NSMutableArray *            parseTimes;
+    GalleryParserOperation *    serialOp;
+    NSTimeInterval              serialTime;
+    NSUInteger                  concurrency;
+
+    error = nil;
+    parseTimes = [NSMutableArray array];
+    assert(parseTimes != nil);
+
+    startTime = CFAbsoluteTimeGetCurrent();
+    data = [self document];
+    self->_buildTime = CFAbsoluteTimeGetCurrent() - startTime;
+    self->_documentLength = [data length];
+
+    // The serial parse is the reference; it has to find every photo, and none of the 
+    // ones in comments or CDATA sections.
+
+    serialOp = [self parseData:data concurrency:1 parseTime:&serialTime];
+    [parseTimes addObject:[NSNumber numberWithDouble:serialTime]];
+    if (serialOp.error != nil) {
+        error = serialOp.error;
+    } else if ([serialOp.results count] != self.photoCount) {
+        error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadCorruptFileError userInfo:nil];
+    }
+    [[QLog log] logWithFormat:@"%s %zu photos, %zu KB, built in %.1f s, serial parse %.3f s",
+        __PRETTY_FUNCTION__,
+        (size_t) self.photoCount,
+        (size_t) (self.documentLength / 1024),
+        self.buildTime,
+        serialTime
+    ];
+
+    for (concurrency = 2; (error == nil) && (concurrency <= self.maximumConcurrency) && ! [self isCancelled]; concurrency++) {
+        NSAutoreleasePool *         pool;
+        GalleryParserOperation *    op;
+        NSTimeInterval              parseTime;
+        BOOL                        matches;
+
+        pool = [[NSAutoreleasePool alloc] init];
+        assert(pool != nil);
+
+        op = [self parseData:data concurrency:concurrency parseTime:&parseTime];
+        [parseTimes addObject:[NSNumber numberWithDouble:parseTime]];
+        // A chunked parse that failed would fall back to a serial one, and match, so we 
+        // also check that it really did parse in chunks.
+        
+        matches = (op.error == nil) && (op.parsedChunkCount > 1) && [op.results isEqual:serialOp.results];
+        [[QLog log] logWithFormat:@"%s %zu photos, concurrency %zu, %zu chunks, parse %.3f s, %.2fx, %s",
+            __PRETTY_FUNCTION__,
+            (size_t) self.photoCount,
+            (size_t) concurrency,
+            (size_t) op.parsedChunkCount,
+            parseTime,
+            serialTime / parseTime,
+            matches ? "results match" : "RESULTS DIFFER"
+        ];
+        if ( ! matches ) {
+            error = op.error;
+            if (error == nil) {
+                error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadCorruptFileError userInfo:nil];
+            }
+            [error retain];
+        }
+
+        [pool drain];
+        [error autorelease];
+    }
+
+    self.parseTimes = parseTimes;
+    self.error = error;
+}
+
+@end
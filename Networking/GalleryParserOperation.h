@@ -6,6 +6,17 @@ extern NSString * kGalleryParserResultName;         // NSString
 extern NSString * kGalleryParserResultDate;         // NSDate
 extern NSString * kGalleryParserResultPhotoPath;    // NSString
 extern NSString * kGalleryParserResultThumbnailPath;// NSString
+extern NSString * kGalleryParserResultVariants;     // NSArray of NSDictionary, keys below, in document order
+
+// Keys for the variant dictionaries.  There's one variant per "image" element that has a 
+// srcURL, including the "image" and "thumbnail" kinds that also appear above.  The width, 
+// height and size keys are only present if the XML specified them.
+
+extern NSString * kGalleryParserVariantKind;        // NSString, for example, "original", "image", "thumbnail"
+extern NSString * kGalleryParserVariantPath;        // NSString
+extern NSString * kGalleryParserVariantWidth;       // NSNumber, pixels
+extern NSString * kGalleryParserVariantHeight;      // NSNumber, pixels
+extern NSString * kGalleryParserVariantSize;        // NSNumber, bytes
 
 
 @interface GalleryParserOperation : NSOperation
@@ -16,9 +27,18 @@ extern NSString * kGalleryParserResultThumbnailPath;// NSString
     NSTimeInterval          _debugDelay;
     NSTimeInterval          _debugDelaySoFar;
 #endif
+    NSUInteger              _parseConcurrency;
+    NSUInteger              _parsedChunkCount;
+    NSArray *               _chunkOperations;
     NSXMLParser *           _parser;
     NSMutableArray *        _mutableResults;
     NSMutableDictionary *   _itemProperties;
+    NSMutableArray *        _itemVariants;
+    BOOL                    _itemRemoved;
+    NSString *              _changeToken;
+    NSString *              _deltaFrom;
+    NSString *              _thumbnailBatchPath;
+    NSMutableArray *        _mutableRemovedPhotoIDs;
 }
 
 // Configures the operation to parse the specified XML data.
@@ -29,6 +49,16 @@ extern NSString * kGalleryParserResultThumbnailPath;// NSString
 @property (copy,   readonly ) NSData *              data;
 
 // properties that can be changed before starting the operation
+
+// If parseConcurrency is greater than 1, the operation splits the XML at <photo> 
+// element boundaries into that many chunks, parses the chunks concurrently, and 
+// merges the results back in document order.  The results are exactly what a serial 
+// parse would produce (including any duplicate photo IDs, which are left for the 
+// client to deal with).  If any chunk fails to parse, the operation falls back to 
+// a serial parse of the whole document so that the error reported is the same as 
+// it would be in serial mode.
+@property (assign, readwrite) NSUInteger            parseConcurrency;   // default is 1
+
 #if ! defined(NDEBUG)
 @property (assign, readwrite) NSTimeInterval        debugDelay;     // default is 0.0
 #endif
@@ -38,6 +68,23 @@ extern NSString * kGalleryParserResultThumbnailPath;// NSString
 // properties that are valid after the operation is finished
 @property (copy,   readonly ) NSError *             error;
 @property (copy,   readonly ) NSArray *             results;       // of NSDictionary, keys below
+@property (assign, readonly ) NSUInteger            parsedChunkCount;   // 0 if the document was parsed serially
+
+// Delta sync support (see PhotoGallery).  The root element of a gallery document may carry 
+// a changeToken attribute, which the client can send back to get just the changes since 
+// that version.  The reply to that is a delta document, whose root element has a deltaFrom 
+// attribute naming the version it applies to.  In a delta, results holds the photos that 
+// were added or changed, and each photo that was removed is reported by a 
+// <photo id="..." removed="yes"/> element.
+@property (copy,   readonly ) NSString *            changeToken;        // nil if the document doesn't have one
+@property (copy,   readonly ) NSString *            deltaFrom;          // nil if the document is a full index
+@property (copy,   readonly ) NSArray *             removedPhotoIDs;    // of NSString, in document order
+
+// Batched thumbnail support (see PhotoGalleryContext).  The root element may also carry a 
+// thumbnailBatchURL attribute, a path relative to the gallery, which the client can GET 
+// with an "ids" query parameter (a comma separated list of photo IDs) to get the thumbnails 
+// of all of those photos in one multipart/mixed response.
+@property (copy,   readonly ) NSString *            thumbnailBatchPath; // nil if the gallery doesn't support it
 
 @end
 
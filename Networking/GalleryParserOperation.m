@@ -1,12 +1,21 @@
 #import "GalleryParserOperation.h"
 #import "Logging.h"
+#import "QTrace.h"
 #include <xlocale.h>                                    // for strptime_l
+#include <string.h>                                     // for memmem
 
 NSString * kGalleryParserResultPhotoID       = @"photoID";
 NSString * kGalleryParserResultName          = @"name";
 NSString * kGalleryParserResultDate          = @"date";
 NSString * kGalleryParserResultPhotoPath     = @"photoPath";
 NSString * kGalleryParserResultThumbnailPath = @"thumbnailPath";
+NSString * kGalleryParserResultVariants      = @"variants";
+
+NSString * kGalleryParserVariantKind         = @"kind";
+NSString * kGalleryParserVariantPath         = @"path";
+NSString * kGalleryParserVariantWidth        = @"width";
+NSString * kGalleryParserVariantHeight       = @"height";
+NSString * kGalleryParserVariantSize         = @"size";
 
 /*
     o 本类继承自 NSOperation,  通过重写 main 方法 来定义自己的 NSOperation.
@@ -24,9 +33,15 @@ NSString * kGalleryParserResultThumbnailPath = @"thumbnailPath";
 @property (assign, readwrite) NSTimeInterval            debugDelaySoFar;
 #endif
 
+@property (copy,   readwrite) NSArray *                 chunkOperations;
 @property (retain, readonly ) NSMutableArray *          mutableResults;
 @property (retain, readwrite) NSXMLParser *             parser;
 @property (retain, readonly ) NSMutableDictionary *     itemProperties;
+@property (retain, readonly ) NSMutableArray *          itemVariants;
+@property (copy,   readwrite) NSString *                changeToken;
+@property (copy,   readwrite) NSString *                deltaFrom;
+@property (copy,   readwrite) NSString *                thumbnailBatchPath;
+@property (retain, readonly ) NSMutableArray *          mutableRemovedPhotoIDs;
 
 @end
 
@@ -39,12 +54,19 @@ NSString * kGalleryParserResultThumbnailPath = @"thumbnailPath";
     self = [super init];
     if (self != nil) {
         self->_data = [data copy];  //copy 一份数据
+        self->_parseConcurrency = 1;
         
         self->_mutableResults  = [[NSMutableArray alloc] init];
         assert(self->_mutableResults != nil);
         
         self->_itemProperties = [[NSMutableDictionary alloc] init];
         assert(self->_itemProperties != nil);
+        
+        self->_itemVariants = [[NSMutableArray alloc] init];
+        assert(self->_itemVariants != nil);
+        
+        self->_mutableRemovedPhotoIDs = [[NSMutableArray alloc] init];
+        assert(self->_mutableRemovedPhotoIDs != nil);
     }
     return self;
 }
@@ -53,9 +75,15 @@ NSString * kGalleryParserResultThumbnailPath = @"thumbnailPath";
 {
     [self->_data release];
     [self->_error release];
+    [self->_chunkOperations release];
     [self->_parser release];
     [self->_mutableResults release];
     [self->_itemProperties release];
+    [self->_itemVariants release];
+    [self->_changeToken release];
+    [self->_deltaFrom release];
+    [self->_thumbnailBatchPath release];
+    [self->_mutableRemovedPhotoIDs release];
     [super dealloc];
 }
 
@@ -66,11 +94,37 @@ NSString * kGalleryParserResultThumbnailPath = @"thumbnailPath";
 
 @synthesize data            = _data; //初始化对象是,传入的 data 参数的一份 copy
 @synthesize error           = _error;
+@synthesize parseConcurrency = _parseConcurrency;
+@synthesize parsedChunkCount = _parsedChunkCount;
+
+@synthesize chunkOperations = _chunkOperations; //并行模式下,每个 chunk 对应的子 GalleryParserOperation, 按文档顺序排列
 
 @synthesize mutableResults  = _mutableResults;  //NSMutableArray, 用来保存最后的结果集合
 @synthesize parser          = _parser;          //NSXMLParser 对象,用来执行 parse 动作
 @synthesize itemProperties  = _itemProperties;  //NSMutableDictionary 对象,一个临时存储变量,用来存储 xml 里的一个 photo element 的属性
+@synthesize itemVariants    = _itemVariants;    //NSMutableArray 对象,一个临时存储变量,用来存储 xml 里的一个 photo element 的所有 image 元素
+@synthesize changeToken     = _changeToken;     //根元素的 changeToken 属性
+@synthesize deltaFrom       = _deltaFrom;       //根元素的 deltaFrom 属性, 只有增量文档才有
+@synthesize thumbnailBatchPath = _thumbnailBatchPath; //根元素的 thumbnailBatchURL 属性, 批量获取 thumbnail 用
+@synthesize mutableRemovedPhotoIDs = _mutableRemovedPhotoIDs;   //增量文档里被删除的 photo ID
+
 
+// Returns the numeric value of an attribute, or nil if the attribute is missing or isn't 
+// a positive number.
++ (NSNumber *)numberFromAttributeString:(NSString *)string
+{
+    NSNumber *  result;
+    long long   value;
+    
+    result = nil;
+    if (string != nil) {
+        value = [string longLongValue];
+        if (value > 0) {
+            result = [NSNumber numberWithLongLong:value];
+        }
+    }
+    return result;
+}
 
 // Parses the supplied XML date string and returns an NSDate object.
 // We avoid NSDateFormatter here and do the work using the much lighter weight strptime_l.
@@ -98,8 +152,337 @@ NSString * kGalleryParserResultThumbnailPath = @"thumbnailPath";
     return [[self->_mutableResults copy] autorelease];
 }
 
-#pragma mark - 入列后开始执行的函数
-- (void)main
+- (NSArray *)removedPhotoIDs
+{
+    return [[self->_mutableRemovedPhotoIDs copy] autorelease];
+}
+
+#pragma mark - Parallel parse support
+
+// Returns YES if the C string prefix occurs at offset.
+static BOOL HasPrefixAtOffset(const char * bytes, NSUInteger length, NSUInteger offset, const char * prefix)
+{
+    size_t  prefixLength;
+    
+    prefixLength = strlen(prefix);
+    return (offset + prefixLength <= length) && (memcmp(bytes + offset, prefix, prefixLength) == 0);
+}
+
+// Returns YES if the tag at [start, end) begins with name (which includes the "<" or "</") 
+// followed by a delimiter.  We check the character after the element name so that we 
+// don't match elements like "<photos>".
+static BOOL TagHasName(const char * bytes, NSUInteger start, NSUInteger end, const char * name)
+{
+    size_t  nameLength;
+    
+    nameLength = strlen(name);
+    return (start + nameLength < end) 
+        && (memcmp(bytes + start, name, nameLength) == 0) 
+        && (memchr(" \t\r\n/>", bytes[start + nameLength], 6) != NULL);
+}
+
+// Returns the offset of the next element tag (start, end or empty element tag) at or after 
+// offset, which must not be inside any markup, and sets *endPtr to the offset just past the 
+// tag's ">".  Returns NSNotFound if there are no more complete tags.
+//
+// A raw search for "<photo" can match inside a comment, a CDATA section or a processing 
+// instruction, so we step over those, and over declarations like DOCTYPE (including any 
+// bracketed internal subset).  Within a tag we step over quoted attribute values, which 
+// can contain ">".  Character data can't contain a raw "<", so every "<" outside those 
+// is the start of a tag.
+static NSUInteger OffsetOfNextTag(const char * bytes, NSUInteger length, NSUInteger offset, NSUInteger * endPtr)
+{
+    const char *    cursor;
+    NSUInteger      start;
+    BOOL            isDeclaration;
+    char            quote;
+    NSUInteger      bracketDepth;
+    char            ch;
+    
+    while (offset < length) {
+        cursor = memchr(bytes + offset, '<', length - offset);
+        if (cursor == NULL) {
+            break;
+        }
+        start = (NSUInteger) (cursor - bytes);
+        
+        if ( HasPrefixAtOffset(bytes, length, start, "<!--") ) {
+            cursor = memmem(bytes + start + 4, length - start - 4, "-->", 3);
+            if (cursor == NULL) {
+                break;
+            }
+            offset = (NSUInteger) (cursor - bytes) + 3;
+        } else if ( HasPrefixAtOffset(bytes, length, start, "<![CDATA[") ) {
+            cursor = memmem(bytes + start + 9, length - start - 9, "]]>", 3);
+            if (cursor == NULL) {
+                break;
+            }
+            offset = (NSUInteger) (cursor - bytes) + 3;
+        } else if ( HasPrefixAtOffset(bytes, length, start, "<?") ) {
+            cursor = memmem(bytes + start + 2, length - start - 2, "?>", 2);
+            if (cursor == NULL) {
+                break;
+            }
+            offset = (NSUInteger) (cursor - bytes) + 2;
+        } else {
+            isDeclaration = HasPrefixAtOffset(bytes, length, start, "<!");
+            quote         = 0;
+            bracketDepth  = 0;
+            for (offset = start + 1; offset < length; offset++) {
+                ch = bytes[offset];
+                if (quote != 0) {
+                    if (ch == quote) {
+                        quote = 0;
+                    }
+                } else if ( (ch == '"') || (ch == '\'') ) {
+                    quote = ch;
+                } else if ( isDeclaration && (ch == '[') ) {
+                    bracketDepth += 1;
+                } else if ( isDeclaration && (ch == ']') && (bracketDepth != 0) ) {
+                    bracketDepth -= 1;
+                } else if ( (ch == '>') && (bracketDepth == 0) ) {
+                    break;
+                }
+            }
+            if (offset >= length) {
+                break;
+            }
+            offset += 1;
+            if ( ! isDeclaration ) {
+                *endPtr = offset;
+                return start;
+            }
+        }
+    }
+    return NSNotFound;
+}
+
+// Splits the XML data into at most maximumCount chunks, each containing a run of 
+// whole "photo" elements of roughly equal size.  Each chunk is wrapped in a copy of 
+// the document's root element (or a synthetic one if we can't find it), so that each 
+// chunk sees the root's attributes, and preceded by the document's XML declaration 
+// (if any, so that the encoding is preserved), which makes it a well-formed document 
+// in its own right.  Returns nil if the data isn't worth splitting.
+//
+// We find the root, the split points and the end of the last photo in one forward 
+// pass over the tags, so we only ever split at a real "<photo" start tag, never at 
+// one that's inside a comment, CDATA section or attribute value.
++ (NSArray *)chunksFromData:(NSData *)data maximumCount:(NSUInteger)maximumCount
+{
+    NSMutableArray *    result;
+    const char *        bytes;
+    NSUInteger          length;
+    NSUInteger          prologueLength;
+    NSUInteger          firstOffset;
+    NSUInteger          lastOffset;
+    NSUInteger          lastStartOffset;
+    NSUInteger          targetLength;
+    NSUInteger          nextSplit;
+    NSMutableIndexSet * splitOffsets;
+    NSUInteger          offset;
+    NSUInteger          tagStart;
+    NSUInteger          tagEnd;
+    BOOL                sawFirstElement;
+    NSUInteger          chunkStart;
+    NSUInteger          chunkEnd;
+    const char *        cursor;
+    NSMutableData *     chunk;
+    NSRange             rootRange;
+    NSUInteger          rootNameLength;
+    NSData *            rootStartTag;
+    NSMutableData *     rootEndTag;
+    
+    assert(data != nil);
+    assert(maximumCount > 1);
+    
+    bytes  = [data bytes];
+    length = [data length];
+    
+    // The prologue is the XML declaration, if any.
+    
+    prologueLength = 0;
+    if ( (length > 5) && (memcmp(bytes, "<?xml", 5) == 0) ) {
+        cursor = memmem(bytes, length, "?>", 2);
+        if (cursor != NULL) {
+            prologueLength = (NSUInteger) (cursor - bytes) + 2;
+        }
+    }
+    
+    // Walk the tags.  The first element is the root, unless it's a photo or an empty 
+    // element.  We aim for chunks of targetLength bytes, measured from the first photo to 
+    // the end of the data, which is near enough the end of the last photo.
+    
+    firstOffset     = NSNotFound;
+    lastOffset      = NSNotFound;
+    lastStartOffset = NSNotFound;
+    targetLength    = 0;
+    nextSplit       = NSNotFound;
+    splitOffsets    = [NSMutableIndexSet indexSet];
+    assert(splitOffsets != nil);
+    sawFirstElement = NO;
+    rootRange       = NSMakeRange(NSNotFound, 0);
+    rootNameLength  = 0;
+    
+    offset = prologueLength;
+    while (YES) {
+        tagStart = OffsetOfNextTag(bytes, length, offset, &tagEnd);
+        if (tagStart == NSNotFound) {
+            break;
+        }
+        offset = tagEnd;
+        
+        if ( TagHasName(bytes, tagStart, tagEnd, "<photo") ) {
+            lastStartOffset = tagStart;
+            if (firstOffset == NSNotFound) {
+                firstOffset  = tagStart;
+                targetLength = (length - firstOffset) / maximumCount;
+                if (targetLength == 0) {
+                    targetLength = 1;
+                }
+                nextSplit = firstOffset + targetLength;
+            } else if ( (tagStart >= nextSplit) && ([splitOffsets count] < (maximumCount - 1)) ) {
+                [splitOffsets addIndex:tagStart];
+                nextSplit = tagStart + targetLength;
+            }
+        } else if ( TagHasName(bytes, tagStart, tagEnd, "</photo") ) {
+            lastOffset = tagEnd;
+        } else if ( ! sawFirstElement && (bytes[tagStart + 1] != '/') && (bytes[tagEnd - 2] != '/') ) {
+            while ( (tagStart + 1 + rootNameLength < tagEnd) && (memchr(" \t\r\n/>", bytes[tagStart + 1 + rootNameLength], 6) == NULL) ) {
+                rootNameLength += 1;
+            }
+            if (rootNameLength != 0) {
+                rootRange = NSMakeRange(tagStart, tagEnd - tagStart);
+            }
+        }
+        sawFirstElement = YES;
+    }
+    if ( (firstOffset == NSNotFound) || (lastOffset == NSNotFound) || (lastOffset <= firstOffset) ) {
+        return nil;
+    }
+    
+    // A photo that starts after the last end tag is never closed.  Rather than quietly 
+    // drop it, leave the whole document to the serial parse, which reports the error.
+    
+    if (lastStartOffset > lastOffset) {
+        return nil;
+    }
+    [splitOffsets addIndex:lastOffset];
+    
+    // The root element's start tag, and a matching end tag.
+    
+    if (rootRange.location == NSNotFound) {
+        rootStartTag = [NSData dataWithBytes:"<chunk>" length:7];
+        rootEndTag   = [NSMutableData dataWithBytes:"</chunk>" length:8];
+    } else {
+        rootStartTag = [data subdataWithRange:rootRange];
+        rootEndTag   = [NSMutableData dataWithBytes:"</" length:2];
+        [rootEndTag appendBytes:bytes + rootRange.location + 1 length:rootNameLength];
+        [rootEndTag appendBytes:">" length:1];
+    }
+    assert(rootStartTag != nil);
+    assert(rootEndTag != nil);
+
+    result = [NSMutableArray array];
+    assert(result != nil);
+    
+    chunkStart = firstOffset;
+    for (chunkEnd = [splitOffsets firstIndex]; chunkEnd != NSNotFound; chunkEnd = [splitOffsets indexGreaterThanIndex:chunkEnd]) {
+        assert(chunkEnd > chunkStart);
+        
+        chunk = [NSMutableData dataWithCapacity:prologueLength + [rootStartTag length] + (chunkEnd - chunkStart) + [rootEndTag length]];
+        assert(chunk != nil);
+        
+        [chunk appendBytes:bytes length:prologueLength];
+        [chunk appendData:rootStartTag];
+        [chunk appendBytes:bytes + chunkStart length:chunkEnd - chunkStart];
+        [chunk appendData:rootEndTag];
+        [result addObject:chunk];
+        
+        chunkStart = chunkEnd;
+    }
+    
+    return result;
+}
+
+- (void)cancel
+    // Override to propagate the cancellation to any chunk operations.
+{
+    [super cancel];
+    for (NSOperation * op in self.chunkOperations) {
+        [op cancel];
+    }
+}
+
+// Parses the chunks concurrently and merges their results in document order. 
+// Returns YES if the outcome is final (that is, the parse succeeded or was 
+// cancelled), or NO if a chunk failed and the caller should fall back to a serial 
+// parse, which gives the same error as if we'd never split the document.
+//
+// Note that the chunk operations run on a private queue rather than queueForCPU. 
+// We block waiting for them, and doing that while holding one of the slots of a 
+// queue whose width defaults to the number of cores could deadlock.
+- (BOOL)parseChunks:(NSArray *)chunks
+{
+    BOOL                        result;
+    NSOperationQueue *          queue;
+    NSMutableArray *            operations;
+    GalleryParserOperation *    op;
+    
+    assert([chunks count] > 1);
+    
+    operations = [NSMutableArray arrayWithCapacity:[chunks count]];
+    assert(operations != nil);
+    for (NSData * chunk in chunks) {
+        op = [[[GalleryParserOperation alloc] initWithData:chunk] autorelease];
+        assert(op != nil);
+        
+        [op setThreadPriority:[self threadPriority]];
+        [operations addObject:op];
+    }
+    self.chunkOperations = operations;
+    
+    // If we were cancelled before the chunk operations were visible to -cancel, 
+    // there's no point starting them.
+    
+    if ( [self isCancelled] ) {
+        self.error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSUserCancelledError userInfo:nil];
+        return YES;
+    }
+    
+    queue = [[[NSOperationQueue alloc] init] autorelease];
+    assert(queue != nil);
+    
+    [queue setMaxConcurrentOperationCount:[operations count]];
+    [queue addOperations:operations waitUntilFinished:YES];
+    
+    // Merge the results in document order.
+    
+    result = YES;
+    for (op in operations) {
+        if ( [self isCancelled] ) {
+            self.error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSUserCancelledError userInfo:nil];
+            break;
+        } else if (op.error != nil) {
+            [[QLog log] logOption:kLogOptionXMLParseDetails withFormat:@"xml parse chunk failed %@, falling back to serial parse", op.error];
+            [self.mutableResults removeAllObjects];
+            [self.mutableRemovedPhotoIDs removeAllObjects];
+            result = NO;
+            break;
+        }
+        [self.mutableResults addObjectsFromArray:op.results];
+        [self.mutableRemovedPhotoIDs addObjectsFromArray:op.removedPhotoIDs];
+        if (op == [operations objectAtIndex:0]) {
+            self.changeToken = op.changeToken;
+            self.deltaFrom   = op.deltaFrom;
+            self.thumbnailBatchPath = op.thumbnailBatchPath;
+        }
+    }
+    self.chunkOperations = nil;
+    
+    return result;
+}
+
+- (void)parseSerially
 {
     BOOL        success;
     
@@ -114,8 +497,6 @@ NSString * kGalleryParserResultThumbnailPath = @"thumbnailPath";
     
     // Do the parse.
     
-    [[QLog log] logOption:kLogOptionXMLParseDetails withFormat:@"xml parse start"];
-    
     success = [self.parser parse];
     if ( ! success ) { //如果分析 xml 动作没有成功执行
         
@@ -128,7 +509,39 @@ NSString * kGalleryParserResultThumbnailPath = @"thumbnailPath";
         }
     }
     
+    self.parser = nil;  //parser动作已经完成了,(可能失败),删除它.
+}
+
+#pragma mark - 入列后开始执行的函数
+- (void)main
+{
+    NSDate *    startDate;
+    NSArray *   chunks;
+    BOOL        done;
+    uint64_t    traceStartTime;
+    
+    traceStartTime = QTraceIsRecording() ? QTraceNow() : 0;
+    [[QLog log] logOption:kLogOptionXMLParseDetails withFormat:@"xml parse start"];
     
+    startDate = [NSDate date];
+    
+    // In parallel mode, split the data at photo element boundaries and parse the 
+    // chunks concurrently.  If that's not possible, or not final, do a serial parse.
+    
+    chunks = nil;
+    done   = NO;
+    if (self.parseConcurrency > 1) {
+        chunks = [[self class] chunksFromData:self.data maximumCount:self.parseConcurrency];
+        if ([chunks count] > 1) {
+            done = [self parseChunks:chunks];
+        }
+    }
+    if ( ! done ) {
+        chunks = nil;
+        [self parseSerially];
+    } else {
+        self->_parsedChunkCount = [chunks count];
+    }
     
     // In the debug version, if we've been told to delay, do so.  This gives
     // us time to test the cancellation path.
@@ -152,12 +565,20 @@ NSString * kGalleryParserResultThumbnailPath = @"thumbnailPath";
 #endif
     
     if (self.error == nil) {
-        [[QLog log] logOption:kLogOptionXMLParseDetails withFormat:@"xml parse success"];
+        [[QLog log] logOption:kLogOptionXMLParseDetails withFormat:@"xml parse success, %zu photos (%zu removed) from %zu bytes in %.3f s using %zu chunks", 
+            (size_t) [self.mutableResults count], 
+            (size_t) [self.mutableRemovedPhotoIDs count], 
+            (size_t) [self.data length], 
+            -[startDate timeIntervalSinceNow], 
+            (size_t) ( (chunks == nil) ? 1 : [chunks count] )
+        ];
     } else {
         [[QLog log] logOption:kLogOptionXMLParseDetails withFormat:@"xml parse failed %@", self.error];
     }
-    
-    self.parser = nil;  //parser动作已经完成了,(可能失败),删除它.
+
+    if ( (traceStartTime != 0) && QTraceIsRecording() ) {
+        [[QTrace trace] recordSpanNamed:"GalleryParserOperation" object:self startTime:traceStartTime];
+    }
 }
 
 /*
@@ -206,6 +627,12 @@ NSString * kGalleryParserResultThumbnailPath = @"thumbnailPath";
         self.error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSUserCancelledError userInfo:nil];
         [self.parser abortParsing];
         
+    } else if ( [elementName isEqual:@"album"] ) {  //根元素, 记录增量同步用的属性
+        
+        self.changeToken = [attributeDict objectForKey:@"changeToken"];
+        self.deltaFrom   = [attributeDict objectForKey:@"deltaFrom"];
+        self.thumbnailBatchPath = [attributeDict objectForKey:@"thumbnailBatchURL"];
+        
     } else if ( [elementName isEqual:@"photo"] ) {  //遇到的 element 是一个 photo 元素
         NSString *  tmpStr;
         NSString *  photoID;
@@ -215,6 +642,8 @@ NSString * kGalleryParserResultThumbnailPath = @"thumbnailPath";
         // We're at the start of a "photo" element.  Set up the itemProperties dictionary.
 
         [self.itemProperties removeAllObjects]; //删除上个 Photo 元素里的 item 数据
+        [self.itemVariants removeAllObjects];
+        self->_itemRemoved = NO;
         
         photoID = nil;
         name = nil;
@@ -224,6 +653,20 @@ NSString * kGalleryParserResultThumbnailPath = @"thumbnailPath";
         name    = [attributeDict objectForKey:@"name"];
         tmpStr  = [attributeDict objectForKey:@"date"];
 
+        // In a delta, a removed photo has nothing but its ID.
+        
+        if ( [[attributeDict objectForKey:@"removed"] isEqual:@"yes"] ) {
+            self->_itemRemoved = YES;
+            if ( (photoID == nil) || ([photoID length] == 0) ) {
+                [[QLog log] logOption:kLogOptionXMLParseDetails withFormat:@"xml parse photo removal skipped, missing 'id'"];
+            } else {
+                [[QLog log] logOption:kLogOptionXMLParseDetails withFormat:@"xml parse photo removed %@", photoID];
+                [self.mutableRemovedPhotoIDs addObject:photoID];
+            }
+            tmpStr = nil;
+            photoID = nil;
+        }
+
         if (tmpStr != nil) {
             date = [[self class] dateFromDateString:tmpStr];
             if (date == nil) {
@@ -231,7 +674,9 @@ NSString * kGalleryParserResultThumbnailPath = @"thumbnailPath";
             }
         }
 
-        if ( (photoID == nil) || ([photoID length] == 0) ) {
+        if (self->_itemRemoved) {
+            // already dealt with
+        } else if ( (photoID == nil) || ([photoID length] == 0) ) {
             [[QLog log] logOption:kLogOptionXMLParseDetails withFormat:@"xml parse photo skipped, missing 'id'"];
         } else if ( (name == nil) || ([name length] == 0) ) {
             [[QLog log] logOption:kLogOptionXMLParseDetails withFormat:@"xml parse photo skipped, missing 'name'"];
@@ -260,6 +705,30 @@ NSString * kGalleryParserResultThumbnailPath = @"thumbnailPath";
             srcURLStr = [attributeDict objectForKey:@"srcURL"];
             
             if ( (srcURLStr != nil) && ([srcURLStr length] != 0) ) {
+                NSMutableDictionary *   variant;
+                NSNumber *              number;
+                
+                // Record every variant, so that Photo can choose which one to download.
+                
+                variant = [NSMutableDictionary dictionaryWithObject:srcURLStr forKey:kGalleryParserVariantPath];
+                assert(variant != nil);
+                if (kindStr != nil) {
+                    [variant setObject:kindStr forKey:kGalleryParserVariantKind];
+                }
+                number = [[self class] numberFromAttributeString:[attributeDict objectForKey:@"width"]];
+                if (number != nil) {
+                    [variant setObject:number forKey:kGalleryParserVariantWidth];
+                }
+                number = [[self class] numberFromAttributeString:[attributeDict objectForKey:@"height"]];
+                if (number != nil) {
+                    [variant setObject:number forKey:kGalleryParserVariantHeight];
+                }
+                number = [[self class] numberFromAttributeString:[attributeDict objectForKey:@"size"]];
+                if (number != nil) {
+                    [variant setObject:number forKey:kGalleryParserVariantSize];
+                }
+                [self.itemVariants addObject:[[variant copy] autorelease]];
+                
                 if ( [kindStr isEqual:@"image"] ) {
                     [[QLog log] logOption:kLogOptionXMLParseDetails withFormat:@"xml parse photo image '%@'", srcURLStr];
                     [self.itemProperties setObject:srcURLStr forKey:kGalleryParserResultPhotoPath];
@@ -293,7 +762,9 @@ NSString * kGalleryParserResultThumbnailPath = @"thumbnailPath";
     // properties and, if so, add an item to the result.
     
     if ( [elementName isEqual:@"photo"] ) {  // 一个 photo 元素已经分析完了.
-        if ([self.itemProperties count] == 0) { //一个有用的属性都没有?那就是遇到错误了
+        if (self->_itemRemoved) {
+            self->_itemRemoved = NO;
+        } else if ([self.itemProperties count] == 0) { //一个有用的属性都没有?那就是遇到错误了
             [[QLog log] logOption:kLogOptionXMLParseDetails withFormat:@"xml parse photo skipped, out of context"];
         } else {
             if ([self.itemProperties objectForKey:kGalleryParserResultPhotoPath] == nil) {
@@ -307,8 +778,10 @@ NSString * kGalleryParserResultThumbnailPath = @"thumbnailPath";
                 assert([[self.itemProperties objectForKey:kGalleryParserResultPhotoPath    ] isKindOfClass:[NSString class]]);
                 assert([[self.itemProperties objectForKey:kGalleryParserResultThumbnailPath] isKindOfClass:[NSString class]]);
                 [[QLog log] logOption:kLogOptionXMLParseDetails withFormat:@"xml parse photo success %@", [self.itemProperties objectForKey:kGalleryParserResultPhotoID]];
+                [self.itemProperties setObject:[[self.itemVariants copy] autorelease] forKey:kGalleryParserResultVariants];
                 [self.mutableResults addObject:[[self.itemProperties copy] autorelease]]; // 添加到结果集合
                 [self.itemProperties removeAllObjects]; //清空这个 photo 元素的所有属性
+                [self.itemVariants removeAllObjects];
             }
         }
     }
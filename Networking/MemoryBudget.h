@@ -0,0 +1,99 @@
+#import <Foundation/Foundation.h>
+
+// MemoryBudget is a process-wide accountant for the big, discretionary memory users in
+// the app: decoded thumbnails, in-memory HTTP response bodies, full size decodes done
+// to make thumbnails, and so on.  Each subsystem reports its usage as it goes up and
+// down (-adjustBytes:forSubsystem:), and the budget compares the total against a soft
+// and a hard limit.
+//
+// As the total climbs from the soft limit towards the hard limit, the budget moves
+// through a series of stages, each of which sheds another kind of load.  The stages
+// are cumulative, that is, when we're at kMemoryBudgetStageThrottleCPU we're also
+// evicting caches and not prefetching.
+//
+// o kMemoryBudgetStageEvictCaches -- reached at the soft limit; anyone holding a cache
+//   of decoded images that it can recreate should drop it.  The budget posts
+//   kMemoryBudgetEvictCachesNotification when entering this stage (or any higher one),
+//   and also when the system sends a memory warning.
+//
+// o kMemoryBudgetStagePausePrefetch -- a third of the way from the soft to the hard
+//   limit; PhotoPrefetcher stops starting new prefetches.
+//
+// o kMemoryBudgetStageThrottleCPU -- two thirds of the way; NetworkManager runs the
+//   CPU queue one operation at a time, which limits the number of full size decodes
+//   in flight.
+//
+// o kMemoryBudgetStageDeferDownloads -- at the hard limit; NetworkManager holds on to
+//   new network transfers that would accumulate their response in memory, and only
+//   queues them once the stage drops.
+//
+// To stop the stage flapping when usage hovers around a threshold, the stage only drops
+// once usage has fallen a little (hysteresisBytes) below the threshold that raised it.
+//
+// Stage changes are logged, along with the per-subsystem breakdown, and announced by
+// kMemoryBudgetStageDidChangeNotification, which is always posted on the main thread.
+//
+// 全局的内存记账: 各个子系统报告各自的内存用量, 超过软限制后, 按照 "清除缓存 -> 暂停预取 ->
+// 降低 CPU 队列并发 -> 推迟新的内存下载" 的顺序逐级减负.
+//
+// All methods can be called from any thread.
+
+enum MemoryBudgetStage {
+    kMemoryBudgetStageNormal = 0,
+    kMemoryBudgetStageEvictCaches,
+    kMemoryBudgetStagePausePrefetch,
+    kMemoryBudgetStageThrottleCPU,
+    kMemoryBudgetStageDeferDownloads
+};
+typedef enum MemoryBudgetStage MemoryBudgetStage;
+
+// subsystem names, for -adjustBytes:forSubsystem:
+
+extern NSString * kMemoryBudgetSubsystemThumbnailImages;    // Photo's thumbnailImage
+extern NSString * kMemoryBudgetSubsystemPhotoImages;        // Photo's partial photo images
+extern NSString * kMemoryBudgetSubsystemResponseBuffers;    // QHTTPOperation's in-memory response bodies
+extern NSString * kMemoryBudgetSubsystemThumbnailDecodes;   // MakeThumbnailOperation's full size decodes
+extern NSString * kMemoryBudgetSubsystemTileCaches;         // QTiledImageView's tile caches
+extern NSString * kMemoryBudgetSubsystemThumbnailCache;     // ThumbnailCache's encoded thumbnails
+extern NSString * kMemoryBudgetSubsystemDecodedPhotos;      // DecodedPhotoCache's decoded photos
+
+extern NSString * kMemoryBudgetStageDidChangeNotification;  // object is the budget, posted on the main thread
+extern NSString * kMemoryBudgetEvictCachesNotification;     // object is the budget, posted on the main thread
+
+@interface MemoryBudget : NSObject
+{
+    NSMutableDictionary *   _bytesBySubsystem;
+    long long               _totalBytes;
+    long long               _peakBytes;
+    long long               _softLimit;
+    long long               _hardLimit;
+    long long               _hysteresisBytes;
+    MemoryBudgetStage       _stage;
+}
+
+// Returns the budget singleton.
++ (MemoryBudget *)sharedBudget;
+
+// configuration; changing a limit re-evaluates the stage immediately
+
+@property (assign, readwrite) long long             softLimit;          // default is 16 MB, less on older devices
+@property (assign, readwrite) long long             hardLimit;          // default is 32 MB, less on older devices
+@property (assign, readwrite) long long             hysteresisBytes;    // default is 512 KB
+
+// Records that the specified subsystem's usage has gone up (positive delta) or
+// down (negative delta).  A subsystem must give back everything it takes.
+- (void)adjustBytes:(long long)delta forSubsystem:(NSString *)subsystem;
+
+// current state
+
+@property (assign, readonly ) MemoryBudgetStage     stage;
+@property (assign, readonly ) long long             totalBytes;
+@property (assign, readonly ) long long             peakBytes;
+
+- (long long)bytesForSubsystem:(NSString *)subsystem;
+- (NSDictionary *)usageBySubsystem;                                     // subsystem name -> NSNumber of bytes
+
+// A convenience for the common stage tests.
+- (BOOL)isAtLeastStage:(MemoryBudgetStage)stage;
+
+@end
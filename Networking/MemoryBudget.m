@@ -0,0 +1,280 @@
+#import "MemoryBudget.h"
+#import "Logging.h"
+
+#import <UIKit/UIKit.h>
+
+NSString * kMemoryBudgetSubsystemThumbnailImages  = @"thumbnailImages";
+NSString * kMemoryBudgetSubsystemPhotoImages      = @"photoImages";
+NSString * kMemoryBudgetSubsystemResponseBuffers  = @"responseBuffers";
+NSString * kMemoryBudgetSubsystemThumbnailDecodes = @"thumbnailDecodes";
+NSString * kMemoryBudgetSubsystemTileCaches       = @"tileCaches";
+NSString * kMemoryBudgetSubsystemThumbnailCache   = @"thumbnailCache";
+NSString * kMemoryBudgetSubsystemDecodedPhotos    = @"decodedPhotos";
+
+NSString * kMemoryBudgetStageDidChangeNotification = @"MemoryBudgetStageDidChange";
+NSString * kMemoryBudgetEvictCachesNotification    = @"MemoryBudgetEvictCaches";
+
+@interface MemoryBudget ()
+
+// read/write versions of public properties
+
+@property (assign, readwrite) MemoryBudgetStage     stage;
+
+// forward declarations
+
+- (void)updateStage;
+
+@end
+
+@implementation MemoryBudget
+
++ (MemoryBudget *)sharedBudget
+{
+    static MemoryBudget * sMemoryBudget;
+    // This can be called on any thread, so we synchronise.  As with +[NetworkManager sharedManager],
+    // once sMemoryBudget goes non-nil it never goes nil again.
+    if (sMemoryBudget == nil) {
+        @synchronized (self) {
+            if (sMemoryBudget == nil) {
+                sMemoryBudget = [[MemoryBudget alloc] init];
+                assert(sMemoryBudget != nil);
+            }
+        }
+    }
+    return sMemoryBudget;
+}
+
+- (id)init
+{
+    // any thread, but serialised by +sharedBudget
+    self = [super init];
+    if (self != nil) {
+        long long   reductionFactor;
+
+        self->_bytesBySubsystem = [[NSMutableDictionary alloc] init];
+        assert(self->_bytesBySubsystem != nil);
+
+        // Devices with 256 MB or less get half the budget.
+        reductionFactor = ([[NSProcessInfo processInfo] physicalMemory] <= 256ULL * 1024 * 1024) ? 2 : 1;
+
+        self->_softLimit       = 16LL * 1024 * 1024 / reductionFactor;
+        self->_hardLimit       = 32LL * 1024 * 1024 / reductionFactor;
+        self->_hysteresisBytes = 512LL * 1024;
+
+        // A memory warning from the system is as good a reason as any to evict our caches,
+        // whatever stage we think we're at.  UIKit posts it on the main thread, so we can
+        // just pass it along.
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(didReceiveMemoryWarning:) name:UIApplicationDidReceiveMemoryWarningNotification object:nil];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    // This object lives for the entire life of the application.  Getting it to support being
+    // deallocated would be quite tricky (particularly from a threading perspective), so we
+    // don't even try.
+    assert(NO);
+    [super dealloc];
+}
+
+@synthesize stage = _stage;
+
+- (long long)softLimit
+{
+    @synchronized (self) {
+        return self->_softLimit;
+    }
+}
+
+- (void)setSoftLimit:(long long)newValue
+{
+    assert(newValue > 0);
+    @synchronized (self) {
+        self->_softLimit = newValue;
+    }
+    [self updateStage];
+}
+
+- (long long)hardLimit
+{
+    @synchronized (self) {
+        return self->_hardLimit;
+    }
+}
+
+- (void)setHardLimit:(long long)newValue
+{
+    assert(newValue > 0);
+    @synchronized (self) {
+        self->_hardLimit = newValue;
+    }
+    [self updateStage];
+}
+
+- (long long)hysteresisBytes
+{
+    @synchronized (self) {
+        return self->_hysteresisBytes;
+    }
+}
+
+- (void)setHysteresisBytes:(long long)newValue
+{
+    assert(newValue >= 0);
+    @synchronized (self) {
+        self->_hysteresisBytes = newValue;
+    }
+    [self updateStage];
+}
+
+- (long long)totalBytes
+{
+    @synchronized (self) {
+        return self->_totalBytes;
+    }
+}
+
+- (long long)peakBytes
+{
+    @synchronized (self) {
+        return self->_peakBytes;
+    }
+}
+
+- (long long)bytesForSubsystem:(NSString *)subsystem
+{
+    assert(subsystem != nil);
+    @synchronized (self) {
+        return [[self->_bytesBySubsystem objectForKey:subsystem] longLongValue];
+    }
+}
+
+- (NSDictionary *)usageBySubsystem
+{
+    @synchronized (self) {
+        return [[self->_bytesBySubsystem copy] autorelease];
+    }
+}
+
+- (BOOL)isAtLeastStage:(MemoryBudgetStage)stage
+{
+    return self.stage >= stage;
+}
+
+- (void)adjustBytes:(long long)delta forSubsystem:(NSString *)subsystem
+{
+    long long   newBytes;
+
+    // any thread
+    assert(subsystem != nil);
+
+    if (delta != 0) {
+        @synchronized (self) {
+            newBytes = [[self->_bytesBySubsystem objectForKey:subsystem] longLongValue] + delta;
+            assert(newBytes >= 0);              // a subsystem has given back more than it took
+            [self->_bytesBySubsystem setObject:[NSNumber numberWithLongLong:newBytes] forKey:subsystem];
+
+            self->_totalBytes += delta;
+            if (self->_totalBytes > self->_peakBytes) {
+                self->_peakBytes = self->_totalBytes;
+            }
+        }
+        [self updateStage];
+    }
+}
+
+#pragma mark - Stages
+
+// Returns the stage for the specified usage, ignoring hysteresis.  Must be called
+// with the lock held.
+- (MemoryBudgetStage)stageForBytes:(long long)bytes
+{
+    long long           step;
+    MemoryBudgetStage   result;
+
+    // The three intermediate stages divide the gap between the limits evenly.  If someone
+    // has set the hard limit below the soft limit, we go straight from evicting to deferring.
+    step = (self->_hardLimit - self->_softLimit) / 3;
+    if (step < 0) {
+        step = 0;
+    }
+
+    if (bytes >= self->_hardLimit) {
+        result = kMemoryBudgetStageDeferDownloads;
+    } else if (bytes >= self->_softLimit + 2 * step) {
+        result = kMemoryBudgetStageThrottleCPU;
+    } else if (bytes >= self->_softLimit + step) {
+        result = kMemoryBudgetStagePausePrefetch;
+    } else if (bytes >= self->_softLimit) {
+        result = kMemoryBudgetStageEvictCaches;
+    } else {
+        result = kMemoryBudgetStageNormal;
+    }
+    return result;
+}
+
+// Recalculates the stage and, if it's changed, tells the main thread about it.
+- (void)updateStage
+{
+    MemoryBudgetStage   oldStage;
+    MemoryBudgetStage   newStage;
+    NSDictionary *      usage;
+    long long           total;
+
+    // any thread
+
+    usage = nil;
+    @synchronized (self) {
+        oldStage = self->_stage;
+        total    = self->_totalBytes;
+        newStage = [self stageForBytes:total];
+
+        // Only drop the stage once we're comfortably below the threshold that raised it;
+        // otherwise we'd flap each time a thumbnail comes and goes.
+        if (newStage < oldStage) {
+            newStage = [self stageForBytes:total + self->_hysteresisBytes];
+            if (newStage > oldStage) {
+                newStage = oldStage;
+            }
+        }
+
+        if (newStage != oldStage) {
+            self->_stage = newStage;
+            usage = [[self->_bytesBySubsystem copy] autorelease];
+        }
+    }
+
+    if (usage != nil) {
+        [[QLog log] logWithFormat:@"%s stage %d -> %d, total %lld bytes, %@", __PRETTY_FUNCTION__, (int) oldStage, (int) newStage, total, usage];
+
+        // Entering any stage beyond normal means evicting caches, so we do that before
+        // telling folks about the stage change.
+        if (newStage > oldStage) {
+            [self performSelectorOnMainThread:@selector(postEvictCachesNotification) withObject:nil waitUntilDone:NO];
+        }
+        [self performSelectorOnMainThread:@selector(postStageDidChangeNotification) withObject:nil waitUntilDone:NO];
+    }
+}
+
+- (void)postEvictCachesNotification
+{
+    assert([NSThread isMainThread]);
+    [[NSNotificationCenter defaultCenter] postNotificationName:kMemoryBudgetEvictCachesNotification object:self];
+}
+
+- (void)postStageDidChangeNotification
+{
+    assert([NSThread isMainThread]);
+    [[NSNotificationCenter defaultCenter] postNotificationName:kMemoryBudgetStageDidChangeNotification object:self];
+}
+
+- (void)didReceiveMemoryWarning:(NSNotification *)note
+{
+    #pragma unused(note)
+    assert([NSThread isMainThread]);
+    [[QLog log] logWithFormat:@"%s total %lld bytes, %@", __PRETTY_FUNCTION__, self.totalBytes, [self usageBySubsystem]];
+    [self postEvictCachesNotification];
+}
+
+@end
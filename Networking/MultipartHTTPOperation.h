@@ -0,0 +1,51 @@
+#import "QHTTPOperation.h"
+#import "QMultipartOutputStream.h"
+
+/*
+    MultipartHTTPOperation is a QHTTPOperation for requests whose response is a
+    multipart body (for example, multipart/mixed), where the client wants each part
+    as soon as it arrives rather than the whole body at the end.
+
+    When the response arrives, if it's acceptable and has a multipart content type, the
+    operation sets up a QMultipartOutputStream as its responseOutputStream, so the body
+    is parsed as it's received and never accumulated in memory.  Each part is queued
+    and the operation sends partAction to partTarget on the main thread to say that
+    there are parts waiting; the target then calls -takeParts to get them.
+
+    Parts that arrive just before the operation finishes may not have been announced
+    by the time its completion runs, so the completion should call -takeParts as well.
+    After that, -takeParts always returns an empty array.
+
+    The part target isn't retained; you must set partTarget to nil before it goes away.
+
+    Like a plain QHTTPOperation, this doesn't retry.  A failed transfer (or a response
+    that isn't multipart) just finishes with an error, and any parts that were parsed
+    before that are still available from -takeParts.
+
+    逐个交付 multipart 回应里的 part, 不用等整个回应下载完.
+*/
+
+// Keys for the part dictionaries returned by -takeParts.
+
+extern NSString * kMultipartHTTPOperationPartHeaders;  // NSDictionary, with lowercase header names
+extern NSString * kMultipartHTTPOperationPartBody;     // NSData
+
+@interface MultipartHTTPOperation : QHTTPOperation <QMultipartOutputStreamPartDelegate>
+{
+    id                  _partTarget;
+    SEL                 _partAction;
+    NSMutableArray *    _pendingParts;
+    NSUInteger          _partCount;
+}
+
+// Things you can configure before queuing the operation.
+@property (assign, readwrite) id                    partTarget;     // main thread only
+@property (assign, readwrite) SEL                   partAction;     // - (void)partsAvailable:(MultipartHTTPOperation *)operation
+
+// Returns, and forgets, the parts that have been parsed so far, in order.  Main thread only.
+- (NSArray *)takeParts;
+
+// The number of parts parsed so far.  Can be read from any thread.
+@property (assign, readonly ) NSUInteger            partCount;
+
+@end
@@ -0,0 +1,109 @@
+#import "MultipartHTTPOperation.h"
+
+NSString * kMultipartHTTPOperationPartHeaders = @"headers";
+NSString * kMultipartHTTPOperationPartBody    = @"body";
+
+@implementation MultipartHTTPOperation
+
+- (id)initWithRequest:(NSURLRequest *)request
+{
+    self = [super initWithRequest:request];
+    if (self != nil) {
+        self->_pendingParts = [[NSMutableArray alloc] init];
+        assert(self->_pendingParts != nil);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self->_pendingParts release];
+    [super dealloc];
+}
+
+@synthesize partTarget = _partTarget;
+@synthesize partAction = _partAction;
+
+- (NSUInteger)partCount
+{
+    NSUInteger  result;
+
+    @synchronized (self) {
+        result = self->_partCount;
+    }
+    return result;
+}
+
+- (NSArray *)takeParts
+{
+    NSArray *   result;
+
+    assert([NSThread isMainThread]);
+    @synchronized (self) {
+        result = [[self->_pendingParts copy] autorelease];
+        [self->_pendingParts removeAllObjects];
+    }
+    return result;
+}
+
+- (void)partsAvailableOnMainThread
+    // Tells the part target that there are parts waiting.  If the target took them
+    // earlier (say, in response to a previous one of these), there's nothing to tell.
+{
+    BOOL    available;
+
+    assert([NSThread isMainThread]);
+    @synchronized (self) {
+        available = ([self->_pendingParts count] != 0);
+    }
+    if ( available && (self.partTarget != nil) && ! [self isCancelled] ) {
+        [self.partTarget performSelector:self.partAction withObject:self];
+    }
+}
+
+#pragma mark - QHTTPOperation overrides
+
+- (void)connection:(NSURLConnection *)connection didReceiveResponse:(NSURLResponse *)response
+    // If the response is the multipart body we're after, set up a stream to parse it.
+    // Anything else goes to memory in the usual way, and fails the content type check
+    // (if the client set acceptableContentTypes) or leaves the client with no parts.
+{
+    NSString *  boundary;
+
+    [super connection:connection didReceiveResponse:response];
+
+    if ( self.isStatusCodeAcceptable ) {
+        boundary = [QMultipartOutputStream boundaryForContentType:[[self.lastResponse allHeaderFields] objectForKey:@"Content-Type"]];
+        if (boundary != nil) {
+            QMultipartOutputStream *    stream;
+
+            stream = [[[QMultipartOutputStream alloc] initWithBoundary:boundary] autorelease];
+            assert(stream != nil);
+            stream.partDelegate = self;
+            self.responseOutputStream = stream;
+        }
+    }
+}
+
+#pragma mark - QMultipartOutputStreamPartDelegate
+
+- (void)multipartOutputStream:(QMultipartOutputStream *)stream didReceivePartWithHeaders:(NSDictionary *)headers body:(NSData *)body
+    // Called on the run loop thread, from within the response stream's write.
+{
+    BOOL    wasEmpty;
+
+    assert(self.isActualRunLoopThread);
+    assert(stream == self.responseOutputStream);
+    #pragma unused(stream)
+
+    @synchronized (self) {
+        wasEmpty = ([self->_pendingParts count] == 0);
+        [self->_pendingParts addObject:[NSDictionary dictionaryWithObjectsAndKeys:headers, kMultipartHTTPOperationPartHeaders, body, kMultipartHTTPOperationPartBody, nil]];
+        self->_partCount += 1;
+    }
+    if (wasEmpty) {
+        [self performSelectorOnMainThread:@selector(partsAvailableOnMainThread) withObject:nil waitUntilDone:NO];
+    }
+}
+
+@end
@@ -1,5 +1,40 @@
 #import <Foundation/Foundation.h>
 
+// A NetworkOperationGroup tags a set of operations that belong together, for example all of 
+// the operations for one gallery, so that they can be cancelled in one go using 
+// -[NetworkManager cancelOperationGroup:].  See the comments in NetworkManager below.
+//
+// 一组 operation 的标签, 比如某个 gallery 的所有 operation, 这样就可以一次性全部取消.
+
+@interface NetworkOperationGroup : NSObject
+{
+    NSString *              _name;
+    NSMutableSet *          _operations;
+    BOOL                    _cancelled;
+    NSDate *                _cancelDate;
+    NSTimeInterval          _drainTime;
+    double                  _weight;
+}
+
+- (id)initWithName:(NSString *)name;
+
+@property (copy,   readonly ) NSString *            name;               // for logging only
+
+// These can be read from any thread.
+
+@property (assign, readonly ) NSUInteger            operationCount;     // operations added to the group that haven't finished yet
+@property (assign, readonly, getter=isCancelled) BOOL cancelled;
+@property (assign, readonly ) NSTimeInterval        drainTime;          // time from cancellation until the last operation finished, or -1.0 if not yet drained
+
+// The group's share of the network transfer and CPU queues, relative to the other groups; 
+// see "Fair sharing" below.  Default is 1.0.  Can be changed at any time, from any thread.
+
+@property (assign, readwrite) double                weight;
+
+@end
+
+@class NetworkFairQueue;
+
 @interface NetworkManager : NSObject
 {
     NSThread *                      _networkRunLoopThread;
@@ -9,7 +44,18 @@
     CFMutableDictionaryRef          _runningOperationToTargetMap;
     CFMutableDictionaryRef          _runningOperationToActionMap;
     CFMutableDictionaryRef          _runningOperationToThreadMap;
+    CFMutableDictionaryRef          _runningOperationToGroupMap;
     NSUInteger                      _runningNetworkTransferCount;
+    NSInteger                       _pendingNetworkTransferCountDelta;
+    CFMutableDictionaryRef          _pendingCompletionsByThread;
+    NSUInteger                      _completionCount;
+    NSUInteger                      _completionWakeupCount;
+    NSMutableDictionary *           _throughputByHost;
+    NSMutableArray *                _deferredTransferOperations;
+    NSMutableDictionary *           _prewarmDatesByHost;
+    NetworkFairQueue *              _fairQueueForNetworkTransfers;
+    NetworkFairQueue *              _fairQueueForCPU;
+    CFMutableDictionaryRef          _notReadyOperationToQueueMap;
 }
 
 // Returns the network manager singleton.
@@ -57,12 +103,19 @@
 //   getting any concurrency benefits.
 //
 // o When you queue an operation you must supply a target/action pair that is called when 
-//   the operation completes without being cancelled.
+//   the operation completes without being cancelled.  The exception is operations whose 
+//   result is picked up some other way, typically by an operation that depends on them; 
+//   for those you can pass nil for both target and action.
 //   
 //
 // o The target/action pair is called on the thread that added the operation to the queue.
 //   You have to ensure that this thread runs its run loop.
 //
+// o Completions for a thread are batched: they're queued up per thread and delivered by a 
+//   single run loop callback, which delivers as many as it can within a small time budget 
+//   and then yields to the run loop, so that a burst of completions doesn't stall scrolling.
+//   Completions are still delivered in the order that the operations finished.
+//
 // o If you queue a network operation and that network operation supports the runLoopThread 
 //   property and the value of that property is nil, this sets the run loop thread of the operation 
 //   to the above-mentioned internal networking thread.  This means that, by default, all 
@@ -73,6 +126,13 @@
 //   /not/ true for target/action completions.  These are called on the thread that queued 
 //   the operation, as described above.
 //
+// o The queues respond to memory pressure (see MemoryBudget).  When the budget reaches 
+//   kMemoryBudgetStageThrottleCPU, the CPU queue runs one operation at a time.  When it 
+//   reaches kMemoryBudgetStageDeferDownloads, a QHTTPOperation added to the network transfer 
+//   queue that would accumulate its response in memory (that is, one without a 
+//   responseOutputStream) is held back, and only queued once the stage drops.  Cancelling 
+//   a held back operation queues it immediately, so that it finishes in the usual way.
+//
 // o If you cancel an operation you must do so using -cancelOperation:, lest things get 
 //   very confused.
 //
@@ -87,9 +147,10 @@
 // o To simplify clean up, -cancelOperation: does nothing if the supplied operation is nil 
 //   or if it's not currently queued.
 //
-// We don't do any prioritisation of operations, although that would be a relatively 
-// simple extension.  For example, you could have one network transfer queue for gallery XML 
-// files and another for thumbnail downloads, and tweak their widths appropriately.  And 
+// Apart from sharing the queues fairly between groups (see "Fair sharing" below), we don't 
+// do any prioritisation of operations, although that would be a relatively simple extension. 
+// For example, you could have one network transfer queue for gallery XML files and another 
+// for thumbnail downloads, and tweak their widths appropriately.  And 
 // don't forget, within a queue, a client can affect the priority of an operation using 
 // -[NSOperation setThreadPriority:] and -[NSOperation setQueuePriority:].
 
@@ -98,4 +159,85 @@
 - (void)addCPUOperation:(NSOperation *)operation finishedTarget:(id)target action:(SEL)action;
 - (void)cancelOperation:(NSOperation *)operation;
 
+// Operation groups
+//
+// o The -addXxxOperation:finishedTarget:action:group: variants add the operation to the 
+//   specified group, which may be nil (the plain -addXxxOperation:finishedTarget:action: 
+//   methods pass nil).  An operation leaves its group when it finishes.
+//
+// o -cancelOperationGroup: cancels every queued and running operation in the group.  It 
+//   pulls all of their target/actions out of the maps while holding the lock once, so 
+//   none of their completions will be called, subject to the same threading caveat as 
+//   -cancelOperation:.  This is much cheaper than cancelling the operations one at a time 
+//   when the user switches gallery, say.
+//
+// o A cancelled group stays cancelled; any operation subsequently added to it is cancelled 
+//   immediately.  Create a new group if you need one.
+//
+// o Once the last operation in a cancelled group has finished, the group records how long 
+//   that took in its drainTime property, and logs it.
+//
+// o If an operation responds to -setOperationGroup: and its operationGroup is nil, it's set 
+//   to the group it was queued in, the same way as runLoopThread.  RetryingHTTPOperation uses 
+//   this to put its network transfers in the same group as itself.
+//
+// o Like the other methods, these can be called from any thread.
+
+// Fair sharing
+//
+// When several galleries sync at once, we don't want the one that happened to start first 
+// to hog the network transfer and CPU queues.  So operations that are in a group don't go 
+// straight onto those queues.  Rather, each group has its own first-in, first-out list of 
+// pending operations, and we only move an operation onto the queue when the queue has a 
+// free slot (that is, when fewer than maxConcurrentOperationCount of our grouped operations 
+// are on it).  We pick the group using stride scheduling: each group has a virtual time that 
+// advances by 1/weight every time one of its operations is admitted, and the group with the 
+// lowest virtual time goes next.  A group that's been idle joins at the current virtual time, 
+// so it can't bank credit while it has nothing to do.  The upshot is that, while they're all 
+// busy, each group gets a share of the slots proportional to its weight.
+//
+// o Operations that are not in a group are queued immediately, as before.
+//
+// o An operation is only admitted once it's ready (that is, once its dependencies have 
+//   finished), so an operation waiting on a download doesn't tie up a CPU slot.
+//
+// o Cancelling a pending operation queues it immediately, so that it finishes in the usual 
+//   way, just like an operation held back by the memory budget.
+//
+// o The network management queue is unbounded, so there's nothing to share there.
+
+
+- (void)addNetworkManagementOperation:(NSOperation *)operation finishedTarget:(id)target action:(SEL)action group:(NetworkOperationGroup *)group;
+- (void)addNetworkTransferOperation:(NSOperation *)operation finishedTarget:(id)target action:(SEL)action group:(NetworkOperationGroup *)group;
+- (void)addCPUOperation:(NSOperation *)operation finishedTarget:(id)target action:(SEL)action group:(NetworkOperationGroup *)group;
+- (void)cancelOperationGroup:(NetworkOperationGroup *)group;
+
+// Throughput estimates
+//
+// RetryingHTTPOperation reports each successful transfer using -noteTransferOfBytes:duration:forHost:, 
+// and the network manager keeps a moving average of the throughput to each host.  Clients can 
+// use this to decide how much data they can afford to fetch (see Photo's variant selection). 
+// Small transfers are ignored because their time is dominated by latency rather than throughput.
+//
+// Both methods can be called from any thread.
+
+- (void)noteTransferOfBytes:(unsigned long long)bytes duration:(NSTimeInterval)duration forHost:(NSString *)host;
+- (double)estimatedThroughputForHost:(NSString *)host;      // bytes per second, or 0.0 if unknown
+
+// Connection pre-warming
+//
+// When a client knows that it's about to hit a host with a burst of requests (for example, 
+// the thumbnails that follow a gallery sync), it can call -prewarmConnectionsForURLs:connectionCount:group: 
+// beforehand.  For each distinct host (scheme, host and port) among urls, this sends 
+// connectionCount HEAD requests for the first URL on that host, in parallel.  That resolves 
+// the host name (which the system then caches) and leaves that many idle keep-alive connections 
+// in NSURLConnection's pool, so the real requests don't pay for DNS and TCP (and TLS) setup.
+// A host that was pre-warmed recently enough that its connections should still be alive is 
+// skipped.  The HEAD requests run on the network management queue, in the specified group, 
+// and their results are ignored.
+//
+// Can be called from any thread.
+
+- (void)prewarmConnectionsForURLs:(NSArray *)urls connectionCount:(NSUInteger)connectionCount group:(NetworkOperationGroup *)group;
+
 @end
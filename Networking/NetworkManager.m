@@ -1,6 +1,292 @@
 #import "NetworkManager.h"
 #import "QHTTPOperation.h"
+#import "RetryingHTTPOperation.h"
+#import "MemoryBudget.h"
+#import "QFaultSimulator.h"
 #import "Logging.h"
+#import "QTrace.h"
+
+@interface NetworkOperationGroup ()
+
+// Only NetworkManager modifies these, and it always does so holding the group's lock 
+// (which it takes while holding its own lock, never the other way around).
+
+@property (retain, readonly ) NSMutableSet *        operations;
+@property (assign, readwrite, getter=isCancelled) BOOL cancelled;
+@property (retain, readwrite) NSDate *              cancelDate;
+@property (assign, readwrite) NSTimeInterval        drainTime;
+
+@end
+
+@implementation NetworkOperationGroup
+
+@synthesize name       = _name;
+@synthesize operations = _operations;
+@synthesize cancelDate = _cancelDate;
+
+- (id)initWithName:(NSString *)name
+{
+    assert(name != nil);
+    self = [super init];
+    if (self != nil) {
+        self->_name       = [name copy];
+        self->_operations = [[NSMutableSet alloc] init];
+        assert(self->_operations != nil);
+        self->_drainTime  = -1.0;
+        self->_weight     = 1.0;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self->_name release];
+    [self->_operations release];
+    [self->_cancelDate release];
+    [super dealloc];
+}
+
+- (NSUInteger)operationCount
+{
+    NSUInteger  result;
+    @synchronized (self) {
+        result = [self->_operations count];
+    }
+    return result;
+}
+
+- (BOOL)isCancelled
+{
+    BOOL    result;
+    @synchronized (self) {
+        result = self->_cancelled;
+    }
+    return result;
+}
+
+- (void)setCancelled:(BOOL)newValue
+{
+    @synchronized (self) {
+        self->_cancelled = newValue;
+    }
+}
+
+- (NSTimeInterval)drainTime
+{
+    NSTimeInterval  result;
+    @synchronized (self) {
+        result = self->_drainTime;
+    }
+    return result;
+}
+
+- (void)setDrainTime:(NSTimeInterval)newValue
+{
+    @synchronized (self) {
+        self->_drainTime = newValue;
+    }
+}
+
+- (double)weight
+{
+    double  result;
+    @synchronized (self) {
+        result = self->_weight;
+    }
+    return result;
+}
+
+- (void)setWeight:(double)newValue
+{
+    assert(newValue > 0.0);
+    @synchronized (self) {
+        self->_weight = newValue;
+    }
+}
+
+@end
+
+#pragma mark - Fair sharing
+
+// A NetworkFairQueue sits in front of one of our bounded queues and decides which group's 
+// operation gets the next free slot; see "Fair sharing" in the header.  It's not thread 
+// safe: NetworkManager only uses it while holding its own lock.  The methods that admit 
+// operations return them, rather than queueing them, so that NetworkManager can queue them 
+// after it drops the lock.
+// 按 group 的权重公平地分配 queue 的并发数.
+
+@interface NetworkFairQueue : NSObject
+{
+    NSOperationQueue *      _queue;                     // not retained; NetworkManager's queues live forever
+    NSMutableArray *        _activeGroups;              // groups with pending operations, in the order they became active
+    CFMutableDictionaryRef  _pendingOperationsByGroup;  // group -> NSMutableArray of ready operations, oldest first
+    CFMutableDictionaryRef  _passByGroup;               // group -> NSNumber, the group's virtual time
+    NSMutableSet *          _admittedOperations;
+    double                  _virtualTime;
+}
+
+- (id)initWithQueue:(NSOperationQueue *)queue;
+
+- (void)addOperation:(NSOperation *)operation group:(NetworkOperationGroup *)group;
+    // Adds a ready operation to the end of group's pending list.
+
+- (BOOL)admitOperation:(NSOperation *)operation group:(NetworkOperationGroup *)group;
+    // If operation is pending, admits it out of turn and returns YES.
+
+- (NSArray *)admitOperations;
+    // Admits operations until the queue is full or there are none pending.
+
+- (BOOL)operationDidFinish:(NSOperation *)operation;
+    // Returns YES if operation was one of ours, in which case its slot is now free.
+
+@end
+
+@implementation NetworkFairQueue
+
+- (id)initWithQueue:(NSOperationQueue *)queue
+{
+    assert(queue != nil);
+    self = [super init];
+    if (self != nil) {
+        self->_queue = queue;
+        self->_activeGroups = [[NSMutableArray alloc] init];
+        assert(self->_activeGroups != nil);
+        self->_pendingOperationsByGroup = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        assert(self->_pendingOperationsByGroup != NULL);
+        self->_passByGroup = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        assert(self->_passByGroup != NULL);
+        self->_admittedOperations = [[NSMutableSet alloc] init];
+        assert(self->_admittedOperations != nil);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    // Like NetworkManager, we live for the entire life of the application.
+    assert(NO);
+    [super dealloc];
+}
+
+- (void)addOperation:(NSOperation *)operation group:(NetworkOperationGroup *)group
+{
+    NSMutableArray *    pending;
+    
+    assert(operation != nil);
+    assert(group != nil);
+    
+    pending = (NSMutableArray *) CFDictionaryGetValue(self->_pendingOperationsByGroup, group);
+    if (pending == nil) {
+        pending = [NSMutableArray array];
+        assert(pending != nil);
+        CFDictionarySetValue(self->_pendingOperationsByGroup, group, pending);
+        
+        // A group that's just become active starts at the current virtual time, so it 
+        // neither jumps the queue nor has to wait for everyone else to catch up.
+        
+        CFDictionarySetValue(self->_passByGroup, group, [NSNumber numberWithDouble:self->_virtualTime]);
+        [self->_activeGroups addObject:group];
+    }
+    [pending addObject:operation];
+}
+
+// Removes the operation at index from group's pending list, deactivating the group if 
+// that was its last one, and notes that it's been admitted.
+- (void)removePendingOperationAtIndex:(NSUInteger)operationIndex group:(NetworkOperationGroup *)group
+{
+    NSMutableArray *    pending;
+    
+    pending = (NSMutableArray *) CFDictionaryGetValue(self->_pendingOperationsByGroup, group);
+    assert(pending != nil);
+    
+    [self->_admittedOperations addObject:[pending objectAtIndex:operationIndex]];
+    [pending removeObjectAtIndex:operationIndex];
+    if ([pending count] == 0) {
+        [self->_activeGroups removeObjectIdenticalTo:group];
+        CFDictionaryRemoveValue(self->_pendingOperationsByGroup, group);
+        CFDictionaryRemoveValue(self->_passByGroup, group);
+    }
+}
+
+- (BOOL)admitOperation:(NSOperation *)operation group:(NetworkOperationGroup *)group
+{
+    NSMutableArray *    pending;
+    NSUInteger          operationIndex;
+    
+    assert(operation != nil);
+    
+    operationIndex = NSNotFound;
+    if (group != nil) {
+        pending = (NSMutableArray *) CFDictionaryGetValue(self->_pendingOperationsByGroup, group);
+        if (pending != nil) {
+            operationIndex = [pending indexOfObjectIdenticalTo:operation];
+        }
+    }
+    if (operationIndex != NSNotFound) {
+        [self removePendingOperationAtIndex:operationIndex group:group];
+    }
+    return (operationIndex != NSNotFound);
+}
+
+- (NSArray *)admitOperations
+{
+    NSMutableArray *        result;
+    NSInteger               width;
+    
+    // The CPU queue's width is left at the default, in which case NSOperationQueue runs 
+    // about one operation per core.
+    
+    width = [self->_queue maxConcurrentOperationCount];
+    if (width == NSOperationQueueDefaultMaxConcurrentOperationCount) {
+        width = (NSInteger) [[NSProcessInfo processInfo] activeProcessorCount];
+    }
+    
+    result = nil;
+    while ( ((NSInteger) [self->_admittedOperations count] < width) && ([self->_activeGroups count] != 0) ) {
+        NetworkOperationGroup * chosenGroup;
+        double                  chosenPass;
+        
+        // Pick the group with the lowest virtual time.  Ties go to the group that became 
+        // active first.  There are only ever a handful of groups, so a linear search is fine.
+        
+        chosenGroup = nil;
+        chosenPass  = 0.0;
+        for (NetworkOperationGroup * group in self->_activeGroups) {
+            double  pass;
+            
+            pass = [(NSNumber *) CFDictionaryGetValue(self->_passByGroup, group) doubleValue];
+            if ( (chosenGroup == nil) || (pass < chosenPass) ) {
+                chosenGroup = group;
+                chosenPass  = pass;
+            }
+        }
+        assert(chosenGroup != nil);
+        
+        if (result == nil) {
+            result = [NSMutableArray array];
+            assert(result != nil);
+        }
+        [result addObject:[(NSArray *) CFDictionaryGetValue(self->_pendingOperationsByGroup, chosenGroup) objectAtIndex:0]];
+
+        self->_virtualTime = chosenPass;
+        CFDictionarySetValue(self->_passByGroup, chosenGroup, [NSNumber numberWithDouble:chosenPass + 1.0 / chosenGroup.weight]);
+        [self removePendingOperationAtIndex:0 group:chosenGroup];
+    }
+    return result;
+}
+
+- (BOOL)operationDidFinish:(NSOperation *)operation
+{
+    BOOL    result;
+    
+    result = ([self->_admittedOperations member:operation] != nil);
+    if (result) {
+        [self->_admittedOperations removeObject:operation];
+    }
+    return result;
+}
+
+@end
 
 @interface NetworkManager ()
 
@@ -9,6 +295,13 @@
 @property (nonatomic, retain, readonly ) NSOperationQueue *     queueForNetworkManagement;
 @property (nonatomic, retain, readonly ) NSOperationQueue *     queueForCPU;
 
+// forward declarations
+- (NetworkFairQueue *)fairQueueForQueue:(NSOperationQueue *)queue;
+- (void)enqueueOperation:(NSOperation *)operation onQueue:(NSOperationQueue *)queue;
+- (void)operationBecameReady:(NSOperation *)operation;
+- (void)admitFairOperationsForQueue:(NSOperationQueue *)queue;
+- (void)queuePendingFairOperation:(NSOperation *)operation;
+
 @end
 
 
@@ -112,6 +405,16 @@
         self->_runningOperationToThreadMap = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
         assert(self->_runningOperationToThreadMap != NULL);
         
+        // Unlike the maps above, an operation stays in the group map until it finishes, even 
+        // if it's cancelled; that's how we know when a cancelled group has drained.
+        self->_runningOperationToGroupMap = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        assert(self->_runningOperationToGroupMap != NULL);
+        
+        // Maps each thread to the array of operations whose completions are waiting to be 
+        // delivered on that thread.  See -enqueueCompletionForOperation:onThread:.
+        self->_pendingCompletionsByThread = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        assert(self->_pendingCompletionsByThread != NULL);
+        
         // 我们运行所有的 网络回调函数 在一个独立的线程里,这样它就不会为主线程的延迟贡献力量了,现在创建和配置这个线程.
         // We run all of our network callbacks on a secondary thread to ensure that they don't 
         // contribute to main thread latency.  Create and configure that thread.
@@ -127,6 +430,40 @@
         }
 
         [self->_networkRunLoopThread start];
+
+        self->_throughputByHost = [[NSMutableDictionary alloc] init];
+        assert(self->_throughputByHost != nil);
+
+        // Network transfers held back because memory is tight; see -addOperation:toQueue:finishedTarget:action:group:.
+        self->_deferredTransferOperations = [[NSMutableArray alloc] init];
+        assert(self->_deferredTransferOperations != nil);
+
+        self->_prewarmDatesByHost = [[NSMutableDictionary alloc] init];
+        assert(self->_prewarmDatesByHost != nil);
+        
+        // Grouped operations wait here for their share of the bounded queues; see "Fair sharing" 
+        // in the header.  Operations that aren't ready yet wait in the map until they are.
+        self->_fairQueueForNetworkTransfers = [[NetworkFairQueue alloc] initWithQueue:self->_queueForNetworkTransfers];
+        assert(self->_fairQueueForNetworkTransfers != nil);
+        self->_fairQueueForCPU = [[NetworkFairQueue alloc] initWithQueue:self->_queueForCPU];
+        assert(self->_fairQueueForCPU != nil);
+        self->_notReadyOperationToQueueMap = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        assert(self->_notReadyOperationToQueueMap != NULL);
+        
+        // The memory budget posts this on the main thread; there's no need for us to be on 
+        // any particular thread to adjust the queues.
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(memoryBudgetStageDidChange:) name:kMemoryBudgetStageDidChangeNotification object:nil];
+
+        #if ! defined(NDEBUG)
+            // If the "faultSimulator" user default is set, run all HTTP traffic through the 
+            // fault simulator.  We do this here, before anyone can start an operation, so that 
+            // every request sees the same network.
+            
+            if ( [[NSUserDefaults standardUserDefaults] boolForKey:@"faultSimulator"] ) {
+                [[QFaultSimulator sharedSimulator] configureWithDictionary:[[NSUserDefaults standardUserDefaults] dictionaryForKey:@"faultSimulatorConfig"]];
+                [QHTTPOperation setConnectionClass:[QSimulatedConnection class]];
+            }
+        #endif
     }
     return self;
 }
@@ -207,37 +544,52 @@
     return self->_runningNetworkTransferCount != 0;
 }
 
-//涉及到 UI 的操作,都需要在 main tread 上运行
-- (void)incrementRunningNetworkTransferCount
+// Any thread.  Rather than sending a message to the main thread for every network transfer 
+// that starts or finishes, we accumulate the changes in _pendingNetworkTransferCountDelta 
+// and only send a message when the first change arrives.  By the time the main thread gets 
+// around to it, a whole burst of changes may have accumulated.
+// 任何线程都可以调用. 把变化累积起来, 只在第一个变化到来时向 main thread 发送一次消息.
+- (void)adjustRunningNetworkTransferCountBy:(NSInteger)delta
 {
-    BOOL    movingToInUse;
-    assert([NSThread isMainThread]);
-
-    movingToInUse = (self->_runningNetworkTransferCount == 0);
-    if (movingToInUse) {
-        //因为 application 的 delegate 在监控本对象的"networkInUse"的值,这里如果值改变的话,需要发出通知.
-        [self willChangeValueForKey:@"networkInUse"];
+    BOOL    needsUpdate;
+    
+    @synchronized (self) {
+        needsUpdate = (self->_pendingNetworkTransferCountDelta == 0);
+        self->_pendingNetworkTransferCountDelta += delta;
+        
+        // If the delta has gone back to zero, the update we scheduled earlier will find 
+        // nothing to do; that's fine.
     }
-    self->_runningNetworkTransferCount += 1;
-    if (movingToInUse) {
-        [self  didChangeValueForKey:@"networkInUse"];
+    if (needsUpdate) {
+        [self performSelectorOnMainThread:@selector(applyRunningNetworkTransferCountDelta) withObject:nil waitUntilDone:NO];
     }
 }
 
 //涉及到 UI 的操作,都需要在 main tread 上运行
-- (void)decrementRunningNetworkTransferCount
+- (void)applyRunningNetworkTransferCountDelta
 {
-    BOOL    movingToNotInUse;
+    NSInteger   delta;
+    BOOL        wasInUse;
+    BOOL        isInUse;
     assert([NSThread isMainThread]);
 
-    assert(self->_runningNetworkTransferCount != 0);
-    movingToNotInUse = (self->_runningNetworkTransferCount == 1);
-    if (movingToNotInUse) {
+    @synchronized (self) {
+        delta = self->_pendingNetworkTransferCountDelta;
+        self->_pendingNetworkTransferCountDelta = 0;
+    }
+    
+    // Increments always precede the corresponding decrements in the pending delta, so 
+    // the count can't go negative.
+    assert( (delta >= 0) || ((NSUInteger) -delta <= self->_runningNetworkTransferCount) );
+    
+    wasInUse = (self->_runningNetworkTransferCount != 0);
+    isInUse  = ((NSInteger) self->_runningNetworkTransferCount + delta) != 0;
+    if (wasInUse != isInUse) {
         //因为 application 的 delegate 在监控本对象的"networkInUse"的值,这里如果值改变的话,需要发出通知.
         [self willChangeValueForKey:@"networkInUse"];
     }
-    self->_runningNetworkTransferCount -= 1;
-    if (movingToNotInUse) {
+    self->_runningNetworkTransferCount = (NSUInteger) ((NSInteger) self->_runningNetworkTransferCount + delta);
+    if (wasInUse != isInUse) {
         [self  didChangeValueForKey:@"networkInUse"];
     }
 }
@@ -246,12 +598,14 @@
 
 //添加一个 Operation 到 Queue, 并在 Operation 完成以后,调用 target 的 action.
 // Core code to enqueue an operation on a queue.
-- (void)addOperation:(NSOperation *)operation toQueue:(NSOperationQueue *)queue finishedTarget:(id)target action:(SEL)action
+- (void)addOperation:(NSOperation *)operation toQueue:(NSOperationQueue *)queue finishedTarget:(id)target action:(SEL)action group:(NetworkOperationGroup *)group
 {
+    BOOL    groupCancelled;
+    BOOL    deferred;
+
     // any thread
     assert(operation != nil);
-    assert(target != nil);
-    assert(action != nil);
+    assert( (target != nil) == (action != nil) );   // target may be nil if the caller picks up the result some other way
 
     // In the debug build, apply our debugging preferences to any operations 
     // we enqueue.
@@ -280,11 +634,24 @@
         }
 #endif
 
+    // Link the operation, in the trace, to whoever caused it to be queued: the target, 
+    // if that's an operation (RetryingHTTPOperation queueing its QHTTPOperation, say), 
+    // otherwise the operation whose completion action is running on this thread.
+    if (QTraceIsRecording()) {
+        id  parent;
+        
+        parent = [target isKindOfClass:[NSOperation class]] ? target : [[QTrace trace] currentOperation];
+        if ( (parent == nil) && ([[operation dependencies] count] != 0) ) {
+            parent = [[operation dependencies] objectAtIndex:0];
+        }
+        [[QTrace trace] operation:operation wasQueuedByParent:parent];
+    }
+
     // Update our networkInUse property;
     // because we can be running on any thread, we do this update on the main thread.
     if (queue == self.queueForNetworkTransfers) { //如果有人使用网络传输队列,就要在系统状态条上现实网络使用 loading 图标.
         // 设计到 UI 操作的都要在 main thread.
-        [self performSelectorOnMainThread:@selector(incrementRunningNetworkTransferCount) withObject:nil waitUntilDone:NO];
+        [self adjustRunningNetworkTransferCountBy:1];
     }
     
     // Atomically enter the operation into our target and action maps.
@@ -299,14 +666,36 @@
         // Add the operations to , triggering a KVO notification of networkInUse if required.
         // 全部以 operation 为可以 来创建 dictionary
         // 这样在消息传递时,只要传入operation 就可以获取其他对应数据
-        CFDictionarySetValue(self->_runningOperationToTargetMap, operation, target);
-        CFDictionarySetValue(self->_runningOperationToActionMap, operation, action);
-        CFDictionarySetValue(self->_runningOperationToThreadMap, operation, [NSThread currentThread]);
+        // 如果没有 target, 就不用放入 map 了, 完成后也不用回调.
+        if (target != nil) {
+            CFDictionarySetValue(self->_runningOperationToTargetMap, operation, target);
+            CFDictionarySetValue(self->_runningOperationToActionMap, operation, action);
+            CFDictionarySetValue(self->_runningOperationToThreadMap, operation, [NSThread currentThread]);
+        }
+
+        // 如果指定了 group, 把 operation 加入到 group 里.
+        // An operation that queues operations of its own (RetryingHTTPOperation, say) puts 
+        // them in its group, so that they get the group's share of the queues.
+        groupCancelled = NO;
+        if (group != nil) {
+            assert( CFDictionaryGetValue(self->_runningOperationToGroupMap, operation) == NULL );
+            CFDictionarySetValue(self->_runningOperationToGroupMap, operation, group);
+            @synchronized (group) {
+                [group.operations addObject:operation];
+                groupCancelled = group.cancelled;
+            }
+        }
 
         assert( CFDictionaryGetCount(self->_runningOperationToTargetMap) == CFDictionaryGetCount(self->_runningOperationToActionMap) );
         assert( CFDictionaryGetCount(self->_runningOperationToTargetMap) == CFDictionaryGetCount(self->_runningOperationToThreadMap) );
     }
     
+    if ( (group != nil) && [operation respondsToSelector:@selector(setOperationGroup:)] ) {
+        if ( [(id) operation operationGroup] == nil ) {
+            [(id) operation setOperationGroup:group];
+        }
+    }
+    
     // Observe the isFinished property of the operation.  We pass the queue parameter as the 
     // context so that, in the completion routine, we know what queue the operation was sent 
     // to (necessary to decide what thread to run the target/action on).
@@ -321,12 +710,42 @@
     // NSOperationQueue 的介绍说明查看 QRunLoopOperation.m 的注释
     [operation addObserver:self forKeyPath:@"isFinished" options:0 context:queue];
     
+    // If memory is tight, hold back new network transfers that would accumulate their 
+    // response in memory; -memoryBudgetStageDidChange: queues them once the stage drops.  
+    // We check the stage while holding the lock so that we can't miss that flush.
+    // 内存紧张时, 推迟会把回应数据保存在内存里的网络传输.
+    deferred = NO;
+    if ( (queue == self.queueForNetworkTransfers) && [operation isKindOfClass:[QHTTPOperation class]] && ([(QHTTPOperation *) operation responseOutputStream] == nil) ) {
+        @synchronized (self) {
+            if ( [[MemoryBudget sharedBudget] isAtLeastStage:kMemoryBudgetStageDeferDownloads] ) {
+                [self->_deferredTransferOperations addObject:operation];
+                deferred = YES;
+            }
+        }
+        if (deferred) {
+            [[QLog log] logOption:kLogOptionNetworkDetails withFormat:@"%s deferred %@ by memory budget", __PRETTY_FUNCTION__, [[(QHTTPOperation *) operation request] URL]];
+        }
+    }
+    
     // Queue the operation.  When the operation completes,  [self operationDone] is called.
-    // 将这个operation入列,入列后, operation 立即执行
-    [queue addOperation:operation];
+    // 将这个operation入列,入列后, operation 立即执行 (如果属于某个 group, 要先等 group 分到空位)
+    if ( ! deferred ) {
+        [self enqueueOperation:operation onQueue:queue];
+    }
+    
+    // If the group has already been cancelled, the operation is dead on arrival.  We still 
+    // queue it (rather than just dropping it) so that it goes through the normal finish path.
+    if (groupCancelled) {
+        [self cancelOperation:operation];
+    }
 }
 
 - (void)addNetworkManagementOperation:(NSOperation *)operation finishedTarget:(id)target action:(SEL)action
+{
+    [self addNetworkManagementOperation:operation finishedTarget:target action:action group:nil];
+}
+
+- (void)addNetworkManagementOperation:(NSOperation *)operation finishedTarget:(id)target action:(SEL)action group:(NetworkOperationGroup *)group
 {
     // 检测是否为 QRunLoopOperation 类(或子类),如果是,则调用operation的 setRunLoopThread 设置为 self.networkRunLoopThread
     // 这样回调函数就会在 networkRunLoopThread 线程上运行了,否则会在 main thread 上运行,有可能堵塞 UI.
@@ -335,12 +754,19 @@
             [ (id)operation setRunLoopThread:self.networkRunLoopThread];
         }
     }
-    [self addOperation:operation toQueue:self.queueForNetworkManagement finishedTarget:target action:action];
+    [self addOperation:operation toQueue:self.queueForNetworkManagement finishedTarget:target action:action group:group];
 }
 
 
 - (void)addNetworkTransferOperation:(NSOperation *)operation finishedTarget:(id)target action:(SEL)action
 {
+    [self addNetworkTransferOperation:operation finishedTarget:target action:action group:nil];
+}
+
+- (void)addNetworkTransferOperation:(NSOperation *)operation finishedTarget:(id)target action:(SEL)action group:(NetworkOperationGroup *)group
+{
+    // Like the other queues, a transfer may have no completion.  networkInUse doesn't 
+    // depend on one; the running transfer count is decremented by the isFinished observer.
     // 检测是否为 QRunLoopOperation 类(或子类),如果是,则调用operation的 setRunLoopThread 设置为 self.networkRunLoopThread
     // 这样回调函数就会在 networkRunLoopThread 线程上运行了,否则会在 main thread 上运行,有可能堵塞 UI.
     if ([operation respondsToSelector:@selector(setRunLoopThread:)]) { //这里用到了QHTTPOperation 的方法.所以要引入那个H文件
@@ -348,13 +774,18 @@
             [ (id)operation setRunLoopThread:self.networkRunLoopThread];
         }
     }
-    [self addOperation:operation toQueue:self.queueForNetworkTransfers finishedTarget:target action:action];
+    [self addOperation:operation toQueue:self.queueForNetworkTransfers finishedTarget:target action:action group:group];
 }
 
 
 - (void)addCPUOperation:(NSOperation *)operation finishedTarget:(id)target action:(SEL)action
 {
-    [self addOperation:operation toQueue:self.queueForCPU finishedTarget:target action:action];
+    [self addCPUOperation:operation finishedTarget:target action:action group:nil];
+}
+
+- (void)addCPUOperation:(NSOperation *)operation finishedTarget:(id)target action:(SEL)action group:(NetworkOperationGroup *)group
+{
+    [self addOperation:operation toQueue:self.queueForCPU finishedTarget:target action:action group:group];
 }
 
 #pragma mark - KVO observing method
@@ -382,7 +813,12 @@
         [operation removeObserver:self forKeyPath:@"isFinished"];
         
         //任何对核心 map 数据的操作都要,采用原子级别的锁定
-        NSThread *          thread; // get from self->_runningOperationToThreadMap dictionary
+        NSThread *              thread; // get from self->_runningOperationToThreadMap dictionary
+        NetworkOperationGroup * drainedGroup;
+        NetworkFairQueue *      fairQueue;
+        BOOL                    freedFairSlot;
+        drainedGroup = nil;
+        fairQueue = [self fairQueueForQueue:queue];
         @synchronized (self) {
             assert( CFDictionaryGetCount(self->_runningOperationToTargetMap) == CFDictionaryGetCount(self->_runningOperationToActionMap) );
             assert( CFDictionaryGetCount(self->_runningOperationToTargetMap) == CFDictionaryGetCount(self->_runningOperationToThreadMap) );
@@ -392,19 +828,50 @@
                 // 如果 thread 不为空的话,下面要用它执行 oprationDone 消息, 所以 ratain 一下.
                 [thread retain];
             }
+            
+            // The operation leaves its group now, whether or not it was cancelled.  If it's 
+            // the last operation of a cancelled group, the group has drained.
+            NetworkOperationGroup * group;
+            group = (NetworkOperationGroup *) CFDictionaryGetValue(self->_runningOperationToGroupMap, operation);
+            if (group != nil) {
+                @synchronized (group) {
+                    [group.operations removeObject:operation];
+                    if ( group.cancelled && ([group.operations count] == 0) && (group.drainTime < 0.0) ) {
+                        group.drainTime = -[group.cancelDate timeIntervalSinceNow];
+                        drainedGroup = [[group retain] autorelease];
+                    }
+                }
+                CFDictionaryRemoveValue(self->_runningOperationToGroupMap, operation);
+            }
+            
+            freedFairSlot = (fairQueue != nil) && [fairQueue operationDidFinish:operation];
         }//锁定结束
         
+        if (freedFairSlot) {
+            [self admitFairOperationsForQueue:queue];
+        }
+        
+        if (drainedGroup != nil) {
+            [[QLog log] logWithFormat:@"%s group %@ drained in %.3f s", __PRETTY_FUNCTION__, drainedGroup.name, drainedGroup.drainTime];
+        }
+        
         if (thread != nil) {
             //在调用addOperation:toQueue:finishedTarget:action:的 thread 上执行本类的 operationDone 操作
             //主要作用是从 _runningOperationTo*** map 中删除已经添加的数据(因为也是在那个线程上向 map 添加的数据),并调用添加operation时指定的回调函数.
-            [self performSelector:@selector(operationDone:) onThread:thread  withObject:operation waitUntilDone:NO];
+            [self enqueueCompletionForOperation:operation onThread:thread];
             
             [thread release];
-
-            if (queue == self.queueForNetworkTransfers) {
-                //跟 UI 相关的操作需要到main 线程中执行
-                [self performSelectorOnMainThread:@selector(decrementRunningNetworkTransferCount) withObject:nil waitUntilDone:NO];
-            }
+        }
+        
+        // We do this whether or not the operation was cancelled, to balance the increment 
+        // in -addOperation:toQueue:finishedTarget:action:group:.
+        if (queue == self.queueForNetworkTransfers) {
+            [self adjustRunningNetworkTransferCountBy:-1];
+        }
+    } else if ( [keyPath isEqual:@"isReady"] ) {
+        // Only operations waiting in _notReadyOperationToQueueMap are observed for this.
+        if ( [(NSOperation *) object isReady] ) {
+            [self operationBecameReady:(NSOperation *) object];
         }
     } else if (NO) {   // Disabled because the super class does nothing useful with it.
         [super observeValueForKeyPath:keyPath ofObject:object change:change context:context];
@@ -412,6 +879,108 @@
 }
 
 
+#pragma mark - Completion delivery
+
+// The longest we spend delivering completions in one go before yielding to the run loop. 
+// This is about half a frame, which leaves the other half for scrolling and so on.
+
+static const NSTimeInterval kCompletionDeliveryBudget = 0.008;
+
+// Any thread.  Queues the completion for operation to be delivered on thread.  If there 
+// are no completions pending for that thread, we schedule a -deliverPendingCompletions 
+// on it; otherwise one is already scheduled and it will pick this one up too.
+// 把 operation 放入 thread 对应的待处理队列, 只有在队列为空时, 才向 thread 发送一次消息.
+- (void)enqueueCompletionForOperation:(NSOperation *)operation onThread:(NSThread *)thread
+{
+    NSMutableArray *    pending;
+    BOOL                needsDelivery;
+    
+    assert(operation != nil);
+    assert(thread != nil);
+    
+    @synchronized (self) {
+        pending = (NSMutableArray *) CFDictionaryGetValue(self->_pendingCompletionsByThread, thread);
+        needsDelivery = (pending == nil);
+        if (needsDelivery) {
+            pending = [NSMutableArray array];
+            assert(pending != nil);
+            CFDictionarySetValue(self->_pendingCompletionsByThread, thread, pending);
+        }
+        [pending addObject:operation];
+    }
+    if (needsDelivery) {
+        [self performSelector:@selector(deliverPendingCompletions) onThread:thread withObject:nil waitUntilDone:NO];
+    }
+}
+
+// Runs on the thread that the completions are for.  Delivers the pending completions in 
+// order until we run out or run over kCompletionDeliveryBudget, in which case we schedule 
+// ourselves again to do the rest on a later run loop turn.  The array stays in 
+// _pendingCompletionsByThread for as long as a delivery is scheduled; that's how 
+// -enqueueCompletionForOperation:onThread: knows not to schedule another one.
+- (void)deliverPendingCompletions
+{
+    NSThread *          thread;
+    NSDate *            startDate;
+    NSMutableArray *    pending;
+    NSOperation *       operation;
+    NSUInteger          deliveredCount;
+    NSUInteger          completionCount;
+    NSUInteger          wakeupCount;
+    BOOL                moreToDo;
+    
+    thread = [NSThread currentThread];
+    startDate = [NSDate date];
+    deliveredCount = 0;
+    do {
+        @synchronized (self) {
+            pending = (NSMutableArray *) CFDictionaryGetValue(self->_pendingCompletionsByThread, thread);
+            assert(pending != nil);
+            if ([pending count] == 0) {
+                operation = nil;
+                CFDictionaryRemoveValue(self->_pendingCompletionsByThread, thread);
+            } else {
+                operation = [[[pending objectAtIndex:0] retain] autorelease];
+                [pending removeObjectAtIndex:0];
+            }
+        }
+        if (operation != nil) {
+            [self operationDone:operation];
+            deliveredCount += 1;
+        }
+        moreToDo = (operation != nil) && ([startDate timeIntervalSinceNow] > -kCompletionDeliveryBudget);
+    } while (moreToDo);
+    
+    // If we stopped because we ran out of time, come back for the rest, if there is any.
+    
+    if (operation != nil) {
+        @synchronized (self) {
+            moreToDo = ([pending count] != 0);
+            if ( ! moreToDo ) {
+                CFDictionaryRemoveValue(self->_pendingCompletionsByThread, thread);
+            }
+        }
+        if (moreToDo) {
+            [self performSelector:@selector(deliverPendingCompletions) onThread:thread withObject:nil waitUntilDone:NO];
+        }
+    }
+    
+    @synchronized (self) {
+        self->_completionCount       += deliveredCount;
+        self->_completionWakeupCount += 1;
+        completionCount = self->_completionCount;
+        wakeupCount     = self->_completionWakeupCount;
+    }
+    if (deliveredCount > 1) {
+        [[QLog log] logOption:kLogOptionNetworkDetails withFormat:@"%s delivered %zu completions in %.1f ms; %zu wakeups saved so far", 
+            __PRETTY_FUNCTION__, 
+            (size_t) deliveredCount, 
+            -[startDate timeIntervalSinceNow] * 1000.0, 
+            (size_t) (completionCount - wakeupCount)
+        ];
+    }
+}
+
 //跟调用 addOperation:toQueue:finishedTarget:action: 的 thread 上执行操作
 //主要作用是从 _runningOperationTo*** map 中删除已经添加的数据.也是在那个thread上向 map 添加的数据
 //通过监控 operation 的 isFinished 消息,调用本操作
@@ -469,13 +1038,330 @@
     // we enter the @synchronized block.
     if (target != nil) { //如果 Operation顺利完成, 没有被 cancel 动作删除掉
         if ( ! [operation isCancelled] ) { //确保 operation 没有被cancel,然后执行回调函数,不然就不用执行回调函数了.
+            BOOL    tracing;
+            id      previousOperation;
+            
+            tracing = QTraceIsRecording();
+            previousOperation = nil;
+            if (tracing) {
+                previousOperation = [[QTrace trace] currentOperation];
+                [[QTrace trace] setCurrentOperation:operation];
+            }
             //调用 target/action,  operation 为 actin 的一个参数将被 target 执行
             [target performSelector:action withObject:operation];
+            if (tracing) {
+                [[QTrace trace] setCurrentOperation:previousOperation];
+            }
         }
         [target release];
     }
 }
 
+#pragma mark - Memory pressure
+
+// If the operation was held back by -addOperation:toQueue:finishedTarget:action:group:, 
+// queue it now.  A cancelled operation has to run through the queue to finish.
+- (void)queueDeferredOperation:(NSOperation *)operation
+{
+    NSUInteger  operationIndex;
+    
+    // any thread
+    assert(operation != nil);
+    
+    @synchronized (self) {
+        operationIndex = [self->_deferredTransferOperations indexOfObjectIdenticalTo:operation];
+        if (operationIndex != NSNotFound) {
+            [[operation retain] autorelease];
+            [self->_deferredTransferOperations removeObjectAtIndex:operationIndex];
+        }
+    }
+    if (operationIndex != NSNotFound) {
+        [self.queueForNetworkTransfers addOperation:operation];
+    }
+}
+
+// Called on the main thread when the memory budget's stage changes.  We throttle the 
+// CPU queue, so that we don't have several full size decodes going at once, and queue 
+// any network transfers that we held back once memory frees up.
+- (void)memoryBudgetStageDidChange:(NSNotification *)note
+{
+    MemoryBudgetStage   stage;
+    NSArray *           operations;
+    
+    assert([NSThread isMainThread]);
+    assert([[note object] isKindOfClass:[MemoryBudget class]]);
+    
+    stage = [(MemoryBudget *) [note object] stage];
+    
+    if (stage >= kMemoryBudgetStageThrottleCPU) {
+        [self.queueForCPU setMaxConcurrentOperationCount:1];
+    } else {
+        [self.queueForCPU setMaxConcurrentOperationCount:NSOperationQueueDefaultMaxConcurrentOperationCount];
+    }
+    [self admitFairOperationsForQueue:self.queueForCPU];
+    
+    operations = nil;
+    @synchronized (self) {
+        if ( (stage < kMemoryBudgetStageDeferDownloads) && ([self->_deferredTransferOperations count] != 0) ) {
+            operations = [[self->_deferredTransferOperations copy] autorelease];
+            [self->_deferredTransferOperations removeAllObjects];
+        }
+    }
+    if (operations != nil) {
+        [[QLog log] logWithFormat:@"%s stage %d, queueing %zu deferred transfers", __PRETTY_FUNCTION__, (int) stage, (size_t) [operations count]];
+        for (NSOperation * operation in operations) {
+            [self enqueueOperation:operation onQueue:self.queueForNetworkTransfers];
+        }
+    }
+}
+
+#pragma mark - Fair sharing
+
+// Returns the fair queue in front of queue, or nil if operations go straight onto queue.
+- (NetworkFairQueue *)fairQueueForQueue:(NSOperationQueue *)queue
+{
+    NetworkFairQueue *  result;
+    
+    result = nil;
+    if (queue == self.queueForNetworkTransfers) {
+        result = self->_fairQueueForNetworkTransfers;
+    } else if (queue == self.queueForCPU) {
+        result = self->_fairQueueForCPU;
+    }
+    return result;
+}
+
+// Queues operation on queue or, if it's in a group and queue is shared fairly, adds it to 
+// its group's pending list.  Any thread.
+- (void)enqueueOperation:(NSOperation *)operation onQueue:(NSOperationQueue *)queue
+{
+    NetworkFairQueue *      fairQueue;
+    NetworkOperationGroup * group;
+    BOOL                    isReady;
+    
+    assert(operation != nil);
+    assert(queue != nil);
+    
+    // We check isReady outside of our lock because NSOperation takes its own lock to 
+    // answer it, and might be holding that lock when it tells us (via KVO) that it's ready.
+    
+    fairQueue = [self fairQueueForQueue:queue];
+    isReady = [operation isReady];
+    group = nil;
+    if (fairQueue != nil) {
+        @synchronized (self) {
+            group = (NetworkOperationGroup *) CFDictionaryGetValue(self->_runningOperationToGroupMap, operation);
+            if (group != nil) {
+                if (isReady) {
+                    [fairQueue addOperation:operation group:group];
+                } else {
+                    CFDictionarySetValue(self->_notReadyOperationToQueueMap, operation, queue);
+                }
+            }
+        }
+    }
+    
+    if (group == nil) {
+        [queue addOperation:operation];
+    } else if (isReady) {
+        [self admitFairOperationsForQueue:queue];
+    } else {
+        // Start observing before we check again, so we can't miss the operation becoming 
+        // ready.  -operationBecameReady: copes with being called twice.
+        [operation addObserver:self forKeyPath:@"isReady" options:0 context:queue];
+        if ([operation isReady]) {
+            [self operationBecameReady:operation];
+        }
+    }
+}
+
+// Moves an operation from the not ready map to its group's pending list.  Any thread.
+- (void)operationBecameReady:(NSOperation *)operation
+{
+    NSOperationQueue *      queue;
+    NetworkOperationGroup * group;
+    
+    @synchronized (self) {
+        queue = [[(NSOperationQueue *) CFDictionaryGetValue(self->_notReadyOperationToQueueMap, operation) retain] autorelease];
+        if (queue != nil) {
+            group = (NetworkOperationGroup *) CFDictionaryGetValue(self->_runningOperationToGroupMap, operation);
+            assert(group != nil);
+            [[self fairQueueForQueue:queue] addOperation:operation group:group];
+            CFDictionaryRemoveValue(self->_notReadyOperationToQueueMap, operation);
+        }
+    }
+    if (queue != nil) {
+        [operation removeObserver:self forKeyPath:@"isReady"];
+        [self admitFairOperationsForQueue:queue];
+    }
+}
+
+// Queues as many pending operations as queue has room for.  Any thread.
+- (void)admitFairOperationsForQueue:(NSOperationQueue *)queue
+{
+    NSArray *   operations;
+    
+    @synchronized (self) {
+        operations = [[self fairQueueForQueue:queue] admitOperations];
+    }
+    for (NSOperation * operation in operations) {
+        [queue addOperation:operation];
+    }
+}
+
+// If operation is waiting for its group's turn, queue it now, out of turn.  Like 
+// -queueDeferredOperation:, this is how a cancelled operation gets to finish.
+- (void)queuePendingFairOperation:(NSOperation *)operation
+{
+    NetworkOperationGroup * group;
+    NSOperationQueue *      notReadyQueue;
+    NSOperationQueue *      queue;
+    
+    // any thread
+    assert(operation != nil);
+    
+    queue = nil;
+    notReadyQueue = nil;
+    @synchronized (self) {
+        group = (NetworkOperationGroup *) CFDictionaryGetValue(self->_runningOperationToGroupMap, operation);
+        if (group != nil) {
+            notReadyQueue = [[(NSOperationQueue *) CFDictionaryGetValue(self->_notReadyOperationToQueueMap, operation) retain] autorelease];
+            if (notReadyQueue != nil) {
+                // Put it on the pending list just so that we can admit it from there.
+                [[self fairQueueForQueue:notReadyQueue] addOperation:operation group:group];
+                CFDictionaryRemoveValue(self->_notReadyOperationToQueueMap, operation);
+            }
+            if ( [self->_fairQueueForNetworkTransfers admitOperation:operation group:group] ) {
+                queue = self.queueForNetworkTransfers;
+            } else if ( [self->_fairQueueForCPU admitOperation:operation group:group] ) {
+                queue = self.queueForCPU;
+            }
+        }
+    }
+    if (notReadyQueue != nil) {
+        [operation removeObserver:self forKeyPath:@"isReady"];
+    }
+    if (queue != nil) {
+        [queue addOperation:operation];
+    }
+}
+
+#pragma mark - Throughput estimates
+
+// Transfers smaller than this tell us more about latency than throughput, so we ignore them.
+
+static const unsigned long long kThroughputMinimumTransferSize = 32 * 1024;
+
+// The weight given to each new sample in the moving average.  This is high enough that we 
+// react quickly when the user moves from Wi-Fi to a cellular network, say.
+
+static const double kThroughputSampleWeight = 0.3;
+
+- (void)noteTransferOfBytes:(unsigned long long)bytes duration:(NSTimeInterval)duration forHost:(NSString *)host
+{
+    double      sample;
+    NSNumber *  average;
+    
+    if ( (host != nil) && (bytes >= kThroughputMinimumTransferSize) && (duration > 0.0) ) {
+        sample = (double) bytes / duration;
+        @synchronized (self->_throughputByHost) {
+            average = [self->_throughputByHost objectForKey:host];
+            if (average != nil) {
+                sample = kThroughputSampleWeight * sample + (1.0 - kThroughputSampleWeight) * [average doubleValue];
+            }
+            [self->_throughputByHost setObject:[NSNumber numberWithDouble:sample] forKey:host];
+        }
+        [[QLog log] logOption:kLogOptionNetworkDetails withFormat:@"%s host %@ throughput %.0f bytes/s", __PRETTY_FUNCTION__, host, sample];
+    }
+}
+
+- (double)estimatedThroughputForHost:(NSString *)host
+{
+    double  result;
+    
+    result = 0.0;
+    if (host != nil) {
+        @synchronized (self->_throughputByHost) {
+            result = [[self->_throughputByHost objectForKey:host] doubleValue];
+        }
+    }
+    return result;
+}
+
+#pragma mark - Connection pre-warming
+
+// CFNetwork closes idle keep-alive connections after a while; we assume that connections 
+// we opened less than this long ago are still in the pool.
+
+static const NSTimeInterval kPrewarmKeepAliveInterval = 10.0;
+
+- (void)prewarmConnectionsForURLs:(NSArray *)urls connectionCount:(NSUInteger)connectionCount group:(NetworkOperationGroup *)group
+{
+    NSMutableDictionary *   urlsByHost;
+    NSDate *                now;
+    
+    // any thread
+    assert(urls != nil);
+    assert(connectionCount != 0);
+    
+    // Pick the first URL for each host.  The key includes the scheme and port because 
+    // connections aren't shared across them.
+    
+    urlsByHost = [NSMutableDictionary dictionary];
+    assert(urlsByHost != nil);
+    for (NSURL * url in urls) {
+        NSString *  hostKey;
+        
+        assert([url isKindOfClass:[NSURL class]]);
+        if ([url host] != nil) {
+            hostKey = [NSString stringWithFormat:@"%@://%@:%@", [[url scheme] lowercaseString], [[url host] lowercaseString], [url port]];
+            if ([urlsByHost objectForKey:hostKey] == nil) {
+                [urlsByHost setObject:url forKey:hostKey];
+            }
+        }
+    }
+    
+    // Skip the hosts that are still warm, and note the rest as warm from now on.
+    
+    now = [NSDate date];
+    @synchronized (self->_prewarmDatesByHost) {
+        for (NSString * hostKey in [urlsByHost allKeys]) {
+            NSDate *    lastDate;
+            
+            lastDate = [self->_prewarmDatesByHost objectForKey:hostKey];
+            if ( (lastDate != nil) && ([now timeIntervalSinceDate:lastDate] < kPrewarmKeepAliveInterval) ) {
+                [urlsByHost removeObjectForKey:hostKey];
+            } else {
+                [self->_prewarmDatesByHost setObject:now forKey:hostKey];
+            }
+        }
+    }
+    
+    for (NSString * hostKey in urlsByHost) {
+        NSUInteger  connectionIndex;
+        
+        [[QLog log] logOption:kLogOptionNetworkDetails withFormat:@"%s host %@ pre-warming %zu connections", __PRETTY_FUNCTION__, hostKey, (size_t) connectionCount];
+        
+        for (connectionIndex = 0; connectionIndex < connectionCount; connectionIndex++) {
+            NSMutableURLRequest *   request;
+            QHTTPOperation *        operation;
+            
+            request = [self requestToGetURL:[urlsByHost objectForKey:hostKey]];
+            assert(request != nil);
+            [request setHTTPMethod:@"HEAD"];
+            
+            // Any response will do; all we want is the connection.
+            
+            operation = [[[QHTTPOperation alloc] initWithRequest:request] autorelease];
+            assert(operation != nil);
+            operation.acceptableStatusCodes = [NSIndexSet indexSetWithIndexesInRange:NSMakeRange(100, 500)];
+            [operation setQueuePriority:NSOperationQueuePriorityHigh];
+            
+            [self addNetworkManagementOperation:operation finishedTarget:nil action:NULL group:group];
+        }
+    }
+}
+
 - (void)cancelOperation:(NSOperation *)operation
 {
     id          target;
@@ -493,6 +1379,8 @@
         // some time.
         //这回导致调用 QRunLoopOperation.m 的 cancel 方法,cancel 方法,又会可能在本类的networkRunLoopThread线程上执行一些操作
         [operation cancel];
+        [self queueDeferredOperation:operation];
+        [self queuePendingFairOperation:operation];
 
         // Now we pull the target/action out of the map.
         @synchronized (self) {
@@ -521,4 +1409,59 @@
     }
 }
 
+- (void)cancelOperationGroup:(NetworkOperationGroup *)group
+{
+    NSArray *   operations;
+    NSUInteger  pulledCount;
+    
+    // any thread
+    // 跟 -cancelOperation: 一样, 为了简化 client 的清理代码, 我们允许 group 为 nil.
+    if (group != nil) {
+        
+        // Mark the group as cancelled and pull all of its operations out of the maps while 
+        // holding the lock just once.  Any operation that hasn't yet been picked up by 
+        // -operationDone: will never have its target/action called.  New operations added 
+        // to the group from now on are cancelled by -addOperation:toQueue:finishedTarget:action:group:.
+        // 在一次锁定中, 把 group 里所有的 operation 从 map 中删除, 这样它们的回调函数就都不会被调用了.
+        pulledCount = 0;
+        @synchronized (self) {
+            assert( CFDictionaryGetCount(self->_runningOperationToTargetMap) == CFDictionaryGetCount(self->_runningOperationToActionMap) );
+            assert( CFDictionaryGetCount(self->_runningOperationToTargetMap) == CFDictionaryGetCount(self->_runningOperationToThreadMap) );
+
+            @synchronized (group) {
+                if ( ! group.cancelled ) {
+                    group.cancelled  = YES;
+                    group.cancelDate = [NSDate date];
+                    if ([group.operations count] == 0) {
+                        group.drainTime = 0.0;
+                    }
+                }
+                operations = [group.operations allObjects];
+            }
+            for (NSOperation * operation in operations) {
+                if ( CFDictionaryGetValue(self->_runningOperationToTargetMap, operation) != NULL ) {
+                    CFDictionaryRemoveValue(self->_runningOperationToTargetMap, operation);
+                    CFDictionaryRemoveValue(self->_runningOperationToActionMap, operation);
+                    CFDictionaryRemoveValue(self->_runningOperationToThreadMap, operation);
+                    pulledCount += 1;
+                }
+            }
+
+            assert( CFDictionaryGetCount(self->_runningOperationToTargetMap) == CFDictionaryGetCount(self->_runningOperationToActionMap) );
+            assert( CFDictionaryGetCount(self->_runningOperationToTargetMap) == CFDictionaryGetCount(self->_runningOperationToThreadMap) );
+        }
+        
+        // Now do the actual cancellation outside of the @synchronized block, because it 
+        // might take some time (see -cancelOperation:).  The operations stay in the group 
+        // until they finish, which is how we time the drain.
+        for (NSOperation * operation in operations) {
+            [operation cancel];
+            [self queueDeferredOperation:operation];
+            [self queuePendingFairOperation:operation];
+        }
+        
+        [[QLog log] logWithFormat:@"%s group %@ cancelled %zu operations (%zu pending completions)", __PRETTY_FUNCTION__, group.name, (size_t) [operations count], (size_t) pulledCount];
+    }
+}
+
 @end
@@ -0,0 +1,166 @@
+#import "QHTTPOperation.h"
+
+/*
+    QFaultSimulator injects network faults underneath QHTTPOperation so that we can
+    load test the retry stack (RetryingHTTPOperation's back-off, its reachability waits,
+    and so on) against a local HTTP server, for example the TestGallery directory served
+    over HTTP from a Mac.  It's a debug build facility, like the networkErrorRate and
+    operationDelay preferences in NetworkManager, but it models the network much more
+    closely than those do.
+
+    It works by plugging QSimulatedConnection in as QHTTPOperation's transport (see
+    +[QHTTPOperation setConnectionClass:]).  Each simulated connection asks the simulator
+    for a plan and then either fails on its own or runs the request over a real
+    NSURLConnection and tampers with the results on the way through.  The faults are:
+
+    o latency -- every request waits for a delay drawn from a configurable distribution
+      before it starts
+
+    o outages -- requests to a host fail to connect during configured windows of time
+
+    o 5xx bursts -- a host starts returning 503, with a Retry-After of 1 second, for a
+      run of consecutive requests, which RetryingHTTPOperation backs off and retries
+
+    o truncated bodies -- the connection drops part way through the body
+
+    o slow trickles -- the body is delivered at a configurable (slow) rate
+
+    o wrong content types -- the response claims to be text/html
+
+    All of the random choices for a request are drawn from a generator seeded with the
+    simulator's seed, the request URL, and the number of times that URL has been requested
+    so far, so a run is reproducible regardless of the order in which the requests happen
+    to be made.  Outage windows are measured from the last -reset, and so depend on timing.
+
+    In the debug build, NetworkManager installs the simulator if the faultSimulator
+    preference is set, configuring it from the faultSimulatorConfig dictionary preference
+    (which you can set with a launch argument); see -configureWithDictionary: for the keys.
+
+    -startLoadTestWithURL:operationCount:duration: fires off a large number of
+    RetryingHTTPOperations at one URL and, when they're all done (or the time is up),
+    logs a report of the injected faults and of +[RetryingHTTPOperation statistics].
+
+    网络故障模拟器: 在 QHTTPOperation 下面注入各种网络故障, 用来对重试机制做压力测试.
+*/
+
+#if ! defined(NDEBUG)
+
+@class NetworkOperationGroup;
+
+enum QFaultKind {
+    kQFaultKindNone = 0,
+    kQFaultKindOutage,
+    kQFaultKindServerError,
+    kQFaultKindTruncatedBody,
+    kQFaultKindTrickle,
+    kQFaultKindWrongContentType,
+    kQFaultKindCount
+};
+typedef enum QFaultKind QFaultKind;
+
+enum QFaultLatencyDistribution {
+    kQFaultLatencyDistributionNone = 0,
+    kQFaultLatencyDistributionUniform,          // latencyMean +/- latencySpread
+    kQFaultLatencyDistributionNormal,           // latencySpread is the standard deviation
+    kQFaultLatencyDistributionExponential       // latencySpread is ignored
+};
+typedef enum QFaultLatencyDistribution QFaultLatencyDistribution;
+
+struct QFaultPlan {
+    QFaultKind          kind;
+    NSTimeInterval      latency;
+    double              truncateFraction;       // for kQFaultKindTruncatedBody, how much of the body gets through
+};
+typedef struct QFaultPlan QFaultPlan;
+
+@interface QFaultSimulator : NSObject
+{
+    uint32_t                    _seed;
+    QFaultLatencyDistribution   _latencyDistribution;
+    NSTimeInterval              _latencyMean;
+    NSTimeInterval              _latencySpread;
+    NSDictionary *              _outageWindows;
+    double                      _serverErrorBurstRate;
+    NSUInteger                  _serverErrorBurstLength;
+    double                      _truncatedBodyRate;
+    double                      _trickleRate;
+    double                      _trickleBytesPerSecond;
+    double                      _wrongContentTypeRate;
+
+    CFAbsoluteTime              _startTime;
+    NSMutableDictionary *       _requestCountsByURL;
+    NSMutableDictionary *       _burstRemainingByHost;
+    NSUInteger                  _requestCount;
+    NSUInteger                  _faultCounts[kQFaultKindCount];
+    NSTimeInterval              _totalLatency;
+
+    NetworkOperationGroup *     _loadTestGroup;
+    NSUInteger                  _loadTestOperationCount;
+    NSUInteger                  _loadTestCompletedCount;
+    NSUInteger                  _loadTestSucceededCount;
+    CFAbsoluteTime              _loadTestStartTime;
+    NSTimer *                   _loadTestTimer;
+}
+
++ (QFaultSimulator *)sharedSimulator;
+
+// Configuration.  Set these before starting any operations.  The rates are probabilities
+// per request, between 0.0 and 1.0.
+
+@property (assign, readwrite) uint32_t                      seed;                   // default is 1
+@property (assign, readwrite) QFaultLatencyDistribution     latencyDistribution;    // default is none
+@property (assign, readwrite) NSTimeInterval                latencyMean;
+@property (assign, readwrite) NSTimeInterval                latencySpread;
+@property (copy,   readwrite) NSDictionary *                outageWindows;          // host -> NSArray of [start, duration] NSArrays, in seconds since -reset
+@property (assign, readwrite) double                        serverErrorBurstRate;   // chance that a request starts a burst of 503s for its host
+@property (assign, readwrite) NSUInteger                    serverErrorBurstLength; // default is 5 requests
+@property (assign, readwrite) double                        truncatedBodyRate;
+@property (assign, readwrite) double                        trickleRate;
+@property (assign, readwrite) double                        trickleBytesPerSecond;  // default is 2 KB/s
+@property (assign, readwrite) double                        wrongContentTypeRate;
+
+// Applies a configuration dictionary.  The keys are the property names above, except
+// that latencyDistribution is a string ("none", "uniform", "normal" or "exponential")
+// and outageWindows is spelt "outages".  Missing keys leave the property unchanged.
+// This also does a -reset.
+- (void)configureWithDictionary:(NSDictionary *)config;
+
+// Restarts the outage clock, forgets the per-URL request counts (so the same requests
+// get the same faults again) and clears the statistics.
+- (void)reset;
+
+// Called by QSimulatedConnection to decide what happens to a request.  Any thread.
+- (QFaultPlan)planForRequest:(NSURLRequest *)request;
+
+// Logs the number of requests and the faults injected so far.
+- (void)logReport;
+
+// Starts operationCount RetryingHTTPOperations getting url (each with a distinct query
+// string, so that each gets its own faults), and logs a report when they've all finished
+// or when duration has elapsed, whichever comes first.  Operations still running at that
+// point are cancelled and counted as incomplete.  Main thread only.
+- (void)startLoadTestWithURL:(NSURL *)url operationCount:(NSUInteger)operationCount duration:(NSTimeInterval)duration;
+
+@end
+
+// QSimulatedConnection is the QHTTPConnection that applies the simulator's plan.
+
+@interface QSimulatedConnection : NSObject <QHTTPConnection>
+{
+    NSURLRequest *          _request;
+    id                      _delegate;
+    QFaultPlan              _plan;
+    NSRunLoop *             _runLoop;
+    NSMutableArray *        _runLoopModes;
+    NSURLConnection *       _connection;
+    NSTimer *               _timer;
+    NSMutableData *         _trickleBuffer;
+    BOOL                    _trickleDone;
+    long long               _truncateAfterBytes;
+    long long               _bytesDelivered;
+    BOOL                    _finished;
+}
+
+@end
+
+#endif
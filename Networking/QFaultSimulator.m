@@ -0,0 +1,814 @@
+#import "QFaultSimulator.h"
+
+#if ! defined(NDEBUG)
+
+#import "NetworkManager.h"
+#import "RetryingHTTPOperation.h"
+#import "QHTTPResponseCache.h"
+#import "Logging.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+// If a truncated response doesn't say how long it is, we assume it's this long when
+// working out where to cut it off.
+
+static const long long      kTruncateAssumedLength = 64 * 1024;
+
+// A trickle delivers a chunk of the body this often.
+
+static const NSTimeInterval kTrickleInterval = 0.1;
+
+// How long after a load test's deadline we wait for the cancelled operations to wind
+// down before reporting.
+
+static const NSTimeInterval kLoadTestReportDelay = 1.0;
+
+static NSString * FaultKindName(QFaultKind kind)
+{
+    static NSString * const kNames[kQFaultKindCount] = { @"none", @"outage", @"serverError", @"truncatedBody", @"trickle", @"wrongContentType" };
+    assert(kind < kQFaultKindCount);
+    return kNames[kind];
+}
+
+// SplitMix64 finaliser; scrambles a 64-bit value so that nearby seeds give unrelated
+// random streams.
+
+static uint64_t MixBits(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+@interface QFaultSimulator ()
+
+- (void)loadTestDeadline:(NSTimer *)timer;
+- (void)finishLoadTest;
+
+@end
+
+@implementation QFaultSimulator
+
++ (QFaultSimulator *)sharedSimulator
+{
+    static QFaultSimulator * sSimulator;
+    // any thread; once sSimulator goes non-nil it never goes nil again
+    if (sSimulator == nil) {
+        @synchronized (self) {
+            if (sSimulator == nil) {
+                sSimulator = [[QFaultSimulator alloc] init];
+                assert(sSimulator != nil);
+            }
+        }
+    }
+    return sSimulator;
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self != nil) {
+        self->_seed                   = 1;
+        self->_serverErrorBurstLength = 5;
+        self->_trickleBytesPerSecond  = 2 * 1024;
+        self->_requestCountsByURL   = [[NSMutableDictionary alloc] init];
+        assert(self->_requestCountsByURL != nil);
+        self->_burstRemainingByHost = [[NSMutableDictionary alloc] init];
+        assert(self->_burstRemainingByHost != nil);
+        self->_startTime = CFAbsoluteTimeGetCurrent();
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    // This object lives for the entire life of the application.  Getting it to support being
+    // deallocated would be quite tricky (particularly from a threading perspective), so we
+    // don't even try.
+    assert(NO);
+    [super dealloc];
+}
+
+@synthesize seed                   = _seed;
+@synthesize latencyDistribution    = _latencyDistribution;
+@synthesize latencyMean            = _latencyMean;
+@synthesize latencySpread          = _latencySpread;
+@synthesize outageWindows          = _outageWindows;
+@synthesize serverErrorBurstRate   = _serverErrorBurstRate;
+@synthesize serverErrorBurstLength = _serverErrorBurstLength;
+@synthesize truncatedBodyRate      = _truncatedBodyRate;
+@synthesize trickleRate            = _trickleRate;
+@synthesize trickleBytesPerSecond  = _trickleBytesPerSecond;
+@synthesize wrongContentTypeRate   = _wrongContentTypeRate;
+
+#pragma mark - Configuration
+
+- (void)configureWithDictionary:(NSDictionary *)config
+{
+    id          value;
+    NSString *  distribution;
+
+    if (config != nil) {
+        value = [config objectForKey:@"seed"];
+        if (value != nil) {
+            self.seed = (uint32_t) [value unsignedIntValue];
+        }
+        distribution = [config objectForKey:@"latencyDistribution"];
+        if (distribution != nil) {
+            if ( [distribution isEqual:@"uniform"] ) {
+                self.latencyDistribution = kQFaultLatencyDistributionUniform;
+            } else if ( [distribution isEqual:@"normal"] ) {
+                self.latencyDistribution = kQFaultLatencyDistributionNormal;
+            } else if ( [distribution isEqual:@"exponential"] ) {
+                self.latencyDistribution = kQFaultLatencyDistributionExponential;
+            } else {
+                assert([distribution isEqual:@"none"]);
+                self.latencyDistribution = kQFaultLatencyDistributionNone;
+            }
+        }
+        value = [config objectForKey:@"latencyMean"];
+        if (value != nil) {
+            self.latencyMean = [value doubleValue];
+        }
+        value = [config objectForKey:@"latencySpread"];
+        if (value != nil) {
+            self.latencySpread = [value doubleValue];
+        }
+        value = [config objectForKey:@"outages"];
+        if (value != nil) {
+            assert([value isKindOfClass:[NSDictionary class]]);
+            self.outageWindows = value;
+        }
+        value = [config objectForKey:@"serverErrorBurstRate"];
+        if (value != nil) {
+            self.serverErrorBurstRate = [value doubleValue];
+        }
+        value = [config objectForKey:@"serverErrorBurstLength"];
+        if (value != nil) {
+            self.serverErrorBurstLength = [value unsignedIntegerValue];
+        }
+        value = [config objectForKey:@"truncatedBodyRate"];
+        if (value != nil) {
+            self.truncatedBodyRate = [value doubleValue];
+        }
+        value = [config objectForKey:@"trickleRate"];
+        if (value != nil) {
+            self.trickleRate = [value doubleValue];
+        }
+        value = [config objectForKey:@"trickleBytesPerSecond"];
+        if (value != nil) {
+            self.trickleBytesPerSecond = [value doubleValue];
+        }
+        value = [config objectForKey:@"wrongContentTypeRate"];
+        if (value != nil) {
+            self.wrongContentTypeRate = [value doubleValue];
+        }
+    }
+    [self reset];
+
+    [[QLog log] logWithFormat:@"%s seed %u, latency %d %.3f/%.3f, outages %@, 5xx %.3f x %zu, truncate %.3f, trickle %.3f @ %.0f B/s, content type %.3f",
+        __PRETTY_FUNCTION__,
+        (unsigned int) self.seed,
+        (int) self.latencyDistribution, self.latencyMean, self.latencySpread,
+        self.outageWindows,
+        self.serverErrorBurstRate, (size_t) self.serverErrorBurstLength,
+        self.truncatedBodyRate,
+        self.trickleRate, self.trickleBytesPerSecond,
+        self.wrongContentTypeRate
+    ];
+}
+
+- (void)reset
+{
+    @synchronized (self) {
+        self->_startTime = CFAbsoluteTimeGetCurrent();
+        [self->_requestCountsByURL removeAllObjects];
+        [self->_burstRemainingByHost removeAllObjects];
+        self->_requestCount = 0;
+        memset(self->_faultCounts, 0, sizeof(self->_faultCounts));
+        self->_totalLatency = 0.0;
+    }
+}
+
+#pragma mark - Planning
+
+// Returns a latency drawn from the configured distribution.  randomState is the request's
+// generator state.
+- (NSTimeInterval)latencyWithRandomState:(unsigned short *)randomState
+{
+    NSTimeInterval  result;
+    double          u1;
+    double          u2;
+
+    switch (self->_latencyDistribution) {
+        default:
+            assert(NO);
+            // fall through
+        case kQFaultLatencyDistributionNone: {
+            result = 0.0;
+        } break;
+        case kQFaultLatencyDistributionUniform: {
+            result = self->_latencyMean + (2.0 * erand48(randomState) - 1.0) * self->_latencySpread;
+        } break;
+        case kQFaultLatencyDistributionNormal: {
+            // Box-Muller.  1.0 - u1 keeps us away from log(0).
+            u1 = 1.0 - erand48(randomState);
+            u2 = erand48(randomState);
+            result = self->_latencyMean + self->_latencySpread * sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+        } break;
+        case kQFaultLatencyDistributionExponential: {
+            result = - self->_latencyMean * log(1.0 - erand48(randomState));
+        } break;
+    }
+    if (result < 0.0) {
+        result = 0.0;
+    }
+    return result;
+}
+
+// Returns YES if the host is inside one of its outage windows.  Must be called with
+// the lock held.
+- (BOOL)isOutageForHost:(NSString *)host
+{
+    NSTimeInterval  now;
+
+    now = CFAbsoluteTimeGetCurrent() - self->_startTime;
+    for (NSArray * window in [self->_outageWindows objectForKey:host]) {
+        NSTimeInterval  start;
+        NSTimeInterval  duration;
+
+        assert([window count] == 2);
+        start    = [[window objectAtIndex:0] doubleValue];
+        duration = [[window objectAtIndex:1] doubleValue];
+        if ( (now >= start) && (now < start + duration) ) {
+            return YES;
+        }
+    }
+    return NO;
+}
+
+- (QFaultPlan)planForRequest:(NSURLRequest *)request
+{
+    QFaultPlan          result;
+    NSString *          urlString;
+    NSString *          host;
+    NSUInteger          attempt;
+    NSUInteger          burstRemaining;
+    uint64_t            bits;
+    unsigned short      randomState[3];
+    double              u;
+
+    // any thread
+    assert(request != nil);
+
+    urlString = [[request URL] absoluteString];
+    host      = [[request URL] host];
+    if (host == nil) {
+        host = @"";
+    }
+
+    memset(&result, 0, sizeof(result));
+    @synchronized (self) {
+
+        // Seed a generator just for this request, so that what happens to it doesn't
+        // depend on what happened to the requests that beat it to the lock.
+
+        attempt = [[self->_requestCountsByURL objectForKey:urlString] unsignedIntegerValue];
+        [self->_requestCountsByURL setObject:[NSNumber numberWithUnsignedInteger:attempt + 1] forKey:urlString];
+
+        bits = MixBits( MixBits( MixBits(self->_seed) ^ (uint64_t) [urlString hash] ) ^ (uint64_t) attempt );
+        randomState[0] = (unsigned short) (bits >>  0);
+        randomState[1] = (unsigned short) (bits >> 16);
+        randomState[2] = (unsigned short) (bits >> 32);
+
+        result.latency = [self latencyWithRandomState:randomState];
+
+        // Outages trump everything, then 5xx bursts, and then the per-request faults.
+
+        burstRemaining = [[self->_burstRemainingByHost objectForKey:host] unsignedIntegerValue];
+        u = erand48(randomState);
+        if ( [self isOutageForHost:host] ) {
+            result.kind = kQFaultKindOutage;
+        } else if (burstRemaining != 0) {
+            result.kind = kQFaultKindServerError;
+            [self->_burstRemainingByHost setObject:[NSNumber numberWithUnsignedInteger:burstRemaining - 1] forKey:host];
+        } else if (u < self->_serverErrorBurstRate) {
+            result.kind = kQFaultKindServerError;
+            if (self->_serverErrorBurstLength > 1) {
+                [self->_burstRemainingByHost setObject:[NSNumber numberWithUnsignedInteger:self->_serverErrorBurstLength - 1] forKey:host];
+            }
+        } else {
+            u = erand48(randomState);
+            if (u < self->_truncatedBodyRate) {
+                result.kind = kQFaultKindTruncatedBody;
+                result.truncateFraction = erand48(randomState);
+            } else if (u < self->_truncatedBodyRate + self->_trickleRate) {
+                result.kind = kQFaultKindTrickle;
+            } else if (u < self->_truncatedBodyRate + self->_trickleRate + self->_wrongContentTypeRate) {
+                result.kind = kQFaultKindWrongContentType;
+            } else {
+                result.kind = kQFaultKindNone;
+            }
+        }
+
+        self->_requestCount += 1;
+        self->_faultCounts[result.kind] += 1;
+        self->_totalLatency += result.latency;
+    }
+
+    [[QLog log] logOption:kLogOptionNetworkDetails withFormat:@"%s %@ attempt %zu -> %@ after %.3f", __PRETTY_FUNCTION__, urlString, (size_t) attempt, FaultKindName(result.kind), result.latency];
+
+    return result;
+}
+
+#pragma mark - Reporting
+
+- (void)logReport
+{
+    NSMutableString *   faults;
+    NSUInteger          requestCount;
+    NSTimeInterval      meanLatency;
+
+    faults = [NSMutableString string];
+    assert(faults != nil);
+    @synchronized (self) {
+        requestCount = self->_requestCount;
+        meanLatency  = (requestCount == 0) ? 0.0 : self->_totalLatency / requestCount;
+        for (NSUInteger kind = 0; kind < kQFaultKindCount; kind++) {
+            [faults appendFormat:@" %@=%zu", FaultKindName((QFaultKind) kind), (size_t) self->_faultCounts[kind]];
+        }
+    }
+    [[QLog log] logWithFormat:@"%s requests %zu, mean injected latency %.3f, faults%@", __PRETTY_FUNCTION__, (size_t) requestCount, meanLatency, faults];
+}
+
+#pragma mark - Load test
+
+- (void)startLoadTestWithURL:(NSURL *)url operationCount:(NSUInteger)operationCount duration:(NSTimeInterval)duration
+{
+    NSString *  urlString;
+    NSString *  separator;
+
+    assert([NSThread isMainThread]);
+    assert(url != nil);
+    assert(operationCount != 0);
+    assert(duration > 0.0);
+    assert(self->_loadTestGroup == nil);           // one at a time
+
+    [[QLog log] logWithFormat:@"%s %zu operations for %.0f seconds against %@", __PRETTY_FUNCTION__, (size_t) operationCount, duration, url];
+
+    [self reset];
+    [RetryingHTTPOperation resetStatistics];
+
+    self->_loadTestGroup = [[NetworkOperationGroup alloc] initWithName:@"load test"];
+    assert(self->_loadTestGroup != nil);
+    self->_loadTestOperationCount = operationCount;
+    self->_loadTestCompletedCount = 0;
+    self->_loadTestSucceededCount = 0;
+    self->_loadTestStartTime = CFAbsoluteTimeGetCurrent();
+
+    // Give each operation a distinct query string; a static server ignores it, but it
+    // gives each operation its own random stream in -planForRequest:.
+
+    urlString = [url absoluteString];
+    separator = ([url query] == nil) ? @"?" : @"&";
+    for (NSUInteger operationIndex = 0; operationIndex < operationCount; operationIndex++) {
+        NSURL *                 operationURL;
+        RetryingHTTPOperation * operation;
+
+        operationURL = [NSURL URLWithString:[NSString stringWithFormat:@"%@%@loadTest=%zu", urlString, separator, (size_t) operationIndex]];
+        assert(operationURL != nil);
+
+        operation = [[[RetryingHTTPOperation alloc] initWithRequest:[[NetworkManager sharedManager] requestToGetURL:operationURL]] autorelease];
+        assert(operation != nil);
+
+        [[NetworkManager sharedManager] addNetworkManagementOperation:operation finishedTarget:self action:@selector(loadTestOperationDone:) group:self->_loadTestGroup];
+    }
+
+    self->_loadTestTimer = [[NSTimer scheduledTimerWithTimeInterval:duration target:self selector:@selector(loadTestDeadline:) userInfo:nil repeats:NO] retain];
+    assert(self->_loadTestTimer != nil);
+}
+
+- (void)loadTestOperationDone:(RetryingHTTPOperation *)operation
+{
+    assert([NSThread isMainThread]);
+    assert([operation isKindOfClass:[RetryingHTTPOperation class]]);
+
+    self->_loadTestCompletedCount += 1;
+    if (operation.error == nil) {
+        self->_loadTestSucceededCount += 1;
+    }
+    // Once the deadline has passed (_loadTestTimer is nil), the delayed report takes care of things.
+    if ( (self->_loadTestCompletedCount == self->_loadTestOperationCount) && (self->_loadTestTimer != nil) ) {
+        [self finishLoadTest];
+    }
+}
+
+- (void)loadTestDeadline:(NSTimer *)timer
+{
+    assert([NSThread isMainThread]);
+    assert(timer == self->_loadTestTimer);
+    #pragma unused(timer)
+
+    [[QLog log] logWithFormat:@"%s cancelling %zu operations", __PRETTY_FUNCTION__, (size_t) (self->_loadTestOperationCount - self->_loadTestCompletedCount)];
+    [[NetworkManager sharedManager] cancelOperationGroup:self->_loadTestGroup];
+    [self->_loadTestTimer release];
+    self->_loadTestTimer = nil;
+
+    // The cancelled operations record their statistics as they wind down on the network
+    // management thread, so give them a moment before reporting.
+
+    [self performSelector:@selector(finishLoadTest) withObject:nil afterDelay:kLoadTestReportDelay];
+}
+
+- (void)finishLoadTest
+{
+    NSTimeInterval  elapsed;
+
+    assert([NSThread isMainThread]);
+    assert(self->_loadTestGroup != nil);
+
+    elapsed = CFAbsoluteTimeGetCurrent() - self->_loadTestStartTime;
+    [[QLog log] logWithFormat:@"%s %zu of %zu completed (%.1f%%), %zu succeeded (%.1f%%), %zu incomplete, %.1f seconds",
+        __PRETTY_FUNCTION__,
+        (size_t) self->_loadTestCompletedCount, (size_t) self->_loadTestOperationCount,
+        100.0 * self->_loadTestCompletedCount / self->_loadTestOperationCount,
+        (size_t) self->_loadTestSucceededCount,
+        100.0 * self->_loadTestSucceededCount / self->_loadTestOperationCount,
+        (size_t) (self->_loadTestOperationCount - self->_loadTestCompletedCount),
+        elapsed
+    ];
+    [self logReport];
+    [[QLog log] logWithFormat:@"%s retry statistics %@", __PRETTY_FUNCTION__, [RetryingHTTPOperation statistics]];
+
+    [self->_loadTestTimer invalidate];
+    [self->_loadTestTimer release];
+    self->_loadTestTimer = nil;
+    [self->_loadTestGroup release];
+    self->_loadTestGroup = nil;
+}
+
+@end
+
+#pragma mark -
+
+@interface QSimulatedConnection ()
+
+- (void)startTimerWithInterval:(NSTimeInterval)interval selector:(SEL)selector repeats:(BOOL)repeats;
+- (void)stopTimer;
+
+@end
+
+@implementation QSimulatedConnection
+
+- (id)initWithRequest:(NSURLRequest *)request delegate:(id)delegate startImmediately:(BOOL)startImmediately
+{
+    assert(request != nil);
+    assert(delegate != nil);
+    self = [super init];
+    if (self != nil) {
+        self->_request = [request copy];
+        assert(self->_request != nil);
+        self->_delegate = [delegate retain];      // like NSURLConnection, we retain our delegate until we're done
+        self->_runLoopModes = [[NSMutableArray alloc] init];
+        assert(self->_runLoopModes != nil);
+        self->_truncateAfterBytes = -1;
+        if (startImmediately) {
+            [self scheduleInRunLoop:[NSRunLoop currentRunLoop] forMode:NSDefaultRunLoopMode];
+            [self start];
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    // The timer and the real connection both retain us, so they must be gone by now.
+    assert(self->_timer == nil);
+    assert(self->_connection == nil);
+    [self->_request release];
+    [self->_delegate release];
+    [self->_runLoop release];
+    [self->_runLoopModes release];
+    [self->_trickleBuffer release];
+    [super dealloc];
+}
+
+- (void)scheduleInRunLoop:(NSRunLoop *)runLoop forMode:(NSString *)mode
+{
+    assert(runLoop != nil);
+    assert(mode != nil);
+    if (self->_runLoop == nil) {
+        self->_runLoop = [runLoop retain];
+    }
+    assert(runLoop == self->_runLoop);          // we only support one run loop
+    [self->_runLoopModes addObject:mode];
+}
+
+- (void)start
+{
+    assert(self->_runLoop != nil);
+    assert(self->_timer == nil);
+    assert(self->_connection == nil);
+
+    self->_plan = [[QFaultSimulator sharedSimulator] planForRequest:self->_request];
+    [self startTimerWithInterval:self->_plan.latency selector:@selector(latencyTimerDone:) repeats:NO];
+}
+
+- (void)cancel
+{
+    [[self retain] autorelease];
+    self->_finished = YES;
+    [self stopTimer];
+    if (self->_connection != nil) {
+        [self->_connection cancel];
+        [self->_connection release];
+        self->_connection = nil;
+    }
+    [self->_delegate release];
+    self->_delegate = nil;
+}
+
+#pragma mark - Timers
+
+- (void)startTimerWithInterval:(NSTimeInterval)interval selector:(SEL)selector repeats:(BOOL)repeats
+{
+    assert(self->_timer == nil);
+    self->_timer = [[NSTimer timerWithTimeInterval:interval target:self selector:selector userInfo:nil repeats:repeats] retain];
+    assert(self->_timer != nil);
+    for (NSString * mode in self->_runLoopModes) {
+        [self->_runLoop addTimer:self->_timer forMode:mode];
+    }
+}
+
+- (void)stopTimer
+{
+    if (self->_timer != nil) {
+        [self->_timer invalidate];
+        [self->_timer release];
+        self->_timer = nil;
+    }
+}
+
+#pragma mark - Delivering to our delegate
+
+// Each of these does nothing once we've finished, because the delegate may have
+// cancelled us from within an earlier callback.
+
+- (void)deliverResponse:(NSURLResponse *)response
+{
+    if ( ! self->_finished ) {
+        [self->_delegate connection:(NSURLConnection *) self didReceiveResponse:response];
+    }
+}
+
+- (void)deliverData:(NSData *)data
+{
+    if ( ! self->_finished && ([data length] != 0) ) {
+        self->_bytesDelivered += (long long) [data length];
+        [self->_delegate connection:(NSURLConnection *) self didReceiveData:data];
+    }
+}
+
+- (void)deliverFinish
+{
+    id  delegate;
+
+    if ( ! self->_finished ) {
+        self->_finished = YES;
+        [self stopTimer];
+        delegate = [self->_delegate autorelease];
+        self->_delegate = nil;
+        [delegate connectionDidFinishLoading:(NSURLConnection *) self];
+    }
+}
+
+- (void)deliverError:(NSError *)error
+{
+    id  delegate;
+
+    assert(error != nil);
+    if ( ! self->_finished ) {
+        self->_finished = YES;
+        [self stopTimer];
+        delegate = [self->_delegate autorelease];
+        self->_delegate = nil;
+        [delegate connection:(NSURLConnection *) self didFailWithError:error];
+    }
+}
+
+- (void)deliverErrorWithCode:(NSInteger)code
+{
+    [self deliverError:[NSError errorWithDomain:NSURLErrorDomain code:code userInfo:[NSDictionary dictionaryWithObject:[self->_request URL] forKey:NSURLErrorFailingURLErrorKey]]];
+}
+
+#pragma mark - Faults
+
+- (void)latencyTimerDone:(NSTimer *)timer
+{
+    assert(timer == self->_timer);
+    #pragma unused(timer)
+
+    [[self retain] autorelease];
+    [self stopTimer];
+
+    switch (self->_plan.kind) {
+        case kQFaultKindOutage: {
+            [self deliverErrorWithCode:NSURLErrorCannotConnectToHost];
+        } break;
+        case kQFaultKindServerError: {
+            NSHTTPURLResponse * response;
+
+            response = [[[QHTTPStoredResponse alloc] initWithURL:[self->_request URL]
+                statusCode:503
+                headerFields:[NSDictionary dictionaryWithObjectsAndKeys:@"text/plain", @"Content-Type", @"0", @"Content-Length", @"1", @"Retry-After", nil]
+            ] autorelease];
+            assert(response != nil);
+            [self deliverResponse:response];
+            [self deliverFinish];
+        } break;
+        default: {
+            // Everything else needs a real response to tamper with.
+
+            self->_connection = [[NSURLConnection alloc] initWithRequest:self->_request delegate:self startImmediately:NO];
+            assert(self->_connection != nil);
+            for (NSString * mode in self->_runLoopModes) {
+                [self->_connection scheduleInRunLoop:self->_runLoop forMode:mode];
+            }
+            [self->_connection start];
+        } break;
+    }
+}
+
+// Cuts the real connection off mid-body.
+- (void)dropConnection
+{
+    [self->_connection cancel];
+    [self->_connection release];
+    self->_connection = nil;
+    [self deliverErrorWithCode:NSURLErrorNetworkConnectionLost];
+}
+
+- (void)trickleTimerDone:(NSTimer *)timer
+{
+    NSUInteger  chunkLength;
+
+    assert(timer == self->_timer);
+    #pragma unused(timer)
+
+    [[self retain] autorelease];
+
+    chunkLength = (NSUInteger) ([[QFaultSimulator sharedSimulator] trickleBytesPerSecond] * kTrickleInterval);
+    if (chunkLength == 0) {
+        chunkLength = 1;
+    }
+    if (chunkLength > [self->_trickleBuffer length]) {
+        chunkLength = [self->_trickleBuffer length];
+    }
+    [self deliverData:[self->_trickleBuffer subdataWithRange:NSMakeRange(0, chunkLength)]];
+    [self->_trickleBuffer replaceBytesInRange:NSMakeRange(0, chunkLength) withBytes:NULL length:0];
+
+    if ([self->_trickleBuffer length] == 0) {
+        if (self->_trickleDone) {
+            [self deliverFinish];
+        } else {
+            [self stopTimer];           // restarted when more data arrives
+        }
+    }
+}
+
+#pragma mark - Real connection delegate callbacks
+
+- (NSURLRequest *)connection:(NSURLConnection *)connection willSendRequest:(NSURLRequest *)request redirectResponse:(NSURLResponse *)response
+{
+    assert(connection == self->_connection);
+    #pragma unused(connection)
+    if ( ! self->_finished && [self->_delegate respondsToSelector:@selector(connection:willSendRequest:redirectResponse:)] ) {
+        request = [self->_delegate connection:(NSURLConnection *) self willSendRequest:request redirectResponse:response];
+    }
+    return request;
+}
+
+- (BOOL)connection:(NSURLConnection *)connection canAuthenticateAgainstProtectionSpace:(NSURLProtectionSpace *)protectionSpace
+{
+    assert(connection == self->_connection);
+    #pragma unused(connection)
+    return ! self->_finished
+        && [self->_delegate respondsToSelector:@selector(connection:canAuthenticateAgainstProtectionSpace:)]
+        && [self->_delegate connection:(NSURLConnection *) self canAuthenticateAgainstProtectionSpace:protectionSpace];
+}
+
+- (void)connection:(NSURLConnection *)connection didReceiveAuthenticationChallenge:(NSURLAuthenticationChallenge *)challenge
+{
+    assert(connection == self->_connection);
+    #pragma unused(connection)
+    if ( ! self->_finished && [self->_delegate respondsToSelector:@selector(connection:didReceiveAuthenticationChallenge:)] ) {
+        [self->_delegate connection:(NSURLConnection *) self didReceiveAuthenticationChallenge:challenge];
+    } else {
+        [[challenge sender] cancelAuthenticationChallenge:challenge];
+    }
+}
+
+- (void)connection:(NSURLConnection *)connection didReceiveResponse:(NSURLResponse *)response
+{
+    long long   expectedLength;
+
+    assert(connection == self->_connection);
+    #pragma unused(connection)
+
+    [[self retain] autorelease];
+
+    if ( (self->_plan.kind == kQFaultKindWrongContentType) && [response isKindOfClass:[NSHTTPURLResponse class]] ) {
+        NSHTTPURLResponse *     httpResponse;
+        NSMutableDictionary *   headers;
+
+        // Pretend to be a captive portal's login page.
+
+        httpResponse = (NSHTTPURLResponse *) response;
+        headers = [[[httpResponse allHeaderFields] mutableCopy] autorelease];
+        assert(headers != nil);
+        [headers setObject:@"text/html; charset=utf-8" forKey:@"Content-Type"];
+        response = [[[QHTTPStoredResponse alloc] initWithURL:[httpResponse URL] statusCode:[httpResponse statusCode] headerFields:headers] autorelease];
+        assert(response != nil);
+    }
+    if (self->_plan.kind == kQFaultKindTruncatedBody) {
+        expectedLength = [response expectedContentLength];
+        if (expectedLength <= 0) {
+            expectedLength = kTruncateAssumedLength;
+        }
+        self->_truncateAfterBytes = (long long) (expectedLength * self->_plan.truncateFraction);
+        self->_bytesDelivered = 0;
+    }
+    [self deliverResponse:response];
+}
+
+- (void)connection:(NSURLConnection *)connection didReceiveData:(NSData *)data
+{
+    long long   remaining;
+
+    assert(connection == self->_connection);
+    #pragma unused(connection)
+
+    [[self retain] autorelease];
+
+    switch (self->_plan.kind) {
+        case kQFaultKindTrickle: {
+            if (self->_trickleBuffer == nil) {
+                self->_trickleBuffer = [[NSMutableData alloc] init];
+                assert(self->_trickleBuffer != nil);
+            }
+            [self->_trickleBuffer appendData:data];
+            if (self->_timer == nil) {
+                [self startTimerWithInterval:kTrickleInterval selector:@selector(trickleTimerDone:) repeats:YES];
+            }
+        } break;
+        case kQFaultKindTruncatedBody: {
+            remaining = self->_truncateAfterBytes - self->_bytesDelivered;
+            if ( (long long) [data length] < remaining ) {
+                [self deliverData:data];
+            } else {
+                [self deliverData:[data subdataWithRange:NSMakeRange(0, (NSUInteger) remaining)]];
+                [self dropConnection];
+            }
+        } break;
+        default: {
+            [self deliverData:data];
+        } break;
+    }
+}
+
+- (void)connectionDidFinishLoading:(NSURLConnection *)connection
+{
+    assert(connection == self->_connection);
+    #pragma unused(connection)
+
+    [[self retain] autorelease];
+    [self->_connection release];
+    self->_connection = nil;
+
+    if ( (self->_plan.kind == kQFaultKindTrickle) && ([self->_trickleBuffer length] != 0) ) {
+        self->_trickleDone = YES;               // -trickleTimerDone: finishes once the buffer drains
+    } else if (self->_plan.kind == kQFaultKindTruncatedBody) {
+        // The body was shorter than our cut-off point; drop the connection anyway,
+        // as if the final segment got lost.
+        [self deliverErrorWithCode:NSURLErrorNetworkConnectionLost];
+    } else {
+        [self deliverFinish];
+    }
+}
+
+- (void)connection:(NSURLConnection *)connection didFailWithError:(NSError *)error
+{
+    assert(connection == self->_connection);
+    #pragma unused(connection)
+
+    [[self retain] autorelease];
+    [self->_connection release];
+    self->_connection = nil;
+    [self deliverError:error];
+}
+
+@end
+
+#endif
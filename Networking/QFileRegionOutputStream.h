@@ -0,0 +1,43 @@
+#import <Foundation/Foundation.h>
+
+/*
+    QFileRegionOutputStream is an output stream that writes into an existing file
+    starting at a given offset, without truncating it.  NSOutputStream's file streams
+    either truncate the file or append to it, neither of which lets several downloads
+    fill in disjoint regions of the same file (see SegmentedHTTPOperation).
+
+    If you give it a length, it never writes outside of the region that starts at
+    offset and is that long.  Bytes beyond the end of the region are accepted and
+    dropped, so a server that sends more than it was asked for (say, the whole
+    resource in response to a Range request) can't scribble over the rest of the
+    file; SegmentedHTTPOperation notices the bad Content-Range and falls back.
+
+    It only supports synchronous use, which is how QHTTPOperation uses its
+    responseOutputStream: -open, then -write:maxLength: until done, then -close.
+    It never blocks for long (each write is a pwrite), so it ignores run loop
+    scheduling and never calls its delegate.
+
+    将数据从指定的偏移量开始写入一个已存在的文件, 不会截断文件.
+*/
+
+@interface QFileRegionOutputStream : NSOutputStream
+{
+    NSString *              _path;
+    unsigned long long      _offset;
+    unsigned long long      _endOffset;
+    int                     _fd;
+    NSStreamStatus          _status;
+    unsigned long long      _droppedLength;
+    NSError *               _error;
+    id<NSStreamDelegate>    _delegate;
+}
+
+// The file at path must exist by the time the stream is opened.
+- (id)initWithPath:(NSString *)path offset:(unsigned long long)offset length:(unsigned long long)length;
+- (id)initWithPath:(NSString *)path offset:(unsigned long long)offset;    // no limit on the length
+
+@property (copy,   readonly ) NSString *            path;
+@property (assign, readonly ) unsigned long long    offset;     // where the next write goes
+@property (assign, readonly ) unsigned long long    droppedLength;  // bytes dropped because they were past the end of the region
+
+@end
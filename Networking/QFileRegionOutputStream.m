@@ -0,0 +1,158 @@
+#import "QFileRegionOutputStream.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+
+@implementation QFileRegionOutputStream
+
+- (id)initWithPath:(NSString *)path offset:(unsigned long long)offset length:(unsigned long long)length
+{
+    assert(path != nil);
+    self = [super init];
+    if (self != nil) {
+        self->_path      = [path copy];
+        self->_offset    = offset;
+        self->_endOffset = (length > (ULLONG_MAX - offset)) ? ULLONG_MAX : (offset + length);
+        self->_fd        = -1;
+        self->_status    = NSStreamStatusNotOpen;
+    }
+    return self;
+}
+
+- (id)initWithPath:(NSString *)path offset:(unsigned long long)offset
+{
+    return [self initWithPath:path offset:offset length:ULLONG_MAX];
+}
+
+- (void)dealloc
+{
+    if (self->_fd != -1) {
+        (void) close(self->_fd);
+    }
+    [self->_path release];
+    [self->_error release];
+    [super dealloc];
+}
+
+@synthesize path   = _path;
+@synthesize offset = _offset;
+@synthesize droppedLength = _droppedLength;
+
+- (void)failWithErrno:(int)err
+{
+    [self->_error release];
+    self->_error = [[NSError alloc] initWithDomain:NSPOSIXErrorDomain code:err userInfo:nil];
+    self->_status = NSStreamStatusError;
+}
+
+#pragma mark - NSStream overrides
+
+- (void)open
+{
+    assert(self->_status == NSStreamStatusNotOpen);
+
+    self->_fd = open([self.path fileSystemRepresentation], O_WRONLY);
+    if (self->_fd == -1) {
+        [self failWithErrno:errno];
+    } else {
+        self->_status = NSStreamStatusOpen;
+    }
+}
+
+- (void)close
+{
+    if (self->_fd != -1) {
+        (void) close(self->_fd);
+        self->_fd = -1;
+    }
+    if (self->_status != NSStreamStatusError) {
+        self->_status = NSStreamStatusClosed;
+    }
+}
+
+- (NSStreamStatus)streamStatus
+{
+    return self->_status;
+}
+
+- (NSError *)streamError
+{
+    return [[self->_error retain] autorelease];
+}
+
+- (id<NSStreamDelegate>)delegate
+{
+    return self->_delegate;
+}
+
+- (void)setDelegate:(id<NSStreamDelegate>)delegate
+{
+    self->_delegate = delegate;
+}
+
+- (id)propertyForKey:(NSString *)key
+{
+    if ([key isEqual:NSStreamFileCurrentOffsetKey]) {
+        return [NSNumber numberWithUnsignedLongLong:self.offset];
+    }
+    return nil;
+}
+
+- (BOOL)setProperty:(id)property forKey:(NSString *)key
+{
+    #pragma unused(property)
+    #pragma unused(key)
+    return NO;
+}
+
+- (void)scheduleInRunLoop:(NSRunLoop *)runLoop forMode:(NSString *)mode
+{
+    #pragma unused(runLoop)
+    #pragma unused(mode)
+}
+
+- (void)removeFromRunLoop:(NSRunLoop *)runLoop forMode:(NSString *)mode
+{
+    #pragma unused(runLoop)
+    #pragma unused(mode)
+}
+
+#pragma mark - NSOutputStream overrides
+
+- (NSInteger)write:(const uint8_t *)buffer maxLength:(NSUInteger)len
+{
+    ssize_t     bytesWritten;
+    size_t      bytesToWrite;
+
+    if (self->_status != NSStreamStatusOpen) {
+        return -1;
+    }
+    
+    // Anything past the end of the region is dropped, but we say we wrote it, so that 
+    // the download carries on to the end and the client can see what went wrong.
+    
+    bytesToWrite = len;
+    if ( (unsigned long long) len > (self->_endOffset - self->_offset) ) {
+        bytesToWrite = (size_t) (self->_endOffset - self->_offset);
+    }
+    if (bytesToWrite == 0) {
+        self->_droppedLength += len;
+        return (NSInteger) len;
+    }
+    bytesWritten = pwrite(self->_fd, buffer, bytesToWrite, (off_t) self->_offset);
+    if (bytesWritten < 0) {
+        [self failWithErrno:errno];
+        return -1;
+    }
+    self->_offset += (unsigned long long) bytesWritten;
+    return (NSInteger) bytesWritten;
+}
+
+- (BOOL)hasSpaceAvailable
+{
+    return (self->_status == NSStreamStatusOpen);
+}
+
+@end
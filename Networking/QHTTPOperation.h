@@ -1,5 +1,7 @@
 #import "QRunLoopOperation.h"
 
+#include <CommonCrypto/CommonDigest.h>
+
 /*
     QHTTPOperation is a general purpose NSOperation that runs an HTTP request. 
     You initialise it with an HTTP request and then, when you run the operation, 
@@ -48,6 +50,10 @@
 
     o There are a variety of funky debugging options to simulator errors 
       and delays.
+
+    o You can answer requests from an on-disk HTTP cache, with revalidation, 
+      by setting responseCache (see QHTTPResponseCache).
+
       
     Finally, it's perfectly reasonable to subclass QHTTPOperation to meet you 
     own specific needs.  Specifically, it's common for the subclass to 
@@ -58,6 +64,25 @@
 */
 
 @protocol QHTTPOperationAuthenticationDelegate;
+@class QHTTPResponseCache;
+
+// QHTTPConnection is the part of NSURLConnection that QHTTPOperation uses.  The request 
+// always goes over an NSURLConnection in the end; the protocol exists so that the two 
+// layers we put in front of it, QHTTPCachingConnection (for responseCache) and, in debug 
+// builds, QSimulatedConnection (see QFaultSimulator.h), can stand in for it.  Such a 
+// class must deliver the NSURLConnection delegate callbacks listed in QHTTPOperation 
+// (NSURLConnectionDelegate) below on the run loop it was scheduled on, passing itself 
+// as the connection parameter.
+// NSURLConnection 的接口, 供响应缓存和故障模拟器使用.
+
+@protocol QHTTPConnection <NSObject>
+
+- (id)initWithRequest:(NSURLRequest *)request delegate:(id)delegate startImmediately:(BOOL)startImmediately;
+- (void)scheduleInRunLoop:(NSRunLoop *)runLoop forMode:(NSString *)mode;
+- (void)start;
+- (void)cancel;
+
+@end
 
 extern NSString * kQHTTPOperationErrorDomain;
 
@@ -82,12 +107,20 @@ enum {
     NSOutputStream *    _responseOutputStream;
     NSUInteger          _defaultResponseSize;
     NSUInteger          _maximumResponseSize;
-    NSURLConnection *   _connection;
+    id<QHTTPConnection> _connection;
     BOOL                _firstData;         // 用来标识,是否已经初始化了 dataAccumulator
     NSMutableData *     _dataAccumulator;   // 用来保存陆续到来的网络回应数据
+    long long           _budgetedBytes;     // bytes of _dataAccumulator reported to MemoryBudget
     NSURLRequest *      _lastRequest;
     NSHTTPURLResponse * _lastResponse;      // 因为URL请求可能有重定向的情况,所以此属性保存最近一次的服务器HTTP回应头信息
     NSData *            _responseBody;      // 用于保存服务器的回应数据,是在回应数据传输完成以后,将 _dataAccumulator 的值付给 responseBody
+    BOOL                _computesResponseDigest;
+    CC_SHA1_CTX *       _responseDigestContext; // 写入 responseOutputStream 的数据边写边算 SHA-1
+    NSString *          _responseDigest;
+    QHTTPResponseCache *    _responseCache;
+    long long           _responseBytesFromCache;
+    long long           _responseBytesFromNetwork;
+    CFAbsoluteTime      _transferStartTime;
 #if ! defined(NDEBUG)
     NSError *           _debugError;
     NSTimeInterval      _debugDelay;
@@ -98,6 +131,15 @@ enum {
 - (id)initWithRequest:(NSURLRequest *)request;      // designated
 - (id)initWithURL:(NSURL *)url;                     // convenience, calls +[NSURLRequest requestWithURL:]
 
+// The class of the connection used by operations that start from now on.  This is 
+// NSURLConnection, except in debug builds, where the fault simulator can set it to 
+// QSimulatedConnection.  That applies to every QHTTPOperation, subclasses included, so 
+// it's done once, before any operations are queued.
++ (Class)connectionClass;
+#if ! defined(NDEBUG)
++ (void)setConnectionClass:(Class)newValue;
+#endif
+
 
 
 //注意这些 property 都是线程安全的 atomic
@@ -114,6 +156,7 @@ enum {
 @property (copy,   readwrite) NSIndexSet *          acceptableStatusCodes;  // default is nil, implying 200..299
 @property (copy,   readwrite) NSSet *               acceptableContentTypes; // default is nil, implying anything is acceptable,接收到的网络数据类型MIMEType是否可用
 @property (assign, readwrite) id<QHTTPOperationAuthenticationDelegate>  authenticationDelegate;
+@property (retain, readwrite) QHTTPResponseCache *  responseCache;          // default is nil, which always goes to the network
 
 #if ! defined(NDEBUG)
 @property (copy,   readwrite) NSError *             debugError;             // default is nil
@@ -139,6 +182,14 @@ enum {
 @property (assign, readwrite) NSUInteger            maximumResponseSize;    // default is 4 MB, ignored if responseOutputStream is set
                                                                             // defaults are 1/4 of the above on embedded
 
+// If computesResponseDigest is set, the operation computes the SHA-1 of the data it 
+// writes to responseOutputStream as that data arrives, so a client that wants to 
+// identify a download by its content doesn't have to read the file back in.  It's 
+// ignored if responseOutputStream is nil.
+// 在数据到达时顺便计算 SHA-1, 这样调用者就不用把文件再读一遍.
+
+@property (assign, readwrite) BOOL                  computesResponseDigest; // default is NO
+
 // Things that are only meaningful after a response has been received;
 @property (assign, readonly, getter=isStatusCodeAcceptable)  BOOL statusCodeAcceptable;
 @property (assign, readonly, getter=isContentTypeAcceptable) BOOL contentTypeAcceptable;
@@ -151,6 +202,17 @@ enum {
 @property (copy,   readonly)  NSHTTPURLResponse *   lastResponse;       
 
 @property (copy,   readonly)  NSData *              responseBody;   
+@property (copy,   readonly)  NSString *            responseDigest;         // lowercase hex SHA-1 of the streamed body, or nil
+
+// How much of the response body came from responseCache and how much came over the 
+// network.  A revalidated response counts as coming from the cache.
+@property (assign, readonly)  long long             responseBytesFromCache;
+@property (assign, readonly)  long long             responseBytesFromNetwork;
+
+// When the connection was started, which can be long after the operation was queued if 
+// the transfer queue is busy, or 0 if it never was.  Throughput estimates should be 
+// measured from here.
+@property (assign, readonly)  CFAbsoluteTime        transferStartTime;
 
 @end
 
@@ -1,4 +1,6 @@
 #import "QHTTPOperation.h"
+#import "MemoryBudget.h"
+#import "QHTTPResponseCache.h"
 
 // kQHTTPOperationErrorDomain 已经在.h 文件中声明为了extern 存储类型
 NSString * kQHTTPOperationErrorDomain = @"kQHTTPOperationErrorDomain";
@@ -10,9 +12,11 @@ NSString * kQHTTPOperationErrorDomain = @"kQHTTPOperationErrorDomain";
 // Read/write versions of public properties
 @property (copy,   readwrite) NSURLRequest *        lastRequest;
 @property (copy,   readwrite) NSHTTPURLResponse *   lastResponse;
+@property (assign, readwrite) long long             responseBytesFromCache;
+@property (assign, readwrite) long long             responseBytesFromNetwork;
 
 // Internal properties
-@property (retain, readwrite) NSURLConnection *     connection;
+@property (retain, readwrite) id<QHTTPConnection>  connection;
 //一般为 C primitive properties 指定为 assign
 @property (assign, readwrite) BOOL                  firstData;        //用来标识,是否已经初始化了 dataAccumulator
 @property (retain, readwrite) NSMutableData *       dataAccumulator;  //用来保存陆续到来的网络回应数据
@@ -26,6 +30,19 @@ NSString * kQHTTPOperationErrorDomain = @"kQHTTPOperationErrorDomain";
 
 
 
+// NSURLConnection already implements everything in QHTTPConnection; this just tells the compiler.
+
+@interface NSURLConnection (QHTTPConnection) <QHTTPConnection>
+@end
+
+#if ! defined(NDEBUG)
+
+// The connection class, as set by +setConnectionClass:; Nil means NSURLConnection.
+
+static Class sConnectionClass;
+
+#endif
+
 @implementation QHTTPOperation
 #pragma mark - NS_DESIGNATED_INITIALIZER and finalise
 
@@ -77,9 +94,45 @@ NSString * kQHTTPOperationErrorDomain = @"kQHTTPOperationErrorDomain";
     [self->_lastRequest release];
     [self->_lastResponse release];
     [self->_responseBody release];
+    free(self->_responseDigestContext);
+    [self->_responseDigest release];
+    [self->_responseCache release];
     [super dealloc];
 }
 
+#pragma mark - Transport
+
++ (Class)connectionClass
+{
+    Class   result;
+    
+    // any thread
+    result = Nil;
+    #if ! defined(NDEBUG)
+        @synchronized ([QHTTPOperation class]) {
+            result = sConnectionClass;
+        }
+    #endif
+    if (result == Nil) {
+        result = [NSURLConnection class];
+    }
+    return result;
+}
+
+#if ! defined(NDEBUG)
+
++ (void)setConnectionClass:(Class)newValue
+{
+    // any thread
+    assert( (newValue == Nil) || [newValue instancesRespondToSelector:@selector(initWithRequest:delegate:startImmediately:)] );
+    assert( (newValue == Nil) || [newValue instancesRespondToSelector:@selector(scheduleInRunLoop:forMode:)] );
+    @synchronized ([QHTTPOperation class]) {
+        sConnectionClass = newValue;
+    }
+}
+
+#endif
+
 #pragma mark - Properties
 
 @synthesize request = _request;
@@ -92,6 +145,12 @@ NSString * kQHTTPOperationErrorDomain = @"kQHTTPOperationErrorDomain";
 @synthesize lastRequest     = _lastRequest;
 @synthesize lastResponse    = _lastResponse;
 @synthesize responseBody    = _responseBody;
+@synthesize computesResponseDigest = _computesResponseDigest;
+@synthesize responseDigest  = _responseDigest;
+@synthesize responseCache   = _responseCache;
+@synthesize responseBytesFromCache   = _responseBytesFromCache;
+@synthesize responseBytesFromNetwork = _responseBytesFromNetwork;
+@synthesize transferStartTime        = _transferStartTime;
 
 @synthesize connection      = _connection;
 @synthesize firstData       = _firstData;
@@ -311,7 +370,8 @@ NSString * kQHTTPOperationErrorDomain = @"kQHTTPOperationErrorDomain";
  *
  *   本方法是在 NetworkManger 的 网络传输队列(queueForNetworkTransfers)里执行的.
  *
- *   Called by QRunLoopOperation when the operation starts.  This kicks of an asynchronous NSURLConnection.
+ *   Called by QRunLoopOperation when the operation starts.  This kicks of an asynchronous NSURLConnection 
+ *   (or whatever +connectionClass says).
  */
 - (void)operationDidStart
 {
@@ -332,9 +392,14 @@ NSString * kQHTTPOperationErrorDomain = @"kQHTTPOperationErrorDomain";
     }
 #endif
 
-    // Create a connection that's scheduled in the required run loop modes.
+    // Create a connection that's scheduled in the required run loop modes.  If we have 
+    // a response cache, the caching connection runs +connectionClass underneath.
     assert(self.connection == nil);
-    self.connection = [[[NSURLConnection alloc] initWithRequest:self.request delegate:self startImmediately:NO] autorelease];
+    if (self.responseCache != nil) {
+        self.connection = [[[QHTTPCachingConnection alloc] initWithRequest:self.request delegate:self cache:self.responseCache] autorelease];
+    } else {
+        self.connection = [[[[QHTTPOperation connectionClass] alloc] initWithRequest:self.request delegate:self startImmediately:NO] autorelease];
+    }
     assert(self.connection != nil);
     
     for (NSString * mode in self.actualRunLoopModes) {
@@ -344,6 +409,7 @@ NSString * kQHTTPOperationErrorDomain = @"kQHTTPOperationErrorDomain";
     }
     
     // Causes the connection to begin loading data
+    self->_transferStartTime = CFAbsoluteTimeGetCurrent();
     [self.connection start];
 }
 
@@ -366,6 +432,12 @@ NSString * kQHTTPOperationErrorDomain = @"kQHTTPOperationErrorDomain";
         }
 #endif
 
+    // Grab the caching connection's byte counts before we let it go.
+    if (self.responseCache != nil) {
+        self.responseBytesFromCache   = ((QHTTPCachingConnection *) self.connection).bytesFromCache;
+        self.responseBytesFromNetwork = ((QHTTPCachingConnection *) self.connection).bytesFromNetwork;
+    }
+
     [self.connection cancel];
     self.connection = nil;
 
@@ -376,6 +448,13 @@ NSString * kQHTTPOperationErrorDomain = @"kQHTTPOperationErrorDomain";
     if (self.responseOutputStream != nil) {
         [self.responseOutputStream close];
     }
+    
+    // Once we've finished, the response body belongs to our client, so we stop 
+    // counting it against the memory budget.
+    if (self->_budgetedBytes != 0) {
+        [[MemoryBudget sharedBudget] adjustBytes:-self->_budgetedBytes forSubsystem:kMemoryBudgetSubsystemResponseBuffers];
+        self->_budgetedBytes = 0;
+    }
 }
 
 
@@ -618,6 +697,10 @@ NSString * kQHTTPOperationErrorDomain = @"kQHTTPOperationErrorDomain";
     #pragma unused(connection)
     assert(data != nil);
     
+    if (self.responseCache == nil) {
+        self.responseBytesFromNetwork += (long long) [data length];
+    }
+    
     // If we don't yet have a destination for the data, calculate one.
     // Note that, even if there is an output stream, we don't use it for error responses.
     success = YES;
@@ -650,6 +733,13 @@ NSString * kQHTTPOperationErrorDomain = @"kQHTTPOperationErrorDomain";
             if (self.dataAccumulator == nil) {
                 assert(self.responseOutputStream != nil);
                 [self.responseOutputStream open];
+                
+                if (self.computesResponseDigest) {
+                    assert(self->_responseDigestContext == NULL);
+                    self->_responseDigestContext = malloc(sizeof(*self->_responseDigestContext));
+                    assert(self->_responseDigestContext != NULL);
+                    (void) CC_SHA1_Init(self->_responseDigestContext);
+                }
             }
         }
         
@@ -663,6 +753,8 @@ NSString * kQHTTPOperationErrorDomain = @"kQHTTPOperationErrorDomain";
         if (self.dataAccumulator != nil) { //输出到内存,而不是文件
             if ( ([self.dataAccumulator length] + [data length]) <= self.maximumResponseSize ) {
                 [self.dataAccumulator appendData:data];
+                self->_budgetedBytes += [data length];
+                [[MemoryBudget sharedBudget] adjustBytes:(long long) [data length] forSubsystem:kMemoryBudgetSubsystemResponseBuffers];
             } else {  //太大了
                 [self finishWithError:[NSError errorWithDomain:kQHTTPOperationErrorDomain code:kQHTTPOperationErrorResponseTooLarge userInfo:nil]];
             }
@@ -701,6 +793,8 @@ NSString * kQHTTPOperationErrorDomain = @"kQHTTPOperationErrorDomain";
             
             if (error != nil) {//遇到错误,就不用继续,直接 cancel 这个 operation
                 [self finishWithError:error];
+            } else if (self->_responseDigestContext != NULL) {
+                (void) CC_SHA1_Update(self->_responseDigestContext, dataPtr, (CC_LONG) dataLength);
             }
         }
     }
@@ -733,6 +827,19 @@ NSString * kQHTTPOperationErrorDomain = @"kQHTTPOperationErrorDomain";
     } else if ( ! self.isContentTypeAcceptable ) { //检查 接收到的网络数据类型 MIMEType 是否可用,默认为 nil,表示所有的都可用
         [self finishWithError:[NSError errorWithDomain:kQHTTPOperationErrorDomain code:kQHTTPOperationErrorBadContentType userInfo:nil]];
     } else {
+        if (self->_responseDigestContext != NULL) {
+            unsigned char       digest[CC_SHA1_DIGEST_LENGTH];
+            NSMutableString *   digestString;
+            size_t              digestIndex;
+
+            (void) CC_SHA1_Final(digest, self->_responseDigestContext);
+            digestString = [NSMutableString stringWithCapacity:CC_SHA1_DIGEST_LENGTH * 2];
+            assert(digestString != nil);
+            for (digestIndex = 0; digestIndex < CC_SHA1_DIGEST_LENGTH; digestIndex++) {
+                [digestString appendFormat:@"%02x", (unsigned int) digest[digestIndex]];
+            }
+            self->_responseDigest = [digestString copy];
+        }
         [self finishWithError:nil];
     }
 }
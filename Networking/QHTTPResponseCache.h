@@ -0,0 +1,109 @@
+#import <Foundation/Foundation.h>
+
+#import "QHTTPOperation.h"
+
+/*
+    QHTTPResponseCache is an on-disk cache of HTTP GET responses that any QHTTPOperation
+    can use; set the operation's responseCache property before queuing it.  The cache
+    follows the usual HTTP rules, in a simplified form suitable for a single user client:
+
+    o A 200 response is stored if it doesn't say Cache-Control: no-store (or Vary: *),
+      and it's either fresh for a while (Cache-Control: max-age, Expires, or a
+      heuristic based on Last-Modified) or it carries a validator (ETag or Last-Modified).
+      Cache-Control: no-cache responses are stored but always revalidated.
+
+    o While an entry is fresh, a request for its URL is answered from disk without
+      touching the network.
+
+    o Once it's stale, the request is sent with If-None-Match/If-Modified-Since.  A 304
+      refreshes the entry's headers and expiry and the body comes from disk; anything
+      else replaces (or removes) the entry.
+
+    o The bodies are kept under byteLimit by evicting the least recently used entries.
+
+    Requests that already carry conditional or Range headers pass straight through,
+    because the caller (PhotoStore's conditional photo gets, SegmentedHTTPOperation's
+    segments) wants to see the real response.
+
+    The cache lives in its own directory in Caches, next to the gallery caches, so it
+    survives a gallery cache being reset; that's exactly when it pays off, because
+    every thumbnail of the new gallery cache is fetched again.
+
+    从 Caches/HTTPCache 目录提供 HTTP 回应缓存, 支持 Cache-Control/Expires 和条件请求 (304) 重新验证.
+
+    The cache is thread safe.
+*/
+
+@interface QHTTPResponseCache : NSObject
+{
+    NSString *              _directoryPath;
+    unsigned long long      _byteLimit;
+    NSMutableDictionary *   _entries;           // URL string -> NSMutableDictionary entry
+    unsigned long long      _totalBytes;
+    BOOL                    _saveScheduled;
+}
+
+// Returns the cache in Caches/HTTPCache, which is what the app uses.
++ (QHTTPResponseCache *)sharedCache;
+
+// Creates a cache that keeps its files in the directory at path, creating it if necessary.
+- (id)initWithDirectoryPath:(NSString *)path byteLimit:(unsigned long long)byteLimit;
+
+@property (copy,   readonly ) NSString *            directoryPath;
+@property (assign, readwrite) unsigned long long    byteLimit;          // the shared cache's is 32 MB, 1/4 of that on embedded
+@property (assign, readonly ) unsigned long long    totalBytes;         // size of all the cached bodies
+
+// Forgets the cached response for url, if any.
+- (void)removeResponseForURL:(NSURL *)url;
+
+// Forgets every cached response.
+- (void)removeAllResponses;
+
+@end
+
+// QHTTPCachingConnection is the QHTTPConnection that QHTTPOperation uses when it has a
+// responseCache.  It answers from the cache, or runs the (possibly conditional) request
+// over a connection of +[QHTTPOperation connectionClass] and stores the result.
+
+@interface QHTTPCachingConnection : NSObject <QHTTPConnection>
+{
+    QHTTPResponseCache *    _cache;
+    NSURLRequest *          _request;
+    id                      _delegate;
+    NSRunLoop *             _runLoop;
+    NSMutableArray *        _runLoopModes;
+    id<QHTTPConnection>     _connection;
+    NSTimer *               _timer;
+    NSDictionary *          _cachedEntry;       // entry we're revalidating or serving
+    BOOL                    _revalidated;       // got a 304 for _cachedEntry
+    NSHTTPURLResponse *     _storeResponse;
+    NSString *              _storeFilePath;
+    NSOutputStream *        _storeStream;
+    long long               _storeLength;
+    BOOL                    _finished;
+    long long               _bytesFromCache;
+    long long               _bytesFromNetwork;
+}
+
+- (id)initWithRequest:(NSURLRequest *)request delegate:(id)delegate cache:(QHTTPResponseCache *)cache;
+
+@property (assign, readonly ) long long     bytesFromCache;             // body bytes delivered from disk
+@property (assign, readonly ) long long     bytesFromNetwork;           // body bytes that came over the network
+
+@end
+
+// QHTTPStoredResponse is an NSHTTPURLResponse built from a status code and header
+// fields, for responses that didn't come off the wire (a cache hit, say).
+// -[NSHTTPURLResponse initWithURL:statusCode:HTTPVersion:headerFields:] would do the
+// same job, but it's not available until iOS 5, and we run on iOS 3.
+// 用状态码和 header 构造 NSHTTPURLResponse, 兼容 iOS 5 以前的系统.
+
+@interface QHTTPStoredResponse : NSHTTPURLResponse
+{
+    NSInteger       _storedStatusCode;
+    NSDictionary *  _storedHeaderFields;
+}
+
+- (id)initWithURL:(NSURL *)url statusCode:(NSInteger)statusCode headerFields:(NSDictionary *)headerFields;
+
+@end
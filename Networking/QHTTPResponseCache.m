@@ -0,0 +1,1006 @@
+#import "QHTTPResponseCache.h"
+#import "Logging.h"
+
+// The cache keeps each body in its own file, and everything else in an index property
+// list in the same directory.
+
+static NSString * kHTTPCacheDirectoryName   = @"HTTPCache";
+static NSString * kHTTPCacheIndexFileName   = @"HTTPCache.plist";
+
+static NSString * kEntryKeyFile             = @"file";          // NSString, body file name
+static NSString * kEntryKeySize             = @"size";          // NSNumber, body size in bytes
+static NSString * kEntryKeyURL              = @"URL";           // NSString, URL of the response (differs from the key after a redirect)
+static NSString * kEntryKeyStatus           = @"status";        // NSNumber, HTTP status code
+static NSString * kEntryKeyHeaders          = @"headers";       // NSDictionary, response header fields
+static NSString * kEntryKeyExpires          = @"expires";       // NSDate, when the entry goes stale
+static NSString * kEntryKeyUsed             = @"used";          // NSDate, last time we served it, for LRU eviction
+
+// The largest body we'll store, as a fraction of byteLimit, so that one big response
+// can't flush everything else.
+
+static const unsigned long long kMaximumEntryFraction = 8;
+
+// We deliver bodies from the cache in chunks of this size, like a connection would.
+
+static const NSUInteger kDeliveryChunkSize = 64 * 1024;
+
+// Without any explicit freshness information, a response with a Last-Modified date is
+// fresh for 10% of its age, but no more than this.
+
+static const NSTimeInterval kMaximumHeuristicLifetime = 24.0 * 60.0 * 60.0;
+
+@interface QHTTPResponseCache ()
+
+// forward declarations
+
+- (void)scheduleSave;
+- (void)evictToByteLimit;
+
+@end
+
+// Header field names are case insensitive, and NSHTTPURLResponse doesn't promise
+// any particular capitalisation, so we search.
+static NSString * HeaderValue(NSDictionary * headers, NSString * name)
+{
+    for (NSString * key in headers) {
+        if ([key caseInsensitiveCompare:name] == NSOrderedSame) {
+            return [headers objectForKey:key];
+        }
+    }
+    return nil;
+}
+
+// Parses an HTTP date (RFC 1123 format, which is the only one that servers still send).
+static NSDate * HTTPDate(NSString * string)
+{
+    static NSDateFormatter *    sFormatter;
+    NSDate *                    result;
+
+    if (string == nil) {
+        return nil;
+    }
+    @synchronized ([QHTTPResponseCache class]) {
+        if (sFormatter == nil) {
+            sFormatter = [[NSDateFormatter alloc] init];
+            assert(sFormatter != nil);
+            [sFormatter setLocale:[[[NSLocale alloc] initWithLocaleIdentifier:@"en_US_POSIX"] autorelease]];
+            [sFormatter setTimeZone:[NSTimeZone timeZoneForSecondsFromGMT:0]];
+            [sFormatter setDateFormat:@"EEE',' dd MMM yyyy HH':'mm':'ss 'GMT'"];
+        }
+        result = [sFormatter dateFromString:string];
+    }
+    return result;
+}
+
+// Returns the Cache-Control directives of the response, lowercased, with any argument
+// (as in "max-age=60") as the value, or NSNull if there's no argument.
+static NSDictionary * CacheControlDirectives(NSDictionary * headers)
+{
+    NSMutableDictionary *   result;
+    NSString *              value;
+
+    result = [NSMutableDictionary dictionary];
+    value = HeaderValue(headers, @"Cache-Control");
+    for (NSString * directive in [value componentsSeparatedByString:@","]) {
+        NSRange     equals;
+        NSString *  name;
+        id          argument;
+
+        directive = [directive stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+        equals = [directive rangeOfString:@"="];
+        if (equals.location == NSNotFound) {
+            name     = directive;
+            argument = [NSNull null];
+        } else {
+            name     = [directive substringToIndex:equals.location];
+            argument = [[directive substringFromIndex:equals.location + 1] stringByTrimmingCharactersInSet:[NSCharacterSet characterSetWithCharactersInString:@"\" "]];
+        }
+        if ([name length] != 0) {
+            [result setObject:argument forKey:[name lowercaseString]];
+        }
+    }
+    return result;
+}
+
+// Works out when a response received now stops being fresh.  A date in the past means
+// the response must be revalidated every time.
+static NSDate * ExpirationDateForHeaders(NSDictionary * headers)
+{
+    NSDate *        now;
+    NSDictionary *  directives;
+    id              maxAge;
+    NSDate *        serverDate;
+    NSDate *        expires;
+    NSDate *        lastModified;
+    NSTimeInterval  lifetime;
+
+    now = [NSDate date];
+    directives = CacheControlDirectives(headers);
+    maxAge = [directives objectForKey:@"max-age"];
+    serverDate = HTTPDate(HeaderValue(headers, @"Date"));
+    if (serverDate == nil) {
+        serverDate = now;
+    }
+
+    if ([directives objectForKey:@"no-cache"] != nil) {
+        lifetime = 0.0;
+    } else if ( [maxAge isKindOfClass:[NSString class]] ) {
+        lifetime = [maxAge doubleValue] - [HeaderValue(headers, @"Age") doubleValue];
+    } else if ( (expires = HTTPDate(HeaderValue(headers, @"Expires"))) != nil ) {
+        // Measure against the server's clock, in case ours is wrong.
+        lifetime = [expires timeIntervalSinceDate:serverDate];
+    } else if ( (lastModified = HTTPDate(HeaderValue(headers, @"Last-Modified"))) != nil ) {
+        lifetime = MIN([serverDate timeIntervalSinceDate:lastModified] / 10.0, kMaximumHeuristicLifetime);
+    } else {
+        lifetime = 0.0;
+    }
+    return [NSDate dateWithTimeIntervalSinceNow:MAX(lifetime, 0.0)];
+}
+
+// Sorts keys of the entries dictionary (passed as context) least recently used first.
+static NSInteger CompareEntriesByUse(id key1, id key2, void * context)
+{
+    NSDictionary *  entries;
+
+    entries = (NSDictionary *) context;
+    return [[[entries objectForKey:key1] objectForKey:kEntryKeyUsed] compare:[[entries objectForKey:key2] objectForKey:kEntryKeyUsed]];
+}
+
+@implementation QHTTPResponseCache
+
++ (QHTTPResponseCache *)sharedCache
+{
+    static QHTTPResponseCache * sSharedCache;
+
+    // any thread
+    @synchronized (self) {
+        if (sSharedCache == nil) {
+            NSArray *   paths;
+
+#if TARGET_OS_EMBEDDED || TARGET_IPHONE_SIMULATOR
+            static const unsigned long long kPlatformReductionFactor = 4;
+#else
+            static const unsigned long long kPlatformReductionFactor = 1;
+#endif
+
+            paths = NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES);
+            assert( (paths != nil) && ([paths count] != 0) );
+            sSharedCache = [[QHTTPResponseCache alloc] initWithDirectoryPath:[[paths objectAtIndex:0] stringByAppendingPathComponent:kHTTPCacheDirectoryName]
+                                                                   byteLimit:32 * 1024 * 1024 / kPlatformReductionFactor];
+            assert(sSharedCache != nil);
+        }
+    }
+    return sSharedCache;
+}
+
+- (id)initWithDirectoryPath:(NSString *)path byteLimit:(unsigned long long)byteLimit
+{
+    assert(path != nil);
+    self = [super init];
+    if (self != nil) {
+        NSFileManager * fileManager;
+        NSDictionary *  index;
+        NSMutableSet *  liveFileNames;
+        BOOL            success;
+
+        fileManager = [[[NSFileManager alloc] init] autorelease];     // -defaultManager is not thread safe
+        assert(fileManager != nil);
+
+        self->_directoryPath = [path copy];
+        assert(self->_directoryPath != nil);
+        self->_byteLimit = byteLimit;
+
+        success = [fileManager createDirectoryAtPath:self->_directoryPath withIntermediateDirectories:YES attributes:nil error:NULL];
+        assert(success);
+
+        // Load the index, making the entries mutable as we go, and dropping any whose
+        // body has gone missing.
+
+        self->_entries = [[NSMutableDictionary alloc] init];
+        assert(self->_entries != nil);
+        liveFileNames = [NSMutableSet set];
+        assert(liveFileNames != nil);
+
+        index = [NSDictionary dictionaryWithContentsOfFile:[self->_directoryPath stringByAppendingPathComponent:kHTTPCacheIndexFileName]];
+        for (NSString * key in index) {
+            NSMutableDictionary *   entry;
+            NSString *              fileName;
+
+            entry = [[[index objectForKey:key] mutableCopy] autorelease];
+            fileName = [entry objectForKey:kEntryKeyFile];
+            if ( (fileName != nil) && [fileManager fileExistsAtPath:[self->_directoryPath stringByAppendingPathComponent:fileName]] ) {
+                [self->_entries setObject:entry forKey:key];
+                [liveFileNames addObject:fileName];
+                self->_totalBytes += [[entry objectForKey:kEntryKeySize] unsignedLongLongValue];
+            }
+        }
+
+        // Bodies that aren't in the index were stored just before we were killed, before
+        // the index was saved, or were left behind by a transfer that never finished.
+
+        for (NSString * fileName in [fileManager contentsOfDirectoryAtPath:self->_directoryPath error:NULL]) {
+            if ( ! [fileName isEqual:kHTTPCacheIndexFileName] && ! [liveFileNames containsObject:fileName] ) {
+                (void) [fileManager removeItemAtPath:[self->_directoryPath stringByAppendingPathComponent:fileName] error:NULL];
+            }
+        }
+
+        [[QLog log] logWithFormat:@"%s %zu responses, %llu bytes", __PRETTY_FUNCTION__, (size_t) [self->_entries count], self->_totalBytes];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    // A pending save retains us, so there's nothing to flush here.
+    [self->_directoryPath release];
+    [self->_entries release];
+    [super dealloc];
+}
+
+@synthesize directoryPath = _directoryPath;
+
+- (unsigned long long)byteLimit
+{
+    @synchronized (self) {
+        return self->_byteLimit;
+    }
+}
+
+- (void)setByteLimit:(unsigned long long)newValue
+{
+    @synchronized (self) {
+        self->_byteLimit = newValue;
+        [self evictToByteLimit];
+    }
+}
+
+- (unsigned long long)totalBytes
+{
+    @synchronized (self) {
+        return self->_totalBytes;
+    }
+}
+
+#pragma mark - Index
+
+// Writes the index out on the main thread, coalescing the saves from a burst of changes.
+- (void)scheduleSave
+{
+    @synchronized (self) {
+        if ( ! self->_saveScheduled ) {
+            self->_saveScheduled = YES;
+            [self performSelectorOnMainThread:@selector(save) withObject:nil waitUntilDone:NO];
+        }
+    }
+}
+
+- (void)save
+{
+    NSDictionary *  index;
+    BOOL            success;
+
+    assert([NSThread isMainThread]);
+    @synchronized (self) {
+        self->_saveScheduled = NO;
+        index = [[[NSDictionary alloc] initWithDictionary:self->_entries copyItems:YES] autorelease];
+    }
+    success = [index writeToFile:[self.directoryPath stringByAppendingPathComponent:kHTTPCacheIndexFileName] atomically:YES];
+    if ( ! success ) {
+        [[QLog log] logWithFormat:@"%s save failed", __PRETTY_FUNCTION__];
+    }
+}
+
+// Removes the entry for key from the index and returns the path of its body, which
+// the caller should delete.  Must be called with the lock held.
+- (NSString *)detachEntryForKey:(NSString *)key
+{
+    NSDictionary *  entry;
+    NSString *      result;
+
+    result = nil;
+    entry = [self->_entries objectForKey:key];
+    if (entry != nil) {
+        result = [self->_directoryPath stringByAppendingPathComponent:[entry objectForKey:kEntryKeyFile]];
+        self->_totalBytes -= [[entry objectForKey:kEntryKeySize] unsignedLongLongValue];
+        [self->_entries removeObjectForKey:key];
+    }
+    return result;
+}
+
+// Throws out the least recently used entries until the bodies fit in byteLimit.
+// Must be called with the lock held.
+- (void)evictToByteLimit
+{
+    NSArray *       keys;
+    NSUInteger      keyIndex;
+    NSString *      path;
+
+    if (self->_totalBytes > self->_byteLimit) {
+        keys = [[self->_entries allKeys] sortedArrayUsingFunction:CompareEntriesByUse context:self->_entries];
+        keyIndex = 0;
+        while ( (self->_totalBytes > self->_byteLimit) && (keyIndex < [keys count]) ) {
+            [[QLog log] logOption:kLogOptionNetworkDetails withFormat:@"%s evict %@", __PRETTY_FUNCTION__, [keys objectAtIndex:keyIndex]];
+            path = [self detachEntryForKey:[keys objectAtIndex:keyIndex]];
+            (void) unlink([path fileSystemRepresentation]);
+            keyIndex += 1;
+        }
+        [self scheduleSave];
+    }
+}
+
+- (void)removeResponseForURL:(NSURL *)url
+{
+    NSString *  path;
+
+    assert(url != nil);
+    @synchronized (self) {
+        path = [self detachEntryForKey:[url absoluteString]];
+        if (path != nil) {
+            [self scheduleSave];
+        }
+    }
+    if (path != nil) {
+        (void) unlink([path fileSystemRepresentation]);
+    }
+}
+
+- (void)removeAllResponses
+{
+    NSArray *   keys;
+
+    @synchronized (self) {
+        keys = [self->_entries allKeys];
+        for (NSString * key in keys) {
+            (void) unlink([[self detachEntryForKey:key] fileSystemRepresentation]);
+        }
+        assert(self->_totalBytes == 0);
+        [self scheduleSave];
+    }
+}
+
+#pragma mark - Called by QHTTPCachingConnection
+
+// Returns a copy of the entry for url, or nil, and marks the entry as used.
+- (NSDictionary *)entryForURL:(NSURL *)url
+{
+    NSMutableDictionary *   entry;
+    NSDictionary *          result;
+
+    assert(url != nil);
+    @synchronized (self) {
+        entry = [self->_entries objectForKey:[url absoluteString]];
+        if (entry != nil) {
+            [entry setObject:[NSDate date] forKey:kEntryKeyUsed];
+            [self scheduleSave];
+        }
+        result = [[entry copy] autorelease];
+    }
+    return result;
+}
+
+- (NSString *)pathForEntry:(NSDictionary *)entry
+{
+    assert(entry != nil);
+    return [self.directoryPath stringByAppendingPathComponent:[entry objectForKey:kEntryKeyFile]];
+}
+
+// Returns a new, unique path in the cache directory for a body that's being downloaded.
+// If the app dies before the body is stored, the file is cleaned up on the next launch.
+- (NSString *)temporaryFilePath
+{
+    CFUUIDRef   uuid;
+    NSString *  fileName;
+
+    uuid = CFUUIDCreate(NULL);
+    assert(uuid != NULL);
+    fileName = [(NSString *) CFUUIDCreateString(NULL, uuid) autorelease];
+    assert(fileName != nil);
+    CFRelease(uuid);
+    return [self.directoryPath stringByAppendingPathComponent:fileName];
+}
+
+// Returns YES if response, got from request, may be stored.  length is the size of
+// the body, or -1 if we don't know it.
+- (BOOL)canStoreResponse:(NSHTTPURLResponse *)response forRequest:(NSURLRequest *)request length:(long long)length
+{
+    NSDictionary *  headers;
+    BOOL            hasValidator;
+
+    headers = [response allHeaderFields];
+    hasValidator = (HeaderValue(headers, @"ETag") != nil) || (HeaderValue(headers, @"Last-Modified") != nil);
+    return [[request HTTPMethod] isEqual:@"GET"]
+        && ([response statusCode] == 200)
+        && ([CacheControlDirectives(headers) objectForKey:@"no-store"] == nil)
+        && ! [HeaderValue(headers, @"Vary") isEqual:@"*"]
+        && ( (length < 0) || ((unsigned long long) length <= self.byteLimit / kMaximumEntryFraction) )
+        && ( hasValidator || ([ExpirationDateForHeaders(headers) timeIntervalSinceNow] > 0.0) );
+}
+
+// Makes the body file at path the cached response for url, replacing any existing entry.
+- (void)storeResponse:(NSHTTPURLResponse *)response bodyFilePath:(NSString *)path length:(long long)length forURL:(NSURL *)url
+{
+    NSMutableDictionary *   entry;
+    NSString *              oldPath;
+
+    assert(response != nil);
+    assert(path != nil);
+    assert([[path stringByDeletingLastPathComponent] isEqual:self.directoryPath]);
+    assert(url != nil);
+
+    entry = [NSMutableDictionary dictionaryWithObjectsAndKeys:
+        [path lastPathComponent],                               kEntryKeyFile,
+        [NSNumber numberWithLongLong:length],                   kEntryKeySize,
+        [[response URL] absoluteString],                        kEntryKeyURL,
+        [NSNumber numberWithInteger:[response statusCode]],     kEntryKeyStatus,
+        [response allHeaderFields],                             kEntryKeyHeaders,
+        ExpirationDateForHeaders([response allHeaderFields]),   kEntryKeyExpires,
+        [NSDate date],                                          kEntryKeyUsed,
+        nil
+    ];
+    assert(entry != nil);
+
+    @synchronized (self) {
+        oldPath = [self detachEntryForKey:[url absoluteString]];
+        [self->_entries setObject:entry forKey:[url absoluteString]];
+        self->_totalBytes += (unsigned long long) length;
+        [self evictToByteLimit];
+        [self scheduleSave];
+    }
+    if (oldPath != nil) {
+        (void) unlink([oldPath fileSystemRepresentation]);
+    }
+    [[QLog log] logOption:kLogOptionNetworkDetails withFormat:@"%s %@ %lld bytes", __PRETTY_FUNCTION__, url, length];
+}
+
+// Applies the headers of a 304 response to the entry for url, which makes it fresh
+// again.  Returns a copy of the updated entry, or nil if the entry has gone away.
+- (NSDictionary *)refreshEntryForURL:(NSURL *)url withResponse:(NSHTTPURLResponse *)response
+{
+    NSMutableDictionary *   entry;
+    NSMutableDictionary *   headers;
+    NSDictionary *          result;
+
+    assert(url != nil);
+    assert([response statusCode] == 304);
+    result = nil;
+    @synchronized (self) {
+        entry = [self->_entries objectForKey:[url absoluteString]];
+        if (entry != nil) {
+            // A 304 carries the headers that may have changed (Cache-Control, Expires,
+            // ETag, Date and so on), but not the entity headers like Content-Length.
+
+            headers = [[[entry objectForKey:kEntryKeyHeaders] mutableCopy] autorelease];
+            assert(headers != nil);
+            for (NSString * key in [response allHeaderFields]) {
+                if ( ([key caseInsensitiveCompare:@"Content-Length"] != NSOrderedSame) && ([key caseInsensitiveCompare:@"Content-Type"] != NSOrderedSame) ) {
+                    for (NSString * oldKey in [headers allKeys]) {
+                        if ([oldKey caseInsensitiveCompare:key] == NSOrderedSame) {
+                            [headers removeObjectForKey:oldKey];
+                        }
+                    }
+                    [headers setObject:[[response allHeaderFields] objectForKey:key] forKey:key];
+                }
+            }
+            [entry setObject:headers forKey:kEntryKeyHeaders];
+            [entry setObject:ExpirationDateForHeaders(headers) forKey:kEntryKeyExpires];
+            [entry setObject:[NSDate date] forKey:kEntryKeyUsed];
+            [self scheduleSave];
+            result = [[entry copy] autorelease];
+        }
+    }
+    return result;
+}
+
+@end
+
+@interface QHTTPCachingConnection ()
+
+// read/write versions of public properties
+@property (assign, readwrite) long long     bytesFromCache;
+@property (assign, readwrite) long long     bytesFromNetwork;
+
+// forward declarations
+- (void)startNetworkRequest:(NSURLRequest *)request;
+- (void)stopStoring;
+
+@end
+
+@implementation QHTTPCachingConnection
+
+- (id)initWithRequest:(NSURLRequest *)request delegate:(id)delegate cache:(QHTTPResponseCache *)cache
+{
+    assert(request != nil);
+    assert(delegate != nil);
+    assert(cache != nil);
+    self = [super init];
+    if (self != nil) {
+        self->_cache = [cache retain];
+        self->_request = [request copy];
+        assert(self->_request != nil);
+        self->_delegate = [delegate retain];      // like NSURLConnection, we retain our delegate until we're done
+        self->_runLoopModes = [[NSMutableArray alloc] init];
+        assert(self->_runLoopModes != nil);
+    }
+    return self;
+}
+
+- (id)initWithRequest:(NSURLRequest *)request delegate:(id)delegate startImmediately:(BOOL)startImmediately
+{
+    self = [self initWithRequest:request delegate:delegate cache:[QHTTPResponseCache sharedCache]];
+    if ( (self != nil) && startImmediately ) {
+        [self scheduleInRunLoop:[NSRunLoop currentRunLoop] forMode:NSDefaultRunLoopMode];
+        [self start];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    // The timer and the real connection both retain us, so they must be gone by now.
+    assert(self->_timer == nil);
+    assert(self->_connection == nil);
+    assert(self->_storeStream == nil);
+    [self->_cache release];
+    [self->_request release];
+    [self->_delegate release];
+    [self->_runLoop release];
+    [self->_runLoopModes release];
+    [self->_cachedEntry release];
+    [self->_storeResponse release];
+    [self->_storeFilePath release];
+    [super dealloc];
+}
+
+@synthesize bytesFromCache   = _bytesFromCache;
+@synthesize bytesFromNetwork = _bytesFromNetwork;
+
+- (void)scheduleInRunLoop:(NSRunLoop *)runLoop forMode:(NSString *)mode
+{
+    assert(runLoop != nil);
+    assert(mode != nil);
+    if (self->_runLoop == nil) {
+        self->_runLoop = [runLoop retain];
+    }
+    assert(runLoop == self->_runLoop);          // we only support one run loop
+    [self->_runLoopModes addObject:mode];
+}
+
+// Requests that carry their own validators or ranges want to see the server's answer,
+// not ours.
+- (BOOL)isCacheableRequest
+{
+    return [[self->_request HTTPMethod] isEqual:@"GET"]
+        && ([self->_request valueForHTTPHeaderField:@"If-None-Match"] == nil)
+        && ([self->_request valueForHTTPHeaderField:@"If-Modified-Since"] == nil)
+        && ([self->_request valueForHTTPHeaderField:@"Range"] == nil);
+}
+
+- (void)start
+{
+    NSDictionary *          entry;
+    NSDictionary *          headers;
+    NSString *              value;
+    NSMutableURLRequest *   request;
+
+    assert(self->_runLoop != nil);
+    assert(self->_timer == nil);
+    assert(self->_connection == nil);
+
+    entry = nil;
+    if ( [self isCacheableRequest] ) {
+        entry = [self->_cache entryForURL:[self->_request URL]];
+    }
+
+    if ( (entry != nil) && ([[entry objectForKey:kEntryKeyExpires] timeIntervalSinceNow] > 0.0) ) {
+
+        // Fresh, so answer from the cache.  We deliver from a timer, so that our delegate
+        // hears from us on its run loop, just like it would from a real connection.
+
+        [[QLog log] logOption:kLogOptionNetworkDetails withFormat:@"%s hit %@", __PRETTY_FUNCTION__, [self->_request URL]];
+        self->_cachedEntry = [entry retain];
+        self->_timer = [[NSTimer timerWithTimeInterval:0.0 target:self selector:@selector(deliverTimerDone:) userInfo:nil repeats:NO] retain];
+        assert(self->_timer != nil);
+        for (NSString * mode in self->_runLoopModes) {
+            [self->_runLoop addTimer:self->_timer forMode:mode];
+        }
+    } else {
+        request = nil;
+        if (entry != nil) {
+
+            // Stale, so ask the server whether our copy is still good.
+
+            headers = [entry objectForKey:kEntryKeyHeaders];
+            request = [[self->_request mutableCopy] autorelease];
+            assert(request != nil);
+            value = HeaderValue(headers, @"ETag");
+            if (value != nil) {
+                [request setValue:value forHTTPHeaderField:@"If-None-Match"];
+            }
+            value = HeaderValue(headers, @"Last-Modified");
+            if (value != nil) {
+                [request setValue:value forHTTPHeaderField:@"If-Modified-Since"];
+            }
+            if ( ([request valueForHTTPHeaderField:@"If-None-Match"] != nil) || ([request valueForHTTPHeaderField:@"If-Modified-Since"] != nil) ) {
+                [[QLog log] logOption:kLogOptionNetworkDetails withFormat:@"%s revalidate %@", __PRETTY_FUNCTION__, [self->_request URL]];
+                self->_cachedEntry = [entry retain];
+            } else {
+                request = nil;
+            }
+        }
+        [self startNetworkRequest:(request != nil) ? request : self->_request];
+    }
+}
+
+- (void)cancel
+{
+    [[self retain] autorelease];
+    self->_finished = YES;
+    if (self->_timer != nil) {
+        [self->_timer invalidate];
+        [self->_timer release];
+        self->_timer = nil;
+    }
+    if (self->_connection != nil) {
+        [self->_connection cancel];
+        [self->_connection release];
+        self->_connection = nil;
+    }
+    [self stopStoring];
+    [self->_delegate release];
+    self->_delegate = nil;
+}
+
+- (void)startNetworkRequest:(NSURLRequest *)request
+{
+    assert(request != nil);
+    assert(self->_connection == nil);
+
+    self->_connection = [[[QHTTPOperation connectionClass] alloc] initWithRequest:request delegate:self startImmediately:NO];
+    assert(self->_connection != nil);
+    for (NSString * mode in self->_runLoopModes) {
+        [self->_connection scheduleInRunLoop:self->_runLoop forMode:mode];
+    }
+    [self->_connection start];
+}
+
+#pragma mark - Storing
+
+// Abandons any body we're writing to the cache.
+- (void)stopStoring
+{
+    if (self->_storeStream != nil) {
+        [self->_storeStream close];
+        [self->_storeStream release];
+        self->_storeStream = nil;
+        (void) unlink([self->_storeFilePath fileSystemRepresentation]);
+    }
+    [self->_storeResponse release];
+    self->_storeResponse = nil;
+    [self->_storeFilePath release];
+    self->_storeFilePath = nil;
+}
+
+- (void)storeData:(NSData *)data
+{
+    const uint8_t * dataPtr;
+    NSUInteger      dataOffset;
+    NSInteger       bytesWritten;
+
+    assert(self->_storeStream != nil);
+
+    // The body can turn out to be bigger than it said it was, or the disk can fill up;
+    // either way we just don't store it.
+
+    self->_storeLength += (long long) [data length];
+    if ( (unsigned long long) self->_storeLength > [self->_cache byteLimit] / kMaximumEntryFraction ) {
+        [self stopStoring];
+    } else {
+        dataPtr = [data bytes];
+        dataOffset = 0;
+        while (dataOffset < [data length]) {
+            bytesWritten = [self->_storeStream write:&dataPtr[dataOffset] maxLength:[data length] - dataOffset];
+            if (bytesWritten <= 0) {
+                [self stopStoring];
+                break;
+            }
+            dataOffset += (NSUInteger) bytesWritten;
+        }
+    }
+}
+
+- (void)finishStoring
+{
+    assert(self->_storeStream != nil);
+    [self->_storeStream close];
+    [self->_storeStream release];
+    self->_storeStream = nil;
+    [self->_cache storeResponse:self->_storeResponse bodyFilePath:self->_storeFilePath length:self->_storeLength forURL:[self->_request URL]];
+    [self->_storeResponse release];
+    self->_storeResponse = nil;
+    [self->_storeFilePath release];
+    self->_storeFilePath = nil;
+}
+
+#pragma mark - Delivering to our delegate
+
+// Each of these does nothing once we've finished, because the delegate may have
+// cancelled us from within an earlier callback.
+
+- (void)deliverResponse:(NSURLResponse *)response
+{
+    if ( ! self->_finished ) {
+        [self->_delegate connection:(NSURLConnection *) self didReceiveResponse:response];
+    }
+}
+
+- (void)deliverData:(NSData *)data
+{
+    if ( ! self->_finished && ([data length] != 0) ) {
+        [self->_delegate connection:(NSURLConnection *) self didReceiveData:data];
+    }
+}
+
+- (void)deliverFinish
+{
+    id  delegate;
+
+    if ( ! self->_finished ) {
+        self->_finished = YES;
+        delegate = [self->_delegate autorelease];
+        self->_delegate = nil;
+        [delegate connectionDidFinishLoading:(NSURLConnection *) self];
+    }
+}
+
+- (void)deliverError:(NSError *)error
+{
+    id  delegate;
+
+    assert(error != nil);
+    if ( ! self->_finished ) {
+        self->_finished = YES;
+        delegate = [self->_delegate autorelease];
+        self->_delegate = nil;
+        [delegate connection:(NSURLConnection *) self didFailWithError:error];
+    }
+}
+
+// Delivers _cachedEntry, as if it had just come off the wire.  If the body has gone
+// missing (it was evicted while we were revalidating, say) we fall back to running
+// the original request.
+- (void)deliverCachedEntry
+{
+    NSData *            body;
+    NSHTTPURLResponse * response;
+    NSUInteger          offset;
+    NSUInteger          chunkLength;
+
+    assert(self->_cachedEntry != nil);
+
+    body = [NSData dataWithContentsOfFile:[self->_cache pathForEntry:self->_cachedEntry] options:NSMappedRead error:NULL];
+    if ( (body == nil) || ((long long) [body length] != [[self->_cachedEntry objectForKey:kEntryKeySize] longLongValue]) ) {
+        [[QLog log] logOption:kLogOptionNetworkDetails withFormat:@"%s lost body of %@", __PRETTY_FUNCTION__, [self->_request URL]];
+        [self->_cache removeResponseForURL:[self->_request URL]];
+        [self->_cachedEntry release];
+        self->_cachedEntry = nil;
+        self->_revalidated = NO;
+        [self startNetworkRequest:self->_request];
+    } else {
+        response = [[[QHTTPStoredResponse alloc] initWithURL:[NSURL URLWithString:[self->_cachedEntry objectForKey:kEntryKeyURL]]
+            statusCode:[[self->_cachedEntry objectForKey:kEntryKeyStatus] integerValue]
+            headerFields:[self->_cachedEntry objectForKey:kEntryKeyHeaders]
+        ] autorelease];
+        assert(response != nil);
+        [self deliverResponse:response];
+        offset = 0;
+        while ( ! self->_finished && (offset < [body length]) ) {
+            chunkLength = MIN(kDeliveryChunkSize, [body length] - offset);
+            self.bytesFromCache += (long long) chunkLength;
+            [self deliverData:[body subdataWithRange:NSMakeRange(offset, chunkLength)]];
+            offset += chunkLength;
+        }
+        [self deliverFinish];
+    }
+}
+
+- (void)deliverTimerDone:(NSTimer *)timer
+{
+    assert(timer == self->_timer);
+    #pragma unused(timer)
+
+    [[self retain] autorelease];
+    [self->_timer invalidate];
+    [self->_timer release];
+    self->_timer = nil;
+    [self deliverCachedEntry];
+}
+
+#pragma mark - Real connection delegate callbacks
+
+- (NSURLRequest *)connection:(NSURLConnection *)connection willSendRequest:(NSURLRequest *)request redirectResponse:(NSURLResponse *)response
+{
+    assert(connection == (NSURLConnection *) self->_connection);
+    #pragma unused(connection)
+    if ( ! self->_finished && [self->_delegate respondsToSelector:@selector(connection:willSendRequest:redirectResponse:)] ) {
+        request = [self->_delegate connection:(NSURLConnection *) self willSendRequest:request redirectResponse:response];
+    }
+    return request;
+}
+
+- (BOOL)connection:(NSURLConnection *)connection canAuthenticateAgainstProtectionSpace:(NSURLProtectionSpace *)protectionSpace
+{
+    assert(connection == (NSURLConnection *) self->_connection);
+    #pragma unused(connection)
+    return ! self->_finished
+        && [self->_delegate respondsToSelector:@selector(connection:canAuthenticateAgainstProtectionSpace:)]
+        && [self->_delegate connection:(NSURLConnection *) self canAuthenticateAgainstProtectionSpace:protectionSpace];
+}
+
+- (void)connection:(NSURLConnection *)connection didReceiveAuthenticationChallenge:(NSURLAuthenticationChallenge *)challenge
+{
+    assert(connection == (NSURLConnection *) self->_connection);
+    #pragma unused(connection)
+    if ( ! self->_finished && [self->_delegate respondsToSelector:@selector(connection:didReceiveAuthenticationChallenge:)] ) {
+        [self->_delegate connection:(NSURLConnection *) self didReceiveAuthenticationChallenge:challenge];
+    } else {
+        [[challenge sender] cancelAuthenticationChallenge:challenge];
+    }
+}
+
+- (void)connection:(NSURLConnection *)connection didReceiveResponse:(NSURLResponse *)response
+{
+    NSHTTPURLResponse * httpResponse;
+    NSDictionary *      refreshedEntry;
+
+    assert(connection == (NSURLConnection *) self->_connection);
+    #pragma unused(connection)
+    assert([response isKindOfClass:[NSHTTPURLResponse class]]);
+
+    [[self retain] autorelease];
+
+    // We can get more than one response (for example, for a multipart response), in
+    // which case only the last one counts.
+
+    [self stopStoring];
+    self->_revalidated = NO;
+    httpResponse = (NSHTTPURLResponse *) response;
+
+    if ( (self->_cachedEntry != nil) && ([httpResponse statusCode] == 304) ) {
+
+        // Our copy is still good.  Swallow the 304 and serve the body from disk once
+        // the connection finishes.
+
+        [[QLog log] logOption:kLogOptionNetworkDetails withFormat:@"%s not modified %@", __PRETTY_FUNCTION__, [self->_request URL]];
+        self->_revalidated = YES;
+        refreshedEntry = [self->_cache refreshEntryForURL:[self->_request URL] withResponse:httpResponse];
+        if (refreshedEntry != nil) {
+            [self->_cachedEntry release];
+            self->_cachedEntry = [refreshedEntry retain];
+        }
+    } else {
+        [self->_cachedEntry release];
+        self->_cachedEntry = nil;
+
+        if ( [self isCacheableRequest] && [self->_cache canStoreResponse:httpResponse forRequest:self->_request length:[httpResponse expectedContentLength]] ) {
+            self->_storeResponse = [httpResponse retain];
+            self->_storeFilePath = [[self->_cache temporaryFilePath] retain];
+            self->_storeStream = [[NSOutputStream alloc] initToFileAtPath:self->_storeFilePath append:NO];
+            assert(self->_storeStream != nil);
+            [self->_storeStream open];
+            self->_storeLength = 0;
+        } else if ( [self isCacheableRequest] && ([httpResponse statusCode] != 304) ) {
+            // Whatever we had for this URL has been superseded.
+            [self->_cache removeResponseForURL:[self->_request URL]];
+        }
+        [self deliverResponse:response];
+    }
+}
+
+- (void)connection:(NSURLConnection *)connection didReceiveData:(NSData *)data
+{
+    assert(connection == (NSURLConnection *) self->_connection);
+    #pragma unused(connection)
+
+    [[self retain] autorelease];
+
+    self.bytesFromNetwork += (long long) [data length];
+    if ( ! self->_revalidated ) {
+        if (self->_storeStream != nil) {
+            [self storeData:data];
+        }
+        [self deliverData:data];
+    }
+}
+
+- (void)connectionDidFinishLoading:(NSURLConnection *)connection
+{
+    assert(connection == (NSURLConnection *) self->_connection);
+    #pragma unused(connection)
+
+    [[self retain] autorelease];
+    [self->_connection release];
+    self->_connection = nil;
+
+    if (self->_revalidated) {
+        [self deliverCachedEntry];
+    } else {
+        if (self->_storeStream != nil) {
+            [self finishStoring];
+        }
+        [self deliverFinish];
+    }
+}
+
+- (void)connection:(NSURLConnection *)connection didFailWithError:(NSError *)error
+{
+    assert(connection == (NSURLConnection *) self->_connection);
+    #pragma unused(connection)
+
+    [[self retain] autorelease];
+    [self->_connection release];
+    self->_connection = nil;
+    [self stopStoring];
+    [self deliverError:error];
+}
+
+@end
+
+@implementation QHTTPStoredResponse
+
+- (id)initWithURL:(NSURL *)url statusCode:(NSInteger)statusCode headerFields:(NSDictionary *)headerFields
+{
+    NSString *      contentType;
+    NSString *      MIMEType;
+    NSString *      textEncodingName;
+    NSString *      contentLength;
+    NSArray *       parameters;
+
+    assert(url != nil);
+    if (headerFields == nil) {
+        headerFields = [NSDictionary dictionary];
+    }
+
+    // NSURLResponse wants the MIME type and text encoding split out of Content-Type.
+
+    MIMEType = nil;
+    textEncodingName = nil;
+    contentType = HeaderValue(headerFields, @"Content-Type");
+    if (contentType != nil) {
+        parameters = [contentType componentsSeparatedByString:@";"];
+        MIMEType = [[[parameters objectAtIndex:0] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]] lowercaseString];
+        for (NSString * parameter in parameters) {
+            NSString *  trimmed;
+
+            trimmed = [parameter stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+            if ( ([trimmed length] > 8) && ([[trimmed substringToIndex:8] caseInsensitiveCompare:@"charset="] == NSOrderedSame) ) {
+                textEncodingName = [[trimmed substringFromIndex:8] stringByTrimmingCharactersInSet:[NSCharacterSet characterSetWithCharactersInString:@"\""]];
+            }
+        }
+    }
+    contentLength = HeaderValue(headerFields, @"Content-Length");
+
+    self = [super initWithURL:url MIMEType:MIMEType expectedContentLength:(contentLength != nil) ? (NSInteger) [contentLength longLongValue] : -1 textEncodingName:textEncodingName];
+    if (self != nil) {
+        self->_storedStatusCode   = statusCode;
+        self->_storedHeaderFields = [headerFields copy];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self->_storedHeaderFields release];
+    [super dealloc];
+}
+
+- (NSInteger)statusCode
+{
+    return self->_storedStatusCode;
+}
+
+- (NSDictionary *)allHeaderFields
+{
+    return self->_storedHeaderFields;
+}
+
+@end
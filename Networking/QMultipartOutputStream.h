@@ -0,0 +1,63 @@
+#import <Foundation/Foundation.h>
+
+/*
+    QMultipartOutputStream is an output stream that parses a MIME multipart body
+    (RFC 2046, for example multipart/mixed) as it's written, and hands each part to its
+    part delegate as soon as the part is complete.  Set it as the responseOutputStream
+    of a QHTTPOperation and the parts come out while the response is still arriving,
+    rather than all at once at the end (see MultipartHTTPOperation).
+
+    As with QFileRegionOutputStream, it only supports synchronous use: -open, then
+    -write:maxLength: until done, then -close.  The part delegate is called from within
+    -write:maxLength:, on whatever thread is doing the writing.
+
+    If a part gets bigger than maximumPartLength, the write fails, which makes
+    QHTTPOperation fail the operation.  A body that ends early (or never gets to its
+    close delimiter) isn't an error as far as the stream is concerned; the parts that
+    were complete have already been delivered, and isComplete tells you whether that
+    was all of them.
+
+    边写边解析 multipart 数据, 每收齐一个 part 就交给 partDelegate.
+*/
+
+@protocol QMultipartOutputStreamPartDelegate;
+
+@interface QMultipartOutputStream : NSOutputStream
+{
+    NSData *                _delimiter;
+    NSUInteger              _maximumPartLength;
+    id<QMultipartOutputStreamPartDelegate>  _partDelegate;
+    NSMutableData *         _buffer;
+    NSUInteger              _searchOffset;
+    NSInteger               _state;
+    NSDictionary *          _partHeaders;
+    NSUInteger              _partCount;
+    NSStreamStatus          _status;
+    NSError *               _error;
+    id<NSStreamDelegate>    _delegate;
+}
+
+// Returns the boundary parameter of a multipart Content-Type header value, or nil if
+// the value isn't a multipart type or has no boundary.
++ (NSString *)boundaryForContentType:(NSString *)contentType;
+
+- (id)initWithBoundary:(NSString *)boundary;
+
+@property (copy,   readonly ) NSString *            boundary;
+
+@property (assign, readwrite) NSUInteger            maximumPartLength;  // default is 1 MB
+@property (assign, readwrite) id<QMultipartOutputStreamPartDelegate>    partDelegate;
+
+@property (assign, readonly ) NSUInteger            partCount;          // parts delivered so far
+@property (assign, readonly ) BOOL                  isComplete;         // YES once the close delimiter has been seen
+
+@end
+
+@protocol QMultipartOutputStreamPartDelegate <NSObject>
+
+@required
+
+// Called for each part, in order.  The header names in headers are lowercase.
+- (void)multipartOutputStream:(QMultipartOutputStream *)stream didReceivePartWithHeaders:(NSDictionary *)headers body:(NSData *)body;
+
+@end
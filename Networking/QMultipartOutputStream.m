@@ -0,0 +1,348 @@
+#import "QMultipartOutputStream.h"
+
+#include <string.h>                                     // for memmem
+
+// The parser works through the body in these states.  Each delimiter is CR LF "--"
+// boundary; we prime the buffer with a CR LF when the stream is opened so that a
+// delimiter at the very start of the body (which has no CR LF in front of it) matches
+// too.
+
+enum {
+    kStatePreamble,         // looking for the first delimiter
+    kStateDelimiterLine,    // just after a delimiter, looking for "--" (the close delimiter) or the end of the line
+    kStateHeaders,          // looking for the blank line at the end of the part headers
+    kStateBody,             // looking for the delimiter at the end of the part body
+    kStateEpilogue          // after the close delimiter, ignoring everything
+};
+
+// The most header bytes we'll buffer for one part before deciding the body is bogus.
+
+static const NSUInteger kMaximumHeadersLength = 16 * 1024;
+
+@interface QMultipartOutputStream ()
+
+// forward declarations
+
+- (BOOL)parseBuffer;
+
+@end
+
+@implementation QMultipartOutputStream
+
++ (NSString *)boundaryForContentType:(NSString *)contentType
+{
+    NSString *  result;
+    NSArray *   parameters;
+
+    result = nil;
+    parameters = [contentType componentsSeparatedByString:@";"];
+    if ( ([parameters count] > 1) && [[[[parameters objectAtIndex:0] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]] lowercaseString] hasPrefix:@"multipart/"] ) {
+        for (NSString * parameter in parameters) {
+            NSRange     equalsRange;
+            NSString *  name;
+            NSString *  value;
+
+            equalsRange = [parameter rangeOfString:@"="];
+            if (equalsRange.location != NSNotFound) {
+                name  = [[parameter substringToIndex:equalsRange.location] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+                value = [[parameter substringFromIndex:equalsRange.location + 1] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+                if ( ([value length] >= 2) && [value hasPrefix:@"\""] && [value hasSuffix:@"\""] ) {
+                    value = [value substringWithRange:NSMakeRange(1, [value length] - 2)];
+                }
+                if ( ([name caseInsensitiveCompare:@"boundary"] == NSOrderedSame) && ([value length] != 0) && ([value length] <= 70) ) {
+                    result = value;
+                    break;
+                }
+            }
+        }
+    }
+    return result;
+}
+
+- (id)initWithBoundary:(NSString *)boundary
+{
+    assert(boundary != nil);
+    assert([boundary length] != 0);
+    self = [super init];
+    if (self != nil) {
+        self->_delimiter = [[[NSString stringWithFormat:@"\r\n--%@", boundary] dataUsingEncoding:NSUTF8StringEncoding] copy];
+        assert(self->_delimiter != nil);
+        self->_maximumPartLength = 1024 * 1024;
+        self->_state  = kStatePreamble;
+        self->_status = NSStreamStatusNotOpen;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self->_delimiter release];
+    [self->_buffer release];
+    [self->_partHeaders release];
+    [self->_error release];
+    [super dealloc];
+}
+
+@synthesize maximumPartLength = _maximumPartLength;
+@synthesize partDelegate      = _partDelegate;
+@synthesize partCount         = _partCount;
+
+- (NSString *)boundary
+{
+    NSString *  delimiter;
+
+    delimiter = [[[NSString alloc] initWithData:self->_delimiter encoding:NSUTF8StringEncoding] autorelease];
+    return [delimiter substringFromIndex:4];
+}
+
+- (BOOL)isComplete
+{
+    return (self->_state == kStateEpilogue);
+}
+
+- (void)failWithCode:(NSInteger)code
+{
+    [self->_error release];
+    self->_error = [[NSError alloc] initWithDomain:NSCocoaErrorDomain code:code userInfo:nil];
+    self->_status = NSStreamStatusError;
+}
+
+// Returns the offset of needle in the buffer, starting the search at offset, or NSNotFound.
+- (NSUInteger)offsetOfBytes:(const void *)needle length:(size_t)needleLength fromOffset:(NSUInteger)offset
+{
+    const uint8_t * bytes;
+    const uint8_t * found;
+    NSUInteger      length;
+
+    bytes  = [self->_buffer bytes];
+    length = [self->_buffer length];
+    if (offset >= length) {
+        return NSNotFound;
+    }
+    found = memmem(bytes + offset, length - offset, needle, needleLength);
+    if (found == NULL) {
+        return NSNotFound;
+    }
+    return (NSUInteger) (found - bytes);
+}
+
+- (void)consumeBytes:(NSUInteger)length
+{
+    [self->_buffer replaceBytesInRange:NSMakeRange(0, length) withBytes:NULL length:0];
+    self->_searchOffset = 0;
+}
+
+// Parses a block of header lines (without the blank line at the end) into a dictionary.
+// Header names are lowercased, and continuation lines are folded into the previous header.
++ (NSDictionary *)headersFromData:(NSData *)data
+{
+    NSMutableDictionary *   result;
+    NSString *              headerString;
+    NSString *              lastName;
+
+    result = [NSMutableDictionary dictionary];
+    assert(result != nil);
+
+    headerString = [[[NSString alloc] initWithData:data encoding:NSISOLatin1StringEncoding] autorelease];
+    lastName = nil;
+    for (NSString * line in [headerString componentsSeparatedByString:@"\r\n"]) {
+        NSRange     colonRange;
+
+        if ( ([line length] != 0) && (([line characterAtIndex:0] == ' ') || ([line characterAtIndex:0] == '\t')) ) {
+            if (lastName != nil) {
+                [result setObject:[NSString stringWithFormat:@"%@ %@", [result objectForKey:lastName], [line stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]]] forKey:lastName];
+            }
+        } else {
+            colonRange = [line rangeOfString:@":"];
+            if (colonRange.location != NSNotFound) {
+                lastName = [[[line substringToIndex:colonRange.location] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]] lowercaseString];
+                [result setObject:[[line substringFromIndex:colonRange.location + 1] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]] forKey:lastName];
+            } else {
+                lastName = nil;
+            }
+        }
+    }
+    return result;
+}
+
+// Makes as much progress through the buffer as it can.  Returns NO if the body is
+// malformed (or a part is too big).
+- (BOOL)parseBuffer
+{
+    BOOL            progress;
+    NSUInteger      offset;
+    const uint8_t * bytes;
+
+    do {
+        progress = NO;
+        bytes = [self->_buffer bytes];
+        switch (self->_state) {
+            case kStatePreamble: {
+                offset = [self offsetOfBytes:[self->_delimiter bytes] length:[self->_delimiter length] fromOffset:self->_searchOffset];
+                if (offset != NSNotFound) {
+                    [self consumeBytes:offset + [self->_delimiter length]];
+                    self->_state = kStateDelimiterLine;
+                    progress = YES;
+                } else if ([self->_buffer length] >= [self->_delimiter length]) {
+                    // The preamble is ignored, so we can drop everything that can't be the
+                    // start of a delimiter.
+                    [self consumeBytes:[self->_buffer length] - ([self->_delimiter length] - 1)];
+                }
+            } break;
+            case kStateDelimiterLine: {
+                if ( ([self->_buffer length] >= 2) && (bytes[0] == '-') && (bytes[1] == '-') ) {
+                    [self consumeBytes:[self->_buffer length]];
+                    self->_state = kStateEpilogue;
+                } else {
+                    // Skip any transport padding up to the end of the line.
+                    offset = [self offsetOfBytes:"\r\n" length:2 fromOffset:0];
+                    if (offset != NSNotFound) {
+                        [self consumeBytes:offset + 2];
+                        self->_state = kStateHeaders;
+                        progress = YES;
+                    } else if ([self->_buffer length] > kMaximumHeadersLength) {
+                        return NO;
+                    }
+                }
+            } break;
+            case kStateHeaders: {
+                if ( ([self->_buffer length] >= 2) && (bytes[0] == '\r') && (bytes[1] == '\n') ) {
+                    offset = 0;
+                    [self->_partHeaders release];
+                    self->_partHeaders = [[NSDictionary alloc] init];
+                    [self consumeBytes:2];
+                } else {
+                    offset = [self offsetOfBytes:"\r\n\r\n" length:4 fromOffset:self->_searchOffset];
+                    if (offset != NSNotFound) {
+                        [self->_partHeaders release];
+                        self->_partHeaders = [[[self class] headersFromData:[self->_buffer subdataWithRange:NSMakeRange(0, offset)]] retain];
+                        [self consumeBytes:offset + 4];
+                    } else if ([self->_buffer length] > kMaximumHeadersLength) {
+                        return NO;
+                    } else if ([self->_buffer length] >= 3) {
+                        self->_searchOffset = [self->_buffer length] - 3;
+                    }
+                }
+                if (offset != NSNotFound) {
+                    self->_state = kStateBody;
+                    progress = YES;
+                }
+            } break;
+            case kStateBody: {
+                offset = [self offsetOfBytes:[self->_delimiter bytes] length:[self->_delimiter length] fromOffset:self->_searchOffset];
+                if (offset != NSNotFound) {
+                    NSData *    body;
+
+                    body = [self->_buffer subdataWithRange:NSMakeRange(0, offset)];
+                    assert(body != nil);
+                    [self consumeBytes:offset + [self->_delimiter length]];
+                    self->_partCount += 1;
+                    self->_state = kStateDelimiterLine;
+                    [self.partDelegate multipartOutputStream:self didReceivePartWithHeaders:self->_partHeaders body:body];
+                    progress = YES;
+                } else if ([self->_buffer length] > (self.maximumPartLength + [self->_delimiter length])) {
+                    return NO;
+                } else if ([self->_buffer length] >= [self->_delimiter length]) {
+                    // Next time, start looking where the delimiter could begin.
+                    self->_searchOffset = [self->_buffer length] - ([self->_delimiter length] - 1);
+                }
+            } break;
+            case kStateEpilogue: {
+                [self consumeBytes:[self->_buffer length]];
+            } break;
+            default: {
+                assert(NO);
+            } break;
+        }
+    } while (progress);
+    return YES;
+}
+
+#pragma mark - NSStream overrides
+
+- (void)open
+{
+    assert(self->_status == NSStreamStatusNotOpen);
+
+    self->_buffer = [[NSMutableData alloc] initWithBytes:"\r\n" length:2];
+    assert(self->_buffer != nil);
+    self->_status = NSStreamStatusOpen;
+}
+
+- (void)close
+{
+    [self->_buffer release];
+    self->_buffer = nil;
+    if (self->_status != NSStreamStatusError) {
+        self->_status = NSStreamStatusClosed;
+    }
+}
+
+- (NSStreamStatus)streamStatus
+{
+    return self->_status;
+}
+
+- (NSError *)streamError
+{
+    return [[self->_error retain] autorelease];
+}
+
+- (id<NSStreamDelegate>)delegate
+{
+    return self->_delegate;
+}
+
+- (void)setDelegate:(id<NSStreamDelegate>)delegate
+{
+    self->_delegate = delegate;
+}
+
+- (id)propertyForKey:(NSString *)key
+{
+    #pragma unused(key)
+    return nil;
+}
+
+- (BOOL)setProperty:(id)property forKey:(NSString *)key
+{
+    #pragma unused(property)
+    #pragma unused(key)
+    return NO;
+}
+
+- (void)scheduleInRunLoop:(NSRunLoop *)runLoop forMode:(NSString *)mode
+{
+    #pragma unused(runLoop)
+    #pragma unused(mode)
+}
+
+- (void)removeFromRunLoop:(NSRunLoop *)runLoop forMode:(NSString *)mode
+{
+    #pragma unused(runLoop)
+    #pragma unused(mode)
+}
+
+#pragma mark - NSOutputStream overrides
+
+- (NSInteger)write:(const uint8_t *)buffer maxLength:(NSUInteger)len
+{
+    if (self->_status != NSStreamStatusOpen) {
+        return -1;
+    }
+    if (self->_state != kStateEpilogue) {
+        [self->_buffer appendBytes:buffer length:len];
+        if ( ! [self parseBuffer] ) {
+            [self failWithCode:NSFileReadCorruptFileError];
+            return -1;
+        }
+    }
+    return (NSInteger) len;
+}
+
+- (BOOL)hasSpaceAvailable
+{
+    return (self->_status == NSStreamStatusOpen);
+}
+
+@end
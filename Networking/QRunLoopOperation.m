@@ -1,4 +1,5 @@
 #import "QRunLoopOperation.h"
+#import "QTrace.h"
 
 /*
     Theory of Operation
@@ -323,6 +324,10 @@ XXX  7. init -> start -> cancel -> startOnRunLoopThreadThread -> cancelOnRunLoop
     assert(self.isActualRunLoopThread);
     assert(self.state == kQRunLoopOperationStateExecuting);
 
+    if (QTraceIsRecording()) {
+        [[QTrace trace] operationDidBegin:self];
+    }
+
     // 测试是否取消了操作
     if ([self isCancelled]) {
         // We were cancelled before we even got running.
@@ -366,6 +371,9 @@ XXX  7. init -> start -> cancel -> startOnRunLoopThreadThread -> cancelOnRunLoop
         self.error = error;
     }
     [self operationWillFinish];   //即使有错误也调用 operationWillFinish 方法
+    if (QTraceIsRecording()) {
+        [[QTrace trace] operationDidEnd:self];
+    }
     self.state = kQRunLoopOperationStateFinished;
 }
 
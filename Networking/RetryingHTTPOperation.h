@@ -13,8 +13,10 @@
       你应该只用本类进行一些幂等的请求,即, 多次同样的请求不会导致问题.
     
     o It only retries requests where the result is likely to change.  For example, 
-      there's no point retrying after an HTTP 404 status code.  The (private) method 
-      -shouldRetryAfterError: controls what will and won't be retried.
+      there's no point retrying after an HTTP 404 status code.  The exception is 503 
+      "Service Unavailable", which is retried, but no sooner than the response's 
+      Retry-After.  The (private) method -shouldRetryAfterError: controls what will 
+      and won't be retried.
       它只有像在请求结果改变的时候重新尝试请求.比如,如果收到一个 HTTP 404 的回应代码后,就不会重新尝试获取.
       私有方法 -shouldRetryAfterError: 控制着什么时候 尝试或者不尝试 重新获取.
 
@@ -57,6 +59,8 @@
 
 @class QHTTPOperation;
 @class QReachabilityOperation;
+@class NetworkOperationGroup;
+@class QHTTPResponseCache;
 
 typedef NS_ENUM(NSInteger, RetryingHTTPOperationState) {
     kRetryingHTTPOperationStateNotStarted,
@@ -82,6 +86,18 @@ typedef NS_ENUM(NSInteger, RetryingHTTPOperationState) {
     NSTimer *                   _retryTimer;
     QReachabilityOperation *    _reachabilityOperation;
     BOOL                        _notificationInstalled;
+    BOOL                        _computesResponseDigest;
+    long long                   _responseFileOffset;
+    long long                   _responseFileLength;
+    NSString *                  _responseDigest;  //从 QHTTPOperation的responseDigest获得
+    CFAbsoluteTime              _startTime;
+    CFAbsoluteTime              _retryWaitStartTime;        // 0 if we're not waiting to retry
+    CFAbsoluteTime              _retryNotBeforeTime;        // 0 unless the server sent a 503 with Retry-After
+    CFAbsoluteTime              _reachableWaitStartTime;    // 0 if we're not waiting for the host to become reachable
+    NetworkOperationGroup *     _operationGroup;
+    QHTTPResponseCache *        _responseCache;
+    long long                   _responseBytesFromCache;
+    long long                   _responseBytesFromNetwork;
 }
 
 // Initialise the operation to run the specified HTTP request.
@@ -101,6 +117,14 @@ typedef NS_ENUM(NSInteger, RetryingHTTPOperationState) {
 // 这些属性是可以修改的,在加入到 queue 之前 , runLoopThread  和  runLoopModes 从 QRunLoopOperation 继承
 @property (copy,   readwrite) NSSet *                       acceptableContentTypes; // default is nil, implying anything is acceptable
 @property (retain, readwrite) NSString *                    responseFilePath;       // defaults to nil, which puts response into responseContent
+@property (assign, readwrite) BOOL                          computesResponseDigest; // default is NO, only applies if responseFilePath is set
+@property (assign, readwrite) long long                     responseFileOffset;     // default is -1, which replaces the file at responseFilePath; 
+                                                                                    // otherwise that file must exist, and the response is written into it at this offset
+@property (assign, readwrite) long long                     responseFileLength;     // default is -1, meaning no limit; otherwise, with a responseFileOffset, 
+                                                                                    // any of the response past this many bytes is dropped rather than written
+@property (retain, readwrite) NetworkOperationGroup *       operationGroup;         // default is nil; NetworkManager sets it to the group the operation is queued in, 
+                                                                                    // and the network transfers are queued in that group too
+@property (retain, readwrite) QHTTPResponseCache *          responseCache;          // default is nil; passed on to each network transfer
 
 // Things that change as part of the progress of the operation.
 // 这些是被作为  operation 进程的一部,并且随状态值的变化而变化. 所以是只读.
@@ -116,5 +140,25 @@ typedef NS_ENUM(NSInteger, RetryingHTTPOperationState) {
 // error property inherited from QRunLoopOperation
 @property (copy,   readonly ) NSString *                    responseMIMEType;       // MIME type of responseContent
 @property (copy,   readonly ) NSData *                      responseContent;        // responseContent (nil if response content went to responseFilePath)
+@property (copy,   readonly ) NSDictionary *                responseHeaders;        // header fields of the final response
+@property (copy,   readonly ) NSString *                    responseDigest;         // SHA-1 of the file at responseFilePath, if computesResponseDigest is set
+@property (assign, readonly ) long long                     responseBytesFromCache;     // body bytes served by responseCache
+@property (assign, readonly ) long long                     responseBytesFromNetwork;   // body bytes that came over the network, including failed attempts
+
+// Process-wide statistics, accumulated as each operation finishes, so that a load test
+// (see QFaultSimulator) can see how the retry machinery behaved.  The keys are:
+//
+// o succeeded, failed, cancelled -- NSNumber counts of finished operations
+// o retries -- NSNumber, total number of retries
+// o retryHistogram -- NSArray of NSNumber; element N is the number of operations that
+//   finished after N retries, with the last element counting that many or more
+// o retryWaitTime -- NSNumber, total seconds spent waiting to retry
+// o reachabilityWaits, reachabilityWaitTime -- NSNumber, how often, and for how many
+//   seconds in total, operations waited for their host to become reachable
+// o elapsedTime -- NSNumber, total seconds from start to finish
+//
+// 全局的统计数据, 供压力测试使用.  Any thread.
++ (NSDictionary *)statistics;
++ (void)resetStatistics;
 
 @end
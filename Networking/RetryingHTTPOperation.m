@@ -3,6 +3,7 @@
 #import "Logging.h"
 #import "QHTTPOperation.h"
 #import "QReachabilityOperation.h"
+#import "QFileRegionOutputStream.h"
 
 // When one operation completes it posts the following notification.  Other operations 
 // listen for that notification and, if the host name matches, expedite their retry. 
@@ -13,6 +14,25 @@
 static NSString * kRetryingHTTPOperationTransferDidSucceedNotification = @"com.apple.dts.kRetryingHTTPOperationTransferDidSucceedNotification";
 static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
 
+// Statistics for +statistics, protected by @synchronized on the class.
+// 全局统计数据, 通过 @synchronized ([RetryingHTTPOperation class]) 保护.
+
+enum {
+    kRetryHistogramBucketCount = 5          // 0, 1, 2, 3 and 4-or-more retries
+};
+
+static struct {
+    NSUInteger      succeeded;
+    NSUInteger      failed;
+    NSUInteger      cancelled;
+    NSUInteger      retries;
+    NSUInteger      retryHistogram[kRetryHistogramBucketCount];
+    NSTimeInterval  retryWaitTime;
+    NSUInteger      reachabilityWaits;
+    NSTimeInterval  reachabilityWaitTime;
+    NSTimeInterval  elapsedTime;
+} sStatistics;
+
 @interface RetryingHTTPOperation ()
 
 // read/write versions of public properties
@@ -21,6 +41,9 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
 @property (assign, readwrite) BOOL                          hasHadRetryableFailure;
 @property (assign, readwrite) NSUInteger                    retryCount;
 @property (copy,   readwrite) NSData *                      responseContent;   
+@property (copy,   readwrite) NSString *                    responseDigest;
+@property (assign, readwrite) long long                     responseBytesFromCache;
+@property (assign, readwrite) long long                     responseBytesFromNetwork;
 
 // private properties
 @property (copy,   readwrite) NSHTTPURLResponse *           response;
@@ -91,6 +114,8 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
             sSequenceNumber += 1;
         }
         self->_request = [request copy];  //初始化 NSURLRequest
+        self->_responseFileOffset = -1;
+        self->_responseFileLength = -1;
         assert(self->_retryState == kRetryingHTTPOperationStateNotStarted); //应该为默认值
     }
     
@@ -104,6 +129,9 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
     [self->_responseFilePath release];
     [self->_response release];
     [self->_responseContent release];
+    [self->_responseDigest release];
+    [self->_operationGroup release];
+    [self->_responseCache release];
     
     assert(self->_networkOperation == nil); // 释放被管理的真正执行 HTTP GET的方法实例
     assert(self->_retryTimer == nil);
@@ -112,6 +140,95 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
     [super dealloc];
 }
 
+#pragma mark - Statistics
+
++ (NSDictionary *)statistics
+{
+    NSMutableArray *    histogram;
+    NSDictionary *      result;
+    
+    @synchronized ([RetryingHTTPOperation class]) {
+        histogram = [NSMutableArray array];
+        assert(histogram != nil);
+        for (NSUInteger bucket = 0; bucket < kRetryHistogramBucketCount; bucket++) {
+            [histogram addObject:[NSNumber numberWithUnsignedInteger:sStatistics.retryHistogram[bucket]]];
+        }
+        result = [NSDictionary dictionaryWithObjectsAndKeys:
+            [NSNumber numberWithUnsignedInteger:sStatistics.succeeded],         @"succeeded",
+            [NSNumber numberWithUnsignedInteger:sStatistics.failed],            @"failed",
+            [NSNumber numberWithUnsignedInteger:sStatistics.cancelled],         @"cancelled",
+            [NSNumber numberWithUnsignedInteger:sStatistics.retries],           @"retries",
+            histogram,                                                          @"retryHistogram",
+            [NSNumber numberWithDouble:sStatistics.retryWaitTime],              @"retryWaitTime",
+            [NSNumber numberWithUnsignedInteger:sStatistics.reachabilityWaits], @"reachabilityWaits",
+            [NSNumber numberWithDouble:sStatistics.reachabilityWaitTime],       @"reachabilityWaitTime",
+            [NSNumber numberWithDouble:sStatistics.elapsedTime],                @"elapsedTime",
+            nil
+        ];
+    }
+    return result;
+}
+
++ (void)resetStatistics
+{
+    @synchronized ([RetryingHTTPOperation class]) {
+        memset(&sStatistics, 0, sizeof(sStatistics));
+    }
+}
+
+// Ends a retry wait, if one is in progress, and adds it to the statistics.
+- (void)noteRetryWaitDone
+{
+    if (self->_retryWaitStartTime != 0) {
+        @synchronized ([RetryingHTTPOperation class]) {
+            sStatistics.retryWaitTime += CFAbsoluteTimeGetCurrent() - self->_retryWaitStartTime;
+        }
+        self->_retryWaitStartTime = 0;
+    }
+}
+
+// Ends a wait for the host to become reachable, if one is in progress, and adds it to
+// the statistics.
+- (void)noteReachableWaitDone
+{
+    if (self->_reachableWaitStartTime != 0) {
+        @synchronized ([RetryingHTTPOperation class]) {
+            sStatistics.reachabilityWaitTime += CFAbsoluteTimeGetCurrent() - self->_reachableWaitStartTime;
+        }
+        self->_reachableWaitStartTime = 0;
+    }
+}
+
+// Called as the operation finishes to add its results to the statistics.
+- (void)noteFinished
+{
+    NSError *   error;
+    NSUInteger  bucket;
+    
+    [self noteRetryWaitDone];
+    [self noteReachableWaitDone];
+    
+    error = self.error;
+    bucket = self.retryCount;
+    if (bucket >= kRetryHistogramBucketCount) {
+        bucket = kRetryHistogramBucketCount - 1;
+    }
+    @synchronized ([RetryingHTTPOperation class]) {
+        if (error == nil) {
+            sStatistics.succeeded += 1;
+        } else if ( [[error domain] isEqual:NSCocoaErrorDomain] && ([error code] == NSUserCancelledError) ) {
+            sStatistics.cancelled += 1;
+        } else {
+            sStatistics.failed += 1;
+        }
+        sStatistics.retries += self.retryCount;
+        sStatistics.retryHistogram[bucket] += 1;
+        if (self->_startTime != 0) {
+            sStatistics.elapsedTime += CFAbsoluteTimeGetCurrent() - self->_startTime;
+        }
+    }
+}
+
 #pragma mark - Properties
 
 @synthesize request = _request;
@@ -131,6 +248,14 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
 @synthesize reachabilityOperation  = _reachabilityOperation;
 @synthesize notificationInstalled  = _notificationInstalled;  //如果一个下载成功后,立即通知其他此 server 的下载重新尝试的notification callback 是否已经安装了
 @synthesize responseContent = _responseContent;               //URL请求返回的内容
+@synthesize computesResponseDigest = _computesResponseDigest;
+@synthesize responseFileOffset     = _responseFileOffset;     //写入 responseFilePath 的位置, -1 表示替换整个文件
+@synthesize responseFileLength     = _responseFileLength;     //最多写入的字节数, -1 表示不限
+@synthesize responseDigest  = _responseDigest;                //下载到文件的内容的 SHA-1
+@synthesize operationGroup  = _operationGroup;                //网络传输也加入这个 group, 以便公平地分享传输队列
+@synthesize responseCache   = _responseCache;                 //每次网络传输都使用这个 HTTP 缓存
+@synthesize responseBytesFromCache   = _responseBytesFromCache;
+@synthesize responseBytesFromNetwork = _responseBytesFromNetwork;
 
 
 //  本方法在被添加到 NetworkManger 的 网络管理队列(queueForNetworkManagement) 上执行
@@ -178,6 +303,11 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
     return result;
 }
 
+- (NSDictionary *)responseHeaders
+{
+    return [self.response allHeaderFields];
+}
+
 #pragma mark - Utilities
 
 /*!
@@ -210,10 +340,14 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
     if ( [[error domain] isEqual:kQHTTPOperationErrorDomain] ) {
         // We can easily understand the consequence(result) of coming directly from QHTTPOperation.
         
-        if ( [error code] > 0 ) { //正整数是 server 返回的 HTML status codes
+        if ( [error code] == 503 ) {
+            // 503 "Service Unavailable" means the server is overloaded or down for 
+            // maintenance, which is temporary by definition.  We retry, no sooner than 
+            // any Retry-After it sent (see -retryAfterDelayForOperation:).
+            // 服务器暂时不可用, 可以重试.
+            shouldRetry = YES;
+        } else if ( [error code] > 0 ) { //正整数是 server 返回的 HTML status codes
             // The request made it to the server, which failed it.  We consider that to be fatal.
-            // It might make sense to handle error 503 "Service Unavailable" as a
-            // special case here but, realistically(现实中), how common is that?
             shouldRetry = NO;
         } else {
             switch ( [error code] ) {
@@ -241,6 +375,39 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
 }
 
 
+/*!
+ *  服务器在 503 回应里要求的最短等待时间
+ *
+ *  Returns the number of seconds that the server asked us to wait before retrying, 
+ *  that is, the Retry-After of a 503 response, or 0 if there's no such thing.  We only 
+ *  understand the delta-seconds form; an HTTP-date is treated as absent, which leaves 
+ *  the normal retry delays in charge.  We cap it at kMaximumRetryAfterDelay so that 
+ *  a broken server can't park us indefinitely.
+ *
+ *  @param operation 刚刚失败的请求
+ */
+- (NSTimeInterval)retryAfterDelayForOperation:(QHTTPOperation *)operation
+{
+    static const NSTimeInterval kMaximumRetryAfterDelay = 60.0 * 60.0;
+    NSString *      retryAfter;
+    NSScanner *     scanner;
+    NSInteger       seconds;
+    
+    if ( [operation.lastResponse statusCode] != 503 ) {
+        return 0.0;
+    }
+    retryAfter = [[operation.lastResponse allHeaderFields] objectForKey:@"Retry-After"];
+    if (retryAfter == nil) {
+        return 0.0;
+    }
+    scanner = [NSScanner scannerWithString:retryAfter];
+    assert(scanner != nil);
+    if ( ! [scanner scanInteger:&seconds] || ! [scanner isAtEnd] || (seconds <= 0) ) {
+        return 0.0;
+    }
+    return MIN((NSTimeInterval) seconds, kMaximumRetryAfterDelay);
+}
+
 /*!
  *  获取下次进行重新请求是多长时间以后
     这不是一个加密的系统, 所以我们不关心取模偏差, 我们的随机时间间隔,只是通过使用随机数取模一个延迟毫秒数
@@ -288,6 +455,16 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
 }
 
 
+- (void)setQueuePriority:(NSOperationQueuePriority)priority
+    // Override to pass the new priority on to the current network operation (if any), 
+    // so that raising the priority of an in-flight retrying operation (for example, 
+    // when a prefetched photo is actually displayed) takes effect on the transfer queue. 
+    // Subsequent network operations pick up the priority in -startRequest.
+{
+    [super setQueuePriority:priority];
+    [self.networkOperation setQueuePriority:priority];
+}
+
 #pragma mark - Core state transitions 本类在执行后调用的第一个有意义的函数
 
 /*!
@@ -314,21 +491,33 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
     self.networkOperation.acceptableContentTypes = self.acceptableContentTypes;
     self.networkOperation.runLoopThread = self.runLoopThread;
     self.networkOperation.runLoopModes  = self.runLoopModes;
+    self.networkOperation.responseCache = self.responseCache;
     
     // If we're downloading to a file, set up an output stream that points to that file. 
     // 
     // Note that we pass NO to the append parameter; if we wanted to support resumeable 
     // downloads, we could do it here (but we'd have to mess around with etags and so on).
     //
+    // If we're filling in a region of a file (a segment of a SegmentedHTTPOperation), a 
+    // retry starts again at the beginning of that region, leaving the rest of the file alone.
+    //
     if (self.responseFilePath != nil) {
-        self.networkOperation.responseOutputStream = [NSOutputStream outputStreamToFileAtPath:self.responseFilePath append:NO];
+        if (self.responseFileOffset < 0) {
+            self.networkOperation.responseOutputStream = [NSOutputStream outputStreamToFileAtPath:self.responseFilePath append:NO];
+        } else {
+            self.networkOperation.responseOutputStream = [[[QFileRegionOutputStream alloc] initWithPath:self.responseFilePath 
+                offset:(unsigned long long) self.responseFileOffset 
+                length:(self.responseFileLength < 0) ? ULLONG_MAX : (unsigned long long) self.responseFileLength
+            ] autorelease];
+        }
         assert(self.networkOperation.responseOutputStream != nil);
+        self.networkOperation.computesResponseDigest = self.computesResponseDigest;
     }
 
     //添加到队列,开始网络下载
     //本例是在 NetworkManger的网络管理队列(queueForNetworkManagement) 里执行,
     //而下面将 self.networkOperation 添加到 NetworkManger的网络传输队列(queueForNetworkTransfers) 里执行.
-    [[NetworkManager sharedManager] addNetworkTransferOperation:self.networkOperation finishedTarget:self action:@selector(networkOperationDone:)];
+    [[NetworkManager sharedManager] addNetworkTransferOperation:self.networkOperation finishedTarget:self action:@selector(networkOperationDone:) group:self.operationGroup];
     //到此本网络管理队列(queueForNetworkManagement)里的一个本类实例对象 operation 需要等待self.networkOperation添加到NetworkManger的网络传输队列(queueForNetworkTransfers)
     //里的self.networkOperation完成后(可能不成功),  然后在[本线程]上调用[本类]的networkOperationDone:方法, networkOperationDone:方法会有两种情况:
     //        (1) 如果请求顺利完成,本类的networkOperationDone:方法调用父类的 [self finishWithError:nil],
@@ -353,12 +542,31 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
     
     self.networkOperation = nil;  //请求已经完成(或成功,或失败),并不需要在留着QHTTPOperation的实例
 
+    self.responseBytesFromCache   += operation.responseBytesFromCache;
+    self.responseBytesFromNetwork += operation.responseBytesFromNetwork;
+
     if (operation.error == nil) {  // The request was successful; let's complete the operation.
         
         [[QLog log] logOption:kLogOptionNetworkDetails withFormat:@" %s http %zu request success",__PRETTY_FUNCTION__, (size_t) self->_sequenceNumber];
     
         self.response = operation.lastResponse;        //NSHTTPURLResponse
         self.responseContent = operation.responseBody; //NSData
+        self.responseDigest  = operation.responseDigest;
+        
+        // Tell the network manager how long this took, so that it can estimate the 
+        // throughput to this host.  A response from the cache says nothing about that. 
+        // We measure from when the transfer started, not when we queued it, so that time 
+        // spent waiting behind other transfers doesn't count against the link.
+        
+        if ( (operation.responseBytesFromCache == 0) && (operation.transferStartTime != 0.0) ) {
+            unsigned long long  bytes;
+            if (self.responseFilePath != nil) {
+                bytes = [[[[[[NSFileManager alloc] init] autorelease] attributesOfItemAtPath:self.responseFilePath error:NULL] fileSize];   // -defaultManager is not thread safe
+            } else {
+                bytes = [self.responseContent length];
+            }
+            [[NetworkManager sharedManager] noteTransferOfBytes:bytes duration:CFAbsoluteTimeGetCurrent() - operation.transferStartTime forHost:[[self.request URL] host]];
+        }
         
         ////这将导致调用,本类的 - (void)operationWillFinish
         [self finishWithError:nil];     // this changes state to kRetryingHTTPOperationStateFinished
@@ -375,6 +583,7 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
             [self finishWithError:operation.error];
 
         } else { //继续重新尝试请求
+            NSTimeInterval  retryAfterDelay;
             
             // If this is our first retry, tell our client that we are in retry mode.
             // Model 层的 Photo 类,对此值进行监控,如果此值发生变化,代表第一次从网络获得 thumbnail 失败.启用 placeholder 为 thumbnail
@@ -406,8 +615,12 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
                 [self startReachabilityReachable:NO];
             }
         
-            // Start a time-based retry.
+            // Start a time-based retry.  If the server told us when to come back, none 
+            // of the retries, including the fast ones, goes any sooner.
             self.retryState = kRetryingHTTPOperationStateWaitingToRetry;
+            self->_retryWaitStartTime = CFAbsoluteTimeGetCurrent();
+            retryAfterDelay = [self retryAfterDelayForOperation:operation];
+            self->_retryNotBeforeTime = (retryAfterDelay > 0.0) ? (self->_retryWaitStartTime + retryAfterDelay) : 0.0;
             [self startRetryAfterTimeInterval:[self randomRetryDelay]];
         }
         
@@ -474,6 +687,10 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
     assert(self.retryState == kRetryingHTTPOperationStateWaitingToRetry);
     assert(self.retryTimer == nil);
 
+    if (self->_retryNotBeforeTime != 0.0) {
+        delay = MAX(delay, self->_retryNotBeforeTime - CFAbsoluteTimeGetCurrent());
+    }
+
     [[QLog log] logOption:kLogOptionNetworkDetails withFormat:@"%s http %zu retry wait start %.3f",__PRETTY_FUNCTION__, (size_t) self->_sequenceNumber, delay];
 
     self.retryTimer = [NSTimer timerWithTimeInterval:delay target:self selector:@selector(retryTimerDone:) userInfo:nil repeats:NO];
@@ -502,6 +719,7 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
     assert(self.retryState == kRetryingHTTPOperationStateWaitingToRetry);
     self.retryState = kRetryingHTTPOperationStateRetrying;
     self.retryCount += 1;
+    [self noteRetryWaitDone];
 
     //开始重新的请求尝试
     [self startRequest];
@@ -522,6 +740,15 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
 {
     [[QLog log] logOption:kLogOptionNetworkDetails withFormat:@"http %zu %sreachable start", (size_t) self->_sequenceNumber, reachable ? "" : "un" ];
 
+    // Waiting for the host to become reachable means it's currently unreachable, which
+    // is the wait that the statistics care about.
+    if (reachable) {
+        @synchronized ([RetryingHTTPOperation class]) {
+            sStatistics.reachabilityWaits += 1;
+        }
+        self->_reachableWaitStartTime = CFAbsoluteTimeGetCurrent();
+    }
+
     assert(self.reachabilityOperation == nil);
     self.reachabilityOperation = [[[QReachabilityOperation alloc] initWithHostName:[[self.request URL] host]] autorelease];
     assert(self.reachabilityOperation != nil);
@@ -572,6 +799,8 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
         // system time to settle after the reachability change).
         [[QLog log] logOption:kLogOptionNetworkDetails withFormat:@"http %zu reachable done (0x%zx)", (size_t) self->_sequenceNumber, (size_t) operation.flags];
 
+        [self noteReachableWaitDone];
+
         if (self.retryState == kRetryingHTTPOperationStateWaitingToRetry) {
             assert(self.retryTimer != nil);
             [self.retryTimer invalidate];
@@ -598,6 +827,7 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
     
     [[QLog log] logOption:kLogOptionNetworkDetails withFormat:@"%s http %zu start %@", __PRETTY_FUNCTION__, (size_t) self->_sequenceNumber, [self.request URL]];
     
+    self->_startTime = CFAbsoluteTimeGetCurrent();
     self.retryState = kRetryingHTTPOperationStateGetting;//改变状态
     [self startRequest];
 }
@@ -634,6 +864,7 @@ static NSString * kRetryingHTTPOperationTransferDidSucceedHostKey = @"hostName";
         self.notificationInstalled = NO;
     }
     self.retryState = kRetryingHTTPOperationStateFinished;
+    [self noteFinished];
 
     if (self.error == nil) {
         [[QLog log] logOption:kLogOptionNetworkDetails withFormat:@"%s http %zu success", __PRETTY_FUNCTION__, (size_t) self->_sequenceNumber];
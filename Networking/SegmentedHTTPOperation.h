@@ -0,0 +1,94 @@
+#import "QRunLoopOperation.h"
+
+/*
+    SegmentedHTTPOperation downloads a large resource to a file over several
+    connections at once.  On a high latency link a single TCP connection often
+    can't fill the pipe (and some servers cap the bandwidth of each connection),
+    so splitting the resource into byte ranges and fetching them in parallel
+    can be a lot quicker.
+
+    It works like this:
+
+    1. If you don't tell it how long the resource is (expectedLength), it sends
+       a HEAD request to find out, and to see whether the server accepts ranges.
+
+    2. If the resource is at least minimumSegmentedLength bytes, it creates a
+       temporary file of that size next to responseFilePath and starts
+       segmentCount GET requests, each with a Range header covering its own part
+       of the file.  Each segment is a RetryingHTTPOperation writing into its
+       region of the file, and nowhere else (see responseFileOffset and
+       responseFileLength), so a segment that fails is retried on its own
+       without disturbing the others.
+
+    3. As each segment completes, it checks that the server sent the range it
+       asked for (Content-Range).  If the server ignored the Range header, or
+       the resource isn't the length we expected, it cancels the segments,
+       deletes the temporary file and falls back to downloading the whole thing
+       in one go, straight to responseFilePath.  Cancelling is asynchronous, so
+       a cancelled segment can still write a little more, but only into the
+       deleted temporary file.  It also gets the whole thing in one go if the
+       resource is too small to be worth splitting.
+
+    4. When all the segments are done it checks that the temporary file is the
+       right length, renames it to responseFilePath and, if
+       computesResponseDigest is set, computes its SHA-1.
+
+    The results are presented in the same way as RetryingHTTPOperation, so a
+    client can use either.  As with RetryingHTTPOperation, this runs on the
+    network management queue and queues its segments there too.
+
+    大文件分段并行下载: 每一段用一个带 Range 头的 RetryingHTTPOperation 写入文件的不同区域.
+*/
+
+@class RetryingHTTPOperation;
+@class NetworkOperationGroup;
+
+@interface SegmentedHTTPOperation : QRunLoopOperation
+{
+    NSUInteger                  _sequenceNumber;
+    NSURLRequest *              _request;
+    NSSet *                     _acceptableContentTypes;
+    NSString *                  _responseFilePath;
+    BOOL                        _computesResponseDigest;
+    long long                   _expectedLength;
+    NSUInteger                  _segmentCount;
+    long long                   _minimumSegmentedLength;
+    NetworkOperationGroup *     _operationGroup;
+
+    RetryingHTTPOperation *     _probeOperation;
+    NSMutableArray *            _segmentOperations;     // of RetryingHTTPOperation, or NSNull once the segment is done
+    long long                   _contentLength;         // -1 if we're not splitting the download
+    NSString *                  _segmentFilePath;       // temporary file the segments write into
+    long long                   _segmentLength;
+    NSUInteger                  _finishedSegmentCount;
+    NSUInteger                  _segmentRetryCount;
+    NSDate *                    _startDate;
+
+    NSString *                  _responseMIMEType;
+    NSDictionary *              _responseHeaders;
+    NSString *                  _responseDigest;
+}
+
+- (id)initWithRequest:(NSURLRequest *)request;
+
+// Things that are configured by the init method and can't be changed.
+@property (copy,   readonly ) NSURLRequest *                request;
+
+// Things you can configure before queuing the operation.
+// runLoopThread and runLoopModes inherited from QRunLoopOperation
+@property (copy,   readwrite) NSSet *                       acceptableContentTypes; // default is nil, implying anything is acceptable
+@property (retain, readwrite) NSString *                    responseFilePath;       // must be set before queuing
+@property (assign, readwrite) BOOL                          computesResponseDigest; // default is NO
+@property (assign, readwrite) long long                     expectedLength;         // default is 0, meaning unknown, which triggers a HEAD
+@property (assign, readwrite) NSUInteger                    segmentCount;           // default is 4
+@property (assign, readwrite) long long                     minimumSegmentedLength; // default is 512 KB
+@property (retain, readwrite) NetworkOperationGroup *       operationGroup;         // default is nil; set by NetworkManager, and passed on to the segments' transfers
+
+// Things that are only meaningful after the operation is finished.
+// error property inherited from QRunLoopOperation
+@property (copy,   readonly ) NSString *                    responseMIMEType;
+@property (copy,   readonly ) NSDictionary *                responseHeaders;        // header fields of the response for the first segment
+@property (copy,   readonly ) NSString *                    responseDigest;         // SHA-1 of the file, if computesResponseDigest is set
+@property (assign, readonly ) NSUInteger                    segmentRetryCount;      // total retries across all segments
+
+@end
@@ -0,0 +1,403 @@
+#import "SegmentedHTTPOperation.h"
+#import "RetryingHTTPOperation.h"
+#import "NetworkManager.h"
+#import "Logging.h"
+
+#include <CommonCrypto/CommonDigest.h>
+#include <stdio.h>                                      // for rename
+#include <errno.h>
+
+@interface SegmentedHTTPOperation ()
+
+// read/write versions of public properties
+@property (copy,   readwrite) NSString *                    responseMIMEType;
+@property (copy,   readwrite) NSDictionary *                responseHeaders;
+@property (copy,   readwrite) NSString *                    responseDigest;
+@property (assign, readwrite) NSUInteger                    segmentRetryCount;
+
+// private properties
+@property (retain, readwrite) RetryingHTTPOperation *       probeOperation;
+@property (copy,   readwrite) NSDate *                      startDate;
+
+- (void)startSegmentsForLength:(long long)length;
+- (void)stopSegmentsRemovingFile:(BOOL)removeFile;
+
+@end
+
+// Header field names are case insensitive, and NSHTTPURLResponse doesn't promise
+// any particular capitalisation, so we search.
+static NSString * HeaderValue(NSDictionary * headers, NSString * name)
+{
+    for (NSString * key in headers) {
+        if ([key caseInsensitiveCompare:name] == NSOrderedSame) {
+            return [headers objectForKey:key];
+        }
+    }
+    return nil;
+}
+
+// Parses a Content-Range header of the form "bytes first-last/total".
+static BOOL ParseContentRange(NSString * contentRange, long long * firstPtr, long long * lastPtr, long long * totalPtr)
+{
+    NSScanner * scanner;
+
+    assert(firstPtr != NULL);
+    assert(lastPtr != NULL);
+    assert(totalPtr != NULL);
+
+    if (contentRange == nil) {
+        return NO;
+    }
+    scanner = [NSScanner scannerWithString:contentRange];
+    assert(scanner != nil);
+    return [scanner scanString:@"bytes" intoString:NULL]
+        && [scanner scanLongLong:firstPtr]
+        && [scanner scanString:@"-" intoString:NULL]
+        && [scanner scanLongLong:lastPtr]
+        && [scanner scanString:@"/" intoString:NULL]
+        && [scanner scanLongLong:totalPtr];
+}
+
+// Returns the lowercase hex SHA-1 of the file at path, or nil if it can't be read.
+static NSString * DigestOfFileAtPath(NSString * path)
+{
+    NSString *          result;
+    NSData *            data;
+    unsigned char       digest[CC_SHA1_DIGEST_LENGTH];
+    NSMutableString *   digestString;
+    size_t              digestIndex;
+
+    result = nil;
+    data = [NSData dataWithContentsOfFile:path options:NSMappedRead error:NULL];
+    if (data != nil) {
+        (void) CC_SHA1([data bytes], (CC_LONG) [data length], digest);
+        digestString = [NSMutableString stringWithCapacity:CC_SHA1_DIGEST_LENGTH * 2];
+        assert(digestString != nil);
+        for (digestIndex = 0; digestIndex < CC_SHA1_DIGEST_LENGTH; digestIndex++) {
+            [digestString appendFormat:@"%02x", (unsigned int) digest[digestIndex]];
+        }
+        result = digestString;
+    }
+    return result;
+}
+
+@implementation SegmentedHTTPOperation
+
+- (id)initWithRequest:(NSURLRequest *)request
+{
+    assert(request != nil);
+    assert([[request HTTPMethod] isEqual:@"GET"]);
+
+    self = [super init];
+    if (self != nil) {
+        @synchronized ([self class]) {
+            static NSUInteger sSequenceNumber;
+            self->_sequenceNumber = sSequenceNumber;
+            sSequenceNumber += 1;
+        }
+        self->_request                = [request copy];
+        self->_segmentCount           = 4;
+        self->_minimumSegmentedLength = 512 * 1024;
+        self->_contentLength          = -1;
+        self->_segmentOperations      = [[NSMutableArray alloc] init];
+        assert(self->_segmentOperations != nil);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self->_request release];
+    [self->_acceptableContentTypes release];
+    [self->_responseFilePath release];
+    [self->_operationGroup release];
+    assert(self->_probeOperation == nil);
+    [self->_segmentOperations release];
+    [self->_segmentFilePath release];
+    [self->_startDate release];
+    [self->_responseMIMEType release];
+    [self->_responseHeaders release];
+    [self->_responseDigest release];
+    [super dealloc];
+}
+
+#pragma mark - Properties
+
+@synthesize request                = _request;
+@synthesize acceptableContentTypes = _acceptableContentTypes;
+@synthesize responseFilePath       = _responseFilePath;
+@synthesize computesResponseDigest = _computesResponseDigest;
+@synthesize expectedLength         = _expectedLength;
+@synthesize segmentCount           = _segmentCount;
+@synthesize minimumSegmentedLength = _minimumSegmentedLength;
+@synthesize operationGroup         = _operationGroup;
+@synthesize responseMIMEType       = _responseMIMEType;
+@synthesize responseHeaders        = _responseHeaders;
+@synthesize responseDigest         = _responseDigest;
+@synthesize segmentRetryCount      = _segmentRetryCount;
+@synthesize probeOperation         = _probeOperation;
+@synthesize startDate              = _startDate;
+
+#pragma mark - Probe
+
+// Sends a HEAD request to find out how long the resource is and whether the server
+// will let us fetch it in ranges.
+- (void)startProbe
+{
+    NSMutableURLRequest *   request;
+
+    assert([self isActualRunLoopThread]);
+    assert(self.probeOperation == nil);
+
+    request = [[self.request mutableCopy] autorelease];
+    assert(request != nil);
+    [request setHTTPMethod:@"HEAD"];
+
+    self.probeOperation = [[[RetryingHTTPOperation alloc] initWithRequest:request] autorelease];
+    assert(self.probeOperation != nil);
+    [self.probeOperation setQueuePriority:[self queuePriority]];
+    self.probeOperation.operationGroup = self.operationGroup;
+
+    [[NetworkManager sharedManager] addNetworkManagementOperation:self.probeOperation finishedTarget:self action:@selector(probeDone:)];
+}
+
+- (void)probeDone:(RetryingHTTPOperation *)operation
+{
+    long long   length;
+    NSString *  acceptRanges;
+
+    assert([self isActualRunLoopThread]);
+    assert(operation == self.probeOperation);
+
+    self.probeOperation = nil;
+
+    if (operation.error != nil) {
+        [self finishWithError:operation.error];
+    } else {
+        length       = [HeaderValue(operation.responseHeaders, @"Content-Length") longLongValue];
+        acceptRanges = HeaderValue(operation.responseHeaders, @"Accept-Ranges");
+        if ( (acceptRanges == nil) || ([acceptRanges rangeOfString:@"bytes"].location == NSNotFound) ) {
+            length = -1;
+        }
+        [[QLog log] logOption:kLogOptionNetworkDetails withFormat:@"%s segmented %zu probe length %lld", __PRETTY_FUNCTION__, (size_t) self->_sequenceNumber, length];
+        [self startSegmentsForLength:length];
+    }
+}
+
+#pragma mark - Segments
+
+// Starts the segments for a resource of the specified length.  If the length is unknown
+// (-1), or too small to be worth splitting, this starts a single segment that gets the
+// whole resource without a Range header.
+- (void)startSegmentsForLength:(long long)length
+{
+    NSUInteger      count;
+    NSUInteger      segmentIndex;
+
+    assert([self isActualRunLoopThread]);
+    assert([self->_segmentOperations count] == 0);
+
+    if ( (length >= self.minimumSegmentedLength) && (self.segmentCount > 1) ) {
+        NSFileHandle *  file;
+
+        // Make the temporary file the full size up front, so that each segment can write 
+        // into its own region of it.
+
+        assert(self->_segmentFilePath == nil);
+        self->_segmentFilePath = [[self.responseFilePath stringByAppendingPathExtension:@"segments"] copy];
+        assert(self->_segmentFilePath != nil);
+        (void) [[[[NSFileManager alloc] init] autorelease] createFileAtPath:self->_segmentFilePath contents:nil attributes:nil];   // -defaultManager is not thread safe
+        file = [NSFileHandle fileHandleForWritingAtPath:self->_segmentFilePath];
+        if (file != nil) {
+            [file truncateFileAtOffset:(unsigned long long) length];
+            [file closeFile];
+            self->_contentLength = length;
+            self->_segmentLength = (length + (long long) self.segmentCount - 1) / (long long) self.segmentCount;
+        } else {
+            self->_contentLength = -1;
+        }
+    } else {
+        self->_contentLength = -1;
+    }
+    count = (self->_contentLength < 0) ? 1 : self.segmentCount;
+
+    [[QLog log] logOption:kLogOptionNetworkDetails withFormat:@"%s segmented %zu start %zu segments for %lld bytes", __PRETTY_FUNCTION__, (size_t) self->_sequenceNumber, (size_t) count, length];
+
+    self->_finishedSegmentCount = 0;
+    for (segmentIndex = 0; segmentIndex < count; segmentIndex++) {
+        NSMutableURLRequest *   request;
+        RetryingHTTPOperation * segment;
+
+        long long               first;
+        long long               last;
+
+        request = [[self.request mutableCopy] autorelease];
+        assert(request != nil);
+
+        first = -1;
+        last  = -1;
+        if (self->_contentLength >= 0) {
+            first = (long long) segmentIndex * self->_segmentLength;
+            last  = MIN(first + self->_segmentLength, self->_contentLength) - 1;
+            [request setValue:[NSString stringWithFormat:@"bytes=%lld-%lld", first, last] forHTTPHeaderField:@"Range"];
+        }
+
+        segment = [[[RetryingHTTPOperation alloc] initWithRequest:request] autorelease];
+        assert(segment != nil);
+        if (self->_contentLength >= 0) {
+            segment.responseFilePath   = self->_segmentFilePath;
+            segment.responseFileOffset = first;
+            segment.responseFileLength = last - first + 1;      // a server that ignores Range can't write past the region
+        } else {
+            segment.responseFilePath   = self.responseFilePath; // replaces the whole file
+        }
+        segment.acceptableContentTypes = self.acceptableContentTypes;
+        segment.operationGroup         = self.operationGroup;
+        [segment setQueuePriority:[self queuePriority]];
+
+        [self->_segmentOperations addObject:segment];
+        [[NetworkManager sharedManager] addNetworkManagementOperation:segment finishedTarget:self action:@selector(segmentDone:)];
+    }
+}
+
+// Cancels any segments that are still running and, if removeFile is YES, deletes 
+// their temporary file.  A cancelled segment may yet write a little more (the 
+// cancel is asynchronous), but if it does it's writing into a deleted file, which 
+// does no harm.
+- (void)stopSegmentsRemovingFile:(BOOL)removeFile
+{
+    for (id segment in self->_segmentOperations) {
+        if (segment != [NSNull null]) {
+            [[NetworkManager sharedManager] cancelOperation:segment];
+        }
+    }
+    [self->_segmentOperations removeAllObjects];
+    if (self->_segmentFilePath != nil) {
+        if (removeFile) {
+            (void) [[[[NSFileManager alloc] init] autorelease] removeItemAtPath:self->_segmentFilePath error:NULL];   // -defaultManager is not thread safe
+        }
+        [self->_segmentFilePath release];
+        self->_segmentFilePath = nil;
+    }
+}
+
+// Returns YES if the segment got the range we asked for.
+- (BOOL)isValidSegment:(RetryingHTTPOperation *)segment atIndex:(NSUInteger)segmentIndex
+{
+    long long   first;
+    long long   last;
+    long long   total;
+
+    assert(self->_contentLength >= 0);
+
+    return ParseContentRange(HeaderValue(segment.responseHeaders, @"Content-Range"), &first, &last, &total)
+        && (first == (long long) segmentIndex * self->_segmentLength)
+        && (last  == MIN(first + self->_segmentLength, self->_contentLength) - 1)
+        && (total == self->_contentLength);
+}
+
+- (void)segmentDone:(RetryingHTTPOperation *)segment
+{
+    NSUInteger  segmentIndex;
+
+    assert([self isActualRunLoopThread]);
+
+    segmentIndex = [self->_segmentOperations indexOfObjectIdenticalTo:segment];
+    assert(segmentIndex != NSNotFound);
+    [self->_segmentOperations replaceObjectAtIndex:segmentIndex withObject:[NSNull null]];
+    self.segmentRetryCount += segment.retryCount;
+
+    if (segment.error != nil) {
+        // The segment has already done its own retrying, so this is fatal.
+        [self finishWithError:segment.error];
+    } else if ( (self->_contentLength >= 0) && ! [self isValidSegment:segment atIndex:segmentIndex] ) {
+
+        // The server ignored our Range header, or the resource isn't as long as we were
+        // told.  Either way, start again with a single request for the whole thing.
+
+        [[QLog log] logWithFormat:@"%s segmented %zu segment %zu bad range '%@', falling back to a single get", __PRETTY_FUNCTION__, (size_t) self->_sequenceNumber, (size_t) segmentIndex, HeaderValue(segment.responseHeaders, @"Content-Range")];
+        [self stopSegmentsRemovingFile:YES];
+        [self startSegmentsForLength:-1];
+    } else {
+        if (segmentIndex == 0) {
+            self.responseMIMEType = segment.responseMIMEType;
+            self.responseHeaders  = segment.responseHeaders;
+        }
+        self->_finishedSegmentCount += 1;
+        if (self->_finishedSegmentCount == [self->_segmentOperations count]) {
+            unsigned long long  fileSize;
+            NSTimeInterval      duration;
+
+            [self->_segmentOperations removeAllObjects];
+
+            // If we split the download, check the temporary file and move it into place.
+            
+            if (self->_contentLength >= 0) {
+                fileSize = [[[[[[NSFileManager alloc] init] autorelease] attributesOfItemAtPath:self->_segmentFilePath error:NULL] fileSize];   // -defaultManager is not thread safe
+                if (fileSize != (unsigned long long) self->_contentLength) {
+                    [[QLog log] logWithFormat:@"%s segmented %zu length %llu, expected %lld", __PRETTY_FUNCTION__, (size_t) self->_sequenceNumber, fileSize, self->_contentLength];
+                    [self finishWithError:[NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorCannotParseResponse userInfo:nil]];
+                    return;
+                }
+                if ( rename([self->_segmentFilePath fileSystemRepresentation], [self.responseFilePath fileSystemRepresentation]) != 0 ) {
+                    [self finishWithError:[NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil]];
+                    return;
+                }
+                [self stopSegmentsRemovingFile:NO];
+            }
+
+            fileSize = [[[[[[NSFileManager alloc] init] autorelease] attributesOfItemAtPath:self.responseFilePath error:NULL] fileSize];   // -defaultManager is not thread safe
+            if (self.computesResponseDigest) {
+                self.responseDigest = DigestOfFileAtPath(self.responseFilePath);
+            }
+            duration = -[self.startDate timeIntervalSinceNow];
+            [[QLog log] logWithFormat:@"%s segmented %zu got %llu bytes in %.3f s (%.1f KB/s) over %zu connections, %zu segment retries", __PRETTY_FUNCTION__,
+                (size_t) self->_sequenceNumber,
+                fileSize,
+                duration,
+                (duration > 0.0) ? ((double) fileSize / 1024.0 / duration) : 0.0,
+                (size_t) ((self->_contentLength >= 0) ? self.segmentCount : 1),
+                (size_t) self.segmentRetryCount
+            ];
+            [self finishWithError:nil];
+        }
+    }
+}
+
+#pragma mark - overwrite parent method
+
+- (void)operationDidStart
+{
+    assert([self isActualRunLoopThread]);
+    assert(self.responseFilePath != nil);
+
+    [super operationDidStart];
+
+    [[QLog log] logOption:kLogOptionNetworkDetails withFormat:@"%s segmented %zu start %@", __PRETTY_FUNCTION__, (size_t) self->_sequenceNumber, [self.request URL]];
+
+    self.startDate = [NSDate date];
+    if (self.expectedLength > 0) {
+        [self startSegmentsForLength:self.expectedLength];
+    } else {
+        [self startProbe];
+    }
+}
+
+- (void)operationWillFinish
+{
+    assert([self isActualRunLoopThread]);
+
+    [super operationWillFinish];
+
+    if (self.probeOperation != nil) {
+        [[NetworkManager sharedManager] cancelOperation:self.probeOperation];
+        self.probeOperation = nil;
+    }
+    [self stopSegmentsRemovingFile:YES];
+
+    if (self.error != nil) {
+        [[QLog log] logOption:kLogOptionNetworkDetails withFormat:@"segmented %zu error %@", (size_t) self->_sequenceNumber, self.error];
+    }
+}
+
+@end
@@ -0,0 +1,321 @@
+#!/usr/bin/env python3
+#
+# batch-server.py -- a stand-in gallery server for testing batched thumbnail gets.
+#
+# It serves a generated gallery at /TestGallery/batch.xml whose root element advertises a
+# thumbnail batch endpoint, and implements that endpoint.  Everything else under the
+# directory that contains TestGallery is served as static files, so the generated photos
+# use the TestGallery images and thumbnails.
+#
+#     python3 TestGallery/batch-server.py [--port 8080] [--photos 200] [--latency 0.15]
+#                                         [--part-delay 0.0] [--drop 0.0] [--seed 1]
+#
+# The protocol, as implemented by PhotoGalleryContext:
+#
+# o The root element of the gallery carries a thumbnailBatchURL attribute, a path relative
+#   to the gallery ("thumbnails/batch").
+#
+# o The client GETs "thumbnails/batch?ids=<id>,<id>,..." and the response is
+#   multipart/mixed, with one part per photo.  Each part has a Content-ID header holding
+#   the photo ID (in angle brackets) and the thumbnail's Content-Type.  The parts are
+#   written as they're ready, so the client can start on the first while the rest are on
+#   the way.
+#
+# o A photo the server can't supply is simply left out; the client gets that thumbnail
+#   on its own.  --drop leaves out that fraction of the parts at random, to exercise this.
+#
+# To make the comparison meaningful on a local network, --latency delays the start of
+# every thumbnail response (batched or not) by that many seconds, as a high latency link
+# would, and --part-delay spaces out the parts of a batch.
+#
+#     /batch/stats      report and reset the thumbnail request counts
+#
+# Instead of serving, --compare runs a quick client side comparison of the two paths
+# against a private instance of the server: for each of --screens screenfuls of
+# --screen-size thumbnails, it fetches them one per request, with 4 requests at a time
+# (the width of NetworkManager's transfer queue), and then with a single batch request,
+# and reports the requests per screen and the time to fill the screen.
+#
+# 批量获取 thumbnail 测试用的本地服务器: gallery 根元素声明 batch 接口, 以 multipart/mixed 逐个返回.
+
+import argparse
+import concurrent.futures
+import http.client
+import http.server
+import mimetypes
+import os
+import random
+import sys
+import threading
+import time
+import urllib.parse
+from xml.sax.saxutils import quoteattr
+
+IMAGES = [
+    "IMG_0119.jpg", "IMG_0122.jpg", "IMG_0125.jpg", "IMG_0127.jpg", "IMG_0130.jpg",
+    "IMG_0133.jpg", "IMG_0139.jpg", "IMG_0149.jpg", "IMG_0152.jpg", "IMG_0156.jpg",
+]
+
+GALLERY_PATH = "/TestGallery/batch.xml"
+THUMBNAILS_PATH = "/TestGallery/thumbnails/"
+BATCH_PATH = THUMBNAILS_PATH + "batch"
+BOUNDARY = "thumbnail-batch-boundary-7d3a9c"
+TRANSFER_WIDTH = 4
+
+
+def make_photos(seed, photo_count):
+    """Returns a dict of photo ID -> photo."""
+    rng = random.Random(seed)
+    photos = {}
+    for i in range(photo_count):
+        photo_id = str(rng.getrandbits(63))
+        image = rng.choice(IMAGES)
+        photos[photo_id] = {
+            "id": photo_id,
+            "name": "Photo %s" % photo_id[-6:],
+            "date": "2010-08-%02dT%02d:%02d:%02dZ" % (1 + (i % 28), rng.randrange(24), rng.randrange(60), rng.randrange(60)),
+            "image": image,
+            "thumbnail": image,
+        }
+    return photos
+
+
+def gallery_document(photos):
+    body = "".join(
+        (
+            '  <photo name=%s date=%s id=%s>\n'
+            '    <image kind="image" srcURL="images/%s"></image>\n'
+            '    <image kind="thumbnail" srcURL="thumbnails/%s"></image>\n'
+            '  </photo>\n'
+        ) % (quoteattr(p["name"]), quoteattr(p["date"]), quoteattr(p["id"]), p["image"], p["thumbnail"])
+        for p in (photos[i] for i in sorted(photos))
+    )
+    return (
+        '<?xml version="1.0"?>\n'
+        '<album QPhotoXMLVersion="1.0b4" name="Batched Thumbnails" date="2010-08-16T13:12:36Z" thumbnailBatchURL="thumbnails/batch">\n'
+        '%s</album>\n'
+    ) % body
+
+
+class State(object):
+    def __init__(self, args, root):
+        self.photos = make_photos(args.seed, args.photos)
+        self.latency = args.latency
+        self.part_delay = args.part_delay
+        self.drop = args.drop
+        self.rng = random.Random(args.seed)
+        self.root = root
+        self.lock = threading.Lock()
+        self.single_requests = 0
+        self.batch_requests = 0
+        self.parts = 0
+
+    def thumbnail_data(self, name):
+        with open(os.path.join(self.root, "TestGallery", "thumbnails", name), "rb") as f:
+            return f.read()
+
+
+class Handler(http.server.SimpleHTTPRequestHandler):
+    state = None
+
+    def log_message(self, format, *args):
+        if not self.server.quiet:
+            super().log_message(format, *args)
+
+    def send_text(self, status, content_type, text):
+        data = text.encode("utf-8")
+        self.send_response(status)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(data)))
+        self.send_header("Cache-Control", "no-store")
+        self.end_headers()
+        if self.command != "HEAD":
+            self.wfile.write(data)
+
+    def handle_batch(self, query):
+        state = self.state
+        ids = [i for i in ",".join(query.get("ids", [])).split(",") if i]
+        with state.lock:
+            state.batch_requests += 1
+            dropped = set(i for i in ids if state.rng.random() < state.drop)
+        time.sleep(state.latency)
+        self.send_response(200)
+        self.send_header("Content-Type", 'multipart/mixed; boundary="%s"' % BOUNDARY)
+        self.send_header("Cache-Control", "no-store")
+        self.end_headers()
+        if self.command == "HEAD":
+            return
+        for photo_id in ids:
+            photo = state.photos.get(photo_id)
+            if (photo is None) or (photo_id in dropped):
+                continue
+            data = state.thumbnail_data(photo["thumbnail"])
+            content_type = mimetypes.guess_type(photo["thumbnail"])[0] or "application/octet-stream"
+            self.wfile.write(((
+                "--%s\r\n"
+                "Content-Type: %s\r\n"
+                "Content-ID: <%s>\r\n"
+                "Content-Length: %d\r\n"
+                "\r\n"
+            ) % (BOUNDARY, content_type, photo_id, len(data))).encode("ascii"))
+            self.wfile.write(data)
+            self.wfile.write(b"\r\n")
+            self.wfile.flush()
+            with state.lock:
+                state.parts += 1
+            if state.part_delay > 0:
+                time.sleep(state.part_delay)
+        self.wfile.write(("--%s--\r\n" % BOUNDARY).encode("ascii"))
+
+    def handle_stats(self):
+        state = self.state
+        with state.lock:
+            text = "%d single thumbnail requests, %d batch requests carrying %d parts\n" % (
+                state.single_requests, state.batch_requests, state.parts
+            )
+            state.single_requests = state.batch_requests = state.parts = 0
+        self.send_text(200, "text/plain", text)
+
+    def do_GET(self):
+        url = urllib.parse.urlsplit(self.path)
+        if url.path == GALLERY_PATH:
+            self.send_text(200, "application/xml", gallery_document(self.state.photos))
+        elif url.path == BATCH_PATH:
+            self.handle_batch(urllib.parse.parse_qs(url.query))
+        elif url.path == "/batch/stats":
+            self.handle_stats()
+        else:
+            if url.path.startswith(THUMBNAILS_PATH):
+                with self.state.lock:
+                    self.state.single_requests += 1
+                time.sleep(self.state.latency)
+            super().do_GET()
+
+    def do_HEAD(self):
+        self.do_GET()
+
+
+def start_server(args, quiet):
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    Handler.state = State(args, root)
+    handler = lambda *a, **kw: Handler(*a, directory=root, **kw)
+    server = http.server.ThreadingHTTPServer(("127.0.0.1" if quiet else "", args.port), handler)
+    server.quiet = quiet
+    server.daemon_threads = True
+    return server
+
+
+def fetch_single(port, path):
+    connection = http.client.HTTPConnection("127.0.0.1", port)
+    connection.request("GET", path)
+    response = connection.getresponse()
+    data = response.read()
+    connection.close()
+    assert response.status == 200, response.status
+    return data
+
+
+def fetch_batch(port, ids):
+    """Fetches a batch and parses the parts as they arrive, the way QMultipartOutputStream
+    does.  Returns the list of (photo ID, time since the request started) for each part."""
+    start = time.monotonic()
+    connection = http.client.HTTPConnection("127.0.0.1", port)
+    connection.request("GET", "%s?ids=%s" % (BATCH_PATH, ",".join(ids)))
+    response = connection.getresponse()
+    assert response.status == 200, response.status
+    delimiter = ("\r\n--%s" % BOUNDARY).encode("ascii")
+    buffer = b"\r\n"
+    parts = []
+    while True:
+        chunk = response.read1(65536)
+        if not chunk:
+            break
+        buffer += chunk
+        while True:
+            start_index = buffer.find(delimiter)
+            if start_index < 0:
+                break
+            end_index = buffer.find(delimiter, start_index + len(delimiter))
+            if end_index < 0:
+                break
+            part = buffer[start_index + len(delimiter):end_index]
+            headers, _, _ = part.partition(b"\r\n\r\n")
+            for line in headers.split(b"\r\n"):
+                name, _, value = line.decode("latin-1").partition(":")
+                if name.strip().lower() == "content-id":
+                    parts.append((value.strip(" <>"), time.monotonic() - start))
+            buffer = buffer[end_index:]
+    connection.close()
+    return parts
+
+
+def compare(args):
+    args.port = 0
+    server = start_server(args, quiet=True)
+    port = server.server_address[1]
+    thread = threading.Thread(target=server.serve_forever, daemon=True)
+    thread.start()
+
+    photos = Handler.state.photos
+    ids = sorted(photos)
+    rng = random.Random(args.seed)
+    single_times = []
+    batch_times = []
+    batch_requests = 0
+    with concurrent.futures.ThreadPoolExecutor(max_workers=TRANSFER_WIDTH) as pool:
+        for _ in range(args.screens):
+            first = rng.randrange(len(ids) - args.screen_size)
+            screen = ids[first:first + args.screen_size]
+
+            start = time.monotonic()
+            list(pool.map(lambda i: fetch_single(port, THUMBNAILS_PATH + photos[i]["thumbnail"]), screen))
+            single_times.append(time.monotonic() - start)
+
+            start = time.monotonic()
+            parts = fetch_batch(port, screen)
+            batch_requests += 1
+            missing = [i for i in screen if i not in set(p[0] for p in parts)]
+            if missing:
+                list(pool.map(lambda i: fetch_single(port, THUMBNAILS_PATH + photos[i]["thumbnail"]), missing))
+                batch_requests += len(missing)
+            batch_times.append(time.monotonic() - start)
+    server.shutdown()
+
+    def summary(times):
+        times = sorted(times)
+        return "mean %.3f s, median %.3f s, worst %.3f s" % (sum(times) / len(times), times[len(times) // 2], times[-1])
+
+    print("%d screens of %d thumbnails, latency %.3f s, part delay %.3f s, drop %.0f%%" % (
+        args.screens, args.screen_size, args.latency, args.part_delay, args.drop * 100.0
+    ))
+    print("per photo: %5.1f requests per screen, time to full screen %s" % (args.screen_size, summary(single_times)))
+    print("batched:   %5.1f requests per screen, time to full screen %s" % (float(batch_requests) / args.screens, summary(batch_times)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Stand-in gallery server for batched thumbnail gets.")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--photos", type=int, default=200)
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--latency", type=float, default=0.15, help="seconds before each thumbnail response starts")
+    parser.add_argument("--part-delay", type=float, default=0.0, help="seconds between the parts of a batch")
+    parser.add_argument("--drop", type=float, default=0.0, help="fraction of batch parts to leave out")
+    parser.add_argument("--compare", action="store_true", help="compare the two paths rather than serving")
+    parser.add_argument("--screens", type=int, default=20)
+    parser.add_argument("--screen-size", type=int, default=12)
+    args = parser.parse_args()
+
+    if args.compare:
+        compare(args)
+        return
+
+    server = start_server(args, quiet=False)
+    sys.stderr.write("serving http://localhost:%d%s (%d photos, latency %.3f s)\n" % (args.port, GALLERY_PATH, args.photos, args.latency))
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,202 @@
+#!/usr/bin/env python3
+#
+# delta-server.py -- a stand-in gallery server for testing delta sync.
+#
+# It generates two versions of a gallery from a seed and serves whichever is current at
+# /TestGallery/delta.xml.  Everything else under the directory that contains TestGallery
+# is served as static files, so the generated photos can use the TestGallery images and
+# thumbnails.
+#
+#     python3 TestGallery/delta-server.py [--port 8080] [--photos 200] [--seed 1]
+#
+# The protocol, as implemented by PhotoGallery:
+#
+# o The full index carries a changeToken attribute on its root element.
+#
+# o A client that has a token asks for "delta.xml?since=<token>".  If the token is one we
+#   issued, the response is a delta document: the root element also has a deltaFrom
+#   attribute (the token the delta applies to), and contains a <photo> element for each
+#   photo that was added or changed and a <photo id="..." removed="yes"/> element for
+#   each photo that was removed.  If the token is current, the delta is empty.
+#
+# o If the token isn't one we issued (for example, because the server was restarted with
+#   a different seed), the response is 410 Gone, and the client falls back to a full sync.
+#
+# Control URLs, which you can hit with curl or Safari:
+#
+#     /delta/advance    make version 2 current
+#     /delta/rewind     make version 1 current
+#     /delta/status     report the current version and tokens
+#
+# 增量同步测试用的本地服务器: 由同一个 seed 生成两个版本的 gallery, 提供全量索引和增量.
+
+import argparse
+import http.server
+import os
+import random
+import sys
+import urllib.parse
+from xml.sax.saxutils import quoteattr
+
+IMAGES = [
+    "IMG_0119.jpg", "IMG_0122.jpg", "IMG_0125.jpg", "IMG_0127.jpg", "IMG_0130.jpg",
+    "IMG_0133.jpg", "IMG_0139.jpg", "IMG_0149.jpg", "IMG_0152.jpg", "IMG_0156.jpg",
+]
+
+GALLERY_PATH = "/TestGallery/delta.xml"
+
+
+def make_photo(rng, photo_id, day):
+    image = rng.choice(IMAGES)
+    return {
+        "id": photo_id,
+        "name": "Photo %s" % photo_id[-6:],
+        "date": "2010-08-%02dT%02d:%02d:%02dZ" % (day, rng.randrange(24), rng.randrange(60), rng.randrange(60)),
+        "image": image,
+        "thumbnail": image,
+    }
+
+
+def make_versions(seed, photo_count):
+    """Returns (version1, version2), each a dict of photo ID -> photo.  Version 2 drops
+    about 5% of the photos, changes about 5% (name, date or thumbnail) and adds about 5%."""
+    rng = random.Random(seed)
+    version1 = {}
+    for i in range(photo_count):
+        photo_id = str(rng.getrandbits(63))
+        version1[photo_id] = make_photo(rng, photo_id, 1 + (i % 28))
+
+    version2 = {photo_id: dict(photo) for photo_id, photo in version1.items()}
+    ids = sorted(version1)
+    churn = max(1, photo_count // 20)
+    for photo_id in rng.sample(ids, churn):
+        del version2[photo_id]
+    for photo_id in rng.sample([i for i in ids if i in version2], min(churn, len(version2))):
+        photo = version2[photo_id]
+        change = rng.randrange(3)
+        if change == 0:
+            photo["name"] = photo["name"] + " (renamed)"
+        elif change == 1:
+            photo["date"] = photo["date"].replace("2010-08", "2010-09")
+        else:
+            photo["thumbnail"] = rng.choice([i for i in IMAGES if i != photo["thumbnail"]])
+    for _ in range(churn):
+        photo_id = str(rng.getrandbits(63))
+        version2[photo_id] = make_photo(rng, photo_id, 1 + rng.randrange(28))
+    return version1, version2
+
+
+def photo_element(photo):
+    return (
+        '  <photo name=%s date=%s id=%s>\n'
+        '    <image kind="image" srcURL="images/%s"></image>\n'
+        '    <image kind="thumbnail" srcURL="thumbnails/%s"></image>\n'
+        '  </photo>\n'
+    ) % (quoteattr(photo["name"]), quoteattr(photo["date"]), quoteattr(photo["id"]), photo["image"], photo["thumbnail"])
+
+
+def album(attributes, body):
+    attrs = "".join(" %s=%s" % (k, quoteattr(v)) for k, v in attributes)
+    return '<?xml version="1.0"?>\n<album QPhotoXMLVersion="1.0b4"%s>\n%s</album>\n' % (attrs, body)
+
+
+def full_document(photos, token):
+    body = "".join(photo_element(photos[i]) for i in sorted(photos))
+    return album([("name", "Delta Sync"), ("date", "2010-08-16T13:12:36Z"), ("changeToken", token)], body)
+
+
+def delta_document(old, new, old_token, new_token):
+    body = []
+    for photo_id in sorted(new):
+        if old.get(photo_id) != new[photo_id]:
+            body.append(photo_element(new[photo_id]))
+    for photo_id in sorted(old):
+        if photo_id not in new:
+            body.append('  <photo id=%s removed="yes"/>\n' % quoteattr(photo_id))
+    return album(
+        [("name", "Delta Sync"), ("date", "2010-08-16T13:12:36Z"), ("changeToken", new_token), ("deltaFrom", old_token)],
+        "".join(body),
+    )
+
+
+class State(object):
+    def __init__(self, seed, photo_count):
+        self.versions = make_versions(seed, photo_count)
+        self.tokens = ["%d-v1" % seed, "%d-v2" % seed]
+        self.current = 0
+
+
+class Handler(http.server.SimpleHTTPRequestHandler):
+    state = None
+
+    def send_text(self, status, content_type, text):
+        data = text.encode("utf-8")
+        self.send_response(status)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(data)))
+        self.send_header("Cache-Control", "no-store")
+        self.end_headers()
+        if self.command != "HEAD":
+            self.wfile.write(data)
+
+    def handle_gallery(self, query):
+        state = self.state
+        current_token = state.tokens[state.current]
+        since = query.get("since", [None])[0]
+        if since is None:
+            self.send_text(200, "application/xml", full_document(state.versions[state.current], current_token))
+        elif since in state.tokens:
+            old = state.versions[state.tokens.index(since)]
+            self.send_text(200, "application/xml", delta_document(old, state.versions[state.current], since, current_token))
+        else:
+            self.send_text(410, "text/plain", "change token %s not recognised\n" % since)
+
+    def handle_control(self, path):
+        state = self.state
+        if path == "/delta/advance":
+            state.current = 1
+        elif path == "/delta/rewind":
+            state.current = 0
+        elif path != "/delta/status":
+            self.send_text(404, "text/plain", "unknown control URL\n")
+            return
+        self.send_text(200, "text/plain", "version %d current, token %s, %d photos\n" % (
+            state.current + 1, state.tokens[state.current], len(state.versions[state.current])
+        ))
+
+    def do_GET(self):
+        url = urllib.parse.urlsplit(self.path)
+        if url.path == GALLERY_PATH:
+            self.handle_gallery(urllib.parse.parse_qs(url.query))
+        elif url.path.startswith("/delta/"):
+            self.handle_control(url.path)
+        else:
+            super().do_GET()
+
+    def do_HEAD(self):
+        url = urllib.parse.urlsplit(self.path)
+        if (url.path == GALLERY_PATH) or url.path.startswith("/delta/"):
+            self.do_GET()
+        else:
+            super().do_HEAD()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Stand-in gallery server for delta sync.")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--photos", type=int, default=200)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    Handler.state = State(args.seed, args.photos)
+    os.chdir(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+    server = http.server.ThreadingHTTPServer(("", args.port), Handler)
+    sys.stderr.write("serving http://localhost:%d%s (version 1, token %s)\n" % (args.port, GALLERY_PATH, Handler.state.tokens[0]))
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,258 @@
+#!/usr/bin/env python3
+#
+# range-server.py -- a stand-in gallery server for testing segmented photo downloads.
+#
+# It serves a generated gallery at /TestGallery/range.xml whose photos use the large
+# TestGallery images, and serves everything under the directory that contains TestGallery
+# as static files, with two twists:
+#
+# o Each connection is limited to --rate KB/s, as some servers (and many links) limit each
+#   TCP connection.  That's the case where SegmentedHTTPOperation's parallel Range
+#   requests pay off.  --latency delays the start of every response.
+#
+# o HEAD and single range GET requests ("Range: bytes=first-last") are supported, with
+#   Accept-Ranges and Content-Range, unless --ignore-range is set, in which case the
+#   server ignores Range and sends the whole file, to exercise the fall back to a single
+#   get.
+#
+#     python3 TestGallery/range-server.py [--port 8080] [--rate 64] [--latency 0.1]
+#                                         [--ignore-range]
+#
+# Turn on Debug > Debug Options > Segmented Photo Gets to make the app use ranges, and
+# compare the "segmented ... got" log lines with the "full image after" ones with it off.
+#
+#     /range/stats      report and reset the request counts
+#
+# Instead of serving, --compare runs a quick client side comparison against a private
+# instance of the server: it downloads --file in one request, then in --segments
+# parallel Range requests, checks that both got the same bytes, and reports the times.
+#
+# 分段下载测试用的本地服务器: 限制每个连接的带宽, 支持 Range 请求.
+
+import argparse
+import concurrent.futures
+import http.client
+import http.server
+import os
+import re
+import sys
+import threading
+import time
+import urllib.parse
+from xml.sax.saxutils import quoteattr
+
+# Only the PNG is big enough to be split (SegmentedHTTPOperation's minimumSegmentedLength
+# is 512 KB); the JPEGs are there to show that small photos still come in one piece.
+
+IMAGES = [
+    "IMG_0125.png", "IMG_0119.jpg", "IMG_0122.jpg", "IMG_0127.jpg",
+]
+
+GALLERY_PATH = "/TestGallery/range.xml"
+IMAGES_PATH = "/TestGallery/images/"
+CHUNK_SIZE = 4096
+
+
+def gallery_document(root):
+    body = "".join(
+        (
+            '  <photo name=%s date="2010-08-16T13:12:%02dZ" id="%d">\n'
+            '    <image kind="image" srcURL="images/%s" size="%d"></image>\n'
+            '    <image kind="thumbnail" srcURL="thumbnails/%s"></image>\n'
+            '  </photo>\n'
+        ) % (quoteattr(name), index, 9000 + index, name, os.path.getsize(os.path.join(root, "TestGallery", "images", name)), name)
+        for (index, name) in enumerate(IMAGES)
+    )
+    return (
+        '<?xml version="1.0"?>\n'
+        '<album QPhotoXMLVersion="1.0b4" name="Segmented Downloads" date="2010-08-16T13:12:36Z">\n'
+        '%s</album>\n'
+    ) % body
+
+
+class State(object):
+    def __init__(self, args, root):
+        self.rate = args.rate * 1024.0
+        self.latency = args.latency
+        self.ignore_range = args.ignore_range
+        self.root = root
+        self.lock = threading.Lock()
+        self.full_requests = 0
+        self.range_requests = 0
+        self.head_requests = 0
+
+
+class Handler(http.server.SimpleHTTPRequestHandler):
+    state = None
+
+    def log_message(self, format, *args):
+        if not self.server.quiet:
+            super().log_message(format, *args)
+
+    def send_text(self, status, content_type, text):
+        data = text.encode("utf-8")
+        self.send_response(status)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(data)))
+        self.send_header("Cache-Control", "no-store")
+        self.end_headers()
+        if self.command != "HEAD":
+            self.wfile.write(data)
+
+    def send_paced(self, data):
+        """Writes data no faster than the per-connection rate."""
+        start = time.monotonic()
+        sent = 0
+        while sent < len(data):
+            chunk = data[sent:sent + CHUNK_SIZE]
+            self.wfile.write(chunk)
+            sent += len(chunk)
+            delay = (sent / self.state.rate) - (time.monotonic() - start)
+            if delay > 0:
+                time.sleep(delay)
+
+    def handle_image(self, path):
+        state = self.state
+        file_path = os.path.join(state.root, path.lstrip("/"))
+        if not os.path.isfile(file_path):
+            self.send_error(404)
+            return
+        with open(file_path, "rb") as f:
+            data = f.read()
+        content_type = self.guess_type(file_path)
+
+        first, last = 0, len(data) - 1
+        status = 200
+        match = re.fullmatch(r"bytes=(\d+)-(\d*)", self.headers.get("Range", "").strip())
+        if (match is not None) and not state.ignore_range:
+            first = int(match.group(1))
+            if match.group(2):
+                last = min(int(match.group(2)), len(data) - 1)
+            if first > last:
+                self.send_response(416)
+                self.send_header("Content-Range", "bytes */%d" % len(data))
+                self.end_headers()
+                return
+            status = 206
+        with state.lock:
+            if self.command == "HEAD":
+                state.head_requests += 1
+            elif status == 206:
+                state.range_requests += 1
+            else:
+                state.full_requests += 1
+
+        time.sleep(state.latency)
+        self.send_response(status)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(last - first + 1))
+        if not state.ignore_range:
+            self.send_header("Accept-Ranges", "bytes")
+        if status == 206:
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (first, last, len(data)))
+        self.end_headers()
+        if self.command != "HEAD":
+            self.send_paced(data[first:last + 1])
+
+    def handle_stats(self):
+        state = self.state
+        with state.lock:
+            text = "%d full gets, %d range gets, %d heads\n" % (state.full_requests, state.range_requests, state.head_requests)
+            state.full_requests = state.range_requests = state.head_requests = 0
+        self.send_text(200, "text/plain", text)
+
+    def do_GET(self):
+        url = urllib.parse.urlsplit(self.path)
+        if url.path == GALLERY_PATH:
+            self.send_text(200, "application/xml", gallery_document(self.state.root))
+        elif url.path == "/range/stats":
+            self.handle_stats()
+        elif url.path.startswith(IMAGES_PATH):
+            self.handle_image(url.path)
+        else:
+            super().do_GET()
+
+    def do_HEAD(self):
+        self.do_GET()
+
+
+def start_server(args, quiet):
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    Handler.state = State(args, root)
+    handler = lambda *a, **kw: Handler(*a, directory=root, **kw)
+    server = http.server.ThreadingHTTPServer(("127.0.0.1" if quiet else "", args.port), handler)
+    server.quiet = quiet
+    server.daemon_threads = True
+    return server
+
+
+def fetch(port, path, first=None, last=None):
+    connection = http.client.HTTPConnection("127.0.0.1", port)
+    headers = {}
+    if first is not None:
+        headers["Range"] = "bytes=%d-%d" % (first, last)
+    connection.request("GET", path, headers=headers)
+    response = connection.getresponse()
+    data = response.read()
+    connection.close()
+    assert response.status in (200, 206), response.status
+    return (response.status, data)
+
+
+def compare(args):
+    args.port = 0
+    server = start_server(args, quiet=True)
+    port = server.server_address[1]
+    thread = threading.Thread(target=server.serve_forever, daemon=True)
+    thread.start()
+    path = IMAGES_PATH + args.file
+
+    start = time.monotonic()
+    (_, single) = fetch(port, path)
+    single_time = time.monotonic() - start
+
+    # The same split as SegmentedHTTPOperation: equal segments, the last one short.
+    start = time.monotonic()
+    length = len(single)
+    segment_length = (length + args.segments - 1) // args.segments
+    ranges = [(first, min(first + segment_length, length) - 1) for first in range(0, length, segment_length)]
+    with concurrent.futures.ThreadPoolExecutor(max_workers=len(ranges)) as pool:
+        results = list(pool.map(lambda r: fetch(port, path, r[0], r[1]), ranges))
+    segmented = b"".join(data for (_, data) in results)
+    segmented_time = time.monotonic() - start
+    server.shutdown()
+
+    assert all(status == 206 for (status, _) in results) or args.ignore_range, "server ignored Range"
+    print("%s, %d bytes, %.0f KB/s per connection, latency %.3f s" % (args.file, length, args.rate, args.latency))
+    print("single get:        %6.2f s (%.1f KB/s)" % (single_time, length / 1024.0 / single_time))
+    print("%d segments:        %6.2f s (%.1f KB/s), %.2fx, %s" % (
+        len(ranges), segmented_time, length / 1024.0 / segmented_time, single_time / segmented_time,
+        "bytes match" if segmented == single else "BYTES DIFFER"
+    ))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Stand-in gallery server for segmented photo downloads.")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--rate", type=float, default=64.0, help="KB/s per connection")
+    parser.add_argument("--latency", type=float, default=0.1, help="seconds before each response starts")
+    parser.add_argument("--ignore-range", action="store_true", help="ignore Range headers, to exercise the fall back")
+    parser.add_argument("--compare", action="store_true", help="compare single and segmented gets rather than serving")
+    parser.add_argument("--file", default="IMG_0125.png", help="image to download in --compare mode")
+    parser.add_argument("--segments", type=int, default=4)
+    args = parser.parse_args()
+
+    if args.compare:
+        compare(args)
+        return
+
+    server = start_server(args, quiet=False)
+    sys.stderr.write("serving http://localhost:%d%s (%.0f KB/s per connection)\n" % (args.port, GALLERY_PATH, args.rate))
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -3,6 +3,7 @@
 @class Photo;
 @class PhotoGallery;
 @class QImageScrollView;
+@class PhotoPrefetcher;
 
 @interface PhotoDetailViewController : UIViewController
 {
@@ -11,6 +12,10 @@
     
     Photo *                     _photo;
     PhotoGallery *              _photoGallery;
+    
+    PhotoPrefetcher *           _prefetcher;
+    NSArray *                   _galleryPhotos;
+    NSUInteger                  _galleryPhotoIndex;
 }
 
 @property (nonatomic, retain, readwrite) IBOutlet QImageScrollView *        scrollView;
@@ -21,4 +26,12 @@
 
 - (id)initWithPhoto:(Photo *)photo photoGallery:(PhotoGallery *)photoGallery;
 
+// If the client sets these, the view controller tells the prefetcher when the photo 
+// appears, which lets it prefetch the photo's neighbours in galleryPhotos.  
+// galleryPhotoIndex is the index of photo within galleryPhotos.
+
+@property (nonatomic, retain, readwrite) PhotoPrefetcher *  prefetcher;
+@property (nonatomic, retain, readwrite) NSArray *          galleryPhotos;
+@property (nonatomic, assign, readwrite) NSUInteger         galleryPhotoIndex;
+
 @end
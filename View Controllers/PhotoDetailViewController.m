@@ -2,6 +2,8 @@
 #import "QImageScrollView.h"
 #import "PhotoGallery.h"
 #import "Photo.h"
+#import "PhotoPrefetcher.h"
+#import "DecodedPhotoCache.h"
 #import "Logging.h"
 
 
@@ -15,6 +17,9 @@
 @synthesize photoGallery = _photoGallery;
 @synthesize scrollView   = _scrollView;
 @synthesize loadingLabel = _loadingLabel;
+@synthesize prefetcher        = _prefetcher;
+@synthesize galleryPhotos     = _galleryPhotos;
+@synthesize galleryPhotoIndex = _galleryPhotoIndex;
 
 //初始化
 - (id)initWithPhoto:(Photo *)photo photoGallery:(PhotoGallery *)photoGallery
@@ -42,12 +47,74 @@
 
     [self->_photo release];
     [self->_photoGallery release];
+    [self->_prefetcher release];
+    [self->_galleryPhotos release];
 
     [super dealloc];
 }
 
 #pragma mark - Keeping everything up-to-date
 
+// Pushes the photo into the scroll view.  We prefer the photo's tiles, if it has them, 
+// because then the scroll view only has to decode the bits of the photo that are on 
+// screen.  Note that we don't touch photoImage in that case, because that would decode 
+// the whole photo.
+- (void)updateImage
+{
+    NSString *  tilesPath;
+    UIImage *   image;
+    BOOL        hasImage;
+
+    tilesPath = self.photo.photoTilesPath;
+    if (tilesPath != nil) {
+        self.scrollView.tileDirectoryPath = tilesPath;
+        hasImage = YES;
+    } else {
+        image = self.photo.photoImage;
+        self.scrollView.tileDirectoryPath = nil;
+        if ( (image != nil) && (image != self.scrollView.image) ) {
+            [self performSelector:@selector(logImageDisplayTime:) withObject:[NSDate date] afterDelay:0.0];
+        }
+        self.scrollView.image = image;
+        hasImage = (image != nil);
+    }
+    self.scrollView.hidden = ! hasImage;
+    self.loadingLabel.hidden = hasImage;
+}
+
+// Running totals for -logImageDisplayTime:, across all photos this session.
+
+static NSUInteger       sImageDisplayCount;
+static NSTimeInterval   sImageDisplayTotalTime;
+static NSTimeInterval   sImageDisplayMaximumTime;
+
+// Logs how long the main thread was busy between handing an image to the scroll view and 
+// getting back to the run loop.  That includes the Core Animation commit that first draws 
+// the image, which is where a photo that wasn't decoded ahead of time gets decoded.  The 
+// log line also carries the session's mean and worst case, and DecodedPhotoCache's hits 
+// and misses, so flipping through the same photos with and without the photoLazyDecode 
+// preference gives the before and after figures for Photo's background decode.
+- (void)logImageDisplayTime:(NSDate *)startDate
+{
+    NSTimeInterval  elapsed;
+    
+    elapsed = -[startDate timeIntervalSinceNow];
+    sImageDisplayCount += 1;
+    sImageDisplayTotalTime += elapsed;
+    if (elapsed > sImageDisplayMaximumTime) {
+        sImageDisplayMaximumTime = elapsed;
+    }
+    [[QLog log] logWithFormat:@"%s photo %@ image display took %.1f ms on the main thread; %zu displays, mean %.1f ms, worst %.1f ms, decoded cache %zu hits %zu misses", __PRETTY_FUNCTION__, 
+        self.photo.photoID, 
+        elapsed * 1000.0, 
+        (size_t) sImageDisplayCount, 
+        sImageDisplayTotalTime / (NSTimeInterval) sImageDisplayCount * 1000.0, 
+        sImageDisplayMaximumTime * 1000.0, 
+        (size_t) [DecodedPhotoCache sharedCache].hitCount, 
+        (size_t) [DecodedPhotoCache sharedCache].missCount
+    ];
+}
+
 // 当正在展示的 CoreData 中的图片被删除后调用,photoGallery页面
 // If the underlying photos was deleted while we're displaying it (typically because a sync ran),
 // we just pop ourselves off the view controller stack.
@@ -92,21 +159,18 @@
             self.title = self.photo.displayName;
             
         } else if (self.isViewLoaded) {
-            if ([keyPath isEqual:@"photoImage"]) {
-                UIImage *   image;
+            if ([keyPath isEqual:@"photoImage"] || [keyPath isEqual:@"photoTilesPath"]) {
             
-                // If the photo changed, update our UI.  All of the hard work is done 
-                // by the QImageScrollView class.
-                image = self.photo.photoImage;
-                self.scrollView.image = image;
-                self.scrollView.hidden = (image == nil);
-                self.loadingLabel.hidden = (image != nil);
+                // If the photo (or its tiles) changed, update our UI.  All of the hard 
+                // work is done by the QImageScrollView class.
+                [self updateImage];
                 
-            } else if ([keyPath isEqual:@"photoGetting"]) {
+            } else if ([keyPath isEqual:@"photoGetting"] || [keyPath isEqual:@"photoDecoding"]) {
             
-                // Update our loading label as the photo hits the network.
+                // Update our loading label as the photo hits the network, and while it's 
+                // being decoded.
             
-                if (self.photo.photoGetting) {
+                if (self.photo.photoGetting || self.photo.photoDecoding) {
                     self.loadingLabel.text = @"Loading…"; //获取大图的操作正在进行中
                 } else {
                     // This assert isn't valid because if we get bad photo data we don't 
@@ -122,6 +186,16 @@
                 assert(NO);
             }
         }
+    } else if (context == &self->_scrollView) {
+    
+        // Called when the user zooms.  If they've zoomed all the way in, they want more 
+        // detail than the photo we've got, so ask the photo for a bigger variant.
+        
+        assert(object == self.scrollView);
+        assert([keyPath isEqual:@"zoomedToMaximum"]);
+        if (self.scrollView.zoomedToMaximum) {
+            [self.photo upgradePhoto];
+        }
     } else if (NO) {   // Disabled because the super class does nothing useful with it.
         [super observeValueForKeyPath:keyPath ofObject:object change:change context:context];
     }
@@ -155,6 +229,12 @@
     // Tell the model object that we want it to keep the photo image up-to-date.
     // 如果大图没有下载的话,将下载它
     [self.photo assertPhotoNeeded];
+    
+    // Let the prefetcher start getting the photos on either side of this one.  We do this 
+    // after asserting that we need our photo so that its get is queued first.
+    if ( (self.prefetcher != nil) && (self.galleryPhotos != nil) ) {
+        [self.prefetcher photoAtIndex:self.galleryPhotoIndex didBecomeVisibleInPhotos:self.galleryPhotos];
+    }
 
     // Configure our view.  We hide the scroll view, which leaves the loading label visible.
     self.scrollView.hidden   = YES;
@@ -170,8 +250,14 @@
     // of the scroll view (that is, after the toolbar has hidden).
     // 启用NSKeyValueObservingOptionInitial选项,将导致.立即发出通知一次
     
-    [self.photo addObserver:self forKeyPath:@"photoImage"   options:NSKeyValueObservingOptionInitial context:&self->_photo];
+    // The initial photoTilesPath notification covers photoImage as well (see -updateImage), 
+    // so we don't ask for an initial photoImage notification.
+    
+    [self.photo addObserver:self forKeyPath:@"photoTilesPath" options:NSKeyValueObservingOptionInitial context:&self->_photo];
+    [self.photo addObserver:self forKeyPath:@"photoImage"     options:0 context:&self->_photo];
     [self.photo addObserver:self forKeyPath:@"photoGetting" options:NSKeyValueObservingOptionInitial context:&self->_photo];
+    [self.photo addObserver:self forKeyPath:@"photoDecoding" options:NSKeyValueObservingOptionInitial context:&self->_photo];
+    [self.scrollView addObserver:self forKeyPath:@"zoomedToMaximum" options:0 context:&self->_scrollView];
 
     // Unfortunately -[NSManagedObject isDeleted] doesn't really do what I want 
     // here, so I just watch the context directly.
@@ -191,8 +277,11 @@
     
     [[NSNotificationCenter defaultCenter] removeObserver:self name:NSManagedObjectContextObjectsDidChangeNotification object:self.photo.managedObjectContext];
 
+    [self.photo removeObserver:self forKeyPath:@"photoTilesPath"];
     [self.photo removeObserver:self forKeyPath:@"photoImage"];
     [self.photo removeObserver:self forKeyPath:@"photoGetting"];
+    [self.photo removeObserver:self forKeyPath:@"photoDecoding"];
+    [self.scrollView removeObserver:self forKeyPath:@"zoomedToMaximum"];
 
     // We show the navigation controller's toolbar here, so that you 
     // can see the animation.
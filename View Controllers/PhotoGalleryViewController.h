@@ -2,6 +2,8 @@
 #import <CoreData/CoreData.h>
 
 @class PhotoGallery;
+@class PhotoPrefetcher;
+@class CADisplayLink;
 
 @interface PhotoGalleryViewController : UITableViewController
 {
@@ -14,6 +16,16 @@
     PhotoGallery *                  _photoGallery;
     NSFetchedResultsController *    _fetcher;
     NSDateFormatter *               _dateFormatter;
+    PhotoPrefetcher *               _prefetcher;
+    
+    NSMutableArray *                _pendingDeletedIndexPaths;
+    NSMutableArray *                _pendingInsertedIndexPaths;
+    BOOL                            _pendingChangesShowedPlaceholder;
+    
+    CADisplayLink *                 _frameMonitor;
+    CFTimeInterval                  _frameMonitorLastTimestamp;
+    NSUInteger                      _frameMonitorFrameCount;
+    NSUInteger                      _frameMonitorDropCount;
 }
 
 - (id)initWithPhotoGallery:(PhotoGallery *)photoGallery;
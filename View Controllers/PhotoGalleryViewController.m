@@ -2,11 +2,26 @@
 #import "PhotoCell.h"
 #import "PhotoDetailViewController.h"
 #import "PhotoGallery.h"
+#import "PhotoMetadataStore.h"
 #import "Photo.h"
+#import "PhotoPrefetcher.h"
 
 #import "QLogViewer.h"
 #import "QLog.h"
 
+#import <QuartzCore/QuartzCore.h>
+
+// If a single batch of changes from the fetched results controller touches more rows than 
+// this, we just reload the table; animating thousands of row insertions is much slower 
+// than a reload, and the user can't follow it anyway.
+
+static const NSUInteger kTableBatchUpdateLimit = 100;
+
+// When the table reads a gallery's metadata store, rather than a fetcher, the detail view's 
+// prefetcher only gets to see this many photos either side of the one that was tapped.
+
+static const NSUInteger kMetadataPrefetchWindow = 4;
+
 #pragma mark - private properties
 @interface PhotoGalleryViewController () <NSFetchedResultsControllerDelegate>
 
@@ -17,10 +32,13 @@
 @property (nonatomic, retain, readwrite) UIBarButtonItem *              statusBarButtonItem;
 @property (nonatomic, retain, readwrite) NSFetchedResultsController *   fetcher;
 @property (nonatomic, copy,   readwrite) NSDateFormatter *              dateFormatter; //表示的时间格式, 等于 self.photoGallery.standardDateFormatter
+@property (nonatomic, retain, readonly ) PhotoPrefetcher *              prefetcher;    //为 PhotoDetailViewController 预先下载相邻的大图
 
 // forward declarations
 - (void)setupStatusLabel;
 - (void)setupSyncBarButtonItem;
+- (void)startFrameMonitor;
+- (void)stopFrameMonitor;
 
 @end
 
@@ -42,6 +60,7 @@
 @synthesize photoGallery         = _photoGallery;   // PhotoGallery 对象,初始化本类对象时,通过initWithPhotoGallery: 方法赋值.
 @synthesize fetcher              = _fetcher;
 @synthesize dateFormatter        = _dateFormatter;
+@synthesize prefetcher           = _prefetcher;
 
 
 
@@ -53,6 +72,14 @@
         
         self->_photoGallery = [photoGallery retain];
         self.title = @"Photos";
+        
+        self->_prefetcher = [[PhotoPrefetcher alloc] init];
+        assert(self->_prefetcher != nil);
+        
+        self->_pendingDeletedIndexPaths  = [[NSMutableArray alloc] init];
+        assert(self->_pendingDeletedIndexPaths != nil);
+        self->_pendingInsertedIndexPaths = [[NSMutableArray alloc] init];
+        assert(self->_pendingInsertedIndexPaths != nil);
 
         // Set up a raft of bar button items.
         self->_stopBarButtonItem    = [[UIBarButtonItem alloc] initWithBarButtonSystemItem:UIBarButtonSystemItemStop target:self action:@selector(stopAction:)];
@@ -109,9 +136,11 @@
         [self->_photoGallery removeObserver:self forKeyPath:@"syncing"];
         [self->_photoGallery removeObserver:self forKeyPath:@"syncStatus"];
         [self->_photoGallery removeObserver:self forKeyPath:@"standardDateFormatter"];
+        [self->_photoGallery removeObserver:self forKeyPath:@"metadataStore"];
     }
     [self removeObserver:self forKeyPath:@"photoGallery"];
     [[QLog log] removeObserver:self forKeyPath:@"showViewer"];
+    [[NSNotificationCenter defaultCenter] removeObserver:self name:kPhotoMetadataStoreDidChangeNotification object:nil];
 
     // Release our ivars.
     [self->_stopBarButtonItem release];
@@ -126,6 +155,10 @@
         [self->_fetcher release];
     }
     [self->_dateFormatter release];
+    [self->_prefetcher release];
+    [self->_pendingDeletedIndexPaths release];
+    [self->_pendingInsertedIndexPaths release];
+    [self stopFrameMonitor];
 
     [super dealloc];
 }
@@ -145,6 +178,16 @@
     assert(self.photoGallery != nil);
     assert(self.photoGallery.managedObjectContext != nil);
     
+    // If the gallery keeps a metadata store, that's already sorted by date, and the table 
+    // reads it directly (see -photoAtIndexPath:), so we don't need a fetcher at all.
+    
+    // The store tells us when a sync changes it.
+    
+    if (self.photoGallery.metadataStore != nil) {
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(metadataStoreDidChange:) name:kPhotoMetadataStoreDidChangeNotification object:self.photoGallery.metadataStore];
+        return;
+    }
+    
     sortDescriptor = [[[NSSortDescriptor alloc] initWithKey:@"date" ascending:YES] autorelease]; //以时间排序
     assert(sortDescriptor != nil);
     
@@ -156,11 +199,14 @@
     //[fetchRequest setSortDescriptors:[NSArray arrayWithObject:sortDescriptor]];
     [fetchRequest setSortDescriptors:@[sortDescriptor]];
     
+    // We use a persistent cache so that, on relaunch, the fetched results controller doesn't 
+    // have to sort every photo in the gallery before we can display the first screenful.
+    
     assert(self.fetcher == nil);
     self.fetcher = [[[NSFetchedResultsController alloc] initWithFetchRequest:fetchRequest
                                                         managedObjectContext:self.photoGallery.managedObjectContext
                                                           sectionNameKeyPath:nil
-                                                                   cacheName:nil] autorelease];
+                                                                   cacheName:self.photoGallery.fetchedResultsCacheName] autorelease];
     assert(self.fetcher != nil);
     
     // 设置self.fetcher的delegate为self,在数据有变动时,会调用本类的controller:didChangeObject:atIndexPath:forChangeType:newIndexPath:
@@ -180,6 +226,95 @@
     }
 }
 
+// Returns the gallery's metadata store if the table is using it, that is, if -startFetcher 
+// didn't set up a fetcher.
+- (PhotoMetadataStore *)metadataStore
+{
+    return (self.fetcher == nil) ? self.photoGallery.metadataStore : nil;
+}
+
+// Returns the photo for a row of the table, from either the fetcher or the metadata store. 
+// In the latter case this can be nil, if the store is ahead of the database.
+- (Photo *)photoAtIndexPath:(NSIndexPath *)indexPath
+{
+    Photo *     result;
+    
+    if (self.metadataStore != nil) {
+        assert(indexPath.section == 0);
+        result = [self.photoGallery photoForMetadataRow:[self.metadataStore rowAtIndex:(NSUInteger) indexPath.row]];
+    } else {
+        result = [self.fetcher objectAtIndexPath:indexPath];
+        assert([result isKindOfClass:[Photo class]]);
+    }
+    return result;
+}
+
+// Called when a metadata store changes.  The notification says which rows moved (see 
+// PhotoMetadataStore.h), and we apply those to the table as batch updates, just like the 
+// changes from the fetcher.  The other rows keep their cells, which observe their photos 
+// and so pick up any other changes by themselves.  We reload the whole table if the 
+// store doesn't say what changed, if there are lots of changes, or if the table is 
+// showing, or is about to show, the "No photos" placeholder row.
+- (void)metadataStoreDidChange:(NSNotification *)note
+{
+    NSIndexSet *        removedIndexes;
+    NSIndexSet *        insertedIndexes;
+    NSMutableArray *    removedIndexPaths;
+    NSMutableArray *    insertedIndexPaths;
+    NSUInteger          changeCount;
+    NSUInteger          oldCount;
+    NSUInteger          index;
+    NSDate *            startDate;
+    BOOL                reload;
+    
+    assert([NSThread isMainThread]);
+    assert([note object] == self.metadataStore);
+    
+    if ( ! self.isViewLoaded ) {
+        return;
+    }
+    
+    removedIndexes  = [[note userInfo] objectForKey:kPhotoMetadataStoreRemovedIndexesKey];
+    insertedIndexes = [[note userInfo] objectForKey:kPhotoMetadataStoreInsertedIndexesKey];
+    changeCount = [removedIndexes count] + [insertedIndexes count];
+    if ( (removedIndexes != nil) && (insertedIndexes != nil) && (changeCount == 0) ) {
+        return;
+    }
+    startDate = [NSDate date];
+    
+    reload = (removedIndexes == nil) || (insertedIndexes == nil) || (changeCount > kTableBatchUpdateLimit) || [self hasNoPhotos];
+    if ( ! reload ) {
+        oldCount = self.metadataStore.count + [removedIndexes count] - [insertedIndexes count];
+        reload = (oldCount == 0);
+    }
+    if (reload) {
+        [self.tableView reloadData];
+    } else {
+        removedIndexPaths = [NSMutableArray arrayWithCapacity:[removedIndexes count]];
+        assert(removedIndexPaths != nil);
+        for (index = [removedIndexes firstIndex]; index != NSNotFound; index = [removedIndexes indexGreaterThanIndex:index]) {
+            [removedIndexPaths addObject:[NSIndexPath indexPathForRow:(NSInteger) index inSection:0]];
+        }
+        insertedIndexPaths = [NSMutableArray arrayWithCapacity:[insertedIndexes count]];
+        assert(insertedIndexPaths != nil);
+        for (index = [insertedIndexes firstIndex]; index != NSNotFound; index = [insertedIndexes indexGreaterThanIndex:index]) {
+            [insertedIndexPaths addObject:[NSIndexPath indexPathForRow:(NSInteger) index inSection:0]];
+        }
+        
+        [self.tableView beginUpdates];
+        [self.tableView deleteRowsAtIndexPaths:removedIndexPaths  withRowAnimation:UITableViewRowAnimationFade];
+        [self.tableView insertRowsAtIndexPaths:insertedIndexPaths withRowAnimation:UITableViewRowAnimationFade];
+        [self.tableView endUpdates];
+    }
+    
+    [[QLog log] logWithFormat:@"%s %zu row changes applied by %@ in %.1f ms", 
+        __PRETTY_FUNCTION__, 
+        (size_t) changeCount, 
+        reload ? @"reload" : @"batch update", 
+        -[startDate timeIntervalSinceNow] * 1000.0
+    ];
+}
+
 #pragma mark -  implement the KVO observing method
 
 - (void)observeValueForKeyPath:(NSString *)keyPath ofObject:(id)object change:(NSDictionary *)change context:(void *)context
@@ -192,6 +327,13 @@
         assert(object == self.photoGallery);
         
         [self setupSyncBarButtonItem];
+        
+        // Count the frames we drop while syncing, which is when the table takes the most updates.
+        if (self.photoGallery.isSyncing) {
+            [self startFrameMonitor];
+        } else {
+            [self stopFrameMonitor];
+        }
 
     } else if (context == &self->_statusBarButtonItem) {
         //根据 photoGallery 的运行状态,来决定在状态条上显示什么提示文字.
@@ -216,9 +358,15 @@
                 [self.photoGallery removeObserver:self forKeyPath:@"syncing"];
                 [self.photoGallery removeObserver:self forKeyPath:@"syncStatus"];
                 [self.photoGallery removeObserver:self forKeyPath:@"standardDateFormatter"];
+                [self.photoGallery removeObserver:self forKeyPath:@"metadataStore"];
+                [self stopFrameMonitor];
+
+                // Cancel any prefetches for the old gallery's photos.
+                [self.prefetcher stop];
 
                 self.fetcher.delegate = nil;
                 self.fetcher = nil;
+                [[NSNotificationCenter defaultCenter] removeObserver:self name:kPhotoMetadataStoreDidChangeNotification object:nil];
             }
             
         } else {   //值改变之后的通知
@@ -241,6 +389,7 @@
                 [self.photoGallery addObserver:self forKeyPath:@"syncing"               options:NSKeyValueObservingOptionInitial context:&self->_stopBarButtonItem];
                 [self.photoGallery addObserver:self forKeyPath:@"syncStatus"            options:NSKeyValueObservingOptionInitial context:&self->_statusBarButtonItem];
                 [self.photoGallery addObserver:self forKeyPath:@"standardDateFormatter" options:NSKeyValueObservingOptionInitial context:&self->_dateFormatter];
+                [self.photoGallery addObserver:self forKeyPath:@"metadataStore"         options:0                                 context:&self->_fetcher];
             
                 // Set up the fetched results controller that provides the data for our table.
                 [self startFetcher];
@@ -262,6 +411,21 @@
         self.dateFormatter = self.photoGallery.standardDateFormatter;
         [self reloadTable];  //重新加载 table, 这样新的时间样式格式就会显现到 UI
 
+    } else if (context == &self->_fetcher) {
+    
+        // Called when the gallery's metadata store becomes available, which happens some 
+        // time after the gallery starts if the store had to be rebuilt.  Until then we've 
+        // been using a fetcher; now we switch over to the store.
+        assert([keyPath isEqual:@"metadataStore"]);
+        assert(object == self.photoGallery);
+        
+        if ( (self.photoGallery.metadataStore != nil) && (self.fetcher != nil) ) {
+            self.fetcher.delegate = nil;
+            self.fetcher = nil;
+            [self startFetcher];
+            [self reloadTable];
+        }
+
     } else if ( (context == NULL) && [keyPath isEqual:@"showViewer"] ) {  //Qlog view
     
         // Called when the showViewer property of QLog changes (typically because the user has 
@@ -325,7 +489,9 @@
     NSArray *   sections;
     NSUInteger  sectionCount;
     
-    if (self.fetcher != nil) {
+    if (self.metadataStore != nil) {
+        result = (self.metadataStore.count == 0);
+    } else if (self.fetcher != nil) {
         sections = [self.fetcher sections];
         sectionCount = [sections count];
         if (sectionCount > 0) {
@@ -346,6 +512,8 @@
     #pragma unused(tv)
     if ( [self hasNoPhotos] ) {
         result = 1;                                 // if there's no photos, there's 1 section with 1 row that is the placeholder UI
+    } else if (self.metadataStore != nil) {
+        result = 1;                                 // the metadata store has just the one section
     } else {
         result = [[self.fetcher sections] count];   // if there's photos, base this off(依靠) the fetcher results controller
     }
@@ -362,6 +530,9 @@
     NSInteger   result;
     if ( [self hasNoPhotos] ) {
         result = 1;                                 // if there's no photos, there's 1 section with 1 row that is the placeholder UI
+    } else if (self.metadataStore != nil) {
+        assert(section == 0);
+        result = (NSInteger) self.metadataStore.count;
     } else {
         NSArray *   sections;                       // if there's photos, base this off the fetcher results controller
 
@@ -409,8 +580,7 @@
         
         
         // Photo 对象实际上是 NSManagedObject 对象, 从 core data 里提去来的.
-        Photo *  photo = [self.fetcher objectAtIndexPath:indexPath];
-        assert([photo isKindOfClass:[Photo class]]);
+        Photo *  photo = [self photoAtIndexPath:indexPath];
         
         PhotoCell *  cell = (PhotoCell *) [self.tableView dequeueReusableCellWithIdentifier:@"PhotoCell"];
         if (cell != nil) {
@@ -449,24 +619,73 @@
         
         // Push a photo detail view controller to display the bigger version of the photo.
         Photo * photo;
-        photo = [self.fetcher objectAtIndexPath:indexPath];
-        assert([photo isKindOfClass:[Photo class]]);
+        photo = [self photoAtIndexPath:indexPath];
         
-        PhotoDetailViewController *     vc;
-        vc = [[[PhotoDetailViewController alloc] initWithPhoto:photo photoGallery:self.photoGallery] autorelease];
-        assert(vc != nil);
-        
-        [self.navigationController pushViewController:vc animated:YES];
+        if (photo == nil) {
+            [self.tableView deselectRowAtIndexPath:indexPath animated:YES];
+        } else {
+            PhotoDetailViewController *     vc;
+            vc = [[[PhotoDetailViewController alloc] initWithPhoto:photo photoGallery:self.photoGallery] autorelease];
+            assert(vc != nil);
+            
+            vc.prefetcher        = self.prefetcher;
+            if (self.metadataStore == nil) {
+                vc.galleryPhotos     = self.fetcher.fetchedObjects;
+                vc.galleryPhotoIndex = (NSUInteger) indexPath.row;
+            } else {
+                NSMutableArray *    neighbours;
+                NSUInteger          rowIndex;
+                NSUInteger          firstIndex;
+                NSUInteger          limitIndex;
+                
+                // Fetching every photo would defeat the point of the metadata store, so 
+                // we give the prefetcher a window of the photo's immediate neighbours.
+                
+                neighbours = [NSMutableArray array];
+                assert(neighbours != nil);
+                firstIndex = ((NSUInteger) indexPath.row > kMetadataPrefetchWindow) ? ((NSUInteger) indexPath.row - kMetadataPrefetchWindow) : 0;
+                limitIndex = MIN((NSUInteger) indexPath.row + kMetadataPrefetchWindow + 1, self.metadataStore.count);
+                for (rowIndex = firstIndex; rowIndex < limitIndex; rowIndex++) {
+                    Photo *     neighbour;
+                    
+                    neighbour = (rowIndex == (NSUInteger) indexPath.row) ? photo : [self.photoGallery photoForMetadataRow:[self.metadataStore rowAtIndex:rowIndex]];
+                    if (neighbour != nil) {
+                        if (neighbour == photo) {
+                            vc.galleryPhotoIndex = [neighbours count];
+                        }
+                        [neighbours addObject:neighbour];
+                    }
+                }
+                vc.galleryPhotos     = neighbours;
+            }
+            
+            [self.navigationController pushViewController:vc animated:YES];
+        }
     }
 }
 
 #pragma mark - Fetched results controller callbacks
 
-// A delegate callback called by the fetched results controller when its content changes.
-// If anything interesting happens (that is, an insert, delete or move), we respond by reloading the entire table.
-// This is rather a heavy-handed approach, but I found it difficult to correctly handle the updates.
-// Also, the insert, delete and move aren't on the critical performance path (which is scrolling through the list loading thumbnails),
-// so I can afford to(支付的起) keep it simple.
+// The fetched results controller brackets each batch of changes with -controllerWillChangeContent: 
+// and -controllerDidChangeContent:.  We collect the row changes in between and apply them to the 
+// table in one go at the end, either as a single set of batch updates or, if the batch is big, 
+// as a reload.  A sync can insert thousands of photos in one save, and we used to reload the 
+// table for every one of them.
+// 在 willChange 和 didChange 之间收集所有的变化, 最后一次性更新 table.
+
+- (void)controllerWillChangeContent:(NSFetchedResultsController *)controller
+{
+    assert(controller == self.fetcher);
+    #pragma unused(controller)
+    
+    [self->_pendingDeletedIndexPaths  removeAllObjects];
+    [self->_pendingInsertedIndexPaths removeAllObjects];
+    
+    // If we're showing the "No photos" placeholder row, the table's rows don't correspond 
+    // to the fetcher's objects, so we can't apply the changes row by row.
+    self->_pendingChangesShowedPlaceholder = [self hasNoPhotos];
+}
+
 - (void)controller:(NSFetchedResultsController *)controller
    didChangeObject:(id)anObject
        atIndexPath:(NSIndexPath *)indexPath
@@ -476,21 +695,24 @@
     assert(controller == self.fetcher);
     #pragma unused(controller)
     #pragma unused(anObject)
-    #pragma unused(indexPath)
-    #pragma unused(newIndexPath)
 
     switch (type) {
         case NSFetchedResultsChangeInsert: {
-            [self reloadTable];
+            assert(newIndexPath != nil);
+            [self->_pendingInsertedIndexPaths addObject:newIndexPath];
         } break;
         case NSFetchedResultsChangeDelete: {
-            [self reloadTable];
+            assert(indexPath != nil);
+            [self->_pendingDeletedIndexPaths addObject:indexPath];
         } break;
         case NSFetchedResultsChangeMove: {
-            [self reloadTable];
+            assert(indexPath != nil);
+            assert(newIndexPath != nil);
+            [self->_pendingDeletedIndexPaths  addObject:indexPath];
+            [self->_pendingInsertedIndexPaths addObject:newIndexPath];
         } break;
         case NSFetchedResultsChangeUpdate: {
-            // do nothing
+            // do nothing; the cell observes its photo and updates itself
         } break;
         default: {
             assert(NO);
@@ -498,6 +720,96 @@
     }
 }
 
+- (void)controllerDidChangeContent:(NSFetchedResultsController *)controller
+{
+    NSUInteger  changeCount;
+    NSDate *    startDate;
+    BOOL        reload;
+    
+    assert(controller == self.fetcher);
+    #pragma unused(controller)
+    
+    changeCount = [self->_pendingDeletedIndexPaths count] + [self->_pendingInsertedIndexPaths count];
+    if ( (changeCount != 0) && self.isViewLoaded ) {
+        startDate = [NSDate date];
+        
+        reload = (changeCount > kTableBatchUpdateLimit) || self->_pendingChangesShowedPlaceholder || [self hasNoPhotos];
+        if (reload) {
+            [self.tableView reloadData];
+        } else {
+            [self.tableView beginUpdates];
+            [self.tableView deleteRowsAtIndexPaths:self->_pendingDeletedIndexPaths  withRowAnimation:UITableViewRowAnimationFade];
+            [self.tableView insertRowsAtIndexPaths:self->_pendingInsertedIndexPaths withRowAnimation:UITableViewRowAnimationFade];
+            [self.tableView endUpdates];
+        }
+        
+        [[QLog log] logWithFormat:@"%s %zu row changes applied by %@ in %.1f ms", 
+            __PRETTY_FUNCTION__, 
+            (size_t) changeCount, 
+            reload ? @"reload" : @"batch update", 
+            -[startDate timeIntervalSinceNow] * 1000.0
+        ];
+    }
+    
+    [self->_pendingDeletedIndexPaths  removeAllObjects];
+    [self->_pendingInsertedIndexPaths removeAllObjects];
+}
+
+#pragma mark - Frame monitoring
+
+// While a sync is in progress we watch the display link and count the frames that we 
+// miss, that is, callbacks that arrive more than one and a half frame durations after 
+// the previous one.  The count is logged when the sync stops.  CADisplayLink was added 
+// in iOS 3.1; on earlier systems we just don't measure.
+
+- (void)startFrameMonitor
+{
+    Class   displayLinkClass;
+    
+    displayLinkClass = NSClassFromString(@"CADisplayLink");
+    if ( (self->_frameMonitor == nil) && (displayLinkClass != nil) ) {
+        self->_frameMonitorLastTimestamp = 0.0;
+        self->_frameMonitorFrameCount    = 0;
+        self->_frameMonitorDropCount     = 0;
+        
+        // The display link retains its target; -stopFrameMonitor breaks the cycle.
+        self->_frameMonitor = [[displayLinkClass displayLinkWithTarget:self selector:@selector(frameMonitorTick:)] retain];
+        assert(self->_frameMonitor != nil);
+        [self->_frameMonitor addToRunLoop:[NSRunLoop mainRunLoop] forMode:NSRunLoopCommonModes];
+    }
+}
+
+- (void)frameMonitorTick:(CADisplayLink *)link
+{
+    assert(link == self->_frameMonitor);
+    
+    if (self->_frameMonitorLastTimestamp != 0.0) {
+        NSUInteger  elapsedFrames;
+        
+        elapsedFrames = (NSUInteger) (((link.timestamp - self->_frameMonitorLastTimestamp) / link.duration) + 0.5);
+        if (elapsedFrames > 1) {
+            self->_frameMonitorDropCount += elapsedFrames - 1;
+        }
+        self->_frameMonitorFrameCount += elapsedFrames;
+    }
+    self->_frameMonitorLastTimestamp = link.timestamp;
+}
+
+- (void)stopFrameMonitor
+{
+    if (self->_frameMonitor != nil) {
+        [self->_frameMonitor invalidate];
+        [self->_frameMonitor release];
+        self->_frameMonitor = nil;
+        
+        [[QLog log] logWithFormat:@"%s dropped %zu of %zu frames during sync", 
+            __PRETTY_FUNCTION__, 
+            (size_t) self->_frameMonitorDropCount, 
+            (size_t) self->_frameMonitorFrameCount
+        ];
+    }
+}
+
 #pragma mark - UI wrangling
 
 // Set the status label in the toolbar based on the syncing status from the the photoGallery.
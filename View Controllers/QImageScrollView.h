@@ -6,9 +6,10 @@
 
     <http://developer.apple.com/iphone/library/samplecode/PhotoScroller/>
     
-    It's simplified because a) it does not support rotation, b) it does not support tiling 
-    (and uses a hackish workaround on old school hardware, where non-tiled performance is 
-    way too slow), and c) it ignores the Retina display.  It's possible to fix all of these, 
+    It's simplified because a) it does not support rotation, b) it only supports tiling 
+    for photos that have already been cut into tiles (and otherwise uses a hackish 
+    workaround on old school hardware, where non-tiled performance is way too slow), 
+    and c) it ignores the Retina display.  It's possible to fix all of these, 
     but such UI complexity is the scope of this /networking/ sample code. If you want to see 
     how to do this stuff properly, you should check out the PhotoScroller sample code and 
     WWDC 2010 Session 104 "Designing Apps with Scroll Views".
@@ -16,13 +17,28 @@
     <http://developer.apple.com/videos/wwdc/2010/>
 */
 
+@class QTiledImageView;
+
 @interface QImageScrollView : UIScrollView
 {
-    UIImage *       _image;
-    UIImageView *   _imageView;
-    BOOL            _limitImageSize;
+    UIImage *           _image;
+    UIImageView *       _imageView;
+    NSString *          _tileDirectoryPath;
+    QTiledImageView *   _tiledImageView;
+    BOOL                _limitImageSize;
+    BOOL                _zoomedToMaximum;
 }
 
-@property (nonatomic, retain, readwrite) UIImage * image;
+// The scroll view shows either image or, if set, the tile pyramid in tileDirectoryPath 
+// (as built by PhotoTileOperation).  Setting one clears the other.  The tiled case only 
+// decodes the tiles that are on screen, so it's much cheaper for large photos, and it 
+// doesn't need the old school hardware workaround described in the implementation.
+
+@property (nonatomic, retain, readwrite) UIImage *  image;
+@property (nonatomic, copy,   readwrite) NSString * tileDirectoryPath;
+
+// observable, YES if the user has zoomed all the way in, that is, they're looking at the 
+// image at full resolution.  Clients can use this as a hint to get a higher resolution image.
+@property (nonatomic, assign, readonly ) BOOL       zoomedToMaximum;
 
 @end
@@ -1,10 +1,19 @@
 #import "QImageScrollView.h"
+#import "QTiledImageView.h"
 #import "Logging.h"
 #include <sys/sysctl.h>
 
 @interface QImageScrollView () <UIScrollViewDelegate>
 
-@property (nonatomic, retain, readwrite) UIImageView *  imageView;
+@property (nonatomic, retain, readwrite) UIImageView *      imageView;
+@property (nonatomic, retain, readwrite) QTiledImageView *  tiledImageView;
+
+// read/write versions of public properties
+
+@property (nonatomic, assign, readwrite) BOOL               zoomedToMaximum;
+
+// forward declarations
+- (UIView *)zoomView;
 
 @end
 
@@ -80,6 +89,8 @@ static BOOL LimitImageSize(void)
 {
     [self->_image release];
     [self->_imageView release];
+    [self->_tileDirectoryPath release];
+    [self->_tiledImageView release];
     [super dealloc];
 }
 
@@ -94,12 +105,12 @@ static BOOL LimitImageSize(void)
     
     [super layoutSubviews];
     
-    if (self.imageView != nil) {
+    if (self.zoomView != nil) {
         boundsSize     = self.bounds.size;
 
         // get the frame
         
-        imageViewFrame = self.imageView.frame;
+        imageViewFrame = self.zoomView.frame;
         
         // if it's smaller than the scroll view, centre it horizontally
 
@@ -119,7 +130,7 @@ static BOOL LimitImageSize(void)
         
         // set it back
         
-        self.imageView.frame = imageViewFrame;
+        self.zoomView.frame = imageViewFrame;
     }
 }
 
@@ -129,30 +140,115 @@ static BOOL LimitImageSize(void)
 {
     assert(scrollView == self);
     #pragma unused(scrollView)
-    return self.imageView;
+    return self.zoomView;
+}
+
+- (void)scrollViewDidEndZooming:(UIScrollView *)scrollView withView:(UIView *)view atScale:(CGFloat)scale
+{
+    assert(scrollView == self);
+    #pragma unused(scrollView)
+    #pragma unused(view)
+    self.zoomedToMaximum = (scale >= self.maximumZoomScale) && (self.maximumZoomScale > self.minimumZoomScale);
 }
 
 #pragma mark - Properties
 
-@synthesize image     = _image;
-@synthesize imageView = _imageView;
+@synthesize image             = _image;
+@synthesize imageView         = _imageView;
+@synthesize tileDirectoryPath = _tileDirectoryPath;
+@synthesize tiledImageView    = _tiledImageView;
+@synthesize zoomedToMaximum   = _zoomedToMaximum;
 
-- (void)setImage:(UIImage *)newValue
+// Returns the view that we zoom and scroll, that is, either the image view or the tiled 
+// image view, or nil if we're not showing anything.
+- (UIView *)zoomView
 {
-    if (newValue != self->_image) {
+    UIView *    result;
+    
+    result = self.imageView;
+    if (result == nil) {
+        result = self.tiledImageView;
+    }
+    return result;
+}
 
-        // If we had a previous image view, clean it up.
+// Gets rid of the current zoom view (if any) and resets our zooming back to the default.
+- (void)removeZoomView
+{
+    if (self.imageView != nil) {
+        [self.imageView removeFromSuperview];
+        self.imageView = nil;
+    }
+    if (self.tiledImageView != nil) {
+    
+        // Log the tiled drawing statistics so that they can be compared to the decoded 
+        // size of the untiled image (see -setImage:).
         
-        if (self.imageView != nil) {
-            [self.imageView removeFromSuperview];
-            self.imageView = nil;
+        if (self.tiledImageView.tileDrawCount != 0) {
+            [[QLog log] logWithFormat:@"%s image scroll tiled %.0f x %.0f, %zu tile draws, average %.1f ms, peak %zu bytes decoded", 
+                __PRETTY_FUNCTION__, 
+                self.tiledImageView.imageSize.width, 
+                self.tiledImageView.imageSize.height, 
+                (size_t) self.tiledImageView.tileDrawCount, 
+                1000.0 * self.tiledImageView.tileDrawTime / self.tiledImageView.tileDrawCount, 
+                (size_t) self.tiledImageView.peakTileCacheBytes
+            ];
         }
+        [self.tiledImageView removeFromSuperview];
+        self.tiledImageView = nil;
+    }
+    
+    self.zoomScale        = 1.0;
+    self.minimumZoomScale = 1.0;
+    assert(self.maximumZoomScale == 1.0f);
+    self.zoomedToMaximum  = NO;
+}
+
+// Adds zoomView (which must be either imageView or tiledImageView) as our content and 
+// sets the zoom scales so that it's initially shown in its entirety.
+- (void)addZoomView:(UIView *)zoomView
+{
+    CGSize      boundsSize;
+    CGSize      imageSize;
+    CGFloat     widthScale;
+    CGFloat     heightScale;
+
+    assert( (zoomView == self.imageView) || (zoomView == self.tiledImageView) );
+
+    boundsSize = self.bounds.size;
+    imageSize  = zoomView.bounds.size;
+
+    [self addSubview:zoomView];
+
+    // Calculate the width and height zoom scales, and then use the 
+    // lesser one at minimum zoom scale.
+    
+    widthScale  = boundsSize.width  / imageSize.width;
+    heightScale = boundsSize.height / imageSize.height;
+    
+    self.contentSize = imageSize;
+    if (widthScale < heightScale) {
+        self.minimumZoomScale = widthScale;
+    } else {
+        self.minimumZoomScale = heightScale;
+    }
+    assert(self.maximumZoomScale == 1.0f);
+
+    // And set the current zoom scale to be the minimum (that is, we can see 
+    // the entire image).
+
+    self.zoomScale = self.minimumZoomScale;
+}
+
+- (void)setImage:(UIImage *)newValue
+{
+    if (newValue != self->_image) {
+
+        // If we had a previous image view (or tiled image view), clean it up.
         
-        // Reset our zooming back to the default before doing further calculations.
-        
-        self.zoomScale        = 1.0;
-        self.minimumZoomScale = 1.0;
-        assert(self.maximumZoomScale == 1.0f);
+        [self removeZoomView];
+        [self->_tileDirectoryPath release];
+        self->_tileDirectoryPath = nil;
         
         // Complete the setter.
         
@@ -162,11 +258,6 @@ static BOOL LimitImageSize(void)
         // If there is a new image, make an image view for it.
         
         if (newValue != nil) {
-            CGSize      boundsSize;
-            CGSize      imageSize;
-            CGFloat     widthScale;
-            CGFloat     heightScale;
-
             // If we're on old school hardware and the image is bigger than 1000 pixels in either 
             // dimension, resize it.  This has a number of benefits:
             //
@@ -206,32 +297,49 @@ static BOOL LimitImageSize(void)
                 }
             }
             
-            boundsSize = self.bounds.size;
-            imageSize  = [newValue size];
-            
             // Set up the image view.
             
-            self.imageView = [[[UIImageView alloc] initWithImage:newValue] autorelease];
-            [self addSubview:self.imageView];
-            
-            // Calculate the width and height zoom scales, and then use the 
-            // lesser one at minimum zoom scale.
+            [[QLog log] logWithFormat:@"%s image scroll untiled %.0f x %.0f, %zu bytes decoded", 
+                __PRETTY_FUNCTION__, 
+                newValue.size.width * newValue.scale, 
+                newValue.size.height * newValue.scale, 
+                (size_t) (newValue.size.width * newValue.scale * newValue.size.height * newValue.scale * 4)
+            ];
             
-            widthScale  = boundsSize.width  / imageSize.width;
-            heightScale = boundsSize.height / imageSize.height;
+            self.imageView = [[[UIImageView alloc] initWithImage:newValue] autorelease];
+            assert(self.imageView != nil);
             
-            self.contentSize = imageSize;
-            if (widthScale < heightScale) {
-                self.minimumZoomScale = widthScale;
-            } else {
-                self.minimumZoomScale = heightScale;
-            }
-            assert(self.maximumZoomScale == 1.0f);
+            [self addZoomView:self.imageView];
+        }
+    }
+}
 
-            // And set the current zoom scale to be the minimum (that is, we can see 
-            // the entire image).
+- (void)setTileDirectoryPath:(NSString *)newValue
+{
+    if ( (newValue != self->_tileDirectoryPath) && ! [newValue isEqual:self->_tileDirectoryPath] ) {
+    
+        // If we had a previous image view (or tiled image view), clean it up.
+    
+        [self removeZoomView];
+        [self->_image release];
+        self->_image = nil;
 
-            self.zoomScale = self.minimumZoomScale;
+        // Complete the setter.
+        
+        [self->_tileDirectoryPath release];
+        self->_tileDirectoryPath = [newValue copy];
+        
+        // If there's a new tile directory, make a tiled image view for it.  If the tiles 
+        // are bad we end up showing nothing, which is consistent with what happens when 
+        // the photo file itself is bad.
+        
+        if (newValue != nil) {
+            self.tiledImageView = [[[QTiledImageView alloc] initWithTileDirectoryPath:newValue] autorelease];
+            if (self.tiledImageView == nil) {
+                [[QLog log] logWithFormat:@"%s image scroll tiles bad '%@'", __PRETTY_FUNCTION__, newValue];
+            } else {
+                [self addZoomView:self.tiledImageView];
+            }
         }
     }
 }
@@ -0,0 +1,45 @@
+#import <UIKit/UIKit.h>
+
+/*
+    QTiledImageView draws a photo from the tile pyramid built by PhotoTileOperation.  It's
+    backed by a CATiledLayer, so only the tiles that are actually on screen get loaded and
+    drawn, and they're drawn from the pyramid level that best matches the current zoom
+    scale.  This keeps the memory used by a large photo roughly proportional to the size
+    of the screen, rather than to the size of the photo.
+
+    The view's bounds are the full size of the photo, so it can be dropped into a scroll
+    view in place of a UIImageView showing the whole photo.
+
+    Recently drawn tiles are kept in a small cache, which helps when the user scrolls back
+    and forth.  The cache is shared by the CATiledLayer drawing threads, and is protected
+    by @synchronized.
+*/
+
+@interface QTiledImageView : UIView
+{
+    NSString *              _tileDirectoryPath;
+    CGSize                  _imageSize;
+    NSUInteger              _levelCount;
+    NSMutableDictionary *   _tileCache;
+    NSMutableArray *        _tileCacheOrder;
+    NSUInteger              _tileCacheBytes;
+    NSUInteger              _peakTileCacheBytes;
+    NSUInteger              _tileDrawCount;
+    NSTimeInterval          _tileDrawTime;
+}
+
+// Returns a view for the tile pyramid in tileDirectoryPath, or nil if the pyramid's
+// info file can't be read.
+- (id)initWithTileDirectoryPath:(NSString *)tileDirectoryPath;
+
+@property (nonatomic, copy,   readonly ) NSString *         tileDirectoryPath;
+@property (nonatomic, assign, readonly ) CGSize             imageSize;              // full size of the photo, in pixels
+@property (nonatomic, assign, readonly ) NSUInteger         levelCount;
+
+// statistics, which may be read from any thread
+
+@property (           assign, readonly ) NSUInteger         tileDrawCount;
+@property (           assign, readonly ) NSTimeInterval     tileDrawTime;           // total time spent in -drawRect:
+@property (           assign, readonly ) NSUInteger         peakTileCacheBytes;     // decoded bytes
+
+@end
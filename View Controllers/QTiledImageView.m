@@ -0,0 +1,243 @@
+#import "QTiledImageView.h"
+#import "PhotoTileOperation.h"
+#import "MemoryBudget.h"
+#import <QuartzCore/QuartzCore.h>
+#include <math.h>
+
+@implementation QTiledImageView
+
+// The maximum number of decoded tiles we hold on to.  Each tile is at most 256 KB
+// decoded, so this caps the cache at about 6 MB, which is a couple of screens' worth.
+
+static const NSUInteger kTileCacheCount = 24;
+
++ (Class)layerClass
+{
+    return [CATiledLayer class];
+}
+
+- (id)initWithTileDirectoryPath:(NSString *)tileDirectoryPath
+{
+    NSDictionary *  info;
+    CGSize          imageSize;
+    NSUInteger      levelCount;
+
+    assert(tileDirectoryPath != nil);
+
+    info = [NSDictionary dictionaryWithContentsOfFile:[tileDirectoryPath stringByAppendingPathComponent:kPhotoTileInfoFileName]];
+    imageSize  = CGSizeMake([[info objectForKey:kPhotoTileInfoKeyWidth] floatValue], [[info objectForKey:kPhotoTileInfoKeyHeight] floatValue]);
+    levelCount = [[info objectForKey:kPhotoTileInfoKeyLevelCount] unsignedIntegerValue];
+    if ( (info == nil) || (imageSize.width < 1.0f) || (imageSize.height < 1.0f) || (levelCount == 0) || ([[info objectForKey:kPhotoTileInfoKeyTileSize] unsignedIntegerValue] != kPhotoTileSize) ) {
+        [self release];
+        return nil;
+    }
+
+    self = [super initWithFrame:CGRectMake(0.0f, 0.0f, imageSize.width, imageSize.height)];
+    if (self != nil) {
+        CATiledLayer *  layer;
+
+        self->_tileDirectoryPath = [tileDirectoryPath copy];
+        self->_imageSize         = imageSize;
+        self->_levelCount        = levelCount;
+        self->_tileCache         = [[NSMutableDictionary alloc] init];
+        assert(self->_tileCache != nil);
+        self->_tileCacheOrder    = [[NSMutableArray alloc] init];
+        assert(self->_tileCacheOrder != nil);
+
+        // Level n of the pyramid is drawn when the zoom scale is between 1/2^n and 1/2^(n-1),
+        // so we need one level of detail per pyramid level.  We never zoom in past 1.0 (see
+        // QImageScrollView), so there's no need for a bias.
+
+        layer = (CATiledLayer *) self.layer;
+        assert([layer isKindOfClass:[CATiledLayer class]]);
+        layer.tileSize       = CGSizeMake(kPhotoTileSize, kPhotoTileSize);
+        layer.levelsOfDetail = levelCount;
+
+        self.opaque = YES;
+        self.backgroundColor = [UIColor whiteColor];
+
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(evictTileCache:) name:kMemoryBudgetEvictCachesNotification object:nil];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [[NSNotificationCenter defaultCenter] removeObserver:self name:kMemoryBudgetEvictCachesNotification object:nil];
+    [[MemoryBudget sharedBudget] adjustBytes:-(long long) self->_tileCacheBytes forSubsystem:kMemoryBudgetSubsystemTileCaches];
+    [self->_tileDirectoryPath release];
+    [self->_tileCache release];
+    [self->_tileCacheOrder release];
+    [super dealloc];
+}
+
+@synthesize tileDirectoryPath = _tileDirectoryPath;
+@synthesize imageSize         = _imageSize;
+@synthesize levelCount        = _levelCount;
+
+- (NSUInteger)tileDrawCount
+{
+    NSUInteger  result;
+    @synchronized (self->_tileCache) {
+        result = self->_tileDrawCount;
+    }
+    return result;
+}
+
+- (NSTimeInterval)tileDrawTime
+{
+    NSTimeInterval  result;
+    @synchronized (self->_tileCache) {
+        result = self->_tileDrawTime;
+    }
+    return result;
+}
+
+- (NSUInteger)peakTileCacheBytes
+{
+    NSUInteger  result;
+    @synchronized (self->_tileCache) {
+        result = self->_peakTileCacheBytes;
+    }
+    return result;
+}
+
+// Returns the tile at the specified path, from the cache if possible.  Tiles are decoded
+// before they go into the cache, so a cache hit costs nothing but the draw.
+- (UIImage *)tileAtPath:(NSString *)path
+{
+    UIImage *   result;
+
+    @synchronized (self->_tileCache) {
+        result = [[[self->_tileCache objectForKey:path] retain] autorelease];
+        if (result != nil) {
+            [self->_tileCacheOrder removeObject:path];
+            [self->_tileCacheOrder addObject:path];
+        }
+    }
+    if (result == nil) {
+        UIImage *   tile;
+
+        // Decode outside of the lock, so that the other drawing threads aren't held up.
+        // Two threads might decode the same tile at the same time; that's harmless.
+
+        tile = [UIImage imageWithContentsOfFile:path];
+        if (tile != nil) {
+            UIGraphicsBeginImageContext(tile.size);
+            [tile drawAtPoint:CGPointZero];
+            result = UIGraphicsGetImageFromCurrentImageContext();
+            UIGraphicsEndImageContext();
+        }
+        if (result != nil) {
+            NSUInteger  oldBytes;
+            NSUInteger  newBytes;
+
+            @synchronized (self->_tileCache) {
+                oldBytes = self->_tileCacheBytes;
+                if ([self->_tileCache objectForKey:path] == nil) {
+                    [self->_tileCache setObject:result forKey:path];
+                    [self->_tileCacheOrder addObject:path];
+                    self->_tileCacheBytes += (NSUInteger) (result.size.width * result.size.height * 4);
+                    while ([self->_tileCacheOrder count] > kTileCacheCount) {
+                        NSString *  oldestPath;
+                        UIImage *   oldestTile;
+
+                        oldestPath = [self->_tileCacheOrder objectAtIndex:0];
+                        oldestTile = [self->_tileCache objectForKey:oldestPath];
+                        self->_tileCacheBytes -= (NSUInteger) (oldestTile.size.width * oldestTile.size.height * 4);
+                        [self->_tileCache removeObjectForKey:oldestPath];
+                        [self->_tileCacheOrder removeObjectAtIndex:0];
+                    }
+                    if (self->_tileCacheBytes > self->_peakTileCacheBytes) {
+                        self->_peakTileCacheBytes = self->_tileCacheBytes;
+                    }
+                }
+                newBytes = self->_tileCacheBytes;
+            }
+            [[MemoryBudget sharedBudget] adjustBytes:(long long) newBytes - (long long) oldBytes forSubsystem:kMemoryBudgetSubsystemTileCaches];
+        }
+    }
+    return result;
+}
+
+// Called on the main thread when the memory budget wants caches evicted.  The tiles 
+// that are on screen live on in the layer's backing store, so this costs nothing 
+// until the user scrolls.
+- (void)evictTileCache:(NSNotification *)note
+{
+    NSUInteger  oldBytes;
+    
+    #pragma unused(note)
+    assert([NSThread isMainThread]);
+
+    @synchronized (self->_tileCache) {
+        oldBytes = self->_tileCacheBytes;
+        [self->_tileCache removeAllObjects];
+        [self->_tileCacheOrder removeAllObjects];
+        self->_tileCacheBytes = 0;
+    }
+    [[MemoryBudget sharedBudget] adjustBytes:-(long long) oldBytes forSubsystem:kMemoryBudgetSubsystemTileCaches];
+}
+
+- (void)drawRect:(CGRect)rect
+    // Called by CATiledLayer on a background thread.
+{
+    NSDate *        startDate;
+    CGFloat         scale;
+    NSUInteger      level;
+    CGFloat         levelScale;
+    CGFloat         tileExtent;
+    NSUInteger      firstColumn;
+    NSUInteger      lastColumn;
+    NSUInteger      firstRow;
+    NSUInteger      lastRow;
+    NSUInteger      column;
+    NSUInteger      row;
+
+    startDate = [NSDate date];
+
+    // Work out which pyramid level matches the scale we're being drawn at.  Level n is
+    // 1/2^n the size of the photo, so we want the smallest level that's still at least
+    // as big as what's on screen.
+
+    scale = CGContextGetCTM(UIGraphicsGetCurrentContext()).a;
+    level = 0;
+    while ( (level + 1 < self.levelCount) && (scale <= (CGFloat) 1.0f / (CGFloat) (1 << (level + 1))) ) {
+        level += 1;
+    }
+    levelScale = (CGFloat) (1 << level);
+
+    // Each tile at that level covers tileExtent x tileExtent of our bounds.
+
+    tileExtent = kPhotoTileSize * levelScale;
+
+    // Halving the levels rounds up, so the tiles along the right and bottom edges can
+    // overhang our bounds by a pixel or so; clip them.
+
+    UIRectClip(self.bounds);
+    rect = CGRectIntersection(rect, self.bounds);
+    firstColumn = (NSUInteger) floorf(CGRectGetMinX(rect) / tileExtent);
+    lastColumn  = (NSUInteger) floorf((CGRectGetMaxX(rect) - 1.0f) / tileExtent);
+    firstRow    = (NSUInteger) floorf(CGRectGetMinY(rect) / tileExtent);
+    lastRow     = (NSUInteger) floorf((CGRectGetMaxY(rect) - 1.0f) / tileExtent);
+
+    for (row = firstRow; row <= lastRow; row++) {
+        for (column = firstColumn; column <= lastColumn; column++) {
+            UIImage *   tile;
+            CGRect      tileRect;
+
+            tile = [self tileAtPath:[PhotoTileOperation pathForTileAtLevel:level column:column row:row inDirectory:self.tileDirectoryPath]];
+            if (tile != nil) {
+                tileRect = CGRectMake(column * tileExtent, row * tileExtent, tile.size.width * levelScale, tile.size.height * levelScale);
+                [tile drawInRect:tileRect];
+            }
+        }
+    }
+
+    @synchronized (self->_tileCache) {
+        self->_tileDrawCount += 1;
+        self->_tileDrawTime  += -[startDate timeIntervalSinceNow];
+    }
+}
+
+@end
@@ -48,8 +48,10 @@
         if (self->_choices == nil) {
             #if TARGET_IPHONE_SIMULATOR
                 #define HOSTNAME "localhost"
+                #define DELTA_HOSTNAME "localhost:8080"
             #else
                 #define HOSTNAME "Leo-MacBook-Pro.local:8888"
+                #define DELTA_HOSTNAME "Leo-MacBook-Pro.local:8080"
             #endif
             self->_choices = [[NSMutableArray alloc] initWithObjects:
                 @"http://" HOSTNAME "/TestGallery/index.xml", 
@@ -67,6 +69,9 @@
                 @"http://" HOSTNAME "/TestGallery/broken-xml.xml", 
                 @"http://" HOSTNAME "/TestGallery/broken-attributes.xml", 
                 @"http://" HOSTNAME "/TestGallery/broken-images.xml", 
+                @"http://" DELTA_HOSTNAME "/TestGallery/delta.xml",     // served by TestGallery/delta-server.py
+                @"http://" DELTA_HOSTNAME "/TestGallery/batch.xml",     // served by TestGallery/batch-server.py
+                @"http://" DELTA_HOSTNAME "/TestGallery/range.xml",     // served by TestGallery/range-server.py
                 nil
             ];
         }